@@ -0,0 +1,158 @@
+#include "allocation_tracker.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+
+namespace util
+{
+	namespace
+	{
+		thread_local const char* t_tag = nullptr;
+		thread_local int t_owner = -1;
+
+		double toMegabytes(size_t bytes)
+		{
+			return bytes / (1024.0 * 1024.0);
+		}
+	}
+
+	AllocationTracker& AllocationTracker::get()
+	{
+		static AllocationTracker tracker;
+		return tracker;
+	}
+
+	void AllocationTracker::recordAllocation(const char* tag, const size_t bytes, const bool frame_temporary, const int owner)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto& stats = m_tags[tag];
+		stats.num_allocations++;
+		stats.bytes_in_use += bytes;
+		stats.peak_bytes_in_use = std::max(stats.peak_bytes_in_use, stats.bytes_in_use);
+		if (owner >= 0)
+		{
+			auto& owner_stats = m_owners[owner];
+			owner_stats.num_allocations++;
+			owner_stats.bytes_in_use += bytes;
+			owner_stats.peak_bytes_in_use = std::max(owner_stats.peak_bytes_in_use, owner_stats.bytes_in_use);
+		}
+		m_bytes_in_use += bytes;
+		m_peak_bytes_in_use = std::max(m_peak_bytes_in_use, m_bytes_in_use);
+
+		if (frame_temporary)
+		{
+			return;
+		}
+		m_frame_allocations++;
+		if (m_steady_state_frame >= 0 && m_frame > m_steady_state_frame)
+		{
+			m_steady_state_allocations++;
+			std::cout << "Warning: Allocation of " << bytes << " bytes (" << tag << ") in frame " << m_frame
+				<< " of the steady state!" << std::endl;
+		}
+	}
+
+	void AllocationTracker::recordDeallocation(const char* tag, const size_t bytes, const int owner)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto& stats = m_tags[tag];
+		stats.bytes_in_use -= std::min(bytes, stats.bytes_in_use);
+		if (owner >= 0)
+		{
+			auto& owner_stats = m_owners[owner];
+			owner_stats.bytes_in_use -= std::min(bytes, owner_stats.bytes_in_use);
+		}
+		m_bytes_in_use -= std::min(bytes, m_bytes_in_use);
+	}
+
+	void AllocationTracker::beginFrame()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_frame++;
+		m_last_frame_allocations = m_frame_allocations;
+		m_frame_allocations = 0;
+	}
+
+	std::map<std::string, TagStats> AllocationTracker::getTagStats() const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_tags;
+	}
+
+	TagStats AllocationTracker::getOwnerStats(const int owner) const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		const auto it = m_owners.find(owner);
+		return it != m_owners.end() ? it->second : TagStats();
+	}
+
+	size_t AllocationTracker::getBytesInUse() const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_bytes_in_use;
+	}
+
+	size_t AllocationTracker::getPeakBytesInUse() const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_peak_bytes_in_use;
+	}
+
+	void AllocationTracker::print(std::ostream& stream) const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		const auto precision = stream.precision();
+		stream << std::fixed << std::setprecision(1);
+		stream << "Device arrays: " << toMegabytes(m_bytes_in_use) << " MB in use, " << toMegabytes(m_peak_bytes_in_use) << " MB peak, "
+			<< m_last_frame_allocations << " allocations in the last frame";
+		if (m_steady_state_frame >= 0)
+		{
+			stream << ", " << m_steady_state_allocations << " in the steady state";
+		}
+		stream << std::endl;
+		for (const auto& tag : m_tags)
+		{
+			stream << "  " << std::left << std::setw(12) << tag.first << std::right << std::setw(10) << toMegabytes(tag.second.bytes_in_use) << " MB, peak "
+				<< toMegabytes(tag.second.peak_bytes_in_use) << " MB, " << tag.second.num_allocations << " allocations" << std::endl;
+		}
+		for (const auto& owner : m_owners)
+		{
+			stream << "  owner " << std::left << std::setw(6) << owner.first << std::right << std::setw(10) << toMegabytes(owner.second.bytes_in_use)
+				<< " MB, peak " << toMegabytes(owner.second.peak_bytes_in_use) << " MB, " << owner.second.num_allocations << " allocations" << std::endl;
+		}
+		stream << std::defaultfloat << std::setprecision(precision);
+	}
+
+	ScopedAllocationTag::ScopedAllocationTag(const char* tag)
+		: m_previous(t_tag)
+	{
+		t_tag = tag;
+	}
+
+	ScopedAllocationTag::~ScopedAllocationTag()
+	{
+		t_tag = m_previous;
+	}
+
+	const char* getAllocationTag()
+	{
+		return t_tag ? t_tag : "other";
+	}
+
+	ScopedAllocationOwner::ScopedAllocationOwner(const int owner)
+		: m_previous(t_owner)
+	{
+		t_owner = owner;
+	}
+
+	ScopedAllocationOwner::~ScopedAllocationOwner()
+	{
+		t_owner = m_previous;
+	}
+
+	int getAllocationOwner()
+	{
+		return t_owner;
+	}
+}
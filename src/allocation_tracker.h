@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+
+namespace util
+{
+	struct TagStats
+	{
+		size_t num_allocations = 0;
+		size_t bytes_in_use = 0;
+		size_t peak_bytes_in_use = 0;
+	};
+
+	//Bytes of the DeviceArrays per tag, e.g. "basis", "jacobian", "residuals" or "frame". An array takes the tag of the innermost
+	//ScopedAllocationTag of its thread when it allocates, "other" outside of one. Frames are counted by beginFrame, arrays of
+	//the frame arena are per frame temporaries and don't count as frame allocations.
+	//Arrays are also counted per owner, the ScopedAllocationOwner of the thread when they allocate (e.g. a TrackingSession),
+	//and freed from that owner wherever they are destroyed.
+	class AllocationTracker
+	{
+	public:
+		static AllocationTracker& get();
+
+		void recordAllocation(const char* tag, size_t bytes, bool frame_temporary, int owner = -1);
+		void recordDeallocation(const char* tag, size_t bytes, int owner = -1);
+
+		//Called once per frame, next to FrameArenaAllocator::beginFrame.
+		void beginFrame();
+		//Allocations of the last complete frame, without the frame arena.
+		size_t getFrameAllocations() const { return m_last_frame_allocations; }
+		//Debug mode: from "warmup_frames" frames on, the frame loop is expected to allocate nothing. Every allocation after that
+		//prints a warning with its tag and size. < 0 switches it off.
+		void setSteadyStateFrame(int warmup_frames) { m_steady_state_frame = warmup_frames; }
+		size_t getSteadyStateAllocations() const { return m_steady_state_allocations; }
+
+		std::map<std::string, TagStats> getTagStats() const;
+		//Zero for an owner which never allocated.
+		TagStats getOwnerStats(int owner) const;
+		size_t getBytesInUse() const;
+		size_t getPeakBytesInUse() const;
+		//Current and peak bytes per tag, the frame allocations and the ones of the steady state.
+		void print(std::ostream& stream) const;
+
+	private:
+		mutable std::mutex m_mutex;
+		std::map<std::string, TagStats> m_tags;
+		std::map<int, TagStats> m_owners; //without the arrays of no owner
+		size_t m_bytes_in_use{ 0 };
+		size_t m_peak_bytes_in_use{ 0 };
+		int m_frame{ 0 };
+		size_t m_frame_allocations{ 0 };
+		size_t m_last_frame_allocations{ 0 };
+		int m_steady_state_frame{ -1 };
+		size_t m_steady_state_allocations{ 0 };
+
+	private:
+		AllocationTracker() = default;
+		AllocationTracker(const AllocationTracker&) = delete;
+		AllocationTracker(AllocationTracker&&) = delete;
+	};
+
+	//Tag of the arrays allocated by this thread during its lifetime, nested ones win.
+	class ScopedAllocationTag
+	{
+	public:
+		explicit ScopedAllocationTag(const char* tag);
+		~ScopedAllocationTag();
+
+	private:
+		const char* m_previous;
+	};
+
+	//Of the innermost ScopedAllocationTag of this thread, "other" without one.
+	const char* getAllocationTag();
+
+	//Owner (>= 0) of the arrays allocated by this thread during its lifetime, nested ones win. Independent of the tag.
+	class ScopedAllocationOwner
+	{
+	public:
+		explicit ScopedAllocationOwner(int owner);
+		~ScopedAllocationOwner();
+
+	private:
+		int m_previous;
+	};
+
+	//Of the innermost ScopedAllocationOwner of this thread, -1 without one.
+	int getAllocationOwner();
+}
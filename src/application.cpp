@@ -1,48 +1,446 @@
 #include "application.h"
 #include "prior_sparse_features.h"
+#include "profiler.h"
+#include "spsc_queue.h"
+#include "tracking_session.h"
+#include "thread_placement.h"
 
 #include <imgui.h>
 #include <glm/gtx/euler_angles.hpp>
 #include <glm/ext/matrix_clip_space.hpp>
 #include <glm/ext/matrix_transform.hpp>
+#include <algorithm>
 #include <utility>
 #include "opencv2/imgproc/imgproc.hpp"
 #include "opencv2/highgui/highgui.hpp"
 #include <chrono>
+#include <atomic>
+#include <thread>
 
 constexpr int kNumOfPyramidLevels = 3;
 
 static std::string kMorphableModelPath("../MorphableModel/");
 
-Application::Application()
-//: m_camera(cv::VideoCapture(0))
-	: m_camera(cv::VideoCapture("./demo2.mp4"))
-	, m_screen_width(m_camera.get(3))
-	, m_screen_height(m_camera.get(4))
+//Offset and scale of the face targets in their textures, in texture coordinates, for the face_window of the composite shaders.
+static std::vector<GLfloat> getFaceWindow(const Face::GraphicsSettings& settings)
+{
+	const float width = static_cast<float>(settings.atlas_width);
+	const float height = static_cast<float>(settings.atlas_height);
+	return { settings.target_x / width, settings.target_y / height, settings.texture_width / width, settings.texture_height / height };
+}
+
+Application::Application(const ApplicationSettings& settings)
+	: m_settings(settings)
+//, m_camera(cv::VideoCapture(0))
+	, m_camera(settings.ipc_input.empty() ? cv::VideoCapture(settings.input_path) : cv::VideoCapture())
+	, m_ipc_source(settings.ipc_input.empty() ? nullptr : std::make_unique<util::IpcVideoSource>(settings.ipc_input))
+	, m_screen_width(m_ipc_source ? m_ipc_source->getWidth() : static_cast<int>(m_camera.get(3)))
+	, m_screen_height(m_ipc_source ? m_ipc_source->getHeight() : static_cast<int>(m_camera.get(4)))
 	, m_gui_position(0, 0)
 	, m_gui_size(300, m_screen_height)
 	, m_projection(glm::perspectiveRH_NO(glm::radians(60.0f), static_cast<float>(m_screen_width) / m_screen_height, 0.01f, 10.0f))
-	, m_window(m_gui_size.x, m_screen_width, m_screen_height)
-	, m_face(kMorphableModelPath)
-	, m_solver()
+	, m_window(m_gui_size.x, m_screen_width, m_screen_height, !settings.headless)
+	, m_context(std::make_shared<util::ExecutionContext>())
+	, m_face(kMorphableModelPath, settings.basis_limits)
+	, m_solver(SolverParameters(), m_context)
 	, m_tracker()
 	, m_menu(m_gui_position, m_gui_size)
-	, m_pyramid(kNumOfPyramidLevels, m_screen_width, m_screen_height)
+	, m_pyramid(kNumOfPyramidLevels, m_screen_width, m_screen_height, settings.packed_visibility, settings.roi_size, settings.render_target_atlas)
 	, m_video_width(m_screen_width)
 	, m_video_height(m_screen_height / 2)
-	, m_video_writer("../../video.avi", cv::VideoWriter::fourcc('M', 'J', 'P', 'G'), 24, cv::Size(m_video_width, m_video_height))
-{}
+{
+	if (!m_ipc_source && !m_camera.isOpened())
+	{
+		throw std::runtime_error("Error: Could not open the input " + settings.input_path);
+	}
+
+	if (!settings.output_video_path.empty())
+	{
+		//Offline output keeps every frame, the live runs drop frames rather than wait for the encoder.
+		m_video_writer = util::createVideoWriter(settings.output_video_path, settings.video_codec, 24, m_video_width, m_video_height, settings.headless);
+	}
+
+	if (!settings.headless)
+	{
+		m_window.setSwapInterval(settings.swap_interval);
+	}
+
+	util::AllocationTracker::get().setSteadyStateFrame(settings.allocation_check_frame);
+	if (!settings.trace_path.empty())
+	{
+		util::Profiler::get().startTrace(settings.trace_path, settings.trace_first_frame, settings.trace_num_frames);
+	}
+
+	//Frames are copied on the upload stream, everything else goes to the compute stream of the solver.
+	m_face.setExecutionContext(m_context);
+	m_pyramid.setExecutionContext(m_context);
+
+	m_tracker.getParameters().max_faces = std::max(settings.max_faces, 1);
+	for (int i = 1; i < settings.max_faces; ++i)
+	{
+		m_extra_faces.push_back(std::make_unique<Face>(m_face.getModel()));
+		m_extra_faces.back()->setExecutionContext(m_context);
+		m_extra_projections.push_back(m_projection);
+	}
+
+	if (!settings.parameter_stream_path.empty() && settings.server_inputs.empty() && settings.batch.inputs.empty())
+	{
+		m_parameter_writer = std::make_unique<ParameterStreamWriter>(settings.parameter_stream_path, m_face, settings.parameter_encoding);
+	}
+
+	if (!settings.shared_memory_name.empty() && settings.server_inputs.empty() && settings.batch.inputs.empty())
+	{
+		m_shared_memory_sink = std::make_unique<SharedMemorySink>(settings.shared_memory_name, m_face, settings.shared_memory_mesh);
+	}
+
+	if (!settings.mesh_stream_path.empty() && settings.server_inputs.empty() && settings.batch.inputs.empty())
+	{
+		m_mesh_stream_file.open(settings.mesh_stream_path, std::ios::binary);
+		if (!m_mesh_stream_file)
+		{
+			throw std::runtime_error("Error: Could not open the mesh stream " + settings.mesh_stream_path);
+		}
+		m_mesh_stream_encoder = std::make_unique<MeshStreamEncoder>(settings.mesh_stream_mode);
+	}
+
+	if (!settings.input_recording_path.empty() && settings.server_inputs.empty() && settings.batch.inputs.empty())
+	{
+		m_input_recorder = std::make_unique<InputRecorder>(settings.input_recording_path,
+			settings.input_recording_png ? InputRecordingCodec::Png : InputRecordingCodec::Raw);
+	}
+
+	if (!settings.landmark_cache_path.empty())
+	{
+		m_landmark_cache = std::make_unique<LandmarkCacheReader>(settings.landmark_cache_path);
+	}
+
+	if (!settings.convergence_log_path.empty())
+	{
+		m_solver.openConvergenceLog(settings.convergence_log_path);
+	}
+}
+
+void Application::writeParameters(bool tracked)
+{
+	if (m_parameter_writer)
+	{
+		util::ScopedTimer timer("Parameter stream");
+		m_parameter_writer->write(m_face, m_projection, tracked);
+	}
+	if (m_shared_memory_sink)
+	{
+		util::ScopedTimer timer("Shared memory sink");
+		m_shared_memory_sink->write(m_face, m_projection, tracked);
+	}
+	if (m_mesh_stream_encoder)
+	{
+		util::ScopedTimer timer("Mesh stream");
+		for (const auto& packet : m_mesh_stream_encoder->encode(m_face, tracked))
+		{
+			m_mesh_stream_file.write(reinterpret_cast<const char*>(packet.data()), packet.size());
+		}
+		m_mesh_stream_file.flush(); //viewers read it as it is written
+	}
+	if (tracked && !m_settings.snapshot_path.empty() && ++m_num_tracked_frames % std::max(m_settings.snapshot_interval, 1) == 0)
+	{
+		util::ScopedTimer timer("Tracking snapshot");
+		writeSnapshot();
+	}
+}
+
+void Application::recordInput(const cv::Mat& raw_frame, const std::vector<std::vector<glm::vec2>>& sparse_features)
+{
+	if (m_input_recorder)
+	{
+		util::ScopedTimer timer("Input recording copy");
+		m_input_recorder->capture(raw_frame, sparse_features, m_solver.getSolverParameters());
+	}
+}
+
+void Application::writeSnapshot()
+{
+	//Nothing was tracked yet, the last snapshot is better than the mean face.
+	if (m_settings.snapshot_path.empty() || m_num_tracked_frames == 0)
+	{
+		return;
+	}
+
+	std::vector<const Face*> faces{ &m_face };
+	std::vector<const glm::mat4*> projections{ &m_projection };
+	for (size_t i = 0; i < m_extra_faces.size(); ++i)
+	{
+		faces.push_back(m_extra_faces[i].get());
+		projections.push_back(&m_extra_projections[i]);
+	}
+	writeTrackingSnapshot(m_settings.snapshot_path, faces, projections, m_solver, m_num_tracked_frames);
+}
+
+void Application::loadIdentityProfile()
+{
+	if (m_settings.identity_store_directory.empty() || m_settings.subject_id.empty())
+	{
+		return;
+	}
+	m_identity_store = std::make_unique<IdentityProfileStore>(m_settings.identity_store_directory);
+	m_identity_from_profile = m_identity_store->load(m_settings.subject_id, m_face);
+	std::cout << (m_identity_from_profile ? "Loaded the identity of " : "New subject ") << m_settings.subject_id << std::endl;
+}
+
+void Application::saveIdentityProfile()
+{
+	if (!m_identity_store || m_identity_from_profile || !m_face.isIdentityLocked())
+	{
+		return;
+	}
+	m_identity_store->save(m_settings.subject_id, m_face);
+	std::cout << "Saved the identity of " << m_settings.subject_id << std::endl;
+}
+
+void Application::restoreSnapshot()
+{
+	if (m_settings.restore_path.empty())
+	{
+		return;
+	}
+	if (!std::ifstream(m_settings.restore_path).good())
+	{
+		std::cout << "Warning: No tracking snapshot at " << m_settings.restore_path << ", starting from the mean face" << std::endl;
+		return;
+	}
+
+	std::vector<Face*> faces{ &m_face };
+	std::vector<glm::mat4*> projections{ &m_projection };
+	for (size_t i = 0; i < m_extra_faces.size(); ++i)
+	{
+		faces.push_back(m_extra_faces[i].get());
+		projections.push_back(&m_extra_projections[i]);
+	}
+	const auto header = readTrackingSnapshot(m_settings.restore_path, faces, projections, m_solver);
+	m_num_tracked_frames = header.frame;
+	std::cout << "Restored " << header.num_faces << " faces after " << header.frame << " tracked frames from " << m_settings.restore_path << std::endl;
+}
+
+void Application::openInput()
+{
+	if (m_ipc_source)
+	{
+		return;
+	}
+	if (m_settings.gpu_decode && util::NvdecVideoSource::isAvailable())
+	{
+		m_nvdec_source = std::make_unique<util::NvdecVideoSource>(m_settings.input_path);
+		return;
+	}
+	if (m_settings.gpu_decode)
+	{
+		std::cout << "Warning: NVDEC is not available, decoding on the CPU instead!" << std::endl;
+	}
+	m_frame_grabber = std::make_unique<util::FrameGrabber>(m_camera, m_settings.capture_policy);
+}
+
+bool Application::readFrame(cv::Mat& frame)
+{
+	if (m_ipc_source)
+	{
+		const uchar* device_frame = nullptr;
+		size_t pitch = 0;
+		int channels = 0;
+		const cudaStream_t stream = m_context->getComputeStream();
+		{
+			util::ScopedTimer timer("Capture");
+			if (!m_ipc_source->read(device_frame, pitch, channels, stream))
+			{
+				return false;
+			}
+		}
+		//The pyramid holds its own copy of every level, the producer may reuse the buffer once they are built.
+		m_pyramid.uploadFrame(device_frame, pitch, channels, stream);
+		m_ipc_source->release(stream);
+		{
+			util::ScopedTimer timer("Frame download");
+			m_pyramid.downloadFrame(1, frame, stream);
+			if (m_input_recorder)
+			{
+				m_pyramid.downloadFrame(0, m_recorded_frame, stream);
+			}
+		}
+		return true;
+	}
+
+	if (m_nvdec_source)
+	{
+		const uchar* device_frame = nullptr;
+		size_t pitch = 0;
+		int channels = 0;
+		{
+			util::ScopedTimer timer("Capture");
+			if (!m_nvdec_source->read(device_frame, pitch, channels))
+			{
+				return false;
+			}
+		}
+		m_pyramid.uploadFrame(device_frame, pitch, channels);
+		{
+			//Level 1 is the half resolution frame, like cv::pyrDown.
+			util::ScopedTimer timer("Frame download");
+			m_pyramid.downloadFrame(1, frame);
+			if (m_input_recorder)
+			{
+				m_pyramid.downloadFrame(0, m_recorded_frame);
+			}
+		}
+		return true;
+	}
+
+	cv::Mat raw_frame;
+	{
+		util::ScopedTimer timer("Capture");
+		if (!m_frame_grabber->read(raw_frame))
+		{
+			return false;
+		}
+	}
+	//The tracker gets level 1 of the pyramid, like with NVDEC, instead of a cv::pyrDown of the host frame.
+	m_pyramid.uploadFrame(raw_frame);
+	if (raw_frame.cols % 2 == 0 && raw_frame.rows % 2 == 0 && m_pyramid.getNumberOfLevels() > 1)
+	{
+		util::ScopedTimer timer("Frame download");
+		m_pyramid.downloadFrame(1, frame, m_context->getComputeStream());
+	}
+	else
+	{
+		util::ScopedTimer timer("Downscale");
+		m_frame_downscaler.downscale(raw_frame, frame);
+	}
+	if (m_input_recorder)
+	{
+		m_recorded_frame = raw_frame;
+	}
+	return true;
+}
+
+std::vector<std::vector<glm::vec2>> Application::getSparseFeatures(const cv::Mat& frame)
+{
+	if (!m_landmark_cache)
+	{
+		return m_tracker.getSparseFeaturesOfFaces(frame);
+	}
+
+	util::ScopedTimer timer("Landmark cache");
+	const auto& header = m_landmark_cache->getHeader();
+	if (header.frame_width != frame.cols || header.frame_height != frame.rows)
+	{
+		throw std::runtime_error("Error: The landmark cache " + m_settings.landmark_cache_path + " was written for another frame size!");
+	}
+
+	std::vector<std::vector<glm::vec2>> sparse_features;
+	if (!m_landmark_cache->read(sparse_features) && !m_landmark_cache_ended)
+	{
+		std::cout << "Warning: The landmark cache " << m_settings.landmark_cache_path << " ended, the remaining frames are untracked." << std::endl;
+		m_landmark_cache_ended = true;
+	}
+	sparse_features.resize(std::max(m_tracker.getParameters().max_faces, 1));
+	return sparse_features;
+}
+
+void Application::solveFaces(const std::vector<std::vector<glm::vec2>>& sparse_features)
+{
+	const auto start = std::chrono::high_resolution_clock::now();
+	if (m_extra_faces.empty())
+	{
+		m_solver.solve(sparse_features[0], m_face, m_projection, m_pyramid);
+		calibrateIdentity(sparse_features[0]);
+	}
+	else
+	{
+		std::vector<Face*> faces = { &m_face };
+		std::vector<glm::mat4*> projections = { &m_projection };
+		for (int i = 0; i < m_extra_faces.size(); ++i)
+		{
+			faces.push_back(m_extra_faces[i].get());
+			projections.push_back(&m_extra_projections[i]);
+		}
+		m_solver.solveBatch(sparse_features, faces, projections, m_pyramid);
+	}
+	const auto end = std::chrono::high_resolution_clock::now();
+	m_solve_time = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1000.0;
+}
+
+void Application::calibrateIdentity(const std::vector<glm::vec2>& sparse_features)
+{
+	const auto& params = m_solver.getSolverParameters();
+	if (!params.use_identity_locking || !params.use_joint_calibration || m_face.isIdentityLocked())
+	{
+		m_identity_calibrator.reset(); //a recalibration starts with new keyframes
+		return;
+	}
+	if (sparse_features.empty())
+	{
+		return;
+	}
+
+	if (!m_identity_calibrator)
+	{
+		m_identity_calibrator = std::make_unique<IdentityCalibrator>(params.num_calibration_keyframes);
+	}
+	m_identity_calibrator->addFrame(m_pyramid, sparse_features, m_face, m_solver.getStream());
+	if (m_identity_calibrator->getNumFrames() >= params.num_calibration_frames)
+	{
+		m_identity_calibrator->calibrate(m_solver, m_face, m_projection, m_pyramid);
+	}
+}
+
+void Application::renderFaces(const std::vector<std::vector<glm::vec2>>& sparse_features)
+{
+	//The level 0 targets hold m_face already, one parameter update behind.
+	const bool reuse_render = m_settings.reuse_solver_render && m_extra_faces.empty() && !sparse_features[0].empty()
+		&& m_solver.getStatistics().final_render_level == 0;
+	if (!reuse_render)
+	{
+		m_pyramid.setGraphicsSettings(0, m_face.getGraphicsSettings()); //Render highest resolution in the end.
+		m_face.computeFace();
+		m_face.updateVertexBuffer();
+		m_face.draw();
+	}
+
+	for (int i = 0; i < m_extra_faces.size(); ++i)
+	{
+		if (i + 1 < sparse_features.size() && !sparse_features[i + 1].empty())
+		{
+			auto& face = *m_extra_faces[i];
+			m_pyramid.setGraphicsSettings(0, face.getGraphicsSettings());
+			face.computeFace();
+			face.updateVertexBuffer();
+			face.draw(false);
+		}
+	}
+}
+
+//Writes the final identity into the header.
+void Application::closeParameterStream()
+{
+	if (m_parameter_writer)
+	{
+		m_parameter_writer->close(m_face);
+		m_parameter_writer.reset();
+	}
+}
 
 void Application::run()
 {
 	initGraphics();
 	initMenuWidgets();
 	reloadShaders();
+	openInput();
 
 	int number_of_frames = 24 * 15; //15 seconds
 	while (!glfwWindowShouldClose(m_window.getGLFWWindow())/* && number_of_frames-- > 0*/)
 	{
 		auto start_frame = std::chrono::high_resolution_clock::now();
+		util::getFrameArena().beginFrame();
+		util::AllocationTracker::get().beginFrame();
+		//Also ends the frames without a new camera frame, which continue early.
+		util::ScopedFrame profiler_frame;
 
 		glfwPollEvents();
 		if (glfwGetKey(m_window.getGLFWWindow(), GLFW_KEY_F5) == GLFW_PRESS)
@@ -53,49 +451,761 @@ void Application::run()
 
 		//printUniqueFaceVerticesSparse();
 
-		cv::Mat raw_frame;
-		if (!m_camera.read(raw_frame))
+		cv::Mat frame;
+		std::vector<std::vector<glm::vec2>> sparse_features;
 		{
-			continue;
+			util::ScopedTimer frame_timer("Frame");
+			if (!readFrame(frame))
+			{
+				continue;
+			}
+
+			sparse_features = getSparseFeatures(frame);
+			recordInput(m_recorded_frame, sparse_features);
+			{
+				util::ScopedTimer timer("Solve", true);
+				solveFaces(sparse_features);
+			}
+			writeParameters(!sparse_features[0].empty());
+
+			{
+				util::ScopedTimer timer("Render", true);
+				renderFaces(sparse_features);
+			}
+			{
+				util::ScopedTimer timer("Video readback");
+				saveVideoFrame(); // pass sparse_features[0], if you want to render them 
+				//saveVideoFrame(sparse_features[0]);
+			}
+			if (isDisplayDue())
+			{
+				util::ScopedTimer timer("Display");
+				draw();
+				m_menu.draw();
+				m_window.refresh();
+			}
+		}
+		profiler_frame.end();
+		if (m_input_recorder)
+		{
+			m_input_recorder->commit(util::Profiler::get().getFrameSamples());
 		}
+
+		auto end_frame = std::chrono::high_resolution_clock::now();
+		m_frame_time = std::chrono::duration_cast<std::chrono::microseconds>(end_frame - start_frame).count() / 1000.0;
+		m_budget.update(m_frame_time, m_solve_time, m_solver.getSolverParameters(), m_tracker.getParameters());
+	}
+
+	m_frame_grabber.reset();
+	m_nvdec_source.reset();
+	writeSnapshot();
+	saveIdentityProfile();
+	closeParameterStream();
+	m_input_recorder.reset();
+}
+
+void Application::runPipelined()
+{
+	initGraphics();
+	initMenuWidgets();
+	reloadShaders();
+
+	//The frames are decoded into pinned frames and downscaled into others, which the solve returns to their pools, so the
+	//steady state allocates no frames and the pyramid uploads them without the staging copy. Enough frames for the queues
+	//below, those of the grabber and the ones the stages work on.
+	constexpr int kPoolCapacity = 16;
+	const int width = m_pyramid.getWidth(0);
+	const int height = m_pyramid.getHeight(0);
+	util::HostFramePool raw_pool(width, height, CV_8UC3, kPoolCapacity);
+	util::HostFramePool frame_pool((width + 1) / 2, (height + 1) / 2, CV_8UC3, kPoolCapacity); //of FrameDownscaler
+	m_frame_grabber = std::make_unique<util::FrameGrabber>(m_camera, m_settings.capture_policy, 4, &raw_pool);
+
+	struct PipelineFrame
+	{
+		int index = 0; //counted by the capture thread
+		cv::Mat raw_frame;
 		cv::Mat frame;
-		cv::pyrDown(raw_frame, frame);
+		std::vector<std::vector<glm::vec2>> sparse_features;
+	};
 
-		auto sparse_features = m_tracker.getSparseFeatures(frame);
-		m_solver.solve(sparse_features, m_face, raw_frame, m_projection, m_pyramid);
+	//Small queues, so the displayed frame lags at most a few frames behind the capture.
+	constexpr size_t kQueueCapacity = 2;
+	util::SpscQueue<PipelineFrame> capture_queue(kQueueCapacity);
+	util::SpscQueue<PipelineFrame> solve_queue(kQueueCapacity);
+	//Solved frames go back to the capture thread, which fills them again, so the landmark buffers keep their capacity.
+	util::SpscQueue<PipelineFrame> recycle_queue(kPoolCapacity);
+	std::atomic<bool> stop{ false };
+	//Set by a stage once it pushed its last frame, so the next one drains its queue and finishes in turn.
+	std::atomic<bool> capture_done{ false };
+	std::atomic<bool> tracker_done{ false };
+
+	//With asynchronous landmarks the frames go from the capture straight to the solve. The tracker gets every
+	//async_landmark_interval-th of them, unless it is still busy, and its detections catch up with the solve through
+	//detection_queue. The landmark cache has an entry per frame, so it keeps the tracker in front of the solve.
+	const int landmark_interval = m_landmark_cache ? 0 : std::max(m_settings.async_landmark_interval, 0);
+	util::SpscQueue<PipelineFrame> detection_queue(kQueueCapacity);
+	std::vector<LatencyCompensator> compensators(std::max(m_tracker.getParameters().max_faces, 1));
+
+	std::thread capture_thread([&]()
+	{
+		util::ThreadPlacement::get().apply(util::ThreadStage::Capture);
+		int index = 0;
+		PipelineFrame detection_item;
+		while (!stop)
+		{
+			PipelineFrame item;
+			recycle_queue.tryPop(item);
+			{
+				util::ScopedTimer timer("Capture");
+				if (!m_frame_grabber->read(item.raw_frame))
+				{
+					break; //end of the input, the grabber doesn't return further frames
+				}
+			}
+			item.index = index++;
+			if (landmark_interval > 0)
+			{
+				//Only the tracker reads the downscaled frame.
+				if (item.index % landmark_interval == 0)
+				{
+					recycle_queue.tryPop(detection_item);
+					detection_item.index = item.index;
+					detection_item.frame = frame_pool.acquire(stop);
+					if (!detection_item.frame.empty())
+					{
+						util::ScopedTimer timer("Downscale");
+						m_frame_downscaler.downscale(item.raw_frame, detection_item.frame);
+						if (!capture_queue.tryPush(std::move(detection_item)))
+						{
+							frame_pool.release(detection_item.frame);
+						}
+						detection_item.frame = cv::Mat();
+					}
+				}
+				util::ScopedTimer timer("Solve queue push");
+				solve_queue.push(std::move(item), stop);
+				continue;
+			}
+			item.frame = frame_pool.acquire(stop);
+			if (item.frame.empty())
+			{
+				break;
+			}
+			{
+				util::ScopedTimer timer("Downscale");
+				m_frame_downscaler.downscale(item.raw_frame, item.frame);
+			}
+			{
+				util::ScopedTimer timer("Capture queue push");
+				capture_queue.push(std::move(item), stop);
+			}
+		}
+		capture_done = true;
+		capture_queue.wake();
+		solve_queue.wake();
+	});
 
-		m_pyramid.setGraphicsSettings(0, m_face.getGraphicsSettings()); //Render highest resolution in the end.
-		m_face.computeFace();
-		m_face.updateVertexBuffer();
-		m_face.draw();
+	std::thread tracker_thread([&]()
+	{
+		util::ThreadPlacement::get().apply(util::ThreadStage::Detection);
+		PipelineFrame item;
+		while (true)
+		{
+			{
+				util::ScopedTimer timer("Capture queue pop");
+				if (!capture_queue.pop(item, capture_done))
+				{
+					break;
+				}
+			}
+			//Copied into the buffers of the recycled frame, which keep their capacity.
+			const auto sparse_features = getSparseFeatures(item.frame);
+			item.sparse_features.resize(sparse_features.size());
+			for (size_t i = 0; i < sparse_features.size(); ++i)
+			{
+				item.sparse_features[i].assign(sparse_features[i].begin(), sparse_features[i].end());
+			}
+			{
+				util::ScopedTimer timer("Solve queue push");
+				(landmark_interval > 0 ? detection_queue : solve_queue).push(std::move(item), stop);
+			}
+		}
+		tracker_done = true;
+		solve_queue.wake();
+	});
+
+	//Returns the frames of "item" to their pools and the item to the capture thread. Its raw frame may still be copied to the device.
+	auto recycle = [&](PipelineFrame& item)
+	{
+		if (raw_pool.owns(item.raw_frame))
+		{
+			m_pyramid.waitForFrameCopy();
+			raw_pool.release(item.raw_frame);
+		}
+		frame_pool.release(item.frame);
+		item.raw_frame = cv::Mat();
+		item.frame = cv::Mat();
+		for (auto& features : item.sparse_features)
+		{
+			features.clear();
+		}
+		recycle_queue.tryPush(std::move(item));
+	};
+
+	//The newest detections moved to the frame of "item", weighted by their age.
+	PipelineFrame detection;
+	const std::vector<glm::vec2> no_features;
+	std::vector<float> weights;
+	auto compensateLatency = [&](PipelineFrame& item)
+	{
+		util::ScopedTimer timer("Latency compensation");
+		while (detection_queue.tryPop(detection))
+		{
+			for (size_t i = 0; i < compensators.size(); ++i)
+			{
+				compensators[i].addDetection(detection.index, i < detection.sparse_features.size() ? detection.sparse_features[i] : no_features);
+			}
+			recycle(detection);
+		}
+
+		item.sparse_features.resize(compensators.size());
+		for (size_t i = 0; i < compensators.size(); ++i)
+		{
+			compensators[i].predict(m_settings.latency_compensation, item.index, item.sparse_features[i], weights);
+			m_solver.setLandmarkWeights(weights, static_cast<int>(i));
+		}
+	};
 
-		draw(raw_frame);
-		saveVideoFrame(raw_frame); // pass sparse_features, if you want to render them 
-		//saveVideoFrame(raw_frame, sparse_features);
-		m_menu.draw();
-		m_window.refresh();
+	//Solve and rendering stay on this thread, because it owns the GL context.
+	PipelineFrame next_item;
+	bool next_uploaded = false; //next_item is prefetched into m_pyramid
+	//The producer of solve_queue, the run ends once it finished and every frame it pushed is solved.
+	const std::atomic<bool>& input_done = landmark_interval > 0 ? capture_done : tracker_done;
+	auto start_frame = std::chrono::high_resolution_clock::now();
+	while (!glfwWindowShouldClose(m_window.getGLFWWindow()))
+	{
+		glfwPollEvents();
+		if (glfwGetKey(m_window.getGLFWWindow(), GLFW_KEY_F5) == GLFW_PRESS)
+		{
+			std::cout << "reload shaders" << std::endl;
+			reloadShaders();
+		}
+
+		if (!next_uploaded && !solve_queue.pop(next_item, input_done))
+		{
+			break; //end of the input
+		}
+
+		util::getFrameArena().beginFrame();
+		util::AllocationTracker::get().beginFrame();
+		util::Profiler::get().beginFrame();
+		{
+			util::ScopedTimer frame_timer("Frame");
+			if (!next_uploaded)
+			{
+				m_pyramid.prefetchFrame(next_item.raw_frame, raw_pool.owns(next_item.raw_frame));
+			}
+			PipelineFrame item = std::move(next_item);
+			m_pyramid.usePrefetchedFrame();
+			//If the tracker is ahead, the next frame is copied and its levels are built on the upload stream while this one
+			//is solved on the compute stream.
+			next_uploaded = solve_queue.tryPop(next_item);
+			if (next_uploaded)
+			{
+				m_pyramid.prefetchFrame(next_item.raw_frame, raw_pool.owns(next_item.raw_frame));
+			}
+			if (landmark_interval > 0)
+			{
+				compensateLatency(item);
+			}
+			recordInput(item.raw_frame, item.sparse_features);
+			{
+				util::ScopedTimer timer("Solve", true);
+				solveFaces(item.sparse_features);
+			}
+			writeParameters(!item.sparse_features[0].empty());
+
+			{
+				util::ScopedTimer timer("Render", true);
+				renderFaces(item.sparse_features);
+			}
+			{
+				util::ScopedTimer timer("Video readback");
+				saveVideoFrame(); //encoded on the thread of the video writer
+			}
+			if (isDisplayDue())
+			{
+				util::ScopedTimer timer("Display");
+				draw();
+				m_menu.draw();
+				m_window.refresh();
+			}
+			recycle(item);
+		}
+		util::Profiler::get().endFrame();
+		if (m_input_recorder)
+		{
+			m_input_recorder->commit(util::Profiler::get().getFrameSamples());
+		}
 
+		//Time between two displayed frames, i.e. the throughput of the whole pipeline.
 		auto end_frame = std::chrono::high_resolution_clock::now();
 		m_frame_time = std::chrono::duration_cast<std::chrono::microseconds>(end_frame - start_frame).count() / 1000.0;
+		start_frame = end_frame;
+		m_budget.update(m_frame_time, m_solve_time, m_solver.getSolverParameters(), m_tracker.getParameters());
+	}
+
+	stop = true;
+	capture_queue.wake();
+	solve_queue.wake();
+	detection_queue.wake();
+	capture_thread.join();
+	tracker_thread.join();
+	m_frame_grabber.reset();
+	writeSnapshot();
+	saveIdentityProfile();
+	closeParameterStream();
+	m_input_recorder.reset();
+}
+
+void Application::runHeadless()
+{
+	initGraphics();
+	reloadShaders();
+	openInput();
+
+	const bool write_video = m_video_writer && m_video_writer->isOpened();
+	int number_of_frames = 0;
+	auto start = std::chrono::high_resolution_clock::now();
+	while (m_settings.max_frames <= 0 || number_of_frames < m_settings.max_frames)
+	{
+		util::getFrameArena().beginFrame();
+		util::AllocationTracker::get().beginFrame();
+		//Also ends the frames which break out early.
+		util::ScopedFrame profiler_frame;
+
+		cv::Mat frame;
+		{
+			util::ScopedTimer frame_timer("Frame");
+			if (!readFrame(frame))
+			{
+				break; //end of the input, unlike a camera a recording doesn't recover
+			}
+
+			auto sparse_features = getSparseFeatures(frame);
+			recordInput(m_recorded_frame, sparse_features);
+			{
+				util::ScopedTimer timer("Solve", true);
+				solveFaces(sparse_features);
+			}
+			writeParameters(!sparse_features[0].empty());
+
+			if (write_video)
+			{
+				{
+					util::ScopedTimer timer("Render", true);
+					renderFaces(sparse_features);
+				}
+				{
+					util::ScopedTimer timer("Video readback");
+					saveVideoFrame();
+				}
+			}
+		}
+		profiler_frame.end();
+		if (m_input_recorder)
+		{
+			m_input_recorder->commit(util::Profiler::get().getFrameSamples());
+		}
+
+		if (++number_of_frames % 100 == 0)
+		{
+			auto now = std::chrono::high_resolution_clock::now();
+			auto seconds = std::chrono::duration_cast<std::chrono::milliseconds>(now - start).count() / 1000.0;
+			std::cout << number_of_frames << " frames, " << number_of_frames / seconds << " fps" << std::endl;
+		}
+	}
+
+	CHECK_CUDA_ERROR(cudaDeviceSynchronize());
+	auto end = std::chrono::high_resolution_clock::now();
+	auto seconds = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() / 1000.0;
+	m_frame_grabber.reset();
+	m_nvdec_source.reset();
+	writeSnapshot();
+	saveIdentityProfile();
+	closeParameterStream();
+	m_input_recorder.reset();
+	std::cout << "Processed " << number_of_frames << " frames in " << seconds << " s" << std::endl;
+	util::AllocationTracker::get().print(std::cout);
+}
+
+void Application::runServer()
+{
+	initGraphics();
+	reloadShaders();
+
+	SessionScheduler scheduler(m_settings.scheduler);
+	for (int i = 0; i < m_settings.server_inputs.size(); ++i)
+	{
+		const bool offline = i < m_settings.server_offline.size() && m_settings.server_offline[i];
+		util::ScopedAllocationOwner owner(i);
+		auto session = std::make_unique<TrackingSession>(i, m_settings.server_inputs[i], m_face.getModel(), &m_face_shader,
+			kNumOfPyramidLevels, m_solver.getSolverParameters(), m_tracker.getParameters(), offline ? SessionKind::Offline : SessionKind::Live);
+		if (!m_settings.parameter_stream_path.empty())
+		{
+			session->openParameterStream(m_settings.parameter_stream_path + "." + std::to_string(i), m_settings.parameter_encoding);
+		}
+		scheduler.addSession(std::move(session));
+	}
+
+	std::unique_ptr<util::MetricsServer> metrics_server;
+	if (m_settings.metrics_port > 0)
+	{
+		if (!m_telemetry)
+		{
+			m_telemetry = std::make_unique<util::TelemetrySampler>();
+		}
+		metrics_server = std::make_unique<util::MetricsServer>(m_settings.metrics_port, m_telemetry.get());
+	}
+	scheduler.run(m_settings.max_frames);
+}
+
+void Application::runLandmarkPrecompute()
+{
+	//Frames are detected in chunks, so every thread of the tracker's pool gets a few of them.
+	constexpr int kChunkSize = 64;
+
+	std::unique_ptr<LandmarkCacheWriter> writer;
+	std::vector<cv::Mat> frames;
+	cv::Mat raw_frame;
+	int number_of_frames = 0;
+	bool end_of_input = false;
+	auto start = std::chrono::high_resolution_clock::now();
+	while (!end_of_input)
+	{
+		frames.clear();
+		while (frames.size() < kChunkSize && (m_settings.max_frames <= 0 || number_of_frames + static_cast<int>(frames.size()) < m_settings.max_frames))
+		{
+			if (!m_camera.read(raw_frame))
+			{
+				end_of_input = true;
+				break;
+			}
+			//The tracker sees the halved frame, see readFrame.
+			cv::Mat frame;
+			m_frame_downscaler.downscale(raw_frame, frame);
+			frames.push_back(std::move(frame));
+		}
+		if (frames.empty())
+		{
+			break;
+		}
+
+		if (!writer)
+		{
+			writer = std::make_unique<LandmarkCacheWriter>(m_settings.landmark_precompute_path, m_tracker.getParameters().max_faces,
+				frames[0].cols, frames[0].rows);
+		}
+		for (const auto& sparse_features : m_tracker.detectSparseFeaturesOfFrames(frames))
+		{
+			writer->write(sparse_features);
+		}
+
+		number_of_frames += frames.size();
+		end_of_input |= m_settings.max_frames > 0 && number_of_frames >= m_settings.max_frames;
+		std::cout << number_of_frames << " frames" << std::endl;
+	}
+
+	if (!writer)
+	{
+		throw std::runtime_error("Error: The input " + m_settings.input_path + " has no frames!");
+	}
+	writer->close();
+
+	auto end = std::chrono::high_resolution_clock::now();
+	auto seconds = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() / 1000.0;
+	std::cout << "Wrote the landmarks of " << number_of_frames << " frames to " << m_settings.landmark_precompute_path << " in " << seconds << " s" << std::endl;
+}
+
+void Application::runBatch()
+{
+	auto batch_settings = m_settings.batch;
+	batch_settings.model_directory = kMorphableModelPath;
+	batch_settings.number_of_pyramid_levels = kNumOfPyramidLevels;
+	batch_settings.encoding = m_settings.parameter_encoding;
+	if (!m_settings.parameter_stream_path.empty())
+	{
+		batch_settings.output_path = m_settings.parameter_stream_path;
+	}
+
+	BatchProcessor processor(batch_settings, m_solver.getSolverParameters(), m_tracker.getParameters());
+	processor.run();
+}
+
+void Application::runBenchmark()
+{
+	initGraphics();
+	reloadShaders();
+
+	const auto& settings = m_settings.benchmark;
+	auto fixture = loadBenchmarkFixture(m_settings.input_path, settings.warmup_frames + settings.num_frames, m_tracker);
+	const int n_frames = fixture.frames.size();
+	const int warmup = std::min(settings.warmup_frames, n_frames - 1);
+
+	//Loss telemetry for the final loss, it adds one reduction per GN iteration.
+	auto& solver_parameters = m_solver.getSolverParameters();
+	solver_parameters.verbosity = std::max(solver_parameters.verbosity, 1);
+
+	BenchmarkReport report;
+	report.input_path = m_settings.input_path;
+	int device = 0;
+	cudaDeviceProp properties;
+	CHECK_CUDA_ERROR(cudaGetDevice(&device));
+	CHECK_CUDA_ERROR(cudaGetDeviceProperties(&properties, device));
+	report.device_name = properties.name;
+
+	std::chrono::high_resolution_clock::time_point start;
+	for (int i = 0; i < n_frames; ++i)
+	{
+		if (i == warmup)
+		{
+			CHECK_CUDA_ERROR(cudaDeviceSynchronize());
+			util::Profiler::get().clearHistory();
+			start = std::chrono::high_resolution_clock::now();
+		}
+
+		util::getFrameArena().beginFrame();
+		util::AllocationTracker::get().beginFrame();
+		util::Profiler::get().beginFrame();
+		{
+			util::ScopedTimer frame_timer("Frame");
+			if (!fixture.controls.empty())
+			{
+				fixture.controls[i].apply(solver_parameters);
+			}
+			m_pyramid.uploadFrame(fixture.frames[i], m_solver.getStream());
+			{
+				util::ScopedTimer timer("Solve", true);
+				m_solver.solve(fixture.landmarks[i], m_face, m_projection, m_pyramid);
+			}
+		}
+		util::Profiler::get().endFrame();
+
+		if (i >= warmup)
+		{
+			const auto& statistics = m_solver.getStatistics();
+			report.num_frames++;
+			report.num_tracked_frames += fixture.landmarks[i].empty() ? 0 : 1;
+			report.num_gn_iterations += statistics.num_gn_iterations;
+			report.num_pcg_iterations += statistics.num_pcg_iterations;
+			report.num_rejected_steps += statistics.num_rejected_steps;
+			report.num_reused_renders += statistics.num_reused_renders;
+
+			size_t free, total;
+			CHECK_CUDA_ERROR(cudaMemGetInfo(&free, &total));
+			report.peak_device_bytes_used = std::max(report.peak_device_bytes_used, total - free);
+			report.peak_bytes_reserved = std::max(report.peak_bytes_reserved, util::getDefaultAllocator().getStats().bytes_reserved);
+		}
+	}
+
+	CHECK_CUDA_ERROR(cudaDeviceSynchronize());
+	auto end = std::chrono::high_resolution_clock::now();
+	report.seconds = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1.0e6;
+
+	m_solver.collectLosses();
+	if (!fixture.landmarks.back().empty() && !m_solver.getLosses().empty())
+	{
+		report.final_loss = m_solver.getLosses().back();
 	}
+	report.peak_bytes_in_use = util::getDefaultAllocator().getStats().peak_bytes_in_use;
+	report.stages = util::Profiler::get().getStatistics();
+
+	writeBenchmarkReport(settings.output_path, report);
+	std::cout << "Benchmarked " << report.num_frames << " frames in " << report.seconds << " s, report written to "
+		<< settings.output_path << std::endl;
+}
+
+void Application::runKernelBenchmark()
+{
+	KernelBenchmark benchmark(m_settings.kernel_benchmark, m_face.getModel(), m_solver.getSolverParameters());
+	benchmark.run();
+	std::cout << "Kernel benchmark written to " << m_settings.kernel_benchmark.output_path << std::endl;
+}
+
+void Application::runComparison()
+{
+	initGraphics();
+	reloadShaders();
+
+	const auto& settings = m_settings.comparison;
+	auto fixture = loadBenchmarkFixture(m_settings.input_path, settings.num_frames, m_tracker);
+	SolverComparison comparison(settings, m_solver.getSolverParameters(), m_face, kMorphableModelPath);
+	comparison.run(fixture, m_pyramid, m_projection);
+	std::cout << "Comparison written to " << settings.output_path << std::endl;
+}
+
+void Application::runSweep()
+{
+	auto sweep_settings = m_settings.sweep;
+	sweep_settings.model_directory = kMorphableModelPath;
+	sweep_settings.number_of_pyramid_levels = kNumOfPyramidLevels;
+
+	//The grid is checked before the frames are decoded and their landmarks detected.
+	ParameterSweep sweep(sweep_settings, m_solver.getSolverParameters());
+	auto fixture = loadBenchmarkFixture(m_settings.input_path, sweep_settings.warmup_frames + sweep_settings.num_frames, m_tracker);
+	sweep.run(fixture);
+}
+
+void Application::planMemory(const bool prefetch)
+{
+	if (!m_settings.plan_memory || !m_settings.batch.inputs.empty() || !m_settings.landmark_precompute_path.empty())
+	{
+		return; //the batch plans nothing per device, the precompute doesn't solve
+	}
+
+	//The pyramid of the application exists already, it is planned like the others and its memory counted as free.
+	//Server sessions are sized like the first input.
+	MemoryConfig config;
+	config.width = m_pyramid.getWidth(0);
+	config.height = m_pyramid.getHeight(0);
+	config.number_of_levels = m_pyramid.getNumberOfLevels();
+	config.roi_size = m_settings.roi_size;
+	config.packed_visibility = m_settings.packed_visibility;
+	config.num_faces = m_settings.server_inputs.empty() ? std::max(m_settings.max_faces, 1) : 1;
+	config.num_sessions = m_settings.server_inputs.empty() ? 1 : m_settings.server_inputs.size();
+	config.num_pyramids = m_settings.server_inputs.empty() ? 1 : m_settings.server_inputs.size() + 1;
+	const size_t allocated_bytes = MemoryPlanner::estimatePyramidBytes(config);
+	config.prefetch = prefetch;
+
+	size_t free = 0;
+	size_t total = 0;
+	CHECK_CUDA_ERROR(cudaMemGetInfo(&free, &total));
+	if (m_settings.memory_limit_mb > 0)
+	{
+		const size_t limit = m_settings.memory_limit_mb * 1024 * 1024;
+		const size_t used = total - free;
+		free = limit > used ? limit - used : 0;
+	}
+	auto plan = MemoryPlanner::plan(m_solver.getSolverParameters(), config, free + allocated_bytes);
+	MemoryPlanner::print(plan, std::cout);
 }
 
 void Application::initMenuWidgets()
 {
+	if (!m_telemetry)
+	{
+		m_telemetry = std::make_unique<util::TelemetrySampler>();
+	}
+
 	auto gpu_memory_info_gui = [this]()
 	{
 		ImGui::Text("Frame Time: %.1f ms", m_frame_time);
+		ImGui::SliderFloat("Display rate (Hz)", &m_settings.display_rate, 0.0f, 120.0f);
+		int swap_interval = m_window.getSwapInterval();
+		if (ImGui::SliderInt("Swap interval", &swap_interval, 0, 4))
+		{
+			m_window.setSwapInterval(swap_interval);
+		}
+		if (ImGui::CollapsingHeader("Frame Budget", ImGuiTreeNodeFlags_None))
+		{
+			auto& budget = m_budget.getParameters();
+			ImGui::Checkbox("Adapt solver effort", &budget.enabled);
+			ImGui::SliderFloat("Target (ms)", &budget.target_ms, 5.0f, 100.0f);
+			ImGui::SliderFloat("Min. quality", &budget.min_quality, 0.05f, 1.0f);
+			ImGui::Checkbox("Solve deadline", &budget.use_deadline);
+			ImGui::Text("Quality: %.2f, deadline: %.1f ms%s", m_budget.getQuality(), m_solver.getSolverParameters().deadline_ms,
+				m_solver.getStatistics().deadline_expired ? " (expired)" : "");
+		}
+		if (m_frame_grabber)
+		{
+			ImGui::Text("Captured frames: %d, dropped: %d", m_frame_grabber->getNumberOfCapturedFrames(), m_frame_grabber->getNumberOfDroppedFrames());
+		}
+
+		//Sampled in the background, cudaMemGetInfo would synchronize the device every UI frame.
+		const auto telemetry = m_telemetry->getLatest();
+		ImGui::Text("Free  GPU Memory: %.1f MB", telemetry.free_bytes / (1024.0f * 1024.0f));
+		ImGui::Text("Total GPU Memory: %.1f MB", telemetry.total_bytes / (1024.0f * 1024.0f));
+		if (telemetry.has_nvml)
+		{
+			ImGui::Text("GPU load: %u%%, memory load: %u%%", telemetry.gpu_utilization, telemetry.memory_utilization);
+			ImGui::Text("Clocks: SM %u MHz, memory %u MHz", telemetry.sm_clock_mhz, telemetry.memory_clock_mhz);
+			ImGui::Text("Temperature: %u C, power: %.1f W", telemetry.temperature_c, telemetry.power_mw / 1000.0f);
+		}
+
+		if (ImGui::CollapsingHeader("Device Allocators", ImGuiTreeNodeFlags_None))
+		{
+			bool use_caching_allocator = &util::getDefaultAllocator() == &util::getCachingAllocator();
+			if (ImGui::Checkbox("Caching allocator", &use_caching_allocator))
+			{
+				util::setDefaultAllocator(use_caching_allocator ? static_cast<util::DeviceAllocator&>(util::getCachingAllocator()) : util::getCudaAllocator());
+			}
 
-		size_t free, total;
-		CHECK_CUDA_ERROR(cudaMemGetInfo(&free, &total));
+			for (const auto& allocator : telemetry.allocators)
+			{
+				const auto& stats = allocator.second;
+				ImGui::Text("%s", allocator.first);
+				ImGui::Text("  Allocs: %zu (driver: %zu)", stats.num_allocations, stats.num_driver_allocations);
+				ImGui::Text("  In use: %.1f MB, peak: %.1f MB", stats.bytes_in_use / (1024.0f * 1024.0f), stats.peak_bytes_in_use / (1024.0f * 1024.0f));
+				ImGui::Text("  Reserved: %.1f MB", stats.bytes_reserved / (1024.0f * 1024.0f));
+			}
 
-		ImGui::Text("Free  GPU Memory: %.1f MB", free / (1024.0f * 1024.0f));
-		ImGui::Text("Total GPU Memory: %.1f MB", total / (1024.0f * 1024.0f));
+			const auto& tracker = util::AllocationTracker::get();
+			ImGui::Text("Device arrays, %zu allocations last frame", tracker.getFrameAllocations());
+			for (const auto& tag : tracker.getTagStats())
+			{
+				ImGui::Text("  %s: %.1f MB, peak: %.1f MB", tag.first.c_str(), tag.second.bytes_in_use / (1024.0f * 1024.0f),
+					tag.second.peak_bytes_in_use / (1024.0f * 1024.0f));
+			}
+		}
 
 		ImGui::Separator();
 	};
 	m_menu.attach(std::move(gpu_memory_info_gui));
 
+	auto timings_gui = []()
+	{
+		if (ImGui::CollapsingHeader("Timings", ImGuiTreeNodeFlags_None))
+		{
+			auto& profiler = util::Profiler::get();
+			bool enabled = profiler.isEnabled();
+			if (ImGui::Checkbox("Enabled", &enabled))
+			{
+				profiler.setEnabled(enabled);
+			}
+			ImGui::SameLine();
+			if (ImGui::Button("Dump CSV"))
+			{
+				profiler.dumpCsv("timings.csv");
+			}
+			ImGui::SameLine();
+			if (ImGui::Button(profiler.isTracing() ? "Tracing..." : "Trace 30 frames") && !profiler.isTracing())
+			{
+				profiler.startTrace("trace.json", profiler.getFrame() + 1, 30);
+			}
+			ImGui::SameLine();
+			if (ImGui::Button(m_solver.isCapturingDebugFrames() ? "Capturing..." : "Capture 10 frames") && !m_solver.isCapturingDebugFrames())
+			{
+				m_solver.captureDebugFrames(10);
+			}
+
+			ImGui::Text("Stage: CPU p50/p99 | GPU p50/p99 [ms]");
+			for (const auto& stage : profiler.getStatistics())
+			{
+				const auto& stats = stage.second;
+				if (stats.gpu_p50 >= 0.0f)
+				{
+					ImGui::Text("%s: %.2f/%.2f | %.2f/%.2f", stage.first.c_str(), stats.cpu_p50, stats.cpu_p99, stats.gpu_p50, stats.gpu_p99);
+				}
+				else
+				{
+					ImGui::Text("%s: %.2f/%.2f", stage.first.c_str(), stats.cpu_p50, stats.cpu_p99);
+				}
+			}
+		}
+		ImGui::Separator();
+	};
+	m_menu.attach(std::move(timings_gui));
+
 	auto& shape_coefficients = m_face.getShapeCoefficients();
 	auto shape_parameters_gui = [&shape_coefficients]()
 	{
@@ -167,18 +1277,202 @@ void Application::initMenuWidgets()
 			ImGui::SliderFloat("Dense Weight exp", &solver_parameters.dense_weight_exponent, -4.0f, 4.0f);
 			ImGui::SliderFloat("Reg. Weight exp", &solver_parameters.regularisation_weight_exponent, -8.0f, 4.0f);
 
-			ImGui::SliderInt("# PCG iterations", &solver_parameters.num_pcg_iterations, 1, 500);
+			ImGui::SliderInt("Verbosity", &solver_parameters.verbosity, 0, 1);
+			const auto& losses = m_solver.getLosses();
+			if (solver_parameters.verbosity > 0 && !losses.empty())
+			{
+				ImGui::Text("Loss (last GN iteration): %.5f", losses.back());
+			}
+			ImGui::Checkbox("Matrix-free PCG", &solver_parameters.use_matrix_free_pcg);
+			ImGui::Checkbox("Persistent threads", &solver_parameters.use_persistent_threads);
+			ImGui::Checkbox("Row-major Jacobian", &solver_parameters.use_row_major_jacobian);
+			ImGui::Checkbox("Closed-form lighting", &solver_parameters.use_closed_form_lighting);
+			ImGui::Checkbox("Fused PCG", &solver_parameters.use_fused_pcg);
+			ImGui::SliderFloat("PCG max. forcing term", &solver_parameters.pcg_max_forcing_term, 0.0f, 0.9f);
+			ImGui::Checkbox("PCG warm start", &solver_parameters.use_pcg_warm_start);
+			ImGui::Checkbox("CUDA graphs", &solver_parameters.use_cuda_graphs);
+			ImGui::Checkbox("CUDA rasterizer", &solver_parameters.use_cuda_rasterizer);
+			ImGui::Checkbox("Reuse renders", &solver_parameters.use_render_reuse);
+			if (solver_parameters.use_render_reuse)
+			{
+				ImGui::SliderFloat("Render reuse threshold", &solver_parameters.render_reuse_threshold, 0.0f, 0.05f, "%.4f");
+			}
+			if (m_pyramid.hasRoiTargets())
+			{
+				ImGui::Checkbox("ROI rendering", &solver_parameters.use_roi_rendering);
+			}
+			ImGui::Checkbox("Normal equations", &solver_parameters.use_normal_equations);
+			ImGui::Checkbox("Cholesky solve", &solver_parameters.use_cholesky);
+			ImGui::Checkbox("Host LDLT", &solver_parameters.use_host_ldlt);
+			ImGui::Checkbox("JTJ from Jacobian", &solver_parameters.use_jtj_from_jacobian);
+			ImGui::Checkbox("Tensor core JTJ", &solver_parameters.use_tensor_core_jtj);
+			ImGui::Checkbox("Block preconditioner", &solver_parameters.use_block_preconditioner);
+			ImGui::Checkbox("Levenberg-Marquardt", &solver_parameters.use_levenberg_marquardt);
+			if (solver_parameters.use_levenberg_marquardt)
+			{
+				ImGui::SliderFloat("Initial lambda", &solver_parameters.lm_initial_lambda, 0.0f, 0.1f, "%.5f");
+				ImGui::SliderFloat("Min. energy decrease", &solver_parameters.lm_relative_decrease_threshold, 0.0f, 0.05f, "%.4f");
+			}
+			ImGui::SliderInt("Progressive coefficients", &solver_parameters.progressive_initial_coefficients, 0, 80);
+			ImGui::Combo("Pixel sampling", &solver_parameters.pixel_sampling_mode, "All\0Random\0Grid\0");
+			ImGui::SliderInt("# Pixel samples", &solver_parameters.num_pixel_samples, 1000, 200000);
+			ImGui::SliderInt("Pixel sample stride", &solver_parameters.pixel_sample_stride, 1, 8);
+			bool half_precision_basis = m_face.isHalfPrecisionBasis();
+			if (ImGui::Checkbox("FP16 bases", &half_precision_basis))
+			{
+				m_face.setHalfPrecisionBasis(half_precision_basis);
+			}
+			bool vertex_major_basis = m_face.isVertexMajorBasis();
+			if (ImGui::Checkbox("Vertex-major bases", &vertex_major_basis))
+			{
+				m_face.setVertexMajorBasis(vertex_major_basis);
+			}
+			ImGui::Checkbox("Basis textures", &solver_parameters.use_basis_textures);
+			bool aligned_vertices = m_face.isAlignedVertices();
+			if (ImGui::Checkbox("Aligned vertices", &aligned_vertices))
+			{
+				m_face.setAlignedVertices(aligned_vertices);
+			}
+			bool sparse_expressions = m_face.getSparseExpressionThreshold() > 0.0f;
+			if (ImGui::Checkbox("Sparse expressions", &sparse_expressions))
+			{
+				m_face.setSparseExpressionBasis(sparse_expressions ? Face::kDefaultSparseExpressionThreshold : 0.0f);
+			}
+			if (sparse_expressions)
+			{
+				float threshold = m_face.getSparseExpressionThreshold();
+				//Applied on enter only, every change reloads the bases.
+				if (ImGui::InputFloat("Expression threshold", &threshold, 0.0f, 0.0f, "%.4f", ImGuiInputTextFlags_EnterReturnsTrue))
+				{
+					m_face.setSparseExpressionBasis(threshold);
+				}
+				ImGui::Text("Expression vertices %d / %d", m_face.getNumExpressionVertices(), m_face.m_model->number_of_vertices);
+			}
+			bool tiled_basis = m_face.getTiledBasisCacheTiles() > 0;
+			if (ImGui::Checkbox("Tiled bases", &tiled_basis))
+			{
+				m_face.setTiledBasis(tiled_basis ? Face::kDefaultTiledBasisCacheTiles : 0);
+			}
+			if (m_face.m_model->tiled_basis)
+			{
+				const auto& tiles = *m_face.m_model->tiled_basis;
+				ImGui::Text("Basis tiles %d / %d cached, %llu uploaded", tiles.getCacheTiles(), tiles.getTileCount(),
+					static_cast<unsigned long long>(tiles.getUploadedTiles()));
+			}
+			ImGui::Checkbox("Landmarks only", &solver_parameters.use_landmark_only);
+			if (solver_parameters.use_landmark_only)
+			{
+				ImGui::SliderInt("Keyframe interval", &solver_parameters.landmark_keyframe_interval, 0, 120);
+				ImGui::SliderFloat("Keyframe error jump", &solver_parameters.landmark_error_jump, 0.0f, 10.0f);
+				ImGui::SliderInt("# Landmark iterations", &solver_parameters.num_landmark_iterations, 1, 20);
+			}
+			ImGui::Checkbox("Recovery", &solver_parameters.use_recovery);
+			if (solver_parameters.use_recovery)
+			{
+				ImGui::SliderFloat("Recovery landmark error", &solver_parameters.recovery_landmark_error, 0.0f, 1.0f);
+				ImGui::SliderInt("# Recovery levels", &solver_parameters.num_recovery_levels, 1, 4);
+			}
+			ImGui::Checkbox("Identity locking", &solver_parameters.use_identity_locking);
+			ImGui::SliderInt("# Calibration frames", &solver_parameters.num_calibration_frames, 1, 300);
+			ImGui::Checkbox("Joint calibration", &solver_parameters.use_joint_calibration);
+			if (solver_parameters.use_joint_calibration)
+			{
+				ImGui::SliderInt("# Calibration keyframes", &solver_parameters.num_calibration_keyframes, 1, 16);
+			}
+			if (m_face.isIdentityLocked())
+			{
+				if (ImGui::Button("Recalibrate identity"))
+				{
+					m_solver.recalibrate(m_face);
+					for (int i = 0; i < m_extra_faces.size(); ++i)
+					{
+						m_solver.recalibrate(*m_extra_faces[i], i + 1);
+					}
+				}
+			}
+			else if (ImGui::Button("Lock identity now"))
+			{
+				m_face.lockIdentity();
+			}
+			ImGui::Checkbox("Temporal prediction", &solver_parameters.use_temporal_prediction);
+			ImGui::SliderFloat("Prediction damping", &solver_parameters.prediction_damping, 0.0f, 1.0f);
+			ImGui::SliderInt("Warm start level", &solver_parameters.warm_start_level, 0, m_pyramid.getNumberOfLevels() - 1);
+			ImGui::SliderFloat("Convergence threshold", &solver_parameters.convergence_threshold, 0.0f, 1.0e-2f, "%.5f");
+			ImGui::Checkbox("Landmark filter", &solver_parameters.use_landmark_filter);
+			if (solver_parameters.use_landmark_filter)
+			{
+				auto& filter = solver_parameters.landmark_filter;
+				ImGui::SliderFloat("Filter min. cutoff", &filter.min_cutoff, 0.1f, 10.0f);
+				ImGui::SliderFloat("Filter beta", &filter.beta, 0.0f, 50.0f);
+				ImGui::SliderFloat("Landmark jitter", &filter.jitter_scale, 0.001f, 0.05f, "%.4f");
+			}
+			ImGui::Checkbox("Motion gate", &solver_parameters.use_motion_gate);
+			if (solver_parameters.use_motion_gate)
+			{
+				ImGui::SliderFloat("Landmark motion", &solver_parameters.motion_landmark_threshold, 0.0f, 0.02f, "%.4f");
+				ImGui::SliderFloat("Frame motion", &solver_parameters.motion_frame_threshold, 0.0f, 10.0f);
+				ImGui::SliderInt("Static frame iterations", &solver_parameters.static_solve_iterations, 0, 5);
+			}
+			ImGui::Checkbox("Reuse solver render", &m_settings.reuse_solver_render);
+			//Levels without an entry of their own use the last one, the menu shows them all.
+			auto& levels = solver_parameters.levels;
+			if (levels.size() < m_pyramid.getNumberOfLevels())
+			{
+				levels.resize(m_pyramid.getNumberOfLevels(), levels.empty() ? LevelSchedule() : levels.back());
+			}
 			for (int i = 0; i < m_pyramid.getNumberOfLevels(); ++i)
 			{
-				ImGui::SliderInt(("# GN iterations L" + std::to_string(i)).c_str(), solver_parameters.num_gn_iterations + i, 0, 25);
+				const std::string suffix = " L" + std::to_string(i);
+				auto& level = levels[i];
+				ImGui::SliderInt(("# GN iterations" + suffix).c_str(), &level.num_gn_iterations, 0, 25);
+				ImGui::SliderInt(("# PCG iterations" + suffix).c_str(), &level.num_pcg_iterations, 1, 500);
+				ImGui::Checkbox(("Sparse" + suffix).c_str(), &level.use_sparse_term);
+				ImGui::SameLine();
+				ImGui::Checkbox(("Dense" + suffix).c_str(), &level.use_dense_term);
+				ImGui::Checkbox(("Shape" + suffix).c_str(), &level.optimize_shape);
+				ImGui::SameLine();
+				ImGui::Checkbox(("Expr." + suffix).c_str(), &level.optimize_expressions);
+				ImGui::SameLine();
+				ImGui::Checkbox(("Albedo" + suffix).c_str(), &level.optimize_albedo);
+				ImGui::SameLine();
+				ImGui::Checkbox(("SH" + suffix).c_str(), &level.optimize_lighting);
+				if (solver_parameters.use_normal_equations)
+				{
+					ImGui::SliderInt(("JTJ reuse" + suffix).c_str(), &level.jtj_reuse_iterations, 0, 10);
+				}
+				ImGui::SliderInt(("Mesh LOD" + suffix).c_str(), &level.level_of_detail, 0, FaceModel::kNumLevelsOfDetail - 1);
 			}
 
-			ImGui::SliderInt("# Shape Params", &solver_parameters.num_shape_coefficients, 0, 160);
-			ImGui::SliderInt("# Albedo Params", &solver_parameters.num_albedo_coefficients, 0, 160);
-			ImGui::SliderInt("# Expression Params", &solver_parameters.num_expression_coefficients, 0, 76);
+			const auto& model = *m_face.getModel();
+			ImGui::SliderInt("# Shape Params", &solver_parameters.num_shape_coefficients, 0, static_cast<int>(model.num_shape_coefficients));
+			ImGui::SliderInt("# Albedo Params", &solver_parameters.num_albedo_coefficients, 0, static_cast<int>(model.num_albedo_coefficients));
+			ImGui::SliderInt("# Expression Params", &solver_parameters.num_expression_coefficients, 0, static_cast<int>(model.num_expression_coefficients));
 		}
 	};
 	m_menu.attach(std::move(opt_parameters));
+
+	auto& tracker_parameters = m_tracker.getParameters();
+	auto tracker_parameters_gui = [&tracker_parameters]()
+	{
+		if (ImGui::CollapsingHeader("Tracker Parameters", ImGuiTreeNodeFlags_None))
+		{
+			ImGui::Combo("Landmark backend", &tracker_parameters.landmark_backend, "HOG (CPU)\0MMOD CNN (GPU)\0");
+			ImGui::Checkbox("Landmark tracking", &tracker_parameters.use_tracking);
+			ImGui::SliderInt("Redetection interval", &tracker_parameters.redetection_interval, 1, 60);
+			ImGui::SliderFloat("Box padding", &tracker_parameters.box_padding, 0.0f, 0.5f);
+			ImGui::Checkbox("Motion prediction", &tracker_parameters.use_motion);
+			ImGui::SliderFloat("Min. tracking overlap", &tracker_parameters.min_tracking_overlap, 0.0f, 1.0f);
+			ImGui::SliderInt("Tracker threads", &tracker_parameters.num_threads, 0, 16);
+			ImGui::Checkbox("GPU shape predictor", &tracker_parameters.use_gpu_shape_predictor);
+			ImGui::Checkbox("Landmark flow", &tracker_parameters.use_flow);
+			ImGui::SliderInt("Flow fit interval", &tracker_parameters.flow_fit_interval, 1, 30);
+			ImGui::SliderFloat("Max. flow error", &tracker_parameters.max_flow_error, 1.0f, 50.0f);
+			ImGui::SliderFloat("Detection scale", &tracker_parameters.detection_scale, 0.1f, 1.0f);
+			ImGui::Checkbox("Search window", &tracker_parameters.use_search_window);
+			ImGui::SliderFloat("Search window size", &tracker_parameters.search_window_size, 1.0f, 4.0f);
+		}
+	};
+	m_menu.attach(std::move(tracker_parameters_gui));
 }
 
 void Application::initGraphics()
@@ -186,14 +1480,6 @@ void Application::initGraphics()
 	// empty vertex buffer used to draw fullscreen quad
 	glGenVertexArrays(1, &m_empty_vao);
 
-	// texture we upload the camera input to
-	glGenTextures(1, &m_camera_frame_texture);
-	glBindTexture(GL_TEXTURE_2D, m_camera_frame_texture);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
 	//Video framebuffer
 	glGenFramebuffers(1, &m_video_framebuffer);
 	glBindFramebuffer(GL_FRAMEBUFFER, m_video_framebuffer);
@@ -218,9 +1504,7 @@ void Application::initGraphics()
 void Application::reloadShaders()
 {
 	m_face_shader = GLSLProgram();
-	m_face_shader.attachShader(GL_VERTEX_SHADER, "../src/shader/face.vert");
-	m_face_shader.attachShader(GL_GEOMETRY_SHADER, "../src/shader/face.geom");
-	m_face_shader.attachShader(GL_FRAGMENT_SHADER, "../src/shader/face.frag");
+	Face::attachShaders(m_face_shader, m_settings.fragment_barycentrics);
 	m_face_shader.link();
 
 	m_face_shader.use();
@@ -240,9 +1524,29 @@ void Application::reloadShaders()
 
 	auto& graphics_settings = m_face.getGraphicsSettings();
 	graphics_settings.shader = &m_face_shader;
+	for (auto& face : m_extra_faces)
+	{
+		face->getGraphicsSettings().shader = &m_face_shader;
+	}
+}
+
+bool Application::isDisplayDue()
+{
+	if (m_settings.display_rate <= 0.0f)
+	{
+		return true;
+	}
+
+	const auto now = std::chrono::steady_clock::now();
+	if (now - m_last_display < std::chrono::duration<double>(1.0 / m_settings.display_rate))
+	{
+		return false;
+	}
+	m_last_display = now;
+	return true;
 }
 
-void Application::draw(cv::Mat& frame)
+void Application::draw()
 {
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 	glViewport(m_gui_size.x, 0, m_screen_width, m_screen_height);
@@ -253,18 +1557,36 @@ void Application::draw(cv::Mat& frame)
 	m_fullscreen_shader.use();
 	glActiveTexture(GL_TEXTURE0);
 	m_fullscreen_shader.setUniformIVar("face", { 0 });
+	m_fullscreen_shader.setUniformFVar("face_window", getFaceWindow(m_face.getGraphicsSettings()));
 	glBindTexture(GL_TEXTURE_2D, m_face.getGraphicsSettings().rt_rgb);
 
 	glActiveTexture(GL_TEXTURE1);
 	m_fullscreen_shader.setUniformIVar("background", { 1 });
-	glBindTexture(GL_TEXTURE_2D, m_camera_frame_texture);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, m_screen_width, m_screen_height, 0, GL_BGR, GL_UNSIGNED_BYTE, frame.data);
+	glBindTexture(GL_TEXTURE_2D, m_pyramid.getFrameTexture());
 
 	glDrawArrays(GL_TRIANGLES, 0, 6);
 	glBindVertexArray(0);
 }
 
-void Application::saveVideoFrame(cv::Mat& frame, std::vector<glm::vec2>& features)
+void Application::saveVideoFrame(std::vector<glm::vec2>& features)
+{
+	if (!m_video_writer)
+	{
+		return;
+	}
+
+	if (features.empty())
+	{
+		renderVideoFrame();
+		m_video_writer->enqueue(m_video_texture_resource);
+	}
+	else
+	{
+		m_video_writer->enqueue(readVideoFrame(features));
+	}
+}
+
+void Application::renderVideoFrame()
 {
 	glBindFramebuffer(GL_FRAMEBUFFER, m_video_framebuffer);
 	glViewport(0, 0, m_video_width, m_video_height);
@@ -275,15 +1597,20 @@ void Application::saveVideoFrame(cv::Mat& frame, std::vector<glm::vec2>& feature
 	m_video_shader.use();
 	glActiveTexture(GL_TEXTURE0);
 	m_video_shader.setUniformIVar("face", { 0 });
+	m_video_shader.setUniformFVar("face_window", getFaceWindow(m_face.getGraphicsSettings()));
 	glBindTexture(GL_TEXTURE_2D, m_face.getGraphicsSettings().rt_rgb);
 
 	glActiveTexture(GL_TEXTURE1);
 	m_video_shader.setUniformIVar("background", { 1 });
-	glBindTexture(GL_TEXTURE_2D, m_camera_frame_texture);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, m_screen_width, m_screen_height, 0, GL_BGR, GL_UNSIGNED_BYTE, frame.data);
+	glBindTexture(GL_TEXTURE_2D, m_pyramid.getFrameTexture());
 
 	glDrawArrays(GL_TRIANGLES, 0, 6);
 	glBindVertexArray(0);
+}
+
+cv::Mat Application::readVideoFrame(std::vector<glm::vec2>& features)
+{
+	renderVideoFrame();
 	glFinish();
 
 	CHECK_CUDA_ERROR(cudaGraphicsMapResources(1, &m_video_texture_resource, 0));
@@ -307,7 +1634,7 @@ void Application::saveVideoFrame(cv::Mat& frame, std::vector<glm::vec2>& feature
 		}
 
 		std::vector<glm::vec3> face(m_face.getNumberOfVertices());
-		util::copy(face, m_face.getCurrentFaceGpu(), m_face.getNumberOfVertices());
+		util::copy(util::hostSpan(face), util::deviceSpan<const glm::vec3>(m_face.getCurrentFaceGpu(), face.size()));
 
 		const auto& ids = PriorSparseFeatures::get().getPriorIds();
 		for (auto id : ids)
@@ -319,15 +1646,19 @@ void Application::saveVideoFrame(cv::Mat& frame, std::vector<glm::vec2>& feature
 			cv::circle(video_frame, cv::Point(v.x, v.y), radius, color, thickness);
 		}
 	}
-	m_video_writer.write(video_frame);
-
 	CHECK_CUDA_ERROR(cudaGraphicsUnmapResources(1, &m_video_texture_resource, 0));
+
+	return video_frame;
 }
 
 void Application::printUniqueFaceVerticesSparse()
 {
 	auto& graphics_settings = m_face.getGraphicsSettings();
 	m_pyramid.setGraphicsSettings(0, graphics_settings);
+	if (!graphics_settings.rt_barycentrics_cuda_resource)
+	{
+		throw std::runtime_error("Error: printUniqueFaceVerticesSparse needs the barycentrics render target, not the packed visibility buffer!");
+	}
 	m_face.computeFace();
 	m_face.updateVertexBuffer();
 	m_face.draw();
@@ -356,9 +1687,14 @@ void Application::printUniqueFaceVerticesSparse()
 	cv::Mat barycentrics_frame_flipped(cv::Size(width, height), CV_32FC4);
 	cv::Mat vertex_ids_frame_flipped(cv::Size(width, height), CV_32SC4);
 
-	CHECK_CUDA_ERROR(cudaMemcpyFromArray(rgb_frame.data, array_rgb, 0, 0, width * height * 4, cudaMemcpyDeviceToHost));
-	CHECK_CUDA_ERROR(cudaMemcpyFromArray(barycentrics_frame_flipped.data, array_barycentrics, 0, 0, width * height * 4 * sizeof(float), cudaMemcpyDeviceToHost));
-	CHECK_CUDA_ERROR(cudaMemcpyFromArray(vertex_ids_frame_flipped.data, array_vertex_ids, 0, 0, width * height * 4 * sizeof(int), cudaMemcpyDeviceToHost));
+	//Only the viewport of level 0, the targets may be an atlas.
+	const int x = graphics_settings.target_x;
+	const int y = graphics_settings.target_y;
+	CHECK_CUDA_ERROR(cudaMemcpy2DFromArray(rgb_frame.data, width * 4, array_rgb, x * 4, y, width * 4, height, cudaMemcpyDeviceToHost));
+	CHECK_CUDA_ERROR(cudaMemcpy2DFromArray(barycentrics_frame_flipped.data, width * 4 * sizeof(float), array_barycentrics, x * 4 * sizeof(float), y,
+		width * 4 * sizeof(float), height, cudaMemcpyDeviceToHost));
+	CHECK_CUDA_ERROR(cudaMemcpy2DFromArray(vertex_ids_frame_flipped.data, width * 4 * sizeof(int), array_vertex_ids, x * 4 * sizeof(int), y,
+		width * 4 * sizeof(int), height, cudaMemcpyDeviceToHost));
 	cv::flip(rgb_frame, rgb_frame_flipped, 0);
 	cv::flip(barycentrics_frame_flipped, barycentrics_frame, 0);
 	cv::flip(vertex_ids_frame_flipped, vertex_ids_frame, 0);
@@ -6,23 +6,185 @@
 #include "menu.h"
 #include "gauss_newton_solver.h"
 #include "pyramid.h"
+#include "parameter_stream.h"
+#include "landmark_cache.h"
+#include "landmark_latency.h"
+#include "video_writer.h"
+#include "batch_processor.h"
+#include "benchmark.h"
+#include "kernel_benchmark.h"
+#include "frame_grabber.h"
+#include "nvdec_video_source.h"
+#include "ipc_video_source.h"
+#include "solver_comparison.h"
+#include "parameter_sweep.h"
+#include "telemetry.h"
+#include "metrics.h"
+#include "budget_controller.h"
+#include "memory_planner.h"
+#include "shared_memory_sink.h"
+#include "mesh_stream_encoder.h"
+#include "tracking_snapshot.h"
+#include "identity_profile_store.h"
+#include "identity_calibrator.h"
+#include "input_recording.h"
+#include "tracking_session.h"
 
 #include <GLFW/glfw3.h>
 #include <glm/glm.hpp>
+#include <chrono>
+#include <fstream>
+#include <memory>
+
+struct ApplicationSettings
+{
+	std::string input_path = "./demo2.mp4";
+	std::string output_video_path = "../../video.avi"; //empty: no overlay video
+	util::VideoCodec video_codec = util::VideoCodec::Mjpeg; //H264/Hevc write a raw elementary stream, name the output accordingly
+	//Hidden window, no menu and no display, frames are processed as fast as possible until the input ends.
+	bool headless = false;
+	//Of the capture thread, see util::FrameGrabber. DropToLatest for live cameras, where latency matters more than every frame.
+	util::CapturePolicy capture_policy = util::CapturePolicy::Lossless;
+	//Decode input_path with NVDEC straight into the pyramid, only the landmark detector's frame is downloaded. Falls back to
+	//the CPU decoder with a warning, if it isn't available. Used by run and runHeadless.
+	bool gpu_decode = false;
+	//Name of the frame ring of a capture process (see util::IpcFrameWriter), whose device frames go straight into the pyramid.
+	//Replaces input_path in run and runHeadless, the frame size is the one of the ring. Empty: input_path.
+	std::string ipc_input;
+	int max_frames = 0; //0: all frames of the input
+	std::string parameter_stream_path; //empty: no parameter stream
+	ParameterEncoding parameter_encoding = ParameterEncoding::Float32;
+	//Publishes the parameters of every frame to other processes under that name, see SharedMemorySink. Empty: not published.
+	std::string shared_memory_name;
+	bool shared_memory_mesh = false; //also the positions of the fitted face
+	//Mesh stream of every frame for remote viewers (see MeshStreamEncoder), written to that file or pipe. Empty: none.
+	std::string mesh_stream_path;
+	MeshStreamMode mesh_stream_mode = MeshStreamMode::Mesh;
+	//Recording of the camera frames, landmarks and adapted solver parameters of run, runPipelined and runHeadless (see
+	//InputRecorder), which a benchmark takes as its input_path. Empty: none.
+	std::string input_recording_path;
+	bool input_recording_png = false; //PNG encoded frames instead of raw ones
+	//Energies, steps and PCG residuals of every GN iteration of the solver of the first face, see
+	//GaussNewtonSolver::openConvergenceLog. Empty: none.
+	std::string convergence_log_path;
+	//Basis columns of the morphable model which are loaded, e.g. the largest coefficient counts the solver is configured for.
+	BasisLimits basis_limits;
+	//Tracking snapshot (see writeTrackingSnapshot) of all faces, written every snapshot_interval tracked frames and at the end of
+	//run, runPipelined and runHeadless. Empty: none.
+	std::string snapshot_path;
+	int snapshot_interval = 30;
+	//Snapshot restored before the first frame, so a restarted tracker starts converged. Usually snapshot_path of the run before,
+	//a missing file starts from the mean face with a warning. Empty: none.
+	std::string restore_path;
+	//Identity profile of subject_id in that directory, see IdentityProfileStore: loaded into the first face before the run, which
+	//then skips the calibration phase, or saved at the end of run, runPipelined and runHeadless once the solver locked the
+	//identity of a new subject. Empty: none.
+	std::string identity_store_directory;
+	std::string subject_id;
+	//Server mode: one TrackingSession per input, solved by a SessionScheduler headless. Replaces input_path and the overlay video,
+	//a parameter stream is written per session to parameter_stream_path + "." + index.
+	std::vector<std::string> server_inputs;
+	std::vector<bool> server_offline; //of server_inputs, see SessionKind. Live if missing.
+	SchedulerSettings scheduler; //of the server mode
+	//Server mode: serves util::Metrics and the GPU telemetry on http://<host>:<metrics_port>/metrics. 0 doesn't.
+	int metrics_port = 0;
+	//Offline batch mode on all GPUs, see BatchProcessor. Active if batch.inputs isn't empty, writes to parameter_stream_path.
+	BatchSettings batch;
+	//Benchmark mode, active if benchmark.output_path isn't empty. Solves benchmark.num_frames frames of input_path headless.
+	BenchmarkSettings benchmark;
+	//Kernel benchmark mode, active if kernel_benchmark.output_path isn't empty, see KernelBenchmark.
+	KernelBenchmarkSettings kernel_benchmark;
+	//Comparison mode, active if comparison.output_path isn't empty. Solves input_path with the reference and the configured solver.
+	ComparisonSettings comparison;
+	//Sweep mode, active if sweep.output_path isn't empty. Solves input_path with every configuration of sweep.grid_path.
+	SweepSettings sweep;
+	//Landmark precompute mode, active if landmark_precompute_path isn't empty. Detects the landmarks of input_path frame by frame
+	//in parallel (see Tracker::detectSparseFeaturesOfFrames) and writes them to a landmark cache there, without solving.
+	std::string landmark_precompute_path;
+	//Landmark cache which replaces the tracker in run, runPipelined and runHeadless, see LandmarkCacheReader.
+	std::string landmark_cache_path;
+	//runPipelined: > 0 detects the landmarks beside the solve instead of in front of it, on every async_landmark_interval-th frame
+	//at most (2: half rate). Every frame is solved against the newest detection, extrapolated to it and weighted by its age, see
+	//LatencyCompensator. 0, or a landmark cache: every frame waits for its own landmarks.
+	int async_landmark_interval = 0;
+	LatencyCompensationParameters latency_compensation;
+	//Faces tracked at the same time, they share the morphable model and are solved as a batch. The parameter stream records the first one.
+	int max_faces = 1;
+	//Display and overlay video show the face as the last GN iteration rendered it, before its update, instead of evaluating
+	//and drawing it again. Only with a single face and the GL renderer, otherwise the face is rendered as usual.
+	bool reuse_solver_render = false;
+	//Render the solver's pyramid into the packed visibility buffer instead of the barycentrics and vertex ids targets, see Pyramid.
+	bool packed_visibility = false;
+	//> 0: ROI render targets of at most roi_size x roi_size pixels per level, see SolverParameters::use_roi_rendering.
+	int roi_size = 0;
+	//One atlas for the render targets of all pyramid levels (and one for the ROI targets), see Pyramid.
+	bool render_target_atlas = false;
+	//The composite, the menu and the buffer swap of run and runPipelined happen at most display_rate times per second,
+	//0 presents every processed frame. Together with swap_interval 0 the tracking never waits for the display.
+	float display_rate = 30.0f;
+	int swap_interval = 1; //of the visible window, see Window::setSwapInterval
+	//Chrome trace of trace_num_frames frames from trace_first_frame on (counted from 1), see util::Profiler::startTrace.
+	//Empty: no trace.
+	std::string trace_path;
+	int trace_first_frame = 100;
+	int trace_num_frames = 30;
+	//Render the face without the geometry shader where GL_NV_fragment_shader_barycentric is available, see Face::attachShaders.
+	bool fragment_barycentrics = true;
+	//Plans the device memory of the solver before the run and falls back to a solver strategy that fits, see MemoryPlanner.
+	bool plan_memory = true;
+	size_t memory_limit_mb = 0; //> 0: plan for a card with that much memory, e.g. for the smallest one of a deployment
+	//>= 0: warn about every device array allocated after that many frames, see AllocationTracker::setSteadyStateFrame.
+	int allocation_check_frame = -1;
+};
 
 class Application
 {
 public:
-	Application();
+	explicit Application(const ApplicationSettings& settings = ApplicationSettings());
 	Application(Application&) = delete;
 	Application(Application&& rhs) = delete;
 	Application& operator=(Application&) = delete;
 	Application& operator=(Application&&) = delete;
 
 	void run();
+	//Capture, landmark detection, solve and encode run on their own threads, connected by bounded queues.
+	//Landmarks of frame N+1 are computed while frame N is solved.
+	void runPipelined();
+	//Batch mode, see ApplicationSettings::headless.
+	void runHeadless();
+	//See ApplicationSettings::server_inputs.
+	void runServer();
+	//See ApplicationSettings::landmark_precompute_path.
+	void runLandmarkPrecompute();
+	//See ApplicationSettings::batch.
+	void runBatch();
+	//See ApplicationSettings::benchmark. Frames and landmarks are loaded before the run (see loadBenchmarkFixture), so only the
+	//frame upload, the solve and the parameter update are measured. Writes a JSON report.
+	void runBenchmark();
+	//See ApplicationSettings::kernel_benchmark. Uses the model and the solver parameters of the application, not the input.
+	void runKernelBenchmark();
+	//See ApplicationSettings::comparison and SolverComparison. The candidate is the solver and face configuration of the application.
+	void runComparison();
+	//See ApplicationSettings::sweep and ParameterSweep. The configurations start from the solver parameters of the application.
+	void runSweep();
+	//See ApplicationSettings::plan_memory. Call it once the solver parameters are set, "prefetch" if runPipelined follows.
+	void planMemory(bool prefetch);
+	//See ApplicationSettings::restore_path. Call it once the face and the solver are configured, before the run.
+	void restoreSnapshot();
+	//See ApplicationSettings::identity_store_directory. Call it like restoreSnapshot, before it.
+	void loadIdentityProfile();
+
+	SolverParameters& getSolverParameters() { return m_solver.getSolverParameters(); }
+	TrackerParameters& getTrackerParameters() { return m_tracker.getParameters(); }
+	BudgetParameters& getBudgetParameters() { return m_budget.getParameters(); }
+	Face& getFace() { return m_face; }
 
 private:
+	ApplicationSettings m_settings;
 	cv::VideoCapture m_camera;
+	std::unique_ptr<util::FrameGrabber> m_frame_grabber; //reads m_camera while run, runPipelined or runHeadless is active
+	std::unique_ptr<util::NvdecVideoSource> m_nvdec_source; //replaces m_frame_grabber in run and runHeadless, see gpu_decode
+	std::unique_ptr<util::IpcVideoSource> m_ipc_source; //replaces m_camera, see ipc_input
 	int m_screen_width;
 	int m_screen_height;
 	glm::ivec2 m_gui_position;
@@ -30,29 +192,79 @@ private:
 	GLSLProgram m_fullscreen_shader;
 	glm::mat4 m_projection;
 	Window m_window;
+	std::shared_ptr<util::ExecutionContext> m_context; //streams of m_solver, shared with the faces and m_pyramid
 	Face m_face;
+	//Further faces of the same model and their projections, if max_faces > 1. Entry i is face i + 1 of the tracker.
+	std::vector<std::unique_ptr<Face>> m_extra_faces;
+	std::vector<glm::mat4> m_extra_projections;
 	GaussNewtonSolver m_solver;
 	Tracker m_tracker;
 	Menu m_menu;
+	std::unique_ptr<util::TelemetrySampler> m_telemetry; //read by the menu and the metrics endpoint, started with them
 	GLSLProgram m_face_shader;
 	double m_frame_time{ 0.0 };
+	double m_solve_time{ 0.0 }; //of the last solveFaces, host milliseconds
+	BudgetController m_budget; //of run and runPipelined
+	std::chrono::steady_clock::time_point m_last_display; //see ApplicationSettings::display_rate
 	Pyramid m_pyramid;
+	//Halves the host frames for the tracker where level 1 of the pyramid doesn't fit: in the capture thread of the pipelined
+	//mode, the landmark precompute and for odd frame sizes (level 1 rounds down, cv::pyrDown and the landmark caches up).
+	FrameDownscaler m_frame_downscaler;
 	GLuint m_empty_vao{ 0 };
-	GLuint m_camera_frame_texture{ 0 };
 	GLuint m_video_framebuffer;
 	GLuint m_video_texture;
 	cudaGraphicsResource_t m_video_texture_resource;
 	GLSLProgram m_video_shader;
 	int m_video_width;
 	int m_video_height;
-	cv::VideoWriter m_video_writer;
+	std::unique_ptr<util::VideoWriter> m_video_writer; //null, if no overlay video is written
+	std::unique_ptr<ParameterStreamWriter> m_parameter_writer;
+	std::unique_ptr<SharedMemorySink> m_shared_memory_sink; //see ApplicationSettings::shared_memory_name
+	std::unique_ptr<MeshStreamEncoder> m_mesh_stream_encoder; //see ApplicationSettings::mesh_stream_path
+	std::ofstream m_mesh_stream_file;
+	std::unique_ptr<InputRecorder> m_input_recorder; //see ApplicationSettings::input_recording_path
+	cv::Mat m_recorded_frame; //full resolution frame of the last readFrame, only while recording
+	uint32_t m_num_tracked_frames{ 0 }; //of the snapshots, see ApplicationSettings::snapshot_path
+	std::unique_ptr<IdentityProfileStore> m_identity_store; //see ApplicationSettings::identity_store_directory
+	bool m_identity_from_profile{ false };
+	std::unique_ptr<IdentityCalibrator> m_identity_calibrator; //see SolverParameters::use_joint_calibration, created by solveFaces
+	std::unique_ptr<LandmarkCacheReader> m_landmark_cache; //see ApplicationSettings::landmark_cache_path
+	bool m_landmark_cache_ended{ false };
 
 private:
 	void initGraphics();
 	void initMenuWidgets();
+	//To the parameter stream, the shared memory sink and the mesh stream, if they are open. Takes the tracking snapshots.
+	void writeParameters(bool tracked);
+	//Captures the inputs of the frame's solve, if an input recording is written. Committed after Profiler::endFrame.
+	void recordInput(const cv::Mat& raw_frame, const std::vector<std::vector<glm::vec2>>& sparse_features);
+	//See ApplicationSettings::snapshot_path.
+	void writeSnapshot();
+	//Of a new subject, if its identity is locked by now.
+	void saveIdentityProfile();
+	void closeParameterStream();
 	void reloadShaders();
-	void draw(cv::Mat& frame);
-	void saveVideoFrame(cv::Mat& frame, std::vector<glm::vec2>& features = std::vector<glm::vec2>());
+	//Of the tracker, or the next frame of m_landmark_cache. "frame" is the tracker's frame, see readFrame.
+	std::vector<std::vector<glm::vec2>> getSparseFeatures(const cv::Mat& frame);
+	//One entry of landmarks per face, see Tracker::getSparseFeaturesOfFaces.
+	void solveFaces(const std::vector<std::vector<glm::vec2>>& sparse_features);
+	//Calibration phase of SolverParameters::use_joint_calibration for m_face, after its solve. Faces of a batch lock on their own.
+	void calibrateIdentity(const std::vector<glm::vec2>& sparse_features);
+	//Uploads the next input frame into the pyramid and returns its downsampled copy for the tracker. False at the end of the input.
+	bool readFrame(cv::Mat& frame);
+	//m_nvdec_source, if gpu_decode is set and NVDEC is available, otherwise m_frame_grabber.
+	void openInput();
+	//Draws m_face and the tracked extra faces into the render targets of level 0.
+	void renderFaces(const std::vector<std::vector<glm::vec2>>& sparse_features);
+	void draw();
+	//True once per 1 / display_rate seconds, the caller presents then.
+	bool isDisplayDue();
+	//Renders the video frame and hands it to the video writer. Without features it is read back asynchronously,
+	//otherwise they are drawn into the read back frame first. Must be called on the thread which owns the GL context.
+	void saveVideoFrame(std::vector<glm::vec2>& features = std::vector<glm::vec2>());
+	void renderVideoFrame();
+	//Renders the video frame and reads it back synchronously.
+	cv::Mat readVideoFrame(std::vector<glm::vec2>& features = std::vector<glm::vec2>());
 
 	//If you are calling this function. Make sure m_face uses "final.off".
 	void printUniqueFaceVerticesSparse();
@@ -0,0 +1,101 @@
+#include "async_image_writer.h"
+#include "profiler.h"
+#include "util.h"
+#include "thread_placement.h"
+
+#include <chrono>
+#include <iostream>
+#include "opencv2/highgui/highgui.hpp"
+
+namespace util
+{
+	AsyncImageWriter::AsyncImageWriter(int num_buffers)
+		: m_slots(num_buffers)
+		, m_free_slots(num_buffers)
+		, m_filled_slots(num_buffers)
+	{
+		for (int i = 0; i < num_buffers; ++i)
+		{
+			CHECK_CUDA_ERROR(cudaEventCreateWithFlags(&m_slots[i].copied, cudaEventDisableTiming));
+			int slot = i;
+			m_free_slots.tryPush(std::move(slot));
+		}
+
+		m_writer = std::thread(&AsyncImageWriter::write, this);
+	}
+
+	AsyncImageWriter::~AsyncImageWriter()
+	{
+		m_stop = true;
+		m_writer.join();
+
+		for (auto& slot : m_slots)
+		{
+			CHECK_CUDA_ERROR(cudaFreeHost(slot.pixels));
+			CHECK_CUDA_ERROR(cudaEventDestroy(slot.copied));
+		}
+
+		if (m_num_dropped_images > 0)
+		{
+			std::cout << "Warning: " << m_num_dropped_images << " debug images were dropped, the writer couldn't keep up!" << std::endl;
+		}
+	}
+
+	bool AsyncImageWriter::enqueue(const unsigned char* pixels, int width, int height, const std::string& filepath, cudaStream_t stream)
+	{
+		int index;
+		if (!m_free_slots.tryPop(index))
+		{
+			m_num_dropped_images++;
+			return false;
+		}
+
+		auto& slot = m_slots[index];
+		const size_t size = static_cast<size_t>(width) * height * 3;
+		if (slot.capacity < size)
+		{
+			CHECK_CUDA_ERROR(cudaFreeHost(slot.pixels));
+			CHECK_CUDA_ERROR(cudaMallocHost(&slot.pixels, size));
+			slot.capacity = size;
+		}
+		slot.width = width;
+		slot.height = height;
+		slot.filepath = filepath;
+		CHECK_CUDA_ERROR(cudaMemcpyAsync(slot.pixels, pixels, size, cudaMemcpyDeviceToHost, stream));
+		CHECK_CUDA_ERROR(cudaEventRecord(slot.copied, stream));
+
+		m_filled_slots.tryPush(std::move(index)); //can't fail, there are only as many slots as places in the queue
+		return true;
+	}
+
+	void AsyncImageWriter::write()
+	{
+		ThreadPlacement::get().apply(ThreadStage::Io);
+		int index;
+		while (true)
+		{
+			if (!m_filled_slots.tryPop(index))
+			{
+				//Drain the queue before stopping.
+				if (m_stop.load())
+				{
+					break;
+				}
+				//Images are rare, unlike video frames there is no point in spinning.
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				continue;
+			}
+
+			auto& slot = m_slots[index];
+			CHECK_CUDA_ERROR(cudaEventSynchronize(slot.copied));
+			{
+				ScopedTimer timer("Debug image write");
+				if (!cv::imwrite(slot.filepath, cv::Mat(slot.height, slot.width, CV_8UC3, slot.pixels)))
+				{
+					std::cout << "Warning: Couldn't write the debug image " << slot.filepath << "!" << std::endl;
+				}
+			}
+			m_free_slots.tryPush(std::move(index));
+		}
+	}
+}
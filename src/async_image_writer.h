@@ -0,0 +1,52 @@
+#pragma once
+
+#include "spsc_queue.h"
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cuda_runtime.h>
+
+namespace util
+{
+	//Copies 8-bit BGR images from device memory into a ring of pinned host buffers with async copies and writes them with
+	//cv::imwrite on its own thread. Like a live AsyncVideoWriter, enqueue() never waits for the copy or the encoder, if the ring is
+	//full the image is dropped instead.
+	class AsyncImageWriter
+	{
+	public:
+		explicit AsyncImageWriter(int num_buffers = 4);
+		//Writes all queued images before returning.
+		~AsyncImageWriter();
+
+		AsyncImageWriter(const AsyncImageWriter&) = delete;
+		AsyncImageWriter& operator=(const AsyncImageWriter&) = delete;
+
+		//"pixels" (device, width x height x 3, BGR) is copied on "stream", so it may be overwritten by work queued on it afterwards.
+		//A buffer smaller than the image is reallocated, which synchronizes once, e.g. for the first image.
+		bool enqueue(const unsigned char* pixels, int width, int height, const std::string& filepath, cudaStream_t stream);
+		int getNumberOfDroppedImages() const { return m_num_dropped_images; }
+
+	private:
+		struct Slot
+		{
+			unsigned char* pixels = nullptr; //pinned
+			size_t capacity = 0;
+			int width = 0;
+			int height = 0;
+			std::string filepath;
+			cudaEvent_t copied = nullptr;
+		};
+
+		void write();
+
+	private:
+		std::vector<Slot> m_slots;
+		SpscQueue<int> m_free_slots;	//writer -> enqueue
+		SpscQueue<int> m_filled_slots;	//enqueue -> writer
+		std::atomic<bool> m_stop{ false };
+		std::thread m_writer;
+		int m_num_dropped_images{ 0 };
+	};
+}
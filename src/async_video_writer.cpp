@@ -0,0 +1,112 @@
+#include "async_video_writer.h"
+#include "profiler.h"
+#include "util.h"
+#include "thread_placement.h"
+
+#include <iostream>
+
+namespace util
+{
+	AsyncVideoWriter::AsyncVideoWriter(const std::string& filepath, int fourcc, double fps, int width, int height, bool lossless, int num_buffers)
+		: m_writer(filepath, fourcc, fps, cv::Size(width, height))
+		, m_width(width)
+		, m_height(height)
+		, m_lossless(lossless)
+		, m_slots(num_buffers)
+		, m_free_slots(num_buffers)
+		, m_filled_slots(num_buffers)
+	{
+		CHECK_CUDA_ERROR(cudaStreamCreate(&m_stream));
+		for (int i = 0; i < num_buffers; ++i)
+		{
+			CHECK_CUDA_ERROR(cudaMallocHost(&m_slots[i].pixels, m_width * m_height * 4));
+			CHECK_CUDA_ERROR(cudaEventCreateWithFlags(&m_slots[i].copied, cudaEventDisableTiming));
+			int slot = i;
+			m_free_slots.tryPush(std::move(slot));
+		}
+
+		m_encoder = std::thread(&AsyncVideoWriter::encode, this);
+	}
+
+	AsyncVideoWriter::~AsyncVideoWriter()
+	{
+		m_stop = true;
+		m_filled_slots.wake();
+		m_encoder.join();
+
+		for (auto& slot : m_slots)
+		{
+			CHECK_CUDA_ERROR(cudaFreeHost(slot.pixels));
+			CHECK_CUDA_ERROR(cudaEventDestroy(slot.copied));
+		}
+		CHECK_CUDA_ERROR(cudaStreamDestroy(m_stream));
+
+		if (m_num_dropped_frames > 0)
+		{
+			std::cout << "Warning: " << m_num_dropped_frames << " video frames were dropped, the encoder couldn't keep up!" << std::endl;
+		}
+	}
+
+	int AsyncVideoWriter::acquireSlot()
+	{
+		//The encoder thread runs until the destructor, so a lossless wait always ends.
+		int slot;
+		if (m_lossless ? !m_free_slots.pop(slot, m_stop) : !m_free_slots.tryPop(slot))
+		{
+			m_num_dropped_frames++;
+			return -1;
+		}
+		return slot;
+	}
+
+	bool AsyncVideoWriter::enqueue(cudaGraphicsResource_t resource)
+	{
+		int slot = acquireSlot();
+		if (slot < 0)
+		{
+			return false;
+		}
+
+		CHECK_CUDA_ERROR(cudaGraphicsMapResources(1, &resource, m_stream));
+		cudaArray_t array = nullptr;
+		CHECK_CUDA_ERROR(cudaGraphicsSubResourceGetMappedArray(&array, resource, 0, 0));
+		CHECK_CUDA_ERROR(cudaMemcpy2DFromArrayAsync(m_slots[slot].pixels, m_width * 4, array, 0, 0, m_width * 4, m_height, cudaMemcpyDeviceToHost, m_stream));
+		CHECK_CUDA_ERROR(cudaEventRecord(m_slots[slot].copied, m_stream));
+		CHECK_CUDA_ERROR(cudaGraphicsUnmapResources(1, &resource, m_stream));
+
+		m_filled_slots.tryPush(std::move(slot)); //can't fail, there are only as many slots as places in the queue
+		return true;
+	}
+
+	bool AsyncVideoWriter::enqueue(const cv::Mat& frame)
+	{
+		int slot = acquireSlot();
+		if (slot < 0)
+		{
+			return false;
+		}
+
+		cv::Mat pixels(m_height, m_width, CV_8UC4, m_slots[slot].pixels);
+		frame.copyTo(pixels);
+		CHECK_CUDA_ERROR(cudaEventRecord(m_slots[slot].copied, m_stream));
+
+		m_filled_slots.tryPush(std::move(slot));
+		return true;
+	}
+
+	void AsyncVideoWriter::encode()
+	{
+		ThreadPlacement::get().apply(ThreadStage::Encode);
+		//Sleeps while there is nothing to encode. The queue is drained before stopping.
+		int slot;
+		while (m_filled_slots.pop(slot, m_stop))
+		{
+			CHECK_CUDA_ERROR(cudaEventSynchronize(m_slots[slot].copied));
+			{
+				ScopedTimer timer("Video encode");
+				m_writer.write(cv::Mat(m_height, m_width, CV_8UC4, m_slots[slot].pixels));
+			}
+			m_free_slots.tryPush(std::move(slot));
+		}
+	}
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "spsc_queue.h"
+#include "video_writer.h"
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cuda_runtime.h>
+#include "opencv2/videoio/videoio.hpp"
+
+namespace util
+{
+	//Reads frames back from a CUDA registered GL texture into a ring of pinned host buffers with async copies and encodes them
+	//on its own thread. enqueue() never waits for the copy. If the ring is full, it drops the frame, or waits for the encoder if lossless.
+	class AsyncVideoWriter : public VideoWriter
+	{
+	public:
+		AsyncVideoWriter(const std::string& filepath, int fourcc, double fps, int width, int height, bool lossless, int num_buffers = 4);
+		//Encodes all queued frames before returning.
+		~AsyncVideoWriter();
+
+		AsyncVideoWriter(const AsyncVideoWriter&) = delete;
+		AsyncVideoWriter& operator=(const AsyncVideoWriter&) = delete;
+
+		bool isOpened() const override { return m_writer.isOpened(); }
+		bool enqueue(cudaGraphicsResource_t resource) override;
+		bool enqueue(const cv::Mat& frame) override;
+		int getNumberOfDroppedFrames() const override { return m_num_dropped_frames; }
+
+	private:
+		struct Slot
+		{
+			unsigned char* pixels = nullptr; //pinned
+			cudaEvent_t copied = nullptr;
+		};
+
+		int acquireSlot();
+		void encode();
+
+	private:
+		cv::VideoWriter m_writer;
+		int m_width;
+		int m_height;
+		bool m_lossless;
+		cudaStream_t m_stream{ nullptr };
+		std::vector<Slot> m_slots;
+		SpscQueue<int> m_free_slots;	//encoder -> enqueue
+		SpscQueue<int> m_filled_slots;	//enqueue -> encoder
+		std::atomic<bool> m_stop{ false };
+		std::thread m_encoder;
+		int m_num_dropped_frames{ 0 };
+	};
+}
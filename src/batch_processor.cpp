@@ -0,0 +1,447 @@
+#include "batch_processor.h"
+#include "face.h"
+#include "pyramid.h"
+#include "glsl_program.h"
+#include "landmark_cache.h"
+#include "mapped_file.h"
+#include "profiler.h"
+#include "tracking_snapshot.h"
+#include "util.h"
+
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+#include <cuda_gl_interop.h>
+#include <glm/ext/matrix_clip_space.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/highgui/highgui.hpp"
+
+namespace
+{
+	std::string getCheckpointPath(const std::string& parameter_stream_path)
+	{
+		return parameter_stream_path + ".snapshot";
+	}
+
+	bool exists(const std::string& path)
+	{
+		return std::ifstream(path).good();
+	}
+
+	//Coefficients and pose of "source", with its identity locked in "target".
+	void copyFaceState(const Face& source, Face& target)
+	{
+		target.getShapeCoefficients() = source.getShapeCoefficients();
+		target.getAlbedoCoefficients() = source.getAlbedoCoefficients();
+		target.getExpressionCoefficients() = source.getExpressionCoefficients();
+		target.getSHCoefficients() = source.getSHCoefficients();
+		target.getRotationCoefficients() = source.getRotationCoefficients();
+		target.getTranslationCoefficients() = source.getTranslationCoefficients();
+		target.setActiveCoefficients(source.getNumActiveShapeCoefficients(), source.getNumActiveExpressionCoefficients(),
+			source.getNumActiveAlbedoCoefficients());
+		target.lockIdentity();
+		target.invalidateFace();
+	}
+}
+
+BatchProcessor::BatchProcessor(const BatchSettings& settings, const SolverParameters& solver_parameters, const TrackerParameters& tracker_parameters)
+	: m_settings(settings)
+	, m_solver_parameters(solver_parameters)
+	, m_tracker_parameters(tracker_parameters)
+{
+	if (m_settings.devices.empty())
+	{
+		int device_count = 0;
+		CHECK_CUDA_ERROR(cudaGetDeviceCount(&device_count));
+		for (int i = 0; i < device_count; ++i)
+		{
+			m_settings.devices.push_back(i);
+		}
+	}
+	m_tracker_parameters.max_faces = 1;
+	if (m_settings.num_shards < 1 || m_settings.shard_index < 0 || m_settings.shard_index >= m_settings.num_shards)
+	{
+		throw std::runtime_error("Error: Shard " + std::to_string(m_settings.shard_index) + " of " + std::to_string(m_settings.num_shards) + " doesn't exist!");
+	}
+	if (!m_settings.landmark_caches.empty() && m_settings.landmark_caches.size() != m_settings.inputs.size())
+	{
+		throw std::runtime_error("Error: The batch needs one landmark cache per input!");
+	}
+}
+
+void BatchProcessor::buildClips()
+{
+	//Whole keyframe intervals, so the delta encoded clips concatenate to a valid stream.
+	const int interval = ParameterStreamWriter::kKeyframeInterval;
+	const int clip_length = m_settings.clip_length > 0 ? (m_settings.clip_length + interval - 1) / interval * interval : 0;
+
+	m_clips.resize(m_settings.inputs.size());
+	int clip_index = 0;
+	for (int video = 0; video < m_settings.inputs.size(); ++video)
+	{
+		cv::VideoCapture capture(m_settings.inputs[video]);
+		if (!capture.isOpened())
+		{
+			throw std::runtime_error("Error: Could not open the input " + m_settings.inputs[video]);
+		}
+
+		//Some containers don't know their length, those stay in one piece.
+		const int num_frames = static_cast<int>(capture.get(cv::CAP_PROP_FRAME_COUNT));
+		const int n_clips = clip_length > 0 && num_frames > 0 ? (num_frames + clip_length - 1) / clip_length : 1;
+		for (int i = 0; i < n_clips; ++i)
+		{
+			Clip clip;
+			clip.video = video;
+			clip.index = clip_index++;
+			clip.first_frame = i * clip_length;
+			clip.num_frames = n_clips > 1 ? std::min(clip_length, num_frames - clip.first_frame) : 0;
+			clip.parameter_stream_path = m_settings.output_path + "." + std::to_string(video) + "." + std::to_string(i) + ".part";
+			if (i > 0)
+			{
+				clip.previous_checkpoint_path = getCheckpointPath(m_clips[video].back().parameter_stream_path);
+			}
+			m_clips[video].push_back(clip);
+		}
+	}
+
+	//Longest videos first, so the node doesn't end with one device working on a long tail.
+	std::vector<int> order(m_clips.size());
+	for (int i = 0; i < order.size(); ++i)
+	{
+		order[i] = i;
+	}
+	std::sort(order.begin(), order.end(), [&](int a, int b) { return m_clips[a].size() > m_clips[b].size(); });
+	int num_skipped = 0;
+	for (int video : order)
+	{
+		for (const auto& clip : m_clips[video])
+		{
+			if (clip.index % m_settings.num_shards != m_settings.shard_index)
+			{
+				continue;
+			}
+			if (m_settings.resume && exists(getCheckpointPath(clip.parameter_stream_path)) && exists(clip.parameter_stream_path))
+			{
+				num_skipped++;
+				continue;
+			}
+			m_queue.push_back(clip);
+		}
+	}
+	if (num_skipped > 0)
+	{
+		std::cout << "Resuming: " << num_skipped << " clips are done already, " << m_queue.size() << " remain" << std::endl;
+	}
+}
+
+bool BatchProcessor::popClip(Clip& clip)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_queue.empty())
+	{
+		return false;
+	}
+	clip = m_queue.front();
+	m_queue.pop_front();
+	return true;
+}
+
+void BatchProcessor::run()
+{
+	buildClips();
+
+	//CUDA events of the profiler belong to one device, the workers would share its pool.
+	util::Profiler::get().setEnabled(false);
+
+	//GLFW creates windows on the main thread only. Each worker makes its context current on its own thread.
+	std::vector<GLFWwindow*> contexts;
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 5);
+	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+	glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+	for (int i = 0; i < m_settings.devices.size(); ++i)
+	{
+		auto context = glfwCreateWindow(1, 1, "Face2Face worker", nullptr, nullptr);
+		if (!context)
+		{
+			throw std::runtime_error("GLFW could not create the context of a worker");
+		}
+		contexts.push_back(context);
+	}
+	auto main_context = glfwGetCurrentContext();
+	glfwMakeContextCurrent(nullptr);
+
+	auto start = std::chrono::high_resolution_clock::now();
+	std::vector<std::thread> workers;
+	for (int i = 0; i < m_settings.devices.size(); ++i)
+	{
+		workers.emplace_back(&BatchProcessor::runWorker, this, m_settings.devices[i], contexts[i]);
+	}
+	for (auto& worker : workers)
+	{
+		worker.join();
+	}
+
+	glfwMakeContextCurrent(main_context);
+	for (auto context : contexts)
+	{
+		glfwDestroyWindow(context);
+	}
+
+	for (int video = 0; video < m_clips.size(); ++video)
+	{
+		mergeVideo(video);
+	}
+
+	auto end = std::chrono::high_resolution_clock::now();
+	auto seconds = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() / 1000.0;
+	std::cout << "Processed " << m_num_processed_frames << " frames of " << m_clips.size() << " videos on " << m_settings.devices.size()
+		<< " devices in " << seconds << " s, " << m_num_processed_frames / seconds << " fps" << std::endl;
+}
+
+void BatchProcessor::mergeVideo(int video)
+{
+	std::vector<std::string> parts;
+	for (const auto& clip : m_clips[video])
+	{
+		if (!exists(getCheckpointPath(clip.parameter_stream_path)))
+		{
+			std::cout << m_settings.inputs[video] << ": clip " << parts.size() << " isn't done, the shard which finishes it merges the video" << std::endl;
+			return;
+		}
+		parts.push_back(clip.parameter_stream_path);
+	}
+
+	//Shards which finish at the same time merge into files of their own, the renamed output is complete either way.
+	const auto output = m_clips.size() == 1 ? m_settings.output_path : m_settings.output_path + "." + std::to_string(video);
+	const auto temporary_output = output + ".tmp" + std::to_string(m_settings.shard_index);
+	mergeParameterStreams(parts, temporary_output);
+	if (!util::replaceFile(temporary_output, output))
+	{
+		throw std::runtime_error("Error: Could not replace the parameter stream " + output);
+	}
+
+	//Another shard may still be merging the same clips.
+	if (m_settings.num_shards == 1)
+	{
+		for (const auto& part : parts)
+		{
+			std::remove(part.c_str());
+			std::remove(getCheckpointPath(part).c_str());
+		}
+	}
+}
+
+void BatchProcessor::runWorker(int device, void* context)
+{
+	CHECK_CUDA_ERROR(cudaSetDevice(device));
+	glfwMakeContextCurrent(static_cast<GLFWwindow*>(context));
+
+	//Interop with a GL context on another GPU works, but goes through copies. Render inside the solver then, so only the
+	//frame upload touches GL.
+	SolverParameters solver_parameters(m_solver_parameters);
+	unsigned int gl_device_count = 0;
+	int gl_devices[8];
+	cudaGLGetDevices(&gl_device_count, gl_devices, 8, cudaGLDeviceListAll);
+	if (std::find(gl_devices, gl_devices + gl_device_count, device) == gl_devices + gl_device_count)
+	{
+		solver_parameters.use_cuda_rasterizer = true;
+	}
+
+	{
+		GLSLProgram face_shader;
+		Face::attachShaders(face_shader);
+		face_shader.link();
+
+		//The first face loads the model to this device, the faces of the clips share it.
+		Face model_face(m_settings.model_directory);
+		Tracker tracker;
+		tracker.getParameters() = m_tracker_parameters;
+
+		Clip clip;
+		while (popClip(clip))
+		{
+			processClip(clip, device, solver_parameters, model_face.getModel(), face_shader, tracker);
+		}
+	}
+
+	CHECK_CUDA_ERROR(cudaDeviceSynchronize());
+	glfwMakeContextCurrent(nullptr);
+}
+
+void BatchProcessor::processClip(const Clip& clip, int device, const SolverParameters& solver_parameters, std::shared_ptr<FaceModel> model,
+	const GLSLProgram& face_shader, Tracker& tracker)
+{
+	cv::VideoCapture capture(m_settings.inputs[clip.video]);
+	//The checkpoint of the clip before is the state of the frame before this clip, the warmup isn't needed then.
+	const bool warm_start = !clip.previous_checkpoint_path.empty() && exists(clip.previous_checkpoint_path);
+	const int warmup = warm_start ? 0 : std::min(clip.first_frame, std::max(m_settings.warmup_frames, 0));
+	capture.set(cv::CAP_PROP_POS_FRAMES, clip.first_frame - warmup);
+
+	std::unique_ptr<LandmarkCacheReader> landmark_cache;
+	if (!m_settings.landmark_caches.empty() && !m_settings.landmark_caches[clip.video].empty())
+	{
+		landmark_cache = std::make_unique<LandmarkCacheReader>(m_settings.landmark_caches[clip.video]);
+		landmark_cache->seek(clip.first_frame - warmup);
+	}
+
+	const int width = capture.get(cv::CAP_PROP_FRAME_WIDTH);
+	const int height = capture.get(cv::CAP_PROP_FRAME_HEIGHT);
+	if (landmark_cache && (landmark_cache->getHeader().frame_width != (width + 1) / 2 || landmark_cache->getHeader().frame_height != (height + 1) / 2))
+	{
+		throw std::runtime_error("Error: The landmark cache " + m_settings.landmark_caches[clip.video] + " was written for another frame size!");
+	}
+
+	//A fresh face and solver per clip, only the checkpoint of the clip before carries over.
+	Face face(model);
+	Pyramid pyramid(m_settings.number_of_pyramid_levels, width, height);
+	GaussNewtonSolver solver(solver_parameters);
+	glm::mat4 projection = glm::perspectiveRH_NO(glm::radians(60.0f), pyramid.getAspectRatio(), 0.01f, 10.0f);
+	if (warm_start)
+	{
+		readTrackingSnapshot(clip.previous_checkpoint_path, { &face }, { &projection }, solver);
+	}
+	face.getGraphicsSettings().shader = &face_shader;
+	face_shader.use();
+	face_shader.setMat4("projection", projection);
+	tracker.reset();
+
+	ParameterStreamWriter writer(clip.parameter_stream_path, face, m_settings.encoding);
+
+	cv::Mat raw_frame;
+	cv::Mat frame;
+	std::vector<std::vector<glm::vec2>> cached_features;
+	auto readFrame = [&](std::vector<glm::vec2>& sparse_features)
+	{
+		if (!capture.read(raw_frame))
+		{
+			return false;
+		}
+
+		sparse_features.clear();
+		if (landmark_cache)
+		{
+			//A cache which ended leaves the remaining frames untracked, like in Application::getSparseFeatures.
+			if (landmark_cache->read(cached_features) && !cached_features.empty())
+			{
+				sparse_features = cached_features[0];
+			}
+		}
+		else
+		{
+			cv::pyrDown(raw_frame, frame);
+			sparse_features = tracker.getSparseFeatures(frame);
+		}
+		return true;
+	};
+
+	//Frame batches: one face, pyramid and projection per frame of a batch, in the solver's face slots 0 to batch size - 1.
+	const int frame_batch_size = std::max(m_settings.frame_batch_size, 1);
+	std::vector<std::unique_ptr<Face>> frame_faces;
+	std::vector<std::unique_ptr<Pyramid>> frame_pyramids;
+	std::vector<glm::mat4> frame_projections;
+	std::vector<std::vector<glm::vec2>> frame_features(frame_batch_size);
+	int last_slot = -1; //of the last solved frame
+
+	int number_of_frames = 0;
+	int i = 0;
+	bool ended = false;
+	while (!ended && (clip.num_frames == 0 || i < warmup + clip.num_frames))
+	{
+		//Frames are solved one by one until the identity is locked, the faces of a batch share it.
+		if (frame_batch_size == 1 || !face.isIdentityLocked())
+		{
+			auto& sparse_features = frame_features[0];
+			if (!readFrame(sparse_features))
+			{
+				break;
+			}
+			pyramid.uploadFrame(raw_frame, solver.getStream());
+			solver.solve(sparse_features, face, projection, pyramid);
+			if (i >= warmup)
+			{
+				writer.write(face, projection, !sparse_features.empty());
+				number_of_frames++;
+			}
+			i++;
+			continue;
+		}
+
+		//Every slot starts from the last frame solved one by one. Later on slot b continues from frame b of the batch before,
+		//so its temporal prediction spans a batch.
+		if (frame_faces.empty())
+		{
+			const auto state = solver.getFaceState(0);
+			for (int b = 0; b < frame_batch_size; ++b)
+			{
+				frame_faces.push_back(std::make_unique<Face>(model));
+				frame_faces.back()->getGraphicsSettings().shader = &face_shader;
+				copyFaceState(face, *frame_faces.back());
+				frame_pyramids.push_back(std::make_unique<Pyramid>(m_settings.number_of_pyramid_levels, width, height));
+				solver.setFaceState(state, b);
+			}
+			frame_projections.assign(frame_batch_size, projection);
+		}
+
+		//The end of the clip or the video cuts the last batch short.
+		int batch_size = 0;
+		while (batch_size < frame_batch_size && (clip.num_frames == 0 || i + batch_size < warmup + clip.num_frames))
+		{
+			if (!readFrame(frame_features[batch_size]))
+			{
+				ended = true;
+				break;
+			}
+			frame_pyramids[batch_size]->uploadFrame(raw_frame, solver.getStream());
+			batch_size++;
+		}
+		if (batch_size == 0)
+		{
+			break;
+		}
+
+		std::vector<std::vector<glm::vec2>> batch_features(frame_features.begin(), frame_features.begin() + batch_size);
+		std::vector<Face*> batch_faces;
+		std::vector<glm::mat4*> batch_projections;
+		std::vector<const Pyramid*> batch_pyramids;
+		for (int b = 0; b < batch_size; ++b)
+		{
+			batch_faces.push_back(frame_faces[b].get());
+			batch_projections.push_back(&frame_projections[b]);
+			batch_pyramids.push_back(frame_pyramids[b].get());
+		}
+		solver.solveBatch(batch_features, batch_faces, batch_projections, batch_pyramids);
+
+		for (int b = 0; b < batch_size; ++b, ++i)
+		{
+			if (i >= warmup)
+			{
+				writer.write(*frame_faces[b], frame_projections[b], !frame_features[b].empty());
+				number_of_frames++;
+			}
+		}
+		last_slot = batch_size - 1;
+	}
+
+	//The checkpoint and the header of the stream are those of the last frame.
+	if (last_slot >= 0)
+	{
+		copyFaceState(*frame_faces[last_slot], face);
+		projection = frame_projections[last_slot];
+		solver.setFaceState(solver.getFaceState(last_slot), 0);
+	}
+	writer.close(face);
+	//Written after the stream is closed, so a clip with a checkpoint is complete.
+	writeTrackingSnapshot(getCheckpointPath(clip.parameter_stream_path), { &face }, { &projection }, solver, number_of_frames);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_num_processed_frames += number_of_frames;
+	std::cout << "Device " << device << ": " << m_settings.inputs[clip.video] << " frames " << clip.first_frame << " - "
+		<< clip.first_frame + number_of_frames << std::endl;
+}
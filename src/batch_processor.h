@@ -0,0 +1,83 @@
+#pragma once
+
+#include "gauss_newton_solver.h"
+#include "tracker.h"
+#include "parameter_stream.h"
+
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct BatchSettings
+{
+	std::vector<std::string> inputs;
+	//Merged parameter stream of input i: output_path for a single input, otherwise output_path + "." + i.
+	std::string output_path = "parameters.fpst";
+	ParameterEncoding encoding = ParameterEncoding::Float32;
+	std::string model_directory;
+	int number_of_pyramid_levels = 3;
+
+	//Videos are cut into clips of this many frames (rounded to whole keyframe intervals), 0 keeps them whole.
+	int clip_length = 0;
+	//A clip starts this many frames early. They are solved, but not written, so the clip starts from a converged state.
+	int warmup_frames = ParameterStreamWriter::kKeyframeInterval;
+	std::vector<int> devices; //empty: all devices
+	//> 1: once the identity of a clip is locked, this many consecutive frames are solved together (see GaussNewtonSolver::solveBatch
+	//with a pyramid per frame), so a large GPU gets several systems per GN iteration. A frame of a batch starts from the frame
+	//one batch before, not from the frame before. Needs SolverParameters::use_identity_locking, otherwise frames stay single.
+	int frame_batch_size = 1;
+
+	//Landmark cache of input i (see LandmarkCacheReader) which replaces the detector for its clips. Empty, or an empty entry:
+	//the detector.
+	std::vector<std::string> landmark_caches;
+	//Sharding over nodes with a shared file system: clip c (counted over all videos in input order) is processed by the
+	//node with shard_index c % num_shards. Every node runs with the same inputs and output_path.
+	int shard_index = 0;
+	int num_shards = 1;
+	//Skips the clips that have a checkpoint of an earlier run with the same settings, e.g. after a worker or a node failed.
+	bool resume = false;
+};
+
+//Offline processing of independent videos on all GPUs of a node. Every device gets a worker thread with its own GL context,
+//its own copy of the morphable model and its own solver. The workers take clips from a shared queue, each writes the
+//parameter stream of its clips, which are merged per video in the end.
+//A finished clip leaves a checkpoint next to its stream: the tracking snapshot of its last frame (see writeTrackingSnapshot).
+//It marks the stream as complete, and a clip whose predecessor has one starts from that state instead of the warmup frames.
+//A video is merged by the node that finds the checkpoints of all its clips, the clips stay on disk while other shards run.
+class BatchProcessor
+{
+public:
+	BatchProcessor(const BatchSettings& settings, const SolverParameters& solver_parameters, const TrackerParameters& tracker_parameters);
+
+	//Must be called on the main thread, with GLFW initialized. Returns once every clip is processed and merged.
+	void run();
+
+private:
+	struct Clip
+	{
+		int video = 0;
+		int index = 0; //over all videos, decides the shard
+		int first_frame = 0;
+		int num_frames = 0; //0: until the end of the video
+		std::string parameter_stream_path;
+		std::string previous_checkpoint_path; //of the clip before, empty for the first one
+	};
+
+	void buildClips();
+	bool popClip(Clip& clip);
+	void processClip(const Clip& clip, int device, const SolverParameters& solver_parameters, std::shared_ptr<FaceModel> model,
+		const GLSLProgram& face_shader, Tracker& tracker);
+	void runWorker(int device, void* context);
+	void mergeVideo(int video);
+
+private:
+	BatchSettings m_settings;
+	SolverParameters m_solver_parameters;
+	TrackerParameters m_tracker_parameters;
+
+	std::vector<std::vector<Clip>> m_clips; //per video, in frame order
+	std::mutex m_mutex; //guards m_queue and m_num_processed_frames
+	std::deque<Clip> m_queue;
+	int m_num_processed_frames{ 0 };
+};
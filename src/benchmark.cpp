@@ -0,0 +1,179 @@
+#include "benchmark.h"
+#include "landmark_cache.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/highgui/highgui.hpp"
+
+//False, if the cache is missing, outdated or holds fewer than "num_frames" frames.
+static bool readLandmarkCache(const std::string& filepath, int num_frames, std::vector<std::vector<glm::vec2>>& landmarks)
+{
+	try
+	{
+		LandmarkCacheReader reader(filepath);
+		if (reader.getHeader().num_frames < num_frames)
+		{
+			return false;
+		}
+
+		landmarks.resize(num_frames);
+		std::vector<std::vector<glm::vec2>> sparse_features;
+		for (auto& frame_landmarks : landmarks)
+		{
+			if (!reader.read(sparse_features))
+			{
+				return false;
+			}
+			frame_landmarks = sparse_features[0];
+		}
+		return true;
+	}
+	catch (std::exception&)
+	{
+		return false;
+	}
+}
+
+static BenchmarkFixture loadRecordingFixture(const std::string& filepath, int num_frames)
+{
+	InputRecordingReader reader(filepath);
+	BenchmarkFixture fixture;
+	RecordedFrame record;
+	for (int i = 0; i < std::min(num_frames, reader.getNumberOfFrames()); ++i)
+	{
+		if (!reader.read(i, record))
+		{
+			std::cout << "Warning: Record " << i << " of " << filepath << " is truncated, the recording ends before it." << std::endl;
+			break;
+		}
+		fixture.frames.push_back(record.frame.clone());
+		fixture.landmarks.push_back(record.sparse_features.empty() ? std::vector<glm::vec2>() : record.sparse_features[0]);
+		fixture.controls.push_back(record.controls);
+	}
+	if (fixture.frames.empty())
+	{
+		throw std::runtime_error("Error: The input recording " + filepath + " has no frames!");
+	}
+	return fixture;
+}
+
+BenchmarkFixture loadBenchmarkFixture(const std::string& video_path, int num_frames, Tracker& tracker)
+{
+	if (InputRecordingReader::isRecording(video_path))
+	{
+		return loadRecordingFixture(video_path, num_frames);
+	}
+
+	cv::VideoCapture capture(video_path);
+	if (!capture.isOpened())
+	{
+		throw std::runtime_error("Error: Could not open the input " + video_path);
+	}
+
+	BenchmarkFixture fixture;
+	cv::Mat raw_frame;
+	while (fixture.frames.size() < num_frames && capture.read(raw_frame))
+	{
+		fixture.frames.push_back(raw_frame.clone());
+	}
+	if (fixture.frames.empty())
+	{
+		throw std::runtime_error("Error: The input " + video_path + " has no frames!");
+	}
+
+	const std::string cache_path = video_path + ".landmarks";
+	if (readLandmarkCache(cache_path, fixture.frames.size(), fixture.landmarks))
+	{
+		return fixture;
+	}
+
+	std::cout << "Detecting the landmarks of " << fixture.frames.size() << " frames for " << cache_path << std::endl;
+	tracker.reset();
+	fixture.landmarks.clear();
+	cv::Mat frame;
+	for (const auto& frame_bgr : fixture.frames)
+	{
+		cv::pyrDown(frame_bgr, frame);
+		fixture.landmarks.push_back(tracker.getSparseFeatures(frame));
+	}
+	tracker.reset();
+
+	try
+	{
+		LandmarkCacheWriter writer(cache_path, 1, frame.cols, frame.rows);
+		for (const auto& landmarks : fixture.landmarks)
+		{
+			writer.write({ landmarks });
+		}
+	}
+	catch (std::exception& e)
+	{
+		std::cout << "Warning: Could not write the landmark cache. " << e.what() << std::endl;
+	}
+
+	return fixture;
+}
+
+std::string escapeJson(const std::string& text)
+{
+	std::string escaped;
+	for (char c : text)
+	{
+		if (c == '"' || c == '\\')
+		{
+			escaped += '\\';
+		}
+		escaped += c;
+	}
+	return escaped;
+}
+
+void writeBenchmarkReport(const std::string& filepath, const BenchmarkReport& report)
+{
+	std::ofstream file(filepath);
+	if (!file.is_open())
+	{
+		throw std::runtime_error("Error: Could not open " + filepath + " for writing!");
+	}
+
+	const double frames = std::max(report.num_frames, 1);
+	file << "{" << std::endl
+		<< "  \"input\": \"" << escapeJson(report.input_path) << "\"," << std::endl
+		<< "  \"device\": \"" << escapeJson(report.device_name) << "\"," << std::endl
+		<< "  \"frames\": " << report.num_frames << "," << std::endl
+		<< "  \"tracked_frames\": " << report.num_tracked_frames << "," << std::endl
+		<< "  \"seconds\": " << report.seconds << "," << std::endl
+		<< "  \"fps\": " << (report.seconds > 0.0 ? report.num_frames / report.seconds : 0.0) << "," << std::endl
+		<< "  \"gn_iterations\": " << report.num_gn_iterations << "," << std::endl
+		<< "  \"gn_iterations_per_frame\": " << report.num_gn_iterations / frames << "," << std::endl
+		<< "  \"pcg_iterations\": " << report.num_pcg_iterations << "," << std::endl
+		<< "  \"pcg_iterations_per_frame\": " << report.num_pcg_iterations / frames << "," << std::endl
+		<< "  \"rejected_steps\": " << report.num_rejected_steps << "," << std::endl
+		<< "  \"reused_renders\": " << report.num_reused_renders << "," << std::endl
+		<< "  \"final_loss\": " << report.final_loss << "," << std::endl
+		<< "  \"memory\": {" << std::endl
+		<< "    \"peak_bytes_in_use\": " << report.peak_bytes_in_use << "," << std::endl
+		<< "    \"peak_bytes_reserved\": " << report.peak_bytes_reserved << "," << std::endl
+		<< "    \"peak_device_bytes_used\": " << report.peak_device_bytes_used << std::endl
+		<< "  }," << std::endl
+		<< "  \"stages\": {";
+
+	for (int i = 0; i < report.stages.size(); ++i)
+	{
+		const auto& statistics = report.stages[i].second;
+		file << (i > 0 ? "," : "") << std::endl
+			<< "    \"" << escapeJson(report.stages[i].first) << "\": { \"cpu_p50_ms\": " << statistics.cpu_p50
+			<< ", \"cpu_p99_ms\": " << statistics.cpu_p99;
+		if (statistics.gpu_p50 >= 0.0f)
+		{
+			file << ", \"gpu_p50_ms\": " << statistics.gpu_p50 << ", \"gpu_p99_ms\": " << statistics.gpu_p99;
+		}
+		file << " }";
+	}
+	file << std::endl << "  }" << std::endl << "}" << std::endl;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "tracker.h"
+#include "input_recording.h"
+#include "profiler.h"
+
+#include <glm/glm.hpp>
+#include <cstddef>
+#include <string>
+#include <utility>
+#include <vector>
+#include "opencv2/core/core.hpp"
+
+struct BenchmarkSettings
+{
+	std::string output_path; //JSON report, empty: no benchmark
+	int num_frames = 300; //of the input, decoded into memory before the run
+	//Solved before the measured frames, so the allocator caches, cuBLAS and the CUDA graphs are set up.
+	int warmup_frames = 10;
+};
+
+//Frames of a recorded clip, decoded up front, and the dlib landmarks of each. A run then neither decodes nor detects.
+struct BenchmarkFixture
+{
+	std::vector<cv::Mat> frames; //as read from the capture, BGR
+	std::vector<std::vector<glm::vec2>> landmarks; //of the frames after cv::pyrDown, as the tracker reports them
+	//Of an input recording, applied to the solver parameters before each frame. Empty for a clip.
+	std::vector<RecordedSolverControls> controls;
+};
+
+//Decodes up to num_frames frames of "video_path". The landmarks are read from video_path + ".landmarks", if it covers these frames,
+//otherwise "tracker" detects them and the cache is written. Every run on the same clip sees the same landmarks then.
+//An input recording (see InputRecorder) brings the landmarks of its first face and the solver controls of each frame instead.
+BenchmarkFixture loadBenchmarkFixture(const std::string& video_path, int num_frames, Tracker& tracker);
+
+struct BenchmarkReport
+{
+	std::string input_path;
+	std::string device_name;
+	int num_frames = 0; //measured, without the warmup
+	int num_tracked_frames = 0;
+	double seconds = 0.0;
+
+	//Summed over the measured frames, see SolverStatistics.
+	int num_gn_iterations = 0;
+	int num_pcg_iterations = 0;
+	int num_rejected_steps = 0;
+	int num_reused_renders = 0;
+	float final_loss = -1.0f; //||f|| after the last GN iteration of the last frame, negative if it wasn't tracked
+
+	size_t peak_bytes_in_use = 0; //of the default allocator, since the start of the process
+	size_t peak_bytes_reserved = 0; //sampled once per frame
+	size_t peak_device_bytes_used = 0; //cudaMemGetInfo, includes GL, cuBLAS and other processes on the device
+
+	//Of the profiler, i.e. of the last Profiler::kHistorySize measured frames.
+	std::vector<std::pair<std::string, util::Profiler::Statistics>> stages;
+};
+
+void writeBenchmarkReport(const std::string& filepath, const BenchmarkReport& report);
+//Escapes the quotes and backslashes of a JSON string.
+std::string escapeJson(const std::string& text);
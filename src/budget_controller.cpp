@@ -0,0 +1,114 @@
+#include "budget_controller.h"
+
+#include <algorithm>
+#include <cmath>
+
+constexpr float kHysteresis = 0.05f; //relative error of the frame time which is left alone
+constexpr float kMinDeadlineFraction = 0.25f; //of target_ms, the solve always gets at least that
+constexpr float kMinCoefficientFraction = 0.25f;
+constexpr float kMinDetectionFraction = 0.5f;
+constexpr int kMaxPixelStride = 4;
+
+static int scaleCount(int count, float scale, int minimum = 1)
+{
+	return std::max(static_cast<int>(std::lround(count * scale)), std::min(count, minimum));
+}
+
+void BudgetController::update(float frame_ms, float solve_ms, SolverParameters& solver, TrackerParameters& tracker)
+{
+	if (!m_params.enabled)
+	{
+		if (m_active)
+		{
+			restore(solver, tracker);
+			m_active = false;
+		}
+		return;
+	}
+
+	if (!m_active)
+	{
+		m_base.levels = solver.levels;
+		m_base.num_shape_coefficients = solver.num_shape_coefficients;
+		m_base.num_albedo_coefficients = solver.num_albedo_coefficients;
+		m_base.num_expression_coefficients = solver.num_expression_coefficients;
+		m_base.pixel_sampling_mode = solver.pixel_sampling_mode;
+		m_base.num_pixel_samples = solver.num_pixel_samples;
+		m_base.pixel_sample_stride = solver.pixel_sample_stride;
+		m_base.deadline_ms = solver.deadline_ms;
+		m_base.detection_scale = tracker.detection_scale;
+		m_quality = 1.0f;
+		m_frame_ms = -1.0f;
+		m_other_ms = -1.0f;
+		m_active = true;
+	}
+
+	const float other_ms = std::max(frame_ms - solve_ms, 0.0f);
+	m_frame_ms = m_frame_ms < 0.0f ? frame_ms : m_frame_ms + m_params.smoothing * (frame_ms - m_frame_ms);
+	m_other_ms = m_other_ms < 0.0f ? other_ms : m_other_ms + m_params.smoothing * (other_ms - m_other_ms);
+
+	//The effort is about proportional to the quality, so the ratio of the times says how far to go. Single steps are limited,
+	//a stall of the input shouldn't drop the quality to the minimum at once.
+	const float ratio = m_params.target_ms / std::max(m_frame_ms, 1.0e-3f);
+	if (std::abs(ratio - 1.0f) > kHysteresis)
+	{
+		const float step = std::min(std::max(1.0f + m_params.gain * (ratio - 1.0f), 0.5f), 1.25f);
+		m_quality = std::min(std::max(m_quality * step, m_params.min_quality), 1.0f);
+	}
+
+	apply(solver, tracker);
+	if (m_params.use_deadline)
+	{
+		solver.deadline_ms = std::max(m_params.target_ms - m_other_ms, kMinDeadlineFraction * m_params.target_ms);
+	}
+}
+
+void BudgetController::apply(SolverParameters& solver, TrackerParameters& tracker) const
+{
+	const float q = m_quality;
+	solver.levels = m_base.levels;
+	for (auto& level : solver.levels)
+	{
+		level.num_gn_iterations = scaleCount(level.num_gn_iterations, q);
+		level.num_pcg_iterations = scaleCount(level.num_pcg_iterations, q);
+	}
+
+	const float coefficient_scale = std::max(q, kMinCoefficientFraction);
+	solver.num_shape_coefficients = scaleCount(m_base.num_shape_coefficients, coefficient_scale);
+	solver.num_albedo_coefficients = scaleCount(m_base.num_albedo_coefficients, coefficient_scale);
+	solver.num_expression_coefficients = scaleCount(m_base.num_expression_coefficients, coefficient_scale);
+
+	//A grid of stride s keeps 1 / s^2 of the pixels.
+	const int stride = std::min(static_cast<int>(std::lround(1.0f / std::sqrt(q))), kMaxPixelStride);
+	solver.pixel_sampling_mode = m_base.pixel_sampling_mode;
+	solver.pixel_sample_stride = m_base.pixel_sample_stride;
+	solver.num_pixel_samples = m_base.num_pixel_samples;
+	if (m_base.pixel_sampling_mode == 0 && stride > 1)
+	{
+		solver.pixel_sampling_mode = 2;
+		solver.pixel_sample_stride = stride;
+	}
+	else if (m_base.pixel_sampling_mode == 1)
+	{
+		solver.num_pixel_samples = scaleCount(m_base.num_pixel_samples, q);
+	}
+	else if (m_base.pixel_sampling_mode == 2)
+	{
+		solver.pixel_sample_stride = m_base.pixel_sample_stride * stride;
+	}
+
+	tracker.detection_scale = m_base.detection_scale * std::max(q, kMinDetectionFraction);
+}
+
+void BudgetController::restore(SolverParameters& solver, TrackerParameters& tracker) const
+{
+	solver.levels = m_base.levels;
+	solver.num_shape_coefficients = m_base.num_shape_coefficients;
+	solver.num_albedo_coefficients = m_base.num_albedo_coefficients;
+	solver.num_expression_coefficients = m_base.num_expression_coefficients;
+	solver.pixel_sampling_mode = m_base.pixel_sampling_mode;
+	solver.pixel_sample_stride = m_base.pixel_sample_stride;
+	solver.num_pixel_samples = m_base.num_pixel_samples;
+	solver.deadline_ms = m_base.deadline_ms;
+	tracker.detection_scale = m_base.detection_scale;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "gauss_newton_solver.h"
+#include "tracker.h"
+
+struct BudgetParameters
+{
+	bool enabled = false;
+	float target_ms = 33.0f; //frame time to hold
+	//Quality of the knobs, scaled from 1 (the parameters when the controller was enabled) down to at least min_quality.
+	float min_quality = 0.1f;
+	//Fraction of the relative error of the frame time corrected per frame. Higher reacts faster and overshoots more.
+	float gain = 0.5f;
+	float smoothing = 0.2f; //weight of a new frame time in the moving average
+	//Set SolverParameters::deadline_ms to what the other stages leave of target_ms, so a slow frame still ends in time.
+	bool use_deadline = true;
+};
+
+//Closes the loop between the measured frame time and the effort of the solver and the detector. A quality q in
+//[min_quality, 1] scales the knobs relative to the parameters taken over when the controller is enabled: the GN and PCG
+//iterations of every level and the active coefficients with q, the pixel subsampling of the finest level with 1 / q, and the
+//detection scale with q (at least half of it). q follows target_ms / frame time, within a small band of hysteresis.
+//While enabled the controller owns these knobs, changes from the menu are overwritten. Disabling it restores them.
+class BudgetController
+{
+public:
+	BudgetParameters& getParameters() { return m_params; }
+	float getQuality() const { return m_quality; }
+
+	//After every frame, with its frame time and the time of the solve in it (host milliseconds).
+	void update(float frame_ms, float solve_ms, SolverParameters& solver, TrackerParameters& tracker);
+
+private:
+	//The parameters the controller scales, at full quality.
+	struct Knobs
+	{
+		std::vector<LevelSchedule> levels;
+		int num_shape_coefficients = 0;
+		int num_albedo_coefficients = 0;
+		int num_expression_coefficients = 0;
+		int pixel_sampling_mode = 0;
+		int num_pixel_samples = 0;
+		int pixel_sample_stride = 1;
+		float deadline_ms = 0.0f;
+		float detection_scale = 1.0f;
+	};
+
+	void apply(SolverParameters& solver, TrackerParameters& tracker) const;
+	void restore(SolverParameters& solver, TrackerParameters& tracker) const;
+
+private:
+	BudgetParameters m_params;
+	bool m_active{ false };
+	Knobs m_base;
+	float m_quality{ 1.0f };
+	float m_frame_ms{ -1.0f }; //moving averages, negative before the first frame
+	float m_other_ms{ -1.0f }; //frame time besides the solve
+};
@@ -0,0 +1,537 @@
+#include "device_allocator.h"
+#include "util.h"
+
+#include <algorithm>
+
+namespace util
+{
+	namespace
+	{
+		struct AllocationStreamSet
+		{
+			int device = 0;
+			cudaStream_t streams[kMaxAllocationStreams] = {};
+			int count = 0;
+		};
+
+		std::mutex s_stream_sets_mutex;
+		std::unordered_map<int, AllocationStreamSet> s_stream_sets;
+		int s_next_stream_set = 0; //ids aren't reused, so a freed set can't be mistaken for a later one
+
+		thread_local int t_streams = -1;
+
+		//False, if "id" isn't registered (anymore) or belongs to another device than "device".
+		bool getAllocationStreamSet(int id, int device, AllocationStreamSet& set)
+		{
+			std::lock_guard<std::mutex> lock(s_stream_sets_mutex);
+			auto it = s_stream_sets.find(id);
+			if (it == s_stream_sets.end() || it->second.device != device)
+			{
+				return false;
+			}
+			set = it->second;
+			return true;
+		}
+	}
+
+	int registerAllocationStreams(const cudaStream_t* streams, int count)
+	{
+		AllocationStreamSet set;
+		CHECK_CUDA_ERROR(cudaGetDevice(&set.device));
+		set.count = std::min(count, kMaxAllocationStreams);
+		std::copy(streams, streams + set.count, set.streams);
+
+		std::lock_guard<std::mutex> lock(s_stream_sets_mutex);
+		const int id = s_next_stream_set++;
+		s_stream_sets[id] = set;
+		return id;
+	}
+
+	void unregisterAllocationStreams(int id)
+	{
+		std::lock_guard<std::mutex> lock(s_stream_sets_mutex);
+		s_stream_sets.erase(id);
+	}
+
+	ScopedAllocationStreams::ScopedAllocationStreams(const int streams)
+		: m_previous(t_streams)
+	{
+		t_streams = streams;
+	}
+
+	ScopedAllocationStreams::~ScopedAllocationStreams()
+	{
+		t_streams = m_previous;
+	}
+
+	int getAllocationStreams()
+	{
+		return t_streams;
+	}
+
+	AllocationStats AllocationCounters::load() const
+	{
+		AllocationStats stats;
+		stats.num_allocations = num_allocations;
+		stats.num_deallocations = num_deallocations;
+		stats.num_driver_allocations = num_driver_allocations;
+		stats.num_driver_deallocations = num_driver_deallocations;
+		stats.bytes_in_use = bytes_in_use;
+		stats.peak_bytes_in_use = peak_bytes_in_use;
+		stats.bytes_reserved = bytes_reserved;
+		return stats;
+	}
+
+	void AllocationCounters::subtract(std::atomic<size_t>& counter, size_t bytes)
+	{
+		size_t value = counter.load();
+		while (!counter.compare_exchange_weak(value, value - std::min(bytes, value)))
+		{
+		}
+	}
+
+	void DeviceAllocator::recordAllocation(size_t bytes)
+	{
+		m_stats.num_allocations++;
+		const size_t in_use = m_stats.bytes_in_use += bytes;
+		size_t peak = m_stats.peak_bytes_in_use.load();
+		while (peak < in_use && !m_stats.peak_bytes_in_use.compare_exchange_weak(peak, in_use))
+		{
+		}
+	}
+
+	void DeviceAllocator::recordDeallocation(size_t bytes)
+	{
+		m_stats.num_deallocations++;
+		AllocationCounters::subtract(m_stats.bytes_in_use, bytes);
+	}
+
+	void DeviceAllocator::recordDriverAllocation(size_t bytes)
+	{
+		m_stats.num_driver_allocations++;
+		m_stats.bytes_reserved += bytes;
+	}
+
+	void DeviceAllocator::recordDriverDeallocation(size_t bytes)
+	{
+		m_stats.num_driver_deallocations++;
+		AllocationCounters::subtract(m_stats.bytes_reserved, bytes);
+	}
+
+	CudaDeviceAllocator::CudaDeviceAllocator(cudaStream_t stream)
+		: m_stream(stream)
+	{
+#if CUDART_VERSION >= 11020
+		int device = 0;
+		int pools_supported = 0;
+		CHECK_CUDA_ERROR(cudaGetDevice(&device));
+		CHECK_CUDA_ERROR(cudaDeviceGetAttribute(&pools_supported, cudaDevAttrMemoryPoolsSupported, device));
+		m_stream_ordered = pools_supported != 0;
+
+		//By default a pool releases its memory at every synchronization. Keep it instead, on every device the batch workers
+		//and sessions may allocate on.
+		int n_devices = 0;
+		CHECK_CUDA_ERROR(cudaGetDeviceCount(&n_devices));
+		for (int i = 0; i < n_devices; ++i)
+		{
+			CHECK_CUDA_ERROR(cudaDeviceGetAttribute(&pools_supported, cudaDevAttrMemoryPoolsSupported, i));
+			if (pools_supported)
+			{
+				cudaMemPool_t pool;
+				uint64_t threshold = UINT64_MAX;
+				CHECK_CUDA_ERROR(cudaDeviceGetDefaultMemPool(&pool, i));
+				CHECK_CUDA_ERROR(cudaMemPoolSetAttribute(pool, cudaMemPoolAttrReleaseThreshold, &threshold));
+			}
+		}
+#endif
+	}
+
+	void* CudaDeviceAllocator::allocate(size_t bytes)
+	{
+		void* ptr = nullptr;
+		if (bytes == 0)
+		{
+			return ptr;
+		}
+
+#if CUDART_VERSION >= 11020
+		if (m_stream_ordered)
+		{
+			CHECK_CUDA_ERROR(cudaMallocAsync(&ptr, bytes, m_stream));
+		}
+		else
+#endif
+		{
+			CHECK_CUDA_ERROR(cudaMalloc(&ptr, bytes));
+		}
+
+		recordAllocation(bytes);
+		recordDriverAllocation(bytes);
+
+		return ptr;
+	}
+
+	void CudaDeviceAllocator::deallocate(void* ptr, size_t bytes)
+	{
+		if (ptr == nullptr)
+		{
+			return;
+		}
+
+#if CUDART_VERSION >= 11020
+		if (m_stream_ordered)
+		{
+			CHECK_CUDA_ERROR(cudaFreeAsync(ptr, m_stream));
+		}
+		else
+#endif
+		{
+			CHECK_CUDA_ERROR(cudaFree(ptr));
+		}
+
+		recordDeallocation(bytes);
+		recordDriverDeallocation(bytes);
+	}
+
+	CachingDeviceAllocator::CachingDeviceAllocator(DeviceAllocator& upstream)
+		: m_upstream(upstream)
+	{}
+
+	CachingDeviceAllocator::~CachingDeviceAllocator()
+	{
+		trim();
+	}
+
+	size_t CachingDeviceAllocator::getBucketSize(size_t bytes)
+	{
+		//Powers of two for small blocks, 2 MB steps for large ones (e.g. the Jacobian), so we don't waste up to half of a GB sized block.
+		constexpr size_t kMinBucket = 512;
+		constexpr size_t kLargeStep = 2 * 1024 * 1024;
+
+		if (bytes >= kLargeStep)
+		{
+			return (bytes + kLargeStep - 1) / kLargeStep * kLargeStep;
+		}
+
+		size_t bucket = kMinBucket;
+		while (bucket < bytes)
+		{
+			bucket <<= 1;
+		}
+		return bucket;
+	}
+
+	bool CachingDeviceAllocator::isCapturing()
+	{
+		//Fails with cudaErrorStreamCaptureImplicit while a blocking stream is captured, which isn't sticky.
+		cudaStreamCaptureStatus status = cudaStreamCaptureStatusNone;
+		if (cudaStreamIsCapturing(cudaStreamLegacy, &status) != cudaSuccess)
+		{
+			cudaGetLastError();
+			return true;
+		}
+		return status != cudaStreamCaptureStatusNone;
+	}
+
+	void CachingDeviceAllocator::collectPendingBlocks(DeviceCache& cache, bool capturing)
+	{
+		auto& pending = cache.pending_blocks;
+		for (size_t i = 0; i < pending.size();)
+		{
+			auto& block = pending[i];
+			if (block.num_events == 0)
+			{
+				if (!capturing)
+				{
+					recordEvents(cache, block);
+				}
+				i++;
+				continue;
+			}
+
+			bool completed = true;
+			for (int j = 0; j < block.num_events && completed; ++j)
+			{
+				const cudaError_t status = cudaEventQuery(block.events[j]);
+				if (status == cudaErrorNotReady)
+				{
+					cudaGetLastError(); //not an error of a launch
+					completed = false;
+				}
+				else
+				{
+					CHECK_CUDA_ERROR(status);
+				}
+			}
+			if (!completed)
+			{
+				i++;
+				continue;
+			}
+
+			cache.free_blocks[block.bucket].push_back(block.ptr);
+			cache.events.insert(cache.events.end(), block.events, block.events + block.num_events);
+			block = pending.back();
+			pending.pop_back();
+		}
+	}
+
+	void CachingDeviceAllocator::recordEvents(DeviceCache& cache, PendingBlock& block)
+	{
+		int device = 0;
+		CHECK_CUDA_ERROR(cudaGetDevice(&device));
+		AllocationStreamSet set;
+		if (!getAllocationStreamSet(block.streams, device, set) || set.count == 0)
+		{
+			set.streams[0] = cudaStreamLegacy;
+			set.count = 1;
+		}
+
+		for (int i = 0; i < set.count; ++i)
+		{
+			cudaEvent_t& event = block.events[i];
+			if (cache.events.empty())
+			{
+				CHECK_CUDA_ERROR(cudaEventCreateWithFlags(&event, cudaEventDisableTiming));
+			}
+			else
+			{
+				event = cache.events.back();
+				cache.events.pop_back();
+			}
+			CHECK_CUDA_ERROR(cudaEventRecord(event, set.streams[i]));
+		}
+		block.num_events = set.count;
+	}
+
+	void* CachingDeviceAllocator::allocate(size_t bytes)
+	{
+		if (bytes == 0)
+		{
+			return nullptr;
+		}
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		int device = 0;
+		CHECK_CUDA_ERROR(cudaGetDevice(&device));
+
+		const size_t bucket = getBucketSize(bytes);
+		void* ptr = nullptr;
+
+		auto& cache = m_caches[device];
+		collectPendingBlocks(cache, isCapturing());
+		auto& free_blocks = cache.free_blocks[bucket];
+		if (!free_blocks.empty())
+		{
+			ptr = free_blocks.back();
+			free_blocks.pop_back();
+		}
+		else
+		{
+			ptr = m_upstream.allocate(bucket);
+			recordDriverAllocation(bucket);
+		}
+
+		recordAllocation(bucket);
+
+		return ptr;
+	}
+
+	void CachingDeviceAllocator::deallocate(void* ptr, size_t bytes)
+	{
+		deallocateAfter(ptr, bytes, -1);
+	}
+
+	void CachingDeviceAllocator::deallocateAfter(void* ptr, size_t bytes, int streams)
+	{
+		if (ptr == nullptr)
+		{
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		int device = 0;
+		CHECK_CUDA_ERROR(cudaGetDevice(&device));
+
+		//The events of the block are recorded by collectPendingBlocks, right away outside of a capture.
+		PendingBlock block;
+		block.ptr = ptr;
+		block.bucket = getBucketSize(bytes);
+		block.streams = streams;
+		auto& cache = m_caches[device];
+		cache.pending_blocks.push_back(block);
+		collectPendingBlocks(cache, isCapturing());
+
+		recordDeallocation(block.bucket);
+	}
+
+	void CachingDeviceAllocator::trim()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		int current_device = 0;
+		CHECK_CUDA_ERROR(cudaGetDevice(&current_device));
+		for (auto& device : m_caches)
+		{
+			CHECK_CUDA_ERROR(cudaSetDevice(device.first));
+			auto& cache = device.second;
+
+			//Pending blocks may still be in use, so they are only given back once the device finished with them.
+			for (auto& block : cache.pending_blocks)
+			{
+				for (int i = 0; i < block.num_events; ++i)
+				{
+					CHECK_CUDA_ERROR(cudaEventSynchronize(block.events[i]));
+					cache.events.push_back(block.events[i]);
+				}
+				if (block.num_events == 0)
+				{
+					CHECK_CUDA_ERROR(cudaDeviceSynchronize());
+				}
+				cache.free_blocks[block.bucket].push_back(block.ptr);
+			}
+			cache.pending_blocks.clear();
+
+			for (auto& bucket : cache.free_blocks)
+			{
+				for (auto ptr : bucket.second)
+				{
+					m_upstream.deallocate(ptr, bucket.first);
+					recordDriverDeallocation(bucket.first);
+				}
+				bucket.second.clear();
+			}
+
+			for (auto event : cache.events)
+			{
+				CHECK_CUDA_ERROR(cudaEventDestroy(event));
+			}
+			cache.events.clear();
+		}
+		CHECK_CUDA_ERROR(cudaSetDevice(current_device));
+	}
+
+	FrameArenaAllocator::FrameArenaAllocator(DeviceAllocator& upstream, size_t block_size)
+		: m_upstream(upstream)
+		, m_block_size(block_size)
+	{}
+
+	FrameArenaAllocator::~FrameArenaAllocator()
+	{
+		trim();
+	}
+
+	void* FrameArenaAllocator::allocate(size_t bytes)
+	{
+		if (bytes == 0)
+		{
+			return nullptr;
+		}
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		const size_t aligned_bytes = (bytes + kAlignment - 1) / kAlignment * kAlignment;
+
+		//Find the next block which still has enough space. Blocks are only added, never given back during a frame.
+		while (m_current_block < m_blocks.size() && m_offset + aligned_bytes > m_blocks[m_current_block].size)
+		{
+			m_current_block++;
+			m_offset = 0;
+		}
+
+		if (m_current_block == m_blocks.size())
+		{
+			Block block;
+			block.size = std::max(m_block_size, aligned_bytes);
+			block.ptr = static_cast<char*>(m_upstream.allocate(block.size));
+			m_blocks.push_back(block);
+			m_offset = 0;
+
+			recordDriverAllocation(block.size);
+		}
+
+		void* ptr = m_blocks[m_current_block].ptr + m_offset;
+		m_offset += aligned_bytes;
+
+		recordAllocation(aligned_bytes);
+
+		return ptr;
+	}
+
+	void FrameArenaAllocator::deallocate(void* ptr, size_t bytes)
+	{
+		if (ptr == nullptr)
+		{
+			return;
+		}
+
+		//Memory is recycled as a whole in beginFrame().
+		std::lock_guard<std::mutex> lock(m_mutex);
+		recordDeallocation((bytes + kAlignment - 1) / kAlignment * kAlignment);
+	}
+
+	void FrameArenaAllocator::beginFrame()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		if (m_stats.bytes_in_use > 0)
+		{
+			std::cout << "Warning: Frame arena is reset while " << m_stats.bytes_in_use << " bytes are still in use!" << std::endl;
+		}
+
+		m_current_block = 0;
+		m_offset = 0;
+		m_stats.bytes_in_use = 0;
+	}
+
+	void FrameArenaAllocator::trim()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		for (auto& block : m_blocks)
+		{
+			m_upstream.deallocate(block.ptr, block.size);
+			recordDriverDeallocation(block.size);
+		}
+		m_blocks.clear();
+		m_current_block = 0;
+		m_offset = 0;
+	}
+
+	//The allocators are never destroyed on purpose. Static destructors run after the CUDA runtime may already be unloaded.
+	CudaDeviceAllocator& getCudaAllocator()
+	{
+		static auto allocator = new CudaDeviceAllocator();
+		return *allocator;
+	}
+
+	CachingDeviceAllocator& getCachingAllocator()
+	{
+		static auto allocator = new CachingDeviceAllocator(getCudaAllocator());
+		return *allocator;
+	}
+
+	FrameArenaAllocator& getFrameArena()
+	{
+		static auto allocator = new FrameArenaAllocator(getCudaAllocator());
+		return *allocator;
+	}
+
+	static DeviceAllocator* s_default_allocator = nullptr;
+
+	DeviceAllocator& getDefaultAllocator()
+	{
+		if (s_default_allocator == nullptr)
+		{
+			s_default_allocator = &getCachingAllocator();
+		}
+		return *s_default_allocator;
+	}
+
+	void setDefaultAllocator(DeviceAllocator& allocator)
+	{
+		s_default_allocator = &allocator;
+	}
+}
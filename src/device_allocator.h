@@ -0,0 +1,200 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <cuda_runtime.h>
+
+namespace util
+{
+	struct AllocationStats
+	{
+		size_t num_allocations = 0;				//requests served by the allocator
+		size_t num_deallocations = 0;
+		size_t num_driver_allocations = 0;		//requests that reached cudaMalloc(Async)
+		size_t num_driver_deallocations = 0;
+		size_t bytes_in_use = 0;
+		size_t peak_bytes_in_use = 0;
+		size_t bytes_reserved = 0;				//held from the driver, including cached blocks
+	};
+
+	//The counters behind AllocationStats. Allocators are shared by threads which hold different locks (or none, like the
+	//CUDA allocator), so every counter is atomic on its own.
+	struct AllocationCounters
+	{
+		std::atomic<size_t> num_allocations{ 0 };
+		std::atomic<size_t> num_deallocations{ 0 };
+		std::atomic<size_t> num_driver_allocations{ 0 };
+		std::atomic<size_t> num_driver_deallocations{ 0 };
+		std::atomic<size_t> bytes_in_use{ 0 };
+		std::atomic<size_t> peak_bytes_in_use{ 0 };
+		std::atomic<size_t> bytes_reserved{ 0 };
+
+		AllocationStats load() const;
+		//counter -= min(bytes, counter)
+		static void subtract(std::atomic<size_t>& counter, size_t bytes);
+	};
+
+	//The streams of an ExecutionContext, registered under an id, which use the arrays allocated in a ScopedAllocationStreams of
+	//it. At most kMaxAllocationStreams, on the current device. An array of an unregistered set, or of none (-1), may be used
+	//by any stream.
+	constexpr int kMaxAllocationStreams = 4;
+	int registerAllocationStreams(const cudaStream_t* streams, int count);
+	//Before the streams are destroyed. Arrays of the set are treated as arrays of none afterwards.
+	void unregisterAllocationStreams(int id);
+
+	//Stream set (>= 0) of the arrays allocated by this thread during its lifetime, nested ones win. Like ScopedAllocationOwner.
+	class ScopedAllocationStreams
+	{
+	public:
+		explicit ScopedAllocationStreams(int streams);
+		~ScopedAllocationStreams();
+
+	private:
+		int m_previous;
+	};
+
+	//Of the innermost ScopedAllocationStreams of this thread, -1 without one.
+	int getAllocationStreams();
+
+	//Interface used by DeviceArray to get device memory.
+	class DeviceAllocator
+	{
+	public:
+		virtual ~DeviceAllocator() = default;
+
+		virtual void* allocate(size_t bytes) = 0;
+		virtual void deallocate(void* ptr, size_t bytes) = 0;
+		//For memory only used by the stream set "streams" (see registerAllocationStreams), which a caching allocator may hand
+		//out again once these streams are done with it, instead of the whole device.
+		virtual void deallocateAfter(void* ptr, size_t bytes, int streams) { deallocate(ptr, bytes); }
+
+		//Called once per frame. The arena recycles all of its memory here, the others do nothing.
+		virtual void beginFrame() {}
+
+		//Gives cached memory back to the driver.
+		virtual void trim() {}
+
+		virtual const char* getName() const = 0;
+
+		AllocationStats getStats() const { return m_stats.load(); }
+
+	protected:
+		void recordAllocation(size_t bytes);
+		void recordDeallocation(size_t bytes);
+		void recordDriverAllocation(size_t bytes);
+		void recordDriverDeallocation(size_t bytes);
+
+	protected:
+		AllocationCounters m_stats;
+	};
+
+	//Goes straight to the driver. Uses the stream-ordered cudaMallocAsync/cudaFreeAsync if the runtime and the device support it.
+	//The default pools of all devices keep their memory instead of releasing it at every synchronization.
+	class CudaDeviceAllocator : public DeviceAllocator
+	{
+	public:
+		explicit CudaDeviceAllocator(cudaStream_t stream = 0);
+
+		void* allocate(size_t bytes) override;
+		void deallocate(void* ptr, size_t bytes) override;
+		const char* getName() const override { return m_stream_ordered ? "cudaMallocAsync" : "cudaMalloc"; }
+
+		bool isStreamOrdered() const { return m_stream_ordered; }
+
+	private:
+		cudaStream_t m_stream;
+		bool m_stream_ordered{ false };
+	};
+
+	//Freed blocks are kept in size buckets and handed out again, so steady state allocations never reach the driver.
+	//Blocks are cached per device. A block has to be freed with the device current that it was allocated on.
+	//Kernels on other streams (sessions, execution contexts, batch workers) may still use a block when it is freed. So the free
+	//records an event on each stream of the block's stream set, and the block is only handed out again once they completed.
+	//The streams are blocking ones, so these events also order after the earlier work of the legacy default stream. A block
+	//without a stream set gets its event on the legacy default stream instead, which orders after the work of all blocking
+	//streams of the device so far, but also makes them all wait for it. Blocks freed while a stream is captured get their
+	//events with the next call outside of the capture.
+	class CachingDeviceAllocator : public DeviceAllocator
+	{
+	public:
+		explicit CachingDeviceAllocator(DeviceAllocator& upstream);
+		~CachingDeviceAllocator();
+
+		void* allocate(size_t bytes) override;
+		void deallocate(void* ptr, size_t bytes) override;
+		void deallocateAfter(void* ptr, size_t bytes, int streams) override;
+		void trim() override;
+		const char* getName() const override { return "Caching pool"; }
+
+	private:
+		struct PendingBlock
+		{
+			void* ptr = nullptr;
+			size_t bucket = 0;
+			int streams = -1;
+			cudaEvent_t events[kMaxAllocationStreams] = {};
+			int num_events = 0; //0, if it was freed during a stream capture
+		};
+
+		struct DeviceCache
+		{
+			std::unordered_map<size_t, std::vector<void*>> free_blocks; //bucket -> blocks
+			std::vector<PendingBlock> pending_blocks;
+			std::vector<cudaEvent_t> events; //unused ones
+		};
+
+		static size_t getBucketSize(size_t bytes);
+		//True while a blocking stream of the current device is captured, the legacy stream must not be used then.
+		static bool isCapturing();
+		//Records the events of the blocks freed during a capture and moves the ones whose events completed to the free lists.
+		void collectPendingBlocks(DeviceCache& cache, bool capturing);
+		void recordEvents(DeviceCache& cache, PendingBlock& block);
+
+	private:
+		DeviceAllocator& m_upstream;
+		std::mutex m_mutex;
+		std::unordered_map<int, DeviceCache> m_caches; //by device
+	};
+
+	//Bump allocator which is recycled in beginFrame(). Only for temporaries that don't outlive the current frame.
+	class FrameArenaAllocator : public DeviceAllocator
+	{
+	public:
+		explicit FrameArenaAllocator(DeviceAllocator& upstream, size_t block_size = 16 * 1024 * 1024);
+		~FrameArenaAllocator();
+
+		void* allocate(size_t bytes) override;
+		void deallocate(void* ptr, size_t bytes) override;
+		void beginFrame() override;
+		void trim() override;
+		const char* getName() const override { return "Frame arena"; }
+
+	private:
+		struct Block
+		{
+			char* ptr = nullptr;
+			size_t size = 0;
+		};
+
+		static constexpr size_t kAlignment = 256;
+
+	private:
+		DeviceAllocator& m_upstream;
+		size_t m_block_size;
+		std::mutex m_mutex;
+		std::vector<Block> m_blocks;
+		size_t m_current_block{ 0 };
+		size_t m_offset{ 0 };
+	};
+
+	CudaDeviceAllocator& getCudaAllocator();
+	CachingDeviceAllocator& getCachingAllocator();
+	FrameArenaAllocator& getFrameArena();
+
+	//Allocator used by DeviceArray if none is given explicitly. The caching pool by default.
+	DeviceAllocator& getDefaultAllocator();
+	void setDefaultAllocator(DeviceAllocator& allocator);
+}
@@ -1,6 +1,9 @@
 #pragma once
 
 #include "util.h"
+#include "device_allocator.h"
+#include "allocation_tracker.h"
+#include "memory_span.h"
 
 #include <assert.h>
 #include <vector>
@@ -8,57 +11,75 @@
 
 namespace util
 {
-	//This class is a wrapper for device memory.
+	//This class is a wrapper for device memory. The memory comes from "allocator", which has to outlive the array.
+	//Allocations are recorded by the AllocationTracker, under the tag and the owner of the thread when the array allocates.
+	//The memory is freed after the work of the thread's ScopedAllocationStreams at that time, see CachingDeviceAllocator.
 	template<typename T>
 	class DeviceArray
 	{
 	public:
-		explicit DeviceArray(int size = 0)
+		explicit DeviceArray(int size = 0, DeviceAllocator& allocator = getDefaultAllocator())
 			: m_size(size)
+			, m_allocator(&allocator)
 		{
 			if (m_size > 0)
 			{
-				CHECK_CUDA_ERROR(cudaMalloc(&m_ptr, m_size * sizeof(T)));
+				allocate();
 			}
 		}
 
-		DeviceArray(const std::vector<T>& vector)
+		DeviceArray(const std::vector<T>& vector, DeviceAllocator& allocator = getDefaultAllocator())
 			: m_size(vector.size())
+			, m_allocator(&allocator)
 		{
 			if (m_size > 0)
 			{
-				CHECK_CUDA_ERROR(cudaMalloc(&m_ptr, m_size * sizeof(T)));
+				allocate();
 				CHECK_CUDA_ERROR(cudaMemcpy(m_ptr, vector.data(), m_size * sizeof(T), cudaMemcpyHostToDevice));
 			}
 		}
 
+		//The copy uses the same allocator as "da".
 		DeviceArray(const DeviceArray& da)
 			: m_size(da.m_size)
+			, m_allocator(da.m_allocator)
 		{
 			if (m_size > 0)
 			{
-				CHECK_CUDA_ERROR(cudaMalloc(&m_ptr, m_size * sizeof(T)));
+				allocate();
 				CHECK_CUDA_ERROR(cudaMemcpy(m_ptr, da.m_ptr, m_size * sizeof(T), cudaMemcpyDeviceToDevice));
 			}
 		}
 
 		DeviceArray(DeviceArray&& da)
+			: m_allocator(da.m_allocator)
 		{
 			std::swap(m_size, da.m_size);
 			std::swap(m_ptr, da.m_ptr);
+			std::swap(m_tag, da.m_tag);
+			std::swap(m_owner, da.m_owner);
+			std::swap(m_streams, da.m_streams);
 		}
 
 		DeviceArray& operator = (DeviceArray da)
 		{
 			std::swap(m_size, da.m_size);
 			std::swap(m_ptr, da.m_ptr);
+			std::swap(m_allocator, da.m_allocator);
+			std::swap(m_tag, da.m_tag);
+			std::swap(m_owner, da.m_owner);
+			std::swap(m_streams, da.m_streams);
 
 			return *this;
 		}
 
 		~DeviceArray()
 		{
-			CHECK_CUDA_ERROR(cudaFree(m_ptr));
+			if (m_ptr)
+			{
+				AllocationTracker::get().recordDeallocation(m_tag, m_size * sizeof(T), m_owner);
+			}
+			m_allocator->deallocateAfter(m_ptr, m_size * sizeof(T), m_streams);
 			m_ptr = nullptr;
 			m_size = 0;
 		}
@@ -68,6 +89,11 @@ namespace util
 			CHECK_CUDA_ERROR(cudaMemset(m_ptr, value, m_size * sizeof(T)));
 		}
 
+		void memset(int value, cudaStream_t stream)
+		{
+			CHECK_CUDA_ERROR(cudaMemsetAsync(m_ptr, value, m_size * sizeof(T), stream));
+		}
+
 		int getSize() const
 		{
 			return m_size;
@@ -83,75 +109,85 @@ namespace util
 			return m_ptr;
 		}
 
+		DeviceSpan<T> span()
+		{
+			return DeviceSpan<T>(m_ptr, m_size);
+		}
+
+		DeviceSpan<const T> span() const
+		{
+			return DeviceSpan<const T>(m_ptr, m_size);
+		}
+
+		//"count" elements from "offset" on.
+		DeviceSpan<T> span(int offset, int count)
+		{
+			return span().subspan(offset, count);
+		}
+
+		DeviceSpan<const T> span(int offset, int count) const
+		{
+			return span().subspan(offset, count);
+		}
+
+		DeviceAllocator& getAllocator() const
+		{
+			return *m_allocator;
+		}
+
+	private:
+		void allocate()
+		{
+			m_tag = getAllocationTag();
+			m_owner = getAllocationOwner();
+			m_streams = getAllocationStreams();
+			m_ptr = static_cast<T*>(m_allocator->allocate(m_size * sizeof(T)));
+			AllocationTracker::get().recordAllocation(m_tag, m_size * sizeof(T), m_allocator == &getFrameArena(), m_owner);
+		}
+
 	private:
 		int m_size{ 0 };
 		T* m_ptr{ nullptr };
+		DeviceAllocator* m_allocator{ nullptr };
+		const char* m_tag{ nullptr }; //see ScopedAllocationTag
+		int m_owner{ -1 }; //see ScopedAllocationOwner
+		int m_streams{ -1 }; //see ScopedAllocationStreams
 	};
 
-	//Some copy functions on DeviceArray and std::vector.
+	//Reallocates "array" only if it holds less than "size" elements. The content is not preserved.
+	template<typename T>
+	void ensureSize(DeviceArray<T>& array, int size)
+	{
+		if (array.getSize() < size)
+		{
+			array = DeviceArray<T>(size, array.getAllocator());
+		}
+	}
+
+	//Some copy functions on DeviceArray and std::vector, see memory_span.h for raw memory and async copies.
 	//User has to be sure that "dst" and "src" is as large as "size".
 	//For the sake of completeness, host to host copy is also implemented.
 	template<typename T>
 	void copy(DeviceArray<T>& dst, const DeviceArray<T>& src, int size, int offset_dst = 0, int offset_src = 0)
 	{
-		assert(dst.getSize() >= size && src.getSize() >= size);
-		CHECK_CUDA_ERROR(cudaMemcpy(dst.getPtr() + offset_dst, src.getPtr() + offset_src, size * sizeof(T), cudaMemcpyDeviceToDevice));
+		copy(dst.span(offset_dst, size), src.span(offset_src, size));
 	}
 
 	template<typename T>
 	void copy(DeviceArray<T>& dst, const std::vector<T>& src, int size, int offset_dst = 0, int offset_src = 0)
 	{
-		assert(dst.getSize() >= size && src.size() >= size);
-		CHECK_CUDA_ERROR(cudaMemcpy(dst.getPtr() + offset_dst, src.data() + offset_src, size * sizeof(T), cudaMemcpyHostToDevice));
+		copy(dst.span(offset_dst, size), hostSpan(src).subspan(offset_src, size));
 	}
 
 	template<typename T>
 	void copy(std::vector<T>& dst, const std::vector<T>& src, int size, int offset_dst = 0, int offset_src = 0)
 	{
-		assert(dst.size() >= size && src.size() >= size);
-		CHECK_CUDA_ERROR(cudaMemcpy(dst.data() + offset_dst, src.data() + offset_src, size * sizeof(T), cudaMemcpyHostToHost));
+		copy(hostSpan(dst).subspan(offset_dst, size), hostSpan(src).subspan(offset_src, size));
 	}
 
 	template<typename T>
 	void copy(std::vector<T>& dst, const DeviceArray<T>& src, int size, int offset_dst = 0, int offset_src = 0)
 	{
-		assert(dst.size() >= size && src.getSize() >= size);
-		CHECK_CUDA_ERROR(cudaMemcpy(dst.data() + offset_dst, src.getPtr() + offset_src, size * sizeof(T), cudaMemcpyDeviceToHost));
-	}
-
-	template<typename T>
-	void copy(DeviceArray<T>& dst, const T* src, int size, int offset_dst = 0, int offset_src = 0)
-	{
-		cudaPointerAttributes pointer_attributes;
-		memset(&pointer_attributes, 0, sizeof(pointer_attributes));
-		cudaPointerGetAttributes(&pointer_attributes, src);
-
-		if (pointer_attributes.type == cudaMemoryTypeDevice)
-		{
-			CHECK_CUDA_ERROR(cudaMemcpy(dst.getPtr() + offset_dst, src + offset_src, size * sizeof(T), cudaMemcpyDeviceToDevice));
-		}
-		else
-		{
-			cudaGetLastError();
-			CHECK_CUDA_ERROR(cudaMemcpy(dst.getPtr() + offset_dst, src + offset_src, size * sizeof(T), cudaMemcpyHostToDevice));
-		}
-	}
-
-	template<typename T>
-	void copy(T* dst, const DeviceArray<T>& src, int size, int offset_dst = 0, int offset_src = 0)
-	{
-		cudaPointerAttributes pointer_attributes;
-		memset(&pointer_attributes, 0, sizeof(pointer_attributes));
-		cudaPointerGetAttributes(&pointer_attributes, dst);
-
-		if (pointer_attributes.type == cudaMemoryTypeDevice)
-		{
-			CHECK_CUDA_ERROR(cudaMemcpy(dst + offset_dst, src.getPtr() + offset_src, size * sizeof(T), cudaMemcpyDeviceToDevice));
-		}
-		else
-		{
-			cudaGetLastError();
-			CHECK_CUDA_ERROR(cudaMemcpy(dst + offset_dst, src.getPtr() + offset_src, size * sizeof(T), cudaMemcpyDeviceToHost));
-		}
+		copy(hostSpan(dst).subspan(offset_dst, size), src.span(offset_src, size));
 	}
 }
\ No newline at end of file
@@ -1,8 +1,12 @@
 #pragma once
 
+#include "util.h"
+
+#include <algorithm>
 #include <iostream>
 #include <functional>
 #include <cuda_runtime.h>
+#include <glm/glm.hpp>
 
 namespace util
 {
@@ -12,6 +16,12 @@ namespace util
 		return { threadIdx.x + blockIdx.x * blockDim.x };
 	}
 
+	//Step of a grid-stride loop over a 1D range.
+	__device__ inline unsigned int getGridStride1D()
+	{
+		return blockDim.x * gridDim.x;
+	}
+
 	__device__ inline uint2 getThreadIndex2D()
 	{
 		return { threadIdx.x + blockIdx.x * blockDim.x, threadIdx.y + blockIdx.y * blockDim.y };
@@ -31,5 +41,39 @@ namespace util
 
 		return pixel;
 	}
+
+	//Element "i" of a face laid out like Face::m_current_face_gpu (positions, colors, normals), from its float4 copy with one
+	//128-bit load if there is one, see Face::setAlignedVertices.
+	__device__ inline glm::vec3 loadVertex(const glm::vec3* face, const float4* aligned_face, int i)
+	{
+		if (aligned_face)
+		{
+			const float4 vertex = __ldg(aligned_face + i);
+			return glm::vec3(vertex.x, vertex.y, vertex.z);
+		}
+		return face[i];
+	}
+
+	//Launch configuration of a grid-stride kernel over a 1D range. The block size is the one with the highest occupancy for
+	//the kernel, the grid is capped at what fills the device once, so any range size works.
+	struct LaunchConfig1D
+	{
+		int min_grid_size = 0;
+		int block_size = 0;
+
+		int getGridSize(int n) const
+		{
+			return std::max(1, std::min(min_grid_size, (n + block_size - 1) / block_size));
+		}
+	};
+
+	//Queries the occupancy calculator, keep the result in a static instead of calling it for every launch.
+	template<typename Kernel>
+	inline LaunchConfig1D getLaunchConfig1D(Kernel kernel)
+	{
+		LaunchConfig1D config;
+		CHECK_CUDA_ERROR(cudaOccupancyMaxPotentialBlockSize(&config.min_grid_size, &config.block_size, kernel));
+		return config;
+	}
 #endif
 }
\ No newline at end of file
@@ -0,0 +1,245 @@
+#include "embedded_tracker.h"
+#include "window.h"
+#include "face.h"
+#include "pyramid.h"
+#include "glsl_program.h"
+#include "execution_context.h"
+#include "device_allocator.h"
+#include "allocation_tracker.h"
+#include "profiler.h"
+#include "tracking_snapshot.h"
+#include "identity_profile_store.h"
+#include "thread_placement.h"
+
+#include <glm/ext/matrix_clip_space.hpp>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include "opencv2/imgproc/imgproc.hpp"
+
+EmbeddedTracker::EmbeddedTracker(const EmbeddedTrackerSettings& settings)
+	: m_settings(settings)
+	, m_queue(std::max(settings.queue_capacity, 1))
+{
+	if (m_settings.width <= 0 || m_settings.height <= 0)
+	{
+		throw std::runtime_error("Error: The frame size of the embedded tracker is not set.");
+	}
+
+	std::promise<void> started;
+	auto started_future = started.get_future();
+	m_thread = std::thread([this, &started]() { run(started); });
+	try
+	{
+		started_future.get();
+	}
+	catch (...)
+	{
+		m_thread.join();
+		throw;
+	}
+}
+
+EmbeddedTracker::~EmbeddedTracker()
+{
+	//The thread pops what is left before it sees the stop.
+	m_stop = true;
+	if (m_thread.joinable())
+	{
+		m_thread.join();
+	}
+}
+
+std::future<TrackedFrame> EmbeddedTracker::pushFrame(const cv::Mat& frame, Callback callback)
+{
+	if (frame.type() != CV_8UC3 || frame.cols != m_settings.width || frame.rows != m_settings.height)
+	{
+		throw std::runtime_error("Error: The pushed frame is not a CV_8UC3 frame of the size of the embedded tracker.");
+	}
+
+	Request request;
+	request.host_frame = frame.clone();
+	request.callback = std::move(callback);
+	return push(std::move(request));
+}
+
+std::future<TrackedFrame> EmbeddedTracker::pushFrame(const uchar* device_frame, size_t pitch, int channels, cudaEvent_t ready, Callback callback)
+{
+	if (channels != 3 && channels != 4)
+	{
+		throw std::runtime_error("Error: The pushed device frame has " + std::to_string(channels) + " channels, expected 3 or 4.");
+	}
+
+	Request request;
+	request.device_frame = device_frame;
+	request.pitch = pitch;
+	request.channels = channels;
+	request.ready = ready;
+	request.callback = std::move(callback);
+	return push(std::move(request));
+}
+
+std::future<TrackedFrame> EmbeddedTracker::push(Request request)
+{
+	request.frame_id = m_next_frame_id++;
+	auto result = request.result.get_future();
+	util::ScopedTimer timer("Embedded tracker queue push");
+	if (!m_queue.push(std::move(request), m_stop))
+	{
+		throw std::runtime_error("Error: The embedded tracker is stopped.");
+	}
+	return result;
+}
+
+void EmbeddedTracker::flush()
+{
+	while (m_num_completed.load() < m_next_frame_id)
+	{
+		std::this_thread::yield();
+	}
+}
+
+void EmbeddedTracker::run(std::promise<void>& started)
+{
+	util::ThreadPlacement::get().apply(util::ThreadStage::Main);
+	//Everything which touches GL lives on this thread, its context is current here only.
+	std::unique_ptr<Window> window;
+	std::unique_ptr<Face> face;
+	std::unique_ptr<Pyramid> pyramid;
+	std::unique_ptr<GaussNewtonSolver> solver;
+	GLSLProgram face_shader;
+	Tracker tracker;
+	glm::mat4 projection;
+	std::unique_ptr<IdentityProfileStore> identity_store;
+	bool identity_from_profile = false;
+	try
+	{
+		window = std::make_unique<Window>(0, m_settings.width, m_settings.height, false);
+		face = std::make_unique<Face>(m_settings.morphable_model_directory, m_settings.basis_limits);
+		pyramid = std::make_unique<Pyramid>(m_settings.number_of_pyramid_levels, m_settings.width, m_settings.height);
+		solver = std::make_unique<GaussNewtonSolver>(m_settings.solver);
+		face->setExecutionContext(solver->getExecutionContext());
+		pyramid->setExecutionContext(solver->getExecutionContext());
+		tracker.getParameters() = m_settings.tracker;
+		tracker.getParameters().max_faces = 1;
+
+		projection = glm::perspectiveRH_NO(glm::radians(m_settings.field_of_view), pyramid->getAspectRatio(), 0.01f, 10.0f);
+		if (!m_settings.identity_store_directory.empty() && !m_settings.subject_id.empty())
+		{
+			identity_store = std::make_unique<IdentityProfileStore>(m_settings.identity_store_directory);
+			identity_from_profile = identity_store->load(m_settings.subject_id, *face);
+		}
+		if (!m_settings.restore_path.empty() && std::ifstream(m_settings.restore_path).good())
+		{
+			readTrackingSnapshot(m_settings.restore_path, { face.get() }, { &projection }, *solver);
+		}
+		Face::attachShaders(face_shader, m_settings.fragment_barycentrics, m_settings.shader_directory);
+		face_shader.link();
+		face_shader.use();
+		face_shader.setMat4("projection", projection);
+		face->getGraphicsSettings().shader = &face_shader;
+	}
+	catch (...)
+	{
+		started.set_exception(std::current_exception());
+		return;
+	}
+	started.set_value();
+
+	const cudaStream_t compute_stream = solver->getExecutionContext()->getComputeStream();
+	uint32_t num_tracked_frames = 0; //of the snapshots
+	Request request;
+	while (m_queue.pop(request, m_stop))
+	{
+		util::getFrameArena().beginFrame();
+		util::AllocationTracker::get().beginFrame();
+		util::Profiler::get().beginFrame();
+		try
+		{
+			util::ScopedTimer frame_timer("Frame");
+			cv::Mat frame_half;
+			if (request.host_frame.empty())
+			{
+				if (request.ready)
+				{
+					CHECK_CUDA_ERROR(cudaStreamWaitEvent(compute_stream, request.ready, 0));
+				}
+				pyramid->uploadFrame(request.device_frame, request.pitch, request.channels);
+				//Only the level of the landmark detector goes to the host.
+				pyramid->downloadFrame(1, frame_half, compute_stream);
+			}
+			else
+			{
+				pyramid->uploadFrame(request.host_frame);
+				util::ScopedTimer timer("pyrDown");
+				cv::pyrDown(request.host_frame, frame_half);
+			}
+
+			TrackedFrame result;
+			result.frame_id = request.frame_id;
+			result.sparse_features = tracker.getSparseFeatures(frame_half);
+			result.tracked = !result.sparse_features.empty();
+			{
+				util::ScopedTimer timer("Solve", true);
+				solver->solve(result.sparse_features, *face, projection, *pyramid);
+			}
+
+			//The host coefficients are up to date once solve returned.
+			result.projection = projection;
+			result.model_matrix = face->computeModelMatrix();
+			result.rotation = face->getRotationCoefficients();
+			result.translation = face->getTranslationCoefficients();
+			if (result.tracked)
+			{
+				result.shape_coefficients = face->getShapeCoefficients();
+				result.expression_coefficients = face->getExpressionCoefficients();
+				result.albedo_coefficients = face->getAlbedoCoefficients();
+				result.sh_coefficients = face->getSHCoefficients();
+			}
+
+			if (result.tracked && !m_settings.snapshot_path.empty() && ++num_tracked_frames % std::max(m_settings.snapshot_interval, 1) == 0)
+			{
+				util::ScopedTimer timer("Tracking snapshot");
+				writeTrackingSnapshot(m_settings.snapshot_path, { face.get() }, { &projection }, *solver, num_tracked_frames);
+			}
+
+			if (request.callback)
+			{
+				request.callback(result);
+			}
+			request.result.set_value(std::move(result));
+		}
+		catch (...)
+		{
+			request.result.set_exception(std::current_exception());
+		}
+		util::Profiler::get().endFrame();
+		m_num_completed++;
+		request = Request();
+	}
+
+	CHECK_CUDA_ERROR(cudaStreamSynchronize(compute_stream));
+	if (!m_settings.snapshot_path.empty() && num_tracked_frames > 0)
+	{
+		try
+		{
+			writeTrackingSnapshot(m_settings.snapshot_path, { face.get() }, { &projection }, *solver, num_tracked_frames);
+		}
+		catch (const std::exception& e)
+		{
+			std::cout << e.what() << std::endl; //the destructor doesn't throw
+		}
+	}
+	if (identity_store && !identity_from_profile && face->isIdentityLocked())
+	{
+		try
+		{
+			identity_store->save(m_settings.subject_id, *face);
+		}
+		catch (const std::exception& e)
+		{
+			std::cout << e.what() << std::endl;
+		}
+	}
+	face->getGraphicsSettings().shader = nullptr;
+}
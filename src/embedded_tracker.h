@@ -0,0 +1,110 @@
+#pragma once
+
+#include "gauss_newton_solver.h"
+#include "tracker.h"
+#include "spsc_queue.h"
+
+#include <glm/glm.hpp>
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <future>
+#include <string>
+#include <thread>
+#include <vector>
+#include "opencv2/core/core.hpp"
+
+struct EmbeddedTrackerSettings
+{
+	//Both end with a slash, relative to the working directory of the host process.
+	std::string morphable_model_directory = "../MorphableModel/";
+	std::string shader_directory = "../src/shader/";
+	bool fragment_barycentrics = true; //see Face::attachShaders
+	BasisLimits basis_limits; //columns of the bases which are loaded, at least the coefficient counts of "solver"
+	//Of the pushed frames, level 0 of the pyramid.
+	int width = 0;
+	int height = 0;
+	int number_of_pyramid_levels = 3;
+	float field_of_view = 60.0f; //vertical, degrees
+	SolverParameters solver;
+	TrackerParameters tracker;
+	int queue_capacity = 4; //frames pushed but not yet solved, pushFrame blocks while it is full
+	//Tracking snapshot (see writeTrackingSnapshot), written every snapshot_interval tracked frames and when the tracker is
+	//destroyed. Empty: none.
+	std::string snapshot_path;
+	int snapshot_interval = 30;
+	//Restored before the first frame, if the file exists, so a restarted host process starts converged. Empty: none.
+	std::string restore_path;
+	//Identity of subject_id, loaded from that directory before the first frame or saved once the solver locked it, see
+	//IdentityProfileStore. Empty: none.
+	std::string identity_store_directory;
+	std::string subject_id;
+};
+
+//Fitted parameters of one pushed frame. The coefficients are empty, if the face wasn't tracked.
+struct TrackedFrame
+{
+	int frame_id = 0; //counted from 0 in push order
+	bool tracked = false;
+	std::vector<glm::vec2> sparse_features; //landmarks, see Tracker::getSparseFeatures
+	glm::mat4 projection;
+	glm::mat4 model_matrix; //see Face::computeModelMatrix
+	glm::vec3 rotation;
+	glm::vec3 translation;
+	std::vector<float> shape_coefficients;
+	std::vector<float> expression_coefficients;
+	std::vector<float> albedo_coefficients;
+	std::vector<float> sh_coefficients;
+};
+
+//The tracker without Application, for embedding it into another process: frames are pushed from the host or straight from
+//device memory and solved in order on a thread of the tracker, which owns a hidden GL context with the Face, the Pyramid,
+//the GaussNewtonSolver and the Tracker. Every push completes through a future and an optional callback on that thread.
+//pushFrame must be called from one thread only.
+class EmbeddedTracker
+{
+public:
+	using Callback = std::function<void(const TrackedFrame&)>;
+
+	//Waits until the model is loaded and the GL context is set up, and rethrows their errors.
+	explicit EmbeddedTracker(const EmbeddedTrackerSettings& settings);
+	EmbeddedTracker(EmbeddedTracker&) = delete;
+	EmbeddedTracker(EmbeddedTracker&& rhs) = delete;
+	EmbeddedTracker& operator=(EmbeddedTracker&) = delete;
+	EmbeddedTracker& operator=(EmbeddedTracker&&) = delete;
+	//Solves the frames which are still queued.
+	~EmbeddedTracker();
+
+	//CV_8UC3 BGR frame of settings.width x settings.height, it is copied before returning.
+	std::future<TrackedFrame> pushFrame(const cv::Mat& frame, Callback callback = nullptr);
+	//Zero copy: 8 bit BGR (3 channels) or BGRA (4) rows of "pitch" bytes on the device, see Pyramid::uploadFrame. The solve waits
+	//for "ready" first, if it is set, e.g. recorded after the producer wrote the frame. The buffer must stay valid and unchanged
+	//until the frame completed.
+	std::future<TrackedFrame> pushFrame(const uchar* device_frame, size_t pitch, int channels, cudaEvent_t ready = nullptr,
+		Callback callback = nullptr);
+	//Waits until every pushed frame completed.
+	void flush();
+
+private:
+	struct Request
+	{
+		int frame_id = 0;
+		cv::Mat host_frame; //empty for a device frame
+		const uchar* device_frame = nullptr;
+		size_t pitch = 0;
+		int channels = 0;
+		cudaEvent_t ready = nullptr;
+		Callback callback;
+		std::promise<TrackedFrame> result;
+	};
+
+	EmbeddedTrackerSettings m_settings;
+	util::SpscQueue<Request> m_queue;
+	int m_next_frame_id{ 0 };
+	std::atomic<int> m_num_completed{ 0 };
+	std::atomic<bool> m_stop{ false };
+	std::thread m_thread;
+
+	std::future<TrackedFrame> push(Request request);
+	void run(std::promise<void>& started);
+};
@@ -0,0 +1,70 @@
+#include "execution_context.h"
+#include "util.h"
+
+#include <algorithm>
+
+namespace util
+{
+	static int getCudaPriority(StreamPriority priority)
+	{
+		//Lower numbers are greater priorities, "least" is the default one.
+		int least = 0;
+		int greatest = 0;
+		CHECK_CUDA_ERROR(cudaDeviceGetStreamPriorityRange(&least, &greatest));
+		switch (priority)
+		{
+		case StreamPriority::High: return greatest;
+		case StreamPriority::Low: return least;
+		default: return std::max(greatest, std::min(least, 0));
+		}
+	}
+
+	ExecutionContext::ExecutionContext(DeviceAllocator& allocator, StreamPriority priority)
+		: m_allocator(allocator)
+		, m_priority(priority)
+	{
+		//Blocking streams like cudaStreamCreate, see the class comment.
+		const int cuda_priority = getCudaPriority(priority);
+		CHECK_CUDA_ERROR(cudaStreamCreateWithPriority(&m_compute, cudaStreamDefault, cuda_priority));
+		CHECK_CUDA_ERROR(cudaStreamCreateWithPriority(&m_auxiliary, cudaStreamDefault, cuda_priority));
+		CHECK_CUDA_ERROR(cudaStreamCreateWithPriority(&m_upload, cudaStreamDefault, cuda_priority));
+		CHECK_CUDA_ERROR(cudaStreamCreateWithPriority(&m_readback, cudaStreamDefault, cuda_priority));
+		cublasCreate(&m_cublas);
+		cublasSetStream(m_cublas, m_compute);
+		cusolverDnCreate(&m_cusolver);
+		cusolverDnSetStream(m_cusolver, m_compute);
+		const cudaStream_t streams[] = { m_compute, m_auxiliary, m_upload, m_readback };
+		m_allocation_streams = registerAllocationStreams(streams, 4);
+	}
+
+	ExecutionContext::~ExecutionContext()
+	{
+		//Arrays freed from now on fall back to the legacy default stream.
+		unregisterAllocationStreams(m_allocation_streams);
+		for (auto& stream_event : m_events)
+		{
+			CHECK_CUDA_ERROR(cudaEventDestroy(stream_event.second));
+		}
+		cublasDestroy(m_cublas);
+		cusolverDnDestroy(m_cusolver);
+		CHECK_CUDA_ERROR(cudaStreamDestroy(m_readback));
+		CHECK_CUDA_ERROR(cudaStreamDestroy(m_upload));
+		CHECK_CUDA_ERROR(cudaStreamDestroy(m_auxiliary));
+		CHECK_CUDA_ERROR(cudaStreamDestroy(m_compute));
+	}
+
+	void ExecutionContext::waitFor(cudaStream_t waiting, cudaStream_t stream)
+	{
+		if (waiting == stream)
+		{
+			return;
+		}
+		cudaEvent_t& event = m_events[stream];
+		if (!event)
+		{
+			CHECK_CUDA_ERROR(cudaEventCreateWithFlags(&event, cudaEventDisableTiming));
+		}
+		CHECK_CUDA_ERROR(cudaEventRecord(event, stream));
+		CHECK_CUDA_ERROR(cudaStreamWaitEvent(waiting, event, 0));
+	}
+}
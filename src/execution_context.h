@@ -0,0 +1,65 @@
+#pragma once
+
+#include <unordered_map>
+#include <cuda_runtime.h>
+#include <cublas_v2.h>
+#include <cusolverDn.h>
+
+#include "device_allocator.h"
+
+namespace util
+{
+	//Of the streams of an ExecutionContext. The default priority of CUDA is the lowest one, so Low only differs from Normal
+	//on devices with a wider range: Normal streams yield to High ones, but not to each other.
+	enum class StreamPriority
+	{
+		Normal,
+		High,	//the greatest priority of the device, e.g. live sessions next to offline ones
+		Low,
+	};
+
+	//The streams, library handles and the allocator of one tracking pipeline, shared by its solver, face and pyramid so the
+	//dependencies between them are explicit events instead of the legacy default stream. The streams are blocking ones, so work
+	//that still goes to stream 0, e.g. setup copies, stays ordered with them.
+	class ExecutionContext
+	{
+	public:
+		explicit ExecutionContext(DeviceAllocator& allocator = getDefaultAllocator(), StreamPriority priority = StreamPriority::Normal);
+		~ExecutionContext();
+
+		//Solver launches, cuBLAS, cuSOLVER and the face kernels.
+		cudaStream_t getComputeStream() const { return m_compute; }
+		//Work forked from the compute stream and joined back, e.g. the landmark Jacobian.
+		cudaStream_t getAuxiliaryStream() const { return m_auxiliary; }
+		//Host to device copies of the frames.
+		cudaStream_t getUploadStream() const { return m_upload; }
+		//Device to host copies of results, e.g. the losses.
+		cudaStream_t getReadbackStream() const { return m_readback; }
+
+		cublasHandle_t getCublas() const { return m_cublas; }
+		cusolverDnHandle_t getCusolver() const { return m_cusolver; }
+		StreamPriority getPriority() const { return m_priority; }
+		DeviceAllocator& getAllocator() const { return m_allocator; }
+		//The stream set of the four streams, for a ScopedAllocationStreams around the work of the context.
+		int getAllocationStreams() const { return m_allocation_streams; }
+
+		//Later work on "waiting" waits for the work on "stream" so far, without blocking the host.
+		void waitFor(cudaStream_t waiting, cudaStream_t stream);
+
+	private:
+		cudaStream_t m_compute{ nullptr };
+		cudaStream_t m_auxiliary{ nullptr };
+		cudaStream_t m_upload{ nullptr };
+		cudaStream_t m_readback{ nullptr };
+		cublasHandle_t m_cublas{ nullptr };
+		cusolverDnHandle_t m_cusolver{ nullptr };
+		DeviceAllocator& m_allocator;
+		StreamPriority m_priority;
+		int m_allocation_streams{ -1 };
+		std::unordered_map<cudaStream_t, cudaEvent_t> m_events; //recorded by waitFor, one per stream
+
+	private:
+		ExecutionContext(const ExecutionContext&) = delete;
+		ExecutionContext(ExecutionContext&&) = delete;
+	};
+}
@@ -1,77 +1,179 @@
 #include "face.h"
+#include "execution_context.h"
 #include "glsl_program.h"
 #include "util.h"
 #include "prior_sparse_features.h"
+#include "mapped_file.h"
+#include "mesh_ordering.h"
+#include "profiler.h"
 
 #include <assert.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <glm/gtx/euler_angles.hpp>
 #include <Eigen/Dense>
 
-Face::Face(const std::string& morphable_model_directory)
-	: m_sh_coefficients(9, 0.0f)
+Face::Face(const std::string& morphable_model_directory, const BasisLimits& basis_limits)
+	: m_model(std::make_shared<FaceModel>())
+	, m_sh_coefficients(9, 0.0f)
 	, m_rotation_coefficients(0.0f, 0.0f, 0.0f)
 	, m_translation_coefficients(0.0f, 0.0f, -0.4f)
 {
-	std::ifstream file(morphable_model_directory + "/nomouth.off");
-	std::string str_dummy;
-	file >> str_dummy;
+	m_sh_coefficients[0] = 0.5;
+	m_model->directory = morphable_model_directory;
+	m_model->basis_limits = basis_limits;
 
-	int number_of_faces;
-	int int_dummy;
-	file >> m_number_of_vertices;
-	file >> number_of_faces;
-	file >> int_dummy;
+	util::MappedFile cache(getModelCachePath(false));
+	const ModelCacheHeader* header = getModelCacheHeader(cache, false);
 
-	std::vector<glm::vec3> positions(m_number_of_vertices);
-	std::vector<glm::vec3> colors(m_number_of_vertices);
+	std::vector<glm::vec3> positions;
+	std::vector<glm::vec3> colors;
+	std::vector<unsigned int> indices;
+	std::vector<std::vector<unsigned int>> lod_indices;
+	std::vector<unsigned int> lod_vertices;
+	int number_of_faces = 0;
+	if (header)
+	{
+		m_number_of_vertices = header->num_vertices;
+		number_of_faces = header->num_faces;
+		m_number_of_indices = 3 * number_of_faces;
 
-	m_sh_coefficients[0] = 0.5;
+		positions.resize(m_number_of_vertices);
+		colors.resize(m_number_of_vertices);
+		indices.resize(m_number_of_indices);
 
-	m_number_of_indices = 3 * number_of_faces;
-	std::vector<unsigned int> indices(m_number_of_indices);
-	std::vector<glm::ivec3> faces(number_of_faces);
-	constexpr float mesh_scale = 1 / 1000000.0f;
-	for (int i = 0; i < m_number_of_vertices; ++i)
+		const char* data = cache.getData() + sizeof(ModelCacheHeader);
+		std::memcpy(positions.data(), data, m_number_of_vertices * sizeof(glm::vec3));
+		data += m_number_of_vertices * sizeof(glm::vec3);
+		std::memcpy(colors.data(), data, m_number_of_vertices * sizeof(glm::vec3));
+		data += m_number_of_vertices * sizeof(glm::vec3);
+		std::memcpy(indices.data(), data, m_number_of_indices * sizeof(unsigned int));
+		data += m_number_of_indices * sizeof(unsigned int);
+
+		m_model->number_of_original_vertices = header->num_original_vertices;
+		m_model->original_vertex_ids.resize(m_number_of_vertices);
+		std::memcpy(m_model->original_vertex_ids.data(), data, m_number_of_vertices * sizeof(int));
+		data += m_number_of_vertices * sizeof(int);
+
+		for (unsigned int i = 0; i < header->num_lods; ++i)
+		{
+			lod_vertices.push_back(header->lod_num_vertices[i]);
+			lod_indices.emplace_back(3 * header->lod_num_faces[i]);
+			std::memcpy(lod_indices.back().data(), data, lod_indices.back().size() * sizeof(unsigned int));
+			data += lod_indices.back().size() * sizeof(unsigned int);
+		}
+	}
+	else
 	{
-		file >> positions[i].x >> positions[i].y >> positions[i].z;
-		positions[i] *= mesh_scale;
+		std::ifstream file(morphable_model_directory + "/nomouth.off");
+		std::string str_dummy;
+		file >> str_dummy;
 
-		file >> colors[i].x >> colors[i].y >> colors[i].z;
-		colors[i] *= (1.0f / 255.0f);
+		int int_dummy;
+		file >> m_number_of_vertices;
+		file >> number_of_faces;
 		file >> int_dummy;
+
+		positions.resize(m_number_of_vertices);
+		colors.resize(m_number_of_vertices);
+
+		m_number_of_indices = 3 * number_of_faces;
+		indices.resize(m_number_of_indices);
+		constexpr float mesh_scale = 1 / 1000000.0f;
+		for (int i = 0; i < m_number_of_vertices; ++i)
+		{
+			file >> positions[i].x >> positions[i].y >> positions[i].z;
+			positions[i] *= mesh_scale;
+
+			file >> colors[i].x >> colors[i].y >> colors[i].z;
+			colors[i] *= (1.0f / 255.0f);
+			file >> int_dummy;
+		}
+
+		for (int i = 0; i < number_of_faces; ++i)
+		{
+			file >> int_dummy;
+			file >> indices[i * 3] >> indices[i * 3 + 1] >> indices[i * 3 + 2];
+		}
+		file.close();
+
+		compactModel(positions, colors, indices, lod_indices, lod_vertices);
 	}
+	PriorSparseFeatures::get().setVertexRemap(m_model->original_vertex_ids, m_model->number_of_original_vertices);
 
-	for (int i = 0; i < number_of_faces; ++i)
+	m_model->number_of_vertices = m_number_of_vertices;
+	m_model->number_of_indices = m_number_of_indices;
+	m_model->meshes.resize(1 + lod_indices.size());
+	m_model->meshes[0].number_of_vertices = m_number_of_vertices;
+	m_model->meshes[0].indices = std::move(indices);
+	for (size_t i = 0; i < lod_indices.size(); ++i)
 	{
-		file >> int_dummy;
-		file >> indices[i * 3] >> indices[i * 3 + 1] >> indices[i * 3 + 2];
-		faces[i].x = indices[i * 3];
-		faces[i].y = indices[i * 3 + 1];
-		faces[i].z = indices[i * 3 + 2];
+		m_model->meshes[i + 1].number_of_vertices = lod_vertices[i];
+		m_model->meshes[i + 1].indices = std::move(lod_indices[i]);
+	}
+	for (auto& mesh : m_model->meshes)
+	{
+		initMesh(mesh);
 	}
-	file.close();
 
-	m_average_face_gpu = util::DeviceArray<glm::vec3>(m_number_of_vertices * 3);
-	m_current_face_gpu = util::DeviceArray<glm::vec3>(m_number_of_vertices * 3);
+	m_model->average_face_gpu = util::DeviceArray<glm::vec3>(m_number_of_vertices * 3);
 
-	m_average_face_gpu.memset(0); //Important thing is normals are initialized to 0. Whenever we copy m_average_face_gpu to m_current_face_gpu, normals will be reset.
-	util::copy(m_average_face_gpu, positions, m_number_of_vertices);
-	util::copy(m_average_face_gpu, colors, m_number_of_vertices, m_number_of_vertices, 0);
+	m_model->average_face_gpu.memset(0); //Normals of the average face are never read, computeNormals writes them into the current face.
+	util::copy(m_model->average_face_gpu, positions, m_number_of_vertices);
+	util::copy(m_model->average_face_gpu, colors, m_number_of_vertices, m_number_of_vertices, 0);
 
-	m_faces_gpu = util::DeviceArray<glm::ivec3>(number_of_faces);
-	util::copy(m_faces_gpu, faces, number_of_faces);
+	if (header)
+	{
+		loadBasesFromCache(cache);
+	}
+	else
+	{
+		//First start, parse the text files once and write the caches for the next one, with all columns.
+		auto bases = loadBasesFromText(true);
+		writeModelCache(false, positions, colors, bases);
+		writeModelCache(true, positions, colors, bases);
+		truncateBases(bases);
+		uploadBases(bases, false);
+	}
+	m_model->num_shape_coefficients = m_shape_coefficients.size();
+	m_model->num_albedo_coefficients = m_albedo_coefficients.size();
+	m_model->num_expression_coefficients = m_expression_coefficients.size();
+	gatherLandmarkBases();
+
+	initState();
+}
+
+Face::Face(std::shared_ptr<FaceModel> model)
+	: m_model(std::move(model))
+	, m_number_of_vertices(m_model->number_of_vertices)
+	, m_number_of_indices(m_model->number_of_indices)
+	, m_shape_coefficients(m_model->num_shape_coefficients, 0.0f)
+	, m_albedo_coefficients(m_model->num_albedo_coefficients, 0.0f)
+	, m_expression_coefficients(m_model->num_expression_coefficients, 0.0f)
+	, m_sh_coefficients(9, 0.0f)
+	, m_rotation_coefficients(0.0f, 0.0f, 0.0f)
+	, m_translation_coefficients(0.0f, 0.0f, -0.4f)
+{
+	m_sh_coefficients[0] = 0.5;
+
+	initState();
+}
+
+void Face::initState()
+{
+	m_current_face_gpu = util::DeviceArray<glm::vec3>(m_number_of_vertices * 3);
 
 	glGenVertexArrays(1, &m_vertex_array);
 	glGenBuffers(1, &m_vertex_buffer);
-	glGenBuffers(1, &m_index_buffer);
+	m_index_buffers.resize(m_model->meshes.size(), 0);
+	glGenBuffers(m_index_buffers.size(), m_index_buffers.data());
 
 	assert(m_vertex_array);
 	assert(m_vertex_buffer);
-	assert(m_index_buffer);
-
-	glBindVertexArray(m_vertex_array);
 
 	int positions_byte_size = m_number_of_vertices * sizeof(glm::vec3);
 	int colors_byte_size = m_number_of_vertices * sizeof(glm::vec3);
@@ -80,102 +182,430 @@ Face::Face(const std::string& morphable_model_directory)
 
 	glBindBuffer(GL_ARRAY_BUFFER, m_vertex_buffer);
 	glBufferData(GL_ARRAY_BUFFER, positions_byte_size + colors_byte_size + normals_byte_size + tex_coords_byte_size, nullptr, GL_STATIC_DRAW);
-	CHECK_CUDA_ERROR(cudaGraphicsGLRegisterBuffer(&m_resource, m_vertex_buffer, cudaGraphicsRegisterFlagsWriteDiscard));
+	//Not write-discard, computeFace updates parts of the current face in the buffer, see m_face_in_vertex_buffer.
+	CHECK_CUDA_ERROR(cudaGraphicsGLRegisterBuffer(&m_resource, m_vertex_buffer, cudaGraphicsRegisterFlagsNone));
 
 	updateVertexBuffer();
 
+	for (size_t i = 0; i < m_index_buffers.size(); ++i)
+	{
+		const auto& mesh = m_model->meshes[i];
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_index_buffers[i]);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, mesh.number_of_indices * sizeof(unsigned int), mesh.indices.data(), GL_STATIC_DRAW);
+	}
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+	glBindVertexArray(m_vertex_array);
 	glEnableVertexAttribArray(0);
 	glEnableVertexAttribArray(1);
 	glEnableVertexAttribArray(2);
 	glEnableVertexAttribArray(3);
+	bindVertexLayout();
+
+	m_number_of_coefficients = m_shape_coefficients.size() + m_expression_coefficients.size() + m_albedo_coefficients.size() + m_sh_coefficients.size();
+	CHECK_CUDA_ERROR(cudaMallocHost(&m_coefficients_host, m_number_of_coefficients * sizeof(float)));
+	CHECK_CUDA_ERROR(cudaEventCreateWithFlags(&m_coefficients_copied, cudaEventDisableTiming));
+	CHECK_CUDA_ERROR(cudaEventRecord(m_coefficients_copied, 0));
+	m_coefficients_gpu = util::DeviceArray<float>(m_number_of_coefficients);
+	setActiveCoefficients(m_shape_coefficients.size(), m_expression_coefficients.size(), m_albedo_coefficients.size());
+}
 
+Face::~Face()
+{
+	if (m_vertex_buffer)
+	{
+		glDeleteBuffers(1, &m_vertex_buffer);
+		m_vertex_buffer = 0;
+	}
+	if (!m_index_buffers.empty())
+	{
+		glDeleteBuffers(m_index_buffers.size(), m_index_buffers.data());
+		m_index_buffers.clear();
+	}
+	if (m_vertex_array)
+	{
+		glDeleteVertexArrays(1, &m_vertex_array);
+		m_vertex_array = 0;
+	}
+	CHECK_CUDA_ERROR(cudaFreeHost(m_coefficients_host));
+	CHECK_CUDA_ERROR(cudaEventDestroy(m_coefficients_copied));
+}
+
+void Face::bindVertexLayout()
+{
+	//The vertex buffer holds the positions, colors and normals of m_number_of_vertices vertices back to back.
+	const int positions_byte_size = m_number_of_vertices * sizeof(glm::vec3);
+	const int colors_byte_size = m_number_of_vertices * sizeof(glm::vec3);
+
+	glBindVertexArray(m_vertex_array);
+	glBindBuffer(GL_ARRAY_BUFFER, m_vertex_buffer);
 	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (GLvoid*)0);
 	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (GLvoid*)(positions_byte_size));
 	glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (GLvoid*)(positions_byte_size + colors_byte_size));
-
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_index_buffer);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, m_number_of_indices * sizeof(unsigned int), indices.data(), GL_STATIC_DRAW);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_index_buffers[m_level_of_detail]);
 
 	glBindVertexArray(0);
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+void Face::setLevelOfDetail(int level_of_detail)
+{
+	level_of_detail = glm::clamp(level_of_detail, 0, static_cast<int>(m_model->meshes.size()) - 1);
+	if (level_of_detail == m_level_of_detail)
+	{
+		return;
+	}
+
+	//The current face of a level is a prefix of the full one, but its colors and normals start earlier. computeFace
+	//rewrites it before anything reads it.
+	m_level_of_detail = level_of_detail;
+	m_face_valid = false;
+	m_number_of_vertices = getMesh().number_of_vertices;
+	m_number_of_indices = getMesh().number_of_indices;
+	bindVertexLayout();
+}
+
+void Face::initMesh(FaceMesh& mesh)
+{
+	mesh.number_of_indices = static_cast<unsigned int>(mesh.indices.size());
+	const int number_of_faces = mesh.number_of_indices / 3;
+	std::vector<glm::ivec3> faces(number_of_faces);
+	for (int i = 0; i < number_of_faces; ++i)
+	{
+		faces[i].x = mesh.indices[i * 3];
+		faces[i].y = mesh.indices[i * 3 + 1];
+		faces[i].z = mesh.indices[i * 3 + 2];
+	}
+	mesh.faces_gpu = util::DeviceArray<glm::ivec3>(faces);
+
+	//Counting sort of the (vertex, face) pairs by vertex. Faces of a vertex stay in ascending order.
+	std::vector<int> offsets(mesh.number_of_vertices + 1, 0);
+	for (const auto& face : faces)
+	{
+		offsets[face.x + 1]++;
+		offsets[face.y + 1]++;
+		offsets[face.z + 1]++;
+	}
+	for (unsigned int i = 0; i < mesh.number_of_vertices; ++i)
+	{
+		offsets[i + 1] += offsets[i];
+	}
+
+	std::vector<int> vertex_faces(offsets.back());
+	std::vector<int> next(offsets.begin(), offsets.end() - 1);
+	for (int i = 0; i < static_cast<int>(faces.size()); ++i)
+	{
+		for (int vertex : { faces[i].x, faces[i].y, faces[i].z })
+		{
+			vertex_faces[next[vertex]++] = i;
+		}
+	}
+
+	mesh.vertex_face_offsets_gpu = util::DeviceArray<int>(offsets);
+	mesh.vertex_faces_gpu = util::DeviceArray<int>(vertex_faces);
+}
+
+void Face::compactModel(std::vector<glm::vec3>& positions, std::vector<glm::vec3>& colors, std::vector<unsigned int>& indices,
+	std::vector<std::vector<unsigned int>>& lod_indices, std::vector<unsigned int>& lod_vertices)
+{
+	const unsigned int number_of_vertices = static_cast<unsigned int>(positions.size());
+	std::vector<bool> used(number_of_vertices, false);
+	std::vector<bool> landmarks(number_of_vertices, false);
+	for (int id : PriorSparseFeatures::get().getOriginalPriorIds())
+	{
+		used[id] = true;
+		landmarks[id] = true;
+	}
 
-	std::vector<float> shape_basis = loadModelData(morphable_model_directory + "/ShapeBasis_modified.matrix", true);
-	auto shape_std_dev = loadModelData(morphable_model_directory + "/StandardDeviationShape.vec", false);
-	m_shape_coefficients.resize(shape_std_dev.size(), 0.0f);
-	Eigen::Map<Eigen::MatrixXf> shape_basis_eigen(shape_basis.data(), m_number_of_vertices * 3, m_shape_coefficients.size());
-	Eigen::Map<Eigen::VectorXf> shape_std_dev_eigen(shape_std_dev.data(), shape_std_dev.size());
-	shape_basis_eigen = shape_basis_eigen.array().rowwise() * shape_std_dev_eigen.transpose().array();
+	//A triangle with one vertex below the threshold has fragments face.frag keeps.
+	auto discarded = [&](unsigned int vertex) { return colors[vertex].y > 1.0f; };
+	std::vector<unsigned int> kept_indices;
+	kept_indices.reserve(indices.size());
+	for (size_t i = 0; i < indices.size(); i += 3)
+	{
+		if (!discarded(indices[i]) || !discarded(indices[i + 1]) || !discarded(indices[i + 2]))
+		{
+			kept_indices.insert(kept_indices.end(), { indices[i], indices[i + 1], indices[i + 2] });
+			used[indices[i]] = used[indices[i + 1]] = used[indices[i + 2]] = true;
+		}
+	}
 
-	m_shape_basis_gpu = util::DeviceArray<float>(shape_basis);
-	m_shape_coefficients_gpu = util::DeviceArray<float>(m_shape_coefficients.size());
+	//From here on the ids are those of the kept vertices.
+	std::vector<glm::vec3> kept_positions;
+	std::vector<int> kept_ids;
+	std::vector<int> compact_ids(number_of_vertices, -1);
+	std::vector<bool> pinned;
+	for (unsigned int i = 0; i < number_of_vertices; ++i)
+	{
+		if (used[i])
+		{
+			compact_ids[i] = static_cast<int>(kept_ids.size());
+			kept_positions.push_back(positions[i]);
+			kept_ids.push_back(i);
+			pinned.push_back(landmarks[i]);
+		}
+	}
+	for (auto& index : kept_indices)
+	{
+		index = compact_ids[index];
+	}
 
-	std::vector<float> albedo_basis = loadModelData(morphable_model_directory + "/AlbedoBasis_modified.matrix", true);
-	auto albedo_std_dev = loadModelData(morphable_model_directory + "/StandardDeviationAlbedo.vec", false);
-	m_albedo_coefficients.resize(albedo_std_dev.size(), 0.0f);
-	Eigen::Map<Eigen::MatrixXf> albedo_basis_eigen(albedo_basis.data(), m_number_of_vertices * 3, m_albedo_coefficients.size());
-	Eigen::Map<Eigen::VectorXf> albedo_std_dev_dev_eigen(albedo_std_dev.data(), albedo_std_dev.size());
-	albedo_basis_eigen = albedo_basis_eigen.array().rowwise() * albedo_std_dev_dev_eigen.transpose().array();
+	//A vertex belongs to all levels up to the coarsest one that keeps it.
+	const int n_lods = FaceModel::kNumLevelsOfDetail - 1;
+	const auto representatives = util::clusterVertices(kept_positions, kept_indices, pinned, n_lods);
+	std::vector<int> vertex_levels(kept_ids.size(), 0);
+	for (int level = 0; level < n_lods; ++level)
+	{
+		for (size_t v = 0; v < kept_ids.size(); ++v)
+		{
+			if (representatives[level][v] == static_cast<int>(v))
+			{
+				vertex_levels[v] = level + 1;
+			}
+		}
+	}
+	lod_indices.clear();
+	for (int level = 0; level < n_lods; ++level)
+	{
+		lod_indices.push_back(util::collapseTriangles(kept_indices, representatives[level]));
+	}
 
-	m_albedo_basis_gpu = util::DeviceArray<float>(albedo_basis);
-	m_albedo_coefficients_gpu = util::DeviceArray<float>(m_albedo_coefficients.size());
+	//Coarsest level first, so every level uses a prefix of the vertices. Within a level in Morton order, so neighbouring
+	//pixels gather nearby basis rows. Triangles in Tipsify order for the post-transform cache of GL and the vertex locality
+	//of the rasterizer.
+	auto order = util::computeMortonOrder(kept_positions);
+	std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return vertex_levels[a] > vertex_levels[b]; });
+	std::vector<int> new_ids(order.size(), -1);
+	auto& original_ids = m_model->original_vertex_ids;
+	original_ids.resize(order.size());
+	std::vector<glm::vec3> new_positions(order.size());
+	std::vector<glm::vec3> new_colors(order.size());
+	for (size_t i = 0; i < order.size(); ++i)
+	{
+		const int original = kept_ids[order[i]];
+		original_ids[i] = original;
+		new_ids[order[i]] = static_cast<int>(i);
+		new_positions[i] = positions[original];
+		new_colors[i] = colors[original];
+	}
+	positions = std::move(new_positions);
+	colors = std::move(new_colors);
 
-	std::vector<float> expression_basis = loadModelData(morphable_model_directory + "/ExpressionBasis_modified.matrix", true);
-	auto expression_std_dev = loadModelData(morphable_model_directory + "/StandardDeviationExpression.vec", false);
-	m_expression_coefficients.resize(expression_std_dev.size(), 0.0f);
-	Eigen::Map<Eigen::MatrixXf> expression_basis_eigen(expression_basis.data(), m_number_of_vertices * 3, m_expression_coefficients.size());
-	Eigen::Map<Eigen::VectorXf> expression_std_dev_dev_eigen(expression_std_dev.data(), expression_std_dev.size());
-	expression_basis_eigen = expression_basis_eigen.array().rowwise() * expression_std_dev_dev_eigen.transpose().array();
+	auto reorder = [&](std::vector<unsigned int>& level_indices, int level_vertices)
+	{
+		for (auto& index : level_indices)
+		{
+			index = new_ids[index];
+		}
+		level_indices = util::tipsify(level_indices, level_vertices);
+	};
+	reorder(kept_indices, static_cast<int>(original_ids.size()));
+	indices = std::move(kept_indices);
+	lod_vertices.clear();
+	for (int level = 0; level < n_lods; ++level)
+	{
+		lod_vertices.push_back(static_cast<unsigned int>(std::count_if(vertex_levels.begin(), vertex_levels.end(),
+			[&](int vertex_level) { return vertex_level > level; })));
+		reorder(lod_indices[level], lod_vertices.back());
+	}
 
-	m_expression_basis_gpu = util::DeviceArray<float>(expression_basis);
-	m_expression_coefficients_gpu = util::DeviceArray<float>(m_expression_coefficients.size());
+	m_model->number_of_original_vertices = number_of_vertices;
+	m_number_of_vertices = static_cast<unsigned int>(original_ids.size());
+	m_number_of_indices = static_cast<unsigned int>(indices.size());
+}
 
-	cublasCreate(&m_cublas);
+void Face::compactBasis(std::vector<float>& basis, size_t n_coefficients) const
+{
+	//One column at a time through a scratch column, within a column the rows are permuted. Destination columns never
+	//come after their source columns.
+	const size_t original_rows = static_cast<size_t>(3) * m_model->number_of_original_vertices;
+	const size_t rows = static_cast<size_t>(3) * m_model->number_of_vertices;
+	std::vector<float> column_data(rows);
+	for (size_t column = 0; column < n_coefficients; ++column)
+	{
+		const float* source = basis.data() + column * original_rows;
+		for (size_t i = 0; i < m_model->original_vertex_ids.size(); ++i)
+		{
+			const size_t original = static_cast<size_t>(3) * m_model->original_vertex_ids[i];
+			for (size_t c = 0; c < 3; ++c)
+			{
+				column_data[3 * i + c] = source[original + c];
+			}
+		}
+		std::copy(column_data.begin(), column_data.end(), basis.begin() + column * rows);
+	}
+	basis.resize(rows * n_coefficients);
 }
 
-Face::~Face()
+void Face::uploadCoefficients(cudaStream_t stream)
 {
-	if (m_vertex_buffer)
+	//The copy of the last upload has to be done with the staging buffer.
+	CHECK_CUDA_ERROR(cudaEventSynchronize(m_coefficients_copied));
+
+	//The staging buffer holds the device coefficients of the last upload or download, so it tells which groups changed.
+	const std::vector<float>* groups[kNumCoefficientGroups] = { &m_shape_coefficients, &m_expression_coefficients, &m_albedo_coefficients, &m_sh_coefficients };
+	unsigned int changed = m_coefficients_uploaded ? 0 : kAllGroups;
+	float* staging = m_coefficients_host;
+	for (int i = 0; i < kNumCoefficientGroups; ++i)
 	{
-		glDeleteBuffers(1, &m_vertex_buffer);
-		m_vertex_buffer = 0;
+		const auto& coefficients = *groups[i];
+		if (!std::equal(coefficients.begin(), coefficients.end(), staging))
+		{
+			std::copy(coefficients.begin(), coefficients.end(), staging);
+			changed |= 1u << i;
+		}
+		staging += coefficients.size();
 	}
-	if (m_index_buffer)
+	if (changed == 0)
 	{
-		glDeleteBuffers(1, &m_index_buffer);
-		m_index_buffer = 0;
+		return;
 	}
-	if (m_vertex_array)
+	markCoefficientsChanged(changed);
+
+	util::copyAsync(m_coefficients_gpu.span(0, m_number_of_coefficients), util::pinnedSpan(m_coefficients_host, m_number_of_coefficients), stream);
+	CHECK_CUDA_ERROR(cudaEventRecord(m_coefficients_copied, stream));
+	m_coefficients_uploaded = true;
+}
+
+uint64_t Face::getCoefficientVersion(CoefficientGroup group) const
+{
+	for (int i = 0; i < kNumCoefficientGroups; ++i)
 	{
-		glDeleteVertexArrays(1, &m_vertex_array);
-		m_vertex_array = 0;
+		if (group == 1u << i)
+		{
+			return m_coefficient_versions[i];
+		}
+	}
+	throw std::runtime_error("Error: getCoefficientVersion expects a single coefficient group!");
+}
+
+void Face::markCoefficientsChanged(unsigned int groups)
+{
+	for (int i = 0; i < kNumCoefficientGroups; ++i)
+	{
+		if (groups & (1u << i))
+		{
+			++m_coefficient_versions[i];
+		}
 	}
-	cublasDestroy(m_cublas);
+}
+
+void Face::acquireDeviceCoefficients(cudaStream_t stream)
+{
+	uploadCoefficients(stream);
+	m_device_coefficients = true;
+}
+
+void Face::releaseDeviceCoefficients(cudaStream_t stream)
+{
+	if (!m_device_coefficients)
+	{
+		return;
+	}
+
+	CHECK_CUDA_ERROR(cudaEventSynchronize(m_coefficients_copied));
+	util::copyAsync(util::pinnedSpan(m_coefficients_host, m_number_of_coefficients), m_coefficients_gpu.span(0, m_number_of_coefficients), stream);
+	CHECK_CUDA_ERROR(cudaEventRecord(m_coefficients_copied, stream));
+	CHECK_CUDA_ERROR(cudaEventSynchronize(m_coefficients_copied));
+
+	const float* coefficients = m_coefficients_host;
+	std::copy(coefficients, coefficients + m_shape_coefficients.size(), m_shape_coefficients.begin());
+	coefficients += m_shape_coefficients.size();
+	std::copy(coefficients, coefficients + m_expression_coefficients.size(), m_expression_coefficients.begin());
+	coefficients += m_expression_coefficients.size();
+	std::copy(coefficients, coefficients + m_albedo_coefficients.size(), m_albedo_coefficients.begin());
+	coefficients += m_albedo_coefficients.size();
+	std::copy(coefficients, coefficients + m_sh_coefficients.size(), m_sh_coefficients.begin());
+	m_device_coefficients = false;
+	m_coefficients_uploaded = true;
+}
+
+void Face::setActiveCoefficients(int nShapeCoeffs, int nExpressionCoeffs, int nAlbedoCoeffs)
+{
+	nShapeCoeffs = glm::clamp(nShapeCoeffs, 0, static_cast<int>(m_shape_coefficients.size()));
+	nExpressionCoeffs = glm::clamp(nExpressionCoeffs, 0, static_cast<int>(m_expression_coefficients.size()));
+	nAlbedoCoeffs = glm::clamp(nAlbedoCoeffs, 0, static_cast<int>(m_albedo_coefficients.size()));
+	if (nShapeCoeffs != m_num_active_shape_coefficients || nExpressionCoeffs != m_num_active_expression_coefficients ||
+		nAlbedoCoeffs != m_num_active_albedo_coefficients)
+	{
+		m_face_valid = false;
+	}
+	m_num_active_shape_coefficients = nShapeCoeffs;
+	m_num_active_expression_coefficients = nExpressionCoeffs;
+	m_num_active_albedo_coefficients = nAlbedoCoeffs;
+}
+
+void Face::lockIdentity()
+{
+	util::ensureSize(m_neutral_face_gpu, m_model->average_face_gpu.getSize());
+	uploadCoefficients(getStream());
+	//All vertices, so every level of detail can start from it.
+	computeBlendshapes(m_model->average_face_gpu.getPtr(), m_neutral_face_gpu.getPtr(), m_model->number_of_vertices,
+		m_num_active_shape_coefficients, 0, m_num_active_albedo_coefficients);
+
+	m_identity_locked = true;
+	m_face_valid = false;
+	m_neutral_face_version++;
 }
 
 void Face::computeFace()
 {
-	util::copy(m_shape_coefficients_gpu, m_shape_coefficients, m_shape_coefficients.size());
-	util::copy(m_albedo_coefficients_gpu, m_albedo_coefficients, m_albedo_coefficients.size());
-	util::copy(m_expression_coefficients_gpu, m_expression_coefficients, m_expression_coefficients.size());
-	util::copy(m_current_face_gpu, m_average_face_gpu, m_average_face_gpu.getSize());
+	if (!m_device_coefficients)
+	{
+		uploadCoefficients(getStream());
+	}
+	if (m_computed_bases_version != m_model->bases_version)
+	{
+		m_computed_bases_version = m_model->bases_version;
+		m_face_valid = false;
+	}
 
-	float alpha = 1.0f;
-	float beta = 1.0f;
-	int m = 3 * m_number_of_vertices;
-	int n = m_shape_coefficients.size();
-	cublasSgemv(m_cublas, CUBLAS_OP_N, m, n, &alpha, m_shape_basis_gpu.getPtr(), m, m_shape_coefficients_gpu.getPtr(), 1, &beta,
-		reinterpret_cast<float*>(m_current_face_gpu.getPtr()), 1);
+	//A locked identity is baked into the neutral face, then only expressions change the current face.
+	const uint64_t* versions = m_coefficient_versions;
+	const bool positions = !m_face_valid || versions[1] != m_computed_versions[1] || (!m_identity_locked && versions[0] != m_computed_versions[0]);
+	const bool colors = !m_face_valid || (!m_identity_locked && versions[2] != m_computed_versions[2]);
+	if (!positions && !colors)
+	{
+		return;
+	}
 
-	n = m_albedo_coefficients.size();
-	cublasSgemv(m_cublas, CUBLAS_OP_N, m, n, &alpha, m_albedo_basis_gpu.getPtr(), m, m_albedo_coefficients_gpu.getPtr(), 1, &beta,
-		reinterpret_cast<float*>(m_current_face_gpu.getPtr()) + m, 1);
+	//Straight into the vertex buffer while the solver has it mapped. A partial update needs the rest of the face there too.
+	glm::vec3* target = nullptr;
+	if (positions && colors)
+	{
+		target = m_mapped_vertex_buffer ? static_cast<glm::vec3*>(m_mapped_vertex_buffer) : m_current_face_gpu.getPtr();
+		m_face_in_vertex_buffer = m_mapped_vertex_buffer != nullptr;
+		m_face_in_array = !m_face_in_vertex_buffer;
+	}
+	else
+	{
+		if (m_mapped_vertex_buffer && !m_face_in_vertex_buffer)
+		{
+			copyCurrentFace(true);
+		}
+		target = getWritableCurrentFace();
+	}
 
-	n = m_expression_coefficients.size();
-	cublasSgemv(m_cublas, CUBLAS_OP_N, m, n, &alpha, m_expression_basis_gpu.getPtr(), m, m_expression_coefficients_gpu.getPtr(), 1, &beta,
-		reinterpret_cast<float*>(m_current_face_gpu.getPtr()), 1);
+	float4* aligned_target = getAlignedTarget();
+	if (m_identity_locked)
+	{
+		computeBlendshapes(m_neutral_face_gpu.getPtr(), target, m_number_of_vertices, 0, m_num_active_expression_coefficients, 0,
+			positions, colors, aligned_target);
+	}
+	else
+	{
+		computeBlendshapes(m_model->average_face_gpu.getPtr(), target, m_number_of_vertices,
+			m_num_active_shape_coefficients, m_num_active_expression_coefficients, m_num_active_albedo_coefficients, positions, colors,
+			aligned_target);
+	}
 
-	computeNormals();
+	if (positions)
+	{
+		computeNormals(target);
+	}
+	std::copy(versions, versions + 3, m_computed_versions);
+	m_face_valid = true;
 }
 
 glm::mat4 Face::computeModelMatrix() const
@@ -237,31 +667,103 @@ void Face::computeRotationDerivatives(glm::mat3& drx, glm::mat3& dry, glm::mat3&
 
 void Face::updateVertexBuffer()
 {
-	CHECK_CUDA_ERROR(cudaGraphicsMapResources(1, &m_resource, 0));
-	void* vertex_buffer_ptr;
-	size_t size;
-	CHECK_CUDA_ERROR(cudaGraphicsResourceGetMappedPointer(&vertex_buffer_ptr, &size, m_resource));
-	CHECK_CUDA_ERROR(cudaMemcpy(vertex_buffer_ptr, m_current_face_gpu.getPtr(), m_number_of_vertices * sizeof(glm::vec3) * 3, cudaMemcpyDeviceToDevice));
+	if (!m_face_in_vertex_buffer)
+	{
+		copyCurrentFace(true);
+	}
+}
+
+cudaStream_t Face::getStream() const
+{
+	return m_context ? m_context->getComputeStream() : 0;
+}
+
+void Face::copyCurrentFace(bool to_vertex_buffer)
+{
+	const size_t bytes = m_number_of_vertices * sizeof(glm::vec3) * 3;
+	const cudaStream_t stream = getStream();
+	void* vertex_buffer_ptr = m_mapped_vertex_buffer;
+	if (!m_mapped_vertex_buffer)
+	{
+		CHECK_CUDA_ERROR(cudaGraphicsMapResources(1, &m_resource, stream));
+		size_t size;
+		CHECK_CUDA_ERROR(cudaGraphicsResourceGetMappedPointer(&vertex_buffer_ptr, &size, m_resource));
+	}
+
+	if (to_vertex_buffer)
+	{
+		CHECK_CUDA_ERROR(cudaMemcpyAsync(vertex_buffer_ptr, m_current_face_gpu.getPtr(), bytes, cudaMemcpyDeviceToDevice, stream));
+		m_face_in_vertex_buffer = true;
+	}
+	else
+	{
+		CHECK_CUDA_ERROR(cudaMemcpyAsync(m_current_face_gpu.getPtr(), vertex_buffer_ptr, bytes, cudaMemcpyDeviceToDevice, stream));
+		m_face_in_array = true;
+	}
+
+	if (!m_mapped_vertex_buffer)
+	{
+		//Unmapping orders the copy before later GL use of the buffer.
+		CHECK_CUDA_ERROR(cudaGraphicsUnmapResources(1, &m_resource, stream));
+	}
+}
+
+glm::vec3* Face::getCurrentFaceGpu()
+{
+	if (!m_face_in_array && m_face_in_vertex_buffer)
+	{
+		if (m_mapped_vertex_buffer)
+		{
+			return static_cast<glm::vec3*>(m_mapped_vertex_buffer);
+		}
+		copyCurrentFace(false);
+	}
+	return m_current_face_gpu.getPtr();
+}
+
+glm::vec3* Face::getWritableCurrentFace()
+{
+	if (m_face_in_vertex_buffer && m_mapped_vertex_buffer)
+	{
+		m_face_in_array = false;
+		return static_cast<glm::vec3*>(m_mapped_vertex_buffer);
+	}
 
-	CHECK_CUDA_ERROR(cudaGraphicsUnmapResources(1, &m_resource, 0));
+	glm::vec3* current_face = getCurrentFaceGpu();
+	m_face_in_array = true;
+	m_face_in_vertex_buffer = false;
+	return current_face;
 }
 
-void Face::draw() const
+void Face::draw(bool clear) const
 {
 	if (m_graphics_settings.mapped_to_cuda)
 	{
 		throw std::runtime_error("Error: Draw is called while rts is mapped!");
 	}
+	util::ScopedGlTimer timer("Face::draw");
 
 	// Render to face framebuffer
 	glBindFramebuffer(GL_FRAMEBUFFER, m_graphics_settings.framebuffer);
-	glViewport(0, 0, m_graphics_settings.texture_width, m_graphics_settings.texture_height);
-	glClearColor(0, 0, 0, 0);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	const auto& settings = m_graphics_settings;
+	glViewport(settings.target_x, settings.target_y, settings.texture_width, settings.texture_height);
+	if (clear)
+	{
+		//The other levels of an atlas keep their pixels.
+		glEnable(GL_SCISSOR_TEST);
+		glScissor(settings.target_x, settings.target_y, settings.texture_width, settings.texture_height);
+		glClearColor(0, 0, 0, 0);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		//glClear leaves integer targets undefined, the packed visibility buffer relies on 0 for the background.
+		const GLuint zero[4] = { 0, 0, 0, 0 };
+		glClearBufferuiv(GL_COLOR, 3, zero);
+		glDisable(GL_SCISSOR_TEST);
+	}
 	glEnable(GL_DEPTH_TEST);
 
 	m_graphics_settings.shader->use();
 	m_graphics_settings.shader->setMat4("model", computeModelMatrix());
+	m_graphics_settings.shader->setMat4("crop", m_graphics_settings.crop);
 	m_graphics_settings.shader->setUniformFVVar("sh_coefficients", getSHCoefficients());
 
 	glBindVertexArray(m_vertex_array);
@@ -269,6 +771,519 @@ void Face::draw() const
 	glBindVertexArray(0);
 }
 
+void Face::attachShaders(GLSLProgram& program, bool fragment_barycentrics, const std::string& shader_directory)
+{
+	bool supported = false;
+	GLint n_extensions = 0;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &n_extensions);
+	for (GLint i = 0; i < n_extensions && fragment_barycentrics && !supported; ++i)
+	{
+		const auto* extension = reinterpret_cast<const char*>(glGetStringi(GL_EXTENSIONS, i));
+		supported = extension && std::strcmp(extension, "GL_NV_fragment_shader_barycentric") == 0;
+	}
+
+	//The geometry shader only produces the barycentrics and the vertex ids of the triangle, the extension provides both.
+	if (supported)
+	{
+		program.attachShader(GL_VERTEX_SHADER, shader_directory + "face_barycentric.vert");
+		program.attachShader(GL_FRAGMENT_SHADER, shader_directory + "face_barycentric.frag");
+	}
+	else
+	{
+		program.attachShader(GL_VERTEX_SHADER, shader_directory + "face.vert");
+		program.attachShader(GL_GEOMETRY_SHADER, shader_directory + "face.geom");
+		program.attachShader(GL_FRAGMENT_SHADER, shader_directory + "face.frag");
+	}
+}
+
+void Face::setHalfPrecisionBasis(bool enabled)
+{
+	if (enabled != m_model->half_precision_basis)
+	{
+		//Reloading keeps the FP32 values exact when switching back.
+		CHECK_CUDA_ERROR(cudaDeviceSynchronize());
+		loadBases(enabled);
+	}
+}
+
+void Face::setSparseExpressionBasis(float threshold)
+{
+	threshold = std::max(threshold, 0.0f);
+	if (threshold != m_model->sparse_expression_threshold)
+	{
+		//From the dense basis again, so lowering the threshold brings rows back.
+		CHECK_CUDA_ERROR(cudaDeviceSynchronize());
+		m_model->sparse_expression_threshold = threshold;
+		loadBases(m_model->half_precision_basis);
+	}
+}
+
+void Face::setTiledBasis(int cache_tiles)
+{
+	cache_tiles = std::max(cache_tiles, 0);
+	if (cache_tiles != m_model->tiled_basis_cache_tiles)
+	{
+		CHECK_CUDA_ERROR(cudaDeviceSynchronize());
+		m_model->tiled_basis_cache_tiles = cache_tiles;
+		loadBases(m_model->half_precision_basis);
+	}
+}
+
+void Face::setAlignedVertices(bool enabled)
+{
+	if (enabled != m_model->aligned_vertices)
+	{
+		//The copies of the faces are written from scratch by their next computeFace.
+		m_model->aligned_vertices = enabled;
+		++m_model->bases_version;
+	}
+}
+
+float4* Face::getAlignedTarget()
+{
+	if (!m_model->aligned_vertices)
+	{
+		return nullptr;
+	}
+
+	//All vertices of the model, so every level of detail fits. The w components stay 0.
+	const int size = 3 * m_model->number_of_vertices;
+	if (m_aligned_face_gpu.getSize() < size)
+	{
+		m_aligned_face_gpu = util::DeviceArray<float4>(size);
+		m_aligned_face_gpu.memset(0, getStream());
+	}
+	return m_aligned_face_gpu.getPtr();
+}
+
+int Face::getNumExpressionVertices() const
+{
+	return m_model->expression_vertex_map.empty() ? m_model->number_of_vertices : m_model->number_of_expression_vertices;
+}
+
+//Binary model cache: the header, positions, colors, indices, original vertex ids, indices of the coarser meshes, then the
+//shape, albedo and expression bases
+//with the standard deviation folded in, in the column-major layout of the device arrays. FP16 bases are stored divided by
+//their scale. The mesh and the bases are compacted and reordered, see compactModel.
+struct Face::ModelCacheHeader
+{
+	char magic[4]{ 'F', 'M', 'M', 'C' };
+	uint32_t version = 5;
+	uint32_t num_original_vertices = 0;
+	uint32_t num_vertices = 0;
+	uint32_t num_faces = 0;
+	uint32_t num_lods = 0; //coarser meshes, their indices follow the original vertex ids
+	uint32_t lod_num_vertices[4] = { 0, 0, 0, 0 };
+	uint32_t lod_num_faces[4] = { 0, 0, 0, 0 };
+	uint32_t num_basis_coefficients[3] = { 0, 0, 0 }; //shape, albedo, expression
+	uint32_t half_precision = 0;
+	float basis_scale[3] = { 1.0f, 1.0f, 1.0f };
+	//Of the model files it was built from, see ModelSourceFingerprint
+	uint64_t source_size = 0;
+	int64_t source_mtime = 0;
+	uint64_t source_hash = 0;
+};
+
+//Sizes and modification times of the model files the caches are built from. A cache whose fingerprint differs was built
+//from other files and is rebuilt. The files aren't read, the bases are hundreds of MB of text.
+struct ModelSourceFingerprint
+{
+	uint64_t size = 0; //of all files
+	int64_t mtime = 0; //the newest one
+	uint64_t hash = 0; //FNV-1a of the names, sizes and times
+	int num_files = 0; //found, 0: only the caches are deployed
+};
+
+static ModelSourceFingerprint getModelSourceFingerprint(const std::string& directory)
+{
+	static const char* const kSourceFiles[] = { "/nomouth.off", "/ShapeBasis_modified.matrix", "/StandardDeviationShape.vec",
+		"/AlbedoBasis_modified.matrix", "/StandardDeviationAlbedo.vec", "/ExpressionBasis_modified.matrix", "/StandardDeviationExpression.vec" };
+
+	ModelSourceFingerprint fingerprint;
+	fingerprint.hash = 14695981039346656037ull;
+	auto hash = [&fingerprint](const void* data, size_t bytes)
+	{
+		for (size_t i = 0; i < bytes; ++i)
+		{
+			fingerprint.hash = (fingerprint.hash ^ static_cast<const uint8_t*>(data)[i]) * 1099511628211ull;
+		}
+	};
+	for (const char* name : kSourceFiles)
+	{
+		std::error_code error;
+		const std::filesystem::path path(directory + name);
+		const uint64_t size = std::filesystem::file_size(path, error);
+		if (error)
+		{
+			continue;
+		}
+		const int64_t mtime = std::filesystem::last_write_time(path, error).time_since_epoch().count();
+		if (error)
+		{
+			continue;
+		}
+		hash(name, std::strlen(name));
+		hash(&size, sizeof(size));
+		hash(&mtime, sizeof(mtime));
+		fingerprint.size += size;
+		fingerprint.mtime = std::max(fingerprint.mtime, mtime);
+		fingerprint.num_files++;
+	}
+	return fingerprint;
+}
+
+//Bytes from the header to the bases.
+static size_t getModelCacheMeshBytes(const uint32_t num_vertices, const uint32_t num_faces, const uint32_t num_lods, const uint32_t* lod_num_faces)
+{
+	size_t bytes = 2 * num_vertices * sizeof(glm::vec3) + 3 * num_faces * sizeof(unsigned int) + num_vertices * sizeof(int);
+	for (uint32_t i = 0; i < num_lods; ++i)
+	{
+		bytes += 3 * lod_num_faces[i] * sizeof(unsigned int);
+	}
+	return bytes;
+}
+
+std::string Face::getModelCachePath(bool half_precision) const
+{
+	return m_model->directory + (half_precision ? "/model_cache_fp16.bin" : "/model_cache_fp32.bin");
+}
+
+const Face::ModelCacheHeader* Face::getModelCacheHeader(const util::MappedFile& cache, bool half_precision) const
+{
+	if (!cache.isOpen() || cache.getSize() < sizeof(ModelCacheHeader))
+	{
+		return nullptr;
+	}
+
+	const ModelCacheHeader expected;
+	const auto header = reinterpret_cast<const ModelCacheHeader*>(cache.getData());
+	if (std::memcmp(header->magic, expected.magic, sizeof(expected.magic)) != 0 || header->version != expected.version ||
+		header->half_precision != (half_precision ? 1u : 0u))
+	{
+		std::cout << "Warning: Ignoring the outdated model cache " << getModelCachePath(half_precision) << std::endl;
+		return nullptr;
+	}
+
+	if (header->num_lods > 4)
+	{
+		std::cout << "Warning: Ignoring the corrupted model cache " << getModelCachePath(half_precision) << std::endl;
+		return nullptr;
+	}
+
+	//Without the model files the cache is all there is.
+	const auto fingerprint = getModelSourceFingerprint(m_model->directory);
+	if (fingerprint.num_files > 0 && (header->source_size != fingerprint.size || header->source_mtime != fingerprint.mtime ||
+		header->source_hash != fingerprint.hash))
+	{
+		std::cout << "Warning: Ignoring the model cache " << getModelCachePath(half_precision) << ", the model files changed." << std::endl;
+		return nullptr;
+	}
+
+	const size_t element_size = half_precision ? sizeof(Eigen::half) : sizeof(float);
+	size_t size = sizeof(ModelCacheHeader) + getModelCacheMeshBytes(header->num_vertices, header->num_faces, header->num_lods, header->lod_num_faces);
+	for (auto n : header->num_basis_coefficients)
+	{
+		size += static_cast<size_t>(3) * header->num_vertices * n * element_size;
+	}
+	if (cache.getSize() != size)
+	{
+		std::cout << "Warning: Ignoring the truncated model cache " << getModelCachePath(half_precision) << std::endl;
+		return nullptr;
+	}
+
+	return header;
+}
+
+Face::HostBases Face::loadBasesFromText(bool all_columns)
+{
+	auto load_basis = [this, all_columns](int component, const std::string& basis_filename, const std::string& std_dev_filename,
+		std::vector<float>& coefficients)
+	{
+		if (!all_columns && m_model->basis_limits.getColumns(component, 1) == 0)
+		{
+			coefficients.clear();
+			return std::vector<float>();
+		}
+		std::vector<float> basis = loadModelData(m_model->directory + basis_filename, true);
+		auto std_dev = loadModelData(m_model->directory + std_dev_filename, false);
+		coefficients.resize(std_dev.size(), 0.0f);
+		compactBasis(basis, coefficients.size());
+		Eigen::Map<Eigen::MatrixXf> basis_eigen(basis.data(), m_model->number_of_vertices * 3, coefficients.size());
+		Eigen::Map<Eigen::VectorXf> std_dev_eigen(std_dev.data(), std_dev.size());
+		basis_eigen = basis_eigen.array().rowwise() * std_dev_eigen.transpose().array();
+		return basis;
+	};
+
+	HostBases bases;
+	bases.shape = load_basis(0, "/ShapeBasis_modified.matrix", "/StandardDeviationShape.vec", m_shape_coefficients);
+	bases.albedo = load_basis(1, "/AlbedoBasis_modified.matrix", "/StandardDeviationAlbedo.vec", m_albedo_coefficients);
+	bases.expression = load_basis(2, "/ExpressionBasis_modified.matrix", "/StandardDeviationExpression.vec", m_expression_coefficients);
+	if (!all_columns)
+	{
+		truncateBases(bases);
+	}
+	return bases;
+}
+
+void Face::truncateBases(HostBases& bases)
+{
+	//Column-major, the first columns are a prefix.
+	std::vector<float>* host_bases[3] = { &bases.shape, &bases.albedo, &bases.expression };
+	std::vector<float>* coefficients[3] = { &m_shape_coefficients, &m_albedo_coefficients, &m_expression_coefficients };
+	for (int i = 0; i < 3; ++i)
+	{
+		const size_t n_columns = m_model->basis_limits.getColumns(i, coefficients[i]->size());
+		coefficients[i]->resize(n_columns);
+		host_bases[i]->resize(static_cast<size_t>(3) * m_model->number_of_vertices * n_columns);
+	}
+}
+
+//Normalize by the largest entry, the basis values are far below the smallest normal FP16 number otherwise.
+static std::vector<Eigen::half> toHalfPrecision(const std::vector<float>& basis, float& scale)
+{
+	float max_abs = 0.0f;
+	for (auto value : basis)
+	{
+		max_abs = std::max(max_abs, std::abs(value));
+	}
+	scale = max_abs > 0.0f ? max_abs : 1.0f;
+
+	std::vector<Eigen::half> basis_half(basis.size());
+	for (size_t i = 0; i < basis.size(); ++i)
+	{
+		basis_half[i] = Eigen::half(basis[i] / scale);
+	}
+	return basis_half;
+}
+
+void Face::releaseBases()
+{
+	m_model->shape_basis_gpu = util::DeviceArray<float>();
+	m_model->albedo_basis_gpu = util::DeviceArray<float>();
+	m_model->expression_basis_gpu = util::DeviceArray<float>();
+	m_model->shape_basis_half_gpu = util::DeviceArray<Eigen::half>();
+	m_model->albedo_basis_half_gpu = util::DeviceArray<Eigen::half>();
+	m_model->expression_basis_half_gpu = util::DeviceArray<Eigen::half>();
+	m_model->shape_basis_scale = 1.0f;
+	m_model->albedo_basis_scale = 1.0f;
+	m_model->expression_basis_scale = 1.0f;
+	m_model->expression_vertex_map.clear();
+	m_model->expression_vertex_map_gpu = util::DeviceArray<int>();
+	m_model->number_of_expression_vertices = 0;
+	m_model->tiled_basis.reset();
+}
+
+void Face::uploadBases(const HostBases& bases, bool half_precision)
+{
+	//Free the old storage first, so the peak stays at one copy of the bases.
+	releaseBases();
+
+	if (half_precision)
+	{
+		m_model->shape_basis_half_gpu = util::DeviceArray<Eigen::half>(toHalfPrecision(bases.shape, m_model->shape_basis_scale));
+		m_model->albedo_basis_half_gpu = util::DeviceArray<Eigen::half>(toHalfPrecision(bases.albedo, m_model->albedo_basis_scale));
+		m_model->expression_basis_half_gpu = util::DeviceArray<Eigen::half>(toHalfPrecision(bases.expression, m_model->expression_basis_scale));
+	}
+	else
+	{
+		m_model->shape_basis_gpu = util::DeviceArray<float>(bases.shape);
+		m_model->albedo_basis_gpu = util::DeviceArray<float>(bases.albedo);
+		m_model->expression_basis_gpu = util::DeviceArray<float>(bases.expression);
+	}
+	m_model->half_precision_basis = half_precision;
+}
+
+void Face::loadBasesFromCache(const util::MappedFile& cache)
+{
+	releaseBases();
+
+	const auto header = reinterpret_cast<const ModelCacheHeader*>(cache.getData());
+	const bool half_precision = header->half_precision != 0;
+	const char* data = cache.getData() + sizeof(ModelCacheHeader) +
+		getModelCacheMeshBytes(header->num_vertices, header->num_faces, header->num_lods, header->lod_num_faces);
+
+	std::vector<float>* coefficients[3] = { &m_shape_coefficients, &m_albedo_coefficients, &m_expression_coefficients };
+	util::DeviceArray<float>* bases[3] = { &m_model->shape_basis_gpu, &m_model->albedo_basis_gpu, &m_model->expression_basis_gpu };
+	util::DeviceArray<Eigen::half>* bases_half[3] = { &m_model->shape_basis_half_gpu, &m_model->albedo_basis_half_gpu, &m_model->expression_basis_half_gpu };
+	float* scales[3] = { &m_model->shape_basis_scale, &m_model->albedo_basis_scale, &m_model->expression_basis_scale };
+
+	for (int i = 0; i < 3; ++i)
+	{
+		//Column-major, the columns after the basis limits are skipped.
+		const size_t n_columns = m_model->basis_limits.getColumns(i, header->num_basis_coefficients[i]);
+		coefficients[i]->resize(n_columns, 0.0f);
+		const size_t n_elements = static_cast<size_t>(3) * header->num_vertices * n_columns;
+		const size_t n_stored = static_cast<size_t>(3) * header->num_vertices * header->num_basis_coefficients[i];
+		void* destination = nullptr;
+		if (half_precision)
+		{
+			*bases_half[i] = util::DeviceArray<Eigen::half>(static_cast<int>(n_elements));
+			destination = bases_half[i]->getPtr();
+		}
+		else
+		{
+			*bases[i] = util::DeviceArray<float>(static_cast<int>(n_elements));
+			destination = bases[i]->getPtr();
+		}
+		*scales[i] = header->basis_scale[i];
+
+		const size_t element_bytes = half_precision ? sizeof(Eigen::half) : sizeof(float);
+		util::copyThroughPinnedMemory(destination, data, n_elements * element_bytes);
+		data += n_stored * element_bytes;
+	}
+	m_model->half_precision_basis = half_precision;
+}
+
+void Face::writeModelCache(bool half_precision, const std::vector<glm::vec3>& positions, const std::vector<glm::vec3>& colors,
+	const HostBases& bases) const
+{
+	//Written next to it and renamed, so a process which starts meanwhile never maps a half written cache. The batch workers
+	//may write it at the same time.
+	const auto filepath = getModelCachePath(half_precision);
+	const auto temporary_path = util::getTemporaryPath(filepath);
+	std::ofstream file(temporary_path, std::ofstream::binary);
+	if (!file.is_open())
+	{
+		std::cout << "Warning: Could not open " << temporary_path << " for writing!" << std::endl;
+		return;
+	}
+
+	ModelCacheHeader header;
+	header.num_original_vertices = m_model->number_of_original_vertices;
+	header.num_vertices = m_model->number_of_vertices;
+	header.num_faces = m_model->number_of_indices / 3;
+	header.num_lods = static_cast<uint32_t>(m_model->meshes.size() - 1);
+	for (uint32_t i = 0; i < header.num_lods; ++i)
+	{
+		header.lod_num_vertices[i] = m_model->meshes[i + 1].number_of_vertices;
+		header.lod_num_faces[i] = m_model->meshes[i + 1].number_of_indices / 3;
+	}
+	header.num_basis_coefficients[0] = m_shape_coefficients.size();
+	header.num_basis_coefficients[1] = m_albedo_coefficients.size();
+	header.num_basis_coefficients[2] = m_expression_coefficients.size();
+	header.half_precision = half_precision ? 1 : 0;
+	const auto fingerprint = getModelSourceFingerprint(m_model->directory);
+	header.source_size = fingerprint.size;
+	header.source_mtime = fingerprint.mtime;
+	header.source_hash = fingerprint.hash;
+
+	const std::vector<float>* host_bases[3] = { &bases.shape, &bases.albedo, &bases.expression };
+	std::vector<Eigen::half> bases_half[3];
+	if (half_precision)
+	{
+		for (int i = 0; i < 3; ++i)
+		{
+			bases_half[i] = toHalfPrecision(*host_bases[i], header.basis_scale[i]);
+		}
+	}
+
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	file.write(reinterpret_cast<const char*>(positions.data()), positions.size() * sizeof(glm::vec3));
+	file.write(reinterpret_cast<const char*>(colors.data()), colors.size() * sizeof(glm::vec3));
+	const auto& indices = m_model->meshes[0].indices;
+	file.write(reinterpret_cast<const char*>(indices.data()), indices.size() * sizeof(unsigned int));
+	file.write(reinterpret_cast<const char*>(m_model->original_vertex_ids.data()), m_model->original_vertex_ids.size() * sizeof(int));
+	for (size_t i = 1; i < m_model->meshes.size(); ++i)
+	{
+		const auto& lod_indices = m_model->meshes[i].indices;
+		file.write(reinterpret_cast<const char*>(lod_indices.data()), lod_indices.size() * sizeof(unsigned int));
+	}
+	for (int i = 0; i < 3; ++i)
+	{
+		if (half_precision)
+		{
+			file.write(reinterpret_cast<const char*>(bases_half[i].data()), bases_half[i].size() * sizeof(Eigen::half));
+		}
+		else
+		{
+			file.write(reinterpret_cast<const char*>(host_bases[i]->data()), host_bases[i]->size() * sizeof(float));
+		}
+	}
+
+	file.close();
+	if (!file)
+	{
+		std::cout << "Warning: Could not write " << temporary_path << "!" << std::endl;
+		std::remove(temporary_path.c_str());
+		return;
+	}
+	if (!util::replaceFile(temporary_path, filepath))
+	{
+		std::cout << "Warning: Could not replace " << filepath << "!" << std::endl;
+	}
+}
+
+void Face::loadTiledBases()
+{
+	releaseBases();
+
+	//The FP16 cache holds the bases in the layout and precision of the tiles, so they are transposed straight from the mapping.
+	util::MappedFile cache(getModelCachePath(true));
+	const ModelCacheHeader* header = getModelCacheHeader(cache, true);
+	std::vector<Eigen::half> bases_half[3];
+	const Eigen::half* bases[3] = {};
+	float* scales[3] = { &m_model->shape_basis_scale, &m_model->albedo_basis_scale, &m_model->expression_basis_scale };
+	if (header)
+	{
+		const char* data = cache.getData() + sizeof(ModelCacheHeader) +
+			getModelCacheMeshBytes(header->num_vertices, header->num_faces, header->num_lods, header->lod_num_faces);
+		for (int i = 0; i < 3; ++i)
+		{
+			bases[i] = reinterpret_cast<const Eigen::half*>(data);
+			*scales[i] = header->basis_scale[i];
+			data += static_cast<size_t>(3) * header->num_vertices * header->num_basis_coefficients[i] * sizeof(Eigen::half);
+		}
+	}
+	else
+	{
+		const HostBases host_bases = loadBasesFromText();
+		const std::vector<float>* bases_float[3] = { &host_bases.shape, &host_bases.albedo, &host_bases.expression };
+		for (int i = 0; i < 3; ++i)
+		{
+			bases_half[i] = toHalfPrecision(*bases_float[i], *scales[i]);
+			bases[i] = bases_half[i].data();
+		}
+	}
+
+	const int n_coefficients[3] = { static_cast<int>(m_shape_coefficients.size()), static_cast<int>(m_albedo_coefficients.size()),
+		static_cast<int>(m_expression_coefficients.size()) };
+	m_model->tiled_basis = std::make_unique<TiledBasis>(m_model->number_of_vertices, n_coefficients, bases, m_model->tiled_basis_cache_tiles);
+	m_model->half_precision_basis = true;
+}
+
+void Face::loadBases(bool half_precision)
+{
+	util::ScopedAllocationTag tag("basis");
+	if (m_model->tiled_basis_cache_tiles > 0)
+	{
+		loadTiledBases();
+		gatherLandmarkBases();
+		++m_model->bases_version;
+		return;
+	}
+
+	//The cache and the text files are column-major, the layout is restored after loading.
+	const bool vertex_major = m_model->vertex_major_basis;
+	m_model->vertex_major_basis = false;
+
+	util::MappedFile cache(getModelCachePath(half_precision));
+	if (getModelCacheHeader(cache, half_precision))
+	{
+		loadBasesFromCache(cache);
+	}
+	else
+	{
+		uploadBases(loadBasesFromText(), half_precision);
+	}
+	if (m_model->sparse_expression_threshold > 0.0f)
+	{
+		sparsifyExpressionBasis();
+	}
+	setVertexMajorBasis(vertex_major);
+	gatherLandmarkBases();
+	++m_model->bases_version;
+}
+
 //Only load .matrix file with _modified suffix.
 //You can use this for any .vec file.
 std::vector<float> Face::loadModelData(const std::string& filename, bool is_basis)
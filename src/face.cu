@@ -1,43 +1,592 @@
 #include "device_util.h"
 #include "face.h"
+#include "prior_sparse_features.h"
+#include "launch_tuner.h"
 
-__global__ void computeNormalsKernel(int number_of_vertices, int number_of_faces, glm::vec3* current_face, glm::ivec3* faces)
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+
+//One thread per vertex, summing its incident faces from the CSR adjacency in a fixed order. No atomics, so the result is
+//deterministic, and each normal is written once, already normalized.
+//With "aligned_face" the positions are read from it and the normal is written to both.
+__global__ void computeNormalsKernel(int number_of_vertices, glm::vec3* __restrict__ current_face, float4* aligned_face,
+	const glm::ivec3* __restrict__ faces, const int* __restrict__ vertex_face_offsets, const int* __restrict__ vertex_faces)
 {
-	int index = util::getThreadIndex1D();
-	int stride = blockDim.x * gridDim.x;
+	const int vertex = util::getThreadIndex1D();
+	if (vertex >= number_of_vertices)
+	{
+		return;
+	}
 
-	for (int i = index; i < number_of_faces; i += stride)
+	glm::vec3 vertex_normal(0.0f, 0.0f, 0.0f);
+	for (int i = vertex_face_offsets[vertex]; i < vertex_face_offsets[vertex + 1]; ++i)
 	{
-		const auto face = faces[index];
+		const auto face = faces[vertex_faces[i]];
 
-		glm::vec3 v0 = current_face[face.x];
-		glm::vec3 v1 = current_face[face.y];
-		glm::vec3 v2 = current_face[face.z];
+		const glm::vec3 v0 = util::loadVertex(current_face, aligned_face, face.x);
+		const glm::vec3 v1 = util::loadVertex(current_face, aligned_face, face.y);
+		const glm::vec3 v2 = util::loadVertex(current_face, aligned_face, face.z);
 
 		// Not normalizing face_normal is actually a way to use weighted average of normals of neighbouring triangles
 		// where weights are the areas of the triangles.
-		glm::vec3 face_normal = glm::cross((v1 - v0), (v2 - v0));
-		auto normals = &current_face[2 * number_of_vertices];
+		vertex_normal += glm::cross((v1 - v0), (v2 - v0));
+	}
+
+	const float length = glm::length(vertex_normal);
+	const glm::vec3 normal = length > 0.0f ? vertex_normal / length : vertex_normal;
+	current_face[2 * number_of_vertices + vertex] = normal;
+	if (aligned_face)
+	{
+		aligned_face[2 * number_of_vertices + vertex] = make_float4(normal.x, normal.y, normal.z, 0.0f);
+	}
+}
 
-		for (int i : { face.x, face.y, face.z })
+//"Basis" is float or Eigen::half. Half precision bases are stored divided by their scale.
+//Entry (row, i) of a basis is at row * row_stride + i * column_stride, see FaceModel::getBasisRowStride. A sparse expression
+//basis (expression_vertex_map) has its own column stride and skips the vertices without expression rows.
+//"aligned_target" (see Face::setAlignedVertices) gets every component a second time at 4 floats per vertex, if it is set.
+//Only rows [first_row, end_row) of the nRows are written. With "vertex_map" (see TiledBasis) the shape and albedo rows of
+//vertex v are the ones of vertex vertex_map[v], like the expression rows of a sparse basis.
+template<typename Basis>
+__global__ void computeBlendshapesKernel(int nRows, int nBaseRows, int first_row, int end_row, const int* __restrict__ vertex_map,
+	const float* __restrict__ base, float* __restrict__ target,
+	float* __restrict__ aligned_target, int column_stride,
+	const Basis* __restrict__ shape_basis, const float* __restrict__ shape_coefficients, float shape_scale, int nShapeCoeffs, int shape_row_stride,
+	const Basis* __restrict__ expression_basis, const float* __restrict__ expression_coefficients, float expression_scale, int nExpressionCoeffs, int expression_row_stride,
+	const int* __restrict__ expression_vertex_map, int nExpressionVertices, int expression_column_stride,
+	const Basis* __restrict__ albedo_basis, const float* __restrict__ albedo_coefficients, float albedo_scale, int nAlbedoCoeffs, int albedo_row_stride,
+	bool write_positions, bool write_colors)
+{
+	//Every thread needs all coefficients, stage them once per block. The basis scale is folded into them.
+	extern __shared__ float coefficients[];
+	float* shape = coefficients;
+	float* expression = shape + nShapeCoeffs;
+	float* albedo = expression + nExpressionCoeffs;
+	for (int i = threadIdx.x; i < nShapeCoeffs; i += blockDim.x)
+	{
+		shape[i] = shape_coefficients[i] * shape_scale;
+	}
+	for (int i = threadIdx.x; i < nExpressionCoeffs; i += blockDim.x)
+	{
+		expression[i] = expression_coefficients[i] * expression_scale;
+	}
+	for (int i = threadIdx.x; i < nAlbedoCoeffs; i += blockDim.x)
+	{
+		albedo[i] = albedo_coefficients[i] * albedo_scale;
+	}
+	__syncthreads();
+
+	//One thread per vertex component. Column-major bases are read by neighbouring threads at neighbouring floats,
+	//vertex-major ones walk along the cache lines of their own row.
+	const int row = first_row + util::getThreadIndex1D();
+	if (row >= end_row)
+	{
+		return;
+	}
+	const int basis_row = vertex_map ? 3 * vertex_map[row / 3] + row % 3 : row;
+
+	if (write_positions)
+	{
+		float position = base[row];
+		for (int i = 0; i < nShapeCoeffs; ++i)
 		{
-			auto& vertex_normal = normals[i];
+			position += static_cast<float>(shape_basis[basis_row * shape_row_stride + i * column_stride]) * shape[i];
+		}
+		int expression_row = row;
+		int nExpressionCols = nExpressionCoeffs;
+		if (expression_vertex_map)
+		{
+			const int vertex = expression_vertex_map[row / 3];
+			expression_row = 3 * vertex + row % 3;
+			nExpressionCols = vertex < nExpressionVertices ? nExpressionCoeffs : 0;
+		}
+		for (int i = 0; i < nExpressionCols; ++i)
+		{
+			position += static_cast<float>(expression_basis[expression_row * expression_row_stride + i * expression_column_stride]) * expression[i];
+		}
+		target[row] = position;
+		if (aligned_target)
+		{
+			aligned_target[4 * (row / 3) + row % 3] = position;
+		}
+	}
 
-			atomicAdd(&vertex_normal.x, face_normal.x);
-			atomicAdd(&vertex_normal.y, face_normal.y);
-			atomicAdd(&vertex_normal.z, face_normal.z);
+	if (write_colors)
+	{
+		float color = base[nBaseRows + row];
+		for (int i = 0; i < nAlbedoCoeffs; ++i)
+		{
+			color += static_cast<float>(albedo_basis[basis_row * albedo_row_stride + i * column_stride]) * albedo[i];
+		}
+		target[nRows + row] = color;
+		if (aligned_target)
+		{
+			aligned_target[4 * (nRows / 3 + row / 3) + row % 3] = color;
 		}
 	}
+	//Normals are overwritten by computeNormals.
+}
+
+void Face::computeBlendshapes(const glm::vec3* base, glm::vec3* target, int number_of_vertices, int nShapeCoeffs, int nExpressionCoeffs,
+	int nAlbedoCoeffs, bool positions, bool colors, float4* aligned_target)
+{
+	//The skipped half stages no coefficients.
+	if (!positions)
+	{
+		nShapeCoeffs = 0;
+		nExpressionCoeffs = 0;
+	}
+	if (!colors)
+	{
+		nAlbedoCoeffs = 0;
+	}
+
+	const int n_rows = 3 * number_of_vertices;
+	const int n_base_rows = 3 * m_model->number_of_vertices;
+	const size_t shared_memory = (nShapeCoeffs + nExpressionCoeffs + nAlbedoCoeffs) * sizeof(float);
+	const int column_stride = m_model->getBasisColumnStride();
+	const int shape_row_stride = m_model->getBasisRowStride(m_shape_coefficients.size());
+	const int expression_row_stride = m_model->getBasisRowStride(m_expression_coefficients.size());
+	const int albedo_row_stride = m_model->getBasisRowStride(m_albedo_coefficients.size());
+	const int* expression_vertex_map = m_model->expression_vertex_map_gpu.getPtr();
+	const int n_expression_vertices = m_model->number_of_expression_vertices;
+	const int expression_column_stride = m_model->getExpressionBasisColumnStride();
+
+	//"base" and the targets never alias, so the tuner can repeat the launch.
+	const cudaStream_t stream = getStream();
+	if (m_model->tiled_basis)
+	{
+		//Vertex-major FP16 tiles, the expression rows go through the same map as the others.
+		auto& tiles = *m_model->tiled_basis;
+		const int* vertex_map = tiles.getVertexMapGpu();
+		tiles.forEachResidentRange(number_of_vertices, stream, [&](int first_vertex, int end_vertex)
+		{
+			util::LaunchTuner::get().launch("computeBlendshapesKernel", { 256, 128, 512 }, stream, [&](int block_size)
+			{
+				const int num_blocks = (3 * (end_vertex - first_vertex) + block_size - 1) / block_size;
+				computeBlendshapesKernel <<<num_blocks, block_size, shared_memory, stream>>>(
+					n_rows,
+					n_base_rows,
+					3 * first_vertex,
+					3 * end_vertex,
+					vertex_map,
+					reinterpret_cast<const float*>(base),
+					reinterpret_cast<float*>(target),
+					reinterpret_cast<float*>(aligned_target),
+					1,
+					tiles.getCache(TiledBasis::kShape), getShapeCoefficientsGpu(), m_model->shape_basis_scale, nShapeCoeffs, tiles.getCoefficientCount(TiledBasis::kShape),
+					tiles.getCache(TiledBasis::kExpression), getExpressionCoefficientsGpu(), m_model->expression_basis_scale, nExpressionCoeffs, tiles.getCoefficientCount(TiledBasis::kExpression),
+					vertex_map, tiles.getCacheVertices(), 1,
+					tiles.getCache(TiledBasis::kAlbedo), getAlbedoCoefficientsGpu(), m_model->albedo_basis_scale, nAlbedoCoeffs, tiles.getCoefficientCount(TiledBasis::kAlbedo),
+					positions, colors);
+			});
+		});
+		return;
+	}
+
+	util::LaunchTuner::get().launch("computeBlendshapesKernel", { 256, 128, 512 }, stream, [&](int block_size)
+	{
+		const int num_blocks = (n_rows + block_size - 1) / block_size;
+		if (m_model->half_precision_basis)
+		{
+			computeBlendshapesKernel <<<num_blocks, block_size, shared_memory, stream>>>(
+				n_rows,
+				n_base_rows,
+				0,
+				n_rows,
+				nullptr,
+				reinterpret_cast<const float*>(base),
+				reinterpret_cast<float*>(target),
+				reinterpret_cast<float*>(aligned_target),
+				column_stride,
+				m_model->shape_basis_half_gpu.getPtr(), getShapeCoefficientsGpu(), m_model->shape_basis_scale, nShapeCoeffs, shape_row_stride,
+				m_model->expression_basis_half_gpu.getPtr(), getExpressionCoefficientsGpu(), m_model->expression_basis_scale, nExpressionCoeffs, expression_row_stride,
+				expression_vertex_map, n_expression_vertices, expression_column_stride,
+				m_model->albedo_basis_half_gpu.getPtr(), getAlbedoCoefficientsGpu(), m_model->albedo_basis_scale, nAlbedoCoeffs, albedo_row_stride,
+				positions, colors);
+		}
+		else
+		{
+			computeBlendshapesKernel <<<num_blocks, block_size, shared_memory, stream>>>(
+				n_rows,
+				n_base_rows,
+				0,
+				n_rows,
+				nullptr,
+				reinterpret_cast<const float*>(base),
+				reinterpret_cast<float*>(target),
+				reinterpret_cast<float*>(aligned_target),
+				column_stride,
+				m_model->shape_basis_gpu.getPtr(), getShapeCoefficientsGpu(), 1.0f, nShapeCoeffs, shape_row_stride,
+				m_model->expression_basis_gpu.getPtr(), getExpressionCoefficientsGpu(), 1.0f, nExpressionCoeffs, expression_row_stride,
+				expression_vertex_map, n_expression_vertices, expression_column_stride,
+				m_model->albedo_basis_gpu.getPtr(), getAlbedoCoefficientsGpu(), 1.0f, nAlbedoCoeffs, albedo_row_stride,
+				positions, colors);
+		}
+	});
+}
+
+//Unsigned integer of the size of a basis entry, for kernels that move entries without converting them.
+template<typename Scalar>
+using BasisBits = typename std::conditional<sizeof(Scalar) == sizeof(unsigned short), unsigned short, unsigned int>::type;
+
+//Column-major rows x cols to column-major cols x rows, through a padded tile so reads and writes both coalesce.
+//"Bits" is an unsigned integer of the size of the basis entries, nothing is converted.
+template<typename Bits>
+__global__ void transposeBasisKernel(int rows, int cols, const Bits* __restrict__ source, Bits* __restrict__ destination)
+{
+	__shared__ Bits tile[32][33];
+
+	int row = blockIdx.x * 32 + threadIdx.x;
+	int col = blockIdx.y * 32 + threadIdx.y;
+	if (row < rows && col < cols)
+	{
+		tile[threadIdx.y][threadIdx.x] = source[row + col * rows];
+	}
+	__syncthreads();
+
+	row = blockIdx.x * 32 + threadIdx.y;
+	col = blockIdx.y * 32 + threadIdx.x;
+	if (row < rows && col < cols)
+	{
+		destination[col + row * cols] = tile[threadIdx.x][threadIdx.y];
+	}
+}
+
+template<typename Scalar>
+static void transposeBasis(util::DeviceArray<Scalar>& basis, int rows, int cols)
+{
+	if (basis.getSize() == 0)
+	{
+		return;
+	}
+
+	using Bits = BasisBits<Scalar>;
+	static_assert(sizeof(Scalar) == sizeof(Bits), "Unsupported basis type");
+
+	util::DeviceArray<Scalar> transposed(basis.getSize());
+	dim3 threads(32, 32);
+	dim3 blocks((rows + 31) / 32, (cols + 31) / 32);
+	transposeBasisKernel <<<blocks, threads>>>(rows, cols, reinterpret_cast<const Bits*>(basis.getPtr()), reinterpret_cast<Bits*>(transposed.getPtr()));
+	//The old storage goes back to the allocator right away.
+	CHECK_CUDA_ERROR(cudaDeviceSynchronize());
+	basis = std::move(transposed);
+}
+
+void Face::setVertexMajorBasis(bool enabled)
+{
+	if (enabled == m_model->vertex_major_basis)
+	{
+		return;
+	}
+
+	//Vertex-major is the transpose of column-major, so the same kernel converts both ways.
+	util::ScopedAllocationTag tag("basis");
+	CHECK_CUDA_ERROR(cudaDeviceSynchronize());
+	const int n_rows = 3 * m_model->number_of_vertices;
+	const int counts[3] = { static_cast<int>(m_shape_coefficients.size()), static_cast<int>(m_albedo_coefficients.size()), static_cast<int>(m_expression_coefficients.size()) };
+	const int basis_rows[3] = { n_rows, n_rows, m_model->getExpressionBasisRows() };
+	util::DeviceArray<float>* bases[3] = { &m_model->shape_basis_gpu, &m_model->albedo_basis_gpu, &m_model->expression_basis_gpu };
+	util::DeviceArray<Eigen::half>* bases_half[3] = { &m_model->shape_basis_half_gpu, &m_model->albedo_basis_half_gpu, &m_model->expression_basis_half_gpu };
+	for (int i = 0; i < 3; ++i)
+	{
+		const int rows = enabled ? basis_rows[i] : counts[i];
+		const int cols = enabled ? counts[i] : basis_rows[i];
+		transposeBasis(*bases[i], rows, cols);
+		transposeBasis(*bases_half[i], rows, cols);
+	}
+	m_model->vertex_major_basis = enabled;
+}
+
+//Largest magnitude of the 3 rows of each vertex in a column-major basis.
+template<typename Basis>
+__global__ void vertexMaxAbsKernel(int nVertices, int nCoeffs, const Basis* __restrict__ basis, float* __restrict__ max_abs)
+{
+	const int vertex = util::getThreadIndex1D();
+	if (vertex >= nVertices)
+	{
+		return;
+	}
+
+	float value = 0.0f;
+	for (int i = 0; i < nCoeffs; ++i)
+	{
+		for (int k = 0; k < 3; ++k)
+		{
+			value = fmaxf(value, fabsf(static_cast<float>(basis[3 * vertex + k + i * 3 * nVertices])));
+		}
+	}
+	max_abs[vertex] = value;
+}
+
+//Column-major nRows x nCoeffs to column-major nCompactRows x nCoeffs, row r of a kept vertex is row 3 * kept_vertices[r / 3] + r % 3.
+//Rows after the kept vertices are zero, the bit pattern of 0 in both precisions.
+template<typename Bits>
+__global__ void gatherBasisRowsKernel(int nRows, int nCompactRows, int nKeptRows, int nCoeffs, const int* __restrict__ kept_vertices,
+	const Bits* __restrict__ source, Bits* __restrict__ destination)
+{
+	const int index = util::getThreadIndex1D();
+	if (index >= nCompactRows * nCoeffs)
+	{
+		return;
+	}
+
+	const int row = index % nCompactRows;
+	const int col = index / nCompactRows;
+	destination[index] = row < nKeptRows ? source[3 * kept_vertices[row / 3] + row % 3 + col * nRows] : Bits(0);
+}
+
+template<typename Scalar>
+static void gatherBasisRows(util::DeviceArray<Scalar>& basis, int rows, int cols, const util::DeviceArray<int>& kept_vertices)
+{
+	if (basis.getSize() == 0)
+	{
+		return;
+	}
+
+	using Bits = BasisBits<Scalar>;
+	const int compact_rows = 3 * (kept_vertices.getSize() + 1);
+	util::DeviceArray<Scalar> compact(compact_rows * cols);
+	const int block_size = 256;
+	const int num_blocks = (compact_rows * cols + block_size - 1) / block_size;
+	gatherBasisRowsKernel <<<num_blocks, block_size>>>(rows, compact_rows, 3 * kept_vertices.getSize(), cols, kept_vertices.getPtr(),
+		reinterpret_cast<const Bits*>(basis.getPtr()), reinterpret_cast<Bits*>(compact.getPtr()));
+	CHECK_CUDA_ERROR(cudaDeviceSynchronize());
+	basis = std::move(compact);
+}
+
+void Face::sparsifyExpressionBasis()
+{
+	const int n_vertices = m_model->number_of_vertices;
+	const int n_coefficients = m_expression_coefficients.size();
+	util::DeviceArray<float> max_abs_gpu(n_vertices);
+	const int block_size = 256;
+	const int num_blocks = (n_vertices + block_size - 1) / block_size;
+	if (m_model->half_precision_basis)
+	{
+		vertexMaxAbsKernel <<<num_blocks, block_size>>>(n_vertices, n_coefficients, m_model->expression_basis_half_gpu.getPtr(), max_abs_gpu.getPtr());
+	}
+	else
+	{
+		vertexMaxAbsKernel <<<num_blocks, block_size>>>(n_vertices, n_coefficients, m_model->expression_basis_gpu.getPtr(), max_abs_gpu.getPtr());
+	}
+	std::vector<float> max_abs(n_vertices);
+	util::copy(max_abs, max_abs_gpu, n_vertices);
+
+	//Relative to the largest entry, so the threshold means the same for both precisions.
+	const float cutoff = m_model->sparse_expression_threshold * *std::max_element(max_abs.begin(), max_abs.end());
+	std::vector<int> kept_vertices;
+	for (int i = 0; i < n_vertices; ++i)
+	{
+		if (max_abs[i] > cutoff)
+		{
+			kept_vertices.push_back(i);
+		}
+	}
+
+	//Kept vertices stay in model order, so neighbouring vertices read neighbouring rows.
+	auto& vertex_map = m_model->expression_vertex_map;
+	vertex_map.assign(n_vertices, static_cast<int>(kept_vertices.size()));
+	for (int i = 0; i < kept_vertices.size(); ++i)
+	{
+		vertex_map[kept_vertices[i]] = i;
+	}
+
+	const util::DeviceArray<int> kept_vertices_gpu(kept_vertices);
+	gatherBasisRows(m_model->expression_basis_gpu, 3 * n_vertices, n_coefficients, kept_vertices_gpu);
+	gatherBasisRows(m_model->expression_basis_half_gpu, 3 * n_vertices, n_coefficients, kept_vertices_gpu);
+	m_model->expression_vertex_map_gpu = util::DeviceArray<int>(vertex_map);
+	m_model->number_of_expression_vertices = kept_vertices.size();
+}
+
+//max_abs holds the bits of a non-negative float, which order like the floats themselves.
+__global__ void basisMaxAbsKernel(int n, const float* __restrict__ basis, unsigned int* __restrict__ max_abs)
+{
+	float value = 0.0f;
+	for (int i = util::getThreadIndex1D(); i < n; i += blockDim.x * gridDim.x)
+	{
+		value = fmaxf(value, fabsf(basis[i]));
+	}
+	atomicMax(max_abs, __float_as_uint(value));
+}
+
+__global__ void quantizeBasisKernel(int n, const float* __restrict__ basis, float scale, Eigen::half* __restrict__ basis_half)
+{
+	const int i = util::getThreadIndex1D();
+	if (i < n)
+	{
+		basis_half[i] = Eigen::half(basis[i] / scale);
+	}
+}
+
+//Normalized by the largest entry like toHalfPrecision, so the copy equals the FP16 bases loadBases would upload.
+static void quantizeBasis(const util::DeviceArray<float>& basis, util::DeviceArray<Eigen::half>& basis_half, float& scale)
+{
+	const int n = basis.getSize();
+	util::DeviceArray<unsigned int> max_abs_gpu(1);
+	CHECK_CUDA_ERROR(cudaMemset(max_abs_gpu.getPtr(), 0, sizeof(unsigned int)));
+	const int block_size = 256;
+	basisMaxAbsKernel <<<std::min((n + block_size - 1) / block_size, 1024), block_size>>>(n, basis.getPtr(), max_abs_gpu.getPtr());
+	unsigned int max_abs_bits = 0;
+	CHECK_CUDA_ERROR(cudaMemcpy(&max_abs_bits, max_abs_gpu.getPtr(), sizeof(unsigned int), cudaMemcpyDeviceToHost));
+	float max_abs = 0.0f;
+	std::memcpy(&max_abs, &max_abs_bits, sizeof(float));
+	scale = max_abs > 0.0f ? max_abs : 1.0f;
+
+	basis_half = util::DeviceArray<Eigen::half>(n);
+	quantizeBasisKernel <<<(n + block_size - 1) / block_size, block_size>>>(n, basis.getPtr(), scale, basis_half.getPtr());
+	CHECK_CUDA_ERROR(cudaDeviceSynchronize());
+}
+
+void Face::useQuantizedBases(bool enabled)
+{
+	if (enabled == m_model->half_precision_basis)
+	{
+		return;
+	}
+	if (m_model->shape_basis_gpu.getSize() == 0)
+	{
+		throw std::runtime_error("Error: The FP16 copies of the bases are quantized from the FP32 bases on the device, which aren't loaded!");
+	}
+
+	if (enabled && m_model->shape_basis_half_gpu.getSize() == 0)
+	{
+		util::ScopedAllocationTag tag("basis");
+		CHECK_CUDA_ERROR(cudaDeviceSynchronize());
+		quantizeBasis(m_model->shape_basis_gpu, m_model->shape_basis_half_gpu, m_model->shape_basis_scale);
+		quantizeBasis(m_model->albedo_basis_gpu, m_model->albedo_basis_half_gpu, m_model->albedo_basis_scale);
+		quantizeBasis(m_model->expression_basis_gpu, m_model->expression_basis_half_gpu, m_model->expression_basis_scale);
+	}
+	m_model->half_precision_basis = enabled;
+	gatherLandmarkBases();
+	++m_model->bases_version;
+}
+
+void Face::releaseQuantizedBases()
+{
+	useQuantizedBases(false);
+	CHECK_CUDA_ERROR(cudaDeviceSynchronize());
+	m_model->shape_basis_half_gpu = util::DeviceArray<Eigen::half>();
+	m_model->albedo_basis_half_gpu = util::DeviceArray<Eigen::half>();
+	m_model->expression_basis_half_gpu = util::DeviceArray<Eigen::half>();
+	m_model->shape_basis_scale = 1.0f;
+	m_model->albedo_basis_scale = 1.0f;
+	m_model->expression_basis_scale = 1.0f;
+}
+
+//One thread per entry of the landmark basis, which is row-major with 3 rows per landmark.
+template<typename Basis>
+__global__ void gatherLandmarkBasisKernel(int nRows, int nCoeffs, const int* __restrict__ vertex_ids, const Basis* __restrict__ basis,
+	float scale, int row_stride, int column_stride, float* __restrict__ landmark_basis)
+{
+	const int index = util::getThreadIndex1D();
+	if (index >= nRows * nCoeffs)
+	{
+		return;
+	}
+
+	const int row = index / nCoeffs;
+	const int col = index % nCoeffs;
+	const int basis_row = 3 * vertex_ids[row / 3] + row % 3;
+	landmark_basis[index] = scale * static_cast<float>(basis[basis_row * row_stride + col * column_stride]);
+}
+
+template<typename Basis>
+static void gatherLandmarkBasis(util::DeviceArray<float>& landmark_basis, const util::DeviceArray<int>& vertex_ids, const Basis* basis,
+	float scale, int nCoeffs, int row_stride, int column_stride)
+{
+	const int nRows = 3 * vertex_ids.getSize();
+	landmark_basis = util::DeviceArray<float>(nRows * nCoeffs);
+	if (nRows * nCoeffs == 0)
+	{
+		return;
+	}
+
+	const int block_size = 256;
+	const int num_blocks = (nRows * nCoeffs + block_size - 1) / block_size;
+	gatherLandmarkBasisKernel <<<num_blocks, block_size>>>(nRows, nCoeffs, vertex_ids.getPtr(), basis, scale, row_stride, column_stride,
+		landmark_basis.getPtr());
+}
+
+//The landmark rows straight from the pinned copy of a tiled basis, without touching its cache.
+static void gatherLandmarkBasis(util::DeviceArray<float>& landmark_basis, const std::vector<int>& vertex_ids, const TiledBasis& tiles,
+	int basis, float scale)
+{
+	const int nCoeffs = tiles.getCoefficientCount(basis);
+	std::vector<float> rows(3 * vertex_ids.size() * nCoeffs);
+	for (size_t i = 0; i < vertex_ids.size(); ++i)
+	{
+		const Eigen::half* vertex = tiles.getHostVertex(basis, vertex_ids[i]);
+		for (int k = 0; k < 3 * nCoeffs; ++k)
+		{
+			rows[i * 3 * nCoeffs + k] = scale * static_cast<float>(vertex[k]);
+		}
+	}
+	landmark_basis = util::DeviceArray<float>(rows);
+}
+
+void Face::gatherLandmarkBases()
+{
+	if (m_model->tiled_basis)
+	{
+		const auto& ids = PriorSparseFeatures::get().getPriorIds();
+		gatherLandmarkBasis(m_model->landmark_shape_basis_gpu, ids, *m_model->tiled_basis, TiledBasis::kShape, m_model->shape_basis_scale);
+		gatherLandmarkBasis(m_model->landmark_expression_basis_gpu, ids, *m_model->tiled_basis, TiledBasis::kExpression, m_model->expression_basis_scale);
+		return;
+	}
+
+	const util::DeviceArray<int> vertex_ids(PriorSparseFeatures::get().getPriorIds());
+	//Rows of the landmarks in a sparse expression basis.
+	std::vector<int> expression_ids = PriorSparseFeatures::get().getPriorIds();
+	if (!m_model->expression_vertex_map.empty())
+	{
+		for (auto& id : expression_ids)
+		{
+			id = m_model->expression_vertex_map[id];
+		}
+	}
+	const util::DeviceArray<int> expression_vertex_ids(expression_ids);
+	const int nShapeCoeffs = m_shape_coefficients.size();
+	const int nExpressionCoeffs = m_expression_coefficients.size();
+	const int column_stride = m_model->getBasisColumnStride();
+	const int expression_column_stride = m_model->getExpressionBasisColumnStride();
+	if (m_model->half_precision_basis)
+	{
+		gatherLandmarkBasis(m_model->landmark_shape_basis_gpu, vertex_ids, m_model->shape_basis_half_gpu.getPtr(), m_model->shape_basis_scale,
+			nShapeCoeffs, m_model->getBasisRowStride(nShapeCoeffs), column_stride);
+		gatherLandmarkBasis(m_model->landmark_expression_basis_gpu, expression_vertex_ids, m_model->expression_basis_half_gpu.getPtr(), m_model->expression_basis_scale,
+			nExpressionCoeffs, m_model->getBasisRowStride(nExpressionCoeffs), expression_column_stride);
+	}
+	else
+	{
+		gatherLandmarkBasis(m_model->landmark_shape_basis_gpu, vertex_ids, m_model->shape_basis_gpu.getPtr(), 1.0f,
+			nShapeCoeffs, m_model->getBasisRowStride(nShapeCoeffs), column_stride);
+		gatherLandmarkBasis(m_model->landmark_expression_basis_gpu, expression_vertex_ids, m_model->expression_basis_gpu.getPtr(), 1.0f,
+			nExpressionCoeffs, m_model->getBasisRowStride(nExpressionCoeffs), expression_column_stride);
+	}
+	//vertex_ids and expression_vertex_ids are freed on return.
+	CHECK_CUDA_ERROR(cudaDeviceSynchronize());
 }
 
 void Face::computeNormals()
 {
-	const int number_of_faces = m_number_of_indices / 3;
-	int block_size = 256;
-	int num_blocks = (number_of_faces + block_size - 1) / block_size;
-	computeNormalsKernel <<<num_blocks, block_size>>>(
-		m_number_of_vertices,
-		number_of_faces,
-		m_current_face_gpu.getPtr(),
-		m_faces_gpu.getPtr());
+	computeNormals(getWritableCurrentFace());
+}
+
+void Face::computeNormals(glm::vec3* current_face)
+{
+	const cudaStream_t stream = getStream();
+	util::LaunchTuner::get().launch("computeNormalsKernel", { 256, 128, 64, 512 }, stream, [&](int block_size)
+	{
+		const int num_blocks = (m_number_of_vertices + block_size - 1) / block_size;
+		computeNormalsKernel <<<num_blocks, block_size, 0, stream>>>(
+			m_number_of_vertices,
+			current_face,
+			getAlignedTarget(),
+			getMesh().faces_gpu.getPtr(),
+			getMesh().vertex_face_offsets_gpu.getPtr(),
+			getMesh().vertex_faces_gpu.getPtr());
+	});
 }
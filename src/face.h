@@ -1,17 +1,118 @@
 #pragma once
 
 #include "device_array.h"
+#include "tiled_basis.h"
 
 #include <glm/glm.hpp>
+#include <Eigen/Core>
 #include <glad/glad.h>
+#include <algorithm>
+#include <cstdint>
+#include <memory>
 #include <string>
 #include <vector>
 #include <cuda_gl_interop.h>
-#include <cublas_v2.h>
 #include <cuda_runtime.h>
 
 class GLSLProgram;
 
+namespace util
+{
+	class ExecutionContext;
+	class MappedFile;
+}
+
+//Triangles of the morphable model at one level of detail. A level uses the first number_of_vertices vertices of the model,
+//so it shares the average face and the bases with the full mesh and only evaluates fewer of their rows.
+struct FaceMesh
+{
+	unsigned int number_of_vertices = 0;
+	unsigned int number_of_indices = 0;
+	std::vector<unsigned int> indices; //for the index buffers
+	util::DeviceArray<glm::ivec3> faces_gpu;
+	//Vertex -> incident faces in CSR layout, the faces of vertex i are vertex_faces_gpu[offsets[i], offsets[i + 1]).
+	util::DeviceArray<int> vertex_face_offsets_gpu;
+	util::DeviceArray<int> vertex_faces_gpu;
+};
+
+//Columns of each basis a Face loads, e.g. the most coefficients a deployment ever solves for. The columns after them are
+//neither read from the caches nor uploaded, the text files of a component with 0 aren't read at all. Negative: all of them.
+struct BasisLimits
+{
+	int max_shape_coefficients = -1;
+	int max_albedo_coefficients = -1;
+	int max_expression_coefficients = -1;
+
+	//Of the "n" columns of component 0 (shape), 1 (albedo) or 2 (expression).
+	size_t getColumns(int component, size_t n) const
+	{
+		const int limit = component == 0 ? max_shape_coefficients : component == 1 ? max_albedo_coefficients : max_expression_coefficients;
+		return limit < 0 ? n : std::min(n, static_cast<size_t>(limit));
+	}
+};
+
+//Mesh and bases of the morphable model. Loaded once, then shared by all faces which are tracked at the same time.
+//Only Face::setHalfPrecisionBasis changes it, which reloads the bases for all of them.
+struct FaceModel
+{
+	std::string directory;
+	unsigned int number_of_vertices = 0;
+	unsigned int number_of_indices = 0;
+	//The full mesh, then kNumLevelsOfDetail - 1 coarser ones, see Face::setLevelOfDetail.
+	static constexpr int kNumLevelsOfDetail = 3;
+	std::vector<FaceMesh> meshes;
+	//The regions face.frag discards are removed at load time, see Face::compactModel. Vertex i of the model is vertex
+	//original_vertex_ids[i] of the model files.
+	unsigned int number_of_original_vertices = 0;
+	std::vector<int> original_vertex_ids;
+	size_t num_shape_coefficients = 0;
+	size_t num_albedo_coefficients = 0;
+	size_t num_expression_coefficients = 0;
+	//Of the first face, the reloads of the bases keep them. The model caches always have all columns.
+	BasisLimits basis_limits;
+
+	util::DeviceArray<glm::vec3> average_face_gpu;
+
+	//Bases with the standard deviation folded in. Only the *_half_gpu bases are allocated, if half_precision_basis is set,
+	//apart from Face::useQuantizedBases.
+	util::DeviceArray<float> shape_basis_gpu;
+	util::DeviceArray<Eigen::half> shape_basis_half_gpu;
+	float shape_basis_scale = 1.0f;
+	util::DeviceArray<float> albedo_basis_gpu;
+	util::DeviceArray<Eigen::half> albedo_basis_half_gpu;
+	float albedo_basis_scale = 1.0f;
+	util::DeviceArray<float> expression_basis_gpu;
+	util::DeviceArray<Eigen::half> expression_basis_half_gpu;
+	float expression_basis_scale = 1.0f;
+	bool half_precision_basis = false;
+	//Row-major (vertex components x coefficients) instead of column-major, see Face::setVertexMajorBasis.
+	bool vertex_major_basis = false;
+	//Also keep the current face of every face as float4, see Face::setAlignedVertices.
+	bool aligned_vertices = false;
+	//Bases in pinned host memory with a device cache of tiles, see Face::setTiledBasis. The device bases above are empty then.
+	std::unique_ptr<TiledBasis> tiled_basis;
+	int tiled_basis_cache_tiles = 0;
+	//Incremented whenever the bases are loaded or the vertex layout changes, the faces recompute their current face then.
+	uint64_t bases_version = 0;
+	//Shape and expression rows of the landmark vertices (PriorSparseFeatures), dequantized to FP32 and row-major, 3 rows per
+	//landmark. Gathered whenever the bases are loaded, so the sparse term reads them contiguously instead of across the bases.
+	util::DeviceArray<float> landmark_shape_basis_gpu;
+	util::DeviceArray<float> landmark_expression_basis_gpu;
+	//Sparse expression basis, see Face::setSparseExpressionBasis. Vertex v reads the 3 expression rows of vertex
+	//expression_vertex_map[v], the vertices without expression rows share the all-zero vertex number_of_expression_vertices
+	//at the end. Empty for the dense basis.
+	std::vector<int> expression_vertex_map;
+	util::DeviceArray<int> expression_vertex_map_gpu;
+	unsigned int number_of_expression_vertices = 0;
+	float sparse_expression_threshold = 0.0f;
+
+	//Distance between neighbouring rows (vertex components) and columns (coefficients) of a basis with n_coefficients columns.
+	int getBasisRowStride(size_t n_coefficients) const { return vertex_major_basis ? static_cast<int>(n_coefficients) : 1; }
+	int getBasisColumnStride() const { return vertex_major_basis ? 1 : 3 * number_of_vertices; }
+	int getExpressionBasisRows() const { return expression_vertex_map.empty() ? 3 * number_of_vertices : 3 * (number_of_expression_vertices + 1); }
+	int getExpressionBasisColumnStride() const { return vertex_major_basis ? 1 : getExpressionBasisRows(); }
+};
+
 class Face
 {
 public:
@@ -22,29 +123,135 @@ public:
 		cudaGraphicsResource_t rt_rgb_cuda_resource{ nullptr };
 		cudaGraphicsResource_t rt_barycentrics_cuda_resource{ nullptr };
 		cudaGraphicsResource_t rt_vertex_ids_cuda_resource{ nullptr };
+		//Packed visibility buffer instead of the two above, nullptr if the pyramid renders those. See Pyramid.
+		cudaGraphicsResource_t rt_visibility_cuda_resource{ nullptr };
 		const GLSLProgram* shader{ nullptr };
+		//Size of the targets of the level. It is a viewport of textures of atlas_width x atlas_height pixels with the lower
+		//left corner at (target_x, target_y), the sampled region if the pyramid packs its levels into an atlas (see Pyramid).
 		int texture_width{ 0 };
 		int texture_height{ 0 };
+		int target_x{ 0 };
+		int target_y{ 0 };
+		int atlas_width{ 0 };
+		int atlas_height{ 0 };
+		bool atlas{ false }; //all levels share the targets
+		//Maps the NDC of the frame to the ones of a crop window, which the targets cover instead of the frame (see
+		//Pyramid::setRoiGraphicsSettings). Pixel (x, y) of the targets, rows from the top, samples pixel
+		//(roi_x + x * roi_stride, roi_y + y * roi_stride) of the frame. Identity for full size targets.
+		glm::mat4 crop{ 1.0f };
+		int roi_x{ 0 };
+		int roi_y{ 0 };
+		int roi_stride{ 1 };
 		bool mapped_to_cuda{ false };
 	};
 
 public:
 	//Non-movable and non-copyable
-	Face(const std::string& morphable_model_directory);
+	Face(const std::string& morphable_model_directory, const BasisLimits& basis_limits = BasisLimits());
+	//A further face of the same model, with its own coefficients, mesh and vertex buffer.
+	explicit Face(std::shared_ptr<FaceModel> model);
 	Face(Face&) = delete;
 	Face(Face&& rhs) = delete;
 	Face& operator=(Face&) = delete;
 	Face& operator=(Face&&) = delete;
 	~Face();
 
+	//Only recomputes what the coefficient changes since the last call affect: positions and normals if shape or expression
+	//changed, colors if albedo changed. Pose and SH changes don't touch the current face.
 	void computeFace();
+	//The next computeFace recomputes everything, e.g. to time it.
+	void invalidateFace() { m_face_valid = false; }
+	//Bakes the current shape and albedo into a neutral mesh. computeFace then only adds expressions on top of it.
+	void lockIdentity();
+	void unlockIdentity() { m_identity_locked = false; m_face_valid = false; m_neutral_face_version++; }
+	bool isIdentityLocked() const { return m_identity_locked; }
+
+	//Coefficient groups, in the order of m_coefficients_gpu. Each has a version that is incremented whenever its coefficients
+	//change, see computeFace.
+	enum CoefficientGroup : unsigned int
+	{
+		kShapeGroup = 1,
+		kExpressionGroup = 2,
+		kAlbedoGroup = 4,
+		kLightingGroup = 8,
+		kAllGroups = 15
+	};
+	uint64_t getCoefficientVersion(CoefficientGroup group) const;
+	//Changes of the coefficient vectors are found when they are uploaded. Kernels that change m_coefficients_gpu during a solve
+	//report the groups they touched here.
+	void markCoefficientsChanged(unsigned int groups);
+
+	//Only the first n columns of each basis are evaluated by computeFace, coefficients after them are ignored.
+	//The bases are column-major, so the active columns are contiguous and the cost scales with n.
+	void setActiveCoefficients(int nShapeCoeffs, int nExpressionCoeffs, int nAlbedoCoeffs);
+	int getNumActiveShapeCoefficients() const { return m_num_active_shape_coefficients; }
+	int getNumActiveExpressionCoefficients() const { return m_num_active_expression_coefficients; }
+	int getNumActiveAlbedoCoefficients() const { return m_num_active_albedo_coefficients; }
+
+	//Stores the bases in FP16 instead of FP32, each divided by its largest entry. Kernels dequantize and accumulate in FP32.
+	//Halves the memory and bandwidth of the bases. Switching reloads them from disk.
+	void setHalfPrecisionBasis(bool enabled);
+	bool isHalfPrecisionBasis() const { return m_model->half_precision_basis; }
+	//Transposes the bases on the device, so the coefficients of one vertex are contiguous. The dense Jacobian then reads
+	//a basis row with one coalesced load per warp. Kept across setHalfPrecisionBasis.
+	void setVertexMajorBasis(bool enabled);
+	bool isVertexMajorBasis() const { return m_model->vertex_major_basis; }
+	//Drops the expression rows of the vertices whose largest expression entry is at most "threshold" times the largest one
+	//of the basis, 0 keeps the dense basis. Expressions move a small part of the face, so computeFace and the Jacobian read
+	//a fraction of the expression basis. Kept across setHalfPrecisionBasis, switching reloads the bases.
+	void setSparseExpressionBasis(float threshold);
+	float getSparseExpressionThreshold() const { return m_model->sparse_expression_threshold; }
+	//Vertices with expression rows, all of them for the dense basis.
+	int getNumExpressionVertices() const;
+	static constexpr float kDefaultSparseExpressionThreshold = 0.01f;
+	//Keeps the bases in FP16 in pinned host memory and only a cache of "cache_tiles" tiles of vertices on the device (see
+	//TiledBasis), 0 uploads them whole again. The model then isn't bounded by the device memory: computeFace streams the
+	//tiles the cache doesn't hold, the solver makes the tiles of the visible pixels resident. Implies FP16 and vertex-major
+	//reads, the sparse expression basis is ignored. Switching reloads the bases.
+	void setTiledBasis(int cache_tiles);
+	int getTiledBasisCacheTiles() const { return m_model->tiled_basis_cache_tiles; }
+	static constexpr int kDefaultTiledBasisCacheTiles = 32;
+	//For all faces of the model, computeFace and computeNormals also write the current face into a float4 array: positions,
+	//colors and normals in the blocks of m_current_face_gpu, w unused. The solver kernels then read a vertex with one aligned
+	//128-bit load instead of a 3-float gather. The vertex buffer and getCurrentFaceGpu keep their layout for GL and the
+	//other readers, the copy costs one more write per vertex.
+	void setAlignedVertices(bool enabled);
+	bool isAlignedVertices() const { return m_model->aligned_vertices; }
+	//The float4 copy of the current face, nullptr without setAlignedVertices. Up to date after computeFace.
+	const float4* getAlignedFaceGpu() const { return m_model->aligned_vertices && m_aligned_face_gpu.getSize() > 0 ? m_aligned_face_gpu.getPtr() : nullptr; }
+	//Recomputes the normals of the current face, wherever it is (see getCurrentFaceGpu).
 	void computeNormals();
 	glm::mat4 computeModelMatrix() const;
 	void computeRotationDerivatives(glm::mat3& dRx, glm::mat3& dRy, glm::mat3& dRz) const;
 
-	//Copies m_average_face_gpu to content of m_vertex_buffer.
+	//Switches to a coarser mesh of the model, 0 is the full one. The vertex count, computeFace, the normals, draw and the solver
+	//follow it. Coarse pyramid levels use it, see LevelSchedule::level_of_detail. Clamped to the levels of the model.
+	void setLevelOfDetail(int level_of_detail);
+	int getLevelOfDetail() const { return m_level_of_detail; }
+	const FaceMesh& getMesh() const { return m_model->meshes[m_level_of_detail]; }
+
+	//Copies m_current_face_gpu to content of m_vertex_buffer. Maps the buffer itself, unless the solver has it mapped already.
+	//Nothing to do if computeFace wrote into the mapped buffer directly.
 	void updateVertexBuffer();
-	void draw() const;
+	//Positions, colors and normals of the current face in device memory, laid out like m_current_face_gpu. This is the mapped
+	//vertex buffer, if computeFace wrote there and the solver still has it mapped, otherwise m_current_face_gpu, which is
+	//copied back from the vertex buffer first if it is out of date.
+	glm::vec3* getCurrentFaceGpu();
+	//Positions of the face without expressions: the neutral face, if the identity is locked, otherwise the average face of the
+	//model. Levels of detail use a prefix of it, like the current face.
+	const glm::vec3* getNeutralFaceGpu() const { return m_identity_locked ? m_neutral_face_gpu.getPtr() : m_model->average_face_gpu.getPtr(); }
+	//Changes whenever the positions of getNeutralFaceGpu do, also if a second lockIdentity rewrites them in place.
+	uint64_t getNeutralFaceVersion() const { return m_neutral_face_version + m_model->bases_version; }
+	//computeFace, the normals and the vertex buffer copies run on the compute stream of "context", e.g. the one of the solver.
+	//Without a context they use the default stream.
+	void setExecutionContext(std::shared_ptr<util::ExecutionContext> context) { m_context = std::move(context); }
+	cudaStream_t getStream() const;
+	//Without "clear" the face is drawn on top of what the render targets hold, e.g. the other tracked faces.
+	void draw(bool clear = true) const;
+	//Attaches the face shaders to "program", which is linked afterwards. With GL_NV_fragment_shader_barycentric (and
+	//"fragment_barycentrics") these are face_barycentric.vert/.frag without a geometry shader, otherwise face.vert/.geom/.frag.
+	//Needs a current GL context. "shader_directory" ends with a slash.
+	static void attachShaders(GLSLProgram& program, bool fragment_barycentrics = true, const std::string& shader_directory = "../src/shader/");
 
 	std::vector<float>& getShapeCoefficients() { return m_shape_coefficients; }
 	const std::vector<float>& getShapeCoefficients() const { return m_shape_coefficients; }
@@ -64,44 +271,67 @@ public:
 	glm::vec3& getTranslationCoefficients() { return m_translation_coefficients; }
 	const glm::vec3& getTranslationCoefficients() const { return m_translation_coefficients; }
 
+	const std::shared_ptr<FaceModel>& getModel() const { return m_model; }
 	unsigned int getNumberOfVertices() const { return m_number_of_vertices; }
 	const util::DeviceArray<glm::vec3>& getCurrentFaceGpu() const { return m_current_face_gpu; }
 
+	//Device copies of the coefficients as of the last computeFace, during a solve the current ones.
+	const float* getShapeCoefficientsGpu() const { return m_coefficients_gpu.getPtr(); }
+	const float* getExpressionCoefficientsGpu() const { return m_coefficients_gpu.getPtr() + m_shape_coefficients.size(); }
+	const float* getAlbedoCoefficientsGpu() const { return getExpressionCoefficientsGpu() + m_expression_coefficients.size(); }
+	const float* getSHCoefficientsGpu() const { return getAlbedoCoefficientsGpu() + m_albedo_coefficients.size(); }
+
 private:
 	friend class GaussNewtonSolver;
 
 private:
+	std::shared_ptr<FaceModel> m_model;
+	std::shared_ptr<util::ExecutionContext> m_context; //null: default stream
 	GraphicsSettings m_graphics_settings;
 
 	GLuint m_vertex_array{ 0 };
 	GLuint m_vertex_buffer{ 0 };
-	GLuint m_index_buffer{ 0 };
-	unsigned int m_number_of_vertices{ 0 };
+	std::vector<GLuint> m_index_buffers; //one per level of detail
+	unsigned int m_number_of_vertices{ 0 }; //of the current level of detail
 	unsigned int m_number_of_indices{ 0 };
+	int m_level_of_detail{ 0 };
 	cudaGraphicsResource* m_resource{ nullptr };
+	void* m_mapped_vertex_buffer{ nullptr }; //set while the solver keeps m_resource mapped
 
-	//Face vertex and color data.
-	util::DeviceArray<glm::vec3> m_average_face_gpu;
+	//Face vertex and color data. While the solver keeps the vertex buffer mapped computeFace writes into it instead, so the
+	//draw of the next iteration needs no copy. The flags tell which of the two hold the current face.
 	util::DeviceArray<glm::vec3> m_current_face_gpu;
-	util::DeviceArray<glm::ivec3> m_faces_gpu;
-
-	//cuBLAS
-	cublasHandle_t m_cublas;
+	bool m_face_in_array{ false };
+	bool m_face_in_vertex_buffer{ false };
+	util::DeviceArray<float4> m_aligned_face_gpu; //see setAlignedVertices, sized for all vertices of the model
+	util::DeviceArray<glm::vec3> m_neutral_face_gpu; //average face of the model plus the locked identity
+	bool m_identity_locked{ false };
+	uint64_t m_neutral_face_version{ 0 }; //incremented by lockIdentity and unlockIdentity
 
-	//Shape basis and standard deviation.
 	std::vector<float> m_shape_coefficients;
-	util::DeviceArray<float> m_shape_basis_gpu;
-	util::DeviceArray<float> m_shape_coefficients_gpu;
-
-	//Albedo basis and standard deviation.
 	std::vector<float> m_albedo_coefficients;
-	util::DeviceArray<float> m_albedo_basis_gpu;
-	util::DeviceArray<float> m_albedo_coefficients_gpu;
-
-	//Expression basis and standard deviation.
 	std::vector<float> m_expression_coefficients;
-	util::DeviceArray<float> m_expression_basis_gpu;
-	util::DeviceArray<float> m_expression_coefficients_gpu;
+
+	//Shape, expression, albedo and SH coefficients back to back, copied with a single async copy through pinned memory.
+	//During a solve m_coefficients_gpu is authoritative (m_device_coefficients): the solver updates it with a kernel, computeFace
+	//doesn't upload and the vectors are stale until releaseDeviceCoefficients downloads them once.
+	float* m_coefficients_host{ nullptr }; //pinned
+	size_t m_number_of_coefficients{ 0 };
+	cudaEvent_t m_coefficients_copied{ nullptr }; //staging buffer is free again
+	util::DeviceArray<float> m_coefficients_gpu;
+	bool m_device_coefficients{ false };
+	int m_num_active_shape_coefficients{ 0 };
+	int m_num_active_expression_coefficients{ 0 };
+	int m_num_active_albedo_coefficients{ 0 };
+	//Versions of the coefficient groups (see CoefficientGroup) and the shape, expression and albedo versions m_current_face_gpu
+	//was computed from. m_coefficients_uploaded is set once m_coefficients_host mirrors m_coefficients_gpu, outside of a solve
+	//uploads then compare against it and skip the groups that didn't change.
+	static constexpr int kNumCoefficientGroups = 4;
+	uint64_t m_coefficient_versions[kNumCoefficientGroups]{ 1, 1, 1, 1 };
+	uint64_t m_computed_versions[3]{ 0, 0, 0 };
+	uint64_t m_computed_bases_version{ 0 };
+	bool m_face_valid{ false };
+	bool m_coefficients_uploaded{ false };
 
 	//SH parameters
 	std::vector<float> m_sh_coefficients;
@@ -111,5 +341,72 @@ private:
 	glm::vec3 m_translation_coefficients;
 
 private:
+	struct ModelCacheHeader;
+	struct HostBases
+	{
+		std::vector<float> shape;
+		std::vector<float> albedo;
+		std::vector<float> expression;
+	};
+
+	//Current mesh, GL buffers and coefficient storage of this face.
+	void initState();
+	//Attribute offsets (they depend on the vertex count) and index buffer of the current level of detail.
+	void bindVertexLayout();
+	//Fills mesh from its indices and number_of_vertices.
+	void initMesh(FaceMesh& mesh);
+	//Removes the triangles whose vertices are all marked as unused (albedo.y > 1, discarded by face.frag) and the vertices
+	//no remaining triangle uses. Landmark vertices are kept. Then builds the coarser meshes (mesh_ordering.h) and reorders
+	//the vertices coarsest level first, each level in Morton order, and the triangles of each level with Tipsify.
+	//Fills original_vertex_ids of the model, "lod_indices" and "lod_vertices" of the coarser levels.
+	void compactModel(std::vector<glm::vec3>& positions, std::vector<glm::vec3>& colors, std::vector<unsigned int>& indices,
+		std::vector<std::vector<unsigned int>>& lod_indices, std::vector<unsigned int>& lod_vertices);
+	//Gathers the rows of the vertices in original_vertex_ids of a column-major basis of the model files, in place.
+	void compactBasis(std::vector<float>& basis, size_t n_coefficients) const;
+
 	std::vector<float> loadModelData(const std::string& filename, bool is_basis);
+	//Loads the bases from model_cache_fp32/fp16.bin (memory mapped), falls back to the .matrix files.
+	void loadBases(bool half_precision);
+	//Only the columns of the basis limits, unless "all_columns" is set.
+	HostBases loadBasesFromText(bool all_columns = false);
+	//Drops the columns after the basis limits of "bases" and the coefficients.
+	void truncateBases(HostBases& bases);
+	void loadBasesFromCache(const util::MappedFile& cache);
+	void uploadBases(const HostBases& bases, bool half_precision);
+	void releaseBases();
+	//Builds the tiled basis of FaceModel::tiled_basis from the FP16 model cache, or the .matrix files without it.
+	void loadTiledBases();
+	//Fills the landmark bases of the model from its current bases.
+	void gatherLandmarkBases();
+	//Switches between the FP32 bases on the device and FP16 copies quantized from them on the device, without reloading the
+	//model. Both stay allocated until releaseQuantizedBases, which switches back to FP32. For
+	//GaussNewtonSolver::validateHalfPrecisionBasis, throws if the FP32 bases aren't on the device.
+	void useQuantizedBases(bool enabled);
+	void releaseQuantizedBases();
+	//Compacts the column-major expression basis to the vertices above sparse_expression_threshold, see
+	//FaceModel::expression_vertex_map.
+	void sparsifyExpressionBasis();
+
+	std::string getModelCachePath(bool half_precision) const;
+	//nullptr, if the cache is missing, outdated or truncated.
+	const ModelCacheHeader* getModelCacheHeader(const util::MappedFile& cache, bool half_precision) const;
+	void writeModelCache(bool half_precision, const std::vector<glm::vec3>& positions, const std::vector<glm::vec3>& colors,
+		const HostBases& bases) const;
+	void uploadCoefficients(cudaStream_t stream = 0);
+	//Copies the current face from m_current_face_gpu to the vertex buffer or back, mapping the buffer if the solver hasn't.
+	void copyCurrentFace(bool to_vertex_buffer);
+	//The up to date current face, which the caller is about to modify in place.
+	glm::vec3* getWritableCurrentFace();
+	void computeNormals(glm::vec3* current_face);
+	//Uploads the coefficients, from then on only m_coefficients_gpu changes. Release downloads them into the vectors again.
+	void acquireDeviceCoefficients(cudaStream_t stream = 0);
+	void releaseDeviceCoefficients(cudaStream_t stream = 0);
+	//target = base + shape_basis * shape + expression_basis * expression (positions) and base + albedo_basis * albedo (colors)
+	//in one pass, normals of "target" are zeroed. Counts of 0 skip a basis. "base" holds all vertices of the model, "target"
+	//the first number_of_vertices (a level of detail). Without "positions" or "colors" that half of "target" is left as it is.
+	//"aligned_target" gets the same values as float4, see setAlignedVertices.
+	void computeBlendshapes(const glm::vec3* base, glm::vec3* target, int number_of_vertices, int nShapeCoeffs, int nExpressionCoeffs,
+		int nAlbedoCoeffs, bool positions = true, bool colors = true, float4* aligned_target = nullptr);
+	//m_aligned_face_gpu with setAlignedVertices, otherwise nullptr.
+	float4* getAlignedTarget();
 };
\ No newline at end of file
@@ -0,0 +1,126 @@
+#include "frame_grabber.h"
+#include "thread_placement.h"
+
+#include <iostream>
+#include <utility>
+
+namespace util
+{
+	FrameGrabber::FrameGrabber(cv::VideoCapture& capture, CapturePolicy policy, size_t capacity, HostFramePool* pool)
+		: m_capture(capture)
+		, m_policy(policy)
+		, m_pool(pool)
+		, m_frames(capacity)
+		, m_dropped_metric(Metrics::get().counter("capture_dropped_frames_total", "Frames dropped for newer ones by the capture."))
+	{
+		m_thread = std::thread(&FrameGrabber::capture, this);
+	}
+
+	FrameGrabber::~FrameGrabber()
+	{
+		m_stop = true;
+		m_frame_ready.notify_all();
+		m_frames.wake();
+		if (m_pool)
+		{
+			m_pool->wake();
+		}
+		m_thread.join();
+
+		if (m_num_dropped_frames > 0)
+		{
+			std::cout << "Capture: " << m_num_dropped_frames << " of " << m_num_captured_frames << " frames were dropped for newer ones" << std::endl;
+		}
+	}
+
+	void FrameGrabber::capture()
+	{
+		ThreadPlacement::get().apply(ThreadStage::Capture);
+		while (!m_stop)
+		{
+			cv::Mat frame;
+			cv::Mat pool_frame; //the frame is decoded into, if there's a pool
+			if (m_pool)
+			{
+				pool_frame = m_pool->acquire(m_stop);
+				if (pool_frame.empty())
+				{
+					break;
+				}
+				frame = pool_frame;
+			}
+			if (!m_capture.read(frame))
+			{
+				if (m_pool)
+				{
+					m_pool->release(pool_frame);
+				}
+				break;
+			}
+			if (m_pool && frame.data != pool_frame.data)
+			{
+				//A frame of another size than the pool's got its own pixels.
+				m_pool->release(pool_frame);
+			}
+			m_num_captured_frames++;
+
+			if (m_policy == CapturePolicy::Lossless)
+			{
+				if (!m_frames.push(std::move(frame), m_stop))
+				{
+					break;
+				}
+				continue;
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				if (m_has_latest_frame)
+				{
+					m_num_dropped_frames++;
+					m_dropped_metric.add();
+					if (m_pool)
+					{
+						m_pool->release(m_latest_frame);
+					}
+				}
+				m_latest_frame = std::move(frame);
+				m_has_latest_frame = true;
+			}
+			m_frame_ready.notify_one();
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_finished = true;
+		}
+		m_frame_ready.notify_all();
+		m_frames.wake();
+	}
+
+	bool FrameGrabber::read(cv::Mat& frame)
+	{
+		if (m_policy == CapturePolicy::Lossless)
+		{
+			//The queue is checked once more after the end, the last frames may have been pushed right before it.
+			while (!m_frames.pop(frame, m_finished))
+			{
+				if (m_frames.empty())
+				{
+					return false;
+				}
+			}
+			return true;
+		}
+
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_frame_ready.wait(lock, [this]() { return m_has_latest_frame || m_finished || m_stop; });
+		if (!m_has_latest_frame)
+		{
+			return false;
+		}
+		frame = std::move(m_latest_frame);
+		m_has_latest_frame = false;
+		return true;
+	}
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "spsc_queue.h"
+#include "metrics.h"
+#include "host_frame_pool.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "opencv2/core/core.hpp"
+#include "opencv2/videoio/videoio.hpp"
+
+namespace util
+{
+	enum class CapturePolicy
+	{
+		Lossless = 0,		//every frame is handed over, the capture waits for the consumer (recordings)
+		DropToLatest = 1,	//only the newest frame is kept, unread ones are dropped (live cameras)
+	};
+
+	//Reads a cv::VideoCapture on its own thread, so decoding overlaps the processing of the previous frame. With DropToLatest a
+	//single slot holds the newest frame and the capture never waits: a consumer which falls behind gets the most recent frame
+	//instead of a backlog, so the latency stays at one frame. Lossless hands the frames over through a small queue.
+	class FrameGrabber
+	{
+	public:
+		//"capture" has to outlive the grabber and must not be read by anyone else meanwhile. With a "pool" (of the size and type
+		//of the frames, outliving the grabber) the frames are decoded into its pinned frames instead of new cv::Mats. The reader
+		//releases them then, the grabber releases the frames it drops. A full pool holds the capture back.
+		FrameGrabber(cv::VideoCapture& capture, CapturePolicy policy, size_t capacity = 4, HostFramePool* pool = nullptr);
+		~FrameGrabber();
+
+		FrameGrabber(const FrameGrabber&) = delete;
+		FrameGrabber& operator=(const FrameGrabber&) = delete;
+
+		//Waits for the next frame. False once the input has ended and all captured frames have been read.
+		bool read(cv::Mat& frame);
+
+		CapturePolicy getPolicy() const { return m_policy; }
+		int getNumberOfCapturedFrames() const { return m_num_captured_frames; }
+		int getNumberOfDroppedFrames() const { return m_num_dropped_frames; }
+
+	private:
+		void capture();
+
+	private:
+		cv::VideoCapture& m_capture;
+		CapturePolicy m_policy;
+		HostFramePool* m_pool;
+
+		//DropToLatest
+		std::mutex m_mutex;
+		std::condition_variable m_frame_ready;
+		cv::Mat m_latest_frame;
+		bool m_has_latest_frame{ false };
+
+		//Lossless
+		SpscQueue<cv::Mat> m_frames;
+
+		std::atomic<bool> m_finished{ false }; //the input has ended
+		std::atomic<bool> m_stop{ false };
+		std::atomic<int> m_num_captured_frames{ 0 };
+		std::atomic<int> m_num_dropped_frames{ 0 };
+		Counter& m_dropped_metric; //of all grabbers, see Metrics
+		std::thread m_thread;
+	};
+}
@@ -1,185 +1,1628 @@
-#include "gauss_newton_solver.h"
+﻿#include "gauss_newton_solver.h"
 #include "prior_sparse_features.h"
 #include "util.h"
 #include "device_util.h"
 #include "device_array.h"
+#include "profiler.h"
 
 #include <Eigen/Dense>
+#include <algorithm>
+#include <cfloat>
 #include <chrono>
+#include <iterator>
 
-GaussNewtonSolver::GaussNewtonSolver()
-	: m_face_bb(1)
-	, m_sh_coefficients_gpu(9)
+//A failed cuSOLVER call is a wrong argument or a broken context, unlike a matrix which isn't SPD (see the info arrays).
+static void checkCusolver(const cusolverStatus_t status, const char* function)
 {
-	cublasCreate(&m_cublas);
+	if (status != CUSOLVER_STATUS_SUCCESS)
+	{
+		throw std::runtime_error(std::string("Error: ") + function + " failed with status " + std::to_string(status) + "!");
+	}
+}
+
+GaussNewtonSolver::GaussNewtonSolver(const SolverParameters& params, std::shared_ptr<util::ExecutionContext> context)
+	: m_context(context ? std::move(context) : std::make_shared<util::ExecutionContext>())
+	, m_cublas(m_context->getCublas())
+	, m_cusolver(m_context->getCusolver())
+	, m_stream(m_context->getComputeStream())
+	, m_stream_sparse(m_context->getAuxiliaryStream())
+	, m_stream_readback(m_context->getReadbackStream())
+	, m_params(params)
+	, m_face_bb_accumulator(1)
+	, m_face_bb(1)
+{
+	CHECK_CUDA_ERROR(cudaEventCreateWithFlags(&m_jacobian_fork, cudaEventDisableTiming));
+	CHECK_CUDA_ERROR(cudaEventCreateWithFlags(&m_jacobian_join, cudaEventDisableTiming));
+	CHECK_CUDA_ERROR(cudaEventCreateWithFlags(&m_loss_event, cudaEventDisableTiming));
+	CHECK_CUDA_ERROR(cudaEventCreateWithFlags(&m_pcg_converged_event, cudaEventDisableTiming));
+	for (int i = 0; i < kNumSolverStrategies; ++i)
+	{
+		m_linear_solvers[i] = createLinearSolver(static_cast<SolverStrategy>(i), *this);
+	}
+
+	FaceBoundingBoxAccumulator accumulator;
+	util::copy(m_face_bb_accumulator.span(), util::hostSpan(&accumulator, 1));
+	CHECK_CUDA_ERROR(cudaMallocHost(&m_face_bb_host, sizeof(FaceBoundingBox)));
+	CHECK_CUDA_ERROR(cudaMallocHost(&m_pcg_converged_host, sizeof(float)));
 }
 
 GaussNewtonSolver::~GaussNewtonSolver()
 {
-	cublasDestroy(m_cublas);
+	for (auto& workspaces : m_workspaces)
+	{
+		for (auto& workspace : workspaces)
+		{
+			if (workspace.graph_exec)
+			{
+				CHECK_CUDA_ERROR(cudaGraphExecDestroy(workspace.graph_exec));
+			}
+		}
+	}
+	closeConvergenceLog();
+	CHECK_CUDA_ERROR(cudaEventDestroy(m_jacobian_fork));
+	CHECK_CUDA_ERROR(cudaEventDestroy(m_jacobian_join));
+	CHECK_CUDA_ERROR(cudaEventDestroy(m_loss_event));
+	CHECK_CUDA_ERROR(cudaEventDestroy(m_pcg_converged_event));
+	CHECK_CUDA_ERROR(cudaFreeHost(m_pcg_converged_host));
+	CHECK_CUDA_ERROR(cudaFreeHost(m_loss_host));
+	CHECK_CUDA_ERROR(cudaFreeHost(m_face_bb_host));
 	destroyTextures();
 }
 
-void GaussNewtonSolver::solve(const std::vector<glm::vec2>& sparse_features, Face& face, cv::Mat& frame, glm::mat4& projection, const Pyramid& pyramid)
+void GaussNewtonSolver::reserveFaces(const int number_of_faces, const int number_of_levels)
+{
+	if (m_face_states.size() < number_of_faces)
+	{
+		m_face_states.resize(number_of_faces);
+		m_workspaces.resize(number_of_faces);
+		m_sparse_features_gpu.resize(number_of_faces);
+		m_sparse_weights_gpu.resize(number_of_faces);
+	}
+	for (auto& workspaces : m_workspaces)
+	{
+		if (workspaces.size() != number_of_levels)
+		{
+			workspaces.resize(number_of_levels);
+		}
+	}
+	if (m_prior_ids_gpu.getSize() == 0)
+	{
+		m_prior_ids_gpu = util::DeviceArray<int>(PriorSparseFeatures::get().getPriorIds());
+	}
+	if (m_params.use_persistent_threads && m_work_queue.getSize() == 0)
+	{
+		//Zeroed once before any graph is captured, the persistent kernels leave it zeroed.
+		util::ensureSize(m_work_queue, 2);
+		m_work_queue.memset(0, m_stream);
+	}
+}
+
+GaussNewtonSolver::FaceUnknowns GaussNewtonSolver::setupUnknowns(Face& face, const int nFeatures, const int pyramid_level,
+	const int max_coefficients) const
 {
+	const auto& level = m_params.getLevel(pyramid_level);
+	if (!level.use_sparse_term && !level.use_dense_term)
+	{
+		throw std::runtime_error("Error: Pyramid level " + std::to_string(pyramid_level) + " has neither a sparse nor a dense term!");
+	}
+
+	FaceUnknowns unknowns;
+	unknowns.nFeatures = level.use_sparse_term ? nFeatures : 0;
+	//A locked identity is part of the neutral mesh, its columns drop out of the Jacobian.
+	const bool identity_locked = face.isIdentityLocked();
+	//The requested counts are capped at the bases of the model, so they can be set independently of it.
+	const int nShapeCoeffs = glm::clamp(m_params.num_shape_coefficients, 0, static_cast<int>(face.getShapeCoefficients().size()));
+	const int nAlbedoCoeffs = glm::clamp(m_params.num_albedo_coefficients, 0, static_cast<int>(face.getAlbedoCoefficients().size()));
+	const int nExpressionCoeffs = glm::clamp(m_params.num_expression_coefficients, 0, static_cast<int>(face.getExpressionCoefficients().size()));
+	//Albedo and lighting without the dense term would only be pulled to the mean by the regularizer (or be singular).
+	unknowns.nShapeCoeffs = identity_locked || !level.optimize_shape ? 0 : std::min(nShapeCoeffs, max_coefficients);
+	unknowns.nExpressionCoeffs = level.optimize_expressions ? std::min(nExpressionCoeffs, max_coefficients) : 0;
+	unknowns.nAlbedoCoeffs = identity_locked || !level.optimize_albedo || !level.use_dense_term ? 0 : std::min(nAlbedoCoeffs, max_coefficients);
+	unknowns.nSHCoeffs = level.optimize_lighting && level.use_dense_term && !m_params.use_closed_form_lighting ? 9 : 0;
+	unknowns.nFaceCoeffs = unknowns.nShapeCoeffs + unknowns.nExpressionCoeffs + unknowns.nAlbedoCoeffs;
+	//Mesh synthesis evaluates all requested coefficients, the ones fixed at this level still shape the mesh.
+	//A locked identity ignores the shape and albedo counts.
+	face.setActiveCoefficients(nShapeCoeffs, nExpressionCoeffs, nAlbedoCoeffs);
+	unknowns.nUnknowns = 7 + unknowns.nFaceCoeffs + unknowns.nSHCoeffs; //3+3+1 = 7 DoF for rotation, translation and intrinsics. Plus nFaceCoeffs for face parameters and 9 for lighting.
+	return unknowns;
+}
+
+int GaussNewtonSolver::getCoefficientCap(const int iteration) const
+{
+	if (m_params.progressive_initial_coefficients <= 0)
+	{
+		return INT_MAX;
+	}
+	//No basis has more than a few hundred components, so after 16 doublings nothing is capped anymore.
+	return iteration < 16 ? m_params.progressive_initial_coefficients << iteration : INT_MAX;
+}
+
+bool GaussNewtonSolver::isPastDeadline(std::chrono::steady_clock::time_point start)
+{
+	if (m_params.deadline_ms > 0.0f && std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count() > m_params.deadline_ms)
+	{
+		m_statistics.deadline_expired = true;
+	}
+	return m_statistics.deadline_expired;
+}
+
+void GaussNewtonSolver::solve(const std::vector<glm::vec2>& detected_features, Face& face, glm::mat4& projection, const Pyramid& pyramid)
+{
+	const auto start = std::chrono::steady_clock::now();
+	//The arrays a solve grows are only used by the streams of the context (and the legacy default stream of a face without one).
+	util::ScopedAllocationStreams allocation_streams(m_context->getAllocationStreams());
+	auto number_of_levels = pyramid.getNumberOfLevels();
+	reserveFaces(1, number_of_levels);
+	auto& state = m_face_states[0];
+	const uint32_t convergence_frame = m_convergence_frame++;
+	m_statistics = SolverStatistics();
+	const auto& sparse_features = filterLandmarks(detected_features, state);
+
 	if (sparse_features.empty()) //no tracking -> cublas doesnt like a getting matrix/vector of size 0
 	{
+		state.num_tracked_frames = 0;
 		return;
 	}
 
-	auto number_of_levels = pyramid.getNumberOfLevels();
-	if (sizeof(m_params.num_gn_iterations) / sizeof(int) != number_of_levels)
+	collectLosses();
+
+	const bool static_frame = isStaticFrame(sparse_features, pyramid, state);
+	m_statistics.motion_gated = static_frame;
+	if (static_frame && m_params.static_solve_iterations <= 0)
+	{
+		//The parameters and the mesh of the last frame stay, with zero velocity.
+		updateTemporalState(face, state);
+		return;
+	}
+
+	if (!static_frame && solveLandmarksOnly(sparse_features, face, projection, pyramid.getAspectRatio(), state))
+	{
+		return;
+	}
+
+	const bool track_loss = m_params.verbosity > 0 || m_convergence_log;
+	int loss_slot = 0;
+	if (track_loss)
 	{
-		throw std::runtime_error("Please specify number of GN iteration per pyramid level!");
+		int n_total_iterations = 0;
+		for (int i = 0; i < number_of_levels; ++i)
+		{
+			n_total_iterations += m_params.getLevel(i).num_gn_iterations;
+		}
+		util::ensureSize(m_loss_gpu, kConvergenceValues * n_total_iterations);
+		m_loss_gpu.memset(0, m_stream);
+		m_pending_records.clear();
 	}
 
 	const int nFeatures = sparse_features.size();
-	const int nShapeCoeffs = m_params.num_shape_coefficients;
-	const int nExpressionCoeffs = m_params.num_expression_coefficients;
-	const int nAlbedoCoeffs = m_params.num_albedo_coefficients;
-	const int nFaceCoeffs = nShapeCoeffs + nExpressionCoeffs + nAlbedoCoeffs;
-	const int nUnknowns = 7 + nFaceCoeffs + 9; //3+3+1 = 7 DoF for rotation, translation and intrinsics. Plus nFaceCoeffs for face parameters and 9 for lighting.
+	const bool identity_locked = face.isIdentityLocked();
+
+	auto& sparse_features_gpu = m_sparse_features_gpu[0];
+	util::ensureSize(sparse_features_gpu, nFeatures);
+	util::copy(sparse_features_gpu, sparse_features, nFeatures);
+	const float* sparse_weights_gpu = uploadLandmarkWeights(0);
+
+	const bool use_lm = m_params.use_levenberg_marquardt;
+	LinearSolver& linear_solver = getLinearSolver(getStrategy(m_params));
+	const bool uses_pcg = linear_solver.usesPcg();
+	float lambda = m_params.lm_initial_lambda;
+	ParameterBackup backup;
+	if (use_lm)
+	{
+		util::ensureSize(m_energy_gpu, 1);
+	}
+
+	if (usesRoiRendering(pyramid))
+	{
+		predictFaceRect(sparse_features, state);
+	}
+
+	//A lost or diverged face starts below the levels its hypotheses were solved on.
+	const int recovered_level = static_frame ? -1 : recoverFace(sparse_features, sparse_weights_gpu, face, projection, pyramid, state, start);
+
+	//Consecutive frames differ little. Start from the predicted state of the last frame and skip the coarse levels.
+	//A static frame starts from the last one at the finest level.
+	int first_level = number_of_levels - 1;
+	if (recovered_level >= 0)
+	{
+		first_level = std::max(recovered_level - 1, 0);
+	}
+	else if (state.num_tracked_frames > 0)
+	{
+		if (m_params.use_temporal_prediction && !state.predicted && !static_frame)
+		{
+			predictParameters(face, state);
+		}
+		first_level = static_frame ? 0 : glm::clamp(m_params.warm_start_level, 0, number_of_levels - 1);
+	}
+	face.acquireDeviceCoefficients(m_stream);
+
+	int rendered_level = -1;
+	int frame_iteration = 0;
+	for (int pyramid_level = first_level; pyramid_level >= 0; pyramid_level--)
+	{
+		util::ScopedTimer level_timer("Level " + std::to_string(pyramid_level), true);
+		setRenderTargets(face, pyramid, pyramid_level, state);
+		const auto& level = m_params.getLevel(pyramid_level);
+		face.setLevelOfDetail(level.level_of_detail);
+		//The workspace is sized for all coefficients, a progressive schedule solves for fewer in the first iterations.
+		const auto level_unknowns = setupUnknowns(face, nFeatures, pyramid_level);
+
+		const int nPixels = level.use_dense_term ? face.m_graphics_settings.texture_width * face.m_graphics_settings.texture_height : 0;
+		const int nResiduals = 2 * level_unknowns.nFeatures + 3 * nPixels;
+
+		auto& workspace = m_workspaces[0][pyramid_level];
+		workspace.reserve(nResiduals, level_unknowns.nUnknowns, linear_solver.getJacobianRows(nResiduals), m_params.formsJTJ(),
+			m_params.storesReducedJacobian());
+		workspace.resetLevelState(m_stream);
+
+		auto& residuals_gpu = workspace.residuals;
+		auto& result_gpu = workspace.result;
+		//||f||^2 at the last accepted parameters of this level. Levels differ in their residuals, so it starts over.
+		float accepted_energy = -1.0f;
+		int n_active_unknowns = 0;
+		//The last applied step, which the residuals of no iteration have judged yet.
+		bool step_pending = false;
+		FaceUnknowns step_unknowns;
+		//The previous step was rejected, so this iteration is back at the accepted parameters and solves with the raised lambda.
+		bool just_rejected = false;
+
+		const int num_gn_iterations = static_frame ? std::min(level.num_gn_iterations, m_params.static_solve_iterations) : level.num_gn_iterations;
+		for (int iteration = 0; iteration < num_gn_iterations; ++iteration)
+		{
+			if (isPastDeadline(start))
+			{
+				//The last step wasn't judged yet, the last accepted parameters are the best known ones.
+				if (use_lm && accepted_energy >= 0.0f)
+				{
+					restoreParameters(backup, face, projection);
+				}
+				step_pending = false;
+				break;
+			}
+			util::ScopedTimer iteration_timer("GN iteration L" + std::to_string(pyramid_level), true);
+			const auto unknowns = setupUnknowns(face, nFeatures, pyramid_level, getCoefficientCap(frame_iteration++));
+			const int nUnknowns = unknowns.nUnknowns;
+			//A level isn't left before the last coefficients had a step.
+			const bool fully_active = nUnknowns == level_unknowns.nUnknowns;
+			if (nUnknowns != n_active_unknowns)
+			{
+				//Newly activated coefficients add to the regularizer energy, it starts over as well.
+				accepted_energy = -1.0f;
+				n_active_unknowns = nUnknowns;
+				m_result.resize(nUnknowns);
+				workspace.preconditioner_blocks = makePreconditionerBlocks(unknowns);
+				util::ensureSize(workspace.M_blocks, workspace.preconditioner_blocks.storage_size);
+			}
+
+			const int reused_renders = m_statistics.num_reused_renders;
+			auto jacobian_input = prepareIteration(face, projection, pyramid, pyramid_level, unknowns, sparse_features_gpu.getPtr(),
+				sparse_weights_gpu, m_params.use_render_reuse);
+			if (level.use_dense_term && m_statistics.num_reused_renders == reused_renders)
+			{
+				rendered_level = pyramid_level;
+				updateRenderedRect(jacobian_input, state);
+			}
+			m_damping = use_lm ? lambda : 0.0f;
+			m_statistics.num_gn_iterations++;
+			m_statistics.num_pcg_iterations += uses_pcg ? m_num_pcg_iterations : 0;
+
+			//Apply step and update poses GPU
+			//The first iteration of a level runs eagerly, so cuBLAS has set up its resources before anything is captured.
+			if (m_params.use_cuda_graphs && m_params.use_fused_pcg && iteration > 0)
+			{
+				//The sequence of launches is the same in every iteration, only their parameters change. So the graph is recaptured
+				//(cheap, nothing runs) and the instantiated graph of this pyramid level is updated instead of launching every kernel.
+				cudaGraph_t graph;
+				CHECK_CUDA_ERROR(cudaStreamBeginCapture(m_stream, cudaStreamCaptureModeThreadLocal));
+				solveIteration(jacobian_input, workspace);
+				CHECK_CUDA_ERROR(cudaStreamEndCapture(m_stream, &graph));
+
+				launchGraph(graph, workspace.graph_exec);
+				CHECK_CUDA_ERROR(cudaGraphDestroy(graph));
+				CHECK_CUDA_ERROR(cudaStreamSynchronize(m_stream));
+			}
+			else
+			{
+				solveIteration(jacobian_input, workspace);
+			}
+
+			float energy = 0.0f;
+			if (use_lm)
+			{
+				m_energy_gpu.memset(0, m_stream);
+				computeEnergy(jacobian_input, residuals_gpu.getPtr(), m_energy_gpu.getPtr());
+			}
+
+			{
+				util::ScopedTimer timer("Readback");
+				util::copy(m_result, result_gpu, nUnknowns);
+				if (use_lm)
+				{
+					util::copy(util::hostSpan(&energy, 1), m_energy_gpu.span(0, 1));
+				}
+			}
+
+			//The residuals belong to the parameters the previous step led to, so that step is judged now.
+			if (use_lm)
+			{
+				//After a rejection the residuals are those of the restored parameters, which judge no step. Neither is there a
+				//decrease to test for convergence, nor a reason to lower the lambda the rejection raised.
+				const bool has_previous_step = accepted_energy >= 0.0f && !just_rejected;
+				step_pending = false;
+				just_rejected = false;
+				if (has_previous_step && energy > accepted_energy)
+				{
+					//The step from this point was solved with too little damping as well, drop it.
+					restoreParameters(backup, face, projection);
+					lambda *= m_params.lm_lambda_increase;
+					m_statistics.num_rejected_steps++;
+					just_rejected = true;
+					continue;
+				}
+
+				const bool converged = has_previous_step && fully_active &&
+					accepted_energy - energy < m_params.lm_relative_decrease_threshold * accepted_energy;
+				if (has_previous_step)
+				{
+					lambda = std::max(lambda * m_params.lm_lambda_decrease, 1.0e-7f);
+				}
+				accepted_energy = energy;
+				m_statistics.final_energy = energy;
+				if (converged)
+				{
+					break;
+				}
+				backupParameters(face, projection, backup);
+			}
+
+			//Before the update, the regularizer reads the coefficients the residuals belong to.
+			if (track_loss)
+			{
+				computeConvergenceValues(jacobian_input, workspace, uses_pcg ? nUnknowns : 0, m_loss_gpu.getPtr() + kConvergenceValues * loss_slot++);
+				ConvergenceRecord record;
+				record.level = pyramid_level;
+				record.iteration = iteration;
+				record.pcg_iterations = uses_pcg ? m_num_pcg_iterations : 0;
+				record.visible_pixels = level.use_dense_term ? jacobian_input.face_bb.num_visible_pixels : 0;
+				float step_norm = 0.0f;
+				for (auto delta : m_result)
+				{
+					step_norm += delta * delta;
+				}
+				record.step_norm = std::sqrt(step_norm);
+				m_pending_records.push_back(record);
+			}
+
+			updateParameters(m_result, result_gpu.getPtr(), projection, pyramid.getAspectRatio(), face, unknowns);
+			step_pending = use_lm;
+			step_unknowns = unknowns;
+
+			//The step is on the host anyway, so checking for convergence doesn't cost a sync.
+			if (m_params.convergence_threshold > 0.0f && fully_active)
+			{
+				float step_norm = 0.0f;
+				for (auto delta : m_result)
+				{
+					step_norm += delta * delta;
+				}
+				if (std::sqrt(step_norm) < m_params.convergence_threshold)
+				{
+					break;
+				}
+			}
+		}
+
+		//No next iteration judges the last step of the level, so its energy is evaluated once more. Otherwise LM wouldn't check
+		//the finest level at all with its default single GN iteration, nor the step which makes the output.
+		if (step_pending && accepted_energy >= 0.0f)
+		{
+			util::ScopedTimer timer("LM final step", true);
+			const float energy = evaluateEnergy(face, projection, pyramid, pyramid_level, step_unknowns, sparse_features_gpu.getPtr(),
+				sparse_weights_gpu, workspace);
+			if (energy > accepted_energy)
+			{
+				restoreParameters(backup, face, projection);
+				lambda *= m_params.lm_lambda_increase;
+				m_statistics.num_rejected_steps++;
+			}
+			else
+			{
+				lambda = std::max(lambda * m_params.lm_lambda_decrease, 1.0e-7f);
+				m_statistics.final_energy = energy;
+			}
+			if (level.use_dense_term)
+			{
+				rendered_level = pyramid_level;
+			}
+		}
+
+		//The targets still hold the last render of the frame.
+		if (pyramid_level == 0 && rendered_level == 0 && m_num_debug_frames > 0)
+		{
+			captureDebugImages(face, pyramid);
+		}
+
+		//The next level renders to other targets.
+		if (face.m_graphics_settings.mapped_to_cuda)
+		{
+			unmapRenderTargets(face);
+		}
+		if (m_statistics.deadline_expired)
+		{
+			break;
+		}
+	}
+
+	m_damping = 0.0f;
+	//The display reads the full size targets, the ROI targets only hold a window of the face.
+	m_statistics.final_render_level = m_params.use_cuda_rasterizer || usesRoiRendering(pyramid) ? -1 : rendered_level;
+	restoreFullMesh(face);
+	face.releaseDeviceCoefficients(m_stream);
+	finishKeyframe(sparse_features, face, projection, state);
+	updateTemporalState(face, state);
+
+	if (m_params.use_identity_locking && !m_params.use_joint_calibration && !identity_locked
+		&& ++state.num_calibration_frames >= m_params.num_calibration_frames)
+	{
+		face.lockIdentity();
+	}
+
+	if (track_loss && loss_slot > 0)
+	{
+		const int n_values = kConvergenceValues * loss_slot;
+		if (m_loss_host_capacity < n_values)
+		{
+			CHECK_CUDA_ERROR(cudaFreeHost(m_loss_host));
+			CHECK_CUDA_ERROR(cudaMallocHost(&m_loss_host, n_values * sizeof(float)));
+			m_loss_host_capacity = n_values;
+		}
+		//Off the compute stream, the next solve only writes the losses again after collectLosses waited for the copy.
+		m_context->waitFor(m_stream_readback, m_stream);
+		util::copyAsync(util::pinnedSpan(m_loss_host, n_values), m_loss_gpu.span(0, n_values), m_stream_readback);
+		CHECK_CUDA_ERROR(cudaEventRecord(m_loss_event, m_stream_readback));
+		m_pending_losses = loss_slot;
+		m_pending_frame = convergence_frame;
+	}
+}
+
+void GaussNewtonSolver::solveBatch(const std::vector<std::vector<glm::vec2>>& detected_features, const std::vector<Face*>& faces,
+	const std::vector<glm::mat4*>& projections, const Pyramid& pyramid)
+{
+	solveBatch(detected_features, faces, projections, std::vector<const Pyramid*>(faces.size(), &pyramid));
+}
+
+void GaussNewtonSolver::solveBatch(const std::vector<std::vector<glm::vec2>>& detected_features, const std::vector<Face*>& faces,
+	const std::vector<glm::mat4*>& projections, const std::vector<const Pyramid*>& pyramids)
+{
+	const auto start = std::chrono::steady_clock::now();
+	util::ScopedAllocationStreams allocation_streams(m_context->getAllocationStreams()); //see solve
+	if (detected_features.size() != faces.size() || projections.size() != faces.size() || pyramids.size() != faces.size())
+	{
+		throw std::runtime_error("Error: solveBatch expects the same number of feature sets, faces, projections and pyramids!");
+	}
+	if (faces.empty())
+	{
+		return;
+	}
+	if (faces.size() == 1)
+	{
+		solve(detected_features[0], *faces[0], *projections[0], *pyramids[0]);
+		return;
+	}
+
+	const Pyramid& pyramid = *pyramids[0]; //levels and aspect ratio, the same for all faces
+	auto number_of_levels = pyramid.getNumberOfLevels();
+	const int number_of_faces = faces.size();
+	reserveFaces(number_of_faces, number_of_levels);
+	m_statistics = SolverStatistics();
+
+	std::vector<std::vector<glm::vec2>> sparse_features;
+	sparse_features.reserve(number_of_faces);
+	for (int i = 0; i < number_of_faces; ++i)
+	{
+		sparse_features.push_back(filterLandmarks(detected_features[i], m_face_states[i]));
+	}
+
+	std::vector<BatchEntry> entries;
+
+	bool all_warm = true;
+	for (int i = 0; i < number_of_faces; ++i)
+	{
+		auto& state = m_face_states[i];
+		if (sparse_features[i].empty())
+		{
+			state.num_tracked_frames = 0;
+			continue;
+		}
+		if (solveLandmarksOnly(sparse_features[i], *faces[i], *projections[i], pyramid.getAspectRatio(), state))
+		{
+			continue;
+		}
+
+		auto& sparse_features_gpu = m_sparse_features_gpu[i];
+		util::ensureSize(sparse_features_gpu, sparse_features[i].size());
+		util::copy(sparse_features_gpu, sparse_features[i], sparse_features[i].size());
+
+		BatchEntry entry;
+		entry.index = i;
+		entry.face = faces[i];
+		entry.projection = projections[i];
+		entry.pyramid = pyramids[i];
+		entry.state = &state;
+		entry.workspaces = &m_workspaces[i];
+		entry.sparse_features_gpu = sparse_features_gpu.getPtr();
+		entry.sparse_weights = uploadLandmarkWeights(i);
+		entry.num_features = sparse_features[i].size();
+		entry.identity_locked = faces[i]->isIdentityLocked();
+		entries.push_back(std::move(entry));
+
+		if (usesRoiRendering(*pyramids[i]))
+		{
+			predictFaceRect(sparse_features[i], state);
+		}
+		if (state.num_tracked_frames > 0 && m_params.use_temporal_prediction && !state.predicted)
+		{
+			predictParameters(*faces[i], state);
+		}
+		faces[i]->acquireDeviceCoefficients(m_stream);
+		all_warm &= state.num_tracked_frames > 0;
+	}
+	if (entries.empty())
+	{
+		return;
+	}
+
+	//All faces step through the levels together, so a single new face starts the batch at the coarsest level.
+	const int first_level = all_warm ? glm::clamp(m_params.warm_start_level, 0, number_of_levels - 1) : number_of_levels - 1;
+	solveLevelsBatched(entries, first_level, 0, start);
+
+	for (auto& entry : entries)
+	{
+		auto& face = *faces[entry.index];
+		auto& state = m_face_states[entry.index];
+		restoreFullMesh(face);
+		face.releaseDeviceCoefficients(m_stream);
+		finishKeyframe(sparse_features[entry.index], face, *projections[entry.index], state);
+		updateTemporalState(face, state);
+
+		if (m_params.use_identity_locking && !entry.identity_locked && ++state.num_calibration_frames >= m_params.num_calibration_frames)
+		{
+			face.lockIdentity();
+		}
+	}
+}
+
+void GaussNewtonSolver::solveLevelsBatched(std::vector<BatchEntry>& entries, const int first_level, const int last_level,
+	const std::chrono::steady_clock::time_point start, float* energies_gpu)
+{
+	int frame_iteration = 0;
+	for (int pyramid_level = first_level; pyramid_level >= last_level; pyramid_level--)
+	{
+		util::ScopedTimer level_timer("Level " + std::to_string(pyramid_level), true);
+		const auto& level = m_params.getLevel(pyramid_level);
+
+		for (auto& entry : entries)
+		{
+			auto& face = *entry.face;
+			setRenderTargets(face, *entry.pyramid, pyramid_level, *entry.state);
+			face.setLevelOfDetail(level.level_of_detail);
+			const auto level_unknowns = setupUnknowns(face, entry.num_features, pyramid_level);
+
+			const int nPixels = level.use_dense_term ? face.m_graphics_settings.texture_width * face.m_graphics_settings.texture_height : 0;
+			const int nResiduals = 2 * level_unknowns.nFeatures + 3 * nPixels;
+			(*entry.workspaces)[pyramid_level].reserve(nResiduals, level_unknowns.nUnknowns,
+				std::min(nResiduals, 3 * kNormalEquationChunkThreads), true);
+			(*entry.workspaces)[pyramid_level].resetLevelState(m_stream);
+			entry.converged = false;
+		}
+
+		for (int iteration = 0; iteration < level.num_gn_iterations && !isPastDeadline(start); ++iteration)
+		{
+			util::ScopedTimer iteration_timer("GN iteration L" + std::to_string(pyramid_level), true);
+			const int coefficient_cap = getCoefficientCap(frame_iteration++);
+
+			//Faces of one pyramid share its render targets, each one is rendered and assembled before the next one draws.
+			for (int e = 0; e < entries.size(); ++e)
+			{
+				auto& entry = entries[e];
+				if (entry.converged)
+				{
+					continue;
+				}
+
+				auto& face = *entry.face;
+				auto& workspace = (*entry.workspaces)[pyramid_level];
+				entry.unknowns = setupUnknowns(face, entry.num_features, pyramid_level, coefficient_cap);
+				entry.result.resize(entry.unknowns.nUnknowns);
+				m_statistics.num_gn_iterations++;
+				auto jacobian_input = prepareIteration(face, *entry.projection, *entry.pyramid, pyramid_level, entry.unknowns,
+					entry.sparse_features_gpu, entry.sparse_weights);
+				if (level.use_dense_term)
+				{
+					updateRenderedRect(jacobian_input, *entry.state);
+				}
+
+				workspace.residuals.memset(0, m_stream);
+				computeNormalEquations(jacobian_input, workspace, 1.0f, -1.0f);
+				dampJTJ(entry.unknowns.nUnknowns, workspace.jtj.getPtr());
+				if (energies_gpu)
+				{
+					CHECK_CUDA_ERROR(cudaMemsetAsync(energies_gpu + e, 0, sizeof(float), m_stream));
+					computeEnergy(jacobian_input, workspace.residuals.getPtr(), energies_gpu + e);
+				}
+				cublasScopy(m_cublas, entry.unknowns.nUnknowns, workspace.r.getPtr(), 1, workspace.result.getPtr(), 1);
+
+				if (face.m_graphics_settings.mapped_to_cuda)
+				{
+					unmapRenderTargets(face);
+				}
+			}
+
+			//One batched factorization and solve per system size, the sizes only differ with locked identities.
+			{
+				util::ScopedTimer timer("Batched Cholesky", true, m_stream);
+				std::vector<bool> solved(entries.size(), false);
+				for (int e = 0; e < entries.size(); ++e)
+				{
+					if (entries[e].converged || solved[e])
+					{
+						continue;
+					}
+
+					const int nUnknowns = entries[e].unknowns.nUnknowns;
+					std::vector<float*> matrices;
+					std::vector<float*> rhs;
+					for (int k = e; k < entries.size(); ++k)
+					{
+						if (!entries[k].converged && !solved[k] && entries[k].unknowns.nUnknowns == nUnknowns)
+						{
+							auto& workspace = (*entries[k].workspaces)[pyramid_level];
+							matrices.push_back(workspace.jtj.getPtr());
+							rhs.push_back(workspace.result.getPtr());
+							solved[k] = true;
+						}
+					}
+
+					const int batch_size = matrices.size();
+					util::ensureSize(m_batch_matrices, batch_size);
+					util::ensureSize(m_batch_rhs, batch_size);
+					util::ensureSize(m_batch_info, batch_size);
+					util::copy(m_batch_matrices, matrices, batch_size);
+					util::copy(m_batch_rhs, rhs, batch_size);
+
+					//JTJ = LLT in place, then x = inv(LLT) r, for all systems at once. The regularizer and the epsilon of dampJTJ
+					//make JTJ SPD in exact arithmetic, a system which still fails to factorize in float gets a zero step.
+					checkCusolver(cusolverDnSpotrfBatched(m_cusolver, CUBLAS_FILL_MODE_LOWER, nUnknowns, m_batch_matrices.getPtr(), nUnknowns,
+						m_batch_info.getPtr(), batch_size), "cusolverDnSpotrfBatched");
+					checkCusolver(cusolverDnSpotrsBatched(m_cusolver, CUBLAS_FILL_MODE_LOWER, nUnknowns, 1, m_batch_matrices.getPtr(), nUnknowns,
+						m_batch_rhs.getPtr(), nUnknowns, m_batch_info.getPtr(), batch_size), "cusolverDnSpotrsBatched");
+					discardFailedSteps(nUnknowns, batch_size, m_batch_info.getPtr(), m_batch_rhs.getPtr(), nullptr);
+				}
+			}
+
+			bool all_converged = true;
+			for (auto& entry : entries)
+			{
+				if (entry.converged)
+				{
+					continue;
+				}
+
+				{
+					util::ScopedTimer timer("Readback");
+					util::copy(entry.result, (*entry.workspaces)[pyramid_level].result, entry.unknowns.nUnknowns);
+				}
+				updateParameters(entry.result, (*entry.workspaces)[pyramid_level].result.getPtr(), *entry.projection,
+					entry.pyramid->getAspectRatio(), *entry.face, entry.unknowns);
+
+				//Capped coefficients still need a step, see solve.
+				if (m_params.convergence_threshold > 0.0f && coefficient_cap == INT_MAX)
+				{
+					float step_norm = 0.0f;
+					for (auto delta : entry.result)
+					{
+						step_norm += delta * delta;
+					}
+					entry.converged = std::sqrt(step_norm) < m_params.convergence_threshold;
+				}
+				all_converged &= entry.converged;
+			}
+			if (all_converged)
+			{
+				break;
+			}
+		}
+		if (m_statistics.deadline_expired)
+		{
+			break;
+		}
+	}
+
+}
+
+void GaussNewtonSolver::solveIdentity(std::vector<CalibrationKeyframe>& keyframes, Face& face, glm::mat4& projection, Pyramid& pyramid)
+{
+	if (keyframes.empty())
+	{
+		return;
+	}
+	const auto number_of_levels = pyramid.getNumberOfLevels();
+	reserveFaces(1, number_of_levels);
+	m_statistics = SolverStatistics();
+
+	//The parameters of the current frame are put back at the end.
+	const glm::vec3 rotation = face.m_rotation_coefficients;
+	const glm::vec3 translation = face.m_translation_coefficients;
+	const std::vector<float> expression = face.m_expression_coefficients;
+	const std::vector<float> sh = face.m_sh_coefficients;
+	face.unlockIdentity();
+
+	const int frame_pitch = 3 * pyramid.getWidth(0);
+	const FaceState keyframe_state; //full size render targets
+	auto& sparse_features_gpu = m_sparse_features_gpu[0];
+	std::vector<float> jtj_host;
+	std::vector<float> rhs_host;
+
+	//Per keyframe: its block of the normal equations, factorized, and the coupling to the shared unknowns.
+	struct Elimination
+	{
+		Eigen::LDLT<Eigen::MatrixXf> local_jtj;
+		Eigen::MatrixXf coupling; //shared x local
+		Eigen::VectorXf local_rhs;
+	};
+	std::vector<Elimination> eliminations(keyframes.size());
+
+	for (int pyramid_level = number_of_levels - 1; pyramid_level >= 0; pyramid_level--)
+	{
+		util::ScopedTimer level_timer("Identity level " + std::to_string(pyramid_level), true);
+		const auto& level = m_params.getLevel(pyramid_level);
+		face.setLevelOfDetail(level.level_of_detail);
+		auto& workspace = m_workspaces[0][pyramid_level];
+		workspace.resetLevelState(m_stream);
+
+		for (int iteration = 0; iteration < level.num_gn_iterations; ++iteration)
+		{
+			util::ScopedTimer iteration_timer("Identity GN iteration L" + std::to_string(pyramid_level), true);
+			FaceUnknowns unknowns;
+			std::vector<int> shared; //focal, shape and albedo
+			std::vector<int> local; //pose, expressions and SH
+			Eigen::MatrixXf reduced_jtj;
+			Eigen::VectorXf reduced_rhs;
+
+			for (size_t k = 0; k < keyframes.size(); ++k)
+			{
+				auto& keyframe = keyframes[k];
+				face.m_rotation_coefficients = keyframe.rotation;
+				face.m_translation_coefficients = keyframe.translation;
+				face.m_expression_coefficients = keyframe.expression;
+				face.m_sh_coefficients = keyframe.sh;
+				pyramid.uploadFrame(keyframe.frame.getPtr(), frame_pitch, 3, m_stream);
+				setRenderTargets(face, pyramid, pyramid_level, keyframe_state);
+
+				//The counts only depend on the level, they are the same for every keyframe.
+				const int nFeatures = keyframe.sparse_features.size();
+				unknowns = setupUnknowns(face, nFeatures, pyramid_level);
+				const int nUnknowns = unknowns.nUnknowns;
+				const int nPixels = level.use_dense_term ? face.m_graphics_settings.texture_width * face.m_graphics_settings.texture_height : 0;
+				const int nResiduals = 2 * unknowns.nFeatures + 3 * nPixels;
+				workspace.reserve(nResiduals, nUnknowns, std::min(nResiduals, 3 * kNormalEquationChunkThreads), true);
+				util::ensureSize(sparse_features_gpu, nFeatures);
+				util::copy(sparse_features_gpu, keyframe.sparse_features, nFeatures);
+
+				m_statistics.num_gn_iterations++;
+				auto jacobian_input = prepareIteration(face, projection, pyramid, pyramid_level, unknowns, sparse_features_gpu.getPtr(), nullptr);
+				workspace.residuals.memset(0, m_stream);
+				computeNormalEquations(jacobian_input, workspace, 1.0f, -1.0f);
+				if (face.m_graphics_settings.mapped_to_cuda)
+				{
+					unmapRenderTargets(face);
+				}
+				keyframe.sh = face.m_sh_coefficients; //closed-form lighting solves them while preparing the iteration
+
+				jtj_host.resize(nUnknowns * nUnknowns);
+				rhs_host.resize(nUnknowns);
+				util::copy(jtj_host, workspace.jtj, nUnknowns * nUnknowns);
+				util::copy(rhs_host, workspace.r, nUnknowns);
+				Eigen::MatrixXf jtj = Eigen::Map<Eigen::MatrixXf>(jtj_host.data(), nUnknowns, nUnknowns).selfadjointView<Eigen::Lower>();
+				Eigen::VectorXf rhs = Eigen::Map<Eigen::VectorXf>(rhs_host.data(), nUnknowns);
+
+				const int shape_begin = 7;
+				const int expression_begin = shape_begin + unknowns.nShapeCoeffs;
+				const int albedo_begin = expression_begin + unknowns.nExpressionCoeffs;
+				const int sh_begin = 7 + unknowns.nFaceCoeffs;
+				if (k == 0)
+				{
+					shared.push_back(0);
+					local = { 1, 2, 3, 4, 5, 6 };
+					for (int i = shape_begin; i < expression_begin; ++i) shared.push_back(i);
+					for (int i = expression_begin; i < albedo_begin; ++i) local.push_back(i);
+					for (int i = albedo_begin; i < sh_begin; ++i) shared.push_back(i);
+					for (int i = sh_begin; i < nUnknowns; ++i) local.push_back(i);
+					reduced_jtj = Eigen::MatrixXf::Zero(shared.size(), shared.size());
+					reduced_rhs = Eigen::VectorXf::Zero(shared.size());
+				}
+				else
+				{
+					//Every keyframe adds the prior of the identity, it counts once.
+					const float weight = jacobian_input.wReg * jacobian_input.wReg;
+					for (int i = 0; i < unknowns.nShapeCoeffs; ++i)
+					{
+						jtj(shape_begin + i, shape_begin + i) -= weight;
+						rhs(shape_begin + i) += weight * face.m_shape_coefficients[i];
+					}
+					for (int i = 0; i < unknowns.nAlbedoCoeffs; ++i)
+					{
+						jtj(albedo_begin + i, albedo_begin + i) -= weight;
+						rhs(albedo_begin + i) += weight * face.m_albedo_coefficients[i];
+					}
+				}
+
+				Eigen::MatrixXf shared_jtj(shared.size(), shared.size());
+				Eigen::MatrixXf local_jtj(local.size(), local.size());
+				auto& elimination = eliminations[k];
+				elimination.coupling.resize(shared.size(), local.size());
+				elimination.local_rhs.resize(local.size());
+				Eigen::VectorXf shared_rhs(shared.size());
+				for (int i = 0; i < shared.size(); ++i)
+				{
+					shared_rhs(i) = rhs(shared[i]);
+					for (int j = 0; j < shared.size(); ++j) shared_jtj(i, j) = jtj(shared[i], shared[j]);
+					for (int j = 0; j < local.size(); ++j) elimination.coupling(i, j) = jtj(shared[i], local[j]);
+				}
+				for (int i = 0; i < local.size(); ++i)
+				{
+					elimination.local_rhs(i) = rhs(local[i]);
+					for (int j = 0; j < local.size(); ++j) local_jtj(i, j) = jtj(local[i], local[j]);
+				}
+
+				//S += A - B C^-1 B^T, s += g_s - B C^-1 g_l
+				elimination.local_jtj.compute(local_jtj);
+				const Eigen::MatrixXf eliminated = elimination.local_jtj.solve(elimination.coupling.transpose());
+				reduced_jtj += shared_jtj - elimination.coupling * eliminated;
+				reduced_rhs += shared_rhs - eliminated.transpose() * elimination.local_rhs;
+			}
+
+			const Eigen::VectorXf shared_step = reduced_jtj.ldlt().solve(reduced_rhs);
+			if (!shared_step.allFinite())
+			{
+				std::cout << "Warning: The joint identity system is singular, the identity of the last step is kept." << std::endl;
+				break;
+			}
 
+			projection[0][0] += shared_step(0);
+			projection[1][1] = projection[0][0] * pyramid.getAspectRatio();
+			for (int i = 0; i < unknowns.nShapeCoeffs; ++i)
+			{
+				face.m_shape_coefficients[i] += shared_step(1 + i);
+			}
+			for (int i = 0; i < unknowns.nAlbedoCoeffs; ++i)
+			{
+				face.m_albedo_coefficients[i] += shared_step(1 + unknowns.nShapeCoeffs + i);
+			}
+
+			//Back substitution of every keyframe: C dl = g_l - B^T ds. The expressions are clamped like in cuUpdateCoefficients.
+			for (size_t k = 0; k < keyframes.size(); ++k)
+			{
+				auto& keyframe = keyframes[k];
+				const auto& elimination = eliminations[k];
+				const Eigen::VectorXf local_step = elimination.local_jtj.solve(elimination.local_rhs - elimination.coupling.transpose() * shared_step);
+				if (!local_step.allFinite())
+				{
+					continue;
+				}
+				keyframe.rotation += glm::vec3(local_step(0), local_step(1), local_step(2));
+				keyframe.translation += glm::vec3(local_step(3), local_step(4), local_step(5));
+				for (int i = 0; i < unknowns.nExpressionCoeffs; ++i)
+				{
+					keyframe.expression[i] = glm::clamp(keyframe.expression[i] + local_step(6 + i), -0.5f, 0.5f);
+				}
+				for (int i = 0; i < unknowns.nSHCoeffs; ++i)
+				{
+					keyframe.sh[i] += local_step(6 + unknowns.nExpressionCoeffs + i);
+				}
+			}
+
+			if (m_params.convergence_threshold > 0.0f && shared_step.norm() < m_params.convergence_threshold)
+			{
+				break;
+			}
+		}
+	}
+
+	face.m_rotation_coefficients = rotation;
+	face.m_translation_coefficients = translation;
+	face.m_expression_coefficients = expression;
+	face.m_sh_coefficients = sh;
+	restoreFullMesh(face);
+	face.lockIdentity();
+}
+
+JacobianInput GaussNewtonSolver::prepareIteration(Face& face, const glm::mat4& projection, const Pyramid& pyramid, const int pyramid_level,
+	const FaceUnknowns& unknowns, glm::vec2* sparse_features_gpu, const float* sparse_weights_gpu, const bool reuse_render)
+{
+	//The render targets may only cover a window of the frame, see Face::GraphicsSettings::crop.
+	const auto& graphics_settings = face.m_graphics_settings;
+	const int targetWidth = graphics_settings.texture_width;
+	const int targetHeight = graphics_settings.texture_height;
+	const int frameWidth = pyramid.getWidth(pyramid_level);
+	const int frameHeight = pyramid.getHeight(pyramid_level);
+	const auto& level = m_params.getLevel(pyramid_level);
+	m_num_pcg_iterations = level.num_pcg_iterations;
+	m_jtj_reuse_iterations = level.jtj_reuse_iterations;
+
+	const bool reuse = reuse_render && level.use_dense_term && canReuseRender(face, projection, pyramid_level);
+	if (!level.use_dense_term || reuse)
+	{
+		//The sparse term reads the landmark vertices of the mesh, there is nothing to render. Neither for a reused render.
+		face.computeFace();
+	}
+	else if (m_params.use_cuda_rasterizer)
+	{
+		util::ScopedTimer timer("GN render", true, m_stream);
+		face.computeFace();
+
+		Rasterizer::Uniforms uniforms;
+		uniforms.model = face.computeModelMatrix();
+		uniforms.projection = graphics_settings.crop * projection;
+		std::copy(face.m_sh_coefficients.begin(), face.m_sh_coefficients.end(), uniforms.sh_coefficients);
+		m_rasterizer.draw(pyramid_level, targetWidth, targetHeight, face.getCurrentFaceGpu(), face.m_number_of_vertices,
+			face.getMesh().faces_gpu.getPtr(), face.m_number_of_indices / 3, uniforms, m_params.use_triangle_culling, m_stream);
+
+		const auto& textures = m_rasterizer.getTextures(pyramid_level);
+		m_texture_rgb = textures.rgb;
+		m_target_offset = glm::ivec2(0);
+		m_texture_barycentrics = textures.barycentrics;
+		m_texture_vertex_ids = textures.vertex_ids;
+		m_packed_visibility.texture = 0;
+	}
+	else
+	{
+		util::ScopedTimer timer("GN render", true);
+		face.computeFace();
+		face.updateVertexBuffer(); //still mapped from the previous iteration, if there was one
+		if (face.m_graphics_settings.mapped_to_cuda)
+		{
+			unmapRenderTargets(face);
+		}
+		face.draw();
+	}
+
+	auto face_pose = face.computeModelMatrix();
+	Eigen::Matrix<float, 3, 3> jacobian_local;
+	jacobian_local <<
+		face_pose[0][0], face_pose[1][0], face_pose[2][0],
+		face_pose[0][1], face_pose[1][1], face_pose[2][1],
+		face_pose[0][2], face_pose[1][2], face_pose[2][2];
+
+	glm::mat3 drx, dry, drz;
+	face.computeRotationDerivatives(drx, dry, drz);
+
+	//Without the dense term the bounding box stays empty and there are no pixel rows.
+	FaceBoundingBox face_bb;
+	float dense_sample_scale = 1.0f; //ratio of covered to sampled pixels
+	int n_dense_pixels = 0;
+	VisiblePixel* visible_pixels = m_visible_pixels.getPtr();
+	if (reuse)
+	{
+		face_bb = m_render_cache.face_bb;
+		dense_sample_scale = m_render_cache.dense_sample_scale;
+		n_dense_pixels = m_render_cache.n_dense_pixels;
+		visible_pixels = m_render_cache.visible_pixels;
+		m_statistics.num_reused_renders++;
+	}
+	else if (level.use_dense_term)
+	{
+		if (!m_params.use_cuda_rasterizer)
+		{
+			mapRenderTargets(face, pyramid_level);
+		}
+
+		const bool subsample = pyramid_level == 0;
+		int grid_stride = 1;
+		int grid_offset_x = 0;
+		int grid_offset_y = 0;
+		if (subsample && m_params.pixel_sampling_mode == 2 && m_params.pixel_sample_stride > 1)
+		{
+			grid_stride = m_params.pixel_sample_stride;
+			grid_offset_x = m_random() % grid_stride;
+			grid_offset_y = m_random() % grid_stride;
+		}
+		m_packed_visibility.faces = face.getMesh().faces_gpu.getPtr();
+		m_packed_visibility.current_face = face.getCurrentFaceGpu();
+		m_packed_visibility.aligned_face = face.getAlignedFaceGpu();
+		m_packed_visibility.number_of_vertices = face.m_number_of_vertices;
+		m_packed_visibility.rotation = glm::mat3(face_pose);
+		m_packed_visibility.sh_coefficients = face.getSHCoefficientsGpu();
+		RenderWindow window;
+		window.frame_width = frameWidth;
+		window.frame_height = frameHeight;
+		window.x = graphics_settings.roi_x;
+		window.y = graphics_settings.roi_y;
+		window.stride = graphics_settings.roi_stride;
+		window.target_x = m_target_offset.x;
+		window.target_y = m_target_offset.y;
+		face_bb = computeFaceBoundingBox(targetWidth, targetHeight, grid_stride, grid_offset_x, grid_offset_y, window);
+
+		dense_sample_scale = static_cast<float>(grid_stride * grid_stride);
+		n_dense_pixels = face_bb.num_covered_pixels;
+		if (subsample && m_params.pixel_sampling_mode == 1 && m_params.num_pixel_samples > 0 && n_dense_pixels > m_params.num_pixel_samples)
+		{
+			dense_sample_scale = n_dense_pixels / static_cast<float>(m_params.num_pixel_samples);
+			visible_pixels = sampleVisiblePixels(n_dense_pixels, m_params.num_pixel_samples, m_random());
+			n_dense_pixels = m_params.num_pixel_samples;
+		}
+		if (reuse_render)
+		{
+			storeRender(face, projection, pyramid_level, face_bb, visible_pixels, n_dense_pixels, dense_sample_scale);
+		}
+	}
+
+	const int nFeatures = unknowns.nFeatures;
+	const int nFaceCoeffs = unknowns.nFaceCoeffs;
 	const float wSparse = std::powf(10, m_params.sparse_weight_exponent);
 	const float wDense = std::powf(10, m_params.dense_weight_exponent);
 	const float wReg = std::powf(10, m_params.regularisation_weight_exponent);
 
-	for (int pyramid_level = number_of_levels - 1; pyramid_level >= 0; pyramid_level--)
+	JacobianInput jacobian_input;
+	jacobian_input.face_bb = face_bb;
+	jacobian_input.nFeatures = nFeatures;
+	jacobian_input.imageWidth = frameWidth;
+	jacobian_input.imageHeight = frameHeight;
+	jacobian_input.nFaceCoeffs = nFaceCoeffs;
+	jacobian_input.nPixels = n_dense_pixels;
+	jacobian_input.n = nFeatures + jacobian_input.nPixels;
+	jacobian_input.nShapeCoeffs = unknowns.nShapeCoeffs;
+	jacobian_input.nExpressionCoeffs = unknowns.nExpressionCoeffs;
+	jacobian_input.nAlbedoCoeffs = unknowns.nAlbedoCoeffs;
+	jacobian_input.nSHCoeffs = unknowns.nSHCoeffs;
+	jacobian_input.nUnknowns = unknowns.nUnknowns;
+	jacobian_input.nResiduals = 2 * nFeatures + 3 * n_dense_pixels;
+	jacobian_input.nVerticesTimes3 = face.m_number_of_vertices * 3;
+	jacobian_input.nBasisRows = face.m_model->number_of_vertices * 3;
+	jacobian_input.nExpressionBasisRows = face.m_model->getExpressionBasisRows();
+	jacobian_input.nShapeCoeffsTotal = face.m_shape_coefficients.size();
+	jacobian_input.nExpressionCoeffsTotal = face.m_expression_coefficients.size();
+	jacobian_input.nAlbedoCoeffsTotal = face.m_albedo_coefficients.size();
+	jacobian_input.wSparse = nFeatures > 0 ? glm::sqrt(wSparse / nFeatures) : 0.0f;
+	jacobian_input.wDense = level.use_dense_term ? glm::sqrt(wDense * dense_sample_scale / face_bb.num_visible_pixels) : 0.0f;
+	jacobian_input.wReg = glm::sqrt(wReg);
+
+	jacobian_input.image = pyramid.getFrame(pyramid_level);
+	jacobian_input.image_gradient_x = pyramid.getGradients(pyramid_level).texture_x;
+	jacobian_input.image_gradient_y = pyramid.getGradients(pyramid_level).texture_y;
+
+	jacobian_input.face_pose = face_pose;
+	jacobian_input.drx = drx;
+	jacobian_input.dry = dry;
+	jacobian_input.drz = drz;
+	jacobian_input.projection = projection;
+	jacobian_input.jacobian_local = jacobian_local;
+
+	//device memory input
+	jacobian_input.prior_local_ids = m_prior_ids_gpu.getPtr();
+	jacobian_input.current_face = face.getCurrentFaceGpu();
+	jacobian_input.aligned_face = face.getAlignedFaceGpu();
+	jacobian_input.sparse_features = sparse_features_gpu;
+	jacobian_input.sparse_weights = sparse_weights_gpu;
+	jacobian_input.visible_pixels = visible_pixels;
+
+	jacobian_input.p_shape_basis = face.m_model->shape_basis_gpu.getPtr();
+	jacobian_input.p_expression_basis = face.m_model->expression_basis_gpu.getPtr();
+	jacobian_input.p_albedo_basis = face.m_model->albedo_basis_gpu.getPtr();
+	jacobian_input.p_landmark_shape_basis = face.m_model->landmark_shape_basis_gpu.getPtr();
+	jacobian_input.p_landmark_expression_basis = face.m_model->landmark_expression_basis_gpu.getPtr();
+
+	jacobian_input.half_precision_basis = face.m_model->half_precision_basis;
+	jacobian_input.p_shape_basis_half = face.m_model->shape_basis_half_gpu.getPtr();
+	jacobian_input.p_expression_basis_half = face.m_model->expression_basis_half_gpu.getPtr();
+	jacobian_input.p_albedo_basis_half = face.m_model->albedo_basis_half_gpu.getPtr();
+	jacobian_input.shape_basis_scale = face.m_model->shape_basis_scale;
+	jacobian_input.expression_basis_scale = face.m_model->expression_basis_scale;
+	jacobian_input.albedo_basis_scale = face.m_model->albedo_basis_scale;
+	jacobian_input.vertex_major_basis = face.m_model->vertex_major_basis;
+	jacobian_input.p_expression_vertex_map = face.m_model->expression_vertex_map_gpu.getPtr();
+	if (face.m_model->tiled_basis)
 	{
-		pyramid.setGraphicsSettings(pyramid_level, face.getGraphicsSettings());
+		//The cache reads like three sparse vertex-major bases with one map, there are no basis textures then.
+		auto& tiles = *face.m_model->tiled_basis;
+		if (level.use_dense_term)
+		{
+			requireBasisTiles(tiles, visible_pixels, n_dense_pixels);
+		}
+		jacobian_input.vertex_major_basis = true;
+		jacobian_input.p_shape_basis_half = tiles.getCache(TiledBasis::kShape);
+		jacobian_input.p_expression_basis_half = tiles.getCache(TiledBasis::kExpression);
+		jacobian_input.p_albedo_basis_half = tiles.getCache(TiledBasis::kAlbedo);
+		jacobian_input.p_expression_vertex_map = tiles.getVertexMapGpu();
+		jacobian_input.p_basis_vertex_map = tiles.getVertexMapGpu();
+		jacobian_input.nExpressionBasisRows = 3 * (tiles.getCacheVertices() + 1);
+	}
+	if (m_params.use_basis_textures)
+	{
+		bindBasisTextures(*face.m_model, jacobian_input);
+	}
 
-		const int frameWidth = face.m_graphics_settings.texture_width;
-		const int frameHeight = face.m_graphics_settings.texture_height;
-		const int nPixels = frameWidth * frameHeight;
-		const int nResiduals = 2 * nFeatures + 3 * nPixels + nFaceCoeffs; //nFaceCoeffs -> regularizer
-
-		const auto& prior_local_ids = PriorSparseFeatures::get().getPriorIds();
-
-		//TODO: Allocate all of the objects below once. So, move them out of here.
-		auto jacobian_gpu = util::DeviceArray<float>(nResiduals * nUnknowns);
-		auto residuals_gpu = util::DeviceArray<float>(nResiduals);
-		auto result_gpu = util::DeviceArray<float>(nUnknowns);
-		std::vector<float> result(nUnknowns);
-		auto ids_gpu = util::DeviceArray<int>(prior_local_ids);
-		auto key_pts_gpu = util::DeviceArray<glm::vec2>(sparse_features);
-
-		cv::Mat processed_frame;
-		cv::resize(frame, processed_frame, cv::Size(frameWidth, frameHeight));
-		cv::cvtColor(processed_frame, processed_frame, cv::COLOR_BGR2RGB);
-		util::DeviceArray<uchar> frame_gpu = util::DeviceArray<uchar>(3 * nPixels);
-		util::copy(frame_gpu, processed_frame.data, 3 * nPixels);
-
-		for (int iteration = 0; iteration < m_params.num_gn_iterations[pyramid_level]; ++iteration)
-		{
-			jacobian_gpu.memset(0);
-			residuals_gpu.memset(0);
-			face.computeFace();
-			face.updateVertexBuffer();
-			face.draw();
-
-			auto face_pose = face.computeModelMatrix();
-			Eigen::Matrix<float, 3, 3> jacobian_local;
-			jacobian_local <<
-				face_pose[0][0], face_pose[1][0], face_pose[2][0],
-				face_pose[0][1], face_pose[1][1], face_pose[2][1],
-				face_pose[0][2], face_pose[1][2], face_pose[2][2];
-
-			glm::mat3 drx, dry, drz;
-			face.computeRotationDerivatives(drx, dry, drz);
-
-			mapRenderTargets(face);
-			FaceBoundingBox face_bb = computeFaceBoundingBox(face.m_graphics_settings.texture_width, face.m_graphics_settings.texture_height);
-
-			int n_current_residuals = 2 * nFeatures + nFaceCoeffs + 3 * face_bb.width * face_bb.height;
-
-			util::copy(m_sh_coefficients_gpu, face.m_sh_coefficients, 9);
-
-			//CUDA
-			computeJacobian(
-				//shared memory
-				face_bb,
-				nFeatures, frameWidth, frameHeight,
-				nShapeCoeffs, nExpressionCoeffs, nAlbedoCoeffs, nUnknowns, n_current_residuals,
-				face.m_number_of_vertices * 3,
-				face.m_shape_coefficients.size(),
-				face.m_expression_coefficients.size(),
-				face.m_albedo_coefficients.size(),
-				face.m_sh_coefficients.size(),
-				wSparse, wDense, wReg,
-
-				frame_gpu.getPtr(),
-
-				face_pose, drx, dry, drz, projection, jacobian_local,
-
-				//device memory input
-				ids_gpu.getPtr(), face.m_current_face_gpu.getPtr(), key_pts_gpu.getPtr(),
-
-				face.m_shape_basis_gpu.getPtr(),
-				face.m_expression_basis_gpu.getPtr(),
-				face.m_albedo_basis_gpu.getPtr(),
-
-				face.m_shape_coefficients_gpu.getPtr(),
-				face.m_expression_coefficients_gpu.getPtr(),
-				face.m_albedo_coefficients_gpu.getPtr(),
-				m_sh_coefficients_gpu.getPtr(),
-
-				//device memory output
-				jacobian_gpu.getPtr(), residuals_gpu.getPtr()
-			);
+	jacobian_input.p_coefficients_shape = face.getShapeCoefficientsGpu();
+	jacobian_input.p_coefficients_expression = face.getExpressionCoefficientsGpu();
+	jacobian_input.p_coefficients_albedo = face.getAlbedoCoefficientsGpu();
+	jacobian_input.p_coefficients_sh = face.getSHCoefficientsGpu();
 
-			unmapRenderTargets(face);
+	jacobian_input.rgb = m_texture_rgb;
+	jacobian_input.barycentrics = m_texture_barycentrics;
+	jacobian_input.vertex_ids = m_texture_vertex_ids;
 
-			//Apply step and update poses GPU
-			solveUpdatePCG(m_cublas, nUnknowns, n_current_residuals, nResiduals, jacobian_gpu, residuals_gpu, result_gpu, 1.0f, -1.0f);
-			util::copy(result, result_gpu, nUnknowns);
+	computeVertexShading(jacobian_input);
+	if (reuse)
+	{
+		//The pixels hold the color and light of the old render.
+		relightVisiblePixels(jacobian_input, jacobian_input.p_coefficients_sh);
+	}
+	if (m_params.use_closed_form_lighting && level.use_dense_term && level.optimize_lighting)
+	{
+		solveLighting(face, jacobian_input);
+	}
+	return jacobian_input;
+}
 
-			updateParameters(result, projection, frame.cols / static_cast<float>(frame.rows), face, nShapeCoeffs, nExpressionCoeffs, nAlbedoCoeffs);
+void GaussNewtonSolver::recalibrate(Face& face, int face_index)
+{
+	face.unlockIdentity();
+	if (face_index < m_face_states.size())
+	{
+		m_face_states[face_index].num_calibration_frames = 0;
+	}
+}
+
+GaussNewtonSolver::FaceState GaussNewtonSolver::getFaceState(int face_index) const
+{
+	return face_index < m_face_states.size() ? m_face_states[face_index] : FaceState();
+}
+
+void GaussNewtonSolver::setFaceState(const FaceState& state, int face_index)
+{
+	if (m_face_states.size() <= face_index)
+	{
+		//Like reserveFaces, the levels of the workspaces are sized by the next solve.
+		m_face_states.resize(face_index + 1);
+		m_workspaces.resize(face_index + 1);
+		m_sparse_features_gpu.resize(face_index + 1);
+		m_sparse_weights_gpu.resize(face_index + 1);
+	}
+	auto& target = m_face_states[face_index];
+	target = state;
+	target.predicted = false;
+	target.rendered_rect = glm::vec4(0.0f);
+	target.motion_landmarks.clear();
+}
+
+void GaussNewtonSolver::setLandmarkWeights(const std::vector<float>& weights, int face_index)
+{
+	if (m_face_states.size() <= face_index)
+	{
+		m_face_states.resize(face_index + 1);
+		m_workspaces.resize(face_index + 1);
+		m_sparse_features_gpu.resize(face_index + 1);
+		m_sparse_weights_gpu.resize(face_index + 1);
+	}
+	m_face_states[face_index].landmark_weights.assign(weights.begin(), weights.end());
+}
+
+void GaussNewtonSolver::collectLosses()
+{
+	if (m_pending_losses == 0)
+	{
+		return;
+	}
+
+	//Issued at the end of the previous solve, so this usually doesn't wait.
+	CHECK_CUDA_ERROR(cudaEventSynchronize(m_loss_event));
+
+	m_losses.resize(m_pending_losses);
+	m_convergence.assign(m_pending_records.begin(), m_pending_records.begin() + m_pending_losses);
+	for (int i = 0; i < m_pending_losses; ++i)
+	{
+		const float* values = m_loss_host + kConvergenceValues * i;
+		auto& record = m_convergence[i];
+		record.sparse_energy = values[0];
+		record.dense_energy = values[1];
+		record.regularizer_energy = values[2];
+		record.pcg_residual = std::sqrt(values[3]);
+		m_losses[i] = std::sqrt(values[0] + values[1] + values[2]);
+	}
+	m_pending_losses = 0;
+
+	if (m_convergence_log)
+	{
+		const uint32_t frame_header[2] = { m_pending_frame, static_cast<uint32_t>(m_convergence.size()) };
+		m_convergence_log->write(reinterpret_cast<const char*>(frame_header), sizeof(frame_header));
+		m_convergence_log->write(reinterpret_cast<const char*>(m_convergence.data()), m_convergence.size() * sizeof(ConvergenceRecord));
+	}
+}
+
+void GaussNewtonSolver::openConvergenceLog(const std::string& filepath)
+{
+	closeConvergenceLog();
+	auto log = std::make_unique<std::ofstream>(filepath, std::ios::binary);
+	if (!*log)
+	{
+		throw std::runtime_error("Error: Could not open the convergence log " + filepath);
+	}
+	const ConvergenceLogHeader header;
+	log->write(reinterpret_cast<const char*>(&header), sizeof(header));
+	m_convergence_log = std::move(log);
+	m_convergence_frame = 0;
+}
+
+void GaussNewtonSolver::closeConvergenceLog()
+{
+	if (!m_convergence_log)
+	{
+		return;
+	}
+	collectLosses();
+	m_convergence_log.reset();
+}
 
-			std::vector<float> residuals_loss_test(n_current_residuals);
-			util::copy(residuals_loss_test, residuals_gpu, n_current_residuals);
-			Eigen::Map<Eigen::VectorXf> residuals_loss_test_eigen(residuals_loss_test.data(), n_current_residuals);
-			std::cout << "Unknowns: " << nUnknowns << ", Residuals: " << nResiduals << std::endl;
-			std::cout << "Iteration: " << iteration << " , Loss: " << glm::sqrt(residuals_loss_test_eigen.dot(residuals_loss_test_eigen)) << std::endl;
+void GaussNewtonSolver::solveIteration(const JacobianInput& input, SolverWorkspace& workspace)
+{
+	workspace.residuals.memset(0, m_stream);
+	getLinearSolver(getStrategy(m_params)).solve(input, workspace);
+}
+
+void GaussNewtonSolver::launchGraph(cudaGraph_t graph, cudaGraphExec_t& graph_exec)
+{
+	if (graph_exec)
+	{
+		//Fails if the topology changed, e.g. cuBLAS picked another gemv kernel for a new number of residuals.
+#if CUDART_VERSION >= 12000
+		cudaGraphExecUpdateResultInfo update_info;
+		bool updated = cudaGraphExecUpdate(graph_exec, graph, &update_info) == cudaSuccess;
+#else
+		cudaGraphNode_t error_node;
+		cudaGraphExecUpdateResult update_result;
+		bool updated = cudaGraphExecUpdate(graph_exec, graph, &error_node, &update_result) == cudaSuccess;
+#endif
+		if (!updated)
+		{
+			cudaGetLastError();
+			CHECK_CUDA_ERROR(cudaGraphExecDestroy(graph_exec));
+			graph_exec = nullptr;
 		}
 	}
+
+	if (!graph_exec)
+	{
+		CHECK_CUDA_ERROR(cudaGraphInstantiateWithFlags(&graph_exec, graph, 0));
+	}
+
+	CHECK_CUDA_ERROR(cudaGraphLaunch(graph_exec, m_stream));
 }
 
-void GaussNewtonSolver::solveUpdatePCG(const cublasHandle_t& cublas, const int nUnknowns, const int nCurrentResiduals, const int nResiduals, util::DeviceArray<float>& jacobian,
-	util::DeviceArray<float>& residuals, util::DeviceArray<float>& x, const float alphaLHS, const float alphaRHS)
+void GaussNewtonSolver::solveUpdatePCG(const cublasHandle_t& cublas, const JacobianInput& input, SolverWorkspace& workspace,
+	const float alphaLHS, const float alphaRHS)
 {
-	const float alpha = 1, beta = 0;
-	x.memset(0);
+	const int nUnknowns = input.nUnknowns;
+	const int nCurrentResiduals = input.nResiduals;
+	const float alpha = 1;
+
+	//J is nCurrentResiduals x nUnknowns, stored as is or transposed (use_row_major_jacobian), with the entries of jacobian_precision.
+	const bool row_major = m_params.use_row_major_jacobian;
+	const int rows = row_major ? nUnknowns : nCurrentResiduals; //leading dimension
 
-	auto r = util::DeviceArray<float>(nUnknowns);	//current residual
-	auto p = util::DeviceArray<float>(nUnknowns);	//gradient 
-	auto M = util::DeviceArray<float>(nUnknowns);	//preconditioner
-	M.memset(0);
-	auto z = util::DeviceArray<float>(nUnknowns);	//preconditioned residual
-	auto Jp = util::DeviceArray<float>(nCurrentResiduals);
-	auto JTJp = util::DeviceArray<float>(nUnknowns);
+	const void* jacobian = workspace.getJacobian();
+	auto& r = workspace.r;	//current residual
+	auto& M = workspace.M;	//preconditioner
+	auto& Jp = workspace.Jp;
 
-	//M=inv(diag(JTJ))
-	computeJacobiPreconditioner(nUnknowns, nCurrentResiduals, nResiduals, jacobian.getPtr(), M.getPtr());
+	//M=inv(diag(JTJ)), needed for the damping even with the block preconditioner
+	computeJacobiPreconditioner(input, jacobian, M.getPtr());
+
+	//JTJ_bb = J_b^T * J_b for the columns of every block, inverted in place.
+	const auto& blocks = workspace.preconditioner_blocks;
+	for (int b = 0; b < blocks.count; ++b)
+	{
+		multiplyStoredJTJ(jacobian, blocks.offsets[b], nCurrentResiduals, blocks.sizes[b], rows, alphaLHS, 0.0f,
+			workspace.M_blocks.getPtr() + blocks.storage[b], blocks.sizes[b]);
+	}
+	if (blocks.count > 0)
+	{
+		addRegularizerToBlocks(input, alphaLHS, workspace);
+		invertPreconditionerBlocks(workspace, nullptr, nUnknowns, m_damping);
+	}
+
+	//The landmark rows are zero in the albedo and SH columns, the pixel rows are dense and the regularizer is applied analytically.
+	//So the products run per row block, over its nonzero columns only. Pixel rows come first in J^T * x, which sets all of the
+	//result, the landmark block adds to its columns.
+	struct RowBlock
+	{
+		int first_row;
+		int n_rows;
+		int n_cols;
+	};
+	const int n_landmark_rows = 2 * input.nFeatures;
+	const RowBlock row_blocks[] = {
+		{ n_landmark_rows, nCurrentResiduals - n_landmark_rows, nUnknowns },
+		{ 0, n_landmark_rows, 7 + input.nShapeCoeffs + input.nExpressionCoeffs } };
+	auto first_entry = [&](const RowBlock& block) { return static_cast<size_t>(row_major ? block.first_row * nUnknowns : block.first_row); };
+
+	//y = a * J * x
+	auto multiply = [&](const float a, const float* x, float* y)
+	{
+		for (const auto& block : row_blocks)
+		{
+			if (block.n_rows > 0)
+			{
+				multiplyStoredJacobian(jacobian, first_entry(block), block.n_rows, block.n_cols, rows, false, a, x, 0.0f, y + block.first_row);
+			}
+		}
+	};
+
+	//y = a * J^T * x
+	auto multiply_transposed = [&](const float a, const float* x, float* y)
+	{
+		//Without pixel rows (a level without the dense term) the landmark block doesn't cover all of y.
+		if (row_blocks[0].n_rows == 0)
+		{
+			CHECK_CUDA_ERROR(cudaMemsetAsync(y, 0, nUnknowns * sizeof(float), m_stream));
+		}
+		for (int b = 0; b < 2; ++b)
+		{
+			const auto& block = row_blocks[b];
+			if (block.n_rows > 0)
+			{
+				const float block_beta = b == 0 ? 0.0f : 1.0f;
+				multiplyStoredJacobian(jacobian, first_entry(block), block.n_rows, block.n_cols, rows, true, a, x + block.first_row, block_beta, y);
+			}
+		}
+	};
 
 	//r = -JTf;
-	cublasSgemv(cublas, CUBLAS_OP_T, nCurrentResiduals, nUnknowns, &alphaRHS, jacobian.getPtr(), nCurrentResiduals, residuals.getPtr(), 1, &beta, r.getPtr(), 1);
+	multiply_transposed(alphaRHS, workspace.residuals.getPtr(), r.getPtr());
+	addRegularizer(input, alphaLHS, alphaRHS, r.getPtr(), nullptr, 0);
+
+	auto apply_jtj = [&](float* p, float* JTJp)
+	{
+		multiply(alphaLHS, p, Jp.getPtr());
+		multiply_transposed(alpha, Jp.getPtr(), JTJp);
+		applyRegularizer(input, alphaLHS, p, JTJp);
+		addDamping(nUnknowns, M.getPtr(), p, JTJp);
+	};
+
+	solvePCG(cublas, nUnknowns, apply_jtj, workspace);
+}
+
+void GaussNewtonSolver::solveUpdatePCGMatrixFree(const cublasHandle_t& cublas, const JacobianInput& input, SolverWorkspace& workspace,
+	const float alphaLHS, const float alphaRHS)
+{
+	const int nUnknowns = input.nUnknowns;
+
+	//r = -JTf and M=inv(diag(JTJ)) in a single pass over the residuals.
+	computeRhsAndJacobiPreconditionerMatrixFree(input, alphaRHS, workspace.residuals.getPtr(), workspace.r.getPtr(), workspace.M.getPtr());
+
+	auto apply_jtj = [&](float* p, float* JTJp)
+	{
+		applyJTJMatrixFree(input, alphaLHS, p, workspace.Jp.getPtr(), JTJp);
+		addDamping(nUnknowns, workspace.M.getPtr(), p, JTJp);
+	};
+
+	solvePCG(cublas, nUnknowns, apply_jtj, workspace);
+}
+
+void GaussNewtonSolver::solveUpdateNormalEquations(const JacobianInput& input, SolverWorkspace& workspace, const float alphaLHS, const float alphaRHS)
+{
+	const int nUnknowns = input.nUnknowns;
+
+	//The IRLS weights and the pose of the assembly are baked into a kept JTJ, so it is only an approximation of the current one.
+	const bool reuse_jtj = workspace.jtj_age >= 0 && workspace.jtj_age < m_jtj_reuse_iterations && workspace.jtj_unknowns == nUnknowns;
+	if (reuse_jtj)
+	{
+		computeRhs(input, workspace, alphaRHS);
+		workspace.jtj_age++;
+	}
+	else
+	{
+		computeNormalEquations(input, workspace, alphaLHS, alphaRHS);
+		workspace.jtj_age = 0;
+		workspace.jtj_unknowns = nUnknowns;
+	}
+
+	solveJTJ(nUnknowns, workspace, m_jtj_reuse_iterations > 0);
+}
+
+void GaussNewtonSolver::solveUpdateJTJ(const JacobianInput& input, SolverWorkspace& workspace, const float alphaLHS, const float alphaRHS)
+{
+	const int nUnknowns = input.nUnknowns;
+	const int nCurrentResiduals = input.nResiduals;
+
+	{
+		util::ScopedTimer timer("JTJ", true, m_stream);
+		const int ld = m_params.use_row_major_jacobian ? nUnknowns : nCurrentResiduals;
+		if (m_params.storesReducedJacobian())
+		{
+			multiplyStoredJTJ(workspace.getJacobian(), 0, nCurrentResiduals, nUnknowns, ld, alphaLHS, 0.0f, workspace.jtj.getPtr(), nUnknowns);
+		}
+		else
+		{
+			multiplyJTJ(workspace.jacobian.getPtr(), nCurrentResiduals, nUnknowns, alphaLHS, 0.0f, workspace.jtj.getPtr());
+		}
+
+		//r = alphaRHS * J^T f
+		multiplyStoredJacobian(workspace.getJacobian(), 0, nCurrentResiduals, nUnknowns, ld, true, alphaRHS, workspace.residuals.getPtr(),
+			0.0f, workspace.r.getPtr());
+
+		addRegularizer(input, alphaLHS, alphaRHS, workspace.r.getPtr(), workspace.jtj.getPtr(), nUnknowns + 1);
+	}
+
+	solveJTJ(nUnknowns, workspace, false);
+}
+
+void GaussNewtonSolver::multiplyJTJ(const float* jacobian, const int nRows, const int nUnknowns, const float alpha, const float beta, float* jtj)
+{
+	//A row-major J is J^T in column-major order.
+	const bool row_major = m_params.use_row_major_jacobian;
+	const cublasOperation_t op_jt = row_major ? CUBLAS_OP_N : CUBLAS_OP_T;
+	const cublasOperation_t op_j = row_major ? CUBLAS_OP_T : CUBLAS_OP_N;
+	const int lda = row_major ? nUnknowns : nRows;
+
+	if (!m_params.use_tensor_core_jtj)
+	{
+		cublasSsyrk(m_cublas, CUBLAS_FILL_MODE_LOWER, op_jt, nUnknowns, nRows, &alpha, jacobian, lda, &beta, jtj, nUnknowns);
+		return;
+	}
+
+	//There is no tensor core syrk, the GEMM writes both triangles.
+#if CUDART_VERSION >= 11000
+	cublasGemmEx(m_cublas, op_jt, op_j, nUnknowns, nUnknowns, nRows, &alpha, jacobian, CUDA_R_32F, lda, jacobian, CUDA_R_32F, lda,
+		&beta, jtj, CUDA_R_32F, nUnknowns, CUBLAS_COMPUTE_32F_FAST_TF32, CUBLAS_GEMM_DEFAULT);
+#else
+	//Lets cuBLAS round the FP32 inputs to FP16 for the tensor cores, the handle is shared, so the mode is restored.
+	cublasSetMathMode(m_cublas, CUBLAS_TENSOR_OP_MATH);
+	cublasGemmEx(m_cublas, op_jt, op_j, nUnknowns, nUnknowns, nRows, &alpha, jacobian, CUDA_R_32F, lda, jacobian, CUDA_R_32F, lda,
+		&beta, jtj, CUDA_R_32F, nUnknowns, CUDA_R_32F, CUBLAS_GEMM_DEFAULT_TENSOR_OP);
+	cublasSetMathMode(m_cublas, CUBLAS_DEFAULT_MATH);
+#endif
+}
+
+void GaussNewtonSolver::multiplyStoredJTJ(const void* jacobian, const int first_col, const int nRows, const int nCols, const int ld,
+	const float alpha, const float beta, float* jtj, const int ldjtj)
+{
+	const bool row_major = m_params.use_row_major_jacobian;
+	const cublasOperation_t op_jt = row_major ? CUBLAS_OP_N : CUBLAS_OP_T;
+	const cublasOperation_t op_j = row_major ? CUBLAS_OP_T : CUBLAS_OP_N;
+	const size_t first_entry = row_major ? first_col : static_cast<size_t>(first_col) * ld;
+
+	if (!m_params.storesReducedJacobian())
+	{
+		cublasSsyrk(m_cublas, CUBLAS_FILL_MODE_LOWER, op_jt, nCols, nRows, &alpha, static_cast<const float*>(jacobian) + first_entry, ld,
+			&beta, jtj, ldjtj);
+		return;
+	}
+
+	const uint16_t* columns = static_cast<const uint16_t*>(jacobian) + first_entry;
+#if CUDART_VERSION >= 11000
+	const cudaDataType_t type = m_params.jacobian_precision == JacobianPrecision::BFloat16 ? CUDA_R_16BF : CUDA_R_16F;
+	cublasGemmEx(m_cublas, op_jt, op_j, nCols, nCols, nRows, &alpha, columns, type, ld, columns, type, ld, &beta, jtj, CUDA_R_32F, ldjtj,
+		CUBLAS_COMPUTE_32F, CUBLAS_GEMM_DEFAULT);
+#else
+	if (m_params.jacobian_precision == JacobianPrecision::BFloat16)
+	{
+		throw std::runtime_error("Error: BF16 Jacobians need CUDA 11!");
+	}
+	cublasSetMathMode(m_cublas, CUBLAS_TENSOR_OP_MATH);
+	cublasGemmEx(m_cublas, op_jt, op_j, nCols, nCols, nRows, &alpha, columns, CUDA_R_16F, ld, columns, CUDA_R_16F, ld, &beta, jtj, CUDA_R_32F,
+		ldjtj, CUDA_R_32F, CUBLAS_GEMM_DEFAULT_TENSOR_OP);
+	cublasSetMathMode(m_cublas, CUBLAS_DEFAULT_MATH);
+#endif
+}
+
+void GaussNewtonSolver::solveJTJ(const int nUnknowns, SolverWorkspace& workspace, const bool keep_jtj)
+{
+	//A kept JTJ stays undamped, the damping of this iteration and the factorization go to a copy.
+	float* jtj = workspace.jtj.getPtr();
+	if (keep_jtj)
+	{
+		util::ensureSize(workspace.jtj_damped, nUnknowns * nUnknowns);
+		CHECK_CUDA_ERROR(cudaMemcpyAsync(workspace.jtj_damped.getPtr(), jtj, nUnknowns * nUnknowns * sizeof(float), cudaMemcpyDeviceToDevice, m_stream));
+		jtj = workspace.jtj_damped.getPtr();
+	}
+	dampJTJ(nUnknowns, jtj);
+
+	if (m_params.use_cholesky)
+	{
+		//JTJ = LLT in place, then x = inv(LLT) r. A JTJ which still isn't SPD in float gets a zero step, see solveLevelsBatched.
+		int buffer_size = 0;
+		checkCusolver(cusolverDnSpotrf_bufferSize(m_cusolver, CUBLAS_FILL_MODE_LOWER, nUnknowns, jtj, nUnknowns, &buffer_size),
+			"cusolverDnSpotrf_bufferSize");
+		util::ensureSize(workspace.cholesky_buffer, buffer_size);
+
+		checkCusolver(cusolverDnSpotrf(m_cusolver, CUBLAS_FILL_MODE_LOWER, nUnknowns, jtj, nUnknowns,
+			workspace.cholesky_buffer.getPtr(), buffer_size, workspace.cholesky_info.getPtr()), "cusolverDnSpotrf");
+
+		cublasScopy(m_cublas, nUnknowns, workspace.r.getPtr(), 1, workspace.result.getPtr(), 1);
+		checkCusolver(cusolverDnSpotrs(m_cusolver, CUBLAS_FILL_MODE_LOWER, nUnknowns, 1, jtj, nUnknowns,
+			workspace.result.getPtr(), nUnknowns, workspace.cholesky_info.getPtr()), "cusolverDnSpotrs");
+		discardFailedSteps(nUnknowns, 1, workspace.cholesky_info.getPtr(), nullptr, workspace.result.getPtr());
+		return;
+	}
+
+	computeJTJPreconditioner(nUnknowns, jtj, workspace.M.getPtr());
+	if (workspace.preconditioner_blocks.count > 0)
+	{
+		//JTJ is damped already
+		invertPreconditionerBlocks(workspace, jtj, nUnknowns, 0.0f);
+	}
+
+	const float alpha = 1, beta = 0;
+	auto apply_jtj = [&](float* p, float* JTJp)
+	{
+		cublasSsymv(m_cublas, CUBLAS_FILL_MODE_LOWER, nUnknowns, &alpha, jtj, nUnknowns, p, 1, &beta, JTJp, 1);
+	};
+
+	solvePCG(m_cublas, nUnknowns, apply_jtj, workspace);
+}
+
+void GaussNewtonSolver::solvePCG(const cublasHandle_t& cublas, const int nUnknowns, const std::function<void(float*, float*)>& applyJTJ, SolverWorkspace& workspace)
+{
+	util::ScopedTimer timer("PCG", true, m_stream);
+
+	if (m_params.use_fused_pcg)
+	{
+		solvePCGFused(nUnknowns, applyJTJ, workspace);
+		return;
+	}
+
+	const float alpha = 1;
+	auto& x = workspace.result;
+
+	auto& r = workspace.r;
+	auto& M = workspace.M;
+	auto& p = workspace.p;	//gradient 
+	auto& z = workspace.z;	//preconditioned residual
+	auto& JTJp = workspace.JTJp;
 
 	//z = Mr
-	elementwiseMultiplication(nUnknowns, M.getPtr(), r.getPtr(), z.getPtr());
+	applyPreconditioner(nUnknowns, workspace, r.getPtr(), z.getPtr());
+
+	float zTr_old = 0, zTr = 0;
+	float pTJTJp;
+	//zTr
+	cublasSdot(cublas, nUnknowns, z.getPtr(), 1, r.getPtr(), 1, &zTr_old);
+
+	//The forcing term is relative to the right-hand side, a warm start changes the initial residual only.
+	float tolerance = m_params.kTolerance;
+	if (m_params.pcg_max_forcing_term > 0.0f)
+	{
+		const float forcing_term = computeForcingTerm(m_params.pcg_max_forcing_term, m_params.pcg_forcing_gamma, zTr_old,
+			workspace.pcg_previous_zTr, workspace.pcg_forcing_term);
+		tolerance = std::max(tolerance, forcing_term * forcing_term * zTr_old);
+		workspace.pcg_previous_zTr = zTr_old;
+		workspace.pcg_forcing_term = forcing_term;
+	}
+
+	if (m_params.use_pcg_warm_start && workspace.warm_start_unknowns == nUnknowns)
+	{
+		//r = r - JTJx
+		const float minus_one = -1;
+		applyJTJ(x.getPtr(), JTJp.getPtr());
+		cublasSaxpy(cublas, nUnknowns, &minus_one, JTJp.getPtr(), 1, r.getPtr(), 1);
+		applyPreconditioner(nUnknowns, workspace, r.getPtr(), z.getPtr());
+		cublasSdot(cublas, nUnknowns, z.getPtr(), 1, r.getPtr(), 1, &zTr_old);
+	}
+	else
+	{
+		x.memset(0);
+	}
+	workspace.warm_start_unknowns = nUnknowns;
 
 	//p=z;
 	cublasScopy(cublas, nUnknowns, z.getPtr(), 1, p.getPtr(), 1);
 
-	float zTr_old = 0, zTr = 0;
-	float pTJTJp;
-	//zTr
-	cublasSdot(cublas, nUnknowns, z.getPtr(), 1, r.getPtr(), 1, &zTr_old);
 	int i = 0;
-	for (; i < std::min(nUnknowns, m_params.num_pcg_iterations); ++i)
+	for (; i < std::min(nUnknowns, m_num_pcg_iterations) && zTr_old >= tolerance; ++i)
 	{
 		//apply JTJ
-		cublasSgemv(cublas, CUBLAS_OP_N, nCurrentResiduals, nUnknowns, &alphaLHS, jacobian.getPtr(), nCurrentResiduals, p.getPtr(), 1, &beta, Jp.getPtr(), 1);
-		cublasSgemv(cublas, CUBLAS_OP_T, nCurrentResiduals, nUnknowns, &alpha, jacobian.getPtr(), nCurrentResiduals, Jp.getPtr(), 1, &beta, JTJp.getPtr(), 1);
+		applyJTJ(p.getPtr(), JTJp.getPtr());
 
 		cublasSdot(cublas, nUnknowns, p.getPtr(), 1, JTJp.getPtr(), 1, &pTJTJp);
 
@@ -192,12 +1635,12 @@ void GaussNewtonSolver::solveUpdatePCG(const cublasHandle_t& cublas, const int n
 		cublasSaxpy(cublas, nUnknowns, &ak, JTJp.getPtr(), 1, r.getPtr(), 1);
 
 		//z=Mr
-		elementwiseMultiplication(nUnknowns, M.getPtr(), r.getPtr(), z.getPtr());
+		applyPreconditioner(nUnknowns, workspace, r.getPtr(), z.getPtr());
 
 		//zTr
 		cublasSdot(cublas, nUnknowns, z.getPtr(), 1, r.getPtr(), 1, &zTr);
 
-		if (zTr < m_params.kTolerance)
+		if (zTr < tolerance)
 		{
 			break;
 		}
@@ -213,65 +1656,550 @@ void GaussNewtonSolver::solveUpdatePCG(const cublasHandle_t& cublas, const int n
 	//	std::cout << "PCG iters: " << i << std::endl; 
 }
 
-void GaussNewtonSolver::solveUpdateCG(const cublasHandle_t& cublas, const int nUnknowns, const int nResiduals, util::DeviceArray<float>& jacobian,
-	util::DeviceArray<float>& residuals, util::DeviceArray<float>& x, const float alphaLHS, const float alphaRHS)
+void GaussNewtonSolver::solvePCGFused(const int nUnknowns, const std::function<void(float*, float*)>& applyJTJ, SolverWorkspace& workspace)
 {
-	const float alpha = 1, beta = 0;
-	x.memset(0);
+	//Same iteration as solvePCG, but ak, bk and zTr never leave the device. Once converged, the remaining iterations are no-ops.
+	const bool warm_start = m_params.use_pcg_warm_start && workspace.warm_start_unknowns == nUnknowns;
+	fusedPCGInit(nUnknowns, workspace, warm_start);
+	if (warm_start)
+	{
+		applyJTJ(workspace.result.getPtr(), workspace.JTJp.getPtr());
+		fusedPCGRestart(nUnknowns, workspace);
+	}
+	workspace.warm_start_unknowns = nUnknowns;
 
-	auto r = util::DeviceArray<float>(nUnknowns);	//current residual
-	auto p = util::DeviceArray<float>(nUnknowns);	//gradient 
-	auto Jp = util::DeviceArray<float>(nResiduals);
-	auto JTJp = util::DeviceArray<float>(nUnknowns);
+	//A captured graph has to launch the same sequence in every GN iteration (see solve), so it runs all iterations.
+	cudaStreamCaptureStatus capture_status = cudaStreamCaptureStatusNone;
+	CHECK_CUDA_ERROR(cudaStreamIsCapturing(m_stream, &capture_status));
+	const bool poll = capture_status == cudaStreamCaptureStatusNone;
 
-	//r = -JTf;
-	cublasSgemv(cublas, CUBLAS_OP_T, nResiduals, nUnknowns, &alphaRHS, jacobian.getPtr(), nResiduals, residuals.getPtr(), 1, &beta, r.getPtr(), 1);
+	//The host runs ahead of the device, so the flag it sees is a few intervals old. That many iterations still run as
+	//no-ops, instead of all that are left.
+	bool copy_pending = false;
+	for (int i = 0; i < std::min(nUnknowns, m_num_pcg_iterations); ++i)
+	{
+		if (poll && i > 0 && i % kFusedPCGPollInterval == 0)
+		{
+			if (copy_pending && cudaEventQuery(m_pcg_converged_event) == cudaSuccess)
+			{
+				copy_pending = false;
+				if (*m_pcg_converged_host != 0.0f)
+				{
+					break;
+				}
+			}
+			if (!copy_pending)
+			{
+				CHECK_CUDA_ERROR(cudaMemcpyAsync(m_pcg_converged_host, workspace.pcg_scalars.getPtr() + 1, sizeof(float),
+					cudaMemcpyDeviceToHost, m_stream));
+				CHECK_CUDA_ERROR(cudaEventRecord(m_pcg_converged_event, m_stream));
+				copy_pending = true;
+			}
+		}
+		applyJTJ(workspace.p.getPtr(), workspace.JTJp.getPtr());
+		fusedPCGIteration(nUnknowns, workspace);
+	}
+}
 
-	//p=r;
-	cublasScopy(cublas, nUnknowns, r.getPtr(), 1, p.getPtr(), 1);
+PreconditionerBlocks GaussNewtonSolver::makePreconditionerBlocks(const FaceUnknowns& unknowns) const
+{
+	PreconditionerBlocks blocks;
+	//Matrix-free PCG keeps the diagonal preconditioner.
+	const SolverStrategy strategy = getStrategy(m_params);
+	const bool uses_pcg = strategy != SolverStrategy::MatrixFree && getLinearSolver(strategy).usesPcg();
+	if (!m_params.use_block_preconditioner || !uses_pcg)
+	{
+		return blocks;
+	}
 
-	float rTr_old = 0, rTr;
-	float pTJTJp;
-	//rTr
-	cublasSdot(cublas, nUnknowns, r.getPtr(), 1, r.getPtr(), 1, &rTr);
-	int i = 0;
-	auto num_of_iterations = std::min(nUnknowns, m_params.num_pcg_iterations);
-	for (; i < num_of_iterations; ++i)
+	//Intrinsics and pose are one block, they are strongly coupled.
+	const int parameter_blocks[] = { 7, unknowns.nShapeCoeffs, unknowns.nExpressionCoeffs, unknowns.nAlbedoCoeffs, unknowns.nSHCoeffs };
+	int offset = 0;
+	for (int n : parameter_blocks)
 	{
-		//apply JTJ
-		cublasSgemv(cublas, CUBLAS_OP_N, nResiduals, nUnknowns, &alphaLHS, jacobian.getPtr(), nResiduals, p.getPtr(), 1, &beta, Jp.getPtr(), 1);
-		cublasSgemv(cublas, CUBLAS_OP_T, nResiduals, nUnknowns, &alpha, jacobian.getPtr(), nResiduals, Jp.getPtr(), 1, &beta, JTJp.getPtr(), 1);
+		const int n_parts = (n + PreconditionerBlocks::kMaxSize - 1) / PreconditionerBlocks::kMaxSize;
+		for (int part = 0; part < n_parts; ++part)
+		{
+			if (blocks.count == PreconditionerBlocks::kMaxBlocks)
+			{
+				throw std::runtime_error("Error: Too many unknowns for the block preconditioner!");
+			}
 
-		rTr_old = rTr;
+			//Parts of about the same size
+			const int size = n * (part + 1) / n_parts - n * part / n_parts;
+			blocks.offsets[blocks.count] = offset;
+			blocks.sizes[blocks.count] = size;
+			blocks.storage[blocks.count] = blocks.storage_size;
+			blocks.storage_size += size * size;
+			blocks.max_size = std::max(blocks.max_size, size);
+			offset += size;
+			++blocks.count;
+		}
+	}
+	return blocks;
+}
 
-		cublasSdot(cublas, nUnknowns, p.getPtr(), 1, JTJp.getPtr(), 1, &pTJTJp);
+void SolverWorkspace::reserve(const int nResiduals, const int nUnknowns, const int nJacobianRows, const bool with_normal_equations,
+	const bool reduced_jacobian)
+{
+	//Shrink as well, switching from the full Jacobian to a chunk (or to the other precision) should give the memory back.
+	const int n_entries = nJacobianRows > 0 ? nJacobianRows * nUnknowns : 0;
+	if (jacobian.getSize() != (reduced_jacobian ? 0 : n_entries))
+	{
+		util::ScopedAllocationTag tag("jacobian");
+		jacobian = util::DeviceArray<float>();
+		if (!reduced_jacobian && n_entries > 0)
+		{
+			jacobian = util::DeviceArray<float>(n_entries);
+		}
+	}
+	if (jacobian_16.getSize() != (reduced_jacobian ? n_entries : 0))
+	{
+		util::ScopedAllocationTag tag("jacobian");
+		jacobian_16 = util::DeviceArray<uint16_t>();
+		if (reduced_jacobian && n_entries > 0)
+		{
+			jacobian_16 = util::DeviceArray<uint16_t>(n_entries);
+		}
+	}
+	util::ScopedAllocationTag tag("residuals");
+	util::ensureSize(residuals, nResiduals);
+	util::ensureSize(result, nUnknowns);
+
+	util::ensureSize(r, nUnknowns);
+	util::ensureSize(p, nUnknowns);
+	util::ensureSize(M, nUnknowns);
+	util::ensureSize(z, nUnknowns);
+	util::ensureSize(Jp, nResiduals);
+	util::ensureSize(JTJp, nUnknowns);
+	util::ensureSize(pcg_scalars, 5);
+
+	if (with_normal_equations)
+	{
+		util::ensureSize(jtj, nUnknowns * nUnknowns);
+		util::ensureSize(cholesky_info, 1);
+	}
+}
 
-		float ak = rTr / std::max(pTJTJp, m_params.kNearZero);
-		//x = ak*p + x
-		cublasSaxpy(cublas, nUnknowns, &ak, p.getPtr(), 1, x.getPtr(), 1);
+void* SolverWorkspace::getJacobian()
+{
+	return jacobian_16.getSize() > 0 ? static_cast<void*>(jacobian_16.getPtr()) : jacobian.getPtr();
+}
 
-		//r = r - ak* JTJp
-		ak *= -1;
-		cublasSaxpy(cublas, nUnknowns, &ak, JTJp.getPtr(), 1, r.getPtr(), 1);
+void SolverWorkspace::resetLevelState(cudaStream_t stream)
+{
+	jtj_age = -1;
+	pcg_previous_zTr = 0.0f;
+	pcg_forcing_term = 0.0f;
+	warm_start_unknowns = 0;
+	pcg_scalars.memset(0, stream);
+}
+
+bool GaussNewtonSolver::canReuseRender(const Face& face, const glm::mat4& projection, const int pyramid_level)
+{
+	auto& cache = m_render_cache;
+	const auto& settings = face.m_graphics_settings;
+	const glm::ivec3 active_coefficients(face.m_num_active_shape_coefficients, face.m_num_active_expression_coefficients,
+		face.m_num_active_albedo_coefficients);
+	if (!cache.valid || cache.face != &face || cache.pyramid_level != pyramid_level || cache.level_of_detail != face.getLevelOfDetail()
+		|| cache.active_coefficients != active_coefficients || cache.identity_locked != face.isIdentityLocked()
+		|| cache.texture_width != settings.texture_width || cache.texture_height != settings.texture_height
+		|| cache.roi_x != settings.roi_x || cache.roi_y != settings.roi_y || cache.roi_stride != settings.roi_stride)
+	{
+		return false;
+	}
+
+	float pose_change = glm::dot(face.m_rotation_coefficients - cache.rotation, face.m_rotation_coefficients - cache.rotation) +
+		glm::dot(face.m_translation_coefficients - cache.translation, face.m_translation_coefficients - cache.translation);
+	for (int i = 0; i < 4; ++i)
+	{
+		pose_change += glm::dot(projection[i] - cache.projection[i], projection[i] - cache.projection[i]);
+	}
+	float change = std::sqrt(pose_change);
+	if (change > m_params.render_reuse_threshold)
+	{
+		return false;
+	}
+
+	//The coefficients are on the device, only compare them if they were written since.
+	if (cache.shape_version != face.getCoefficientVersion(Face::kShapeGroup) || cache.expression_version != face.getCoefficientVersion(Face::kExpressionGroup))
+	{
+		const int n = face.m_shape_coefficients.size() + face.m_expression_coefficients.size();
+		const float minus_one = -1.0f;
+		float coefficient_change = 0.0f;
+		cublasScopy(m_cublas, n, face.m_coefficients_gpu.getPtr(), 1, cache.difference.getPtr(), 1);
+		cublasSaxpy(m_cublas, n, &minus_one, cache.coefficients.getPtr(), 1, cache.difference.getPtr(), 1);
+		cublasSnrm2(m_cublas, n, cache.difference.getPtr(), 1, &coefficient_change);
+		change += coefficient_change;
+	}
+	return change <= m_params.render_reuse_threshold;
+}
 
-		//rTr
-		cublasSdot(cublas, nUnknowns, r.getPtr(), 1, r.getPtr(), 1, &rTr);
+void GaussNewtonSolver::storeRender(const Face& face, const glm::mat4& projection, const int pyramid_level, const FaceBoundingBox& face_bb,
+	VisiblePixel* visible_pixels, const int n_dense_pixels, const float dense_sample_scale)
+{
+	auto& cache = m_render_cache;
+	const auto& settings = face.m_graphics_settings;
+	cache.face = &face;
+	cache.pyramid_level = pyramid_level;
+	cache.level_of_detail = face.getLevelOfDetail();
+	cache.active_coefficients = glm::ivec3(face.m_num_active_shape_coefficients, face.m_num_active_expression_coefficients,
+		face.m_num_active_albedo_coefficients);
+	cache.identity_locked = face.isIdentityLocked();
+	cache.texture_width = settings.texture_width;
+	cache.texture_height = settings.texture_height;
+	cache.roi_x = settings.roi_x;
+	cache.roi_y = settings.roi_y;
+	cache.roi_stride = settings.roi_stride;
+	cache.projection = projection;
+	cache.rotation = face.m_rotation_coefficients;
+	cache.translation = face.m_translation_coefficients;
+	cache.shape_version = face.getCoefficientVersion(Face::kShapeGroup);
+	cache.expression_version = face.getCoefficientVersion(Face::kExpressionGroup);
+
+	//Shape and expression coefficients are the first ones on the device.
+	const int n = face.m_shape_coefficients.size() + face.m_expression_coefficients.size();
+	util::ensureSize(cache.coefficients, n);
+	util::ensureSize(cache.difference, n);
+	CHECK_CUDA_ERROR(cudaMemcpyAsync(cache.coefficients.getPtr(), face.m_coefficients_gpu.getPtr(), n * sizeof(float), cudaMemcpyDeviceToDevice, m_stream));
+
+	cache.face_bb = face_bb;
+	cache.visible_pixels = visible_pixels;
+	cache.n_dense_pixels = n_dense_pixels;
+	cache.dense_sample_scale = dense_sample_scale;
+	cache.valid = true;
+}
+
+void GaussNewtonSolver::predictFaceRect(const std::vector<glm::vec2>& sparse_features, FaceState& state) const
+{
+	if (sparse_features.empty() || state.num_tracked_frames == 0)
+	{
+		state.face_rect = glm::vec4(0.0f, 0.0f, 1.0f, 1.0f);
+		return;
+	}
+
+	//Landmarks are in NDC, y up.
+	glm::vec2 rect_min(FLT_MAX);
+	glm::vec2 rect_max(-FLT_MAX);
+	for (const auto& feature : sparse_features)
+	{
+		const glm::vec2 p(0.5f * (feature.x + 1.0f), 0.5f * (1.0f - feature.y));
+		rect_min = glm::min(rect_min, p);
+		rect_max = glm::max(rect_max, p);
+	}
+	//The landmarks leave out the forehead, the rendered face of the last frame covers it.
+	if (state.rendered_rect.z > 0.0f)
+	{
+		rect_min = glm::min(rect_min, glm::vec2(state.rendered_rect));
+		rect_max = glm::max(rect_max, glm::vec2(state.rendered_rect) + glm::vec2(state.rendered_rect.z, state.rendered_rect.w));
+	}
+
+	//Room for the motion to the next frame.
+	const glm::vec2 margin = 0.25f * (rect_max - rect_min);
+	rect_min = glm::clamp(rect_min - margin, 0.0f, 1.0f);
+	rect_max = glm::clamp(rect_max + margin, 0.0f, 1.0f);
+	state.face_rect = glm::vec4(rect_min, rect_max - rect_min);
+}
+
+void GaussNewtonSolver::setRenderTargets(Face& face, const Pyramid& pyramid, const int pyramid_level, const FaceState& state) const
+{
+	if (usesRoiRendering(pyramid))
+	{
+		pyramid.setRoiGraphicsSettings(pyramid_level, state.face_rect, face.getGraphicsSettings());
+	}
+	else
+	{
+		pyramid.setGraphicsSettings(pyramid_level, face.getGraphicsSettings());
+	}
+}
+
+void GaussNewtonSolver::updateRenderedRect(const JacobianInput& input, FaceState& state)
+{
+	const auto& bb = input.face_bb;
+	if (bb.num_visible_pixels == 0 || bb.x_min > bb.x_max || bb.y_min > bb.y_max)
+	{
+		return;
+	}
+	state.rendered_rect = glm::vec4(static_cast<float>(bb.x_min) / input.imageWidth, static_cast<float>(bb.y_min) / input.imageHeight,
+		static_cast<float>(bb.width + 1) / input.imageWidth, static_cast<float>(bb.height + 1) / input.imageHeight);
+}
+
+const std::vector<glm::vec2>& GaussNewtonSolver::filterLandmarks(const std::vector<glm::vec2>& detected_features, FaceState& state) const
+{
+	//The weights are only for this frame. Cleared instead of moved, so the buffers keep their capacity.
+	auto& weights = state.landmark_weights;
+	if (weights.size() != detected_features.size())
+	{
+		weights.clear();
+	}
 
-		if (rTr < m_params.kTolerance)
+	if (!m_params.use_landmark_filter || detected_features.empty())
+	{
+		state.landmark_filter.reset();
+		state.landmark_confidences.assign(weights.begin(), weights.end());
+		weights.clear();
+		return detected_features;
+	}
+	state.landmark_filter.filter(m_params.landmark_filter, detected_features, state.filtered_landmarks, state.landmark_confidences);
+	for (size_t i = 0; i < weights.size(); ++i)
+	{
+		state.landmark_confidences[i] *= weights[i];
+	}
+	weights.clear();
+	return state.filtered_landmarks;
+}
+
+const float* GaussNewtonSolver::uploadLandmarkWeights(const int face_index)
+{
+	const auto& confidences = m_face_states[face_index].landmark_confidences;
+	if (confidences.empty())
+	{
+		return nullptr;
+	}
+	auto& weights_gpu = m_sparse_weights_gpu[face_index];
+	util::ensureSize(weights_gpu, confidences.size());
+	util::copy(weights_gpu, confidences, confidences.size());
+	return weights_gpu.getPtr();
+}
+
+bool GaussNewtonSolver::isStaticFrame(const std::vector<glm::vec2>& sparse_features, const Pyramid& pyramid, FaceState& state)
+{
+	if (!m_params.use_motion_gate)
+	{
+		return false;
+	}
+
+	const int coarsest_level = pyramid.getNumberOfLevels() - 1;
+	const int n_frame_bytes = 3 * pyramid.getWidth(coarsest_level) * pyramid.getHeight(coarsest_level);
+	const uchar* frame = pyramid.getFrame(coarsest_level);
+	bool is_static = state.num_tracked_frames > 0 && state.motion_landmarks.size() == sparse_features.size()
+		&& m_motion_frame.getSize() == n_frame_bytes;
+
+	//The landmarks first, they are on the host already.
+	if (is_static)
+	{
+		float displacement = 0.0f;
+		for (size_t i = 0; i < sparse_features.size(); ++i)
 		{
-			break;
+			displacement += glm::distance(sparse_features[i], state.motion_landmarks[i]);
+		}
+		is_static = displacement / sparse_features.size() <= m_params.motion_landmark_threshold;
+	}
+	if (is_static)
+	{
+		is_static = computeFrameDifference(frame, m_motion_frame.getPtr(), n_frame_bytes) <= m_params.motion_frame_threshold;
+	}
+
+	//Static frames are compared to the same reference, so a slow drift still leads to a full solve eventually.
+	if (!is_static)
+	{
+		state.motion_landmarks = sparse_features;
+		if (m_motion_frame.getSize() != n_frame_bytes)
+		{
+			m_motion_frame = util::DeviceArray<uchar>(n_frame_bytes);
 		}
+		CHECK_CUDA_ERROR(cudaMemcpyAsync(m_motion_frame.getPtr(), frame, n_frame_bytes, cudaMemcpyDeviceToDevice, m_stream));
+	}
+	return is_static;
+}
 
-		float bk = rTr / std::max(rTr_old, m_params.kNearZero);
+void GaussNewtonSolver::predictParameters(Face& face, const FaceState& state) const
+{
+	if (state.num_tracked_frames < 2)
+	{
+		return;
+	}
 
-		//p = r + bk*p        
-		cublasSscal(cublas, nUnknowns, &bk, p.getPtr(), 1);
-		cublasSaxpy(cublas, nUnknowns, &alpha, r.getPtr(), 1, p.getPtr(), 1);
+	const float damping = m_params.prediction_damping;
+	face.m_rotation_coefficients += damping * state.velocity.rotation;
+	face.m_translation_coefficients += damping * state.velocity.translation;
+
+	const size_t n_expressions = std::min(face.m_expression_coefficients.size(), state.velocity.expression.size());
+	for (size_t i = 0; i < n_expressions; ++i)
+	{
+		auto c = face.m_expression_coefficients[i] + damping * state.velocity.expression[i];
+		face.m_expression_coefficients[i] = glm::clamp(c, -0.5f, 0.5f);
+	}
+}
+
+void GaussNewtonSolver::updateTemporalState(const Face& face, FaceState& state)
+{
+	const auto& expression = face.m_expression_coefficients;
+	if (state.num_tracked_frames > 0 && state.last_state.expression.size() == expression.size())
+	{
+		state.velocity.rotation = face.m_rotation_coefficients - state.last_state.rotation;
+		state.velocity.translation = face.m_translation_coefficients - state.last_state.translation;
+		state.velocity.expression.resize(expression.size());
+		for (size_t i = 0; i < expression.size(); ++i)
+		{
+			state.velocity.expression[i] = expression[i] - state.last_state.expression[i];
+		}
+	}
+
+	state.last_state.rotation = face.m_rotation_coefficients;
+	state.last_state.translation = face.m_translation_coefficients;
+	state.last_state.expression = expression;
+	state.num_tracked_frames++;
+	state.predicted = false;
+}
+
+bool GaussNewtonSolver::solveLandmarksOnly(const std::vector<glm::vec2>& sparse_features, Face& face, glm::mat4& projection,
+	const float aspect_ratio, FaceState& state)
+{
+	const int interval = m_params.landmark_keyframe_interval;
+	const bool keyframe = interval > 0 && (state.num_tracked_frames == 0 || state.num_frames_since_keyframe >= interval);
+	if (!m_params.use_landmark_only || keyframe)
+	{
+		return false;
+	}
+
+	if (state.num_tracked_frames > 0 && m_params.use_temporal_prediction)
+	{
+		predictParameters(face, state);
+		state.predicted = true;
+	}
+	m_landmark_solver.solve(m_params, sparse_features, face, projection, aspect_ratio,
+		state.landmark_confidences.empty() ? nullptr : &state.landmark_confidences);
+
+	//The landmarks alone lost the face, e.g. on fast motion or a new expression. Refine this frame with the full solve.
+	if (interval > 0 && m_params.landmark_error_jump > 0.0f && state.keyframe_landmark_error > 0.0f)
+	{
+		const float error = m_landmark_solver.computeError(m_params, sparse_features, face, projection);
+		if (error > m_params.landmark_error_jump * state.keyframe_landmark_error)
+		{
+			return false;
+		}
+	}
+
+	state.num_frames_since_keyframe++;
+	updateTemporalState(face, state);
+	return true;
+}
+
+int GaussNewtonSolver::recoverFace(const std::vector<glm::vec2>& sparse_features, const float* sparse_weights, Face& face,
+	glm::mat4& projection, const Pyramid& pyramid, FaceState& state, const std::chrono::steady_clock::time_point start)
+{
+	if (!m_params.use_recovery)
+	{
+		return -1;
+	}
+	//The landmarks are on the host already, a tracked face only recovers if its last state is far from them.
+	if (state.num_tracked_frames > 0 && (m_params.recovery_landmark_error <= 0.0f
+		|| m_landmark_solver.computeError(m_params, sparse_features, face, projection) <= m_params.recovery_landmark_error))
+	{
+		return -1;
+	}
+
+	util::ScopedTimer timer("Recovery", true);
+	const int number_of_levels = pyramid.getNumberOfLevels();
+	const int last_level = glm::clamp(number_of_levels - m_params.num_recovery_levels, 0, number_of_levels - 1);
+	if (m_recovery_faces.empty() || m_recovery_faces[0]->getModel() != face.getModel())
+	{
+		m_recovery_faces.clear();
+		for (int h = 0; h < kNumRecoveryHypotheses; ++h)
+		{
+			m_recovery_faces.push_back(std::make_unique<Face>(face.getModel()));
+			m_recovery_faces.back()->setExecutionContext(m_context);
+		}
+		m_recovery_states.resize(kNumRecoveryHypotheses);
+		m_recovery_workspaces.resize(kNumRecoveryHypotheses);
+	}
+	util::ensureSize(m_recovery_energy_gpu, kNumRecoveryHypotheses);
+	//Hypotheses whose iterations the deadline skipped keep 0, then the last state wins.
+	m_recovery_energy_gpu.memset(0, m_stream);
+
+	//0: the last state, 1: the mean face, 2: the mean face fitted to the landmarks, a PnP of the pose with the expressions.
+	std::vector<glm::mat4> projections(kNumRecoveryHypotheses);
+	std::vector<BatchEntry> entries;
+	for (int h = 0; h < kNumRecoveryHypotheses; ++h)
+	{
+		auto& hypothesis = *m_recovery_faces[h];
+		copyFaceParameters(face, projection, hypothesis, projections[h]);
+		if (h > 0)
+		{
+			std::fill(hypothesis.m_expression_coefficients.begin(), hypothesis.m_expression_coefficients.end(), 0.0f);
+			hypothesis.m_rotation_coefficients = glm::vec3(0.0f);
+		}
+		if (h == 2)
+		{
+			m_landmark_solver.solve(m_params, sparse_features, hypothesis, projections[h], pyramid.getAspectRatio(),
+				state.landmark_confidences.empty() ? nullptr : &state.landmark_confidences);
+		}
+		//The ROI window of the face, the hypotheses are drawn into its targets one after the other.
+		m_recovery_states[h] = state;
+		if (m_recovery_workspaces[h].size() != number_of_levels)
+		{
+			m_recovery_workspaces[h].resize(number_of_levels);
+		}
+
+		BatchEntry entry;
+		entry.index = h;
+		entry.face = &hypothesis;
+		entry.projection = &projections[h];
+		entry.pyramid = &pyramid;
+		entry.state = &m_recovery_states[h];
+		entry.workspaces = &m_recovery_workspaces[h];
+		entry.sparse_features_gpu = m_sparse_features_gpu[0].getPtr();
+		entry.sparse_weights = sparse_weights;
+		entry.num_features = sparse_features.size();
+		entry.identity_locked = hypothesis.isIdentityLocked();
+		entries.push_back(std::move(entry));
+		hypothesis.acquireDeviceCoefficients(m_stream);
+	}
+	solveLevelsBatched(entries, number_of_levels - 1, last_level, start, m_recovery_energy_gpu.getPtr());
+
+	std::vector<float> energies(kNumRecoveryHypotheses);
+	for (auto& hypothesis : m_recovery_faces)
+	{
+		hypothesis->releaseDeviceCoefficients(m_stream);
 	}
+	util::copy(util::hostSpan(energies), m_recovery_energy_gpu.span(0, kNumRecoveryHypotheses));
+	const int best = std::min_element(energies.begin(), energies.end()) - energies.begin();
+	copyFaceParameters(*m_recovery_faces[best], projections[best], face, projection);
+	m_statistics.recovered_hypothesis = best;
+
+	//The jump to the hypothesis isn't a motion of the face, it starts over as a new track.
+	state.num_tracked_frames = 0;
+	state.predicted = false;
+	return last_level;
 }
 
-void GaussNewtonSolver::updateParameters(const std::vector<float>& result, glm::mat4& projection, float aspect_ratio, Face& face,
-	const int nShapeCoeffs, const int nExpressionCoeffs, const int nAlbedoCoeffs)
+void GaussNewtonSolver::copyFaceParameters(const Face& source, const glm::mat4& source_projection, Face& target, glm::mat4& target_projection)
+{
+	target_projection = source_projection;
+	target.m_rotation_coefficients = source.m_rotation_coefficients;
+	target.m_translation_coefficients = source.m_translation_coefficients;
+	target.m_shape_coefficients = source.m_shape_coefficients;
+	target.m_albedo_coefficients = source.m_albedo_coefficients;
+	target.m_expression_coefficients = source.m_expression_coefficients;
+	target.m_sh_coefficients = source.m_sh_coefficients;
+	target.m_graphics_settings.shader = source.m_graphics_settings.shader;
+	if (source.m_identity_locked)
+	{
+		util::ensureSize(target.m_neutral_face_gpu, source.m_neutral_face_gpu.getSize());
+		util::copyAsync(target.m_neutral_face_gpu.span(), source.m_neutral_face_gpu.span(), m_stream);
+		target.m_identity_locked = true;
+		target.m_face_valid = false;
+	}
+	else if (target.m_identity_locked)
+	{
+		target.unlockIdentity();
+	}
+}
+
+void GaussNewtonSolver::finishKeyframe(const std::vector<glm::vec2>& sparse_features, const Face& face, const glm::mat4& projection,
+	FaceState& state)
+{
+	if (!m_params.use_landmark_only)
+	{
+		return;
+	}
+	state.num_frames_since_keyframe = 0;
+	state.keyframe_landmark_error = m_landmark_solver.computeError(m_params, sparse_features, face, projection);
+}
+
+void GaussNewtonSolver::updateParameters(const std::vector<float>& result, const float* result_gpu, glm::mat4& projection, float aspect_ratio,
+	Face& face, const FaceUnknowns& unknowns)
 {
 	projection[0][0] += result[0];
 	projection[1][1] = projection[0][0] * aspect_ratio;
@@ -284,44 +2212,62 @@ void GaussNewtonSolver::updateParameters(const std::vector<float>& result, glm::
 	face.m_translation_coefficients.y += result[5];
 	face.m_translation_coefficients.z += result[6];
 
-#pragma omp parallel num_threads(4)
+	for (int i = 0; i < unknowns.nSHCoeffs; ++i)
 	{
-#pragma omp single
-		{
-			for (int i = 0; i < nShapeCoeffs; ++i)
-			{
-				face.m_shape_coefficients[i] += result[7 + i];
-			}
-		}
+		face.m_sh_coefficients[i] += result[7 + unknowns.nFaceCoeffs + i];
+	}
 
-#pragma omp single
-		{
-			for (int i = 0; i < nExpressionCoeffs; ++i)
-			{
-				auto c = face.m_expression_coefficients[i] + result[7 + nShapeCoeffs + i];
-				face.m_expression_coefficients[i] = glm::clamp(c, -0.5f, 0.5f);
-			}
-		}
+	updateCoefficients(result_gpu, face, unknowns);
+}
 
-#pragma omp single
-		{
-			for (int i = 0; i < nAlbedoCoeffs; ++i)
-			{
-				face.m_albedo_coefficients[i] += result[7 + nShapeCoeffs + nExpressionCoeffs + i];
-			}
-		}
+void GaussNewtonSolver::backupParameters(const Face& face, const glm::mat4& projection, ParameterBackup& backup) const
+{
+	backup.projection = projection;
+	backup.rotation = face.m_rotation_coefficients;
+	backup.translation = face.m_translation_coefficients;
+	util::ensureSize(backup.coefficients, face.m_number_of_coefficients);
+	CHECK_CUDA_ERROR(cudaMemcpyAsync(backup.coefficients.getPtr(), face.m_coefficients_gpu.getPtr(), face.m_number_of_coefficients * sizeof(float),
+		cudaMemcpyDeviceToDevice, m_stream));
+	backup.sh = face.m_sh_coefficients;
+}
 
-#pragma omp single
-		{
-			for (int i = 0; i < 9; ++i)
-			{
-				face.m_sh_coefficients[i] += result[7 + nShapeCoeffs + nExpressionCoeffs + nAlbedoCoeffs + i];
-			}
-		}
+void GaussNewtonSolver::restoreParameters(const ParameterBackup& backup, Face& face, glm::mat4& projection) const
+{
+	projection = backup.projection;
+	face.m_rotation_coefficients = backup.rotation;
+	face.m_translation_coefficients = backup.translation;
+	CHECK_CUDA_ERROR(cudaMemcpyAsync(face.m_coefficients_gpu.getPtr(), backup.coefficients.getPtr(), face.m_number_of_coefficients * sizeof(float),
+		cudaMemcpyDeviceToDevice, m_stream));
+	face.m_sh_coefficients = backup.sh;
+	face.markCoefficientsChanged(Face::kAllGroups);
+}
+
+float GaussNewtonSolver::evaluateEnergy(Face& face, const glm::mat4& projection, const Pyramid& pyramid, const int pyramid_level,
+	const FaceUnknowns& unknowns, glm::vec2* sparse_features_gpu, const float* sparse_weights_gpu, SolverWorkspace& workspace)
+{
+	//The residuals come with the right hand side, the rhs itself is thrown away.
+	auto input = prepareIteration(face, projection, pyramid, pyramid_level, unknowns, sparse_features_gpu, sparse_weights_gpu, false);
+	workspace.residuals.memset(0, m_stream);
+	computeRhs(input, workspace, -1.0f);
+	m_energy_gpu.memset(0, m_stream);
+	computeEnergy(input, workspace.residuals.getPtr(), m_energy_gpu.getPtr());
+
+	float energy = 0.0f;
+	util::copy(util::hostSpan(&energy, 1), m_energy_gpu.span(0, 1));
+	return energy;
+}
+
+void GaussNewtonSolver::restoreFullMesh(Face& face)
+{
+	//The display and finishKeyframe expect the full mesh, its current face is evaluated from the final coefficients.
+	if (face.getLevelOfDetail() != 0)
+	{
+		face.setLevelOfDetail(0);
+		face.computeFace();
 	}
 }
 
-void GaussNewtonSolver::mapRenderTargets(Face& face)
+void GaussNewtonSolver::mapRenderTargets(Face& face, int pyramid_level)
 {
 	if (face.m_graphics_settings.mapped_to_cuda)
 	{
@@ -329,47 +2275,99 @@ void GaussNewtonSolver::mapRenderTargets(Face& face)
 		return;
 	}
 
-	cudaGraphicsResource* resources[] = { face.m_graphics_settings.rt_rgb_cuda_resource,
-		face.m_graphics_settings.rt_barycentrics_cuda_resource,
-		face.m_graphics_settings.rt_vertex_ids_cuda_resource };
-	CHECK_CUDA_ERROR(cudaGraphicsMapResources(3, resources, 0));
-
-	cudaArray* array_rgb{ nullptr };
-	cudaArray* array_barycentrics{ nullptr };
-	cudaArray* array_vertex_ids{ nullptr };
-
-	CHECK_CUDA_ERROR(cudaGraphicsSubResourceGetMappedArray(&array_rgb, resources[0], 0, 0));
-	CHECK_CUDA_ERROR(cudaGraphicsSubResourceGetMappedArray(&array_barycentrics, resources[1], 0, 0));
-	CHECK_CUDA_ERROR(cudaGraphicsSubResourceGetMappedArray(&array_vertex_ids, resources[2], 0, 0));
-
-	//RGB texture
-	cudaResourceDesc res_desc;
-	memset(&res_desc, 0, sizeof(res_desc));
-	res_desc.resType = cudaResourceTypeArray;
-	res_desc.res.array.array = array_rgb;
-
-	cudaTextureDesc tex_desc;
-	memset(&tex_desc, 0, sizeof(tex_desc));
-	tex_desc.addressMode[0] = cudaTextureAddressMode(cudaAddressModeWrap);
-	tex_desc.addressMode[1] = cudaTextureAddressMode(cudaAddressModeWrap);
-	tex_desc.filterMode = cudaTextureFilterMode(cudaFilterModeLinear);
-	tex_desc.readMode = cudaReadModeNormalizedFloat;
-	tex_desc.normalizedCoords = 0;
-	CHECK_CUDA_ERROR(cudaCreateTextureObject(&m_texture_rgb, &res_desc, &tex_desc, nullptr));
-
-	//Barycentrics texture
-	res_desc.res.array.array = array_barycentrics;
-	tex_desc.filterMode = cudaTextureFilterMode(cudaFilterModePoint);
-	tex_desc.readMode = cudaReadModeElementType;
-	CHECK_CUDA_ERROR(cudaCreateTextureObject(&m_texture_barycentrics, &res_desc, &tex_desc, nullptr));
-
-	//Vertex ids texture
-	res_desc.res.array.array = array_vertex_ids;
-	CHECK_CUDA_ERROR(cudaCreateTextureObject(&m_texture_vertex_ids, &res_desc, &tex_desc, nullptr));
+	//The vertex buffer is mapped in the same call, so the next iteration can already write to it. See Face::updateVertexBuffer.
+	//With the packed visibility buffer only that target and the vertex buffer are mapped.
+	const bool packed = face.m_graphics_settings.rt_visibility_cuda_resource != nullptr;
+	cudaGraphicsResource* resources[4];
+	const int n_targets = getRenderTargetResources(face, resources);
+	CHECK_CUDA_ERROR(cudaGraphicsMapResources(n_targets + 1, resources, m_stream));
+
+	cudaArray* arrays[3]{ nullptr, nullptr, nullptr };
+	for (int i = 0; i < n_targets; ++i)
+	{
+		CHECK_CUDA_ERROR(cudaGraphicsSubResourceGetMappedArray(&arrays[i], resources[i], 0, 0));
+	}
+
+	size_t size;
+	CHECK_CUDA_ERROR(cudaGraphicsResourceGetMappedPointer(&face.m_mapped_vertex_buffer, &size, face.m_resource));
+
+	//The driver hands out the same arrays for a registered image in practice, so the texture objects are only created again
+	//if they changed. A texture object of an array is valid as long as the array is. The levels of an atlas share one entry.
+	const int cache_index = face.m_graphics_settings.atlas ? 0 : pyramid_level;
+	if (static_cast<int>(m_render_target_textures.size()) <= cache_index)
+	{
+		m_render_target_textures.resize(cache_index + 1);
+	}
+	auto& cache = m_render_target_textures[cache_index];
+	if (!std::equal(std::begin(arrays), std::end(arrays), std::begin(cache.arrays)))
+	{
+		cache.destroy();
+
+		cudaResourceDesc res_desc;
+		memset(&res_desc, 0, sizeof(res_desc));
+		res_desc.resType = cudaResourceTypeArray;
+		res_desc.res.array.array = arrays[0];
+
+		cudaTextureDesc tex_desc;
+		memset(&tex_desc, 0, sizeof(tex_desc));
+		tex_desc.addressMode[0] = cudaTextureAddressMode(cudaAddressModeWrap);
+		tex_desc.addressMode[1] = cudaTextureAddressMode(cudaAddressModeWrap);
+		tex_desc.normalizedCoords = 0;
+		if (packed)
+		{
+			//Packed visibility texture
+			tex_desc.filterMode = cudaTextureFilterMode(cudaFilterModePoint);
+			tex_desc.readMode = cudaReadModeElementType;
+			CHECK_CUDA_ERROR(cudaCreateTextureObject(&cache.visibility, &res_desc, &tex_desc, nullptr));
+		}
+		else
+		{
+			//RGB texture
+			tex_desc.filterMode = cudaTextureFilterMode(cudaFilterModeLinear);
+			tex_desc.readMode = cudaReadModeNormalizedFloat;
+			CHECK_CUDA_ERROR(cudaCreateTextureObject(&cache.rgb, &res_desc, &tex_desc, nullptr));
+
+			//Barycentrics texture
+			res_desc.res.array.array = arrays[1];
+			tex_desc.filterMode = cudaTextureFilterMode(cudaFilterModePoint);
+			tex_desc.readMode = cudaReadModeElementType;
+			CHECK_CUDA_ERROR(cudaCreateTextureObject(&cache.barycentrics, &res_desc, &tex_desc, nullptr));
+
+			//Vertex ids texture
+			res_desc.res.array.array = arrays[2];
+			CHECK_CUDA_ERROR(cudaCreateTextureObject(&cache.vertex_ids, &res_desc, &tex_desc, nullptr));
+		}
+
+		std::copy(std::begin(arrays), std::end(arrays), std::begin(cache.arrays));
+	}
+
+	m_texture_rgb = cache.rgb;
+	m_target_offset = glm::ivec2(face.m_graphics_settings.target_x, face.m_graphics_settings.target_y);
+	m_texture_barycentrics = cache.barycentrics;
+	m_texture_vertex_ids = cache.vertex_ids;
+	m_packed_visibility.texture = cache.visibility;
 
 	face.m_graphics_settings.mapped_to_cuda = true;
 }
 
+int GaussNewtonSolver::getRenderTargetResources(const Face& face, cudaGraphicsResource* resources[4]) const
+{
+	const auto& settings = face.m_graphics_settings;
+	int n_targets = 0;
+	if (settings.rt_visibility_cuda_resource)
+	{
+		resources[n_targets++] = settings.rt_visibility_cuda_resource;
+	}
+	else
+	{
+		resources[n_targets++] = settings.rt_rgb_cuda_resource;
+		resources[n_targets++] = settings.rt_barycentrics_cuda_resource;
+		resources[n_targets++] = settings.rt_vertex_ids_cuda_resource;
+	}
+	resources[n_targets] = face.m_resource;
+	return n_targets;
+}
+
 void GaussNewtonSolver::unmapRenderTargets(Face& face)
 {
 	if (!face.m_graphics_settings.mapped_to_cuda)
@@ -378,31 +2376,92 @@ void GaussNewtonSolver::unmapRenderTargets(Face& face)
 		return;
 	}
 
-	destroyTextures();
-
-	cudaGraphicsResource* resources[] = { face.m_graphics_settings.rt_rgb_cuda_resource,
-		face.m_graphics_settings.rt_barycentrics_cuda_resource,
-		face.m_graphics_settings.rt_vertex_ids_cuda_resource };
-	CHECK_CUDA_ERROR(cudaGraphicsUnmapResources(3, resources, 0));
+	cudaGraphicsResource* resources[4];
+	const int n_targets = getRenderTargetResources(face, resources);
+	CHECK_CUDA_ERROR(cudaGraphicsUnmapResources(n_targets + 1, resources, m_stream));
 
+	face.m_mapped_vertex_buffer = nullptr;
 	face.m_graphics_settings.mapped_to_cuda = false;
 }
 
-void GaussNewtonSolver::destroyTextures()
+void GaussNewtonSolver::bindBasisTextures(const FaceModel& model, JacobianInput& input)
 {
-	if (m_texture_rgb)
+	const bool half = model.half_precision_basis;
+	const void* data[3] = {
+		half ? static_cast<const void*>(model.shape_basis_half_gpu.getPtr()) : model.shape_basis_gpu.getPtr(),
+		half ? static_cast<const void*>(model.expression_basis_half_gpu.getPtr()) : model.expression_basis_gpu.getPtr(),
+		half ? static_cast<const void*>(model.albedo_basis_half_gpu.getPtr()) : model.albedo_basis_gpu.getPtr() };
+	const int sizes[3] = {
+		half ? model.shape_basis_half_gpu.getSize() : model.shape_basis_gpu.getSize(),
+		half ? model.expression_basis_half_gpu.getSize() : model.expression_basis_gpu.getSize(),
+		half ? model.albedo_basis_half_gpu.getSize() : model.albedo_basis_gpu.getSize() };
+
+	if (!std::equal(std::begin(data), std::end(data), std::begin(m_basis_texture_data)) ||
+		!std::equal(std::begin(sizes), std::end(sizes), std::begin(m_basis_texture_sizes)))
 	{
-		CHECK_CUDA_ERROR(cudaDestroyTextureObject(m_texture_rgb));
-		m_texture_rgb = 0;
+		destroyBasisTextures();
+		std::copy(std::begin(data), std::end(data), std::begin(m_basis_texture_data));
+		std::copy(std::begin(sizes), std::end(sizes), std::begin(m_basis_texture_sizes));
+
+		int device = 0;
+		int max_width = 0;
+		CHECK_CUDA_ERROR(cudaGetDevice(&device));
+		CHECK_CUDA_ERROR(cudaDeviceGetAttribute(&max_width, cudaDevAttrMaxTexture1DLinearWidth, device));
+		const bool fits = std::all_of(std::begin(sizes), std::end(sizes), [&](int size) { return size > 0 && size <= max_width; });
+		if (fits)
+		{
+			cudaResourceDesc res_desc;
+			memset(&res_desc, 0, sizeof(res_desc));
+			res_desc.resType = cudaResourceTypeLinear;
+			res_desc.res.linear.desc = half ? cudaCreateChannelDescHalf() : cudaCreateChannelDesc<float>();
+
+			//Unfiltered element reads, FP16 is promoted to float.
+			cudaTextureDesc tex_desc;
+			memset(&tex_desc, 0, sizeof(tex_desc));
+			tex_desc.filterMode = cudaTextureFilterMode(cudaFilterModePoint);
+			tex_desc.readMode = cudaReadModeElementType;
+			tex_desc.normalizedCoords = 0;
+
+			const size_t element_size = half ? sizeof(Eigen::half) : sizeof(float);
+			for (int i = 0; i < 3; ++i)
+			{
+				res_desc.res.linear.devPtr = const_cast<void*>(data[i]);
+				res_desc.res.linear.sizeInBytes = sizes[i] * element_size;
+				CHECK_CUDA_ERROR(cudaCreateTextureObject(&m_basis_textures[i], &res_desc, &tex_desc, nullptr));
+			}
+		}
 	}
-	if (m_texture_barycentrics)
+
+	input.shape_basis_texture = m_basis_textures[0];
+	input.expression_basis_texture = m_basis_textures[1];
+	input.albedo_basis_texture = m_basis_textures[2];
+}
+
+void GaussNewtonSolver::destroyBasisTextures()
+{
+	for (auto& texture : m_basis_textures)
 	{
-		m_texture_barycentrics = 0;
-		CHECK_CUDA_ERROR(cudaDestroyTextureObject(m_texture_barycentrics));
+		if (texture)
+		{
+			CHECK_CUDA_ERROR(cudaDestroyTextureObject(texture));
+			texture = 0;
+		}
 	}
-	if (m_texture_vertex_ids)
+	std::fill(std::begin(m_basis_texture_data), std::end(m_basis_texture_data), nullptr);
+	std::fill(std::begin(m_basis_texture_sizes), std::end(m_basis_texture_sizes), 0);
+}
+
+void GaussNewtonSolver::destroyTextures()
+{
+	destroyBasisTextures();
+	for (auto& textures : m_render_target_textures)
 	{
-		CHECK_CUDA_ERROR(cudaDestroyTextureObject(m_texture_vertex_ids));
-		m_texture_vertex_ids = 0;
+		textures.destroy();
 	}
+	m_render_target_textures.clear();
+	m_texture_rgb = 0;
+	m_target_offset = glm::ivec2(0);
+	m_texture_barycentrics = 0;
+	m_texture_vertex_ids = 0;
+	m_packed_visibility.texture = 0;
 }
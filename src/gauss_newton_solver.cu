@@ -5,108 +5,448 @@
 #include "jacobian_util.h"
 #include "device_util.h"
 #include "device_array.h"
+#include "profiler.h"
+#include "launch_tuner.h"
 #include "opencv2/imgproc/imgproc.hpp"
 #include "opencv2/highgui/highgui.hpp"
+#include <cuda_fp16.h>
+#include <type_traits>
 
-/**
- * Compute Jacobian matrix for parametric model w.r.t fov of virtual camera, Rotation, Translation, α, β, δ, γ
- * (α, β, δ) are parametric face model Eigen basis scaling factors
- * γ is illumination model (Spherical harmonics)
- * 
- * Optimization energy
- * P = (intrinsics, pose, α, β, δ, γ)
- * E(P) = w_col * E_col(P) + w_lan * E_lan(P) + w_reg * E_reg(P)
- * 
- */
-__global__ void cuComputeJacobianSparseDense(
-	// Shared memory
-	FaceBoundingBox face_bb,
-	const int nFeatures, const int imageWidth, const int imageHeight,
-	const int nFaceCoeffs, const int nPixels, const int n,
-	const int nShapeCoeffs, const int nExpressionCoeffs, const int nAlbedoCoeffs,
-	const int nUnknowns, const int nResiduals,
-	const int nVerticesTimes3, const int nShapeCoeffsTotal, const int nExpressionCoeffsTotal, const int nAlbedoCoeffsTotal,
-	const float wSparse, float wDense, const float wReg,
+// BF16 entry of a stored Jacobian (JacobianPrecision::BFloat16), the upper half of an FP32.
+struct JacobianBf16
+{
+	unsigned short bits;
+};
 
-	uchar* image,
+__device__ __forceinline__ float loadEntry(float entry)
+{
+	return entry;
+}
 
-	glm::mat4 face_pose, glm::mat3 drx, glm::mat3 dry, glm::mat3 drz, glm::mat4 projection, Eigen::Matrix3f jacobian_local,
+__device__ __forceinline__ float loadEntry(__half entry)
+{
+	return __half2float(entry);
+}
 
-	// Device memory input
-	int* prior_local_ids, glm::vec3* current_face, glm::vec2* sparse_features,
+__device__ __forceinline__ float loadEntry(JacobianBf16 entry)
+{
+	return __uint_as_float(static_cast<unsigned int>(entry.bits) << 16);
+}
 
-	float* p_shape_basis,
-	float* p_expression_basis,
-	float* p_albedo_basis,
+__device__ __forceinline__ void storeEntry(float& entry, float value)
+{
+	entry = value;
+}
 
-	float* p_coefficients_shape,
-	float* p_coefficients_expression,
-	float* p_coefficients_albedo,
-	float* p_coefficients_sh,
+// Saturates instead of overflowing to infinity, which would spread through every PCG product.
+__device__ __forceinline__ void storeEntry(__half& entry, float value)
+{
+	entry = __float2half_rn(fminf(fmaxf(value, -65504.0f), 65504.0f));
+}
 
-	cudaTextureObject_t rgb,
-	cudaTextureObject_t barycentrics,
-	cudaTextureObject_t vertex_ids,
+// Rounds to nearest even, NaNs stay NaNs.
+__device__ __forceinline__ void storeEntry(JacobianBf16& entry, float value)
+{
+	const unsigned int bits = __float_as_uint(value);
+	entry.bits = (bits & 0x7fffffffu) > 0x7f800000u ? static_cast<unsigned short>((bits >> 16) | 0x40u) :
+		static_cast<unsigned short>((bits + 0x7fffu + ((bits >> 16) & 1u)) >> 16);
+}
 
-	// Device memory output
-	float* p_jacobian, float* p_residuals)
+template<typename Derived>
+__device__ void storeBlock(float* destination, int row_stride, int col_stride, const Eigen::MatrixBase<Derived>& block)
 {
-	int i = util::getThreadIndex1D();
+	using Stride = Eigen::Stride<Eigen::Dynamic, Eigen::Dynamic>;
+	Eigen::Map<Eigen::MatrixXf, 0, Stride>(destination, block.rows(), block.cols(), Stride(col_stride, row_stride)) = block;
+}
 
-	if (i >= n)
+// FP16 and BF16: the lazy block is evaluated and rounded entry by entry.
+template<typename Entry, typename Derived>
+__device__ void storeBlock(Entry* destination, int row_stride, int col_stride, const Eigen::MatrixBase<Derived>& block)
+{
+	for (int c = 0; c < block.cols(); ++c)
 	{
-		return;
+		for (int r = 0; r < block.rows(); ++r)
+		{
+			storeEntry(destination[r * row_stride + c * col_stride], block(r, c));
+		}
+	}
+}
+
+/**
+ * Jacobian writers consume the residual rows produced by computeJacobianRows.
+ * Every entry of the Jacobian is handed to the writer exactly once, as a (row, col) anchored block.
+ * Basis products are passed as lazy expressions, so column-wise access does not evaluate the whole block.
+ * StoredJacobianWriter materializes the Jacobian, the others apply it on the fly (matrix-free PCG),
+ * so memory scales with the number of unknowns instead of the number of residuals.
+ */
+template<typename Entry>
+struct StoredJacobianWriter
+{
+	Entry* jacobian; // float, __half or JacobianBf16, see SolverParameters::jacobian_precision
+	float* residuals;
+	int row_stride; //distance between neighbouring rows of "jacobian", 1 if it is column-major
+	int col_stride; //distance between neighbouring columns, 1 if it is row-major (SolverParameters::use_row_major_jacobian)
+	int row_offset; //first row stored in "jacobian", non-zero for the chunks of the normal equation assembly
+
+	// "jacobian" holds the rows [row_offset, row_offset + nRows) of J.
+	static StoredJacobianWriter create(Entry* jacobian, float* residuals, int nRows, int nUnknowns, int row_offset, bool row_major)
+	{
+		return row_major ? StoredJacobianWriter{ jacobian, residuals, nUnknowns, 1, row_offset } : StoredJacobianWriter{ jacobian, residuals, 1, nRows, row_offset };
 	}
 
-	Eigen::Map<Eigen::MatrixXf> jacobian(p_jacobian, nResiduals, nUnknowns);
-	Eigen::Map<Eigen::VectorXf> residuals(p_residuals, nResiduals);
+	__device__ Entry& at(int row, int col) const
+	{
+		return jacobian[(row - row_offset) * row_stride + col * col_stride];
+	}
+
+	__device__ void set(int row, int col, float value) const
+	{
+		storeEntry(at(row, col), value);
+	}
 
-	Eigen::Map<Eigen::MatrixXf> shape_basis(p_shape_basis, nVerticesTimes3, nShapeCoeffsTotal);
-	Eigen::Map<Eigen::MatrixXf> expression_basis(p_expression_basis, nVerticesTimes3, nExpressionCoeffsTotal);
-	Eigen::Map<Eigen::MatrixXf> albedo_basis(p_albedo_basis, nVerticesTimes3, nAlbedoCoeffsTotal);
+	__device__ void setResidual(int row, float value)
+	{
+		residuals[row] = value;
+	}
 
-	// Regularization terms based on the assumption of a normal distributed population
-	if (i >= nFeatures + nPixels)
+	template<typename Derived>
+	__device__ void add(int row, int col, const Eigen::MatrixBase<Derived>& block)
 	{
-		int offset_rows = nFeatures * 2 + nPixels * 3;
-		int offset_cols = 7;
+		storeBlock(&at(row, col), row_stride, col_stride, block);
+	}
+};
 
-		const int current_index = i - nFeatures - nPixels;
-		const int expression_shift = nShapeCoeffs;
-		const int albedo_shift = nShapeCoeffs + nExpressionCoeffs;
+using DenseJacobianWriter = StoredJacobianWriter<float>;
 
-		float coefficient = 0.0f;
-		int relative_index = current_index;
+// Jp = J * p. Every thread owns its residual rows, so no atomics are needed. Jp has to be zeroed beforehand.
+struct ProductWriter
+{
+	const float* p;
+	float* jp;
+
+	__device__ void setResidual(int row, float value) {}
 
-		// Shape
-		if (current_index < expression_shift)
+	template<typename Derived>
+	__device__ void add(int row, int col, const Eigen::MatrixBase<Derived>& block)
+	{
+		for (int c = 0; c < block.cols(); ++c)
 		{
-			coefficient = p_coefficients_shape[relative_index];
+			const auto column = block.col(c).eval();
+			const float p_c = p[col + c];
+			for (int r = 0; r < column.rows(); ++r)
+			{
+				jp[row + r] += column(r) * p_c;
+			}
 		}
-		// Expression
-		else if (current_index < albedo_shift)
-		{
-			offset_rows += expression_shift;
-			offset_cols += expression_shift;
-			relative_index -= expression_shift;
+	}
+};
+
+// JTq = scale * J^T * q. Partial sums are reduced in shared memory, one global atomic per unknown per block.
+struct TransposeProductWriter
+{
+	const float* q;
+	float* accumulator; // shared memory, nUnknowns floats
+	float scale;
+
+	__device__ void setResidual(int row, float value) {}
 
-			coefficient = p_coefficients_expression[relative_index];
+	template<typename Derived>
+	__device__ void add(int row, int col, const Eigen::MatrixBase<Derived>& block)
+	{
+		Eigen::Map<const Eigen::VectorXf> q_rows(q + row, block.rows());
+		for (int c = 0; c < block.cols(); ++c)
+		{
+			atomicAdd(&accumulator[col + c], scale * block.col(c).eval().dot(q_rows));
 		}
-		// Albedo
-		else
+	}
+};
+
+// r = scale * J^T * f alone, for a kept J^T * J (LevelSchedule::jtj_reuse_iterations).
+struct RhsWriter
+{
+	float* residuals;
+	float* accumulator; // shared memory, nUnknowns floats
+	float scale;
+
+	__device__ void setResidual(int row, float value)
+	{
+		residuals[row] = value;
+	}
+
+	template<typename Derived>
+	__device__ void add(int row, int col, const Eigen::MatrixBase<Derived>& block)
+	{
+		Eigen::Map<const Eigen::VectorXf> f_rows(residuals + row, block.rows());
+		for (int c = 0; c < block.cols(); ++c)
 		{
-			offset_rows += albedo_shift;
-			offset_cols += albedo_shift;
-			relative_index -= albedo_shift;
+			atomicAdd(&accumulator[col + c], scale * block.col(c).eval().dot(f_rows));
+		}
+	}
+};
+
+// r = scale * J^T * f and diag(J^T * J) in one pass. Residuals are written as they are produced, the same thread reads them back.
+struct RhsAndDiagonalWriter
+{
+	float* residuals;
+	float* accumulator; // shared memory, 2 * nUnknowns floats: [rhs | diagonal]
+	int nUnknowns;
+	float scale;
+
+	__device__ void setResidual(int row, float value)
+	{
+		residuals[row] = value;
+	}
 
-			coefficient = p_coefficients_albedo[relative_index];
+	template<typename Derived>
+	__device__ void add(int row, int col, const Eigen::MatrixBase<Derived>& block)
+	{
+		Eigen::Map<const Eigen::VectorXf> f_rows(residuals + row, block.rows());
+		for (int c = 0; c < block.cols(); ++c)
+		{
+			auto column = block.col(c).eval();
+			atomicAdd(&accumulator[col + c], scale * column.dot(f_rows));
+			atomicAdd(&accumulator[nUnknowns + col + c], column.squaredNorm());
 		}
+	}
+};
 
-		jacobian(offset_rows + relative_index, offset_cols + relative_index) = wReg;
-		residuals(offset_rows + relative_index) = coefficient * wReg;
+__device__ inline void clearSharedAccumulator(float* accumulator, int size)
+{
+	for (int j = threadIdx.x; j < size; j += blockDim.x)
+	{
+		accumulator[j] = 0.0f;
+	}
+	__syncthreads();
+}
 
-		return;
+__device__ inline void flushSharedAccumulator(const float* accumulator, float* out, int size)
+{
+	__syncthreads();
+	for (int j = threadIdx.x; j < size; j += blockDim.x)
+	{
+		atomicAdd(&out[j], accumulator[j]);
+	}
+}
+
+// 3DMM basis in FP32 or FP16, column-major or vertex-major. Rows are dequantized and scaled lazily, so the products accumulate in FP32.
+// A sparse basis (vertex_map, see FaceModel::expression_vertex_map_gpu) maps the vertices to its rows, the ones without rows
+// read a shared zero block.
+template<typename Scalar>
+struct BasisView
+{
+	const Scalar* data;
+	int row_stride; //see FaceModel::getBasisRowStride
+	int col_stride;
+	float scale;
+	const int* vertex_map; //nullptr if dense
+
+	__device__ float operator()(int row, int col) const
+	{
+		return scale * static_cast<float>(data[row * row_stride + col * col_stride]);
+	}
+
+	// Row of the basis that holds row "row" (3 * vertex id) of the model.
+	__device__ int vertexRow(int row) const
+	{
+		return vertex_map ? 3 * vertex_map[row / 3] : row;
+	}
+
+	// The 3 x nCols block of a vertex, starting at "row" (3 * vertex id). "Cols" is nCols if it is known at compile time.
+	template<int Cols = Eigen::Dynamic>
+	__device__ auto vertexBlock(int row, int nCols) const
+	{
+		using Stride = Eigen::Stride<Eigen::Dynamic, Eigen::Dynamic>;
+		Eigen::Map<const Eigen::Matrix<Scalar, 3, Cols>, 0, Stride> block(data + vertexRow(row) * row_stride, 3, nCols, Stride(col_stride, row_stride));
+		return scale * block.template cast<float>();
+	}
+};
+
+// Tag of a basis read through a linear texture object, see SolverParameters::use_basis_textures.
+struct TextureBasis
+{
+};
+
+// Element (r, c) of a vertex block as an Eigen expression, so the texture fetches are as lazy as the reads of a Map.
+struct TextureBasisBlock
+{
+	cudaTextureObject_t texture;
+	int offset;
+	int row_stride;
+	int col_stride;
+	float scale;
+
+	__device__ float operator()(Eigen::Index r, Eigen::Index c) const
+	{
+		return scale * tex1Dfetch<float>(texture, offset + static_cast<int>(r) * row_stride + static_cast<int>(c) * col_stride);
+	}
+};
+
+// The same view over a texture of the FP32 or FP16 basis. The fetches of the random vertices of the dense term go through the
+// texture cache instead of L1, FP16 elements are promoted to float by the fetch.
+template<>
+struct BasisView<TextureBasis>
+{
+	cudaTextureObject_t texture;
+	int row_stride;
+	int col_stride;
+	float scale;
+	const int* vertex_map;
+
+	__device__ float operator()(int row, int col) const
+	{
+		return scale * tex1Dfetch<float>(texture, row * row_stride + col * col_stride);
+	}
+
+	__device__ int vertexRow(int row) const
+	{
+		return vertex_map ? 3 * vertex_map[row / 3] : row;
+	}
+
+	template<int Cols = Eigen::Dynamic>
+	__device__ auto vertexBlock(int row, int nCols) const
+	{
+		return Eigen::Matrix<float, 3, Cols>::NullaryExpr(3, nCols,
+			TextureBasisBlock{ texture, vertexRow(row) * row_stride, row_stride, col_stride, scale });
+	}
+};
+
+// Coefficient counts of a Jacobian launch. Counts fixed at compile time give the basis blocks a static number of columns, so the
+// writers' column loops are unrolled and zero-sized blocks vanish. Eigen::Dynamic takes the count of JacobianInput.
+template<int kShape = Eigen::Dynamic, int kExpression = Eigen::Dynamic, int kAlbedo = Eigen::Dynamic>
+struct CoefficientCounts
+{
+	static constexpr int kShapeCols = kShape;
+	static constexpr int kExpressionCols = kExpression;
+	static constexpr int kAlbedoCols = kAlbedo;
+
+	__device__ static int shape(const JacobianInput& in) { return kShape != Eigen::Dynamic ? kShape : in.nShapeCoeffs; }
+	__device__ static int expression(const JacobianInput& in) { return kExpression != Eigen::Dynamic ? kExpression : in.nExpressionCoeffs; }
+	__device__ static int albedo(const JacobianInput& in) { return kAlbedo != Eigen::Dynamic ? kAlbedo : in.nAlbedoCoeffs; }
+
+	static bool matches(const JacobianInput& in)
+	{
+		return (kShape == Eigen::Dynamic || kShape == in.nShapeCoeffs) && (kExpression == Eigen::Dynamic || kExpression == in.nExpressionCoeffs) &&
+			(kAlbedo == Eigen::Dynamic || kAlbedo == in.nAlbedoCoeffs);
+	}
+};
+
+// Calls function(counts) with the specialization of the production configurations the input matches: the defaults of
+// SolverParameters, a reduced identity without albedo and a locked identity (see SolverParameters::use_identity_locking).
+// Everything else gets the runtime counts.
+template<typename Function>
+void dispatchCoefficientCounts(const JacobianInput& input, Function function)
+{
+	if (CoefficientCounts<80, 76, 80>::matches(input))
+	{
+		function(CoefficientCounts<80, 76, 80>());
+	}
+	else if (CoefficientCounts<40, 76, 0>::matches(input))
+	{
+		function(CoefficientCounts<40, 76, 0>());
+	}
+	else if (CoefficientCounts<0, 76, 0>::matches(input))
+	{
+		function(CoefficientCounts<0, 76, 0>());
+	}
+	else
+	{
+		function(CoefficientCounts<>());
+	}
+}
+
+template<typename Scalar>
+__device__ BasisView<Scalar> makeBasisView(const JacobianInput& in, const Scalar* data, int nCoeffsTotal, float scale, int nRows,
+	const int* vertex_map = nullptr)
+{
+	return in.vertex_major_basis ? BasisView<Scalar>{ data, nCoeffsTotal, 1, scale, vertex_map } : BasisView<Scalar>{ data, 1, nRows, scale, vertex_map };
+}
+
+__device__ inline BasisView<TextureBasis> makeTextureBasisView(const JacobianInput& in, cudaTextureObject_t texture, int nCoeffsTotal, float scale,
+	int nRows, const int* vertex_map = nullptr)
+{
+	return in.vertex_major_basis ? BasisView<TextureBasis>{ texture, nCoeffsTotal, 1, scale, vertex_map } :
+		BasisView<TextureBasis>{ texture, 1, nRows, scale, vertex_map };
+}
+
+// Calls function(shape_basis, expression_basis, albedo_basis) with the views of the precision in use, or the texture views.
+template<typename Function>
+__device__ void withBasisViews(const JacobianInput& in, Function function)
+{
+	// Uniform for the whole launch, so this doesn't diverge.
+	if (in.shape_basis_texture)
+	{
+		const float shape_scale = in.half_precision_basis ? in.shape_basis_scale : 1.0f;
+		const float expression_scale = in.half_precision_basis ? in.expression_basis_scale : 1.0f;
+		const float albedo_scale = in.half_precision_basis ? in.albedo_basis_scale : 1.0f;
+		function(makeTextureBasisView(in, in.shape_basis_texture, in.nShapeCoeffsTotal, shape_scale, in.nBasisRows, in.p_basis_vertex_map),
+			makeTextureBasisView(in, in.expression_basis_texture, in.nExpressionCoeffsTotal, expression_scale, in.nExpressionBasisRows, in.p_expression_vertex_map),
+			makeTextureBasisView(in, in.albedo_basis_texture, in.nAlbedoCoeffsTotal, albedo_scale, in.nBasisRows, in.p_basis_vertex_map));
+	}
+	else if (in.half_precision_basis)
+	{
+		function(makeBasisView(in, in.p_shape_basis_half, in.nShapeCoeffsTotal, in.shape_basis_scale, in.nBasisRows, in.p_basis_vertex_map),
+			makeBasisView(in, in.p_expression_basis_half, in.nExpressionCoeffsTotal, in.expression_basis_scale, in.nExpressionBasisRows, in.p_expression_vertex_map),
+			makeBasisView(in, in.p_albedo_basis_half, in.nAlbedoCoeffsTotal, in.albedo_basis_scale, in.nBasisRows, in.p_basis_vertex_map));
+	}
+	else
+	{
+		function(makeBasisView<float>(in, in.p_shape_basis, in.nShapeCoeffsTotal, 1.0f, in.nBasisRows, in.p_basis_vertex_map),
+			makeBasisView<float>(in, in.p_expression_basis, in.nExpressionCoeffsTotal, 1.0f, in.nExpressionBasisRows, in.p_expression_vertex_map),
+			makeBasisView<float>(in, in.p_albedo_basis, in.nAlbedoCoeffsTotal, 1.0f, in.nBasisRows, in.p_basis_vertex_map));
 	}
+}
+
+template<typename Block>
+__device__ auto weightedBlock(float weight, const Block& block)
+{
+	return weight * block;
+}
+
+template<typename Derived, typename Block>
+__device__ auto weightedBlock(const Eigen::MatrixBase<Derived>& weight, const Block& block)
+{
+	return weight.lazyProduct(block);
+}
+
+/**
+ * Basis columns of a pixel, weight0 * B(v0) + weight1 * B(v1) + weight2 * B(v2), where B(v) is the 3 x nCols block of vertex v.
+ * The weights are scalars (albedo) or 3 x 3 matrices (shape and expression, through position and shading).
+ * A separate step from Writer::add, so DenseTileWriter can evaluate the products cooperatively instead.
+ */
+template<int Cols, typename Writer, typename Weight, typename Scalar>
+__device__ void addBasisRows(Writer& writer, int row, int col, const Weight& weight0, const Weight& weight1, const Weight& weight2,
+	const BasisView<Scalar>& basis, const int3& vertex_ids, int nCols)
+{
+	writer.add(row, col,
+		weightedBlock(weight0, basis.template vertexBlock<Cols>(3 * vertex_ids.x, nCols)) +
+		weightedBlock(weight1, basis.template vertexBlock<Cols>(3 * vertex_ids.y, nCols)) +
+		weightedBlock(weight2, basis.template vertexBlock<Cols>(3 * vertex_ids.z, nCols)));
+}
+
+/**
+ * Compute Jacobian matrix for parametric model w.r.t fov of virtual camera, Rotation, Translation, α, β, δ, γ
+ * (α, β, δ) are parametric face model Eigen basis scaling factors
+ * γ is illumination model (Spherical harmonics)
+ * 
+ * Optimization energy
+ * P = (intrinsics, pose, α, β, δ, γ)
+ * E(P) = w_col * E_col(P) + w_lan * E_lan(P) + w_reg * E_reg(P)
+ * 
+ * Thread i evaluates the residual rows of the i-th landmark or pixel and passes them to the writer. E_reg has no rows, it is
+ * added to the normal equations directly, see regularizerDiagonal.
+ */
+template<typename Counts, typename Writer, typename Scalar>
+__device__ void computeJacobianRows(const int i, const JacobianInput& in, Writer& writer,
+	const BasisView<Scalar>& shape_basis, const BasisView<Scalar>& expression_basis, const BasisView<Scalar>& albedo_basis)
+{
+
+	const int nShapeCoeffs = Counts::shape(in);
+	const int nExpressionCoeffs = Counts::expression(in);
+	const int nAlbedoCoeffs = Counts::albedo(in);
+	const auto& face_pose = in.face_pose;
+	const auto& projection = in.projection;
+	const auto& jacobian_local = in.jacobian_local;
+	const auto* current_face = in.current_face;
 
 	/*
 	 * Photo-Consistency dense energy term
@@ -115,25 +455,24 @@ __global__ void cuComputeJacobianSparseDense(
 	 *	 C_I is input RGB image
 	 *
 	 */
-	if (i >= nFeatures)
+	if (i >= in.nFeatures)
 	{
-		int offset_rows = nFeatures * 2;
+		const int imageWidth = in.imageWidth;
+		const int imageHeight = in.imageHeight;
+		const uchar* image = in.image;
+		const int current_index = i - in.nFeatures;
+		const int row = in.nFeatures * 2 + current_index * 3;
 
-		const int current_index = i - nFeatures;
-		unsigned int xp = current_index % face_bb.width + face_bb.x_min;
-		unsigned int yp = current_index / face_bb.width + face_bb.y_min;
+		// Only pixels covered by the face are in the list, see cuComputeVisiblePixelsAndBB.
+		const VisiblePixel visible_pixel = in.visible_pixels[current_index];
+		const int xp = visible_pixel.x;
+		const int yp = visible_pixel.y;
 
 		int background_index = 3 * (xp + yp * imageWidth);
-		int ygl = imageHeight - 1 - yp; // "height - 1 - index.y" OpenGL uses left-bottom corner as texture origin.
-		float4 rgb_sampled = tex2D<float4>(rgb, xp, ygl);
-
-		if (rgb_sampled.w < 1.0f) // pixel is not covered by face
-		{
-			return;
-		}
 
-		float4 barycentrics_sampled = tex2D<float4>(barycentrics, xp, ygl);
-		int4 vertex_ids_sampled = tex2D<int4>(vertex_ids, xp, ygl);
+		float4 barycentrics_sampled = visible_pixel.barycentrics_light;
+		int3 vertex_ids_sampled = visible_pixel.vertex_ids;
+		float3 rgb_sampled = visible_pixel.rgb;
 		Eigen::Map<Eigen::Vector3f> face_rgb(reinterpret_cast<float*>(&rgb_sampled));
 		Eigen::Vector3f frame_rgb;
 
@@ -144,9 +483,11 @@ __global__ void cuComputeJacobianSparseDense(
 		Eigen::Vector3f residual = face_rgb - frame_rgb;
 
 		// IRLS with L1 norm.
-		wDense /= glm::sqrt(glm::max(residual.norm(), 1.0e-8f));
+		const float wDense = in.wDense / glm::sqrt(glm::max(residual.norm(), 1.0e-8f));
 
-		residuals.block(offset_rows + current_index * 3, 0, 3, 1) = residual * wDense;
+		writer.setResidual(row, residual.x() * wDense);
+		writer.setResidual(row + 1, residual.y() * wDense);
+		writer.setResidual(row + 2, residual.z() * wDense);
 
 		/*
 		 * Energy derivation
@@ -159,10 +500,11 @@ __global__ void cuComputeJacobianSparseDense(
 		 * Albedo = A(E_alb_A * β) + B(E_alb_B * β) + C(E_alb_C * β) => barycentric coordinates
 		 * dColor/dAlbedo
 		 */
-		jacobian.block(offset_rows + current_index * 3, 7 + nShapeCoeffs + nExpressionCoeffs, 3, nAlbedoCoeffs) =
-			(barycentrics_sampled.w * wDense * barycentrics_sampled.x) * albedo_basis.block(3 * vertex_ids_sampled.x, 0, 3, nAlbedoCoeffs) +
-			(barycentrics_sampled.w * wDense * barycentrics_sampled.y) * albedo_basis.block(3 * vertex_ids_sampled.y, 0, 3, nAlbedoCoeffs) +
-			(barycentrics_sampled.w * wDense * barycentrics_sampled.z) * albedo_basis.block(3 * vertex_ids_sampled.z, 0, 3, nAlbedoCoeffs);
+		addBasisRows<Counts::kAlbedoCols>(writer, row, 7 + nShapeCoeffs + nExpressionCoeffs,
+			barycentrics_sampled.w * wDense * barycentrics_sampled.x,
+			barycentrics_sampled.w * wDense * barycentrics_sampled.y,
+			barycentrics_sampled.w * wDense * barycentrics_sampled.z,
+			albedo_basis, vertex_ids_sampled, nAlbedoCoeffs);
 
 		/*
 		 * Spherical harmonics derivation
@@ -171,19 +513,27 @@ __global__ void cuComputeJacobianSparseDense(
 		 *
 		 * see file /shaders/face.frag computeSH(normal)
 		 */
-		auto number_of_vertices = nVerticesTimes3 / 3;
+		auto number_of_vertices = in.nVerticesTimes3 / 3;
 		auto albedos = current_face + number_of_vertices;
 		auto normals = current_face + 2 * number_of_vertices;
-
-		auto normal_a_unnorm_glm = glm::mat3(face_pose) * normals[vertex_ids_sampled.x];
-		auto normal_b_unnorm_glm = glm::mat3(face_pose) * normals[vertex_ids_sampled.y];
-		auto normal_c_unnorm_glm = glm::mat3(face_pose) * normals[vertex_ids_sampled.z];
-
-		auto normal_a_glm = glm::normalize(normal_a_unnorm_glm);
-		auto normal_b_glm = glm::normalize(normal_b_unnorm_glm);
-		auto normal_c_glm = glm::normalize(normal_c_unnorm_glm);
-
-		auto albedo_glm = barycentrics_sampled.x * albedos[vertex_ids_sampled.x] + barycentrics_sampled.y * albedos[vertex_ids_sampled.y] + barycentrics_sampled.z * albedos[vertex_ids_sampled.z];
+		const float4* aligned_albedos = in.aligned_face ? in.aligned_face + number_of_vertices : nullptr;
+		const float4* aligned_normals = in.aligned_face ? in.aligned_face + 2 * number_of_vertices : nullptr;
+		const glm::vec3 v0 = util::loadVertex(current_face, in.aligned_face, vertex_ids_sampled.x);
+		const glm::vec3 v1 = util::loadVertex(current_face, in.aligned_face, vertex_ids_sampled.y);
+		const glm::vec3 v2 = util::loadVertex(current_face, in.aligned_face, vertex_ids_sampled.z);
+
+		// Rotated and normalized once per vertex, see cuComputeVertexShading.
+		const VertexShading shading_a = in.vertex_shading[vertex_ids_sampled.x];
+		const VertexShading shading_b = in.vertex_shading[vertex_ids_sampled.y];
+		const VertexShading shading_c = in.vertex_shading[vertex_ids_sampled.z];
+
+		const auto& normal_a_glm = shading_a.normal;
+		const auto& normal_b_glm = shading_b.normal;
+		const auto& normal_c_glm = shading_c.normal;
+
+		auto albedo_glm = barycentrics_sampled.x * util::loadVertex(albedos, aligned_albedos, vertex_ids_sampled.x) +
+			barycentrics_sampled.y * util::loadVertex(albedos, aligned_albedos, vertex_ids_sampled.y) +
+			barycentrics_sampled.z * util::loadVertex(albedos, aligned_albedos, vertex_ids_sampled.z);
 		auto normal_unnorm_glm = barycentrics_sampled.x * normal_a_glm + barycentrics_sampled.y * normal_b_glm + barycentrics_sampled.z * normal_c_glm;
 		auto normal_glm = glm::normalize(normal_unnorm_glm);
 
@@ -203,7 +553,10 @@ __global__ void cuComputeJacobianSparseDense(
 		bands(0, 7) = normal_glm.x * normal_glm.z;
 		bands(0, 8) = normal_glm.x * normal_glm.x - normal_glm.y * normal_glm.y;
 
-		jacobian.block<3, 9>(offset_rows + current_index * 3, 7 + nShapeCoeffs + nExpressionCoeffs + nAlbedoCoeffs) = wDense * albedo * bands;
+		if (in.nSHCoeffs > 0)
+		{
+			writer.add(row, 7 + nShapeCoeffs + nExpressionCoeffs + nAlbedoCoeffs, (wDense * albedo * bands).eval());
+		}
 
 		/* 
 		 * Expression and shape derivations
@@ -218,7 +571,7 @@ __global__ void cuComputeJacobianSparseDense(
 		 * dColor/dα = dColor/dSH * dSH/dNormal * dNormal/dNormalize() * dNormalize/dCross() * dCross()/d{(B - A), (C - A), A}
 		 */
 		Eigen::Matrix<float, 1, 3> dlight_dnormal;
-		jacobian_util::computeDLightDNormal(dlight_dnormal, normal_glm, p_coefficients_sh);
+		jacobian_util::computeDLightDNormal(dlight_dnormal, normal_glm, in.p_coefficients_sh);
 
 		Eigen::Matrix<float, 3, 3> dnormal_dunnormnormal;
 		jacobian_util::computeNormalizationJacobian(dnormal_dunnormnormal, normal_unnorm_glm);
@@ -229,53 +582,30 @@ __global__ void cuComputeJacobianSparseDense(
 		Eigen::Matrix<float, 3, 3> v1_jacobian;
 		Eigen::Matrix<float, 3, 3> v2_jacobian;
 
-		jacobian_util::computeNormalJacobian(v0_jacobian, v1_jacobian, v2_jacobian,
-			current_face[vertex_ids_sampled.x], current_face[vertex_ids_sampled.y], current_face[vertex_ids_sampled.z]);
+		jacobian_util::computeNormalJacobian(v0_jacobian, v1_jacobian, v2_jacobian, v0, v1, v2);
 
 		unnormnormal_jacobian = wDense * unnormnormal_jacobian * jacobian_local;
 		v0_jacobian = unnormnormal_jacobian * v0_jacobian;
 		v1_jacobian = unnormnormal_jacobian * v1_jacobian;
 		v2_jacobian = unnormnormal_jacobian * v2_jacobian;
 
-		// dColor/dα
-		jacobian.block(offset_rows + current_index * 3, 7, 3, nShapeCoeffs) =
-			v0_jacobian * shape_basis.block(3 * vertex_ids_sampled.x, 0, 3, nShapeCoeffs) +
-			v1_jacobian * shape_basis.block(3 * vertex_ids_sampled.y, 0, 3, nShapeCoeffs) +
-			v2_jacobian * shape_basis.block(3 * vertex_ids_sampled.z, 0, 3, nShapeCoeffs);
-
-		// dColor/dδ
-		jacobian.block(offset_rows + current_index * 3, 7 + nShapeCoeffs, 3, nExpressionCoeffs) =
-			v0_jacobian * expression_basis.block(3 * vertex_ids_sampled.x, 0, 3, nExpressionCoeffs) +
-			v1_jacobian * expression_basis.block(3 * vertex_ids_sampled.y, 0, 3, nExpressionCoeffs) +
-			v2_jacobian * expression_basis.block(3 * vertex_ids_sampled.z, 0, 3, nExpressionCoeffs);
-
-		Eigen::Matrix<float, 3, 3> dnormal_dunnormnormal_sum = Eigen::MatrixXf::Zero(3, 3);
-
-		// For 1st vertex normal
-		jacobian_util::computeNormalizationJacobian(dnormal_dunnormnormal, normal_a_unnorm_glm);
-		dnormal_dunnormnormal_sum += barycentrics_sampled.x * dnormal_dunnormnormal;
-
-		// For 2nd vertex normal
-		jacobian_util::computeNormalizationJacobian(dnormal_dunnormnormal, normal_b_unnorm_glm);
-		dnormal_dunnormnormal_sum += barycentrics_sampled.y * dnormal_dunnormnormal;
-
-		// For 3rd vertex normal
-		jacobian_util::computeNormalizationJacobian(dnormal_dunnormnormal, normal_c_unnorm_glm);
-		dnormal_dunnormnormal_sum += barycentrics_sampled.z * dnormal_dunnormnormal;
+		// Normalization Jacobians of the three vertex normals, blended like the normals themselves.
+		Eigen::Matrix<float, 3, 3> dnormal_dunnormnormal_sum =
+			barycentrics_sampled.x * Eigen::Map<const Eigen::Matrix3f>(shading_a.dnormal) +
+			barycentrics_sampled.y * Eigen::Map<const Eigen::Matrix3f>(shading_b.dnormal) +
+			barycentrics_sampled.z * Eigen::Map<const Eigen::Matrix3f>(shading_c.dnormal);
 
 		Eigen::Matrix<float, 3, 3> jacobian_rotation;
 
-		auto dx = drx * normals[vertex_ids_sampled.x];
-		auto dy = dry * normals[vertex_ids_sampled.y];
-		auto dz = drz * normals[vertex_ids_sampled.z];
+		auto dx = in.drx * util::loadVertex(normals, aligned_normals, vertex_ids_sampled.x);
+		auto dy = in.dry * util::loadVertex(normals, aligned_normals, vertex_ids_sampled.y);
+		auto dz = in.drz * util::loadVertex(normals, aligned_normals, vertex_ids_sampled.z);
 
 		jacobian_rotation <<
 			dx[0], dy[0], dz[0],
 			dx[1], dy[1], dz[1],
 			dx[2], dy[2], dz[2];
 
-		jacobian.block<3, 3>(offset_rows + current_index * 3, 1) = unnormnormal_jacobian * dnormal_dunnormnormal_sum * jacobian_rotation * wDense;
-
 		/* 
 		 * Energy derivation
 		 * -dE/dC_I
@@ -285,37 +615,30 @@ __global__ void cuComputeJacobianSparseDense(
 		 */
 
 		// Take into account barycentric interpolation in the fragment shader for vertices and their attributes
-		auto local_coord = 
-			barycentrics_sampled.x * current_face[vertex_ids_sampled.x] +
-			barycentrics_sampled.y * current_face[vertex_ids_sampled.y] +
-			barycentrics_sampled.z * current_face[vertex_ids_sampled.z];
+		auto local_coord = barycentrics_sampled.x * v0 + barycentrics_sampled.y * v1 + barycentrics_sampled.z * v2;
 
 		auto world_coord = face_pose * glm::vec4(local_coord, 1.0f);
 		auto proj_coord = projection * world_coord;
 
 		// Derivative of source image (screen coordinate system) with respect to (u,v)
-		// TODO: Check for boundary for xp and yp
 		Eigen::Matrix<float, 3, 2> jacobian_uv;
 
-		int background_index_left = 3 * (xp - 1 + yp * imageWidth);
-		int background_index_right = 3 * (xp + 1 + yp * imageWidth);
-		int background_index_up = 3 * (xp + (yp - 1) * imageWidth);
-		int background_index_down = 3 * (xp + (yp + 1) * imageWidth);
-
 		/*
-		 * Central difference derivation for color ([c(i+1)-c(i-1)]/2p) with viewport transformation derivation
-		 * Color => Screen => NDC
+		 * Smoothed central difference per pixel, precomputed once per frame by the pyramid (clamped at the borders),
+		 * with viewport transformation derivation: Color => Screen => NDC
 		 */
+		const float4 gradient_x = tex2D<float4>(in.image_gradient_x, xp + 0.5f, yp + 0.5f);
+		const float4 gradient_y = tex2D<float4>(in.image_gradient_y, xp + 0.5f, yp + 0.5f);
 
 		// dColor/du
-		jacobian_uv(0, 0) = -(image[background_index_right] / 255.0f - image[background_index_left] / 255.0f) * 0.25f * imageWidth;
-		jacobian_uv(1, 0) = -(image[background_index_right + 1] / 255.0f - image[background_index_left + 1] / 255.0f) *  0.25f * imageWidth;
-		jacobian_uv(2, 0) = -(image[background_index_right + 2] / 255.0f - image[background_index_left + 2] / 255.0f) *  0.25f * imageWidth;
+		jacobian_uv(0, 0) = -gradient_x.x * 0.5f * imageWidth;
+		jacobian_uv(1, 0) = -gradient_x.y * 0.5f * imageWidth;
+		jacobian_uv(2, 0) = -gradient_x.z * 0.5f * imageWidth;
 
 		// dColor/dv
-		jacobian_uv(0, 1) = (image[background_index_down] / 255.0f - image[background_index_up] / 255.0f) *  0.25f  * imageHeight;
-		jacobian_uv(1, 1) = (image[background_index_down + 1] / 255.0f - image[background_index_up + 1] / 255.0f) *  0.25f  * imageHeight;
-		jacobian_uv(2, 1) = (image[background_index_down + 2] / 255.0f - image[background_index_up + 2] / 255.0f) *  0.25f  * imageHeight;
+		jacobian_uv(0, 1) = gradient_y.x * 0.5f * imageHeight;
+		jacobian_uv(1, 1) = gradient_y.y * 0.5f * imageHeight;
+		jacobian_uv(2, 1) = gradient_y.z * 0.5f * imageHeight;
 
 		// Jacobian for homogenization (AKA division by w)
 		// NCD => Clip coordinates
@@ -352,7 +675,7 @@ __global__ void cuComputeJacobianSparseDense(
 		Eigen::Matrix<float, 3, 1> jacobian_intrinsics = Eigen::MatrixXf::Zero(3, 1);
 
 		jacobian_intrinsics(0, 0) = world_coord.x;
-		jacobian.block<3, 1>(offset_rows + current_index * 3, 0) = jacobian_uv * jacobian_proj * jacobian_intrinsics * wDense;
+		writer.add(row, 0, (jacobian_uv * jacobian_proj * jacobian_intrinsics * wDense).eval());
 
 		/*
 		 * Derivative of world coordinates with respect to rotation coefficients
@@ -362,9 +685,9 @@ __global__ void cuComputeJacobianSparseDense(
 		 * X_world = R * X_local + T
 		 * dX_world/dR and dX_world/dT
 		 */
-		dx = drx * local_coord;
-		dy = dry * local_coord;
-		dz = drz * local_coord;
+		dx = in.drx * local_coord;
+		dy = in.dry * local_coord;
+		dz = in.drz * local_coord;
 
 		Eigen::Matrix<float, 3, 6> jacobian_pose = Eigen::MatrixXf::Zero(3, 6);
 
@@ -383,7 +706,10 @@ __global__ void cuComputeJacobianSparseDense(
 
 		auto jacobian_proj_world = jacobian_uv * jacobian_proj * jacobian_world;
 
-		jacobian.block<3, 6>(offset_rows + current_index * 3, 1) += jacobian_proj_world * jacobian_pose * wDense;
+		// Pose columns get both the geometric term and the rotated normals' term of the shading.
+		Eigen::Matrix<float, 3, 6> jacobian_pose_total = jacobian_proj_world * jacobian_pose * wDense;
+		jacobian_pose_total.block<3, 3>(0, 0) += unnormnormal_jacobian * dnormal_dunnormnormal_sum * jacobian_rotation * wDense;
+		writer.add(row, 1, jacobian_pose_total);
 
 		/*
 		 * Derivative of world coordinates with respect to local coordinates.
@@ -391,18 +717,19 @@ __global__ void cuComputeJacobianSparseDense(
 		 * X_world = R * X_local + T
 		 * dX_world/dX_local = R
 		 */
-		auto jacobian_proj_world_local = jacobian_proj_world * jacobian_local * wDense;
+		Eigen::Matrix<float, 3, 3> jacobian_proj_world_local = jacobian_proj_world * jacobian_local * wDense;
+
+		// Shading (through the normals) and position contributions of each vertex are merged before touching the basis,
+		// so every basis row is gathered only once.
+		Eigen::Matrix<float, 3, 3> v0_total = v0_jacobian + jacobian_proj_world_local * barycentrics_sampled.x;
+		Eigen::Matrix<float, 3, 3> v1_total = v1_jacobian + jacobian_proj_world_local * barycentrics_sampled.y;
+		Eigen::Matrix<float, 3, 3> v2_total = v2_jacobian + jacobian_proj_world_local * barycentrics_sampled.z;
 
-		// Derivative of local coordinates with respect to shape and expression parameters
-		jacobian.block(offset_rows + current_index * 3, 7, 3, nShapeCoeffs) +=
-			(jacobian_proj_world_local * barycentrics_sampled.x) * shape_basis.block(3 * vertex_ids_sampled.x, 0, 3, nShapeCoeffs) +
-			(jacobian_proj_world_local * barycentrics_sampled.y) * shape_basis.block(3 * vertex_ids_sampled.y, 0, 3, nShapeCoeffs) +
-			(jacobian_proj_world_local * barycentrics_sampled.z) * shape_basis.block(3 * vertex_ids_sampled.z, 0, 3, nShapeCoeffs);
+		// dColor/dα
+		addBasisRows<Counts::kShapeCols>(writer, row, 7, v0_total, v1_total, v2_total, shape_basis, vertex_ids_sampled, nShapeCoeffs);
 
-		jacobian.block(offset_rows + current_index * 3, 7 + nShapeCoeffs, 3, nExpressionCoeffs) +=
-			(jacobian_proj_world_local * barycentrics_sampled.x) * expression_basis.block(3 * vertex_ids_sampled.x, 0, 3, nExpressionCoeffs) +
-			(jacobian_proj_world_local * barycentrics_sampled.y) * expression_basis.block(3 * vertex_ids_sampled.y, 0, 3, nExpressionCoeffs) +
-			(jacobian_proj_world_local * barycentrics_sampled.z) * expression_basis.block(3 * vertex_ids_sampled.z, 0, 3, nExpressionCoeffs);
+		// dColor/dδ
+		addBasisRows<Counts::kExpressionCols>(writer, row, 7 + nShapeCoeffs, v0_total, v1_total, v2_total, expression_basis, vertex_ids_sampled, nExpressionCoeffs);
 
 		return;
 	}
@@ -414,18 +741,19 @@ __global__ void cuComputeJacobianSparseDense(
 	 * E = sum(l2_norm(f - Π(Φ(local_coord))^2)
 	 * where Π(Φ()) is full perspective projection
 	 */
-	auto vertex_id = prior_local_ids[i];
-	auto local_coord = current_face[vertex_id];
+	const float wSparse = in.sparse_weights ? in.wSparse * in.sparse_weights[i] : in.wSparse;
+	auto vertex_id = in.prior_local_ids[i];
+	auto local_coord = util::loadVertex(current_face, in.aligned_face, vertex_id);
 
 	auto world_coord = face_pose * glm::vec4(local_coord, 1.0f);
 	auto proj_coord = projection * world_coord;
 	auto uv = glm::vec2(proj_coord.x, proj_coord.y) / proj_coord.w;
 
 	// Residual
-	auto residual = uv - sparse_features[i];
+	auto residual = uv - in.sparse_features[i];
 
-	residuals(i * 2) = residual.x * wSparse;
-	residuals(i * 2 + 1) = residual.y * wSparse;
+	writer.setResidual(i * 2, residual.x * wSparse);
+	writer.setResidual(i * 2 + 1, residual.y * wSparse);
 
 	// Jacobians follow the same description like in the case of dense features
 
@@ -452,12 +780,12 @@ __global__ void cuComputeJacobianSparseDense(
 	Eigen::Matrix<float, 3, 1> jacobian_intrinsics = Eigen::MatrixXf::Zero(3, 1);
 
 	jacobian_intrinsics(0, 0) = world_coord.x;
-	jacobian.block<2, 1>(i * 2, 0) = jacobian_proj * jacobian_intrinsics * wSparse;
+	writer.add(i * 2, 0, (jacobian_proj * jacobian_intrinsics * wSparse).eval());
 
 	// Derivative of world coordinates with respect to rotation coefficients
-	auto dx = drx * local_coord;
-	auto dy = dry * local_coord;
-	auto dz = drz * local_coord;
+	auto dx = in.drx * local_coord;
+	auto dy = in.dry * local_coord;
+	auto dz = in.drz * local_coord;
 
 	Eigen::Matrix<float, 3, 6> jacobian_pose = Eigen::MatrixXf::Zero(3, 6);
 
@@ -474,185 +802,1959 @@ __global__ void cuComputeJacobianSparseDense(
 	jacobian_pose(1, 2) = dz[1];
 	jacobian_pose(2, 2) = dz[2];
 
-	auto jacobian_proj_world = jacobian_proj * jacobian_world * wSparse;
-	jacobian.block<2, 6>(i * 2, 1) = jacobian_proj_world * jacobian_pose;
+	Eigen::Matrix<float, 2, 3> jacobian_proj_world = jacobian_proj * jacobian_world * wSparse;
+	writer.add(i * 2, 1, (jacobian_proj_world * jacobian_pose).eval());
 
 	// Derivative of world coordinates with respect to local coordinates.
 	// This is basically the rotation matrix.
-	auto jacobian_proj_world_local = jacobian_proj_world * jacobian_local;
+	Eigen::Matrix<float, 2, 3> jacobian_proj_world_local = jacobian_proj_world * jacobian_local;
 
 	// Derivative of local coordinates with respect to shape and expression parameters
 	// This is basically the corresponding (to unique vertices we have chosen) rows of basis matrices.
-	auto jacobian_shape = jacobian_proj_world_local * shape_basis.block(3 * vertex_id, 0, 3, nShapeCoeffs);
-	jacobian.block(i * 2, 7, 2, nShapeCoeffs) = jacobian_shape;
-
-	auto jacobian_expression = jacobian_proj_world_local * expression_basis.block(3 * vertex_id, 0, 3, nExpressionCoeffs);
-	jacobian.block(i * 2, 7 + nShapeCoeffs, 2, nExpressionCoeffs) = jacobian_expression;
+	// Read from the contiguous landmark copies, row 3 * i belongs to landmark i.
+	const BasisView<float> landmark_shape_basis{ in.p_landmark_shape_basis, in.nShapeCoeffsTotal, 1, 1.0f, nullptr };
+	const BasisView<float> landmark_expression_basis{ in.p_landmark_expression_basis, in.nExpressionCoeffsTotal, 1, 1.0f, nullptr };
+	writer.add(i * 2, 7, jacobian_proj_world_local.lazyProduct(landmark_shape_basis.template vertexBlock<Counts::kShapeCols>(3 * i, nShapeCoeffs)));
+	writer.add(i * 2, 7 + nShapeCoeffs, jacobian_proj_world_local.lazyProduct(
+		landmark_expression_basis.template vertexBlock<Counts::kExpressionCols>(3 * i, nExpressionCoeffs)));
 }
 
-__global__ void cuComputeVisiblePixelsAndBB(cudaTextureObject_t texture, FaceBoundingBox* face_bb, int width, int height)
+template<typename Counts = CoefficientCounts<>, typename Writer>
+__device__ void computeJacobianRows(const int i, const JacobianInput& in, Writer& writer)
 {
-	auto index = util::getThreadIndex2D();
-	if (index.x >= width || index.y >= height)
+	withBasisViews(in, [&](const auto& shape_basis, const auto& expression_basis, const auto& albedo_basis)
 	{
-		return;
-	}
+		computeJacobianRows<Counts>(i, in, writer, shape_basis, expression_basis, albedo_basis);
+	});
+}
 
-	int y = height - 1 - index.y; // "height - 1 - index.y" is used since OpenGL uses left-bottom corner as texture origin.
-	float4 color = tex2D<float4>(texture, index.x, y);
+// One residual type per kernel, so the branches in computeJacobianRows are uniform within every warp.
+template<typename Counts, typename Writer>
+__global__ void cuComputeJacobianSparse(JacobianInput input, Writer writer)
+{
+	int i = util::getThreadIndex1D();
 
-	if (color.w > 0.0f)
+	if (i >= input.nFeatures)
 	{
-		atomicInc(&face_bb->num_visible_pixels, UINT32_MAX);
-		atomicMin(&face_bb->x_min, index.x);
-		atomicMin(&face_bb->y_min, index.y);
-		atomicMax(&face_bb->x_max, index.x);
-		atomicMax(&face_bb->y_max, index.y);
+		return;
 	}
+
+	computeJacobianRows<Counts>(i, input, writer);
 }
 
-FaceBoundingBox GaussNewtonSolver::computeFaceBoundingBox(const int imageWidth, const int imageHeight)
+template<typename Counts, typename Writer>
+__global__ void cuComputeJacobianDense(JacobianInput input, Writer writer)
 {
-	FaceBoundingBox bb;
-	util::copy(m_face_bb, &bb, 1);
-
-	//TODO: Arrange this (16,16) according to TitanX when we use it.
-	dim3 threads_meta(16, 16);
-	dim3 blocks_meta(imageWidth / threads_meta.x + 1, imageHeight / threads_meta.y + 1);
-
-	cuComputeVisiblePixelsAndBB << <blocks_meta, threads_meta >> > (m_texture_rgb, m_face_bb.getPtr(), imageWidth, imageHeight);
-
-	util::copy(&bb, m_face_bb, 1);
-	//std::cout << bb.num_visible_pixels << " " << bb.x_min << " " << bb.y_min << " " << bb.x_max << " " << bb.y_max << std::endl;
+	int i = util::getThreadIndex1D();
 
-	if (bb.num_visible_pixels <= 0 || bb.x_min >= bb.x_max || bb.y_min >= bb.y_max)
+	if (i >= input.nPixels)
 	{
-		std::cout << "Warning: invalid face bounding box!" << std::endl;
+		return;
 	}
 
-	bb.width = bb.x_max - bb.x_min;
-	bb.height = bb.y_max - bb.y_min;
-
-	return bb;
+	computeJacobianRows<Counts>(input.nFeatures + i, input, writer);
 }
 
-void GaussNewtonSolver::computeJacobian(
-	//shared memory
-	const FaceBoundingBox face_bb,
-	const int nFeatures, const int imageWidth, const int imageHeight,
-	const int nShapeCoeffs, const int nExpressionCoeffs, const int nAlbedoCoeffs,
-	const int nUnknowns, const int nResiduals,
-	const int nVerticesTimes3, const int nShapeCoeffsTotal, const int nExpressionCoeffsTotal, const int nAlbedoCoeffsTotal, const int nShcoeffsTotal,
-	float sparseWeight, float denseWeight, float regularizationWeight,
-
-	uchar* image,
-
-	const glm::mat4& face_pose, const glm::mat3& drx, const glm::mat3& dry, const glm::mat3& drz, const glm::mat4& projection, const Eigen::Matrix3f& jacobian_local,
-
-	//device memory input
-	int* prior_local_ids, glm::vec3* current_face, glm::vec2* sparse_features,
-
-	float* p_shape_basis,
-	float* p_expression_basis,
-	float* p_albedo_basis,
-
-	float* p_coefficients_shape,
-	float* p_coefficients_expression,
-	float* p_coefficients_albedo,
-	float* p_coefficients_sh,
+/**
+ * Warp-cooperative dense term for vertex-major bases. A warp owns 32 consecutive pixels, i.e. 96 consecutive Jacobian rows.
+ * First every lane evaluates its pixel as cuComputeJacobianDense does, except for the basis columns, of which only the weights
+ * and vertex ids are kept. Then the warp takes the pixels one after the other and the lanes split the coefficient columns,
+ * so each basis row is a single coalesced load. A column-major Jacobian gets the tile transposed, a column of 96 contiguous rows
+ * at a time, a row-major one is written by the lanes directly.
+ * The grid is pixels x column tiles: blockIdx.y takes kDenseColumnTile of the basis columns (shape, expression, albedo in a row),
+ * so the serial column loop of a warp doesn't grow with the coefficients and more blocks are resident. Every column tile
+ * evaluates the chain rule of its pixels again, only the first one writes the other columns and the residuals.
+ */
+const int kDenseTileWarps = 2;
+const int kDenseColumnTile = 64;
 
-	//device memory output
-	float* p_jacobian, float* p_residuals
-) const
+struct DensePixelTile
 {
-	const int nPixels = face_bb.width * face_bb.height;
-
-	const int nFaceCoeffs = nShapeCoeffs + nExpressionCoeffs + nAlbedoCoeffs;
-	const int n = nFeatures + nPixels + nFaceCoeffs;
-
-	//TODO: Fine tune these configs according to TitanX in the end.
-	const int threads = 128;
-	const int block = (n + threads - 1) / threads;
-
-	auto time = util::runKernelGetExecutionTime([&]() {cuComputeJacobianSparseDense << <block, threads >> > (
-		//shared memory
-		face_bb,
-		nFeatures, imageWidth, imageHeight,
-		nFaceCoeffs, nPixels, n,
-		nShapeCoeffs, nExpressionCoeffs, nAlbedoCoeffs,
-		nUnknowns, nResiduals,
-		nVerticesTimes3, nShapeCoeffsTotal, nExpressionCoeffsTotal, nAlbedoCoeffsTotal,
-		glm::sqrt(sparseWeight / nFeatures), glm::sqrt(denseWeight / face_bb.num_visible_pixels), glm::sqrt(regularizationWeight),
-
-		image,
-
-		face_pose, drx, dry, drz, projection, jacobian_local,
-
-		//device memory input
-		prior_local_ids, current_face, sparse_features,
+	float geometry_weights[32][27]; // v0, v1, v2 weights of shape and expression, 3 x 3 column-major each
+	float albedo_weights[32][3];
+	int3 vertex_ids[32];
+	float jacobian[96][33]; // rows x 32 columns, padded against bank conflicts
+};
+
+// Writes everything except the basis columns, those are recorded in the lane's slot of the tile. Only the first column tile
+// writes ("write_rows"), the others just record.
+template<typename Entry>
+struct DenseTileWriter
+{
+	StoredJacobianWriter<Entry> dense;
+	DensePixelTile* tile;
+	int lane;
+	bool write_rows;
 
-		p_shape_basis,
-		p_expression_basis,
-		p_albedo_basis,
+	__device__ void setResidual(int row, float value)
+	{
+		if (write_rows)
+		{
+			dense.setResidual(row, value);
+		}
+	}
 
-		p_coefficients_shape,
-		p_coefficients_expression,
-		p_coefficients_albedo,
-		p_coefficients_sh,
+	template<typename Derived>
+	__device__ void add(int row, int col, const Eigen::MatrixBase<Derived>& block)
+	{
+		if (write_rows)
+		{
+			dense.add(row, col, block);
+		}
+	}
+};
 
-		m_texture_rgb,
-		m_texture_barycentrics,
-		m_texture_vertex_ids,
+// Shape and expression share the weights, so recording them twice does no harm.
+template<int Cols, typename Entry, typename Scalar>
+__device__ void addBasisRows(DenseTileWriter<Entry>& writer, int row, int col, const Eigen::Matrix3f& weight0, const Eigen::Matrix3f& weight1, const Eigen::Matrix3f& weight2,
+	const BasisView<Scalar>& basis, const int3& vertex_ids, int nCols)
+{
+	float* weights = writer.tile->geometry_weights[writer.lane];
+	Eigen::Map<Eigen::Matrix3f>(weights) = weight0;
+	Eigen::Map<Eigen::Matrix3f>(weights + 9) = weight1;
+	Eigen::Map<Eigen::Matrix3f>(weights + 18) = weight2;
+	writer.tile->vertex_ids[writer.lane] = vertex_ids;
+}
 
-		//device memory output
-		p_jacobian, p_residuals
-		);
-	});
+template<int Cols, typename Entry, typename Scalar>
+__device__ void addBasisRows(DenseTileWriter<Entry>& writer, int row, int col, const float& weight0, const float& weight1, const float& weight2,
+	const BasisView<Scalar>& basis, const int3& vertex_ids, int nCols)
+{
+	float* weights = writer.tile->albedo_weights[writer.lane];
+	weights[0] = weight0;
+	weights[1] = weight1;
+	weights[2] = weight2;
+	writer.tile->vertex_ids[writer.lane] = vertex_ids;
+}
 
-	std::cout << "Jacobian kernel time: " << time << std::endl;
+// The columns [begin, end) of the basis, clamped to its nCols.
+template<typename Entry, typename Scalar>
+__device__ void writeTiledBasisColumns(DensePixelTile& tile, int lane, int nTilePixels, const StoredJacobianWriter<Entry>& writer, int first_row, int first_col,
+	const BasisView<Scalar>& basis, int nCols, int begin, int end, bool albedo)
+{
+	// Row-major rows are contiguous in the columns already, so the lanes store straight away. Column-major goes through the tile.
+	const bool row_major = writer.col_stride == 1;
+	begin = max(begin, 0);
+	end = min(end, nCols);
+	for (int col_begin = begin; col_begin < end; col_begin += 32)
+	{
+		const int col = col_begin + lane;
+		for (int p = 0; p < nTilePixels; ++p)
+		{
+			Eigen::Vector3f value = Eigen::Vector3f::Zero();
+			if (col < end)
+			{
+				const int3 ids = tile.vertex_ids[p];
+				const int vertices[3] = { ids.x, ids.y, ids.z };
+				for (int k = 0; k < 3; ++k)
+				{
+					const int row = basis.vertexRow(3 * vertices[k]);
+					const Eigen::Vector3f basis_column(basis(row, col), basis(row + 1, col), basis(row + 2, col));
+					if (albedo)
+					{
+						value += tile.albedo_weights[p][k] * basis_column;
+					}
+					else
+					{
+						value += Eigen::Map<const Eigen::Matrix3f>(tile.geometry_weights[p] + 9 * k) * basis_column;
+					}
+				}
+			}
+
+			if (!row_major)
+			{
+				tile.jacobian[3 * p][lane] = value.x();
+				tile.jacobian[3 * p + 1][lane] = value.y();
+				tile.jacobian[3 * p + 2][lane] = value.z();
+			}
+			else if (col < end)
+			{
+				writer.set(first_row + 3 * p, first_col + col, value.x());
+				writer.set(first_row + 3 * p + 1, first_col + col, value.y());
+				writer.set(first_row + 3 * p + 2, first_col + col, value.z());
+			}
+		}
 
-	cudaDeviceSynchronize();
+		if (!row_major)
+		{
+			__syncwarp();
+			const int nTileCols = min(32, end - col_begin);
+			for (int c = 0; c < nTileCols; ++c)
+			{
+				Entry* destination = &writer.at(first_row, first_col + col_begin + c);
+				for (int r = lane; r < 3 * nTilePixels; r += 32)
+				{
+					storeEntry(destination[r], tile.jacobian[r][c]);
+				}
+			}
+			__syncwarp();
+		}
+	}
 }
 
-__global__ void cuComputeJTJDiagonals(const int nUnknowns, const int nCurrentResiduals, const int nResiduals, float* jacobian, float* preconditioner)
+template<typename Entry>
+__global__ void __launch_bounds__(32 * kDenseTileWarps) cuComputeJacobianDenseTiled(JacobianInput input, StoredJacobianWriter<Entry> writer)
 {
-	int tid = threadIdx.x;
-	int col = blockIdx.x;
+	__shared__ DensePixelTile tiles[kDenseTileWarps];
 
-	float sum = 0.0f;
-	for (int row = tid; row < nCurrentResiduals; row += blockDim.x)
+	const int warp = threadIdx.x / 32;
+	const int lane = threadIdx.x % 32;
+	const int first_pixel = (blockIdx.x * kDenseTileWarps + warp) * 32;
+	if (first_pixel >= input.nPixels)
 	{
-		auto v = jacobian[col * nResiduals + row];
-		sum += v * v;
+		return;
 	}
 
-	atomicAdd(&preconditioner[col], sum);
+	DensePixelTile& tile = tiles[warp];
+	const int nTilePixels = min(32, input.nPixels - first_pixel);
+	if (lane < nTilePixels)
+	{
+		DenseTileWriter<Entry> tile_writer{ writer, &tile, lane, blockIdx.y == 0 };
+		computeJacobianRows(input.nFeatures + first_pixel + lane, input, tile_writer);
+	}
+	__syncwarp();
+
+	// The column tile in the columns of each basis.
+	const int tile_begin = blockIdx.y * kDenseColumnTile;
+	const int tile_end = tile_begin + kDenseColumnTile;
+	const int expression_shift = input.nShapeCoeffs;
+	const int albedo_shift = input.nShapeCoeffs + input.nExpressionCoeffs;
+	const int first_row = input.nFeatures * 2 + first_pixel * 3;
+	withBasisViews(input, [&](const auto& shape_basis, const auto& expression_basis, const auto& albedo_basis)
+	{
+		writeTiledBasisColumns(tile, lane, nTilePixels, writer, first_row, 7, shape_basis, input.nShapeCoeffs, tile_begin, tile_end, false);
+		writeTiledBasisColumns(tile, lane, nTilePixels, writer, first_row, 7 + expression_shift, expression_basis, input.nExpressionCoeffs,
+			tile_begin - expression_shift, tile_end - expression_shift, false);
+		writeTiledBasisColumns(tile, lane, nTilePixels, writer, first_row, 7 + albedo_shift, albedo_basis, input.nAlbedoCoeffs,
+			tile_begin - albedo_shift, tile_end - albedo_shift, true);
+	});
 }
 
-__global__ void cuElementwiseMultiplication(float* v1, float* v2, float* out)
+// Rows of the residual threads [thread_begin, thread_end) only.
+template<typename Counts>
+__global__ void cuComputeJacobianChunk(JacobianInput input, DenseJacobianWriter writer, int thread_begin, int thread_end)
 {
-	int i = util::getThreadIndex1D();
-	out[i] = v1[i] * v2[i];
-}
+	int i = thread_begin + util::getThreadIndex1D();
 
-__global__ void cuOneOverElement(float* preconditioner)
-{
-	int i = util::getThreadIndex1D();
+	if (i >= thread_end)
+	{
+		return;
+	}
 
-	preconditioner[i] = 1.0f / glm::max(preconditioner[i], 1.0e-4f);
+	computeJacobianRows<Counts>(i, input, writer);
 }
 
-void GaussNewtonSolver::computeJacobiPreconditioner(const int nUnknowns, const int nCurrentResiduals, const int nResiduals, float* jacobian, float* preconditioner)
+/**
+ * Persistent blocks (SolverParameters::use_persistent_threads). The block takes tiles of blockDim.x residual threads from
+ * the queue until all of them are taken, so a block which got cheap tiles takes more. queue[0] is the first thread of the
+ * next tile, queue[1] counts the finished blocks. The last block resets both, so the next launch starts from zero.
+ * Without a queue every thread evaluates its own residual, as in a flat launch.
+ */
+template<typename Function>
+__device__ void forEachQueuedResidual(int n, unsigned int* queue, Function function)
 {
-	cuComputeJTJDiagonals << <nUnknowns, 128 >> > (nUnknowns, nCurrentResiduals, nResiduals, jacobian, preconditioner);
-	cudaDeviceSynchronize();
+	if (!queue)
+	{
+		const int i = util::getThreadIndex1D();
+		if (i < n)
+		{
+			function(i);
+		}
+		return;
+	}
+
+	__shared__ unsigned int tile_begin;
+	while (true)
+	{
+		if (threadIdx.x == 0)
+		{
+			tile_begin = atomicAdd(&queue[0], blockDim.x);
+		}
+		__syncthreads();
+		const unsigned int begin = tile_begin;
+		__syncthreads();
+		if (begin >= static_cast<unsigned int>(n))
+		{
+			break;
+		}
+		if (begin + threadIdx.x < n)
+		{
+			function(begin + threadIdx.x);
+		}
+	}
+
+	if (threadIdx.x == 0)
+	{
+		__threadfence();
+		if (atomicAdd(&queue[1], 1u) == gridDim.x - 1)
+		{
+			queue[0] = 0;
+			queue[1] = 0;
+		}
+	}
+}
+
+// Residuals, r = alpha * J^T * f and diag(J^T * J) without materializing J.
+__global__ void cuComputeRhsAndJTJDiagonalsMatrixFree(JacobianInput input, float alpha, float* residuals, float* rhs, float* jtj_diagonals,
+	unsigned int* queue)
+{
+	extern __shared__ float shared_accumulator[];
+	clearSharedAccumulator(shared_accumulator, 2 * input.nUnknowns);
+
+	RhsAndDiagonalWriter writer{ residuals, shared_accumulator, input.nUnknowns, alpha };
+	forEachQueuedResidual(input.n, queue, [&](int i)
+	{
+		computeJacobianRows(i, input, writer);
+	});
+
+	__syncthreads();
+	for (int j = threadIdx.x; j < input.nUnknowns; j += blockDim.x)
+	{
+		atomicAdd(&rhs[j], shared_accumulator[j]);
+		atomicAdd(&jtj_diagonals[j], shared_accumulator[input.nUnknowns + j]);
+	}
+}
+
+__global__ void cuComputeRhs(JacobianInput input, float alpha, float* residuals, float* rhs, unsigned int* queue)
+{
+	extern __shared__ float shared_accumulator[];
+	clearSharedAccumulator(shared_accumulator, input.nUnknowns);
+
+	RhsWriter writer{ residuals, shared_accumulator, alpha };
+	forEachQueuedResidual(input.n, queue, [&](int i)
+	{
+		computeJacobianRows(i, input, writer);
+	});
+
+	flushSharedAccumulator(shared_accumulator, rhs, input.nUnknowns);
+}
+
+// JTJp = alpha * J^T * (J * p). The rows are evaluated twice: once for Jp, once for its transpose product.
+// Jp rows are owned by the evaluating thread, so no synchronization is needed between the two passes.
+__global__ void cuApplyJTJMatrixFree(JacobianInput input, float alpha, const float* p, float* jp, float* jtjp, unsigned int* queue)
+{
+	extern __shared__ float shared_accumulator[];
+	clearSharedAccumulator(shared_accumulator, input.nUnknowns);
+
+	ProductWriter product_writer{ p, jp };
+	TransposeProductWriter transpose_writer{ jp, shared_accumulator, alpha };
+	forEachQueuedResidual(input.n, queue, [&](int i)
+	{
+		computeJacobianRows(i, input, product_writer);
+		computeJacobianRows(i, input, transpose_writer);
+	});
+
+	flushSharedAccumulator(shared_accumulator, jtjp, input.nUnknowns);
+}
+
+__device__ unsigned int warpReduceMin(unsigned int value)
+{
+	for (int offset = warpSize / 2; offset > 0; offset >>= 1)
+	{
+		value = min(value, __shfl_down_sync(0xffffffff, value, offset));
+	}
+	return value;
+}
+
+__device__ unsigned int warpReduceMax(unsigned int value)
+{
+	for (int offset = warpSize / 2; offset > 0; offset >>= 1)
+	{
+		value = max(value, __shfl_down_sync(0xffffffff, value, offset));
+	}
+	return value;
+}
+
+constexpr int kBoundingBoxThreads = 256; //per block, the width of the block is tuned, see LaunchTuner
+
+//Status of a tile of the ordered compaction: the flag in the top bits, the pixel count in the rest. A tile publishes the count of
+//its own pixels first, then the count of all pixels up to and including it, once its predecessors are known.
+constexpr unsigned int kTileAggregate = 1u << 30;
+constexpr unsigned int kTileInclusive = 2u << 30;
+constexpr unsigned int kTileCountMask = kTileAggregate - 1u;
+
+//Offset of the pixels of "tile" in the list, looking back over the published counts of its predecessors. They took their
+//tiles earlier, so they are running or done and the loop ends.
+__device__ unsigned int lookBackTileOffset(unsigned int* tile_status, unsigned int tile, unsigned int tile_count)
+{
+	if (tile == 0)
+	{
+		atomicExch(&tile_status[0], kTileInclusive | tile_count);
+		return 0;
+	}
+
+	atomicExch(&tile_status[tile], kTileAggregate | tile_count);
+	unsigned int offset = 0;
+	for (int predecessor = static_cast<int>(tile) - 1; predecessor >= 0;)
+	{
+		const unsigned int status = atomicAdd(&tile_status[predecessor], 0u);
+		if (status == 0)
+		{
+			continue;
+		}
+		offset += status & kTileCountMask;
+		if (status & kTileInclusive)
+		{
+			break;
+		}
+		--predecessor;
+	}
+	atomicExch(&tile_status[tile], kTileInclusive | (offset + tile_count));
+	return offset;
+}
+
+//Rebuilds the render target samples from the packed visibility buffer, see face.vert and face.frag.
+__device__ VisiblePixel unpackVisiblePixel(const PackedVisibility& packed, uint2 sample)
+{
+	const glm::ivec3 ids = packed.faces[sample.x - 1];
+	const float b0 = (sample.y & 0xffffu) / 65535.0f;
+	const float b1 = (sample.y >> 16) / 65535.0f;
+	const float b2 = fmaxf(1.0f - b0 - b1, 0.0f);
+
+	const int n = packed.number_of_vertices;
+	auto vertex = [&](int block, int id) { return util::loadVertex(packed.current_face, packed.aligned_face, block * n + id); };
+	const glm::vec3 normal = b0 * glm::normalize(packed.rotation * vertex(2, ids.x)) + b1 * glm::normalize(packed.rotation * vertex(2, ids.y)) +
+		b2 * glm::normalize(packed.rotation * vertex(2, ids.z));
+	const glm::vec3 albedo = b0 * vertex(1, ids.x) + b1 * vertex(1, ids.y) + b2 * vertex(1, ids.z);
+	const float light = jacobian_util::computeSH(packed.sh_coefficients, glm::normalize(normal));
+	const glm::vec3 rgb = glm::clamp(light * albedo, 0.0f, 1.0f); //the RGBA8 target clamps
+
+	VisiblePixel pixel;
+	pixel.barycentrics_light = make_float4(b0, b1, b2, light);
+	pixel.rgb = make_float3(rgb.x, rgb.y, rgb.z);
+	pixel.vertex_ids = make_int3(ids.x, ids.y, ids.z);
+	return pixel;
+}
+
+// The bounding box and the pixel counts are reduced per warp with shuffles and ballots, then per block in shared memory, and
+// added to the accumulator with one atomic per block and field. The last block to finish publishes the result and resets the
+// accumulator for the next launch.
+//
+// The covered pixels are compacted in a fixed order, so the solve doesn't change from run to run: tile by tile, within a tile
+// warp by warp and lane by lane. The blocks take their tiles from a counter, so a tile's predecessors have been scheduled, and
+// find their offset by looking back over the counts the earlier tiles published (tile_status, zeroed before the launch).
+__global__ void cuComputeVisiblePixelsAndBB(cudaTextureObject_t texture, cudaTextureObject_t texture_barycentrics, cudaTextureObject_t texture_vertex_ids,
+	const PackedVisibility packed, FaceBoundingBoxAccumulator* accumulator, unsigned int* tile_status, FaceBoundingBox* face_bb,
+	VisiblePixel* visible_pixels, int width, int height, int grid_stride, int grid_offset_x, int grid_offset_y, const RenderWindow window)
+{
+	__shared__ unsigned int block_visible, block_x_min, block_y_min, block_x_max, block_y_max, block_offset, tile;
+	__shared__ unsigned int warp_covered[kBoundingBoxThreads / 32];
+
+	const unsigned int thread = threadIdx.y * blockDim.x + threadIdx.x;
+	const unsigned int lane = thread % warpSize;
+	const unsigned int warp = thread / warpSize;
+	if (thread == 0)
+	{
+		block_visible = 0;
+		block_x_min = UINT_MAX;
+		block_y_min = UINT_MAX;
+		block_x_max = 0;
+		block_y_max = 0;
+		tile = atomicAdd(&accumulator->next_tile, 1u);
+	}
+	__syncthreads();
+
+	//No early return, every thread takes part in the warp and block reductions.
+	const uint2 index = make_uint2(threadIdx.x + (tile % gridDim.x) * blockDim.x, threadIdx.y + (tile / gridDim.x) * blockDim.y);
+	//Pixel of the frame the target pixel samples, the bounding box, the grid and the list are in frame pixels.
+	const unsigned int frame_x = window.x + index.x * window.stride;
+	const unsigned int frame_y = window.y + index.y * window.stride;
+	const bool inside = index.x < width && index.y < height && frame_x < static_cast<unsigned int>(window.frame_width)
+		&& frame_y < static_cast<unsigned int>(window.frame_height);
+	// "height - 1 - index.y" is used since OpenGL uses left-bottom corner as texture origin.
+	const int x = window.target_x + index.x;
+	const int y = window.target_y + height - 1 - index.y;
+	float4 color = make_float4(0.0f, 0.0f, 0.0f, 0.0f);
+	uint2 sample = make_uint2(0, 0); //packed visibility, x is the triangle id + 1
+	if (inside && packed.texture)
+	{
+		sample = tex2D<uint2>(packed.texture, x, y);
+		color.w = sample.x != 0 ? 1.0f : 0.0f;
+	}
+	else if (inside)
+	{
+		color = tex2D<float4>(texture, x, y);
+	}
+
+	// Stream compaction of the pixels the dense term uses.
+	const bool visible = color.w > 0.0f;
+	const bool on_grid = (frame_x + grid_offset_x) % grid_stride == 0 && (frame_y + grid_offset_y) % grid_stride == 0;
+	const bool covered = color.w >= 1.0f && on_grid;
+
+	const unsigned int visible_mask = __ballot_sync(0xffffffff, visible);
+	const unsigned int covered_mask = __ballot_sync(0xffffffff, covered);
+	const unsigned int x_min = warpReduceMin(visible ? frame_x : UINT_MAX);
+	const unsigned int y_min = warpReduceMin(visible ? frame_y : UINT_MAX);
+	const unsigned int x_max = warpReduceMax(visible ? frame_x : 0);
+	const unsigned int y_max = warpReduceMax(visible ? frame_y : 0);
+
+	if (lane == 0 && visible_mask != 0)
+	{
+		atomicAdd(&block_visible, __popc(visible_mask));
+		atomicMin(&block_x_min, x_min);
+		atomicMin(&block_y_min, y_min);
+		atomicMax(&block_x_max, x_max);
+		atomicMax(&block_y_max, y_max);
+	}
+	if (lane == 0)
+	{
+		warp_covered[warp] = __popc(covered_mask);
+	}
+	__syncthreads();
+
+	if (thread == 0)
+	{
+		//Exclusive scan over the warps, in place.
+		unsigned int block_covered = 0;
+		for (unsigned int i = 0; i < blockDim.x * blockDim.y / warpSize; ++i)
+		{
+			const unsigned int count = warp_covered[i];
+			warp_covered[i] = block_covered;
+			block_covered += count;
+		}
+		block_offset = lookBackTileOffset(tile_status, tile, block_covered);
+		if (block_covered > 0)
+		{
+			atomicAdd(&accumulator->bb.num_covered_pixels, block_covered);
+		}
+		if (block_visible > 0)
+		{
+			atomicAdd(&accumulator->bb.num_visible_pixels, block_visible);
+			atomicMin(&accumulator->bb.x_min, block_x_min);
+			atomicMin(&accumulator->bb.y_min, block_y_min);
+			atomicMax(&accumulator->bb.x_max, block_x_max);
+			atomicMax(&accumulator->bb.y_max, block_y_max);
+		}
+	}
+	__syncthreads();
+
+	if (covered)
+	{
+		VisiblePixel pixel;
+		if (packed.texture)
+		{
+			pixel = unpackVisiblePixel(packed, sample);
+		}
+		else
+		{
+			float4 barycentrics = tex2D<float4>(texture_barycentrics, x, y);
+			int4 vertex_ids = tex2D<int4>(texture_vertex_ids, x, y);
+			pixel.barycentrics_light = barycentrics;
+			pixel.rgb = make_float3(color.x, color.y, color.z);
+			pixel.vertex_ids = make_int3(vertex_ids.x, vertex_ids.y, vertex_ids.z);
+		}
+		pixel.x = frame_x;
+		pixel.y = frame_y;
+
+		const unsigned int rank = __popc(covered_mask & ((1u << lane) - 1u));
+		visible_pixels[block_offset + warp_covered[warp] + rank] = pixel;
+	}
+
+	if (thread == 0)
+	{
+		__threadfence();
+		const unsigned int n_blocks = gridDim.x * gridDim.y;
+		if (atomicAdd(&accumulator->finished_blocks, 1u) == n_blocks - 1)
+		{
+			FaceBoundingBox bb;
+			bb.num_visible_pixels = atomicExch(&accumulator->bb.num_visible_pixels, 0u);
+			bb.num_covered_pixels = atomicExch(&accumulator->bb.num_covered_pixels, 0u);
+			bb.x_min = atomicExch(&accumulator->bb.x_min, UINT_MAX);
+			bb.y_min = atomicExch(&accumulator->bb.y_min, UINT_MAX);
+			bb.x_max = atomicExch(&accumulator->bb.x_max, 0u);
+			bb.y_max = atomicExch(&accumulator->bb.y_max, 0u);
+			bb.width = bb.x_max - bb.x_min;
+			bb.height = bb.y_max - bb.y_min;
+			*face_bb = bb;
+			accumulator->finished_blocks = 0;
+			accumulator->next_tile = 0;
+		}
+	}
+}
+
+// The vertices of the dense term's pixels, each added to the list once. The flags have to be cleared beforehand.
+__global__ void cuCollectVisibleVertices(const VisiblePixel* visible_pixels, int nPixels, unsigned int* flags, int* visible_vertices,
+	unsigned int* num_visible_vertices)
+{
+	for (int i = util::getThreadIndex1D(); i < nPixels; i += util::getGridStride1D())
+	{
+		const int3 ids = visible_pixels[i].vertex_ids;
+		const int vertices[3] = { ids.x, ids.y, ids.z };
+		for (int k = 0; k < 3; ++k)
+		{
+			if (atomicExch(&flags[vertices[k]], 1u) == 0u)
+			{
+				visible_vertices[atomicAdd(num_visible_vertices, 1u)] = vertices[k];
+			}
+		}
+	}
+}
+
+// Pixel independent part of the shading derivatives, per visible vertex instead of three times per covered pixel.
+// The count stays on the device, the grid covers its upper bound.
+__global__ void cuComputeVertexShading(JacobianInput input, const int* visible_vertices, const unsigned int* num_visible_vertices,
+	VertexShading* vertex_shading)
+{
+	const int number_of_vertices = input.nVerticesTimes3 / 3;
+	const glm::vec3* normals = input.current_face + 2 * number_of_vertices;
+	const float4* aligned_normals = input.aligned_face ? input.aligned_face + 2 * number_of_vertices : nullptr;
+	const glm::mat3 rotation(input.face_pose);
+	const int n = *num_visible_vertices;
+
+	for (int j = util::getThreadIndex1D(); j < n; j += util::getGridStride1D())
+	{
+		const int i = visible_vertices[j];
+		const glm::vec3 normal_unnorm = rotation * util::loadVertex(normals, aligned_normals, i);
+		Eigen::Matrix<float, 3, 3> dnormal;
+		jacobian_util::computeNormalizationJacobian(dnormal, normal_unnorm);
+
+		VertexShading shading;
+		shading.normal = glm::normalize(normal_unnorm);
+		Eigen::Map<Eigen::Matrix3f>(shading.dnormal) = dnormal;
+		vertex_shading[i] = shading;
+	}
+}
+
+void GaussNewtonSolver::computeVertexShading(JacobianInput& input)
+{
+	const int number_of_vertices = input.nVerticesTimes3 / 3;
+	util::ensureSize(m_vertex_shading, number_of_vertices);
+	util::ensureSize(m_visible_vertex_flags, number_of_vertices);
+	util::ensureSize(m_visible_vertices, number_of_vertices);
+	util::ensureSize(m_num_visible_vertices, 1);
+	input.vertex_shading = m_vertex_shading.getPtr();
+	if (input.nPixels <= 0)
+	{
+		return;
+	}
+
+	m_visible_vertex_flags.memset(0, m_stream);
+	m_num_visible_vertices.memset(0, m_stream);
+	static const auto collect_config = util::getLaunchConfig1D(cuCollectVisibleVertices);
+	cuCollectVisibleVertices << <collect_config.getGridSize(input.nPixels), collect_config.block_size, 0, m_stream >> > (input.visible_pixels,
+		input.nPixels, m_visible_vertex_flags.getPtr(), m_visible_vertices.getPtr(), m_num_visible_vertices.getPtr());
+
+	static const auto config = util::getLaunchConfig1D(cuComputeVertexShading);
+	const int max_visible_vertices = std::min(number_of_vertices, 3 * input.nPixels);
+	cuComputeVertexShading << <config.getGridSize(max_visible_vertices), config.block_size, 0, m_stream >> > (input, m_visible_vertices.getPtr(),
+		m_num_visible_vertices.getPtr(), m_vertex_shading.getPtr());
+}
+
+FaceBoundingBox GaussNewtonSolver::computeFaceBoundingBox(const int imageWidth, const int imageHeight, const int gridStride, const int gridOffsetX, const int gridOffsetY,
+	RenderWindow window)
+{
+	util::ensureSize(m_visible_pixels, imageWidth * imageHeight);
+	m_render_cache.valid = false;
+	if (window.frame_width == 0)
+	{
+		window.frame_width = imageWidth;
+		window.frame_height = imageHeight;
+	}
+
+	//Every launch resets the accumulator when it's done, so the tuner can repeat it.
+	//The order of the pixels depends on the block shape, which the tuner keeps per device once it has chosen it.
+	util::LaunchTuner::get().launch("cuComputeVisiblePixelsAndBB", { 16, 32, 64, 8 }, m_stream, [&](int width)
+	{
+		dim3 threads_meta(width, kBoundingBoxThreads / width);
+		dim3 blocks_meta((imageWidth + threads_meta.x - 1) / threads_meta.x, (imageHeight + threads_meta.y - 1) / threads_meta.y);
+		util::ensureSize(m_compaction_tile_status, blocks_meta.x * blocks_meta.y);
+		m_compaction_tile_status.memset(0, m_stream);
+		cuComputeVisiblePixelsAndBB << <blocks_meta, threads_meta, 0, m_stream >> > (m_texture_rgb, m_texture_barycentrics, m_texture_vertex_ids,
+			m_packed_visibility, m_face_bb_accumulator.getPtr(), m_compaction_tile_status.getPtr(), m_face_bb.getPtr(), m_visible_pixels.getPtr(),
+			imageWidth, imageHeight, gridStride, gridOffsetX, gridOffsetY, window);
+	});
+
+	//The one readback of the iteration, the pixel count sizes the residuals and the launches of the Jacobian.
+	util::copyAsync(util::pinnedSpan(m_face_bb_host, 1), m_face_bb.span(), m_stream);
+	CHECK_CUDA_ERROR(cudaStreamSynchronize(m_stream));
+	FaceBoundingBox bb = *m_face_bb_host;
+
+	if (bb.num_visible_pixels <= 0 || bb.x_min >= bb.x_max || bb.y_min >= bb.y_max)
+	{
+		std::cout << "Warning: invalid face bounding box!" << std::endl;
+	}
+
+	return bb;
+}
+
+// Calls f with a null pointer of the entry type of the stored Jacobian.
+template<typename F>
+void dispatchJacobianEntry(const SolverParameters& params, F&& f)
+{
+	const JacobianPrecision precision = params.storesReducedJacobian() ? params.jacobian_precision : JacobianPrecision::Float32;
+	switch (precision)
+	{
+	case JacobianPrecision::Float16: f(static_cast<__half*>(nullptr)); break;
+	case JacobianPrecision::BFloat16: f(static_cast<JacobianBf16*>(nullptr)); break;
+	default: f(static_cast<float*>(nullptr)); break;
+	}
+}
+
+void GaussNewtonSolver::computeJacobian(const JacobianInput& input, void* p_jacobian, float* p_residuals) const
+{
+	//The dense term is tuned per GPU model, see LaunchTuner. The landmark kernel runs next to it, timing it alone says little.
+	const int threads_sparse = 64;
+
+	//The landmark kernel is tiny, it runs on its own stream next to the dense term.
+	auto launch = [&]()
+	{
+		CHECK_CUDA_ERROR(cudaEventRecord(m_jacobian_fork, m_stream));
+		CHECK_CUDA_ERROR(cudaStreamWaitEvent(m_stream_sparse, m_jacobian_fork, 0));
+
+		dispatchJacobianEntry(m_params, [&](auto* entries)
+		{
+			using Entry = std::remove_pointer_t<decltype(entries)>;
+			using Writer = StoredJacobianWriter<Entry>;
+			const auto writer = Writer::create(static_cast<Entry*>(p_jacobian), p_residuals, input.nResiduals, input.nUnknowns, 0,
+				m_params.use_row_major_jacobian);
+
+			if (input.nFeatures > 0)
+			{
+				dispatchCoefficientCounts(input, [&](auto counts)
+				{
+					cuComputeJacobianSparse<decltype(counts), Writer> << <(input.nFeatures + threads_sparse - 1) / threads_sparse, threads_sparse, 0, m_stream_sparse >> > (input, writer);
+				});
+			}
+			if (input.nPixels > 0 && input.vertex_major_basis)
+			{
+				const int pixels_per_block = 32 * kDenseTileWarps;
+				const int n_basis_cols = input.nShapeCoeffs + input.nExpressionCoeffs + input.nAlbedoCoeffs;
+				const dim3 blocks((input.nPixels + pixels_per_block - 1) / pixels_per_block, std::max(1, (n_basis_cols + kDenseColumnTile - 1) / kDenseColumnTile));
+				cuComputeJacobianDenseTiled<Entry> << <blocks, pixels_per_block, 0, m_stream >> > (input, writer);
+			}
+			else if (input.nPixels > 0)
+			{
+				util::LaunchTuner::get().launch("cuComputeJacobianDense", { 256, 128, 64, 512 }, m_stream, [&](int threads_dense)
+				{
+					dispatchCoefficientCounts(input, [&](auto counts)
+					{
+						cuComputeJacobianDense<decltype(counts), Writer> << <(input.nPixels + threads_dense - 1) / threads_dense, threads_dense, 0, m_stream >> > (input, writer);
+					});
+				});
+			}
+		});
+
+		CHECK_CUDA_ERROR(cudaEventRecord(m_jacobian_join, m_stream_sparse));
+		CHECK_CUDA_ERROR(cudaStreamWaitEvent(m_stream, m_jacobian_join, 0));
+	};
+
+	util::ScopedTimer timer("Jacobian", true, m_stream);
+	launch();
+}
+
+__device__ float warpReduceSum(float value)
+{
+	for (int offset = warpSize / 2; offset > 0; offset >>= 1)
+	{
+		value += __shfl_down_sync(0xffffffff, value, offset);
+	}
+	return value;
+}
+
+__device__ float invertJTJDiagonal(float diagonal)
+{
+	return 1.0f / glm::max(diagonal, 1.0e-4f);
+}
+
+// The regularizer wReg^2 * ||c||^2 of the face coefficients c, the unknowns [7, 7 + nFaceCoeffs). Its Jacobian is wReg * identity,
+// so instead of one nearly empty Jacobian row per coefficient it adds wReg^2 to the diagonal of JTJ and wReg^2 * c to JTf.
+__device__ float regularizerDiagonal(const JacobianInput& input, const int unknown)
+{
+	return unknown >= 7 && unknown < 7 + input.nFaceCoeffs ? input.wReg * input.wReg : 0.0f;
+}
+
+__device__ float regularizedCoefficient(const JacobianInput& input, const int i)
+{
+	const int expression_shift = input.nShapeCoeffs;
+	const int albedo_shift = input.nShapeCoeffs + input.nExpressionCoeffs;
+	if (i < expression_shift)
+	{
+		return input.p_coefficients_shape[i];
+	}
+	if (i < albedo_shift)
+	{
+		return input.p_coefficients_expression[i - expression_shift];
+	}
+	return input.p_coefficients_albedo[i - albedo_shift];
+}
+
+// Column-major J: block "col" reduces column col with warp shuffles, then across the warps in shared memory, and writes the
+// reciprocal directly. No atomics, so the preconditioner needs no clearing.
+constexpr int kDiagonalThreads = 256;
+
+template<typename Entry>
+__global__ void cuComputeJacobiPreconditioner(const JacobianInput input, const Entry* jacobian, float* preconditioner)
+{
+	const int nCurrentResiduals = input.nResiduals;
+	__shared__ float warp_sums[kDiagonalThreads / 32];
+
+	const int col = blockIdx.x;
+	const Entry* column = jacobian + static_cast<size_t>(col) * nCurrentResiduals;
+
+	float sum = 0.0f;
+	for (int row = threadIdx.x; row < nCurrentResiduals; row += blockDim.x)
+	{
+		const float v = loadEntry(column[row]);
+		sum += v * v;
+	}
+
+	const int lane = threadIdx.x % 32;
+	const int warp = threadIdx.x / 32;
+	sum = warpReduceSum(sum);
+	if (lane == 0)
+	{
+		warp_sums[warp] = sum;
+	}
+	__syncthreads();
+
+	if (warp == 0)
+	{
+		sum = lane < blockDim.x / 32 ? warp_sums[lane] : 0.0f;
+		sum = warpReduceSum(sum);
+		if (lane == 0)
+		{
+			preconditioner[col] = invertJTJDiagonal(sum + regularizerDiagonal(input, col));
+		}
+	}
+}
+
+// Row-major J: block b sums kDiagonalRowsPerBlock rows, thread j column j, so neighbouring threads read neighbouring floats.
+constexpr int kDiagonalRowsPerBlock = 256;
+
+template<typename Entry>
+__global__ void cuComputeJTJDiagonalsRowMajor(const int nUnknowns, const int nCurrentResiduals, const Entry* jacobian, float* preconditioner)
+{
+	const int row_begin = blockIdx.x * kDiagonalRowsPerBlock;
+	const int row_end = min(row_begin + kDiagonalRowsPerBlock, nCurrentResiduals);
+
+	for (int col = threadIdx.x; col < nUnknowns; col += blockDim.x)
+	{
+		float sum = 0.0f;
+		for (int row = row_begin; row < row_end; ++row)
+		{
+			const float v = loadEntry(jacobian[row * nUnknowns + col]);
+			sum += v * v;
+		}
+		atomicAdd(&preconditioner[col], sum);
+	}
+}
+
+// The vector kernels below are grid-stride loops, launched with util::getLaunchConfig1D.
+__global__ void cuElementwiseMultiplication(const int nElements, const float* v1, const float* v2, float* out)
+{
+	for (int i = util::getThreadIndex1D(); i < nElements; i += util::getGridStride1D())
+	{
+		out[i] = v1[i] * v2[i];
+	}
+}
+
+__global__ void cuOneOverElement(const int nElements, float* preconditioner)
+{
+	for (int i = util::getThreadIndex1D(); i < nElements; i += util::getGridStride1D())
+	{
+		preconditioner[i] = invertJTJDiagonal(preconditioner[i]);
+	}
+}
+
+void GaussNewtonSolver::invertDiagonal(const int nUnknowns, float* preconditioner)
+{
+	static const auto config = util::getLaunchConfig1D(cuOneOverElement);
+	cuOneOverElement << <config.getGridSize(nUnknowns), config.block_size, 0, m_stream >> > (nUnknowns, preconditioner);
+}
+
+void GaussNewtonSolver::computeJacobiPreconditioner(const JacobianInput& input, const void* jacobian, float* preconditioner)
+{
+	const int nUnknowns = input.nUnknowns;
+	const int nCurrentResiduals = input.nResiduals;
+	dispatchJacobianEntry(m_params, [&](auto* entries)
+	{
+		using Entry = std::remove_pointer_t<decltype(entries)>;
+		const Entry* typed_jacobian = static_cast<const Entry*>(jacobian);
+		if (m_params.use_row_major_jacobian)
+		{
+			const int blocks = (nCurrentResiduals + kDiagonalRowsPerBlock - 1) / kDiagonalRowsPerBlock;
+			CHECK_CUDA_ERROR(cudaMemsetAsync(preconditioner, 0, nUnknowns * sizeof(float), m_stream));
+			cuComputeJTJDiagonalsRowMajor << <blocks, 256, 0, m_stream >> > (nUnknowns, nCurrentResiduals, typed_jacobian, preconditioner);
+			addRegularizer(input, 1.0f, 0.0f, nullptr, preconditioner, 1);
+			invertDiagonal(nUnknowns, preconditioner);
+		}
+		else
+		{
+			cuComputeJacobiPreconditioner << <nUnknowns, kDiagonalThreads, 0, m_stream >> > (input, typed_jacobian, preconditioner);
+		}
+	});
+}
+
+// Products with a reduced stored Jacobian, y[o] += a * sum_i J(o, i) * x[i] with J(o, i) = jacobian[o * out_stride + i * in_stride].
+// The entries are widened to FP32 as they are loaded, the sums are FP32.
+constexpr int kStoredProductThreads = 256;
+
+// Neighbouring outputs are neighbouring entries (out_stride 1): a thread per output, coalesced across the threads. Few outputs
+// over many inputs (J^T * x of a row-major J) would leave the GPU idle, so the inputs are split over gridDim.y and the partial
+// sums are added atomically.
+template<typename Entry>
+__global__ void cuMultiplyStoredJacobianStrided(const Entry* jacobian, const int n_out, const int n_in, const int in_stride,
+	const int inputs_per_split, const float a, const float* x, float* y)
+{
+	const int o = util::getThreadIndex1D();
+	if (o >= n_out)
+	{
+		return;
+	}
+
+	const int begin = blockIdx.y * inputs_per_split;
+	const int end = min(begin + inputs_per_split, n_in);
+	float sum = 0.0f;
+	for (int i = begin; i < end; ++i)
+	{
+		sum += loadEntry(jacobian[o + static_cast<size_t>(i) * in_stride]) * x[i];
+	}
+	atomicAdd(&y[o], a * sum);
+}
+
+// The inputs of an output are neighbouring entries (in_stride 1): ThreadsPerOutput threads reduce each output, a warp for the
+// rows of a row-major J, the whole block for the long columns of a column-major one.
+template<typename Entry, int ThreadsPerOutput>
+__global__ void __launch_bounds__(kStoredProductThreads) cuMultiplyStoredJacobianContiguous(const Entry* jacobian, const int n_out,
+	const int n_in, const int out_stride, const float a, const float* x, const float beta, float* y)
+{
+	__shared__ float warp_sums[kStoredProductThreads / 32];
+
+	const int o = blockIdx.x * (kStoredProductThreads / ThreadsPerOutput) + threadIdx.x / ThreadsPerOutput;
+	const int t = threadIdx.x % ThreadsPerOutput;
+
+	float sum = 0.0f;
+	if (o < n_out)
+	{
+		const Entry* entries = jacobian + static_cast<size_t>(o) * out_stride;
+		for (int i = t; i < n_in; i += ThreadsPerOutput)
+		{
+			sum += loadEntry(entries[i]) * x[i];
+		}
+	}
+	sum = warpReduceSum(sum);
+
+	if (ThreadsPerOutput > 32)
+	{
+		const int lane = threadIdx.x % 32;
+		if (lane == 0)
+		{
+			warp_sums[threadIdx.x / 32] = sum;
+		}
+		__syncthreads();
+		sum = warpReduceSum(lane < ThreadsPerOutput / 32 ? warp_sums[lane] : 0.0f);
+	}
+
+	if (t == 0 && o < n_out)
+	{
+		y[o] = a * sum + (beta != 0.0f ? beta * y[o] : 0.0f);
+	}
+}
+
+void GaussNewtonSolver::multiplyStoredJacobian(const void* jacobian, const size_t first_entry, const int n_rows, const int n_cols, const int ld,
+	const bool transposed, const float a, const float* x, const float beta, float* y)
+{
+	const bool row_major = m_params.use_row_major_jacobian;
+	if (!m_params.storesReducedJacobian())
+	{
+		//A row-major J is J^T in column-major order.
+		cublasSgemv(m_cublas, transposed != row_major ? CUBLAS_OP_T : CUBLAS_OP_N, row_major ? n_cols : n_rows, row_major ? n_rows : n_cols,
+			&a, static_cast<const float*>(jacobian) + first_entry, ld, x, 1, &beta, y, 1);
+		return;
+	}
+
+	const int n_out = transposed ? n_cols : n_rows;
+	const int n_in = transposed ? n_rows : n_cols;
+	const bool contiguous_outputs = transposed == row_major; //out_stride 1, in_stride ld
+	dispatchJacobianEntry(m_params, [&](auto* entries)
+	{
+		using Entry = std::remove_pointer_t<decltype(entries)>;
+		const Entry* block = static_cast<const Entry*>(jacobian) + first_entry;
+		if (contiguous_outputs)
+		{
+			if (beta == 0.0f)
+			{
+				CHECK_CUDA_ERROR(cudaMemsetAsync(y, 0, n_out * sizeof(float), m_stream));
+			}
+			else if (beta != 1.0f)
+			{
+				cublasSscal(m_cublas, n_out, &beta, y, 1);
+			}
+			const int output_blocks = (n_out + kStoredProductThreads - 1) / kStoredProductThreads;
+			const int splits = std::max(1, std::min((n_in + kStoredProductThreads - 1) / kStoredProductThreads, 1024 / output_blocks));
+			const int inputs_per_split = (n_in + splits - 1) / splits;
+			cuMultiplyStoredJacobianStrided << <dim3(output_blocks, splits), kStoredProductThreads, 0, m_stream >> > (block, n_out, n_in, ld,
+				inputs_per_split, a, x, y);
+		}
+		else if (n_in > 1024)
+		{
+			cuMultiplyStoredJacobianContiguous<Entry, kStoredProductThreads> << <n_out, kStoredProductThreads, 0, m_stream >> > (block, n_out, n_in,
+				ld, a, x, beta, y);
+		}
+		else
+		{
+			const int outputs_per_block = kStoredProductThreads / 32;
+			cuMultiplyStoredJacobianContiguous<Entry, 32> << <(n_out + outputs_per_block - 1) / outputs_per_block, kStoredProductThreads, 0, m_stream >> > (
+				block, n_out, n_in, ld, a, x, beta, y);
+		}
+	});
+}
+
+void GaussNewtonSolver::elementwiseMultiplication(const int nElements, float* v1, float* v2, float* out)
+{
+	static const auto config = util::getLaunchConfig1D(cuElementwiseMultiplication);
+	cuElementwiseMultiplication << <config.getGridSize(nElements), config.block_size, 0, m_stream >> > (nElements, v1, v2, out);
+}
+
+// One CUDA block per preconditioner block. The block is symmetrized from its lower triangle into shared memory, its diagonal clamped
+// like the Jacobi preconditioner's and damped, then inverted by Gauss-Jordan elimination. SPD, so no pivoting is needed.
+__global__ void cuInvertPreconditionerBlocks(const PreconditionerBlocks blocks, const float* jtj, const int ld, const float lambda, float* M_blocks)
+{
+	extern __shared__ float shared[];
+
+	const int b = blockIdx.x;
+	const int n = blocks.sizes[b];
+	float* A = shared; // n x n, column-major
+	float* pivot_col = A + n * n;
+	float* pivot_row = pivot_col + n;
+
+	// From JTJ or, in place, from the packed blocks
+	const float* source = jtj ? jtj + blocks.offsets[b] * (ld + 1) : M_blocks + blocks.storage[b];
+	const int source_ld = jtj ? ld : n;
+	for (int idx = threadIdx.x; idx < n * n; idx += blockDim.x)
+	{
+		const int i = idx % n;
+		const int j = idx / n;
+		float value = i >= j ? source[i + j * source_ld] : source[j + i * source_ld];
+		if (i == j)
+		{
+			value = glm::max(value, 1.0e-4f);
+			value += lambda * value;
+		}
+		A[idx] = value;
+	}
+	__syncthreads();
+
+	for (int k = 0; k < n; ++k)
+	{
+		for (int i = threadIdx.x; i < n; i += blockDim.x)
+		{
+			pivot_col[i] = A[i + k * n];
+			pivot_row[i] = A[k + i * n];
+		}
+		__syncthreads();
+
+		const float one_over_pivot = 1.0f / pivot_col[k];
+		for (int idx = threadIdx.x; idx < n * n; idx += blockDim.x)
+		{
+			const int i = idx % n;
+			const int j = idx / n;
+			if (i == k && j == k)
+			{
+				A[idx] = one_over_pivot;
+			}
+			else if (i == k)
+			{
+				A[idx] = pivot_row[j] * one_over_pivot;
+			}
+			else if (j == k)
+			{
+				A[idx] = -pivot_col[i] * one_over_pivot;
+			}
+			else
+			{
+				A[idx] -= pivot_col[i] * pivot_row[j] * one_over_pivot;
+			}
+		}
+		__syncthreads();
+	}
+
+	float* inverse = M_blocks + blocks.storage[b];
+	for (int idx = threadIdx.x; idx < n * n; idx += blockDim.x)
+	{
+		inverse[idx] = A[idx];
+	}
+}
+
+// Row i of the block-diagonal preconditioner times r.
+__device__ float applyBlockPreconditionerRow(const PreconditionerBlocks& blocks, const float* M_blocks, const float* r, const int i)
+{
+	int b = 0;
+	while (b + 1 < blocks.count && i >= blocks.offsets[b + 1])
+	{
+		++b;
+	}
+
+	const int n = blocks.sizes[b];
+	const int local = i - blocks.offsets[b];
+	const float* inverse = M_blocks + blocks.storage[b];
+	const float* r_block = r + blocks.offsets[b];
+
+	float z = 0.0f;
+	for (int j = 0; j < n; ++j)
+	{
+		z += inverse[local + j * n] * r_block[j];
+	}
+	return z;
+}
+
+__global__ void cuApplyBlockPreconditioner(const int nUnknowns, const PreconditionerBlocks blocks, const float* M_blocks, const float* r, float* z)
+{
+	int i = util::getThreadIndex1D();
+	if (i >= nUnknowns)
+	{
+		return;
+	}
+
+	z[i] = applyBlockPreconditionerRow(blocks, M_blocks, r, i);
+}
+
+void GaussNewtonSolver::invertPreconditionerBlocks(SolverWorkspace& workspace, const float* jtj, const int nUnknowns, const float lambda)
+{
+	const auto& blocks = workspace.preconditioner_blocks;
+	const size_t shared_memory_size = (blocks.max_size * blocks.max_size + 2 * blocks.max_size) * sizeof(float);
+	cuInvertPreconditionerBlocks << <blocks.count, 256, shared_memory_size, m_stream >> > (blocks, jtj, nUnknowns, lambda, workspace.M_blocks.getPtr());
+}
+
+void GaussNewtonSolver::applyPreconditioner(const int nUnknowns, SolverWorkspace& workspace, float* r, float* z)
+{
+	if (workspace.preconditioner_blocks.count == 0)
+	{
+		elementwiseMultiplication(nUnknowns, workspace.M.getPtr(), r, z);
+		return;
+	}
+
+	const int threads = 256;
+	cuApplyBlockPreconditioner << <(nUnknowns + threads - 1) / threads, threads, 0, m_stream >> > (nUnknowns, workspace.preconditioner_blocks,
+		workspace.M_blocks.getPtr(), r, z);
+}
+
+//Blocks of a launch over "n" residual threads. A persistent launch ("queue" set) gets the blocks which are resident on the
+//device at once, at most one per tile.
+template<typename Kernel>
+static int getResidualGridSize(Kernel kernel, const int n, const int threads, const size_t shared_memory_size, const unsigned int* queue)
+{
+	const int n_tiles = std::max((n + threads - 1) / threads, 1);
+	if (!queue)
+	{
+		return n_tiles;
+	}
+
+	//Queried per launch, the batch workers run on different devices. Both are host-side lookups.
+	int device = 0;
+	int n_sms = 0;
+	CHECK_CUDA_ERROR(cudaGetDevice(&device));
+	CHECK_CUDA_ERROR(cudaDeviceGetAttribute(&n_sms, cudaDevAttrMultiProcessorCount, device));
+	int n_blocks_per_sm = 0;
+	CHECK_CUDA_ERROR(cudaOccupancyMaxActiveBlocksPerMultiprocessor(&n_blocks_per_sm, kernel, threads, shared_memory_size));
+	return std::min(std::max(n_blocks_per_sm, 1) * n_sms, n_tiles);
+}
+
+unsigned int* GaussNewtonSolver::getWorkQueue()
+{
+	//Allocated by reserveFaces, a flag switched on during the frame takes effect with the next one.
+	return m_params.use_persistent_threads && m_work_queue.getSize() > 0 ? m_work_queue.getPtr() : nullptr;
+}
+
+void GaussNewtonSolver::computeRhsAndJacobiPreconditionerMatrixFree(const JacobianInput& input, const float alphaRHS, float* residuals, float* rhs, float* preconditioner)
+{
+	const int threads = 128;
+	const size_t shared_memory_size = 2 * input.nUnknowns * sizeof(float);
+	unsigned int* queue = getWorkQueue();
+	const int block = getResidualGridSize(cuComputeRhsAndJTJDiagonalsMatrixFree, input.n, threads, shared_memory_size, queue);
+
+	CHECK_CUDA_ERROR(cudaMemsetAsync(rhs, 0, input.nUnknowns * sizeof(float), m_stream));
+	CHECK_CUDA_ERROR(cudaMemsetAsync(preconditioner, 0, input.nUnknowns * sizeof(float), m_stream));
+
+	cuComputeRhsAndJTJDiagonalsMatrixFree << <block, threads, shared_memory_size, m_stream >> > (input, alphaRHS, residuals, rhs, preconditioner, queue);
+	addRegularizer(input, 1.0f, alphaRHS, rhs, preconditioner, 1);
+	invertDiagonal(input.nUnknowns, preconditioner);
+}
+
+void GaussNewtonSolver::applyJTJMatrixFree(const JacobianInput& input, const float alphaLHS, const float* p, float* jp, float* jtjp)
+{
+	const int threads = 128;
+	const size_t shared_memory_size = input.nUnknowns * sizeof(float);
+	unsigned int* queue = getWorkQueue();
+	const int block = getResidualGridSize(cuApplyJTJMatrixFree, input.n, threads, shared_memory_size, queue);
+
+	CHECK_CUDA_ERROR(cudaMemsetAsync(jp, 0, input.nResiduals * sizeof(float), m_stream));
+	CHECK_CUDA_ERROR(cudaMemsetAsync(jtjp, 0, input.nUnknowns * sizeof(float), m_stream));
+
+	cuApplyJTJMatrixFree << <block, threads, shared_memory_size, m_stream >> > (input, alphaLHS, p, jp, jtjp, queue);
+	applyRegularizer(input, alphaLHS, p, jtjp);
+}
+
+/**
+ * Fused PCG. The whole PCG state lives on the device, one iteration is applyJTJ followed by a single launch of cuFusedPCGIteration.
+ * nUnknowns is only a few hundred, so one block holds all of it and the dot products are block reductions instead of cublasSdot.
+ * scalars[0] = zTr_old, scalars[1] = converged flag, scalars[2] = tolerance on zTr,
+ * scalars[3] and [4] = zTr of the right-hand side and forcing term of the previous GN iteration (see computeForcingTerm).
+ */
+constexpr int kFusedPCGThreads = 512;
+
+__device__ float blockReduceSum(float value, float* shared)
+{
+	shared[threadIdx.x] = value;
+	__syncthreads();
+
+	for (int stride = blockDim.x / 2; stride > 0; stride >>= 1)
+	{
+		if (threadIdx.x < stride)
+		{
+			shared[threadIdx.x] += shared[threadIdx.x + stride];
+		}
+		__syncthreads();
+	}
+
+	float sum = shared[0];
+	__syncthreads();
+
+	return sum;
+}
+
+// M_blocks is nullptr for the diagonal preconditioner M, see PreconditionerBlocks.
+// A warm start keeps x, cuFusedPCGRestart follows.
+__global__ void cuFusedPCGInit(const int nUnknowns, const float* M, const float* M_blocks, const PreconditionerBlocks blocks,
+	const float* r, float* z, float* p, float* x, float* scalars, const bool warm_start, const float kTolerance,
+	const float max_forcing_term, const float forcing_gamma)
+{
+	__shared__ float shared[kFusedPCGThreads];
+
+	float zTr = 0.0f;
+	for (int i = threadIdx.x; i < nUnknowns; i += blockDim.x)
+	{
+		//z = Mr, p = z, x = 0
+		float zi = M_blocks ? applyBlockPreconditionerRow(blocks, M_blocks, r, i) : M[i] * r[i];
+		z[i] = zi;
+		p[i] = zi;
+		if (!warm_start)
+		{
+			x[i] = 0.0f;
+		}
+		zTr += zi * r[i];
+	}
+	zTr = blockReduceSum(zTr, shared);
+
+	if (threadIdx.x == 0)
+	{
+		float tolerance = kTolerance;
+		if (max_forcing_term > 0.0f)
+		{
+			const float forcing_term = computeForcingTerm(max_forcing_term, forcing_gamma, zTr, scalars[3], scalars[4]);
+			tolerance = glm::max(tolerance, forcing_term * forcing_term * zTr);
+			scalars[3] = zTr;
+			scalars[4] = forcing_term;
+		}
+		scalars[0] = zTr;
+		scalars[1] = zTr < tolerance ? 1.0f : 0.0f;
+		scalars[2] = tolerance;
+	}
+}
+
+__global__ void cuFusedPCGRestart(const int nUnknowns, const float* M, const float* M_blocks, const PreconditionerBlocks blocks,
+	const float* JTJx, float* r, float* z, float* p, float* scalars)
+{
+	__shared__ float shared[kFusedPCGThreads];
+
+	//r = r - JTJx, all of it before the blocks mix its entries
+	for (int i = threadIdx.x; i < nUnknowns; i += blockDim.x)
+	{
+		r[i] -= JTJx[i];
+	}
+	__syncthreads();
+
+	float zTr = 0.0f;
+	for (int i = threadIdx.x; i < nUnknowns; i += blockDim.x)
+	{
+		//z = Mr, p = z
+		float zi = M_blocks ? applyBlockPreconditionerRow(blocks, M_blocks, r, i) : M[i] * r[i];
+		z[i] = zi;
+		p[i] = zi;
+		zTr += zi * r[i];
+	}
+	zTr = blockReduceSum(zTr, shared);
+
+	if (threadIdx.x == 0)
+	{
+		scalars[0] = zTr;
+		scalars[1] = zTr < scalars[2] ? 1.0f : 0.0f;
+	}
+}
+
+__global__ void cuFusedPCGIteration(const int nUnknowns, const float* M, const float* M_blocks, const PreconditionerBlocks blocks,
+	const float* JTJp, float* r, float* z, float* p, float* x, float* scalars, const float kNearZero)
+{
+	__shared__ float shared[kFusedPCGThreads];
+
+	if (scalars[1] != 0.0f)
+	{
+		return;
+	}
+
+	float pTJTJp = 0.0f;
+	for (int i = threadIdx.x; i < nUnknowns; i += blockDim.x)
+	{
+		pTJTJp += p[i] * JTJp[i];
+	}
+	pTJTJp = blockReduceSum(pTJTJp, shared);
+
+	const float zTr_old = scalars[0];
+	const float ak = zTr_old / glm::max(pTJTJp, kNearZero);
+
+	float zTr = 0.0f;
+	if (M_blocks)
+	{
+		//The blocks mix entries of r, so all of r is updated first.
+		for (int i = threadIdx.x; i < nUnknowns; i += blockDim.x)
+		{
+			x[i] += ak * p[i];
+			r[i] -= ak * JTJp[i];
+		}
+		__syncthreads();
+
+		for (int i = threadIdx.x; i < nUnknowns; i += blockDim.x)
+		{
+			float zi = applyBlockPreconditionerRow(blocks, M_blocks, r, i);
+			z[i] = zi;
+			zTr += zi * r[i];
+		}
+	}
+	else
+	{
+		for (int i = threadIdx.x; i < nUnknowns; i += blockDim.x)
+		{
+			//x = ak*p + x, r = r - ak* JTJp, z=Mr
+			x[i] += ak * p[i];
+			float ri = r[i] - ak * JTJp[i];
+			float zi = M[i] * ri;
+			r[i] = ri;
+			z[i] = zi;
+			zTr += zi * ri;
+		}
+	}
+	zTr = blockReduceSum(zTr, shared);
+
+	if (zTr < scalars[2])
+	{
+		if (threadIdx.x == 0)
+		{
+			scalars[1] = 1.0f;
+		}
+		return;
+	}
+
+	//p = z + bk*p
+	const float bk = zTr / glm::max(zTr_old, kNearZero);
+	for (int i = threadIdx.x; i < nUnknowns; i += blockDim.x)
+	{
+		p[i] = z[i] + bk * p[i];
+	}
+
+	if (threadIdx.x == 0)
+	{
+		scalars[0] = zTr;
+	}
+}
+
+void GaussNewtonSolver::fusedPCGInit(const int nUnknowns, SolverWorkspace& workspace, const bool warm_start)
+{
+	const float* M_blocks = workspace.preconditioner_blocks.count > 0 ? workspace.M_blocks.getPtr() : nullptr;
+	cuFusedPCGInit << <1, kFusedPCGThreads, 0, m_stream >> > (nUnknowns, workspace.M.getPtr(), M_blocks, workspace.preconditioner_blocks,
+		workspace.r.getPtr(), workspace.z.getPtr(), workspace.p.getPtr(), workspace.result.getPtr(), workspace.pcg_scalars.getPtr(),
+		warm_start, m_params.kTolerance, m_params.pcg_max_forcing_term, m_params.pcg_forcing_gamma);
+}
+
+void GaussNewtonSolver::fusedPCGRestart(const int nUnknowns, SolverWorkspace& workspace)
+{
+	const float* M_blocks = workspace.preconditioner_blocks.count > 0 ? workspace.M_blocks.getPtr() : nullptr;
+	cuFusedPCGRestart << <1, kFusedPCGThreads, 0, m_stream >> > (nUnknowns, workspace.M.getPtr(), M_blocks, workspace.preconditioner_blocks,
+		workspace.JTJp.getPtr(), workspace.r.getPtr(), workspace.z.getPtr(), workspace.p.getPtr(), workspace.pcg_scalars.getPtr());
+}
 
-	cuOneOverElement << <1, nUnknowns >> > (preconditioner);
-	cudaDeviceSynchronize();
+void GaussNewtonSolver::fusedPCGIteration(const int nUnknowns, SolverWorkspace& workspace)
+{
+	const float* M_blocks = workspace.preconditioner_blocks.count > 0 ? workspace.M_blocks.getPtr() : nullptr;
+	cuFusedPCGIteration << <1, kFusedPCGThreads, 0, m_stream >> > (nUnknowns, workspace.M.getPtr(), M_blocks, workspace.preconditioner_blocks,
+		workspace.JTJp.getPtr(), workspace.r.getPtr(), workspace.z.getPtr(), workspace.p.getPtr(), workspace.result.getPtr(), workspace.pcg_scalars.getPtr(),
+		m_params.kNearZero);
 }
 
-void GaussNewtonSolver::elementwiseMultiplication(const int nElements, float* v1, float* v2, float* out)
+// First Jacobian row written by residual thread i. Sparse threads own 2 rows, dense threads 3.
+static int getFirstRow(const JacobianInput& input, int i)
+{
+	if (i < input.nFeatures)
+	{
+		return 2 * i;
+	}
+	return 2 * input.nFeatures + 3 * (i - input.nFeatures);
+}
+
+void GaussNewtonSolver::computeNormalEquations(const JacobianInput& input, SolverWorkspace& workspace, const float alphaLHS, const float alphaRHS)
+{
+	const int nUnknowns = input.nUnknowns;
+	const int threads = 128;
+	const float beta = 1.0f;
+
+	float* jacobian_chunk = workspace.jacobian.getPtr();
+	float* jtj = workspace.jtj.getPtr();
+	float* rhs = workspace.r.getPtr();
+
+	CHECK_CUDA_ERROR(cudaMemsetAsync(jtj, 0, nUnknowns * nUnknowns * sizeof(float), m_stream));
+	CHECK_CUDA_ERROR(cudaMemsetAsync(rhs, 0, nUnknowns * sizeof(float), m_stream));
+
+	//Thread i writes rows in front of the rows of thread i + 1, so a range of threads owns a contiguous block of rows.
+	for (int thread_begin = 0; thread_begin < input.n; thread_begin += kNormalEquationChunkThreads)
+	{
+		const int thread_end = std::min(input.n, thread_begin + kNormalEquationChunkThreads);
+		const int row_begin = getFirstRow(input, thread_begin);
+		const int n_rows = getFirstRow(input, thread_end) - row_begin;
+
+		CHECK_CUDA_ERROR(cudaMemsetAsync(jacobian_chunk, 0, n_rows * nUnknowns * sizeof(float), m_stream));
+
+		const bool row_major = m_params.use_row_major_jacobian;
+		auto writer = DenseJacobianWriter::create(jacobian_chunk, workspace.residuals.getPtr(), n_rows, nUnknowns, row_begin, row_major);
+		const int block = (thread_end - thread_begin + threads - 1) / threads;
+		dispatchCoefficientCounts(input, [&](auto counts)
+		{
+			cuComputeJacobianChunk<decltype(counts)> << <block, threads, 0, m_stream >> > (input, writer, thread_begin, thread_end);
+		});
+
+		//JTJ += alphaLHS * JcT * Jc
+		multiplyJTJ(jacobian_chunk, n_rows, nUnknowns, alphaLHS, beta, jtj);
+
+		//r += alphaRHS * JcT * fc. A row-major chunk is JcT in column-major order.
+		const cublasOperation_t op_jt = row_major ? CUBLAS_OP_N : CUBLAS_OP_T;
+		const int lda = row_major ? nUnknowns : n_rows;
+		cublasSgemv(m_cublas, op_jt, row_major ? nUnknowns : n_rows, row_major ? n_rows : nUnknowns, &alphaRHS, jacobian_chunk, lda,
+			workspace.residuals.getPtr() + row_begin, 1, &beta, rhs, 1);
+	}
+
+	addRegularizer(input, alphaLHS, alphaRHS, rhs, jtj, nUnknowns + 1);
+}
+
+void GaussNewtonSolver::computeRhs(const JacobianInput& input, SolverWorkspace& workspace, const float alphaRHS)
+{
+	const int threads = 128;
+	const size_t shared_memory_size = input.nUnknowns * sizeof(float);
+	unsigned int* queue = getWorkQueue();
+	const int block = getResidualGridSize(cuComputeRhs, input.n, threads, shared_memory_size, queue);
+	float* rhs = workspace.r.getPtr();
+
+	CHECK_CUDA_ERROR(cudaMemsetAsync(rhs, 0, input.nUnknowns * sizeof(float), m_stream));
+
+	cuComputeRhs << <block, threads, shared_memory_size, m_stream >> > (input, alphaRHS, workspace.residuals.getPtr(), rhs, queue);
+	addRegularizer(input, 1.0f, alphaRHS, rhs, nullptr, 0);
+}
+
+__global__ void cuJTJDiagonalToPreconditioner(const int nUnknowns, const float* jtj, float* preconditioner)
+{
+	for (int i = util::getThreadIndex1D(); i < nUnknowns; i += util::getGridStride1D())
+	{
+		preconditioner[i] = invertJTJDiagonal(jtj[static_cast<size_t>(i) * nUnknowns + i]);
+	}
+}
+
+void GaussNewtonSolver::computeJTJPreconditioner(const int nUnknowns, const float* jtj, float* preconditioner)
+{
+	static const auto config = util::getLaunchConfig1D(cuJTJDiagonalToPreconditioner);
+	cuJTJDiagonalToPreconditioner << <config.getGridSize(nUnknowns), config.block_size, 0, m_stream >> > (nUnknowns, jtj, preconditioner);
+}
+
+__global__ void cuAddDamping(const int nUnknowns, const float lambda, const float* M, const float* p, float* JTJp)
+{
+	for (int i = util::getThreadIndex1D(); i < nUnknowns; i += util::getGridStride1D())
+	{
+		JTJp[i] += lambda * p[i] / M[i];
+	}
+}
+
+// Same clamping as the preconditioners, so zero columns (e.g. unseen coefficients) are damped as well. The regularizer only
+// covers the face coefficients, the epsilon keeps the pose, focal and SH columns of a face without visible pixels factorizable.
+__global__ void cuDampJTJ(const int nUnknowns, const float lambda, float* jtj)
+{
+	for (int i = util::getThreadIndex1D(); i < nUnknowns; i += util::getGridStride1D())
+	{
+		float& diagonal = jtj[static_cast<size_t>(i) * nUnknowns + i];
+		diagonal += lambda * glm::max(diagonal, 1.0e-4f) + kJTJDiagonalEpsilon;
+	}
+}
+
+// One block per system: zeroes the step of a system whose Cholesky factorization failed, instead of applying NaNs.
+__global__ void cuDiscardFailedSteps(const int nUnknowns, const int* info, float* const* results, float* result)
+{
+	if (info[blockIdx.x] == 0)
+	{
+		return;
+	}
+	float* step = results ? results[blockIdx.x] : result;
+	for (int i = threadIdx.x; i < nUnknowns; i += blockDim.x)
+	{
+		step[i] = 0.0f;
+	}
+}
+
+void GaussNewtonSolver::discardFailedSteps(const int nUnknowns, const int batch_size, const int* info, float* const* results, float* result)
+{
+	cuDiscardFailedSteps << <batch_size, 128, 0, m_stream >> > (nUnknowns, info, results, result);
+}
+
+void GaussNewtonSolver::addDamping(const int nUnknowns, const float* M, const float* p, float* JTJp)
+{
+	// M only rescales by 1 + lambda with damping, which leaves the PCG iterates as they are, so it is not updated.
+	if (m_damping > 0.0f)
+	{
+		static const auto config = util::getLaunchConfig1D(cuAddDamping);
+		cuAddDamping << <config.getGridSize(nUnknowns), config.block_size, 0, m_stream >> > (nUnknowns, m_damping, M, p, JTJp);
+	}
+}
+
+void GaussNewtonSolver::dampJTJ(const int nUnknowns, float* jtj)
+{
+	static const auto config = util::getLaunchConfig1D(cuDampJTJ);
+	cuDampJTJ << <config.getGridSize(nUnknowns), config.block_size, 0, m_stream >> > (nUnknowns, m_damping, jtj);
+}
+
+__global__ void cuAddRegularizer(const JacobianInput input, const float alphaLHS, const float alphaRHS, float* rhs, float* diagonal,
+	const size_t diagonal_stride)
+{
+	const float weight = input.wReg * input.wReg;
+	for (int i = util::getThreadIndex1D(); i < input.nFaceCoeffs; i += util::getGridStride1D())
+	{
+		if (rhs)
+		{
+			rhs[7 + i] += alphaRHS * weight * regularizedCoefficient(input, i);
+		}
+		if (diagonal)
+		{
+			diagonal[(7 + i) * diagonal_stride] += alphaLHS * weight;
+		}
+	}
+}
+
+__global__ void cuApplyRegularizer(const int nFaceCoeffs, const float weight, const float* p, float* JTJp)
+{
+	for (int i = util::getThreadIndex1D(); i < nFaceCoeffs; i += util::getGridStride1D())
+	{
+		JTJp[7 + i] += weight * p[7 + i];
+	}
+}
+
+// The regularized unknowns of each block are consecutive, so a thread walks the blocks until it finds its own.
+__global__ void cuAddRegularizerToBlocks(const int nFaceCoeffs, const float weight, const PreconditionerBlocks blocks, float* M_blocks)
+{
+	for (int i = util::getThreadIndex1D(); i < nFaceCoeffs; i += util::getGridStride1D())
+	{
+		const int unknown = 7 + i;
+		int b = 0;
+		while (b + 1 < blocks.count && blocks.offsets[b + 1] <= unknown)
+		{
+			++b;
+		}
+		const int local = unknown - blocks.offsets[b];
+		M_blocks[blocks.storage[b] + local * (blocks.sizes[b] + 1)] += weight;
+	}
+}
+
+void GaussNewtonSolver::addRegularizer(const JacobianInput& input, const float alphaLHS, const float alphaRHS, float* rhs, float* diagonal,
+	const size_t diagonal_stride)
+{
+	if (input.nFaceCoeffs > 0)
+	{
+		static const auto config = util::getLaunchConfig1D(cuAddRegularizer);
+		cuAddRegularizer << <config.getGridSize(input.nFaceCoeffs), config.block_size, 0, m_stream >> > (input, alphaLHS, alphaRHS, rhs,
+			diagonal, diagonal_stride);
+	}
+}
+
+void GaussNewtonSolver::applyRegularizer(const JacobianInput& input, const float alphaLHS, const float* p, float* JTJp)
+{
+	if (input.nFaceCoeffs > 0)
+	{
+		static const auto config = util::getLaunchConfig1D(cuApplyRegularizer);
+		cuApplyRegularizer << <config.getGridSize(input.nFaceCoeffs), config.block_size, 0, m_stream >> > (input.nFaceCoeffs,
+			alphaLHS * input.wReg * input.wReg, p, JTJp);
+	}
+}
+
+void GaussNewtonSolver::addRegularizerToBlocks(const JacobianInput& input, const float alphaLHS, SolverWorkspace& workspace)
+{
+	if (input.nFaceCoeffs > 0 && workspace.preconditioner_blocks.count > 0)
+	{
+		static const auto config = util::getLaunchConfig1D(cuAddRegularizerToBlocks);
+		cuAddRegularizerToBlocks << <config.getGridSize(input.nFaceCoeffs), config.block_size, 0, m_stream >> > (input.nFaceCoeffs,
+			alphaLHS * input.wReg * input.wReg, workspace.preconditioner_blocks, workspace.M_blocks.getPtr());
+	}
+}
+
+// Coefficient and SH part of the GN step. They stay on the device during a solve, the expressions are clamped like in
+// predictParameters.
+__global__ void cuUpdateCoefficients(const float* result, float* coefficients, const int nShapeCoeffs, const int nExpressionCoeffs,
+	const int nAlbedoCoeffs, const int nSHCoeffs, const int nShapeCoeffsTotal, const int nExpressionCoeffsTotal, const int nAlbedoCoeffsTotal)
+{
+	const int nFaceCoeffs = nShapeCoeffs + nExpressionCoeffs + nAlbedoCoeffs;
+	const int n = nFaceCoeffs + nSHCoeffs;
+	for (int i = util::getThreadIndex1D(); i < n; i += util::getGridStride1D())
+	{
+		const float delta = result[7 + i];
+		if (i < nShapeCoeffs)
+		{
+			coefficients[i] += delta;
+		}
+		else if (i < nShapeCoeffs + nExpressionCoeffs)
+		{
+			float& c = coefficients[nShapeCoeffsTotal + i - nShapeCoeffs];
+			c = glm::clamp(c + delta, -0.5f, 0.5f);
+		}
+		else if (i < nFaceCoeffs)
+		{
+			coefficients[nShapeCoeffsTotal + nExpressionCoeffsTotal + i - nShapeCoeffs - nExpressionCoeffs] += delta;
+		}
+		else
+		{
+			coefficients[nShapeCoeffsTotal + nExpressionCoeffsTotal + nAlbedoCoeffsTotal + i - nFaceCoeffs] += delta;
+		}
+	}
+}
+
+void GaussNewtonSolver::updateCoefficients(const float* result_gpu, Face& face, const FaceUnknowns& unknowns)
+{
+	const int n = unknowns.nFaceCoeffs + unknowns.nSHCoeffs;
+	if (n == 0)
+	{
+		return; //pose only
+	}
+	static const auto config = util::getLaunchConfig1D(cuUpdateCoefficients);
+	cuUpdateCoefficients << <config.getGridSize(n), config.block_size, 0, m_stream >> > (result_gpu, face.m_coefficients_gpu.getPtr(),
+		unknowns.nShapeCoeffs, unknowns.nExpressionCoeffs, unknowns.nAlbedoCoeffs, unknowns.nSHCoeffs, face.m_shape_coefficients.size(),
+		face.m_expression_coefficients.size(), face.m_albedo_coefficients.size());
+	face.markCoefficientsChanged((unknowns.nShapeCoeffs > 0 ? Face::kShapeGroup : 0) | (unknowns.nExpressionCoeffs > 0 ? Face::kExpressionGroup : 0) |
+		(unknowns.nAlbedoCoeffs > 0 ? Face::kAlbedoGroup : 0) | (unknowns.nSHCoeffs > 0 ? Face::kLightingGroup : 0));
+}
+
+__device__ inline unsigned int hashIndex(unsigned int x)
+{
+	// PCG hash
+	unsigned int state = x * 747796405u + 2891336453u;
+	unsigned int word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+	return (word >> 22u) ^ word;
+}
+
+__global__ void cuSampleVisiblePixels(const VisiblePixel* visible_pixels, VisiblePixel* sampled_pixels, int nVisiblePixels, int nSamples, unsigned int seed)
+{
+	int i = util::getThreadIndex1D();
+	if (i >= nSamples)
+	{
+		return;
+	}
+
+	// Jittered position inside the i-th stratum of the list
+	const float jitter = (hashIndex(seed ^ hashIndex(i)) & 0xFFFFFF) / static_cast<float>(0x1000000);
+	const int index = glm::min(static_cast<int>((i + jitter) * nVisiblePixels / nSamples), nVisiblePixels - 1);
+
+	sampled_pixels[i] = visible_pixels[index];
+}
+
+VisiblePixel* GaussNewtonSolver::sampleVisiblePixels(const int nVisiblePixels, const int nSamples, const unsigned int seed)
+{
+	util::ensureSize(m_sampled_pixels, nSamples);
+
+	const int threads = 256;
+	const int block = (nSamples + threads - 1) / threads;
+	cuSampleVisiblePixels << <block, threads, 0, m_stream >> > (m_visible_pixels.getPtr(), m_sampled_pixels.getPtr(), nVisiblePixels, nSamples, seed);
+
+	return m_sampled_pixels.getPtr();
+}
+
+// Flags the tiles (see TiledBasis) of the three vertices of every pixel. All writes store 1, so they need no atomics.
+__global__ void cuMarkBasisTiles(const VisiblePixel* __restrict__ visible_pixels, const int nPixels, const int verticesPerTile,
+	unsigned char* __restrict__ flags)
+{
+	const int i = util::getThreadIndex1D();
+	if (i >= nPixels)
+	{
+		return;
+	}
+
+	const int3 ids = visible_pixels[i].vertex_ids;
+	flags[ids.x / verticesPerTile] = 1;
+	flags[ids.y / verticesPerTile] = 1;
+	flags[ids.z / verticesPerTile] = 1;
+}
+
+void GaussNewtonSolver::requireBasisTiles(TiledBasis& tiles, const VisiblePixel* visible_pixels, const int n_pixels)
+{
+	util::ensureSize(m_basis_tile_flags, tiles.getTileCount());
+	m_basis_tile_flags.memset(0, m_stream);
+	if (n_pixels > 0)
+	{
+		const int threads = 256;
+		const int block = (n_pixels + threads - 1) / threads;
+		cuMarkBasisTiles << <block, threads, 0, m_stream >> > (visible_pixels, n_pixels, tiles.getVerticesPerTile(), m_basis_tile_flags.getPtr());
+	}
+	m_basis_tile_flags_host.resize(tiles.getTileCount());
+	CHECK_CUDA_ERROR(cudaMemcpyAsync(m_basis_tile_flags_host.data(), m_basis_tile_flags.getPtr(), m_basis_tile_flags_host.size(),
+		cudaMemcpyDeviceToHost, m_stream));
+	CHECK_CUDA_ERROR(cudaStreamSynchronize(m_stream));
+	tiles.require(m_basis_tile_flags_host, m_stream);
+}
+
+__global__ void cuSquaredNorm(const float* f, const int n, float* loss)
+{
+	__shared__ float shared[256];
+
+	float sum = 0.0f;
+	for (int i = util::getThreadIndex1D(); i < n; i += blockDim.x * gridDim.x)
+	{
+		sum += f[i] * f[i];
+	}
+	sum = blockReduceSum(sum, shared);
+
+	if (threadIdx.x == 0)
+	{
+		atomicAdd(loss, sum);
+	}
+}
+
+void GaussNewtonSolver::computeSquaredNorm(const float* f, const int n, float* loss)
+{
+	const int threads = 256;
+	const int block = std::min((n + threads - 1) / threads, 256);
+	cuSquaredNorm << <block, threads, 0, m_stream >> > (f, n, loss);
+}
+
+// One block, there are only a few hundred coefficients.
+__global__ void cuRegularizerEnergy(const JacobianInput input, float* loss)
+{
+	__shared__ float shared[256];
+
+	float sum = 0.0f;
+	for (int i = threadIdx.x; i < input.nFaceCoeffs; i += blockDim.x)
+	{
+		const float residual = input.wReg * regularizedCoefficient(input, i);
+		sum += residual * residual;
+	}
+	sum = blockReduceSum(sum, shared);
+
+	if (threadIdx.x == 0)
+	{
+		atomicAdd(loss, sum);
+	}
+}
+
+// Interpolated albedo and SH bands of a pixel of the dense term, as the dense Jacobian evaluates them.
+__device__ void computeLightingTerms(const JacobianInput& input, const VisiblePixel& pixel, glm::vec3& albedo, float bands[9])
+{
+	const int number_of_vertices = input.nVerticesTimes3 / 3;
+	const glm::vec3* albedos = input.current_face + number_of_vertices;
+	const float4* aligned_albedos = input.aligned_face ? input.aligned_face + number_of_vertices : nullptr;
+	const float4 b = pixel.barycentrics_light;
+	const int3 v = pixel.vertex_ids;
+	albedo = b.x * util::loadVertex(albedos, aligned_albedos, v.x) + b.y * util::loadVertex(albedos, aligned_albedos, v.y) +
+		b.z * util::loadVertex(albedos, aligned_albedos, v.z);
+	const glm::vec3 normal = glm::normalize(b.x * input.vertex_shading[v.x].normal + b.y * input.vertex_shading[v.y].normal +
+		b.z * input.vertex_shading[v.z].normal);
+
+	bands[0] = 1.0f;
+	bands[1] = normal.y;
+	bands[2] = normal.z;
+	bands[3] = normal.x;
+	bands[4] = normal.x * normal.y;
+	bands[5] = normal.y * normal.z;
+	bands[6] = 3.0f * normal.z * normal.z - 1.0f;
+	bands[7] = normal.x * normal.z;
+	bands[8] = normal.x * normal.x - normal.y * normal.y;
+}
+
+// Lower triangle of the 9x9 matrix row by row, then the right hand side.
+constexpr int kLightingSystemSize = 45 + 9;
+constexpr int kLightingThreads = 256;
+
+// Normal equations of the SH coefficients alone. A pixel has the rows albedo * bands and the residuals albedo * light - frame,
+// weighted with the IRLS weight of the dense term at the current lighting. The sums are reduced per block, one atomic per entry.
+__global__ void cuAccumulateLightingSystem(const JacobianInput input, float* system)
+{
+	__shared__ float shared[kLightingThreads];
+
+	float sums[kLightingSystemSize] = {};
+	for (int i = util::getThreadIndex1D(); i < input.nPixels; i += util::getGridStride1D())
+	{
+		const VisiblePixel pixel = input.visible_pixels[i];
+		glm::vec3 albedo;
+		float bands[9];
+		computeLightingTerms(input, pixel, albedo, bands);
+
+		const int index = 3 * (pixel.x + pixel.y * input.imageWidth);
+		const glm::vec3 frame(input.image[index] / 255.0f, input.image[index + 1] / 255.0f, input.image[index + 2] / 255.0f);
+		const glm::vec3 residual = glm::vec3(pixel.rgb.x, pixel.rgb.y, pixel.rgb.z) - frame;
+		const float weight = 1.0f / glm::sqrt(glm::max(glm::length(residual), 1.0e-8f));
+
+		const float lhs = weight * glm::dot(albedo, albedo);
+		const float rhs = weight * glm::dot(albedo, frame);
+		int k = 0;
+		for (int row = 0; row < 9; ++row)
+		{
+			for (int col = 0; col <= row; ++col)
+			{
+				sums[k++] += lhs * bands[row] * bands[col];
+			}
+		}
+		for (int row = 0; row < 9; ++row)
+		{
+			sums[45 + row] += rhs * bands[row];
+		}
+	}
+
+	for (int k = 0; k < kLightingSystemSize; ++k)
+	{
+		const float sum = blockReduceSum(sums[k], shared);
+		if (threadIdx.x == 0)
+		{
+			atomicAdd(&system[k], sum);
+		}
+	}
+}
+
+// Rendered color and light of the pixels for new SH coefficients, as face.frag computes them.
+__global__ void cuRelightVisiblePixels(const JacobianInput input, const float* sh_coefficients)
+{
+	for (int i = util::getThreadIndex1D(); i < input.nPixels; i += util::getGridStride1D())
+	{
+		VisiblePixel& pixel = input.visible_pixels[i];
+		glm::vec3 albedo;
+		float bands[9];
+		computeLightingTerms(input, pixel, albedo, bands);
+
+		float light = 0.0f;
+		for (int k = 0; k < 9; ++k)
+		{
+			light += sh_coefficients[k] * bands[k];
+		}
+		pixel.barycentrics_light.w = light;
+		pixel.rgb = make_float3(light * albedo.x, light * albedo.y, light * albedo.z);
+	}
+}
+
+void GaussNewtonSolver::solveLighting(Face& face, const JacobianInput& input)
+{
+	if (input.nPixels < 9)
+	{
+		return;
+	}
+
+	util::ScopedTimer timer("Closed-form lighting", true, m_stream);
+	util::ensureSize(m_lighting_system, kLightingSystemSize);
+	m_lighting_system.memset(0, m_stream);
+
+	//The system is tiny, a few blocks saturate the atomics already.
+	const int blocks = std::min((input.nPixels + kLightingThreads - 1) / kLightingThreads, 64);
+	cuAccumulateLightingSystem << <blocks, kLightingThreads, 0, m_stream >> > (input, m_lighting_system.getPtr());
+
+	float system[kLightingSystemSize];
+	util::copy(util::hostSpan(system, kLightingSystemSize), m_lighting_system.span(0, kLightingSystemSize));
+
+	Eigen::Matrix<float, 9, 9> lhs;
+	Eigen::Matrix<float, 9, 1> rhs;
+	int k = 0;
+	for (int row = 0; row < 9; ++row)
+	{
+		for (int col = 0; col <= row; ++col)
+		{
+			lhs(row, col) = lhs(col, row) = system[k++];
+		}
+		rhs(row) = system[45 + row];
+	}
+	//Bands of a small patch of the face are nearly collinear, a tiny ridge keeps the system regular.
+	lhs.diagonal().array() += 1.0e-6f * (lhs.trace() / 9.0f + 1.0f);
+	const Eigen::Matrix<float, 9, 1> sh = lhs.ldlt().solve(rhs);
+	if (!sh.allFinite())
+	{
+		std::cout << "Warning: closed-form lighting failed, the SH coefficients are kept." << std::endl;
+		return;
+	}
+
+	for (int i = 0; i < 9; ++i)
+	{
+		face.m_sh_coefficients[i] = sh(i);
+	}
+	float* sh_gpu = face.m_coefficients_gpu.getPtr() + face.m_shape_coefficients.size() + face.m_expression_coefficients.size() +
+		face.m_albedo_coefficients.size();
+	CHECK_CUDA_ERROR(cudaMemcpyAsync(sh_gpu, face.m_sh_coefficients.data(), 9 * sizeof(float), cudaMemcpyHostToDevice, m_stream));
+	face.markCoefficientsChanged(Face::kLightingGroup);
+	relightVisiblePixels(input, sh_gpu);
+}
+
+void GaussNewtonSolver::relightVisiblePixels(const JacobianInput& input, const float* sh_coefficients)
+{
+	if (input.nPixels <= 0)
+	{
+		return;
+	}
+	static const auto config = util::getLaunchConfig1D(cuRelightVisiblePixels);
+	cuRelightVisiblePixels << <config.getGridSize(input.nPixels), config.block_size, 0, m_stream >> > (input, sh_coefficients);
+}
+
+void GaussNewtonSolver::computeEnergy(const JacobianInput& input, const float* residuals, float* loss)
+{
+	computeSquaredNorm(residuals, input.nResiduals, loss);
+	if (input.nFaceCoeffs > 0)
+	{
+		cuRegularizerEnergy << <1, 256, 0, m_stream >> > (input, loss);
+	}
+}
+
+void GaussNewtonSolver::computeConvergenceValues(const JacobianInput& input, const SolverWorkspace& workspace, const int nPcgUnknowns,
+	float* values)
+{
+	// The landmark rows come first, see computeJacobianRows.
+	const int nSparseRows = 2 * input.nFeatures;
+	if (nSparseRows > 0)
+	{
+		computeSquaredNorm(workspace.residuals.getPtr(), nSparseRows, values);
+	}
+	if (input.nResiduals > nSparseRows)
+	{
+		computeSquaredNorm(workspace.residuals.getPtr() + nSparseRows, input.nResiduals - nSparseRows, values + 1);
+	}
+	if (input.nFaceCoeffs > 0)
+	{
+		cuRegularizerEnergy << <1, 256, 0, m_stream >> > (input, values + 2);
+	}
+	if (nPcgUnknowns > 0)
+	{
+		computeSquaredNorm(workspace.r.getPtr(), nPcgUnknowns, values + 3);
+	}
+}
+
+constexpr int kFrameDifferenceThreads = 256;
+
+// Sum of the absolute differences of two frames, one atomic per block.
+__global__ void cuFrameDifference(const uchar* frame, const uchar* reference, int n, float* sum)
+{
+	__shared__ float shared[kFrameDifferenceThreads];
+
+	float difference = 0.0f;
+	for (int i = util::getThreadIndex1D(); i < n; i += util::getGridStride1D())
+	{
+		difference += fabsf(static_cast<float>(frame[i]) - static_cast<float>(reference[i]));
+	}
+	difference = blockReduceSum(difference, shared);
+	if (threadIdx.x == 0)
+	{
+		atomicAdd(sum, difference);
+	}
+}
+
+float GaussNewtonSolver::computeFrameDifference(const uchar* frame, const uchar* reference, const int n)
 {
-	cuElementwiseMultiplication << <1, nElements >> > (v1, v2, out);
-	cudaDeviceSynchronize();
-}
\ No newline at end of file
+	util::ensureSize(m_motion_difference, 1);
+	m_motion_difference.memset(0, m_stream);
+
+	//The coarsest level is small, a few blocks cover it.
+	const int blocks = std::min((n + kFrameDifferenceThreads - 1) / kFrameDifferenceThreads, 64);
+	cuFrameDifference << <blocks, kFrameDifferenceThreads, 0, m_stream >> > (frame, reference, n, m_motion_difference.getPtr());
+
+	float sum = 0.0f;
+	util::copy(util::hostSpan(&sum, 1), m_motion_difference.span(0, 1));
+	return sum / std::max(n, 1);
+}
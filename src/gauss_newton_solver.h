@@ -1,12 +1,64 @@
-#pragma once
+﻿#pragma once
 
+#include "async_image_writer.h"
+#include "execution_context.h"
 #include "face.h"
 #include "pyramid.h"
+#include "rasterizer.h"
+#include "landmark_filter.h"
+#include "landmark_solver.h"
+#include "linear_solver.h"
 
 #include <Eigen/Dense>
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <cusolverDn.h>
 #include "opencv2/highgui/highgui.hpp"
 #include "opencv2/imgproc/imgproc.hpp"
 
+//Energy terms, parameter groups and iteration counts of one pyramid level.
+struct LevelSchedule
+{
+	int num_gn_iterations = 1;
+	int num_pcg_iterations = 5;
+
+	//Without the dense term the level isn't rendered. Albedo and lighting are fixed then, only the dense term observes them.
+	bool use_sparse_term = true;
+	bool use_dense_term = true;
+
+	//Intrinsics and pose are always optimized. The groups are capped by num_*_coefficients and a locked identity.
+	bool optimize_shape = true;
+	bool optimize_expressions = true;
+	bool optimize_albedo = true;
+	bool optimize_lighting = true;
+
+	//Normal equations only: after an assembly, this many GN iterations keep its JTJ. They recompute J^T f alone, which still
+	//evaluates the rows but skips their products, the bulk of the assembly. The gradient stays exact, so the fixed point
+	//doesn't change, only the steps get less accurate as the pose moves away from the assembly.
+	int jtj_reuse_iterations = 0;
+
+	//Mesh the level renders and differentiates, see Face::setLevelOfDetail. 0 is the full mesh, coarser pyramid levels can
+	//use coarser ones to save the blendshapes, normals, rasterization and vertex shading of vertices they can't resolve.
+	int level_of_detail = 0;
+};
+
+//Entry type of a stored Jacobian, see SolverParameters::jacobian_precision.
+enum class JacobianPrecision
+{
+	Float32,
+	Float16,	//10 mantissa bits, saturates at +-65504
+	BFloat16,	//8 mantissa bits, the range of FP32
+};
+
 //Default
 struct SolverParameters
 {
@@ -14,20 +66,281 @@ struct SolverParameters
 	float dense_weight_exponent = 0.0f;
 	float regularisation_weight_exponent = -4.6f;
 
-	int num_gn_iterations[3] = { 1, 5, 25 };
-	int num_pcg_iterations = 5;
+	//Indexed by pyramid level, 0 is the finest. Levels past the end use the last entry, so any number of levels is covered.
+	std::vector<LevelSchedule> levels = { { 1 }, { 5 }, { 25 } };
+
+	const LevelSchedule& getLevel(int pyramid_level) const
+	{
+		if (levels.empty())
+		{
+			throw std::runtime_error("Error: Please specify the schedule of at least one pyramid level!");
+		}
+		return levels[std::min(pyramid_level, static_cast<int>(levels.size()) - 1)];
+	}
 
 	int num_shape_coefficients = 80;
 	int num_albedo_coefficients = 80;
 	int num_expression_coefficients = 76;
 
+	//Don't store the Jacobian, recompute its rows in every PCG iteration instead.
+	//Memory scales with the number of unknowns, at the cost of two Jacobian evaluations per PCG iteration.
+	bool use_matrix_free_pcg = false;
+	//Persistent blocks for the kernels which reduce J^T products in shared memory (matrix-free PCG and the right-hand side of a
+	//kept JTJ): as many blocks as fit on the device take tiles of residuals from an atomic queue, and flush their partial sums
+	//once at the end instead of once per tile. Pixels whose rows are cheap (e.g. occluded in the rendering) no longer leave
+	//blocks idle while the others finish.
+	bool use_persistent_threads = false;
+
+	//Store J row by row, i.e. as J^T in column-major order, so the rows of a residual are contiguous and the Jacobian kernels
+	//write whole cache lines instead of one float per column. The PCG gemvs and the normal equations swap their transposes.
+	bool use_row_major_jacobian = false;
+
+	//Run the PCG vector updates and dot products in one kernel per iteration, without reading scalars back to the host.
+	bool use_fused_pcg = false;
+
+	//Inexact Newton: PCG stops once z^T r drops below eta^2 times its value for the right-hand side, i.e. the preconditioned
+	//residual below eta times the preconditioned gradient. eta is the Eisenstat-Walker forcing term (choice 2),
+	//pcg_forcing_gamma * (||g_k|| / ||g_k-1||)^2 over the gradients of successive GN iterations of a level, at most
+	//pcg_max_forcing_term, which the first iteration of a level uses. 0 keeps the absolute kTolerance alone.
+	float pcg_max_forcing_term = 0.0f;
+	float pcg_forcing_gamma = 0.9f;
+	//Start PCG from the step of the previous GN iteration of the level instead of 0, if it had the same unknowns.
+	bool use_pcg_warm_start = false;
+
+	//Capture the Jacobian evaluation and the PCG solve of a GN iteration as a CUDA graph and replay it.
+	//Only used together with use_fused_pcg, the classic PCG reads scalars back to the host.
+	bool use_cuda_graphs = false;
+
+	//Accumulate the nUnknowns x nUnknowns system JTJ and JTr chunk by chunk instead of storing J,
+	//then solve it with a Cholesky factorization (or PCG on JTJ, if use_cholesky is off).
+	bool use_normal_equations = false;
+	bool use_cholesky = true;
+	//Accumulate the normal equations like use_normal_equations, but download them and solve them on the host with an LDLT, see
+	//HostLdltSolver. Costs a stream synchronization per GN iteration, for GPUs with a slow cuSOLVER or few unknowns.
+	bool use_host_ldlt = false;
+
+	//Stored Jacobian only: form JTJ and J^T f from J once per GN iteration, then solve them like use_normal_equations does.
+	//PCG multiplies with the nUnknowns x nUnknowns JTJ then, instead of running two gemvs over all residuals.
+	bool use_jtj_from_jacobian = false;
+	//Form JTJ with a tensor core GEMM and FP32 accumulation: TF32 inputs from CUDA 11 on, FP16 inputs before.
+	//Used by use_jtj_from_jacobian and the chunks of use_normal_equations.
+	bool use_tensor_core_jtj = false;
+
+	//Stored Jacobian only: store J with 16-bit entries, which halves its memory and the bandwidth of every product with it. The
+	//entries are rounded when they are written, the products (gemvs, preconditioners and JTJ) accumulate in FP32. The
+	//normal equations and matrix-free PCG don't store J and keep FP32.
+	JacobianPrecision jacobian_precision = JacobianPrecision::Float32;
+
+	bool storesReducedJacobian() const
+	{
+		return jacobian_precision != JacobianPrecision::Float32 && !use_matrix_free_pcg && !use_normal_equations && !use_host_ldlt;
+	}
+
+	//Read the shape, expression and albedo bases of the Jacobian kernels through linear texture objects instead of pointers,
+	//so the gathers of the vertices of the dense term use the texture cache. Ignored for bases larger than a linear texture.
+	bool use_basis_textures = false;
+
+	//The flags above pick the backend of the linear solve, see getStrategy and LinearSolver.
+	//The backend solves the nUnknowns x nUnknowns system JTJ (with Cholesky, PCG or the host LDLT).
+	bool formsJTJ() const
+	{
+		return !use_matrix_free_pcg && (use_normal_equations || use_host_ldlt || use_jtj_from_jacobian);
+	}
+
+	//Precondition PCG with the inverted diagonal blocks of JTJ (intrinsics and pose, shape, expression, albedo, SH) instead of
+	//its diagonal, which captures the coupling within a block. Matrix-free PCG keeps the diagonal preconditioner.
+	bool use_block_preconditioner = false;
+
+	//Subsampling of the photometric term at the finest pyramid level, redrawn in every GN iteration.
+	//0: all visible pixels, 1: random subset of num_pixel_samples pixels, 2: every pixel_sample_stride-th pixel of a randomly shifted grid.
+	//The dense weight is rescaled by the sampling ratio, so wDense keeps its meaning.
+	int pixel_sampling_mode = 0;
+	int num_pixel_samples = 20000;
+	int pixel_sample_stride = 2;
+
+	//Temporal warm start: extrapolate pose and expressions with the damped velocity of the last frame before solving.
+	bool use_temporal_prediction = true;
+	float prediction_damping = 0.5f;
+	//If the previous frame was tracked, start at this pyramid level instead of the coarsest one.
+	int warm_start_level = 1;
+	//Leave a pyramid level, once ||delta|| of a GN step drops below this. 0 runs all iterations.
+	float convergence_threshold = 1.0e-4f;
+
+	//One-Euro filter of the landmarks of every face before the solve, against the jitter of the detector. The confidences of the
+	//filter weight the sparse term per landmark, also in the landmark-only solve.
+	bool use_landmark_filter = false;
+	LandmarkFilterParameters landmark_filter;
+
+	//Motion gate of solve for static scenes. A frame is static if, compared to the last fully solved frame, the landmarks moved by
+	//at most motion_landmark_threshold (mean distance, NDC) and the coarsest pyramid level of the frame by at most
+	//motion_frame_threshold (mean absolute difference of the channels, 0-255). A static frame keeps the parameters of the last
+	//one and isn't solved, or only with static_solve_iterations GN iterations at level 0 if that's > 0.
+	bool use_motion_gate = false;
+	float motion_landmark_threshold = 0.002f;
+	float motion_frame_threshold = 1.0f;
+	int static_solve_iterations = 0;
+
+	//Levenberg-Marquardt: solve (JTJ + lambda * diag(JTJ)) delta = -JTf instead of the plain GN system. A step which raises ||f||^2
+	//is undone and retried with lambda * lm_lambda_increase, an accepted one lowers lambda by lm_lambda_decrease.
+	//The energy is the one of the residuals of the next iteration, so it costs no extra Jacobian evaluation. Only the last step
+	//of a level is judged by an extra evaluation of the residuals.
+	bool use_levenberg_marquardt = false;
+	float lm_initial_lambda = 1.0e-3f;
+	float lm_lambda_increase = 10.0f;
+	float lm_lambda_decrease = 0.3f;
+	//Leave a pyramid level, once an accepted step lowers the energy by less than this fraction of it. 0 runs all iterations.
+	float lm_relative_decrease_threshold = 1.0e-3f;
+
+	//Progressive activation: the first GN iteration of a frame solves for the leading progressive_initial_coefficients components
+	//of shape, expressions and albedo only, every further iteration doubles them up to the num_*_coefficients above. The bases
+	//are sorted by variance, so the early, coarse iterations get much smaller systems. 0 solves for all of them from the start.
+	int progressive_initial_coefficients = 0;
+
+	//Block-coordinate lighting: at levels with the dense term, the color albedo * SH(normal) is linear in the 9 SH coefficients, so
+	//before every GN iteration they are solved in closed form (9x9 normal equations over the visible pixels) for the current
+	//geometry and albedo, and the GN system leaves them out. Albedo stays in the GN system, or is frozen with LevelSchedule::optimize_albedo.
+	bool use_closed_form_lighting = false;
+
+	//Estimate shape and albedo during the first num_calibration_frames tracked frames, then freeze them in the Face
+	//and only solve for pose, intrinsics, expressions and lighting.
+	bool use_identity_locking = false;
+	int num_calibration_frames = 30;
+	//Identity locking without the lock of solve: the caller collects the calibration frames and solves the identity jointly over
+	//num_calibration_keyframes of them, see IdentityCalibrator and GaussNewtonSolver::solveIdentity. solveBatch still locks.
+	bool use_joint_calibration = false;
+	int num_calibration_keyframes = 6;
+
+	//Render the face with the CUDA rasterizer on the solver stream instead of the GL pipeline and the interop mapping.
+	bool use_cuda_rasterizer = false;
+	//CUDA rasterizer only: drop the triangles which face away from the camera, lie outside the render targets or cover no pixel
+	//center before rasterizing, see Rasterizer::draw.
+	bool use_triangle_culling = false;
+
+	//Render only a window around the face, predicted from the last frame and the landmarks, into the ROI targets of the pyramid
+	//(see Pyramid::setRoiGraphicsSettings). The cost of the dense term then depends on the size of the face in the ROI targets,
+	//not on the resolution of the camera. Ignored without ROI targets.
+	bool use_roi_rendering = false;
+
+	//Reuse the visible pixels of the last render of solve for a GN iteration instead of rendering and mapping again, e.g. in the
+	//first iteration of a frame. Requires the same level, level of detail, active coefficients and render targets, and a geometry
+	//which changed by at most render_reuse_threshold since the render (summed norms of the change of the projection and pose and
+	//of the shape and expression coefficients, 0: unchanged only). The visibility stays, the color and
+	//light of the pixels are evaluated again for the current mesh. Not in solveBatch.
+	bool use_render_reuse = false;
+	float render_reuse_threshold = 0.0f;
+
+	//Solve only focal length, pose and expressions against the landmarks, on the host without rendering (see LandmarkSolver).
+	//Keyframes run the full solve instead and refine identity and lighting: the first tracked frame, the landmark_keyframe_interval-th
+	//frame after the last keyframe (0: never, the dense term is off entirely), and a frame whose landmark error after the landmark
+	//solve exceeds landmark_error_jump times the one of the last keyframe (0: off). The full solve then starts from the landmark fit.
+	bool use_landmark_only = false;
+	int landmark_keyframe_interval = 0;
+	float landmark_error_jump = 2.0f;
+	int num_landmark_iterations = 5;
+
+	//Recovery of solve from a lost face: if the face isn't tracked (the first frame and the frames after the landmarks were lost)
+	//or the RMS distance of its landmark vertices to the landmarks of the frame exceeds recovery_landmark_error (NDC, 0: never),
+	//e.g. after the solver diverged, several hypotheses of pose and expressions start the frame: the last state, the mean face
+	//(no expressions, frontal at the last translation), and the mean face fitted to the landmarks by the LandmarkSolver. They are
+	//solved in lockstep like solveBatch on the num_recovery_levels coarsest levels, the one of the lowest energy at the last of
+	//them replaces the state of the face and the solve continues on the next finer level. The face starts over as a new track.
+	bool use_recovery = false;
+	float recovery_landmark_error = 0.15f;
+	int num_recovery_levels = 1;
+
+	//Hard deadline of solve and solveBatch: once this many milliseconds of host time passed since the call, no further GN
+	//iteration is started and the parameters of the last update are kept, with Levenberg-Marquardt those of the last accepted step.
+	//The steps are read back every iteration, so the host time follows the device. 0: none, see BudgetController.
+	float deadline_ms = 0.0f;
+
+	//0: no loss, otherwise the energies of every GN iteration of solve are reduced on the device and read back once per frame
+	//(getLosses, getConvergence). GaussNewtonSolver::openConvergenceLog turns that on as well.
+	int verbosity = 0;
+
 	const float kNearZero = 1.0e-8;		// interpretation of "zero"
 	const float kTolerance = 1.0e-8;	//convergence if rtr < TOLERANCE
 };
 
+//Result of GaussNewtonSolver::validateHalfPrecisionBasis
+struct BasisPrecisionReport
+{
+	float loss_fp32 = 0.0f; //||f|| after the last GN iteration
+	float loss_fp16 = 0.0f;
+	float max_position_error = 0.0f; //of the mesh synthesized from the same coefficients
+	float max_albedo_error = 0.0f;
+	bool validated = false; //false, if the FP32 bases weren't on the device
+};
+
+//Result of GaussNewtonSolver::evaluateFit
+struct FitQuality
+{
+	float landmark_error = 0.0f; //mean distance of the projected landmark vertices to the landmarks, in pixels of level 0
+	float photometric_error = 0.0f; //mean ||C_S - C_I|| over the covered pixels of level 0, colors in [0, 1]
+	int num_pixels = 0;
+};
+
+//Frame of the calibration phase with the parameters the solver fitted to it, see GaussNewtonSolver::solveIdentity.
+struct CalibrationKeyframe
+{
+	util::DeviceArray<uchar> frame; //BGR, 3 * width bytes per row, see Pyramid::getRawFrame
+	std::vector<glm::vec2> sparse_features;
+	glm::vec3 rotation{ 0.0f };
+	glm::vec3 translation{ 0.0f };
+	std::vector<float> expression;
+	std::vector<float> sh;
+};
+
+//One GN iteration of solve, see GaussNewtonSolver::getConvergence. The energies are ||f||^2 of the residuals of the
+//iteration, i.e. of the parameters before its step.
+struct ConvergenceRecord
+{
+	uint16_t level = 0;
+	uint16_t iteration = 0; //of the level, rejected Levenberg-Marquardt steps have none
+	uint32_t pcg_iterations = 0; //issued, the fused PCG may stop earlier on the device. 0: the step was factorized
+	uint32_t visible_pixels = 0; //of the render of the iteration, 0 without the dense term
+	float sparse_energy = 0.0f;
+	float dense_energy = 0.0f;
+	float regularizer_energy = 0.0f;
+	float step_norm = 0.0f; //||delta|| of all unknowns
+	float pcg_residual = 0.0f; //||r|| of the normal equations after PCG, 0 without PCG
+};
+
+//Header of a convergence log, see GaussNewtonSolver::openConvergenceLog. Each frame follows as its uint32 frame index (solves
+//since the log was opened), its uint32 number of records and that many ConvergenceRecords. Frames without GN iterations
+//(landmarks only, static, not tracked) are left out.
+struct ConvergenceLogHeader
+{
+	char magic[4]{ 'F', 'C', 'N', 'V' };
+	uint32_t version = 1;
+	uint32_t record_size = sizeof(ConvergenceRecord);
+	uint32_t reserved = 0;
+};
+
+//Work done by the last solve or solveBatch, summed over its faces.
+struct SolverStatistics
+{
+	int num_gn_iterations = 0;
+	int num_pcg_iterations = 0; //issued, the fused PCG may stop earlier on the device
+	int num_rejected_steps = 0; //Levenberg-Marquardt steps which raised the energy
+	float final_energy = -1.0f; //of the last accepted Levenberg-Marquardt step of solve, negative without Levenberg-Marquardt
+	int num_reused_renders = 0; //GN iterations with the visible pixels of an earlier render, see use_render_reuse
+	bool motion_gated = false; //a static frame, see use_motion_gate
+	bool deadline_expired = false; //GN iterations were skipped, see SolverParameters::deadline_ms
+	int recovered_hypothesis = -1; //solve started from this hypothesis, see SolverParameters::use_recovery
+	//Level whose GL render targets hold the face as drawn by the last GN iteration of solve, i.e. before the last update.
+	//With Levenberg-Marquardt it's the render which judged the last step, so the face after that step, even if it was undone.
+	//-1: nothing drawn (not tracked, CUDA rasterizer, ROI rendering, solveBatch).
+	int final_render_level = -1;
+};
+
+//Added to the diagonal of a JTJ before it is factorized. The regularizer only makes the face coefficients SPD, the 7 pose and
+//focal unknowns and the SH ones have zero columns for a face without visible pixels.
+constexpr float kJTJDiagonalEpsilon = 1.0e-6f;
+
 struct FaceBoundingBox
 {
 	unsigned int num_visible_pixels = 0; 
+	unsigned int num_covered_pixels = 0; //pixels fully covered by the face, i.e. entries of the visible pixel list
 	unsigned int x_min = UINT_MAX;
 	unsigned int y_min = UINT_MAX;
 	unsigned int x_max = 0;
@@ -36,6 +349,223 @@ struct FaceBoundingBox
 	unsigned int height = 0; 
 };
 
+//Frame pixels the render targets cover, see Face::GraphicsSettings::crop. Pixel (x, y) of the targets is pixel
+//(this->x + x * stride, this->y + y * stride) of the frame, pixels outside of the frame are background.
+struct RenderWindow
+{
+	int frame_width = 0; //0: the targets are the frame
+	int frame_height = 0;
+	int x = 0;
+	int y = 0;
+	int stride = 1;
+	//Lower left corner of the targets in their textures, see Face::GraphicsSettings::target_x.
+	int target_x = 0;
+	int target_y = 0;
+};
+
+//Running reduction of cuComputeVisiblePixelsAndBB, one atomic per block and field. The last block of a launch writes the
+//result and resets it, so it is uploaded only once.
+struct FaceBoundingBoxAccumulator
+{
+	FaceBoundingBox bb;
+	unsigned int finished_blocks = 0;
+	unsigned int next_tile = 0; //tiles are handed out in order, see cuComputeVisiblePixelsAndBB
+};
+
+//Inputs of cuComputeVisiblePixelsAndBB for the packed visibility buffer, see Pyramid. The render target only holds the
+//triangle and two barycentrics, the rest of a VisiblePixel is interpolated from the current face like face.frag does.
+struct PackedVisibility
+{
+	cudaTextureObject_t texture = 0; //0 if the separate render targets are used
+	const glm::ivec3* faces = nullptr;
+	const glm::vec3* current_face = nullptr; //positions, colors, normals
+	const float4* aligned_face = nullptr; //the same as float4, nullptr without Face::setAlignedVertices
+	int number_of_vertices = 0;
+	glm::mat3 rotation;
+	const float* sh_coefficients = nullptr;
+};
+
+//Render target samples of a pixel covered by the face. The dense term iterates over a compact list of these,
+//so background pixels of the bounding box don't produce (zero) residual rows.
+struct VisiblePixel
+{
+	float4 barycentrics_light; //w is light
+	float3 rgb;
+	int3 vertex_ids;
+	int x;
+	int y;
+};
+
+//Pixel independent shading terms of a vertex, computed once per GN iteration by cuComputeVertexShading. The dense term blends
+//those of its three vertices with the barycentrics instead of evaluating them for every pixel again. Only the vertices of
+//the pixels in the dense term are filled in, the others keep stale values.
+struct VertexShading
+{
+	glm::vec3 normal; //rotated by the face pose and normalized
+	float dnormal[9]; //column-major Jacobian of the normalization of the rotated normal
+};
+
+//Everything the Jacobian kernels need to evaluate the residual rows of one GN iteration.
+//Shared by the dense Jacobian assembly and the matrix-free operators.
+struct JacobianInput
+{
+	FaceBoundingBox face_bb;
+	int nFeatures = 0;
+	int imageWidth = 0;
+	int imageHeight = 0;
+	int nFaceCoeffs = 0;
+	int nPixels = 0; //number of visible pixels
+	int n = 0; //number of threads, nFeatures + nPixels. The regularizer has no rows, see GaussNewtonSolver::addRegularizer.
+	int nShapeCoeffs = 0;
+	int nExpressionCoeffs = 0;
+	int nAlbedoCoeffs = 0;
+	int nSHCoeffs = 0; //9 or 0, if the lighting is fixed at this level
+	int nUnknowns = 0;
+	int nResiduals = 0;
+	int nVerticesTimes3 = 0; //of the current level of detail
+	int nBasisRows = 0; //3 * vertices of the model, the column stride of column-major bases
+	int nExpressionBasisRows = 0; //fewer with a sparse expression basis, see FaceModel::getExpressionBasisRows
+	int nShapeCoeffsTotal = 0;
+	int nExpressionCoeffsTotal = 0;
+	int nAlbedoCoeffsTotal = 0;
+	float wSparse = 0.0f;
+	float wDense = 0.0f;
+	float wReg = 0.0f;
+
+	const uchar* image = nullptr;
+	cudaTextureObject_t image_gradient_x = 0; //see FrameGradients
+	cudaTextureObject_t image_gradient_y = 0;
+
+	glm::mat4 face_pose;
+	glm::mat3 drx;
+	glm::mat3 dry;
+	glm::mat3 drz;
+	glm::mat4 projection;
+	Eigen::Matrix3f jacobian_local;
+
+	int* prior_local_ids = nullptr;
+	glm::vec3* current_face = nullptr;
+	const float4* aligned_face = nullptr; //see Face::getAlignedFaceGpu, read instead of current_face if it is set
+	glm::vec2* sparse_features = nullptr;
+	const float* sparse_weights = nullptr; //per landmark, multiplies wSparse. nullptr: 1, see SolverParameters::use_landmark_filter
+	VisiblePixel* visible_pixels = nullptr;
+	const VertexShading* vertex_shading = nullptr; //one entry per vertex
+
+	float* p_shape_basis = nullptr;
+	float* p_expression_basis = nullptr;
+	float* p_albedo_basis = nullptr;
+	//See FaceModel::landmark_shape_basis_gpu, row 3 * i is the first one of landmark i. FP32 in both precisions.
+	const float* p_landmark_shape_basis = nullptr;
+	const float* p_landmark_expression_basis = nullptr;
+
+	//FP16 bases divided by their scale, see Face::setHalfPrecisionBasis. Used instead of p_*_basis if half_precision_basis is set.
+	bool half_precision_basis = false;
+	const Eigen::half* p_shape_basis_half = nullptr;
+	const Eigen::half* p_expression_basis_half = nullptr;
+	const Eigen::half* p_albedo_basis_half = nullptr;
+	float shape_basis_scale = 1.0f;
+	float expression_basis_scale = 1.0f;
+	float albedo_basis_scale = 1.0f;
+	//See Face::setVertexMajorBasis. The dense Jacobian is then assembled by warps, a pixel at a time.
+	bool vertex_major_basis = false;
+	//See FaceModel::expression_vertex_map_gpu, nullptr for a dense expression basis.
+	const int* p_expression_vertex_map = nullptr;
+	//Map of a tiled basis (TiledBasis::getVertexMapGpu) for the shape and albedo bases, nullptr otherwise. The expression rows
+	//then go through p_expression_vertex_map, which is the same map.
+	const int* p_basis_vertex_map = nullptr;
+	//Linear textures over the bases of the precision in use, see SolverParameters::use_basis_textures. 0: read the pointers.
+	cudaTextureObject_t shape_basis_texture = 0;
+	cudaTextureObject_t expression_basis_texture = 0;
+	cudaTextureObject_t albedo_basis_texture = 0;
+
+	const float* p_coefficients_shape = nullptr;
+	const float* p_coefficients_expression = nullptr;
+	const float* p_coefficients_albedo = nullptr;
+	const float* p_coefficients_sh = nullptr;
+
+	cudaTextureObject_t rgb = 0;
+	cudaTextureObject_t barycentrics = 0;
+	cudaTextureObject_t vertex_ids = 0;
+};
+
+//Diagonal blocks of the block-Jacobi preconditioner, back to back over all unknowns. Blocks with more than kMaxSize unknowns
+//are split, so every block is inverted in shared memory.
+struct PreconditionerBlocks
+{
+	static constexpr int kMaxBlocks = 32;
+	static constexpr int kMaxSize = 96;
+
+	int count = 0; //0: diagonal preconditioner
+	int offsets[kMaxBlocks]; //first unknown of the block
+	int sizes[kMaxBlocks];
+	int storage[kMaxBlocks]; //first entry of its column-major inverse in SolverWorkspace::M_blocks
+	int storage_size = 0;
+	int max_size = 0;
+};
+
+//Device buffers of one pyramid level. They are allocated on the first frame and reused afterwards,
+//so the GN loop itself doesn't call cudaMalloc/cudaFree.
+struct SolverWorkspace
+{
+	util::DeviceArray<float> jacobian;
+	util::DeviceArray<uint16_t> jacobian_16; //instead of "jacobian" for a reduced jacobian_precision
+	util::DeviceArray<float> residuals;
+	util::DeviceArray<float> result;
+
+	//PCG vectors
+	util::DeviceArray<float> r;
+	util::DeviceArray<float> p;
+	util::DeviceArray<float> M;
+	util::DeviceArray<float> z;
+	util::DeviceArray<float> Jp;
+	util::DeviceArray<float> JTJp;
+	util::DeviceArray<float> pcg_scalars; //fused PCG: zTr, the converged flag and the inexact Newton state, see cuFusedPCGInit
+	PreconditionerBlocks preconditioner_blocks; //see SolverParameters::use_block_preconditioner
+	util::DeviceArray<float> M_blocks;
+
+	cudaGraphExec_t graph_exec{ nullptr }; //owned by GaussNewtonSolver
+
+	//Inexact Newton state of the classic PCG (the fused PCG keeps it in pcg_scalars), see SolverParameters::pcg_max_forcing_term.
+	float pcg_previous_zTr = 0.0f; //z^T r of the right-hand side of the previous GN iteration, 0: none
+	float pcg_forcing_term = 0.0f;
+	int warm_start_unknowns = 0; //unknowns of the step in "result" PCG can start from, 0: none
+
+	//Normal equations, the lower triangle of JTJ is valid
+	util::DeviceArray<float> jtj;
+	util::DeviceArray<float> jtj_damped; //damped and factorized instead of jtj, while JTJ is kept (LevelSchedule::jtj_reuse_iterations)
+	int jtj_age = -1; //GN iterations since jtj was assembled, -1: nothing assembled at this level
+	int jtj_unknowns = 0;
+	util::DeviceArray<float> cholesky_buffer;
+	util::DeviceArray<int> cholesky_info;
+
+	//"nJacobianRows" is the number of Jacobian rows kept at once: 0 for matrix-free, a chunk for the normal equations.
+	//"reduced_jacobian" keeps them in jacobian_16 instead of jacobian, see SolverParameters::storesReducedJacobian.
+	void reserve(int nResiduals, int nUnknowns, int nJacobianRows, bool with_normal_equations, bool reduced_jacobian = false);
+	//jacobian_16 or jacobian, whichever holds the Jacobian.
+	void* getJacobian();
+	//Forgets the previous GN iterations (PCG state, kept JTJ), at the start of a level.
+	void resetLevelState(cudaStream_t stream);
+};
+
+//Eisenstat-Walker forcing term of a GN iteration, from z^T r of its right-hand side and the one of the previous iteration.
+__host__ __device__ inline float computeForcingTerm(const float max_forcing_term, const float gamma, const float zTr,
+	const float previous_zTr, const float previous_forcing_term)
+{
+	if (previous_zTr <= 0.0f)
+	{
+		return max_forcing_term;
+	}
+	//z^T r is a squared norm, so this is the squared ratio of the gradients already.
+	float forcing_term = gamma * zTr / previous_zTr;
+	//Safeguard, the term doesn't drop much faster than the previous one while that one is still large.
+	const float safeguard = gamma * previous_forcing_term * previous_forcing_term;
+	if (safeguard > 0.1f)
+	{
+		forcing_term = fmaxf(forcing_term, safeguard);
+	}
+	return fminf(forcing_term, max_forcing_term);
+}
+
 ////Debug
 //struct SolverParameters
 //{
@@ -56,66 +586,479 @@ struct FaceBoundingBox
 class GaussNewtonSolver
 {
 public:
-	GaussNewtonSolver();
+	//Without a context the solver creates its own, see getExecutionContext.
+	explicit GaussNewtonSolver(const SolverParameters& params = SolverParameters(), std::shared_ptr<util::ExecutionContext> context = nullptr);
 	~GaussNewtonSolver();
 
-	void solve(const std::vector<glm::vec2>& sparse_features, Face& face, cv::Mat& frame, glm::mat4& projection, const Pyramid& pyramid);
+	//The frame has to be uploaded with pyramid.uploadFrame before.
+	void solve(const std::vector<glm::vec2>& sparse_features, Face& face, glm::mat4& projection, const Pyramid& pyramid);
+
+	//Several faces of the same frame, entry i of every vector belongs to face i. Faces without features are skipped.
+	//The GN iterations run in lockstep: every face assembles its normal equations, then all systems of the same size are
+	//factorized and solved by one batched Cholesky. Always uses the normal equations, a single face is passed on to solve.
+	void solveBatch(const std::vector<std::vector<glm::vec2>>& sparse_features, const std::vector<Face*>& faces,
+		const std::vector<glm::mat4*>& projections, const Pyramid& pyramid);
+	//Same, but face i is solved against the frame in pyramids[i], e.g. consecutive frames of a video with one face per frame
+	//(see BatchSettings::frame_batch_size). The pyramids have the same size and number of levels.
+	void solveBatch(const std::vector<std::vector<glm::vec2>>& sparse_features, const std::vector<Face*>& faces,
+		const std::vector<glm::mat4*>& projections, const std::vector<const Pyramid*>& pyramids);
+
+	//||f|| of every GN iteration of the last frame that finished, coarsest level first. Empty if verbosity is 0.
+	const std::vector<float>& getLosses() const { return m_losses; }
+	//The same iterations, split into their terms, see ConvergenceRecord.
+	const std::vector<ConvergenceRecord>& getConvergence() const { return m_convergence; }
+	//Appends the records of every following solve to "filepath", see ConvergenceLogHeader. They are written when collectLosses
+	//picks them up, so the log costs no synchronization. Throws, if the file can't be opened. Closes a log that is open.
+	void openConvergenceLog(const std::string& filepath);
+	//Writes the records of the last solve and closes the log, the destructor does so as well.
+	void closeConvergenceLog();
+	//Picks up the losses copied at the end of the previous solve. solve calls it, so this is only needed after the last frame.
+	void collectLosses();
+	const SolverStatistics& getStatistics() const { return m_statistics; }
+
+	//Solves the same frame twice, from the same state and identity lock, with the FP32 bases on the device and with FP16 copies
+	//quantized from them (Face::useQuantizedBases), and compares the losses. Leaves face, projection and the bases as they were.
+	//Without FP32 bases on the device the report isn't validated.
+	BasisPrecisionReport validateHalfPrecisionBasis(const std::vector<glm::vec2>& sparse_features, Face& face, glm::mat4& projection, const Pyramid& pyramid);
+
+	//Renders "face" at pyramid level 0 and measures how well it fits the frame and the landmarks. Always over all covered pixels,
+	//whatever pixel_sampling_mode is, so fits of differently configured solvers can be compared.
+	FitQuality evaluateFit(const std::vector<glm::vec2>& sparse_features, Face& face, const glm::mat4& projection, const Pyramid& pyramid);
+
+	//Unlocks the identity of "face" and starts a new calibration phase. "face_index" is its index in solveBatch.
+	void recalibrate(Face& face, int face_index = 0);
+
+	//Fits one identity (shape, albedo, intrinsics) to all keyframes at once, with a pose, expressions and lighting per keyframe,
+	//and locks it in "face". Every GN iteration assembles the normal equations of each keyframe with the dense and sparse
+	//Jacobian of solve, then eliminates the per-keyframe unknowns (Schur complement of their blocks) and solves the reduced
+	//system of the shared ones. The keyframes are uploaded into "pyramid" one after the other, it holds the last one afterwards.
+	//Pose, expressions and lighting of "face" stay, the keyframes hold their refined parameters.
+	void solveIdentity(std::vector<CalibrationKeyframe>& keyframes, Face& face, glm::mat4& projection, Pyramid& pyramid);
+
+	//Writes the render targets of the next "num_frames" frames which solve renders at pyramid level 0 to
+	//"<path_prefix>_<n>_rgb.png" (the rendered face over the frame) and "<path_prefix>_<n>_deferred.png" (albedo times light of
+	//the deferred targets), n counts the captured frames. They are converted on the device and copied off the compute stream,
+	//a background thread writes them (see util::AsyncImageWriter), so the frame loop doesn't wait. Restarts a running capture.
+	void captureDebugFrames(int num_frames, const std::string& path_prefix = "debug");
+	bool isCapturingDebugFrames() const { return m_num_debug_frames > 0; }
+
+	//Stream of all solver launches. Work on it, e.g. Pyramid::uploadFrame, is ordered with the next solve.
+	cudaStream_t getStream() const { return m_stream; }
+	//Streams and handles of the solver, e.g. to share them with the face and the pyramid of the frame.
+	const std::shared_ptr<util::ExecutionContext>& getExecutionContext() const { return m_context; }
 
 	SolverParameters& getSolverParameters() { return m_params; }
 	const SolverParameters& getSolverParameters() const { return m_params; }
+	//Backend of "strategy", e.g. to time it on its own. The GN iterations use the one of getStrategy(getSolverParameters()).
+	LinearSolver& getLinearSolver(SolverStrategy strategy) { return *m_linear_solvers[static_cast<int>(strategy)]; }
+	const LinearSolver& getLinearSolver(SolverStrategy strategy) const { return *m_linear_solvers[static_cast<int>(strategy)]; }
+
+	//Tracked state of the previous frame, used for the temporal prediction.
+	struct TemporalState
+	{
+		glm::vec3 rotation{ 0.0f };
+		glm::vec3 translation{ 0.0f };
+		std::vector<float> expression;
+	};
+	struct FaceState
+	{
+		TemporalState last_state;
+		TemporalState velocity;
+		int num_tracked_frames = 0;
+		int num_calibration_frames = 0;
+		//Keyframe schedule of use_landmark_only
+		int num_frames_since_keyframe = 0;
+		float keyframe_landmark_error = 0.0f; //0: no keyframe yet
+		bool predicted = false; //parameters of this frame already moved along the velocity
+		//use_roi_rendering: window of this frame and the face as rendered by the last dense iteration (x, y, width, height,
+		//normalized to the frame, y down). A zero width means nothing was rendered.
+		glm::vec4 face_rect{ 0.0f, 0.0f, 1.0f, 1.0f };
+		glm::vec4 rendered_rect{ 0.0f };
+		std::vector<glm::vec2> motion_landmarks; //of the last fully solved frame, see use_motion_gate
+		//use_landmark_filter
+		LandmarkFilter landmark_filter;
+		std::vector<glm::vec2> filtered_landmarks;
+		std::vector<float> landmark_confidences; //empty without the filter and without landmark_weights
+		std::vector<float> landmark_weights; //of the next frame only, see setLandmarkWeights
+	};
+	//State of face "face_index" (see solveBatch) between frames, e.g. for a tracking snapshot. getFaceState returns a default
+	//state for faces the solver hasn't seen yet. setFaceState takes effect with the next frame, as if it had followed the frame of
+	//the state. The motion gate starts over, its frame isn't part of the state.
+	FaceState getFaceState(int face_index = 0) const;
+	void setFaceState(const FaceState& state, int face_index = 0);
+	//Per-landmark weights of the sparse term of the next solve of face "face_index", e.g. of late landmarks (see LatencyCompensator).
+	//They multiply the confidences of the landmark filter and are ignored if their number differs from the landmarks of that solve.
+	void setLandmarkWeights(const std::vector<float>& weights, int face_index = 0);
+
+private:
+	friend class KernelBenchmark; //times the private stages one by one
+	friend class MemoryPlanner; //sizes the workspaces like reserve does
+	//The backends of the linear solve run the private stages.
+	friend class DenseJacobianSolver;
+	friend class JtjFromJacobianSolver;
+	friend class NormalEquationSolver;
+	friend class HostLdltSolver;
+	friend class MatrixFreeSolver;
 
 private:
+	std::shared_ptr<util::ExecutionContext> m_context; //owns the handles and streams below
 	cublasHandle_t m_cublas;
+	cusolverDnHandle_t m_cusolver;
+	cudaStream_t m_stream{ nullptr }; //all solver launches go here, cuBLAS included, the context's compute stream
+	//Landmark Jacobian kernel, forked from and joined into m_stream.
+	cudaStream_t m_stream_sparse{ nullptr };
+	cudaStream_t m_stream_readback{ nullptr }; //loss copies, joined with m_loss_event
+	cudaEvent_t m_jacobian_fork{ nullptr };
+	cudaEvent_t m_jacobian_join{ nullptr };
 	SolverParameters m_params;
+	std::unique_ptr<LinearSolver> m_linear_solvers[kNumSolverStrategies]; //indexed by SolverStrategy
 	cudaTextureObject_t m_texture_rgb{ 0 };
+	glm::ivec2 m_target_offset{ 0 }; //of the targets in the textures above, see RenderWindow::target_x
 	cudaTextureObject_t m_texture_barycentrics{ 0 };
 	cudaTextureObject_t m_texture_vertex_ids{ 0 };
+	PackedVisibility m_packed_visibility;
+	std::vector<RenderTargetTextures> m_render_target_textures; //one per pyramid level (one for an atlas), created on first use
+	//Textures over the shape, expression and albedo bases and the arrays and sizes they were created for, see bindBasisTextures.
+	const void* m_basis_texture_data[3]{ nullptr, nullptr, nullptr };
+	int m_basis_texture_sizes[3]{ 0, 0, 0 };
+	cudaTextureObject_t m_basis_textures[3]{ 0, 0, 0 };
+	util::DeviceArray<unsigned char> m_basis_tile_flags; //see requireBasisTiles
+	std::vector<unsigned char> m_basis_tile_flags_host;
+	Rasterizer m_rasterizer; //one target per pyramid level
+	util::DeviceArray<FaceBoundingBoxAccumulator> m_face_bb_accumulator;
+	util::DeviceArray<unsigned int> m_compaction_tile_status; //one per block of cuComputeVisiblePixelsAndBB, cleared before each launch
 	util::DeviceArray<FaceBoundingBox> m_face_bb;
-	util::DeviceArray<float> m_sh_coefficients_gpu;
+	FaceBoundingBox* m_face_bb_host{ nullptr }; //pinned
+	util::DeviceArray<VisiblePixel> m_visible_pixels;
+	util::DeviceArray<VisiblePixel> m_sampled_pixels;
+	//Key and visible pixels of the last render of solve, see use_render_reuse. computeFaceBoundingBox overwrites the pixels,
+	//so it drops the cache.
+	struct RenderCache
+	{
+		bool valid = false;
+		const Face* face = nullptr;
+		int pyramid_level = -1;
+		int level_of_detail = 0;
+		glm::ivec3 active_coefficients{ 0 }; //shape, expression, albedo
+		bool identity_locked = false;
+		int texture_width = 0;
+		int texture_height = 0;
+		int roi_x = 0;
+		int roi_y = 0;
+		int roi_stride = 1;
+		glm::mat4 projection{ 1.0f };
+		glm::vec3 rotation{ 0.0f };
+		glm::vec3 translation{ 0.0f };
+		uint64_t shape_version = 0;
+		uint64_t expression_version = 0;
+		util::DeviceArray<float> coefficients; //shape and expression coefficients of the render
+		util::DeviceArray<float> difference;
+		FaceBoundingBox face_bb;
+		VisiblePixel* visible_pixels = nullptr; //m_visible_pixels or m_sampled_pixels
+		int n_dense_pixels = 0;
+		float dense_sample_scale = 1.0f;
+	};
+	RenderCache m_render_cache;
+	//Coarsest pyramid level of the last frame fully solved by solve, see use_motion_gate. Empty if there is none.
+	util::DeviceArray<uchar> m_motion_frame;
+	util::DeviceArray<float> m_motion_difference;
+	util::DeviceArray<VertexShading> m_vertex_shading;
+	//Compact list of the vertices referenced by the pixels of the dense term, rebuilt every GN iteration. The flags mark the
+	//vertices already in the list.
+	util::DeviceArray<unsigned int> m_visible_vertex_flags;
+	util::DeviceArray<int> m_visible_vertices;
+	util::DeviceArray<unsigned int> m_num_visible_vertices;
+	util::DeviceArray<float> m_lighting_system; //see solveLighting
+	util::DeviceArray<unsigned int> m_work_queue; //next tile and finished blocks, see forEachQueuedResidual
+	std::minstd_rand m_random;
+
+	//Loss telemetry, see SolverParameters::verbosity. kConvergenceValues floats per GN iteration: the sparse, dense and
+	//regularizer energy and ||r||^2 of PCG. The rest of a ConvergenceRecord is known on the host, it waits in m_pending_records.
+	static constexpr int kConvergenceValues = 4;
+	util::DeviceArray<float> m_loss_gpu;
+	float* m_loss_host{ nullptr }; //pinned
+	int m_loss_host_capacity{ 0 };
+	int m_pending_losses{ 0 };
+	cudaEvent_t m_loss_event{ nullptr };
+	float* m_pcg_converged_host{ nullptr }; //pinned, see solvePCGFused
+	cudaEvent_t m_pcg_converged_event{ nullptr };
+	std::vector<float> m_losses;
+	std::vector<ConvergenceRecord> m_pending_records;
+	std::vector<ConvergenceRecord> m_convergence;
+	std::unique_ptr<std::ofstream> m_convergence_log; //see openConvergenceLog
+	uint32_t m_convergence_frame{ 0 }; //solves since the log was opened
+	uint32_t m_pending_frame{ 0 }; //of m_pending_records
+
+	//Per face (index in solveBatch, solve is face 0): one workspace per pyramid level and the landmarks.
+	std::vector<std::vector<SolverWorkspace>> m_workspaces;
+	std::vector<util::DeviceArray<glm::vec2>> m_sparse_features_gpu;
+	std::vector<util::DeviceArray<float>> m_sparse_weights_gpu; //landmark confidences, see use_landmark_filter
+	util::DeviceArray<int> m_prior_ids_gpu;
+	std::vector<float> m_result;
+
+	//Levenberg-Marquardt, see SolverParameters::use_levenberg_marquardt
+	float m_damping{ 0.0f }; //lambda of the current GN iteration, 0 solves the undamped system
+	util::DeviceArray<float> m_energy_gpu;
+	SolverStatistics m_statistics;
+	int m_num_pcg_iterations{ 5 }; //of the pyramid level of the current GN iteration, set by prepareIteration
+	int m_jtj_reuse_iterations{ 0 }; //as well
+
+	//Batched Cholesky of solveBatch, device arrays of the JTJ and right hand side pointers of a group of faces.
+	util::DeviceArray<float*> m_batch_matrices;
+	util::DeviceArray<float*> m_batch_rhs;
+	util::DeviceArray<int> m_batch_info;
+
+	std::vector<FaceState> m_face_states; //per face, like m_workspaces
+	LandmarkSolver m_landmark_solver;
+
+	//use_recovery: a face of the model per hypothesis, with its state and workspaces. Created by the first recovery.
+	static constexpr int kNumRecoveryHypotheses = 3;
+	std::vector<std::unique_ptr<Face>> m_recovery_faces;
+	std::vector<FaceState> m_recovery_states;
+	std::vector<std::vector<SolverWorkspace>> m_recovery_workspaces;
+	util::DeviceArray<float> m_recovery_energy_gpu;
+
+	//captureDebugFrames
+	std::unique_ptr<util::AsyncImageWriter> m_debug_writer; //created by the first capture
+	std::string m_debug_path_prefix;
+	int m_num_debug_frames{ 0 }; //left to capture
+	int m_debug_frame_index{ 0 };
+	util::DeviceArray<uchar> m_debug_images; //BGR, the rgb image followed by the deferred one
+
+	//Parameters before the last accepted step, restored if the step raised the energy.
+	struct ParameterBackup
+	{
+		glm::mat4 projection;
+		glm::vec3 rotation{ 0.0f };
+		glm::vec3 translation{ 0.0f };
+		util::DeviceArray<float> coefficients; //of Face::m_coefficients_gpu, which is authoritative during a solve
+		std::vector<float> sh;
+	};
+
+	//Unknowns of one face in the current frame.
+	struct FaceUnknowns
+	{
+		int nFeatures = 0;
+		int nShapeCoeffs = 0;
+		int nExpressionCoeffs = 0;
+		int nAlbedoCoeffs = 0;
+		int nFaceCoeffs = 0;
+		int nSHCoeffs = 0;
+		int nUnknowns = 0;
+	};
+
+	//A face of a batched solve, see solveLevelsBatched. "index" is its index in solveBatch.
+	struct BatchEntry
+	{
+		int index = 0;
+		Face* face = nullptr;
+		glm::mat4* projection = nullptr;
+		const Pyramid* pyramid = nullptr;
+		FaceState* state = nullptr;
+		std::vector<SolverWorkspace>* workspaces = nullptr; //one per pyramid level
+		const glm::vec2* sparse_features_gpu = nullptr;
+		const float* sparse_weights = nullptr;
+		int num_features = 0;
+		FaceUnknowns unknowns;
+		bool identity_locked = false;
+		bool converged = false;
+		std::vector<float> result;
+	};
 
 private:
-	void computeJacobian(
-		//shared memory
-		const FaceBoundingBox face_bb,
-		int nFeatures, const int imageWidth, const int imageHeight,
-		int nShapeCoeffs, int nExpressionCoeffs, int nAlbedoCoeffs,
-		int nUnknowns, int nResiduals,
-		int nVerticesTimes3, int nShapeCoeffsTotal, int nExpressionCoeffsTotal, int nAlbedoCoeffsTotal, int nShCoeffsTotal,
-		float sparseWeight, float denseWeight, float regularizationWeight,
-
-		uchar* image,
-
-		const glm::mat4& face_pose, const glm::mat3& drx, const glm::mat3& dry, const glm::mat3& drz, const glm::mat4& projection, const Eigen::Matrix3f& jacobian_local,
-
-		//device memory input
-		int* prior_local_ids, glm::vec3* current_face, glm::vec2* sparse_features,
-
-		float* p_shape_basis, 
-		float* p_expression_basis, 
-		float* p_albedo_basis, 
-		
-		float* p_coefficients_shape, 
-		float* p_coefficients_expression,
-		float* p_coefficients_albedo,
-		float* p_coefficients_sh, 
-
-		//device memory output
-		float* p_jacobian, float* p_residuals) const;
+	//"p_jacobian" has the entries of m_params.jacobian_precision, if storesReducedJacobian, FP32 otherwise.
+	void computeJacobian(const JacobianInput& input, void* p_jacobian, float* p_residuals) const;
+	//y = a * J * x + beta * y, or a * J^T * x + beta * y if "transposed", for the n_rows x n_cols block of a stored Jacobian
+	//starting at "first_entry" with leading dimension "ld". FP32 accumulation for any jacobian_precision.
+	void multiplyStoredJacobian(const void* jacobian, size_t first_entry, int n_rows, int n_cols, int ld, bool transposed, float a,
+		const float* x, float beta, float* y);
 
 	void elementwiseMultiplication(int nElements, float* v1, float* v2, float* out);
-	FaceBoundingBox computeFaceBoundingBox(const int imageWidth, const int imageHeight); 
-	void computeJacobiPreconditioner(const int nUnknowns, const int nCurrentResiduals, const int nResiduals, float* jacobian, float* preconditioner);
+	//z = M * r with the diagonal or, if the workspace has preconditioner blocks, the block-diagonal preconditioner.
+	void applyPreconditioner(int nUnknowns, SolverWorkspace& workspace, float* r, float* z);
+	//Layout of the preconditioner blocks of "unknowns", no blocks if use_block_preconditioner doesn't apply.
+	PreconditionerBlocks makePreconditionerBlocks(const FaceUnknowns& unknowns) const;
+	//Inverts (JTJ_bb + lambda * diag(JTJ_bb)) of every block into workspace.M_blocks. The lower triangles of the blocks are read
+	//from "jtj" (leading dimension nUnknowns) or, if it is nullptr, from M_blocks itself.
+	void invertPreconditionerBlocks(SolverWorkspace& workspace, const float* jtj, int nUnknowns, float lambda);
+	//"imageWidth" x "imageHeight" are the render targets, the bounding box and the visible pixels are in pixels of the frame.
+	FaceBoundingBox computeFaceBoundingBox(const int imageWidth, const int imageHeight, int gridStride = 1, int gridOffsetX = 0, int gridOffsetY = 0,
+		RenderWindow window = RenderWindow());
+	//Stratified random subset of the visible pixel list: one sample out of every nVisiblePixels / nSamples entries.
+	VisiblePixel* sampleVisiblePixels(int nVisiblePixels, int nSamples, unsigned int seed);
+	//Fills m_vertex_shading for the pose and mesh of "input" and points input.vertex_shading to it. Only the vertices of the
+	//visible pixels are evaluated, so the work scales with the face area instead of the model.
+	void computeVertexShading(JacobianInput& input);
+	//Color and light of the pixels of "input" for its current face and the SH coefficients "sh_coefficients" (device), as face.frag
+	//computes them. Needs input.vertex_shading.
+	void relightVisiblePixels(const JacobianInput& input, const float* sh_coefficients);
+	//Closed-form SH of "face" for the geometry and albedo of "input", see use_closed_form_lighting. The pixels of the dense term are
+	//relit with it, so the residuals of the GN iteration belong to the new lighting.
+	void solveLighting(Face& face, const JacobianInput& input);
+	//M = inv(diag(JTJ)) of the stored Jacobian of "input", including the regularizer.
+	void computeJacobiPreconditioner(const JacobianInput& input, const void* jacobian, float* preconditioner);
+	//preconditioner[i] = 1 / max(preconditioner[i], 1e-4), the diagonal of JTJ in, the Jacobi preconditioner out.
+	void invertDiagonal(int nUnknowns, float* preconditioner);
+
+	//Everything of a GN iteration which runs on the device only: Jacobian (or its matrix-free operators) and the solve of the
+	//backend of m_params.
+	void solveIteration(const JacobianInput& input, SolverWorkspace& workspace);
+	void launchGraph(cudaGraph_t graph, cudaGraphExec_t& graph_exec);
+
+	//loss += f^T * f on the solver stream
+	void computeSquaredNorm(const float* f, int n, float* loss);
+	//loss += ||f||^2 + wReg^2 * ||c||^2, the energy of "input" with the residuals f of its rows.
+	void computeEnergy(const JacobianInput& input, const float* residuals, float* loss);
+	//The kConvergenceValues of a GN iteration into "values", which are zero. "nPcgUnknowns" is 0 if the step was factorized.
+	void computeConvergenceValues(const JacobianInput& input, const SolverWorkspace& workspace, int nPcgUnknowns, float* values);
+
+	//Tikhonov regularizer of the face coefficients, handled analytically instead of as Jacobian rows.
+	//rhs += alphaRHS * wReg^2 * c and diagonal[i * diagonal_stride] += alphaLHS * wReg^2 on the coefficient unknowns, either may be nullptr.
+	void addRegularizer(const JacobianInput& input, float alphaLHS, float alphaRHS, float* rhs, float* diagonal, size_t diagonal_stride);
+	//JTJp += alphaLHS * wReg^2 * p on the coefficient unknowns
+	void applyRegularizer(const JacobianInput& input, float alphaLHS, const float* p, float* JTJp);
+	//The regularizer on the diagonals of the (not yet inverted) preconditioner blocks.
+	void addRegularizerToBlocks(const JacobianInput& input, float alphaLHS, SolverWorkspace& workspace);
+
+	//Number of residual threads whose Jacobian rows are evaluated at once when assembling the normal equations (at most 3 rows each).
+	static constexpr int kNormalEquationChunkThreads = 8192;
+
+	//JTJ = alphaLHS * J^T * J and r = alphaRHS * J^T * f, while only a chunk of J is alive.
+	void computeNormalEquations(const JacobianInput& input, SolverWorkspace& workspace, float alphaLHS, float alphaRHS);
+	//Residuals and r = alphaRHS * J^T f alone, for a kept JTJ.
+	void computeRhs(const JacobianInput& input, SolverWorkspace& workspace, float alphaRHS);
+	void solveUpdateNormalEquations(const JacobianInput& input, SolverWorkspace& workspace, float alphaLHS = 1, float alphaRHS = 1);
+	//Same as solveUpdatePCG, but JTJ and J^T f are formed from the stored Jacobian first, see use_jtj_from_jacobian.
+	void solveUpdateJTJ(const JacobianInput& input, SolverWorkspace& workspace, float alphaLHS = 1, float alphaRHS = 1);
+	//Solves workspace.jtj x = workspace.r, damped. "keep_jtj" leaves workspace.jtj intact for the next GN iteration.
+	void solveJTJ(int nUnknowns, SolverWorkspace& workspace, bool keep_jtj);
+	//jtj (lower triangle) = alpha * J^T J + beta * jtj for the nRows x nUnknowns "jacobian", see use_tensor_core_jtj.
+	void multiplyJTJ(const float* jacobian, int nRows, int nUnknowns, float alpha, float beta, float* jtj);
+	//Same for the columns [first_col, first_col + nCols) of a stored Jacobian of m_params.jacobian_precision with "ld" rows (or
+	//columns, if row-major), into the "ldjtj" x nCols "jtj". FP32 is a syrk, reduced precisions go through a GEMM with FP32
+	//accumulation, which writes both triangles.
+	void multiplyStoredJTJ(const void* jacobian, int first_col, int nRows, int nCols, int ld, float alpha, float beta, float* jtj, int ldjtj);
+	void computeJTJPreconditioner(int nUnknowns, const float* jtj, float* preconditioner);
+	//JTJp += m_damping * diag(JTJ) * p, with diag(JTJ) = 1 / M as computed by the Jacobi preconditioners.
+	void addDamping(int nUnknowns, const float* M, const float* p, float* JTJp);
+	//JTJ += m_damping * diag(JTJ) + kJTJDiagonalEpsilon * I
+	void dampJTJ(int nUnknowns, float* jtj);
+	//Zeroes the steps of the systems whose info of the Cholesky factorization isn't 0, "results" holds the steps of a batch
+	//of "batch_size" systems on the device, or is nullptr and "result" is the step of a single one.
+	void discardFailedSteps(int nUnknowns, int batch_size, const int* info, float* const* results, float* result);
+
+	//PCG with the Jacobian of "input" stored in the workspace, see SolverWorkspace::getJacobian.
+	void solveUpdatePCG(const cublasHandle_t& cublas, const JacobianInput& input, SolverWorkspace& workspace, float alphaLHS = 1,
+		float alphaRHS = 1);
+
+	//Same as solveUpdatePCG, but J is never stored. J*p and J^T*(J*p) are recomputed from the render targets in every PCG iteration.
+	//Render targets have to stay mapped until it returns.
+	void solveUpdatePCGMatrixFree(const cublasHandle_t& cublas, const JacobianInput& input, SolverWorkspace& workspace,
+		float alphaLHS = 1, float alphaRHS = 1);
+
+	//Preconditioned CG on JTJ * x = r. "applyJTJ(p, JTJp)" provides the system matrix, "workspace.M" the inverse Jacobi preconditioner.
+	//Expects "workspace.r" and "workspace.M" to be filled, the solution x ends up in "workspace.result".
+	void solvePCG(const cublasHandle_t& cublas, int nUnknowns, const std::function<void(float*, float*)>& applyJTJ, SolverWorkspace& workspace);
+
+	//Same as solvePCG, but ak, bk and zTr stay on the device and the vector updates are fused into one single-block kernel.
+	//Outside of a graph capture the converged flag is copied back every kFusedPCGPollInterval iterations without waiting for
+	//it, and no further iterations are queued once a finished copy shows it set.
+	static constexpr int kFusedPCGPollInterval = 4;
+	void solvePCGFused(int nUnknowns, const std::function<void(float*, float*)>& applyJTJ, SolverWorkspace& workspace);
+	void fusedPCGInit(int nUnknowns, SolverWorkspace& workspace, bool warm_start);
+	//r = r - JTJp, after applyJTJ(x) of a warm start, and restarts PCG from there.
+	void fusedPCGRestart(int nUnknowns, SolverWorkspace& workspace);
+	void fusedPCGIteration(int nUnknowns, SolverWorkspace& workspace);
+
+	void computeRhsAndJacobiPreconditionerMatrixFree(const JacobianInput& input, float alphaRHS, float* residuals, float* rhs, float* preconditioner);
+	void applyJTJMatrixFree(const JacobianInput& input, float alphaLHS, const float* p, float* jp, float* jtjp);
+	//Work queue of the persistent kernels, nullptr for flat launches (SolverParameters::use_persistent_threads off).
+	unsigned int* getWorkQueue();
 
-	void solveUpdateCG(const cublasHandle_t& cublas, int nUnknowns, int nResiduals, util::DeviceArray<float>& jacobian,
-		util::DeviceArray<float>& residuals, util::DeviceArray<float>& x, float alphaLHS = 1, float alphaRHS = 1);
+	//Grows the per face state, so "face_index" is valid.
+	void reserveFaces(int number_of_faces, int number_of_levels);
+	//Picks the unknowns for "face" at "pyramid_level" (a locked identity drops shape and albedo, the level schedule may drop
+	//terms and groups, at most "max_coefficients" per group are solved for) and sets its active coefficients.
+	FaceUnknowns setupUnknowns(Face& face, int nFeatures, int pyramid_level, int max_coefficients = INT_MAX) const;
+	//Coefficients per group solved for in the "iteration"-th GN iteration of a frame, see progressive_initial_coefficients.
+	int getCoefficientCap(int iteration) const;
+	//See SolverParameters::deadline_ms, "start" is the one of the call to solve or solveBatch. Sets deadline_expired.
+	bool isPastDeadline(std::chrono::steady_clock::time_point start);
+	//Renders "face" at "pyramid_level", maps the render targets and fills the Jacobian input of one GN iteration.
+	//The render targets stay mapped, so the caller unmaps them before another face renders to the same level.
+	//"reuse_render" keeps the render in m_render_cache and takes the visible pixels from there if they still fit, see use_render_reuse.
+	JacobianInput prepareIteration(Face& face, const glm::mat4& projection, const Pyramid& pyramid, int pyramid_level,
+		const FaceUnknowns& unknowns, glm::vec2* sparse_features_gpu, const float* sparse_weights_gpu = nullptr, bool reuse_render = false);
+	//Whether m_render_cache holds a render of "face" at "pyramid_level" close enough to its current geometry.
+	bool canReuseRender(const Face& face, const glm::mat4& projection, int pyramid_level);
+	void storeRender(const Face& face, const glm::mat4& projection, int pyramid_level, const FaceBoundingBox& face_bb,
+		VisiblePixel* visible_pixels, int n_dense_pixels, float dense_sample_scale);
+	bool usesRoiRendering(const Pyramid& pyramid) const { return m_params.use_roi_rendering && pyramid.hasRoiTargets(); }
+	//Window of the ROI targets of this frame: the face rendered in the last frame and the landmarks (NDC), with a margin.
+	//The whole frame if the face wasn't tracked.
+	void predictFaceRect(const std::vector<glm::vec2>& sparse_features, FaceState& state) const;
+	//Render targets of "face" at "pyramid_level", the ROI targets around state.face_rect with use_roi_rendering.
+	void setRenderTargets(Face& face, const Pyramid& pyramid, int pyramid_level, const FaceState& state) const;
+	//Remembers the rendered face of a dense iteration for predictFaceRect.
+	static void updateRenderedRect(const JacobianInput& input, FaceState& state);
 
-	void solveUpdatePCG(const cublasHandle_t& cublas, int nUnknowns, int nCurrentResiduals, int nResiduals, util::DeviceArray<float>& jacobian,
-		util::DeviceArray<float>& residuals, util::DeviceArray<float>& x, float alphaLHS = 1, float alphaRHS = 1);
+	//The landmarks of this frame the solve uses, "detected_features" or their filtered copy in "state", see use_landmark_filter.
+	const std::vector<glm::vec2>& filterLandmarks(const std::vector<glm::vec2>& detected_features, FaceState& state) const;
+	//Uploads the landmark confidences of a face as the weights of its sparse term. nullptr without the filter.
+	const float* uploadLandmarkWeights(int face_index);
+	//Motion gate, see use_motion_gate. A frame which isn't static becomes the reference of the following ones.
+	bool isStaticFrame(const std::vector<glm::vec2>& sparse_features, const Pyramid& pyramid, FaceState& state);
+	//Mean absolute difference of the "n" bytes of two frames on the device.
+	float computeFrameDifference(const uchar* frame, const uchar* reference, int n);
+	//Moves the face along the velocity of the last frame. Called before the first GN iteration of a frame.
+	void predictParameters(Face& face, const FaceState& state) const;
+	//Remembers the solved state of this frame and its velocity.
+	void updateTemporalState(const Face& face, FaceState& state);
+	//Solves the frame with m_landmark_solver, if use_landmark_only is set and it isn't a keyframe of the face. False otherwise,
+	//then the full solve runs.
+	bool solveLandmarksOnly(const std::vector<glm::vec2>& sparse_features, Face& face, glm::mat4& projection, float aspect_ratio,
+		FaceState& state);
+	//The GN iterations of solveBatch from "first_level" down to "last_level", all entries in lockstep. Without "energies_gpu"
+	//nothing is summed, otherwise the energy of the last linearization of entry e, i.e. before its last step, is in energies_gpu[e].
+	void solveLevelsBatched(std::vector<BatchEntry>& entries, int first_level, int last_level, std::chrono::steady_clock::time_point start,
+		float* energies_gpu = nullptr);
+	//See SolverParameters::use_recovery. Returns the finest level the hypotheses were solved on, -1 if the face needs no recovery.
+	int recoverFace(const std::vector<glm::vec2>& sparse_features, const float* sparse_weights, Face& face, glm::mat4& projection,
+		const Pyramid& pyramid, FaceState& state, std::chrono::steady_clock::time_point start);
+	//Pose, focal length, coefficients and the locked identity of "source". Both faces are outside of a solve.
+	void copyFaceParameters(const Face& source, const glm::mat4& source_projection, Face& target, glm::mat4& target_projection);
+	//After a full solve: restarts the keyframe schedule with the landmark error of this fit.
+	void finishKeyframe(const std::vector<glm::vec2>& sparse_features, const Face& face, const glm::mat4& projection, FaceState& state);
 
-	void updateParameters(const std::vector<float>& result, glm::mat4& projection, float aspect_ratio, Face& face, int nShapeCoeffs, int nExpressionCoeffs, int nAlbedoCoeffs);
+	//The coefficients and SH of the face on the device from "result_gpu". The host keeps pose, focal length and a mirror of the SH
+	//up to date from "result", they set up the render of the next iteration.
+	void updateParameters(const std::vector<float>& result, const float* result_gpu, glm::mat4& projection, float aspect_ratio, Face& face,
+		const FaceUnknowns& unknowns);
+	void updateCoefficients(const float* result_gpu, Face& face, const FaceUnknowns& unknowns);
+	void backupParameters(const Face& face, const glm::mat4& projection, ParameterBackup& backup) const;
+	void restoreParameters(const ParameterBackup& backup, Face& face, glm::mat4& projection) const;
+	//||f||^2 + wReg^2 * ||c||^2 at the current parameters, with a render of its own. Judges the last LM step of a level.
+	float evaluateEnergy(Face& face, const glm::mat4& projection, const Pyramid& pyramid, int pyramid_level, const FaceUnknowns& unknowns,
+		glm::vec2* sparse_features_gpu, const float* sparse_weights_gpu, SolverWorkspace& workspace);
 
-	void mapRenderTargets(Face& face);
+	//Maps the render targets of "pyramid_level" and the vertex buffer of "face" in one call and binds the cached texture objects.
+	//Back to level of detail 0 after a solve, see LevelSchedule::level_of_detail.
+	void restoreFullMesh(Face& face);
+	void mapRenderTargets(Face& face, int pyramid_level);
 	void unmapRenderTargets(Face& face);
+	//The mapped render targets of the face followed by its vertex buffer, returns the number of render targets.
+	int getRenderTargetResources(const Face& face, cudaGraphicsResource* resources[4]) const;
+	//The mapped render targets of "face" over "frame" (RGB, "frame_width" pixels per row, pyramid level 0) and its deferred
+	//shading into "images" (device), two BGR images of the size of the targets, on the compute stream.
+	void convertDebugImages(const Face& face, const uchar* frame, int frame_width, uchar* images);
+	void captureDebugImages(const Face& face, const Pyramid& pyramid);
+	//Synchronous, the frame has to be of the size of the targets.
 	void debugFrameBufferTextures(Face& face, uchar* frame, const std::string& rgb_filepath, const std::string& deferred_filepath);
+	//Sets the basis textures of "input" for the bases of "model", creates them again if the bases moved. Leaves them 0 if a
+	//basis is empty or exceeds the linear texture width of the device.
+	void bindBasisTextures(const FaceModel& model, JacobianInput& input);
+	//Makes the tiles of the vertices of the visible pixels resident in the cache of a tiled basis. Waits for the flags.
+	void requireBasisTiles(TiledBasis& tiles, const VisiblePixel* visible_pixels, int n_pixels);
+	void destroyBasisTextures();
 	void destroyTextures();
 };
\ No newline at end of file
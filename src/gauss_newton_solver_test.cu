@@ -1,104 +1,363 @@
 #pragma once 
 
 #include "gauss_newton_solver.h"
+#include "prior_sparse_features.h"
 #include "util.h"
 #include "device_util.h"
 #include "device_array.h"
+#include "profiler.h"
+#include "parameter_stream.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
 #include "opencv2/imgproc/imgproc.hpp"
 #include "opencv2/highgui/highgui.hpp"
 
-__global__ void textureRgbTestKernel(cudaTextureObject_t texture, uchar* frame, float* arr, int width, int height)
+__device__ inline uchar3 toBgr(float r, float g, float b)
+{
+	return make_uchar3(static_cast<uchar>(255.0f * __saturatef(b) + 0.5f), static_cast<uchar>(255.0f * __saturatef(g) + 0.5f),
+		static_cast<uchar>(255.0f * __saturatef(r) + 0.5f));
+}
+
+//Two BGR images of the render targets: the rendered face over the frame, and albedo times light of the deferred targets.
+//Pixel (x, y) of the targets is (roi_x + x * roi_stride, roi_y + y * roi_stride) of the frame, see Face::GraphicsSettings.
+//The targets start at "target" in the textures.
+__global__ void cuConvertDebugImages(cudaTextureObject_t texture_rgb, cudaTextureObject_t texture_barycentrics, cudaTextureObject_t texture_vertex_ids,
+	const glm::vec3* albedos, const uchar* frame, int frame_width, int roi_x, int roi_y, int roi_stride, int width, int height,
+	const glm::ivec2 target, uchar3* rgb_image, uchar3* deferred_image)
 {
 	auto index = util::getThreadIndex2D();
 	if (index.x >= width || index.y >= height)
 	{
 		return;
 	}
-	int y = height - 1 - index.y; // "height - 1 - index.y" is used since OpenGL uses left-bottom corner as texture origin.
-	float4 color = tex2D<float4>(texture, index.x, y);
-	auto idx = (index.x + index.y * width) * 3;
+	const int x = target.x + index.x;
+	const int y = target.y + height - 1 - index.y; // "height - 1 - index.y" is used since OpenGL uses left-bottom corner as texture origin.
+	const int idx = index.x + index.y * width;
 
+	float4 color = tex2D<float4>(texture_rgb, x, y);
 	if (color.w > 0)
 	{
-		arr[idx] = color.x;
-		arr[idx + 1] = color.y;
-		arr[idx + 2] = color.z;
+		rgb_image[idx] = toBgr(color.x, color.y, color.z);
 	}
 	else
 	{
-		arr[idx] = frame[idx] / 255.0;
-		arr[idx + 1] = frame[idx + 1] / 255.0;
-		arr[idx + 2] = frame[idx + 2] / 255.0;
-	}
-}
-
-__global__ void textureBarycentricsVertexIdsTestKernel(cudaTextureObject_t texture_barycentrics, cudaTextureObject_t texture_vertex_ids, glm::vec3* albedos,
-	float* arr, int width, int height)
-{
-	auto index = util::getThreadIndex2D();
-
-	if (index.x >= width || index.y >= height)
-	{
-		return;
+		const int frame_idx = 3 * ((roi_x + index.x * roi_stride) + (roi_y + index.y * roi_stride) * frame_width);
+		rgb_image[idx] = make_uchar3(frame[frame_idx + 2], frame[frame_idx + 1], frame[frame_idx]);
 	}
 
-	int y = height - 1 - index.y; // "height - 1 - index.y" is used since OpenGL uses left-bottom corner as texture origin.
-	float4 barycentrics_light = tex2D<float4>(texture_barycentrics, index.x, y); // barycentrics_light.w is light.
-	int4 vertex_ids = tex2D<int4>(texture_vertex_ids, index.x, y);
+	float4 barycentrics_light = tex2D<float4>(texture_barycentrics, x, y); // barycentrics_light.w is light.
+	int4 vertex_ids = tex2D<int4>(texture_vertex_ids, x, y);
 
 	auto albedo_v0 = albedos[vertex_ids.x];
 	auto albedo_v1 = albedos[vertex_ids.y];
 	auto albedo_v2 = albedos[vertex_ids.z];
 
 	auto albedo = barycentrics_light.x * albedo_v0 + barycentrics_light.y * albedo_v1 + barycentrics_light.z * albedo_v2;
-	auto color = albedo * barycentrics_light.w;
+	auto deferred = albedo * barycentrics_light.w;
+	deferred_image[idx] = toBgr(deferred.x, deferred.y, deferred.z);
+}
 
-	auto idx = (index.x + index.y * width) * 3;
-	arr[idx] = color.x;
-	arr[idx + 1] = color.y;
-	arr[idx + 2] = color.z;
+void GaussNewtonSolver::convertDebugImages(const Face& face, const uchar* frame, int frame_width, uchar* images)
+{
+	const auto& graphics_settings = face.m_graphics_settings;
+	const int img_width = graphics_settings.texture_width;
+	const int img_height = graphics_settings.texture_height;
+
+	dim3 threads(16, 16);
+	dim3 blocks(img_width / threads.x + 1, img_height / threads.y + 1);
+	auto* pixels = reinterpret_cast<uchar3*>(images);
+	cuConvertDebugImages << <blocks, threads, 0, m_stream >> > (m_texture_rgb, m_texture_barycentrics, m_texture_vertex_ids,
+		face.getCurrentFaceGpu() + face.m_number_of_vertices, frame, frame_width, graphics_settings.roi_x, graphics_settings.roi_y,
+		graphics_settings.roi_stride, img_width, img_height, m_target_offset, pixels, pixels + img_width * img_height);
 }
 
 void GaussNewtonSolver::debugFrameBufferTextures(Face& face, uchar* frame, const std::string& rgb_filepath, const std::string& deferred_filepath)
 {
 	int img_width = face.m_graphics_settings.texture_width;
 	int img_height = face.m_graphics_settings.texture_height;
-	util::DeviceArray<float> temp_memory(img_width * img_height * 3);
+	const int image_size = img_width * img_height * 3;
+	util::DeviceArray<uchar> images(2 * image_size, util::getFrameArena());
+	convertDebugImages(face, frame, img_width, images.getPtr());
 
-	dim3 threads(16, 16);
-	dim3 blocks(img_width / threads.x + 1, img_height / threads.y + 1);
+	cv::Mat rgb(cv::Size(img_width, img_height), CV_8UC3);
+	cv::Mat deferred(cv::Size(img_width, img_height), CV_8UC3);
+	CHECK_CUDA_ERROR(cudaMemcpyAsync(rgb.data, images.getPtr(), image_size, cudaMemcpyDeviceToHost, m_stream));
+	CHECK_CUDA_ERROR(cudaMemcpyAsync(deferred.data, images.getPtr() + image_size, image_size, cudaMemcpyDeviceToHost, m_stream));
+	CHECK_CUDA_ERROR(cudaStreamSynchronize(m_stream));
+	cv::imwrite(rgb_filepath, rgb);
+	cv::imwrite(deferred_filepath, deferred);
+}
+
+void GaussNewtonSolver::captureDebugFrames(const int num_frames, const std::string& path_prefix)
+{
+	if (!m_debug_writer)
+	{
+		m_debug_writer = std::make_unique<util::AsyncImageWriter>();
+	}
+	m_num_debug_frames = num_frames;
+	m_debug_path_prefix = path_prefix;
+}
+
+void GaussNewtonSolver::captureDebugImages(const Face& face, const Pyramid& pyramid)
+{
+	util::ScopedTimer timer("Debug capture", true, m_stream);
+	const int img_width = face.m_graphics_settings.texture_width;
+	const int img_height = face.m_graphics_settings.texture_height;
+	const int image_size = img_width * img_height * 3;
+	util::ensureSize(m_debug_images, 2 * image_size);
 
-	textureRgbTestKernel << <blocks, threads >> > (m_texture_rgb, frame, temp_memory.getPtr(), img_width, img_height);
+	//The images of the previous capture are copied off the compute stream, they are overwritten once that copy is done.
+	m_context->waitFor(m_stream, m_stream_readback);
+	convertDebugImages(face, pyramid.getFrame(0), pyramid.getWidth(0), m_debug_images.getPtr());
+	m_context->waitFor(m_stream_readback, m_stream);
+
+	char index[16];
+	std::snprintf(index, sizeof(index), "_%06d", m_debug_frame_index++);
+	const auto prefix = m_debug_path_prefix + index;
+	m_debug_writer->enqueue(m_debug_images.getPtr(), img_width, img_height, prefix + "_rgb.png", m_stream_readback);
+	m_debug_writer->enqueue(m_debug_images.getPtr() + image_size, img_width, img_height, prefix + "_deferred.png", m_stream_readback);
+	m_num_debug_frames--;
+}
+
+BasisPrecisionReport GaussNewtonSolver::validateHalfPrecisionBasis(const std::vector<glm::vec2>& sparse_features, Face& face,
+	glm::mat4& projection, const Pyramid& pyramid)
+{
+	BasisPrecisionReport report;
+	if (face.isHalfPrecisionBasis() || face.m_model->tiled_basis)
+	{
+		std::cout << "Warning: The basis precision is validated against the FP32 bases on the device, which aren't loaded!" << std::endl;
+		return report;
+	}
 
-	std::vector<float> temp_memory_host(img_width * img_height * 3);
-	util::copy(temp_memory_host, temp_memory, temp_memory.getSize());
+	//SolverParameters has const members and can't be assigned, only the changed field is restored.
+	const int verbosity = m_params.verbosity;
+	reserveFaces(1, pyramid.getNumberOfLevels());
+	const auto face_state = m_face_states[0];
+	const auto shape = face.m_shape_coefficients;
+	const auto expression = face.m_expression_coefficients;
+	const auto albedo = face.m_albedo_coefficients;
+	const auto sh = face.m_sh_coefficients;
+	const auto rotation = face.m_rotation_coefficients;
+	const auto translation = face.m_translation_coefficients;
+	const int active[3] = { face.m_num_active_shape_coefficients, face.m_num_active_expression_coefficients, face.m_num_active_albedo_coefficients };
+	const bool identity_locked = face.isIdentityLocked();
+	const auto original_projection = projection;
 
-	cv::Mat image(cv::Size(img_width, img_height), CV_8UC3);
-	for (int y = 0; y < image.rows; y++)
+	//A locked identity is baked again with the bases of the run, so both track it as the application does. A solve which
+	//locks the identity itself is undone.
+	auto restore = [&]()
 	{
-		for (int x = 0; x < image.cols; x++)
+		m_params.verbosity = verbosity;
+		m_face_states[0] = face_state;
+		face.m_shape_coefficients = shape;
+		face.m_expression_coefficients = expression;
+		face.m_albedo_coefficients = albedo;
+		face.m_sh_coefficients = sh;
+		face.m_rotation_coefficients = rotation;
+		face.m_translation_coefficients = translation;
+		face.setActiveCoefficients(active[0], active[1], active[2]);
+		projection = original_projection;
+		if (identity_locked)
+		{
+			face.lockIdentity();
+		}
+		else
 		{
-			auto idx = (x + y * img_width) * 3;
+			face.unlockIdentity();
+		}
+		face.invalidateFace();
+	};
+
+	const int n_vertices = face.getNumberOfVertices();
+	std::vector<glm::vec3> mesh[2];
+	float loss[2];
+	for (int precision = 0; precision < 2; ++precision)
+	{
+		face.useQuantizedBases(precision == 1);
+		restore();
+
+		face.computeFace();
+		mesh[precision].resize(2 * n_vertices);
+		CHECK_CUDA_ERROR(cudaMemcpy(mesh[precision].data(), face.getCurrentFaceGpu(), 2 * n_vertices * sizeof(glm::vec3), cudaMemcpyDeviceToHost));
+
+		m_params.verbosity = 1;
+		solve(sparse_features, face, projection, pyramid);
+		CHECK_CUDA_ERROR(cudaStreamSynchronize(m_stream));
+		collectLosses();
+		loss[precision] = m_losses.empty() ? 0.0f : m_losses.back();
+	}
+
+	for (int i = 0; i < n_vertices; ++i)
+	{
+		report.max_position_error = std::max(report.max_position_error, glm::length(mesh[0][i] - mesh[1][i]));
+		report.max_albedo_error = std::max(report.max_albedo_error, glm::length(mesh[0][n_vertices + i] - mesh[1][n_vertices + i]));
+	}
+	report.loss_fp32 = loss[0];
+	report.loss_fp16 = loss[1];
+	report.validated = true;
+
+	face.releaseQuantizedBases();
+	restore();
+
+	std::cout << "Basis precision: loss FP32 " << report.loss_fp32 << ", FP16 " << report.loss_fp16
+		<< " (" << 100.0f * (report.loss_fp16 - report.loss_fp32) / std::max(report.loss_fp32, m_params.kNearZero) << "%), max position error "
+		<< report.max_position_error << ", max albedo error " << report.max_albedo_error << std::endl;
+
+	return report;
+}
+
+constexpr int kPhotometricErrorThreads = 256;
+
+//error += sum of ||C_S - C_I|| over the visible pixels, reduced per block.
+__global__ void cuPhotometricError(const VisiblePixel* visible_pixels, const int nPixels, const uchar* image, const int width, float* error)
+{
+	__shared__ float shared[kPhotometricErrorThreads];
+
+	const int i = util::getThreadIndex1D();
+	float value = 0.0f;
+	if (i < nPixels)
+	{
+		const VisiblePixel pixel = visible_pixels[i];
+		const int index = 3 * (pixel.x + pixel.y * width);
+		const float3 face_rgb = pixel.rgb;
+		const float dr = face_rgb.x - image[index] / 255.0f;
+		const float dg = face_rgb.y - image[index + 1] / 255.0f;
+		const float db = face_rgb.z - image[index + 2] / 255.0f;
+		value = sqrtf(dr * dr + dg * dg + db * db);
+	}
 
-			// OpenCV expects it to be an BGRA image.
-			image.at<cv::Vec3b>(cv::Point(x, y)) = cv::Vec3b(255.0f * cv::Vec3f(temp_memory_host[idx + 2], temp_memory_host[idx + 1], temp_memory_host[idx]));
+	shared[threadIdx.x] = value;
+	__syncthreads();
+	for (int stride = blockDim.x / 2; stride > 0; stride >>= 1)
+	{
+		if (threadIdx.x < stride)
+		{
+			shared[threadIdx.x] += shared[threadIdx.x + stride];
 		}
+		__syncthreads();
+	}
+
+	if (threadIdx.x == 0)
+	{
+		atomicAdd(error, shared[0]);
+	}
+}
+
+FitQuality GaussNewtonSolver::evaluateFit(const std::vector<glm::vec2>& sparse_features, Face& face, const glm::mat4& projection, const Pyramid& pyramid)
+{
+	FitQuality quality;
+	const int nFeatures = sparse_features.size();
+	if (nFeatures == 0)
+	{
+		return quality;
+	}
+
+	reserveFaces(1, pyramid.getNumberOfLevels());
+	auto& sparse_features_gpu = m_sparse_features_gpu[0];
+	util::ensureSize(sparse_features_gpu, nFeatures);
+	util::copy(sparse_features_gpu, sparse_features, nFeatures);
+
+	const auto unknowns = setupUnknowns(face, nFeatures, 0);
+	pyramid.setGraphicsSettings(0, face.getGraphicsSettings());
+	const int pixel_sampling_mode = m_params.pixel_sampling_mode;
+	m_params.pixel_sampling_mode = 0;
+	const auto input = prepareIteration(face, projection, pyramid, 0, unknowns, sparse_features_gpu.getPtr());
+	m_params.pixel_sampling_mode = pixel_sampling_mode;
+
+	util::DeviceArray<float> error_gpu(1, util::getFrameArena());
+	error_gpu.memset(0, m_stream);
+	const int blocks = (input.nPixels + kPhotometricErrorThreads - 1) / kPhotometricErrorThreads;
+	if (blocks > 0)
+	{
+		cuPhotometricError << <blocks, kPhotometricErrorThreads, 0, m_stream >> > (input.visible_pixels, input.nPixels, input.image,
+			input.imageWidth, error_gpu.getPtr());
 	}
-	cv::imwrite(rgb_filepath, image);
+	float error = 0.0f;
+	util::copy(util::hostSpan(&error, 1), error_gpu.span(0, 1));
+	quality.num_pixels = input.nPixels;
+	quality.photometric_error = input.nPixels > 0 ? error / input.nPixels : 0.0f;
+
+	//Landmarks are in NDC, see the sparse term of the Jacobian.
+	const int n_vertices = face.getNumberOfVertices();
+	std::vector<glm::vec3> positions(n_vertices);
+	CHECK_CUDA_ERROR(cudaMemcpy(positions.data(), face.getCurrentFaceGpu(), n_vertices * sizeof(glm::vec3), cudaMemcpyDeviceToHost));
+	const auto& prior_ids = PriorSparseFeatures::get().getPriorIds();
+	const glm::vec2 ndc_to_pixels(0.5f * input.imageWidth, 0.5f * input.imageHeight);
+	float landmark_error = 0.0f;
+	for (int i = 0; i < nFeatures; ++i)
+	{
+		const auto proj_coord = projection * input.face_pose * glm::vec4(positions[prior_ids[i]], 1.0f);
+		const auto uv = glm::vec2(proj_coord.x, proj_coord.y) / proj_coord.w;
+		landmark_error += glm::length((uv - sparse_features[i]) * ndc_to_pixels);
+	}
+	quality.landmark_error = landmark_error / nFeatures;
+
+	if (face.m_graphics_settings.mapped_to_cuda)
+	{
+		unmapRenderTargets(face);
+	}
+
+	return quality;
+}
 
-	textureBarycentricsVertexIdsTestKernel << <blocks, threads >> > (m_texture_barycentrics, m_texture_vertex_ids, face.m_current_face_gpu.getPtr() + face.m_number_of_vertices,
-		temp_memory.getPtr(), img_width, img_height);
+float checkParameterStreamRoundTrip(const Face& face, const glm::mat4& projection, ParameterEncoding encoding, const std::string& scratch_path)
+{
+	size_t clamped_values = 0;
+	{
+		ParameterStreamWriter writer(scratch_path, face, encoding);
+		for (int i = 0; i <= ParameterStreamWriter::kKeyframeInterval; ++i)
+		{
+			writer.write(face, projection, true);
+		}
+		clamped_values = writer.getClampedValues();
+		writer.close(face);
+	}
 
-	util::copy(temp_memory_host, temp_memory, temp_memory.getSize());
-	for (int y = 0; y < image.rows; y++)
+	float max_error = 0.0f;
+	bool exceeded = false;
 	{
-		for (int x = 0; x < image.cols; x++)
+		ParameterStreamReader reader(scratch_path);
+		const auto& header = reader.getHeader();
+		const bool quantized = encoding != ParameterEncoding::Float32;
+		auto compare = [&](float decoded, float written, int group)
 		{
-			auto idx = (x + y * img_width) * 3;
+			const float error = std::abs(decoded - written);
+			max_error = std::max(max_error, error);
+			exceeded |= !(error <= (quantized ? 0.5f * header.steps[group] * (1.0f + 1.0e-3f) : 0.0f));
+		};
 
-			// OpenCV expects it to be an BGRA image.
-			image.at<cv::Vec3b>(cv::Point(x, y)) = cv::Vec3b(255.0f * cv::Vec3f(temp_memory_host[idx + 2], temp_memory_host[idx + 1], temp_memory_host[idx]));
+		FrameParameters parameters;
+		int n_frames = 0;
+		while (reader.read(parameters))
+		{
+			for (int i = 0; i < 3; ++i)
+			{
+				compare(parameters.rotation[i], face.getRotationCoefficients()[i], 0);
+				compare(parameters.translation[i], face.getTranslationCoefficients()[i], 1);
+			}
+			compare(parameters.focal, projection[0][0], 2);
+			for (size_t i = 0; i < parameters.expression.size(); ++i)
+			{
+				compare(parameters.expression[i], face.getExpressionCoefficients()[i], 3);
+			}
+			for (size_t i = 0; i < parameters.sh.size(); ++i)
+			{
+				compare(parameters.sh[i], face.getSHCoefficients()[i], 4);
+			}
+			n_frames++;
 		}
+		exceeded |= n_frames != ParameterStreamWriter::kKeyframeInterval + 1;
 	}
-	cv::imwrite(deferred_filepath, image);
-}
\ No newline at end of file
+	std::remove(scratch_path.c_str());
+
+	if (clamped_values > 0 || exceeded)
+	{
+		throw std::runtime_error("Error: The parameter stream doesn't round-trip the face, " + std::to_string(clamped_values)
+			+ " clamped values, largest error " + std::to_string(max_error) + "!");
+	}
+	return max_error;
+}
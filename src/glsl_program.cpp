@@ -1,13 +1,47 @@
 #include "glsl_program.h"
+#include "mapped_file.h"
 
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <cassert>
+#include <cstring>
+#include <iomanip>
+
+std::string GLSLProgram::s_binary_cache_directory = ".";
+
+//Followed by "size" bytes of the program binary in "format".
+struct ProgramBinaryHeader
+{
+	char magic[4]{ 'F', 'S', 'P', 'B' };
+	uint32_t version = 1;
+	uint64_t hash = 0; //of the sources and the driver, see link
+	uint32_t format = 0;
+	uint32_t size = 0;
+};
+
+//FNV-1a, the cache only has to notice changes, it isn't a security boundary.
+static uint64_t hashBytes(const std::string& bytes, uint64_t hash = 14695981039346656037ull)
+{
+	for (const char byte : bytes)
+	{
+		hash = (hash ^ static_cast<unsigned char>(byte)) * 1099511628211ull;
+	}
+	return hash;
+}
+
+static std::string toHex(uint64_t value)
+{
+	std::ostringstream stream;
+	stream << std::hex << std::setw(16) << std::setfill('0') << value;
+	return stream.str();
+}
 
 GLSLProgram::GLSLProgram(GLSLProgram&& rhs)
 	: m_program(rhs.m_program)
+	, m_sources(std::move(rhs.m_sources))
 	, m_shaders(std::move(rhs.m_shaders))
+	, m_uniform_locations(std::move(rhs.m_uniform_locations))
 {
 	rhs.m_program = 0;
 }
@@ -18,7 +52,9 @@ GLSLProgram& GLSLProgram::operator=(GLSLProgram&& rhs)
 	destroyShaders();
 
 	m_program = rhs.m_program;
+	m_sources = std::move(rhs.m_sources);
 	m_shaders = std::move(rhs.m_shaders);
+	m_uniform_locations = std::move(rhs.m_uniform_locations);
 	rhs.m_program = 0;
 
 	return *this;
@@ -57,38 +93,135 @@ void GLSLProgram::attachShader(GLenum shader_type, const std::string& shader_pat
 		std::cout << "ERROR::glsl_program.cpp::attachShader::SHADER_FILE_NOT_SUCCESFULLY_READ/OPENED" << std::endl;
 	}
 
-	GLuint shader = 0;
-	shader = glCreateShader(shader_type);
-	assert(shader);
+	m_sources.push_back({ shader_type, shader_path, std::move(shader_code) });
+}
+
+void GLSLProgram::compileShaders()
+{
+	for (const auto& source : m_sources)
+	{
+		GLuint shader = 0;
+		shader = glCreateShader(source.type);
+		assert(shader);
+
+		const GLchar* sc_ptr = source.code.c_str();
+		glShaderSource(shader, 1, &sc_ptr, nullptr);
+		glCompileShader(shader);
+		m_shaders.push_back(shader);
+
+		//Check errors, if any.
+		GLint success;
+		GLchar info_log[1024];
+		glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
+		if (!success)
+		{
+			glGetShaderInfoLog(shader, 1024, nullptr, info_log);
+			std::cout << source.path << std::endl;
+			std::cout << "ERROR::glsl_program.cpp::attachShader::COMPILATION_FAILED\n" << info_log << std::endl;
+		}
+	}
+}
 
-	const GLchar* sc_ptr = shader_code.c_str();
-	glShaderSource(shader, 1, &sc_ptr, nullptr);
-	glCompileShader(shader);
-	m_shaders.push_back(shader);
+bool GLSLProgram::loadBinary(const std::string& filepath, uint64_t hash)
+{
+	std::ifstream file(filepath, std::ifstream::binary);
+	ProgramBinaryHeader header;
+	const ProgramBinaryHeader expected;
+	if (!file.is_open() || !file.read(reinterpret_cast<char*>(&header), sizeof(header))
+		|| std::memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 || header.version != expected.version || header.hash != hash)
+	{
+		return false;
+	}
 
-	//Check errors, if any.
-	GLint success;
-	GLchar info_log[1024];
-	glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
-	if (!success)
+	std::vector<char> binary(header.size);
+	if (!file.read(binary.data(), binary.size()))
 	{
-		glGetShaderInfoLog(shader, 1024, nullptr, info_log);
-		std::cout << shader_path << std::endl;
-		std::cout << "ERROR::glsl_program.cpp::attachShader::COMPILATION_FAILED\n" << info_log << std::endl;
+		return false;
 	}
+
+	//The driver may still reject it, e.g. after an update with the same version strings.
+	glProgramBinary(m_program, header.format, binary.data(), static_cast<GLsizei>(binary.size()));
+	GLint success = GL_FALSE;
+	glGetProgramiv(m_program, GL_LINK_STATUS, &success);
+	return success == GL_TRUE;
+}
+
+void GLSLProgram::saveBinary(const std::string& filepath, uint64_t hash) const
+{
+	GLint size = 0;
+	glGetProgramiv(m_program, GL_PROGRAM_BINARY_LENGTH, &size);
+	if (size <= 0)
+	{
+		return;
+	}
+
+	ProgramBinaryHeader header;
+	std::vector<char> binary(size);
+	GLenum format = 0;
+	glGetProgramBinary(m_program, size, nullptr, &format, binary.data());
+	header.hash = hash;
+	header.format = format;
+	header.size = static_cast<uint32_t>(size);
+
+	//Written next to it and renamed, the batch workers may link the same program at the same time.
+	const auto temporary_path = util::getTemporaryPath(filepath);
+	{
+		std::ofstream file(temporary_path, std::ofstream::binary);
+		if (!file.is_open())
+		{
+			std::cout << "Warning: Could not open " << temporary_path << " for writing!" << std::endl;
+			return;
+		}
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		file.write(binary.data(), binary.size());
+	}
+	util::replaceFile(temporary_path, filepath); //a cache, the next link writes it again otherwise
 }
 
 void GLSLProgram::link()
 {
 	destroyProgram();
+	m_uniform_locations.clear();
 
 	m_program = glCreateProgram();
 	assert(m_program);
 
+	GLint n_binary_formats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &n_binary_formats);
+	const bool use_cache = !s_binary_cache_directory.empty() && n_binary_formats > 0;
+
+	std::string filepath;
+	uint64_t hash = 0;
+	if (use_cache)
+	{
+		std::string paths;
+		hash = hashBytes(reinterpret_cast<const char*>(glGetString(GL_VENDOR)));
+		hash = hashBytes(reinterpret_cast<const char*>(glGetString(GL_RENDERER)), hash);
+		hash = hashBytes(reinterpret_cast<const char*>(glGetString(GL_VERSION)), hash);
+		for (const auto& source : m_sources)
+		{
+			paths += source.path + ";";
+			hash = hashBytes(std::to_string(source.type) + source.code, hash);
+		}
+		filepath = s_binary_cache_directory + "/program_cache_" + toHex(hashBytes(paths)) + ".bin";
+
+		if (loadBinary(filepath, hash))
+		{
+			m_sources.clear();
+			return;
+		}
+	}
+
+	compileShaders();
+	m_sources.clear();
 	for (auto shader : m_shaders)
 	{
 		glAttachShader(m_program, shader);
 	}
+	if (use_cache)
+	{
+		glProgramParameteri(m_program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	}
 	glLinkProgram(m_program);
 
 	destroyShaders();
@@ -102,6 +235,20 @@ void GLSLProgram::link()
 		glGetProgramInfoLog(m_program, 1024, nullptr, info_log);
 		std::cout << "ERROR::glsl_program.cpp::link::LINKING_FAILED\n" << info_log << std::endl;
 	}
+	else if (use_cache)
+	{
+		saveBinary(filepath, hash);
+	}
+}
+
+GLint GLSLProgram::getUniformLocation(const std::string& name) const
+{
+	auto it = m_uniform_locations.find(name);
+	if (it == m_uniform_locations.end())
+	{
+		it = m_uniform_locations.emplace(name, glGetUniformLocation(m_program, name.c_str())).first;
+	}
+	return it->second;
 }
 
 void GLSLProgram::use() const
@@ -121,19 +268,19 @@ void GLSLProgram::setUniformIVar(const std::string& name, const std::vector<GLin
 	switch (size)
 	{
 	case 1:
-		glUniform1i(glGetUniformLocation(m_program, name.c_str()), begin[0]);
+		glUniform1i(getUniformLocation(name), begin[0]);
 		break;
 
 	case 2:
-		glUniform2i(glGetUniformLocation(m_program, name.c_str()), begin[0], begin[1]);
+		glUniform2i(getUniformLocation(name), begin[0], begin[1]);
 		break;
 
 	case 3:
-		glUniform3i(glGetUniformLocation(m_program, name.c_str()), begin[0], begin[1], begin[2]);
+		glUniform3i(getUniformLocation(name), begin[0], begin[1], begin[2]);
 		break;
 
 	case 4:
-		glUniform4i(glGetUniformLocation(m_program, name.c_str()), begin[0], begin[1], begin[2], begin[3]);
+		glUniform4i(getUniformLocation(name), begin[0], begin[1], begin[2], begin[3]);
 		break;
 	}
 }
@@ -148,31 +295,31 @@ void GLSLProgram::setUniformFVar(const std::string& name, const std::vector<GLfl
 	switch (size)
 	{
 	case 1:
-		glUniform1f(glGetUniformLocation(m_program, name.c_str()), begin[0]);
+		glUniform1f(getUniformLocation(name), begin[0]);
 		break;
 
 	case 2:
-		glUniform2f(glGetUniformLocation(m_program, name.c_str()), begin[0], begin[1]);
+		glUniform2f(getUniformLocation(name), begin[0], begin[1]);
 		break;
 
 	case 3:
-		glUniform3f(glGetUniformLocation(m_program, name.c_str()), begin[0], begin[1], begin[2]);
+		glUniform3f(getUniformLocation(name), begin[0], begin[1], begin[2]);
 		break;
 
 	case 4:
-		glUniform4f(glGetUniformLocation(m_program, name.c_str()), begin[0], begin[1], begin[2], begin[3]);
+		glUniform4f(getUniformLocation(name), begin[0], begin[1], begin[2], begin[3]);
 		break;
 	}
 }
 
 void GLSLProgram::setUniformFVVar(const std::string& name, const std::vector<GLfloat>& values) const
 {
-	glUniform1fv(glGetUniformLocation(m_program, name.c_str()), values.size(), values.data());
+	glUniform1fv(getUniformLocation(name), values.size(), values.data());
 }
 
 void GLSLProgram::setMat4(const std::string& name, const glm::mat4& matrix) const
 {
-	glUniformMatrix4fv(glGetUniformLocation(m_program, name.c_str()), 1, GL_FALSE, &matrix[0][0]);
+	glUniformMatrix4fv(getUniformLocation(name), 1, GL_FALSE, &matrix[0][0]);
 }
 
 void GLSLProgram::destroyProgram()
@@ -5,7 +5,9 @@
 #include <glm/glm.hpp>
 #include <glad/glad.h>
 
+#include <cstdint>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 class GLSLProgram
@@ -19,20 +21,43 @@ public:
 	GLSLProgram& operator=(GLSLProgram&&);
 	~GLSLProgram();
 
+	//Reads the source, it is compiled by link, unless the program binary cache has the program.
 	void attachShader(GLenum shader_type, const std::string& shader_path);
+	//Loads the program from the binary cache, if the sources and the driver are those it was written with, otherwise
+	//compiles and links the shaders and writes the cache. Without binary formats in the driver it always compiles.
 	void link();
 	void use() const;
 
+	//Of the program binary cache, empty disables it. One file per program (its shader paths), which holds the hash of the
+	//sources and the driver strings, so an edited shader or a driver update just overwrites it.
+	static void setBinaryCacheDirectory(const std::string& directory) { s_binary_cache_directory = directory; }
+
 	void setUniformIVar(const std::string& name, const std::vector<GLint>& values) const;
 	void setUniformFVar(const std::string& name, const std::vector<GLfloat>& values) const;
 	void setUniformFVVar(const std::string& name, const std::vector<GLfloat>& values) const;
 	void setMat4(const std::string& name, const glm::mat4& matrix) const;
 
 private:
+	struct ShaderSource
+	{
+		GLenum type;
+		std::string path;
+		std::string code;
+	};
+
+	std::vector<ShaderSource> m_sources;
 	std::vector<GLuint> m_shaders;
 	GLuint m_program{ 0 };
+	//Filled on the first lookup of each name, glGetUniformLocation is a string search in the driver.
+	mutable std::unordered_map<std::string, GLint> m_uniform_locations;
+
+	static std::string s_binary_cache_directory;
 
 private:
+	GLint getUniformLocation(const std::string& name) const;
+	void compileShaders();
+	bool loadBinary(const std::string& filepath, uint64_t hash);
+	void saveBinary(const std::string& filepath, uint64_t hash) const;
 	void destroyProgram();
 	void destroyShaders();
 };
\ No newline at end of file
@@ -0,0 +1,100 @@
+#include "host_frame_pool.h"
+#include "util.h"
+
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+#include <cuda_runtime.h>
+
+namespace util
+{
+	HostFramePool::HostFramePool(int width, int height, int type, int capacity)
+		: m_size(width, height)
+		, m_type(type)
+	{
+		if (width < 1 || height < 1 || capacity < 1)
+		{
+			throw std::runtime_error("Error: A frame pool needs at least one frame of at least one pixel!");
+		}
+
+		const size_t n_bytes = static_cast<size_t>(width) * height * CV_ELEM_SIZE(type);
+		m_pixels.resize(capacity, nullptr);
+		m_free.reserve(capacity);
+		for (int i = 0; i < capacity; ++i)
+		{
+			void* pixels = nullptr;
+			CHECK_CUDA_ERROR(cudaMallocHost(&pixels, n_bytes));
+			m_pixels[i] = static_cast<uchar*>(pixels);
+			m_free.push_back(i);
+		}
+	}
+
+	HostFramePool::~HostFramePool()
+	{
+		for (auto* pixels : m_pixels)
+		{
+			CHECK_CUDA_ERROR(cudaFreeHost(pixels));
+		}
+	}
+
+	cv::Mat HostFramePool::acquire(const std::atomic<bool>& stop)
+	{
+		//"stop" is owned by the caller and may be set without a wake(), so it is polled as well.
+		constexpr std::chrono::milliseconds kStopPollInterval(5);
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (true)
+		{
+			if (stop.load(std::memory_order_relaxed))
+			{
+				return cv::Mat();
+			}
+			if (!m_free.empty())
+			{
+				break;
+			}
+			m_released.wait_for(lock, kStopPollInterval);
+		}
+		const int index = m_free.back();
+		m_free.pop_back();
+		return cv::Mat(m_size, m_type, m_pixels[index]);
+	}
+
+	void HostFramePool::wake()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_released.notify_all();
+	}
+
+	cv::Mat HostFramePool::tryAcquire()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_free.empty())
+		{
+			return cv::Mat();
+		}
+		const int index = m_free.back();
+		m_free.pop_back();
+		return cv::Mat(m_size, m_type, m_pixels[index]);
+	}
+
+	bool HostFramePool::owns(const cv::Mat& frame) const
+	{
+		return !frame.empty() && std::find(m_pixels.begin(), m_pixels.end(), frame.data) != m_pixels.end();
+	}
+
+	bool HostFramePool::release(const cv::Mat& frame)
+	{
+		const auto it = frame.empty() ? m_pixels.end() : std::find(m_pixels.begin(), m_pixels.end(), frame.data);
+		if (it == m_pixels.end())
+		{
+			return false;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_free.push_back(static_cast<int>(it - m_pixels.begin()));
+		}
+		m_released.notify_one();
+		return true;
+	}
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+#include "opencv2/core/core.hpp"
+
+namespace util
+{
+	//Pinned host frames of one size and type, recycled through the pipeline instead of a new cv::Mat per frame. A frame is a
+	//cv::Mat header over pinned pixels, so cv::VideoCapture::read, cv::pyrDown or copyTo of the same size and type write into
+	//it without allocating, and Pyramid uploads it without the staging copy. The owner of an acquired frame releases it once
+	//nothing reads it anymore, from any thread. Copies of the header don't count, like for any cv::Mat of external data.
+	class HostFramePool
+	{
+	public:
+		HostFramePool(int width, int height, int type, int capacity);
+		~HostFramePool();
+
+		HostFramePool(const HostFramePool&) = delete;
+		HostFramePool& operator=(const HostFramePool&) = delete;
+
+		//A free frame, its pixels are undefined. Waits until one is released or "stop" is set, then it is empty.
+		cv::Mat acquire(const std::atomic<bool>& stop);
+		//Wakes a waiting acquire, so it sees its "stop" flag right away instead of with the next poll.
+		void wake();
+		//Empty if all frames are in use.
+		cv::Mat tryAcquire();
+		//Returns "frame" to the pool. False for an empty frame or one that isn't of the pool, e.g. after a write of another size
+		//reallocated it. The pixels of that frame may be written again by the next owner, so e.g. an upload from them has to be done.
+		bool release(const cv::Mat& frame);
+
+		//"frame" has the pixels of a frame of the pool.
+		bool owns(const cv::Mat& frame) const;
+
+		int getCapacity() const { return static_cast<int>(m_pixels.size()); }
+		cv::Size getSize() const { return m_size; }
+		int getType() const { return m_type; }
+
+	private:
+		cv::Size m_size;
+		int m_type;
+		std::vector<uchar*> m_pixels; //pinned, one frame each
+		std::mutex m_mutex;
+		std::condition_variable m_released;
+		std::vector<int> m_free; //indices into m_pixels, never grows beyond the capacity
+	};
+}
@@ -0,0 +1,97 @@
+#include "identity_calibrator.h"
+#include "allocation_tracker.h"
+#include "profiler.h"
+#include "util.h"
+
+#include <algorithm>
+#include <cfloat>
+
+namespace
+{
+	//Smallest distance between two of the rotations (Euler angles), skipping entry "skip".
+	float computeDiversity(const std::vector<glm::vec3>& rotations, size_t skip)
+	{
+		float diversity = FLT_MAX;
+		for (size_t i = 0; i < rotations.size(); ++i)
+		{
+			for (size_t j = i + 1; j < rotations.size(); ++j)
+			{
+				if (i != skip && j != skip)
+				{
+					diversity = std::min(diversity, glm::distance(rotations[i], rotations[j]));
+				}
+			}
+		}
+		return diversity;
+	}
+}
+
+IdentityCalibrator::IdentityCalibrator(int num_keyframes)
+	: m_num_keyframes(std::max(num_keyframes, 1))
+{
+}
+
+void IdentityCalibrator::addFrame(const Pyramid& pyramid, const std::vector<glm::vec2>& sparse_features, const Face& face, cudaStream_t stream)
+{
+	const int frame_size = 3 * pyramid.getWidth(0) * pyramid.getHeight(0);
+	util::ScopedAllocationTag tag("identity calibration");
+	util::ensureSize(m_last_frame, frame_size);
+	CHECK_CUDA_ERROR(cudaMemcpyAsync(m_last_frame.getPtr(), pyramid.getRawFrame(), frame_size, cudaMemcpyDeviceToDevice, stream));
+	m_num_frames++;
+
+	//Full: the frame replaces the keyframe whose removal leaves the most diverse poses, if that beats the keyframes as they are.
+	size_t slot = m_keyframes.size();
+	if (m_keyframes.size() >= static_cast<size_t>(m_num_keyframes))
+	{
+		std::vector<glm::vec3> rotations;
+		for (const auto& keyframe : m_keyframes)
+		{
+			rotations.push_back(keyframe.rotation);
+		}
+		rotations.push_back(face.getRotationCoefficients());
+
+		float best_diversity = computeDiversity(rotations, rotations.size() - 1);
+		for (size_t i = 0; i < m_keyframes.size(); ++i)
+		{
+			const float diversity = computeDiversity(rotations, i);
+			if (diversity > best_diversity)
+			{
+				best_diversity = diversity;
+				slot = i;
+			}
+		}
+		if (slot == m_keyframes.size())
+		{
+			return;
+		}
+	}
+	else
+	{
+		m_keyframes.emplace_back();
+	}
+
+	auto& keyframe = m_keyframes[slot];
+	util::ensureSize(keyframe.frame, frame_size);
+	CHECK_CUDA_ERROR(cudaMemcpyAsync(keyframe.frame.getPtr(), pyramid.getRawFrame(), frame_size, cudaMemcpyDeviceToDevice, stream));
+	keyframe.sparse_features = sparse_features;
+	keyframe.rotation = face.getRotationCoefficients();
+	keyframe.translation = face.getTranslationCoefficients();
+	keyframe.expression = face.getExpressionCoefficients();
+	keyframe.sh = face.getSHCoefficients();
+}
+
+void IdentityCalibrator::calibrate(GaussNewtonSolver& solver, Face& face, glm::mat4& projection, Pyramid& pyramid)
+{
+	{
+		util::ScopedTimer timer("Joint identity", true);
+		solver.solveIdentity(m_keyframes, face, projection, pyramid);
+	}
+	pyramid.uploadFrame(m_last_frame.getPtr(), 3 * pyramid.getWidth(0), 3, solver.getStream());
+	reset();
+}
+
+void IdentityCalibrator::reset()
+{
+	m_num_frames = 0;
+	m_keyframes.clear();
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "gauss_newton_solver.h"
+#include "device_array.h"
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <cuda_runtime.h>
+
+//Calibration phase of SolverParameters::use_joint_calibration. The tracked frames are offered one by one as the solver fitted
+//them. The calibrator keeps the num_keyframes frames whose head poses differ most, as the largest smallest distance between two
+//rotations, because a single view leaves the identity poorly conditioned. The frames are copied on the device. calibrate then
+//solves the identity over all of them, see GaussNewtonSolver::solveIdentity.
+class IdentityCalibrator
+{
+public:
+	explicit IdentityCalibrator(int num_keyframes);
+	IdentityCalibrator(const IdentityCalibrator&) = delete;
+	IdentityCalibrator& operator=(const IdentityCalibrator&) = delete;
+
+	//The frame in "pyramid", with "face" as the solver left it for that frame. Copies on "stream".
+	void addFrame(const Pyramid& pyramid, const std::vector<glm::vec2>& sparse_features, const Face& face, cudaStream_t stream);
+	int getNumFrames() const { return m_num_frames; } //offered since the last reset
+	//Locks the identity of "face" and starts over. The last offered frame is uploaded into "pyramid" again, so the display and
+	//the next frame see the pyramid as it was.
+	void calibrate(GaussNewtonSolver& solver, Face& face, glm::mat4& projection, Pyramid& pyramid);
+	void reset();
+
+private:
+	int m_num_keyframes;
+	int m_num_frames{ 0 };
+	std::vector<CalibrationKeyframe> m_keyframes;
+	util::DeviceArray<uchar> m_last_frame;
+};
@@ -0,0 +1,113 @@
+#include "identity_profile_store.h"
+#include "face.h"
+#include "mapped_file.h"
+
+#include <cctype>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+
+IdentityProfileStore::IdentityProfileStore(const std::string& directory)
+	: m_directory(directory)
+{
+	if (!m_directory.empty() && m_directory.back() != '/' && m_directory.back() != '\\')
+	{
+		m_directory += '/';
+	}
+}
+
+std::string IdentityProfileStore::getPath(const std::string& subject_id) const
+{
+	bool valid = !subject_id.empty() && subject_id[0] != '.';
+	for (const char c : subject_id)
+	{
+		valid = valid && (std::isalnum(static_cast<unsigned char>(c)) || c == '-' || c == '_' || c == '.');
+	}
+	if (!valid)
+	{
+		throw std::runtime_error("Error: \"" + subject_id + "\" is not a valid subject id!");
+	}
+	return m_directory + subject_id + ".identity";
+}
+
+bool IdentityProfileStore::contains(const std::string& subject_id) const
+{
+	return std::ifstream(getPath(subject_id)).good();
+}
+
+bool IdentityProfileStore::load(const std::string& subject_id, Face& face, bool load_sh) const
+{
+	const std::string path = getPath(subject_id);
+	std::ifstream file(path, std::ifstream::binary);
+	if (!file.is_open())
+	{
+		return false;
+	}
+
+	IdentityProfileHeader header;
+	file.read(reinterpret_cast<char*>(&header), sizeof(header));
+	if (!file || std::memcmp(header.magic, "FIDP", 4) != 0 || header.version != IdentityProfileHeader().version)
+	{
+		throw std::runtime_error("Error: " + path + " is not an identity profile of version " + std::to_string(IdentityProfileHeader().version));
+	}
+	if (header.num_shape_coefficients != face.getShapeCoefficients().size() || header.num_albedo_coefficients != face.getAlbedoCoefficients().size()
+		|| (header.num_sh_coefficients != 0 && header.num_sh_coefficients != face.getSHCoefficients().size()))
+	{
+		throw std::runtime_error("Error: The identity profile " + path + " was saved with another morphable model!");
+	}
+
+	std::vector<float> shape(header.num_shape_coefficients);
+	std::vector<float> albedo(header.num_albedo_coefficients);
+	std::vector<float> sh(header.num_sh_coefficients);
+	file.read(reinterpret_cast<char*>(shape.data()), shape.size() * sizeof(float));
+	file.read(reinterpret_cast<char*>(albedo.data()), albedo.size() * sizeof(float));
+	file.read(reinterpret_cast<char*>(sh.data()), sh.size() * sizeof(float));
+	if (!file)
+	{
+		throw std::runtime_error("Error: The identity profile " + path + " is truncated!");
+	}
+
+	face.getShapeCoefficients() = shape;
+	face.getAlbedoCoefficients() = albedo;
+	if (load_sh && !sh.empty())
+	{
+		face.getSHCoefficients() = sh;
+	}
+	//Bakes every coefficient of the profile, the solver sets its own counts with the first frame.
+	face.setActiveCoefficients(static_cast<int>(shape.size()), face.getNumActiveExpressionCoefficients(), static_cast<int>(albedo.size()));
+	face.lockIdentity();
+	return true;
+}
+
+void IdentityProfileStore::save(const std::string& subject_id, const Face& face, bool save_sh) const
+{
+	const std::string path = getPath(subject_id);
+	const std::string temporary_path = util::getTemporaryPath(path);
+	{
+		std::ofstream file(temporary_path, std::ofstream::binary);
+		if (!file.is_open())
+		{
+			throw std::runtime_error("Error: Could not open " + temporary_path + " for writing!");
+		}
+
+		IdentityProfileHeader header;
+		header.num_shape_coefficients = static_cast<uint32_t>(face.getShapeCoefficients().size());
+		header.num_albedo_coefficients = static_cast<uint32_t>(face.getAlbedoCoefficients().size());
+		header.num_sh_coefficients = save_sh ? static_cast<uint32_t>(face.getSHCoefficients().size()) : 0;
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		file.write(reinterpret_cast<const char*>(face.getShapeCoefficients().data()), header.num_shape_coefficients * sizeof(float));
+		file.write(reinterpret_cast<const char*>(face.getAlbedoCoefficients().data()), header.num_albedo_coefficients * sizeof(float));
+		file.write(reinterpret_cast<const char*>(face.getSHCoefficients().data()), header.num_sh_coefficients * sizeof(float));
+		if (!file)
+		{
+			throw std::runtime_error("Error: Could not write the identity profile " + temporary_path);
+		}
+	}
+
+	//Like writeTrackingSnapshot, a reader never sees a half written profile.
+	if (!util::replaceFile(temporary_path, path))
+	{
+		throw std::runtime_error("Error: Could not replace the identity profile " + path);
+	}
+}
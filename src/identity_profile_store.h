@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+class Face;
+
+//Identity of one subject: a header, followed by the shape, albedo and SH coefficients as floats. The SH are the lighting of the
+//session the profile was saved in, a start value for the next one. num_sh_coefficients is 0, if they weren't stored.
+struct IdentityProfileHeader
+{
+	char magic[4]{ 'F', 'I', 'D', 'P' };
+	uint32_t version = 1;
+	uint32_t num_shape_coefficients = 0;
+	uint32_t num_albedo_coefficients = 0;
+	uint32_t num_sh_coefficients = 0;
+};
+
+//Identities of returning subjects, one file <subject id>.identity per subject in a directory. A face loaded from the store
+//starts with a locked identity, so there is no calibration phase: from the first frame on the solver only estimates
+//expression, pose and lighting. Ids consist of letters, digits, '-', '_' and '.', so they can't leave the directory.
+class IdentityProfileStore
+{
+public:
+	//The directory has to exist.
+	explicit IdentityProfileStore(const std::string& directory);
+
+	bool contains(const std::string& subject_id) const;
+	//Sets the shape and albedo coefficients of "face" (and its SH, if the profile has them and "load_sh" is set) and locks its
+	//identity. False, if there's no profile of "subject_id". Throws, if the profile doesn't match the model of the face.
+	bool load(const std::string& subject_id, Face& face, bool load_sh = true) const;
+	//Stores the identity of "face" under "subject_id", replacing an older profile. The host coefficients have to be up to date.
+	void save(const std::string& subject_id, const Face& face, bool save_sh = true) const;
+
+private:
+	std::string getPath(const std::string& subject_id) const;
+
+	std::string m_directory;
+};
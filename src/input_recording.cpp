@@ -0,0 +1,396 @@
+#include "input_recording.h"
+#include "util.h"
+#include "thread_placement.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include "opencv2/highgui/highgui.hpp"
+
+RecordedSolverControls RecordedSolverControls::capture(const SolverParameters& params)
+{
+	RecordedSolverControls controls;
+	controls.deadline_ms = params.deadline_ms;
+	controls.num_shape_coefficients = params.num_shape_coefficients;
+	controls.num_albedo_coefficients = params.num_albedo_coefficients;
+	controls.num_expression_coefficients = params.num_expression_coefficients;
+	controls.pixel_sampling_mode = params.pixel_sampling_mode;
+	controls.pixel_sample_stride = params.pixel_sample_stride;
+	controls.num_pixel_samples = params.num_pixel_samples;
+	//Levels beyond kMaxLevels repeat the last one anyway, see SolverParameters::getLevel.
+	controls.num_levels = static_cast<uint32_t>(std::min<size_t>(params.levels.size(), kMaxLevels));
+	std::copy(params.levels.begin(), params.levels.begin() + controls.num_levels, controls.levels);
+	return controls;
+}
+
+void RecordedSolverControls::apply(SolverParameters& params) const
+{
+	params.num_shape_coefficients = num_shape_coefficients;
+	params.num_albedo_coefficients = num_albedo_coefficients;
+	params.num_expression_coefficients = num_expression_coefficients;
+	params.pixel_sampling_mode = pixel_sampling_mode;
+	params.pixel_sample_stride = pixel_sample_stride;
+	params.num_pixel_samples = num_pixel_samples;
+	if (num_levels > 0)
+	{
+		params.levels.assign(levels, levels + std::min<uint32_t>(num_levels, kMaxLevels));
+	}
+}
+
+template<typename T>
+static void append(std::vector<char>& buffer, const T& value)
+{
+	const char* bytes = reinterpret_cast<const char*>(&value);
+	buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+}
+
+static void append(std::vector<char>& buffer, const void* data, size_t size)
+{
+	const char* bytes = static_cast<const char*>(data);
+	buffer.insert(buffer.end(), bytes, bytes + size);
+}
+
+//Reads from a record, false once it would read past its end.
+class RecordParser
+{
+public:
+	explicit RecordParser(const std::vector<char>& record) : m_record(record) {}
+
+	bool read(void* data, size_t size)
+	{
+		if (size == 0)
+		{
+			return true;
+		}
+		if (m_offset + size > m_record.size())
+		{
+			return false;
+		}
+		std::memcpy(data, m_record.data() + m_offset, size);
+		m_offset += size;
+		return true;
+	}
+
+	template<typename T>
+	bool read(T& value)
+	{
+		return read(&value, sizeof(T));
+	}
+
+	const char* getCurrent() const { return m_record.data() + m_offset; }
+	bool skip(size_t size)
+	{
+		m_offset += size;
+		return m_offset <= m_record.size();
+	}
+
+private:
+	const std::vector<char>& m_record;
+	size_t m_offset{ 0 };
+};
+
+InputRecorder::InputRecorder(const std::string& filepath, InputRecordingCodec codec, int num_buffers)
+	: m_file(filepath, std::ofstream::binary)
+	, m_slots(std::max(num_buffers, 1))
+	, m_free_slots(m_slots.size())
+	, m_filled_slots(m_slots.size())
+	, m_start(std::chrono::high_resolution_clock::now())
+{
+	if (!m_file.is_open())
+	{
+		throw std::runtime_error("Error: Could not open " + filepath + " for writing!");
+	}
+
+	m_header.codec = static_cast<uint32_t>(codec);
+	m_file.write(reinterpret_cast<const char*>(&m_header), sizeof(m_header));
+	for (int i = 0; i < m_slots.size(); ++i)
+	{
+		int slot = i;
+		m_free_slots.tryPush(std::move(slot));
+	}
+	m_writer = std::thread(&InputRecorder::write, this);
+}
+
+InputRecorder::~InputRecorder()
+{
+	m_stop = true;
+	m_writer.join();
+
+	//The index and the final header make the recording seekable without walking it.
+	m_header.num_frames = static_cast<uint32_t>(m_offsets.size());
+	m_header.index_offset = static_cast<uint64_t>(m_file.tellp());
+	m_file.write(reinterpret_cast<const char*>(m_offsets.data()), m_offsets.size() * sizeof(uint64_t));
+	m_file.seekp(0);
+	m_file.write(reinterpret_cast<const char*>(&m_header), sizeof(m_header));
+	m_file.close();
+
+	for (auto& slot : m_slots)
+	{
+		CHECK_CUDA_ERROR(cudaFreeHost(slot.pixels));
+	}
+
+	if (m_num_dropped_frames > 0)
+	{
+		std::cout << "Warning: " << m_num_dropped_frames << " frames weren't recorded, the recorder couldn't keep up!" << std::endl;
+	}
+}
+
+void InputRecorder::capture(const cv::Mat& frame, const std::vector<std::vector<glm::vec2>>& sparse_features, const SolverParameters& params)
+{
+	const uint32_t frame_index = m_next_frame_index++;
+	if (frame.empty())
+	{
+		return;
+	}
+	if (m_header.frame_width == 0)
+	{
+		m_header.frame_width = frame.cols;
+		m_header.frame_height = frame.rows;
+		m_header.frame_type = frame.type();
+	}
+	if (static_cast<uint32_t>(frame.cols) != m_header.frame_width || static_cast<uint32_t>(frame.rows) != m_header.frame_height ||
+		static_cast<uint32_t>(frame.type()) != m_header.frame_type ||
+		(m_captured_slot < 0 && !m_free_slots.tryPop(m_captured_slot)))
+	{
+		m_num_dropped_frames++;
+		return;
+	}
+
+	auto& slot = m_slots[m_captured_slot];
+	const size_t size = frame.total() * frame.elemSize();
+	if (slot.capacity < size)
+	{
+		void* pixels = nullptr;
+		CHECK_CUDA_ERROR(cudaFreeHost(slot.pixels));
+		CHECK_CUDA_ERROR(cudaMallocHost(&pixels, size));
+		slot.pixels = static_cast<unsigned char*>(pixels);
+		slot.capacity = size;
+	}
+
+	auto& record = slot.record;
+	record.frame = cv::Mat(frame.size(), frame.type(), slot.pixels);
+	frame.copyTo(record.frame);
+	record.frame_index = frame_index;
+	record.timestamp_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - m_start).count();
+	record.sparse_features = sparse_features;
+	record.controls = RecordedSolverControls::capture(params);
+}
+
+void InputRecorder::commit(const std::vector<std::pair<std::string, util::Profiler::Sample>>& stages)
+{
+	if (m_captured_slot < 0)
+	{
+		return;
+	}
+
+	m_slots[m_captured_slot].record.stages = stages;
+	m_filled_slots.tryPush(std::move(m_captured_slot)); //can't fail, there are only as many slots as places in the queue
+	m_captured_slot = -1;
+}
+
+void InputRecorder::write()
+{
+	util::ThreadPlacement::get().apply(util::ThreadStage::Io);
+	std::vector<char> buffer;
+	std::vector<uchar> encoded;
+	int index;
+	while (true)
+	{
+		if (!m_filled_slots.tryPop(index))
+		{
+			//Drain the queue before stopping.
+			if (m_stop.load())
+			{
+				break;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			continue;
+		}
+
+		{
+			util::ScopedTimer timer("Input recording");
+			const auto& record = m_slots[index].record;
+			const void* pixels = record.frame.data;
+			size_t pixel_bytes = record.frame.total() * record.frame.elemSize();
+			if (m_header.codec == static_cast<uint32_t>(InputRecordingCodec::Png))
+			{
+				cv::imencode(".png", record.frame, encoded);
+				pixels = encoded.data();
+				pixel_bytes = encoded.size();
+			}
+
+			//Record: its size, index and time, the controls, the landmarks, the stages, then the frame.
+			buffer.clear();
+			append(buffer, uint32_t(0));
+			append(buffer, record.frame_index);
+			append(buffer, record.timestamp_ms);
+			append(buffer, record.controls);
+			append(buffer, static_cast<uint32_t>(record.sparse_features.size()));
+			for (const auto& landmarks : record.sparse_features)
+			{
+				append(buffer, static_cast<uint32_t>(landmarks.size()));
+				append(buffer, landmarks.data(), landmarks.size() * sizeof(glm::vec2));
+			}
+			append(buffer, static_cast<uint32_t>(record.stages.size()));
+			for (const auto& stage : record.stages)
+			{
+				append(buffer, static_cast<uint32_t>(stage.first.size()));
+				append(buffer, stage.first.data(), stage.first.size());
+				append(buffer, stage.second.cpu_ms);
+				append(buffer, stage.second.gpu_ms);
+			}
+			append(buffer, static_cast<int32_t>(record.frame.cols));
+			append(buffer, static_cast<int32_t>(record.frame.rows));
+			append(buffer, static_cast<int32_t>(record.frame.type()));
+			append(buffer, static_cast<uint64_t>(pixel_bytes));
+			append(buffer, pixels, pixel_bytes);
+			const uint32_t record_size = static_cast<uint32_t>(buffer.size() - sizeof(uint32_t));
+			std::memcpy(buffer.data(), &record_size, sizeof(record_size));
+
+			m_offsets.push_back(static_cast<uint64_t>(m_file.tellp()));
+			m_file.write(buffer.data(), buffer.size());
+		}
+		m_num_recorded_frames++;
+		m_free_slots.tryPush(std::move(index));
+	}
+}
+
+InputRecordingReader::InputRecordingReader(const std::string& filepath)
+	: m_file(filepath, std::ifstream::binary)
+{
+	if (!m_file.is_open())
+	{
+		throw std::runtime_error("Error: Could not open the input recording " + filepath);
+	}
+
+	const InputRecordingHeader expected;
+	m_file.read(reinterpret_cast<char*>(&m_header), sizeof(m_header));
+	if (!m_file || std::memcmp(m_header.magic, expected.magic, sizeof(expected.magic)) != 0 || m_header.version != expected.version)
+	{
+		throw std::runtime_error("Error: " + filepath + " isn't an input recording of version " + std::to_string(expected.version) + "!");
+	}
+
+	if (m_header.index_offset > 0)
+	{
+		m_offsets.resize(m_header.num_frames);
+		m_file.seekg(m_header.index_offset);
+		m_file.read(reinterpret_cast<char*>(m_offsets.data()), m_offsets.size() * sizeof(uint64_t));
+		if (m_file)
+		{
+			return;
+		}
+		m_file.clear();
+	}
+
+	//Not closed, e.g. after a crash of the deployment: walk the records up to the first truncated one.
+	std::cout << "Warning: " << filepath << " wasn't closed, its records are indexed by reading it." << std::endl;
+	m_offsets.clear();
+	m_file.seekg(0, std::ifstream::end);
+	const uint64_t file_size = static_cast<uint64_t>(m_file.tellg());
+	uint64_t offset = sizeof(InputRecordingHeader);
+	uint32_t record_size = 0;
+	while (offset + sizeof(record_size) <= file_size)
+	{
+		m_file.seekg(offset);
+		m_file.read(reinterpret_cast<char*>(&record_size), sizeof(record_size));
+		if (!m_file || offset + sizeof(record_size) + record_size > file_size)
+		{
+			break;
+		}
+		m_offsets.push_back(offset);
+		offset += sizeof(record_size) + record_size;
+	}
+	m_file.clear();
+}
+
+bool InputRecordingReader::isRecording(const std::string& filepath)
+{
+	std::ifstream file(filepath, std::ifstream::binary);
+	char magic[4] = {};
+	file.read(magic, sizeof(magic));
+	return file && std::memcmp(magic, InputRecordingHeader().magic, sizeof(magic)) == 0;
+}
+
+bool InputRecordingReader::read(int i, RecordedFrame& record)
+{
+	if (i < 0 || i >= m_offsets.size())
+	{
+		return false;
+	}
+
+	uint32_t record_size = 0;
+	m_file.seekg(m_offsets[i]);
+	m_file.read(reinterpret_cast<char*>(&record_size), sizeof(record_size));
+	m_record.resize(record_size);
+	m_file.read(m_record.data(), record_size);
+	if (!m_file)
+	{
+		m_file.clear();
+		return false;
+	}
+
+	RecordParser parser(m_record);
+	uint32_t count = 0;
+	if (!parser.read(record.frame_index) || !parser.read(record.timestamp_ms) || !parser.read(record.controls) || !parser.read(count))
+	{
+		return false;
+	}
+	record.sparse_features.resize(count);
+	for (auto& landmarks : record.sparse_features)
+	{
+		if (!parser.read(count))
+		{
+			return false;
+		}
+		landmarks.resize(count);
+		if (!parser.read(landmarks.data(), count * sizeof(glm::vec2)))
+		{
+			return false;
+		}
+	}
+
+	if (!parser.read(count))
+	{
+		return false;
+	}
+	record.stages.resize(count);
+	for (auto& stage : record.stages)
+	{
+		if (!parser.read(count))
+		{
+			return false;
+		}
+		stage.first.resize(count);
+		if ((count > 0 && !parser.read(&stage.first[0], count)) || !parser.read(stage.second.cpu_ms) || !parser.read(stage.second.gpu_ms))
+		{
+			return false;
+		}
+		stage.second.frame = static_cast<int>(record.frame_index);
+	}
+
+	int32_t width = 0;
+	int32_t height = 0;
+	int32_t type = 0;
+	uint64_t pixel_bytes = 0;
+	if (!parser.read(width) || !parser.read(height) || !parser.read(type) || !parser.read(pixel_bytes))
+	{
+		return false;
+	}
+	const char* pixels = parser.getCurrent();
+	if (!parser.skip(pixel_bytes))
+	{
+		return false;
+	}
+	if (m_header.codec == static_cast<uint32_t>(InputRecordingCodec::Png))
+	{
+		record.frame = cv::imdecode(cv::Mat(1, static_cast<int>(pixel_bytes), CV_8UC1, const_cast<char*>(pixels)), cv::IMREAD_UNCHANGED);
+		return !record.frame.empty();
+	}
+	if (pixel_bytes != static_cast<uint64_t>(width) * height * CV_ELEM_SIZE(type))
+	{
+		return false;
+	}
+	cv::Mat(height, width, type, const_cast<char*>(pixels)).copyTo(record.frame);
+	return true;
+}
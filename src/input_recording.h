@@ -0,0 +1,141 @@
+#pragma once
+
+#include "gauss_newton_solver.h"
+#include "profiler.h"
+#include "spsc_queue.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <glm/glm.hpp>
+#include "opencv2/core/core.hpp"
+
+//Recording of what a deployment processed, so it can be run again against another build (see loadBenchmarkFixture). A header,
+//one record per recorded frame, then the file offsets of the records. Every record starts with its size, so a recording whose
+//writer didn't close it (num_frames 0) is still read by walking the records.
+struct InputRecordingHeader
+{
+	char magic[4]{ 'F', 'R', 'E', 'C' };
+	uint32_t version = 1;
+	uint32_t num_frames = 0; //updated when the recorder is closed, like index_offset
+	uint32_t codec = 0; //see InputRecordingCodec
+	//Of the first frame, every record also has its own. Frames of another size or type aren't recorded.
+	uint32_t frame_width = 0;
+	uint32_t frame_height = 0;
+	uint32_t frame_type = 0; //cv::Mat type
+	uint32_t reserved = 0;
+	uint64_t index_offset = 0; //num_frames uint64 offsets of the records
+};
+
+enum class InputRecordingCodec
+{
+	Raw = 0,	//the pixels as they are
+	Png = 1,	//lossless, encoded on the thread of the recorder
+};
+
+//The parameters BudgetController adapts per frame, which a replay applies to the configured ones of its build. The deadline
+//is recorded, but not applied: it cuts on the host time, so a replay with it wouldn't be deterministic.
+struct RecordedSolverControls
+{
+	static constexpr int kMaxLevels = 8;
+
+	float deadline_ms = 0.0f;
+	int32_t num_shape_coefficients = 0;
+	int32_t num_albedo_coefficients = 0;
+	int32_t num_expression_coefficients = 0;
+	int32_t pixel_sampling_mode = 0;
+	int32_t pixel_sample_stride = 1;
+	int32_t num_pixel_samples = 0;
+	uint32_t num_levels = 0;
+	LevelSchedule levels[kMaxLevels];
+
+	static RecordedSolverControls capture(const SolverParameters& params);
+	void apply(SolverParameters& params) const;
+};
+
+//One frame of a recording.
+struct RecordedFrame
+{
+	uint32_t frame_index = 0; //of the frames the recorder was given, dropped ones leave gaps
+	double timestamp_ms = 0.0; //since the recorder was created
+	cv::Mat frame;
+	std::vector<std::vector<glm::vec2>> sparse_features; //one entry per face slot, empty for untracked ones
+	RecordedSolverControls controls;
+	std::vector<std::pair<std::string, util::Profiler::Sample>> stages; //of the frame, see Profiler::getFrameSamples
+};
+
+//Writes a recording on its own thread. A frame is copied into one of "num_buffers" pinned buffers and queued, the pipeline
+//never waits for the disk or the encoder: if every buffer is queued, the frame is dropped instead. The stage timings of a
+//frame are only known once the profiler ended it, so a frame is captured during the frame and committed after endFrame.
+class InputRecorder
+{
+public:
+	//Throws, if "filepath" can't be opened. Frames of another size or type than the first one are dropped.
+	InputRecorder(const std::string& filepath, InputRecordingCodec codec = InputRecordingCodec::Raw, int num_buffers = 8);
+	//Writes all committed frames and closes the recording.
+	~InputRecorder();
+
+	InputRecorder(const InputRecorder&) = delete;
+	InputRecorder& operator=(const InputRecorder&) = delete;
+
+	//Copies "frame" (8-bit, 1 to 4 channels) and the inputs of its solve. Replaces a captured frame which wasn't committed.
+	void capture(const cv::Mat& frame, const std::vector<std::vector<glm::vec2>>& sparse_features, const SolverParameters& params);
+	//Queues the captured frame with the stage timings of its frame, nothing if there is none.
+	void commit(const std::vector<std::pair<std::string, util::Profiler::Sample>>& stages);
+
+	int getNumberOfRecordedFrames() const { return m_num_recorded_frames; }
+	int getNumberOfDroppedFrames() const { return m_num_dropped_frames; }
+
+private:
+	struct Slot
+	{
+		unsigned char* pixels = nullptr; //pinned
+		size_t capacity = 0;
+		RecordedFrame record; //record.frame is a header over "pixels"
+	};
+
+	void write();
+
+private:
+	std::ofstream m_file;
+	InputRecordingHeader m_header;
+	std::vector<uint64_t> m_offsets;
+	std::vector<Slot> m_slots;
+	util::SpscQueue<int> m_free_slots;	//writer -> capture
+	util::SpscQueue<int> m_filled_slots;	//commit -> writer
+	int m_captured_slot{ -1 };
+	uint32_t m_next_frame_index{ 0 };
+	std::chrono::high_resolution_clock::time_point m_start;
+	std::atomic<bool> m_stop{ false };
+	std::thread m_writer;
+	std::atomic<int> m_num_recorded_frames{ 0 };
+	int m_num_dropped_frames{ 0 };
+};
+
+//Reads a recording in any order.
+class InputRecordingReader
+{
+public:
+	//Throws, if "filepath" can't be opened or isn't a recording of this version.
+	explicit InputRecordingReader(const std::string& filepath);
+
+	const InputRecordingHeader& getHeader() const { return m_header; }
+	int getNumberOfFrames() const { return static_cast<int>(m_offsets.size()); }
+
+	//The i-th record of the recording. False, if it is truncated.
+	bool read(int i, RecordedFrame& record);
+
+	//"filepath" starts with the magic of a recording.
+	static bool isRecording(const std::string& filepath);
+
+private:
+	std::ifstream m_file;
+	InputRecordingHeader m_header;
+	std::vector<uint64_t> m_offsets;
+	std::vector<char> m_record;
+};
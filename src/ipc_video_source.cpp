@@ -0,0 +1,264 @@
+#include "ipc_video_source.h"
+#include "util.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <thread>
+
+namespace util
+{
+	static_assert(sizeof(IpcFrameRingHeader) < 4096, "The ring header should fit into a page.");
+
+	namespace
+	{
+		//The next frame is usually a few milliseconds away, so a wait yields for a while before it sleeps. A stalled or dead
+		//peer then costs no core.
+		void backOff(int& attempt)
+		{
+			constexpr int kYieldAttempts = 64;
+			if (attempt++ < kYieldAttempts)
+			{
+				std::this_thread::yield();
+			}
+			else
+			{
+				std::this_thread::sleep_for(std::chrono::microseconds(500));
+			}
+		}
+
+		//Whether the heartbeat of the other side moved within the last IpcFrameRingHeader::kLivenessTimeoutSeconds.
+		class PeerWatch
+		{
+		public:
+			explicit PeerWatch(const std::atomic<uint64_t>& heartbeat)
+				: m_heartbeat(heartbeat)
+				, m_last_beat(heartbeat.load(std::memory_order_relaxed))
+				, m_last_change(std::chrono::steady_clock::now())
+			{}
+
+			bool isAlive()
+			{
+				const uint64_t beat = m_heartbeat.load(std::memory_order_relaxed);
+				const auto now = std::chrono::steady_clock::now();
+				if (beat != m_last_beat)
+				{
+					m_last_beat = beat;
+					m_last_change = now;
+				}
+				return std::chrono::duration<double>(now - m_last_change).count() < IpcFrameRingHeader::kLivenessTimeoutSeconds;
+			}
+
+		private:
+			const std::atomic<uint64_t>& m_heartbeat;
+			uint64_t m_last_beat;
+			std::chrono::steady_clock::time_point m_last_change;
+		};
+	}
+
+	IpcFrameWriter::IpcFrameWriter(const std::string& name, int width, int height, int channels, int num_slots)
+		: m_region(name, sizeof(IpcFrameRingHeader))
+	{
+		if (!m_region.isOpen())
+		{
+			throw std::runtime_error("Error: Could not create the shared memory " + name);
+		}
+		if (channels != 3 && channels != 4)
+		{
+			throw std::runtime_error("Error: IPC frames have 3 or 4 channels, not " + std::to_string(channels));
+		}
+		num_slots = std::min(std::max(num_slots, 2), IpcFrameRingHeader::kMaxSlots);
+
+		m_header = new (m_region.getData()) IpcFrameRingHeader();
+		m_header->num_slots = num_slots;
+		m_header->width = width;
+		m_header->height = height;
+		m_header->channels = channels;
+
+		//IPC handles need buffers of their own, cudaMalloc rather than a pool.
+		m_frames.resize(num_slots);
+		m_ready_events.resize(num_slots);
+		m_released_events.resize(num_slots);
+		for (int i = 0; i < num_slots; ++i)
+		{
+			size_t pitch = 0;
+			CHECK_CUDA_ERROR(cudaMallocPitch(reinterpret_cast<void**>(&m_frames[i]), &pitch, width * channels, height));
+			m_header->pitch = pitch;
+			CHECK_CUDA_ERROR(cudaEventCreateWithFlags(&m_ready_events[i], cudaEventDisableTiming | cudaEventInterprocess));
+			CHECK_CUDA_ERROR(cudaEventCreateWithFlags(&m_released_events[i], cudaEventDisableTiming | cudaEventInterprocess));
+			CHECK_CUDA_ERROR(cudaIpcGetMemHandle(&m_header->slots[i].memory, m_frames[i]));
+			CHECK_CUDA_ERROR(cudaIpcGetEventHandle(&m_header->slots[i].ready, m_ready_events[i]));
+			CHECK_CUDA_ERROR(cudaIpcGetEventHandle(&m_header->slots[i].released, m_released_events[i]));
+		}
+		m_header->initialized.store(1, std::memory_order_release);
+	}
+
+	IpcFrameWriter::~IpcFrameWriter()
+	{
+		close();
+		//The buffers must outlive the consumer's reads. It gets a second to release the frames which are left, a consumer that
+		//went away doesn't hold up the producer.
+		const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+		int attempt = 0;
+		while (m_header->consumed.load(std::memory_order_acquire) < m_next_frame && std::chrono::steady_clock::now() < deadline)
+		{
+			backOff(attempt);
+		}
+		CHECK_CUDA_ERROR(cudaDeviceSynchronize());
+		for (cudaEvent_t released : m_released_events)
+		{
+			CHECK_CUDA_ERROR(cudaEventSynchronize(released));
+		}
+		for (size_t i = 0; i < m_frames.size(); ++i)
+		{
+			CHECK_CUDA_ERROR(cudaFree(m_frames[i]));
+			CHECK_CUDA_ERROR(cudaEventDestroy(m_ready_events[i]));
+			CHECK_CUDA_ERROR(cudaEventDestroy(m_released_events[i]));
+		}
+	}
+
+	bool IpcFrameWriter::beginFrame(uchar*& device_frame, cudaStream_t stream, const std::atomic<bool>& stop)
+	{
+		const uint32_t num_slots = m_header->num_slots;
+		const uint32_t slot = m_next_frame % num_slots;
+		m_header->producer_heartbeat.fetch_add(1, std::memory_order_relaxed);
+		if (m_next_frame >= num_slots)
+		{
+			//The consumer recorded "released" of this slot once it counted the frame before as consumed.
+			PeerWatch consumer(m_header->consumer_heartbeat);
+			int attempt = 0;
+			while (m_header->consumed.load(std::memory_order_acquire) + num_slots <= m_next_frame)
+			{
+				if (stop.load(std::memory_order_relaxed))
+				{
+					return false;
+				}
+				//Before a consumer attached, the ring just waits for one.
+				if (m_header->consumer_heartbeat.load(std::memory_order_relaxed) != 0 && !consumer.isAlive())
+				{
+					std::cout << "Warning: The consumer of the IPC frame ring stopped responding!" << std::endl;
+					return false;
+				}
+				m_header->producer_heartbeat.fetch_add(1, std::memory_order_relaxed);
+				backOff(attempt);
+			}
+			CHECK_CUDA_ERROR(cudaStreamWaitEvent(stream, m_released_events[slot], 0));
+		}
+		device_frame = m_frames[slot];
+		return true;
+	}
+
+	void IpcFrameWriter::endFrame(cudaStream_t stream)
+	{
+		const uint32_t slot = m_next_frame % m_header->num_slots;
+		CHECK_CUDA_ERROR(cudaEventRecord(m_ready_events[slot], stream));
+		m_header->written.store(++m_next_frame, std::memory_order_release);
+		m_header->producer_heartbeat.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void IpcFrameWriter::close()
+	{
+		m_header->closed.store(1, std::memory_order_release);
+	}
+
+	IpcVideoSource::IpcVideoSource(const std::string& name, double timeout_seconds)
+	{
+		const auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(timeout_seconds);
+		while (true)
+		{
+			m_region = std::make_unique<SharedMemoryRegion>(name, 0);
+			if (m_region->isOpen() && m_region->getSize() >= sizeof(IpcFrameRingHeader))
+			{
+				m_header = reinterpret_cast<IpcFrameRingHeader*>(m_region->getData());
+				if (m_header->initialized.load(std::memory_order_acquire) != 0)
+				{
+					break;
+				}
+			}
+			if (std::chrono::steady_clock::now() > deadline)
+			{
+				throw std::runtime_error("Error: No producer created the IPC frame ring " + name);
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+		if (std::memcmp(m_header->magic, "FIPC", 4) != 0 || m_header->version != IpcFrameRingHeader().version)
+		{
+			throw std::runtime_error("Error: " + name + " is not an IPC frame ring of this version");
+		}
+
+		const uint32_t num_slots = m_header->num_slots;
+		m_frames.resize(num_slots);
+		m_ready_events.resize(num_slots);
+		m_released_events.resize(num_slots);
+		for (uint32_t i = 0; i < num_slots; ++i)
+		{
+			CHECK_CUDA_ERROR(cudaIpcOpenMemHandle(&m_frames[i], m_header->slots[i].memory, cudaIpcMemLazyEnablePeerAccess));
+			CHECK_CUDA_ERROR(cudaIpcOpenEventHandle(&m_ready_events[i], m_header->slots[i].ready));
+			CHECK_CUDA_ERROR(cudaIpcOpenEventHandle(&m_released_events[i], m_header->slots[i].released));
+		}
+		//The producer stalls while the ring is full, so the frames published before we attached are all still there.
+		m_next_frame = m_header->consumed.load(std::memory_order_acquire);
+		m_header->consumer_heartbeat.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	IpcVideoSource::~IpcVideoSource()
+	{
+		CHECK_CUDA_ERROR(cudaDeviceSynchronize());
+		for (size_t i = 0; i < m_frames.size(); ++i)
+		{
+			CHECK_CUDA_ERROR(cudaIpcCloseMemHandle(m_frames[i]));
+			CHECK_CUDA_ERROR(cudaEventDestroy(m_ready_events[i]));
+			CHECK_CUDA_ERROR(cudaEventDestroy(m_released_events[i]));
+		}
+	}
+
+	bool IpcVideoSource::read(const uchar*& device_frame, size_t& pitch, int& channels, cudaStream_t stream)
+	{
+		if (m_holds_frame)
+		{
+			throw std::runtime_error("Error: The last IPC frame wasn't released before the next read!");
+		}
+
+		m_header->consumer_heartbeat.fetch_add(1, std::memory_order_relaxed);
+		PeerWatch producer(m_header->producer_heartbeat);
+		int attempt = 0;
+		while (m_header->written.load(std::memory_order_acquire) <= m_next_frame)
+		{
+			//Written is checked again, frames published right before closing are still read.
+			if (m_header->closed.load(std::memory_order_acquire) != 0 && m_header->written.load(std::memory_order_acquire) <= m_next_frame)
+			{
+				return false;
+			}
+			if (!producer.isAlive())
+			{
+				std::cout << "Warning: The producer of the IPC frame ring stopped responding, the input ends!" << std::endl;
+				return false;
+			}
+			m_header->consumer_heartbeat.fetch_add(1, std::memory_order_relaxed);
+			backOff(attempt);
+		}
+
+		const uint32_t slot = m_next_frame % m_header->num_slots;
+		CHECK_CUDA_ERROR(cudaStreamWaitEvent(stream, m_ready_events[slot], 0));
+		device_frame = static_cast<const uchar*>(m_frames[slot]);
+		pitch = m_header->pitch;
+		channels = m_header->channels;
+		m_holds_frame = true;
+		return true;
+	}
+
+	void IpcVideoSource::release(cudaStream_t stream)
+	{
+		if (!m_holds_frame)
+		{
+			return;
+		}
+		const uint32_t slot = m_next_frame % m_header->num_slots;
+		CHECK_CUDA_ERROR(cudaEventRecord(m_released_events[slot], stream));
+		m_header->consumed.store(++m_next_frame, std::memory_order_release);
+		m_header->consumer_heartbeat.fetch_add(1, std::memory_order_relaxed);
+		m_holds_frame = false;
+	}
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include "shared_memory_region.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cuda_runtime.h>
+#include "opencv2/core/core.hpp"
+
+namespace util
+{
+	//Shared ring through which another process hands device frames to an IpcVideoSource: num_slots frame buffers of the producer,
+	//exported as CUDA IPC memory handles, and two interprocess events per slot. The producer records "ready" after it wrote
+	//a frame, the consumer's stream waits for it. The consumer records "released" once its stream is done with the frame, the
+	//producer's stream waits for it before writing the slot again. The counters say which events were recorded already.
+	//Each side counts its heartbeat up in its calls and while it waits. A side whose peer's heartbeat stands still for
+	//kLivenessTimeoutSeconds takes the peer as gone, e.g. crashed without closing the ring.
+	struct IpcFrameSlot
+	{
+		cudaIpcMemHandle_t memory;
+		cudaIpcEventHandle_t ready;
+		cudaIpcEventHandle_t released;
+	};
+
+	struct IpcFrameRingHeader
+	{
+		static constexpr int kMaxSlots = 8;
+		static constexpr double kLivenessTimeoutSeconds = 5.0;
+
+		char magic[4]{ 'F', 'I', 'P', 'C' };
+		uint32_t version = 2;
+		uint32_t num_slots = 0;
+		uint32_t width = 0;
+		uint32_t height = 0;
+		uint32_t channels = 0; //3: BGR, 4: BGRA, 8 bits each
+		uint64_t pitch = 0; //bytes per row of every slot
+		IpcFrameSlot slots[kMaxSlots];
+		std::atomic<uint32_t> initialized{ 0 }; //set last by the producer, the handles above are valid from then on
+		std::atomic<uint32_t> closed{ 0 }; //the producer won't write further frames
+		std::atomic<uint64_t> written{ 0 }; //frames published by the producer, frame i is in slot i % num_slots
+		std::atomic<uint64_t> consumed{ 0 }; //frames released by the consumer
+		std::atomic<uint64_t> producer_heartbeat{ 0 };
+		std::atomic<uint64_t> consumer_heartbeat{ 0 }; //0 until a consumer attached
+	};
+
+	//Producer side of the ring, for the capture or decoder process. Creates the ring "name" and the frame buffers on the current
+	//device. Exactly one IpcVideoSource consumes it.
+	class IpcFrameWriter
+	{
+	public:
+		static constexpr int kDefaultNumSlots = 3;
+
+		IpcFrameWriter(const std::string& name, int width, int height, int channels, int num_slots = kDefaultNumSlots);
+		//Closes the ring and waits a moment for the consumer to release the frames which are left, its read returns false then.
+		~IpcFrameWriter();
+
+		IpcFrameWriter(const IpcFrameWriter&) = delete;
+		IpcFrameWriter& operator=(const IpcFrameWriter&) = delete;
+
+		//Buffer of the next frame, rows of getPitch() bytes. Waits until the consumer released the frame which was in it before,
+		//work on "stream" waits until its stream is done with it. False, if "stop" was set meanwhile or the consumer is gone.
+		bool beginFrame(uchar*& device_frame, cudaStream_t stream, const std::atomic<bool>& stop);
+		//Publishes the frame which the work issued on "stream" so far writes.
+		void endFrame(cudaStream_t stream);
+		void close();
+
+		size_t getPitch() const { return m_header->pitch; }
+
+	private:
+		SharedMemoryRegion m_region;
+		IpcFrameRingHeader* m_header;
+		std::vector<uchar*> m_frames;
+		std::vector<cudaEvent_t> m_ready_events;
+		std::vector<cudaEvent_t> m_released_events;
+		uint64_t m_next_frame{ 0 };
+	};
+
+	//Consumer side: device frames of another process, see IpcFrameWriter. Like NvdecVideoSource, feed them to
+	//Pyramid::uploadFrame(device_frame, ...). Nothing is copied between the processes.
+	class IpcVideoSource
+	{
+	public:
+		//Waits up to "timeout_seconds" for the producer to create the ring.
+		explicit IpcVideoSource(const std::string& name, double timeout_seconds = 10.0);
+		~IpcVideoSource();
+
+		IpcVideoSource(const IpcVideoSource&) = delete;
+		IpcVideoSource& operator=(const IpcVideoSource&) = delete;
+
+		int getWidth() const { return m_header->width; }
+		int getHeight() const { return m_header->height; }
+
+		//Next frame, waits for the producer. Work on "stream" waits until the frame is written. The frame stays valid until
+		//release, which has to be called before the next read. False, once the producer closed the ring and every frame was read,
+		//or once its heartbeat stood still for IpcFrameRingHeader::kLivenessTimeoutSeconds.
+		bool read(const uchar*& device_frame, size_t& pitch, int& channels, cudaStream_t stream);
+		//The producer may overwrite the last read frame, once the work issued on "stream" so far finished.
+		void release(cudaStream_t stream);
+
+	private:
+		std::unique_ptr<SharedMemoryRegion> m_region; //opened once the producer created it
+		IpcFrameRingHeader* m_header{ nullptr };
+		std::vector<void*> m_frames;
+		std::vector<cudaEvent_t> m_ready_events;
+		std::vector<cudaEvent_t> m_released_events;
+		uint64_t m_next_frame{ 0 };
+		bool m_holds_frame{ false };
+	};
+}
@@ -48,6 +48,21 @@ namespace jacobian_util
 	}
 
 	//Computation of derivative of light with respect to final normal that goes into SH light calculations.
+	//face.frag, computeSH
+	__host__ __device__ inline float computeSH(const float* sh, const glm::vec3& dir)
+	{
+		float light = sh[0];
+		light += sh[1] * dir.y;
+		light += sh[2] * dir.z;
+		light += sh[3] * dir.x;
+		light += sh[4] * dir.x * dir.y;
+		light += sh[5] * dir.y * dir.z;
+		light += sh[6] * (3.0f * dir.z * dir.z - 1.0f);
+		light += sh[7] * dir.x * dir.z;
+		light += sh[8] * (dir.x * dir.x - dir.y * dir.y);
+		return light;
+	}
+
 	__host__ __device__ inline void computeDLightDNormal(Eigen::Matrix<float, 1, 3>& d, const glm::vec3& normal, const float* coefficients_sh)
 	{
 		d(0, 0) = coefficients_sh[3] + coefficients_sh[4] * normal.y + coefficients_sh[7] * normal.z + 2.0f * coefficients_sh[8] * normal.x;
@@ -0,0 +1,228 @@
+#include "kernel_benchmark.h"
+#include "pyramid.h"
+#include "util.h"
+
+#include <glm/ext/matrix_clip_space.hpp>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <utility>
+#include "opencv2/core/core.hpp"
+
+KernelBenchmark::KernelBenchmark(const KernelBenchmarkSettings& settings, std::shared_ptr<FaceModel> model, const SolverParameters& solver_parameters)
+	: m_settings(settings)
+	, m_model(std::move(model))
+	, m_solver_parameters(solver_parameters)
+{
+	//Every pixel and every unknown of the configuration, rendered without GL.
+	m_solver_parameters.use_cuda_rasterizer = true;
+	m_solver_parameters.pixel_sampling_mode = 0;
+	m_solver_parameters.use_matrix_free_pcg = false;
+	m_solver_parameters.use_normal_equations = false;
+	m_solver_parameters.use_host_ldlt = false;
+	m_solver_parameters.use_block_preconditioner = false;
+	m_solver_parameters.use_levenberg_marquardt = false;
+	m_solver_parameters.use_identity_locking = false;
+}
+
+template<typename Launch>
+float KernelBenchmark::measure(cudaStream_t stream, Launch&& launch) const
+{
+	launch();
+
+	cudaEvent_t start, end;
+	CHECK_CUDA_ERROR(cudaEventCreate(&start));
+	CHECK_CUDA_ERROR(cudaEventCreate(&end));
+	CHECK_CUDA_ERROR(cudaEventRecord(start, stream));
+	for (int i = 0; i < m_settings.repetitions; ++i)
+	{
+		launch();
+	}
+	CHECK_CUDA_ERROR(cudaEventRecord(end, stream));
+	CHECK_CUDA_ERROR(cudaEventSynchronize(end));
+
+	float ms = 0.0f;
+	CHECK_CUDA_ERROR(cudaEventElapsedTime(&ms, start, end));
+	CHECK_CUDA_ERROR(cudaEventDestroy(start));
+	CHECK_CUDA_ERROR(cudaEventDestroy(end));
+
+	return ms / std::max(m_settings.repetitions, 1);
+}
+
+void KernelBenchmark::run()
+{
+	m_measurements.clear();
+	for (const auto& resolution : m_settings.resolutions)
+	{
+		for (int n_coefficients : m_settings.coefficient_counts)
+		{
+			runConfiguration(resolution, n_coefficients);
+		}
+	}
+	writeReport();
+}
+
+void KernelBenchmark::runConfiguration(const glm::ivec2& resolution, const int n_coefficients)
+{
+	const int width = resolution.x;
+	const int height = resolution.y;
+
+	SolverParameters solver_parameters(m_solver_parameters);
+	solver_parameters.num_shape_coefficients = n_coefficients;
+	solver_parameters.num_expression_coefficients = n_coefficients;
+	solver_parameters.num_albedo_coefficients = n_coefficients;
+
+	GaussNewtonSolver solver(solver_parameters);
+	const cudaStream_t stream = solver.getStream();
+	Face face(m_model);
+	Pyramid pyramid(1, width, height);
+	pyramid.setGraphicsSettings(0, face.getGraphicsSettings());
+	const glm::mat4 projection = glm::perspectiveRH_NO(glm::radians(60.0f), pyramid.getAspectRatio(), 0.01f, 10.0f);
+
+	cv::Mat frame(height, width, CV_8UC3);
+	cv::randu(frame, cv::Scalar::all(0), cv::Scalar::all(255));
+	pyramid.uploadFrame(frame, stream);
+
+	//Random landmarks in the tracker's frame, which is downsampled once.
+	solver.reserveFaces(1, 1);
+	const int nFeatures = solver.m_prior_ids_gpu.getSize();
+	std::mt19937 random(42);
+	std::uniform_real_distribution<float> x(0.0f, width / 2.0f);
+	std::uniform_real_distribution<float> y(0.0f, height / 2.0f);
+	std::vector<glm::vec2> sparse_features(nFeatures);
+	for (auto& feature : sparse_features)
+	{
+		feature = glm::vec2(x(random), y(random));
+	}
+	auto& sparse_features_gpu = solver.m_sparse_features_gpu[0];
+	util::ensureSize(sparse_features_gpu, nFeatures);
+	util::copy(sparse_features_gpu, sparse_features, nFeatures);
+
+	const auto unknowns = solver.setupUnknowns(face, nFeatures, 0);
+	const int nResiduals = 2 * nFeatures + 3 * width * height;
+	auto& workspace = solver.m_workspaces[0][0];
+	workspace.reserve(nResiduals, unknowns.nUnknowns, nResiduals, true, solver_parameters.storesReducedJacobian());
+	const auto input = solver.prepareIteration(face, projection, pyramid, 0, unknowns, sparse_features_gpu.getPtr());
+
+	const double V = m_model->number_of_vertices;
+	const double F = m_model->number_of_indices / 3;
+	const double C = unknowns.nFaceCoeffs;
+	const double R = input.nResiduals;
+	const double U = input.nUnknowns;
+	const double P = input.nPixels;
+	const double basis_bytes = m_model->half_precision_basis ? 2.0 : 4.0;
+	const double jacobian_bytes = solver_parameters.storesReducedJacobian() ? 2.0 : 4.0;
+	auto add = [&](const char* path, float ms, double bytes, double flops)
+	{
+		Measurement measurement;
+		measurement.path = path;
+		measurement.width = width;
+		measurement.height = height;
+		measurement.num_coefficients = n_coefficients;
+		measurement.ms = ms;
+		measurement.bytes = bytes;
+		measurement.flops = flops;
+		m_measurements.push_back(measurement);
+	};
+
+	//Blendshapes: every active basis entry once, base and result positions and colors. Normals: every face once per corner.
+	const double normals_bytes = 3.0 * F * (4.0 + 12.0 + 3.0 * 12.0) + V * (8.0 + 12.0);
+	const double normals_flops = 3.0 * F * 21.0;
+	add("computeNormals", measure(0, [&]() { face.computeNormals(); }), normals_bytes, normals_flops);
+	add("computeFace", measure(0, [&]() { face.invalidateFace(); face.computeFace(); }), 3.0 * V * C * basis_bytes + 4.0 * 12.0 * V + normals_bytes,
+		2.0 * 3.0 * V * C + normals_flops);
+
+	//Reads the three render targets of every pixel, writes the visible pixel list.
+	add("computeVisiblePixelsAndBB", measure(stream, [&]() { solver.computeFaceBoundingBox(width, height); }),
+		width * height * 3.0 * 16.0 + P * sizeof(VisiblePixel), 0.0);
+
+	//Writes the whole Jacobian, reads the bases of the three vertices of every pixel. Once through the pointers and once through the
+	//basis textures (SolverParameters::use_basis_textures), independent of the parameters.
+	auto pointer_input = input;
+	pointer_input.shape_basis_texture = 0;
+	pointer_input.expression_basis_texture = 0;
+	pointer_input.albedo_basis_texture = 0;
+	add("computeJacobian", measure(stream, [&]() { solver.computeJacobian(pointer_input, workspace.getJacobian(), workspace.residuals.getPtr()); }),
+		R * U * jacobian_bytes + P * 9.0 * C * basis_bytes, 2.0 * R * U);
+	auto texture_input = input;
+	solver.bindBasisTextures(*m_model, texture_input);
+	if (texture_input.shape_basis_texture)
+	{
+		add("computeJacobianBasisTextures", measure(stream, [&]() { solver.computeJacobian(texture_input, workspace.getJacobian(),
+			workspace.residuals.getPtr()); }), R * U * jacobian_bytes + P * 9.0 * C * basis_bytes, 2.0 * R * U);
+	}
+
+	add("computeJacobiPreconditioner", measure(stream, [&]() { solver.computeJacobiPreconditioner(input,
+		workspace.getJacobian(), workspace.M.getPtr()); }), R * U * jacobian_bytes, 2.0 * R * U);
+
+	//Two products with J per PCG iteration, one for the right hand side and the pass of the preconditioner. The products read
+	//the pixel rows and the nonzero columns of the landmark rows once, the preconditioner all of J.
+	const double n_products = 2.0 * solver_parameters.getLevel(0).num_pcg_iterations + 1.0;
+	const double product_entries = 3.0 * P * U + 2.0 * nFeatures * (7.0 + unknowns.nShapeCoeffs + unknowns.nExpressionCoeffs);
+	add("solveUpdatePCG", measure(stream, [&]() { solver.solveUpdatePCG(solver.m_cublas, input, workspace, 1.0f, -1.0f); }),
+		(n_products * product_entries + R * U) * jacobian_bytes, (n_products * product_entries + R * U) * 2.0);
+
+	//J is read once for JTJ (a syrk, or a full GEMM with use_tensor_core_jtj) and once for J^T f, the solve is on U x U.
+	const double jtj_flops = (solver_parameters.use_tensor_core_jtj ? 2.0 : 1.0) * R * U * U + 2.0 * R * U;
+	add("solveUpdateJTJ", measure(stream, [&]() { solver.solveUpdateJTJ(input, workspace, 1.0f, -1.0f); }),
+		2.0 * R * U * jacobian_bytes + U * U * 4.0, jtj_flops);
+
+	//The backends of the linear solve (see LinearSolver) one by one, the whole step of a GN iteration: J or its products and the
+	//solve. Only their times are comparable, they move different amounts of data.
+	auto& parameters = solver.getSolverParameters();
+	for (int s = 0; s < kNumSolverStrategies; ++s)
+	{
+		const auto strategy = static_cast<SolverStrategy>(s);
+		setStrategy(parameters, strategy);
+		auto& linear_solver = solver.getLinearSolver(strategy);
+		workspace.reserve(nResiduals, unknowns.nUnknowns, linear_solver.getJacobianRows(nResiduals), true, parameters.storesReducedJacobian());
+		workspace.resetLevelState(stream);
+		const std::string path = std::string("LinearSolver ") + getStrategyName(strategy);
+		add(path.c_str(), measure(stream, [&]()
+		{
+			workspace.residuals.memset(0, stream);
+			linear_solver.solve(input, workspace);
+		}), 0.0, 0.0);
+	}
+	setStrategy(parameters, getStrategy(solver_parameters));
+
+	CHECK_CUDA_ERROR(cudaStreamSynchronize(stream));
+	std::cout << "Kernel benchmark " << width << "x" << height << ", " << n_coefficients << " coefficients: " << P << " pixels, "
+		<< U << " unknowns" << std::endl;
+}
+
+void KernelBenchmark::writeReport() const
+{
+	std::ofstream file(m_settings.output_path);
+	if (!file.is_open())
+	{
+		throw std::runtime_error("Error: Could not open " + m_settings.output_path + " for writing!");
+	}
+
+	int device = 0;
+	cudaDeviceProp properties;
+	CHECK_CUDA_ERROR(cudaGetDevice(&device));
+	CHECK_CUDA_ERROR(cudaGetDeviceProperties(&properties, device));
+
+	file << "{" << std::endl
+		<< "  \"device\": \"" << properties.name << "\"," << std::endl
+		<< "  \"repetitions\": " << m_settings.repetitions << "," << std::endl
+		<< "  \"measurements\": [";
+	for (int i = 0; i < m_measurements.size(); ++i)
+	{
+		const auto& measurement = m_measurements[i];
+		const double seconds = measurement.ms / 1000.0;
+		file << (i > 0 ? "," : "") << std::endl
+			<< "    { \"path\": \"" << measurement.path << "\", \"width\": " << measurement.width << ", \"height\": " << measurement.height
+			<< ", \"coefficients\": " << measurement.num_coefficients << ", \"ms\": " << measurement.ms
+			<< ", \"gb_per_s\": " << (seconds > 0.0 ? measurement.bytes / seconds / 1.0e9 : 0.0);
+		if (measurement.flops > 0.0)
+		{
+			file << ", \"gflop_per_s\": " << (seconds > 0.0 ? measurement.flops / seconds / 1.0e9 : 0.0);
+		}
+		file << " }";
+	}
+	file << std::endl << "  ]" << std::endl << "}" << std::endl;
+}
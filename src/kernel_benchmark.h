@@ -0,0 +1,55 @@
+#pragma once
+
+#include "face.h"
+#include "gauss_newton_solver.h"
+
+#include <glm/glm.hpp>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cuda_runtime.h>
+
+struct KernelBenchmarkSettings
+{
+	std::string output_path; //JSON report, empty: no kernel benchmark
+	std::vector<glm::ivec2> resolutions{ { 640, 360 }, { 1280, 720 }, { 1920, 1080 } }; //of the frame, pyramid level 0
+	std::vector<int> coefficient_counts{ 20, 40, 80, 160 }; //of shape, expression and albedo each, capped at the model
+	int repetitions = 20;
+};
+
+//Times the hot paths of Face and GaussNewtonSolver one by one on synthetic input: the default face in front of the camera,
+//a noise frame and random landmarks. Sweeps over the frame resolutions and coefficient counts of the settings and reports the
+//average time, with the achieved bandwidth and FLOP rate, of every path. Bytes and FLOPs are estimated from the sizes of the
+//inputs and outputs (caches and the texture path are ignored), so they are comparable between commits and devices, not exact.
+class KernelBenchmark
+{
+public:
+	KernelBenchmark(const KernelBenchmarkSettings& settings, std::shared_ptr<FaceModel> model, const SolverParameters& solver_parameters);
+
+	//Needs a current GL context, Face and Pyramid create GL objects.
+	void run();
+
+private:
+	struct Measurement
+	{
+		std::string path;
+		int width = 0;
+		int height = 0;
+		int num_coefficients = 0;
+		float ms = 0.0f; //per launch
+		double bytes = 0.0;
+		double flops = 0.0; //0: not compute bound, no FLOP rate
+	};
+
+	void runConfiguration(const glm::ivec2& resolution, int n_coefficients);
+	//Average time of "launch" on "stream" over settings.repetitions runs, after one untimed run.
+	template<typename Launch>
+	float measure(cudaStream_t stream, Launch&& launch) const;
+	void writeReport() const;
+
+private:
+	KernelBenchmarkSettings m_settings;
+	std::shared_ptr<FaceModel> m_model;
+	SolverParameters m_solver_parameters;
+	std::vector<Measurement> m_measurements;
+};
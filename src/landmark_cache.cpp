@@ -0,0 +1,146 @@
+#include "landmark_cache.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+static size_t getFaceEntrySize(const LandmarkCacheHeader& header)
+{
+	return sizeof(uint32_t) + sizeof(glm::vec4) + header.num_landmarks * sizeof(glm::vec2);
+}
+
+static size_t getRecordSize(const LandmarkCacheHeader& header)
+{
+	return header.num_faces * getFaceEntrySize(header);
+}
+
+LandmarkCacheWriter::LandmarkCacheWriter(const std::string& filepath, int num_faces, int frame_width, int frame_height)
+	: m_file(filepath, std::ofstream::binary)
+{
+	if (!m_file.is_open())
+	{
+		throw std::runtime_error("Error: Could not open " + filepath + " for writing!");
+	}
+
+	m_header.num_faces = std::max(num_faces, 1);
+	m_header.frame_width = frame_width;
+	m_header.frame_height = frame_height;
+	m_record.resize(getRecordSize(m_header));
+	m_file.write(reinterpret_cast<const char*>(&m_header), sizeof(m_header));
+}
+
+LandmarkCacheWriter::~LandmarkCacheWriter()
+{
+	close();
+}
+
+void LandmarkCacheWriter::write(const std::vector<std::vector<glm::vec2>>& sparse_features)
+{
+	std::fill(m_record.begin(), m_record.end(), 0);
+	const size_t entry_size = getFaceEntrySize(m_header);
+	for (uint32_t f = 0; f < m_header.num_faces && f < sparse_features.size(); ++f)
+	{
+		const auto& landmarks = sparse_features[f];
+		if (landmarks.empty())
+		{
+			continue;
+		}
+		if (landmarks.size() != m_header.num_landmarks)
+		{
+			throw std::runtime_error("Error: The landmark cache holds " + std::to_string(m_header.num_landmarks) + " landmarks per face, not "
+				+ std::to_string(landmarks.size()) + "!");
+		}
+
+		glm::vec2 min_point(std::numeric_limits<float>::max());
+		glm::vec2 max_point(std::numeric_limits<float>::lowest());
+		for (const auto& landmark : landmarks)
+		{
+			min_point = glm::min(min_point, landmark);
+			max_point = glm::max(max_point, landmark);
+		}
+		const uint32_t tracked = 1;
+		const glm::vec4 box(min_point, max_point);
+
+		char* entry = m_record.data() + f * entry_size;
+		std::memcpy(entry, &tracked, sizeof(tracked));
+		std::memcpy(entry + sizeof(tracked), &box, sizeof(box));
+		std::memcpy(entry + sizeof(tracked) + sizeof(box), landmarks.data(), landmarks.size() * sizeof(glm::vec2));
+	}
+
+	m_file.write(m_record.data(), m_record.size());
+	m_header.num_frames++;
+}
+
+void LandmarkCacheWriter::close()
+{
+	if (!m_file.is_open())
+	{
+		return;
+	}
+
+	m_file.seekp(offsetof(LandmarkCacheHeader, num_frames));
+	m_file.write(reinterpret_cast<const char*>(&m_header.num_frames), sizeof(m_header.num_frames));
+	m_file.close();
+}
+
+LandmarkCacheReader::LandmarkCacheReader(const std::string& filepath)
+	: m_file(filepath, std::ifstream::binary)
+{
+	if (!m_file.is_open())
+	{
+		throw std::runtime_error("Error: Could not open the landmark cache " + filepath);
+	}
+
+	const LandmarkCacheHeader expected;
+	m_file.read(reinterpret_cast<char*>(&m_header), sizeof(m_header));
+	if (!m_file || std::memcmp(m_header.magic, expected.magic, sizeof(m_header.magic)) != 0 || m_header.version != expected.version)
+	{
+		throw std::runtime_error("Error: " + filepath + " is not a landmark cache of version " + std::to_string(expected.version) + "!");
+	}
+	m_record.resize(getRecordSize(m_header));
+}
+
+bool LandmarkCacheReader::read(std::vector<std::vector<glm::vec2>>& sparse_features, std::vector<glm::vec4>* face_boxes)
+{
+	if (m_next_frame >= m_header.num_frames || !m_file.read(m_record.data(), m_record.size()))
+	{
+		return false;
+	}
+	m_next_frame++;
+
+	sparse_features.resize(m_header.num_faces);
+	if (face_boxes)
+	{
+		face_boxes->assign(m_header.num_faces, glm::vec4(0.0f));
+	}
+
+	const size_t entry_size = getFaceEntrySize(m_header);
+	for (uint32_t f = 0; f < m_header.num_faces; ++f)
+	{
+		const char* entry = m_record.data() + f * entry_size;
+		uint32_t tracked = 0;
+		std::memcpy(&tracked, entry, sizeof(tracked));
+		if (!tracked)
+		{
+			sparse_features[f].clear();
+			continue;
+		}
+
+		if (face_boxes)
+		{
+			std::memcpy(&(*face_boxes)[f], entry + sizeof(tracked), sizeof(glm::vec4));
+		}
+		sparse_features[f].resize(m_header.num_landmarks);
+		std::memcpy(sparse_features[f].data(), entry + sizeof(tracked) + sizeof(glm::vec4), m_header.num_landmarks * sizeof(glm::vec2));
+	}
+	return true;
+}
+
+void LandmarkCacheReader::seek(uint32_t frame)
+{
+	m_next_frame = std::min(frame, m_header.num_frames);
+	m_file.clear();
+	m_file.seekg(sizeof(LandmarkCacheHeader) + static_cast<std::streamoff>(m_next_frame) * m_record.size());
+}
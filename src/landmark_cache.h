@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+
+//Binary landmark track of a video, so the solver can be run again without the detector, e.g. while tuning SolverParameters.
+//A header, followed by one fixed-size record per frame with num_faces entries: a uint32 tracked flag, the face box and
+//num_landmarks landmarks. Landmarks and boxes are in NDC, as Tracker::getSparseFeaturesOfFaces reports them.
+//The box (left, bottom, right, top) bounds the landmarks, so a reader can crop without going through them.
+struct LandmarkCacheHeader
+{
+	char magic[4]{ 'F', 'L', 'M', 'K' };
+	uint32_t version = 2;
+	uint32_t num_frames = 0; //updated when the writer is closed
+	uint32_t num_faces = 1;
+	uint32_t num_landmarks = 60;
+	uint32_t frame_width = 0; //of the tracker's frame, i.e. after cv::pyrDown
+	uint32_t frame_height = 0;
+};
+
+class LandmarkCacheWriter
+{
+public:
+	LandmarkCacheWriter(const std::string& filepath, int num_faces, int frame_width, int frame_height);
+	LandmarkCacheWriter(const LandmarkCacheWriter&) = delete;
+	LandmarkCacheWriter& operator=(const LandmarkCacheWriter&) = delete;
+	~LandmarkCacheWriter();
+
+	//One entry per face slot, empty for untracked ones. Slots beyond num_faces are dropped.
+	void write(const std::vector<std::vector<glm::vec2>>& sparse_features);
+	//Writes the frame count into the header.
+	void close();
+
+	const LandmarkCacheHeader& getHeader() const { return m_header; }
+
+private:
+	std::ofstream m_file;
+	LandmarkCacheHeader m_header;
+	std::vector<char> m_record;
+};
+
+class LandmarkCacheReader
+{
+public:
+	//Throws, if "filepath" can't be opened or isn't a landmark cache of this version.
+	explicit LandmarkCacheReader(const std::string& filepath);
+
+	const LandmarkCacheHeader& getHeader() const { return m_header; }
+
+	//One entry per face of the header, empty for untracked ones. False at the end of the cache.
+	bool read(std::vector<std::vector<glm::vec2>>& sparse_features, std::vector<glm::vec4>* face_boxes = nullptr);
+	//The next read returns "frame".
+	void seek(uint32_t frame);
+
+private:
+	std::ifstream m_file;
+	LandmarkCacheHeader m_header;
+	std::vector<char> m_record;
+	uint32_t m_next_frame{ 0 };
+};
@@ -0,0 +1,112 @@
+#include "landmark_detector.h"
+
+#include <dlib/dnn.h>
+#include <iostream>
+
+std::vector<std::vector<dlib::rectangle>> LandmarkDetector::detectBatch(const std::vector<cv::Mat>& images)
+{
+	std::vector<std::vector<dlib::rectangle>> faces;
+	faces.reserve(images.size());
+	for (const auto& image : images)
+	{
+		faces.push_back(detect(image));
+	}
+	return faces;
+}
+
+std::vector<dlib::rectangle> HogLandmarkDetector::detect(const cv::Mat& image)
+{
+	dlib::cv_image<dlib::bgr_pixel> cimg(image);
+	return m_detector(cimg);
+}
+
+//Network definition of dlib's mmod_human_face_detector.dat, see dlib/examples/dnn_mmod_face_detection_ex.cpp
+namespace mmod
+{
+	template <long num_filters, typename SUBNET> using con5d = dlib::con<num_filters, 5, 5, 2, 2, SUBNET>;
+	template <long num_filters, typename SUBNET> using con5 = dlib::con<num_filters, 5, 5, 1, 1, SUBNET>;
+
+	template <typename SUBNET> using downsampler = dlib::relu<dlib::affine<con5d<32, dlib::relu<dlib::affine<con5d<32, dlib::relu<dlib::affine<con5d<16, SUBNET>>>>>>>>>;
+	template <typename SUBNET> using rcon5 = dlib::relu<dlib::affine<con5<45, SUBNET>>>;
+
+	using net_type = dlib::loss_mmod<dlib::con<1, 9, 9, 1, 1, rcon5<rcon5<rcon5<downsampler<dlib::input_rgb_image_pyramid<dlib::pyramid_down<6>>>>>>>>;
+}
+
+struct CnnLandmarkDetector::Network
+{
+	mmod::net_type net;
+};
+
+static dlib::matrix<dlib::rgb_pixel> toRgbMatrix(const cv::Mat& image)
+{
+	dlib::matrix<dlib::rgb_pixel> matrix;
+	dlib::assign_image(matrix, dlib::cv_image<dlib::bgr_pixel>(image));
+	return matrix;
+}
+
+static std::vector<dlib::rectangle> toRectangles(const std::vector<dlib::mmod_rect>& detections)
+{
+	std::vector<dlib::rectangle> faces;
+	faces.reserve(detections.size());
+	for (const auto& detection : detections)
+	{
+		faces.push_back(detection.rect);
+	}
+	return faces;
+}
+
+CnnLandmarkDetector::CnnLandmarkDetector(const std::string& model_path)
+	: m_network(std::make_unique<Network>())
+{
+#ifndef DLIB_USE_CUDA
+	std::cout << "Warning: dlib is built without DLIB_USE_CUDA, the CNN detector runs on the CPU!" << std::endl;
+#endif
+
+	try
+	{
+		dlib::deserialize(model_path) >> m_network->net;
+	}
+	catch (dlib::serialization_error& e)
+	{
+		throw std::runtime_error("Error: Could not load " + model_path + ": " + e.what());
+	}
+}
+
+CnnLandmarkDetector::~CnnLandmarkDetector() = default;
+
+std::vector<dlib::rectangle> CnnLandmarkDetector::detect(const cv::Mat& image)
+{
+	return toRectangles(m_network->net(toRgbMatrix(image)));
+}
+
+std::vector<std::vector<dlib::rectangle>> CnnLandmarkDetector::detectBatch(const std::vector<cv::Mat>& images)
+{
+	std::vector<dlib::matrix<dlib::rgb_pixel>> batch;
+	batch.reserve(images.size());
+	for (const auto& image : images)
+	{
+		batch.push_back(toRgbMatrix(image));
+	}
+
+	auto detections = m_network->net(batch, batch.size());
+
+	std::vector<std::vector<dlib::rectangle>> faces;
+	faces.reserve(detections.size());
+	for (const auto& image_detections : detections)
+	{
+		faces.push_back(toRectangles(image_detections));
+	}
+	return faces;
+}
+
+std::unique_ptr<LandmarkDetector> createLandmarkDetector(LandmarkBackend backend)
+{
+	switch (backend)
+	{
+	case LandmarkBackend::Hog:
+		return std::make_unique<HogLandmarkDetector>();
+	case LandmarkBackend::Cnn:
+		return std::make_unique<CnnLandmarkDetector>();
+	}
+	throw std::runtime_error("Error: Unknown landmark backend!");
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <dlib/opencv.h>
+#include <dlib/image_processing/frontal_face_detector.h>
+#include <opencv2/core/core.hpp>
+#include <memory>
+#include <vector>
+
+enum class LandmarkBackend
+{
+	Hog = 0,
+	Cnn = 1,
+};
+
+//Finds the face boxes which the 68 point shape predictor of the Tracker is seeded with.
+class LandmarkDetector
+{
+public:
+	virtual ~LandmarkDetector() = default;
+
+	//"image" is a BGR frame. Boxes are in its pixel coordinates.
+	virtual std::vector<dlib::rectangle> detect(const cv::Mat& image) = 0;
+
+	//Detects faces in several images at once. All images must have the same size. Runs them one by one by default.
+	virtual std::vector<std::vector<dlib::rectangle>> detectBatch(const std::vector<cv::Mat>& images);
+
+	virtual const char* getName() const = 0;
+};
+
+//dlib's HOG sliding window detector on the CPU.
+class HogLandmarkDetector : public LandmarkDetector
+{
+public:
+	std::vector<dlib::rectangle> detect(const cv::Mat& image) override;
+	const char* getName() const override { return "HOG (CPU)"; }
+
+private:
+	dlib::frontal_face_detector m_detector = dlib::get_frontal_face_detector();
+};
+
+//dlib's max-margin object detection CNN. Runs on the GPU, if dlib is built with DLIB_USE_CUDA.
+//Batches are evaluated in a single forward pass.
+class CnnLandmarkDetector : public LandmarkDetector
+{
+public:
+	explicit CnnLandmarkDetector(const std::string& model_path = "mmod_human_face_detector.dat");
+	~CnnLandmarkDetector();
+
+	std::vector<dlib::rectangle> detect(const cv::Mat& image) override;
+	std::vector<std::vector<dlib::rectangle>> detectBatch(const std::vector<cv::Mat>& images) override;
+	const char* getName() const override { return "MMOD CNN (GPU)"; }
+
+private:
+	struct Network; //keeps dlib/dnn.h out of this header
+	std::unique_ptr<Network> m_network;
+};
+
+//Throws, if the backend can't be created, e.g. because its model file is missing.
+std::unique_ptr<LandmarkDetector> createLandmarkDetector(LandmarkBackend backend);
@@ -0,0 +1,57 @@
+#include "landmark_filter.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+	//Smoothing factor of an exponential low pass with the given cutoff, for one time step.
+	float computeAlpha(const float cutoff, const float dt)
+	{
+		const float tau = 1.0f / (2.0f * 3.14159265f * cutoff);
+		return 1.0f / (1.0f + tau / dt);
+	}
+}
+
+void LandmarkFilter::filter(const LandmarkFilterParameters& params, const std::vector<glm::vec2>& landmarks, std::vector<glm::vec2>& filtered,
+	std::vector<float>& confidences)
+{
+	filtered.resize(landmarks.size());
+	confidences.resize(landmarks.size());
+	if (m_values.size() != landmarks.size())
+	{
+		m_values = landmarks;
+		m_derivatives.assign(landmarks.size(), glm::vec2(0.0f));
+		filtered = landmarks;
+		std::fill(confidences.begin(), confidences.end(), 1.0f);
+		return;
+	}
+
+	const float dt = 1.0f / std::max(params.frame_rate, 1.0f);
+	const float alpha_derivative = computeAlpha(params.derivative_cutoff, dt);
+	for (size_t i = 0; i < landmarks.size(); ++i)
+	{
+		const glm::vec2 derivative = (landmarks[i] - m_values[i]) / dt;
+		m_derivatives[i] = glm::mix(m_derivatives[i], derivative, alpha_derivative);
+
+		const float cutoff = params.min_cutoff + params.beta * glm::length(m_derivatives[i]);
+		m_values[i] = glm::mix(m_values[i], landmarks[i], computeAlpha(cutoff, dt));
+		filtered[i] = m_values[i];
+
+		const float jump = glm::distance(landmarks[i], m_values[i]) / std::max(params.jitter_scale, 1.0e-6f);
+		confidences[i] = std::max(1.0f / (1.0f + jump * jump), params.min_confidence);
+	}
+}
+
+void LandmarkFilter::reset()
+{
+	m_values.clear();
+	m_derivatives.clear();
+}
+
+void LandmarkFilter::restore(const std::vector<glm::vec2>& values, const std::vector<glm::vec2>& derivatives)
+{
+	m_values = values;
+	m_derivatives = derivatives;
+	m_derivatives.resize(m_values.size(), glm::vec2(0.0f));
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <vector>
+
+struct LandmarkFilterParameters
+{
+	float frame_rate = 30.0f; //of the input, the filter assumes a fixed time step
+	float min_cutoff = 1.5f; //Hz, of a still landmark. Lower removes more jitter and adds lag.
+	float beta = 5.0f; //added to the cutoff per NDC/s of speed, so a moving face doesn't lag
+	float derivative_cutoff = 1.0f; //Hz, of the speed estimate
+	//Confidence of a landmark: 1 / (1 + (d / jitter_scale)^2) of its distance d (NDC) to the filtered position, at least min_confidence.
+	float jitter_scale = 0.005f;
+	float min_confidence = 0.25f;
+};
+
+//One-Euro filter (Casiez et al. 2012, "1€ Filter") of the landmarks of one face: a low pass whose cutoff rises with the speed.
+//A still face loses the jitter of the detector, a moving one follows without lag. How far a landmark jumps from its filtered
+//position also gives its confidence, for the weights of the sparse term.
+class LandmarkFilter
+{
+public:
+	//Filters the landmarks (NDC) of the next frame into "filtered" and writes their confidences. A different number of landmarks
+	//than in the last frame, e.g. after the face was lost, starts over with the raw ones.
+	void filter(const LandmarkFilterParameters& params, const std::vector<glm::vec2>& landmarks, std::vector<glm::vec2>& filtered,
+		std::vector<float>& confidences);
+	void reset();
+
+	//Filtered positions and speeds of the last frame, empty before the first one. restore continues from them, e.g. after a restart.
+	const std::vector<glm::vec2>& getValues() const { return m_values; }
+	const std::vector<glm::vec2>& getDerivatives() const { return m_derivatives; }
+	void restore(const std::vector<glm::vec2>& values, const std::vector<glm::vec2>& derivatives);
+
+private:
+	std::vector<glm::vec2> m_values;
+	std::vector<glm::vec2> m_derivatives;
+};
@@ -0,0 +1,296 @@
+#include "landmark_flow.h"
+#include "device_util.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+#include <opencv2/imgproc/imgproc.hpp>
+
+constexpr int kMaxFlowLevels = 6;
+constexpr int kWindowRadius = 7;
+constexpr int kWindowSize = 2 * kWindowRadius + 1;
+constexpr int kFlowThreads = 256; //one block per point, one thread per pixel of the window
+constexpr int kFlowIterations = 10;
+constexpr float kMinFlowStep = 0.01f; //pixels of the level
+constexpr float kMinDeterminant = 1e-3f; //of the structure tensor over the squared window area, below that the window has no texture
+
+static_assert(kWindowSize * kWindowSize <= kFlowThreads, "The window doesn't fit into a block.");
+
+struct FlowLevels
+{
+	const float* images[kMaxFlowLevels];
+	int widths[kMaxFlowLevels];
+	int heights[kMaxFlowLevels];
+	int count;
+};
+
+__global__ void grayToFloatKernel(const uchar* __restrict__ gray, int width, int height, float* __restrict__ image)
+{
+	const auto index = util::getThreadIndex2D();
+	if (index.x >= width || index.y >= height)
+	{
+		return;
+	}
+
+	image[index.y * width + index.x] = gray[index.y * width + index.x];
+}
+
+//Averages 2x2 blocks, the last row and column are repeated for odd sizes.
+__global__ void halveImageKernel(const float* __restrict__ source, int source_width, int source_height,
+	float* __restrict__ target, int target_width, int target_height)
+{
+	const auto index = util::getThreadIndex2D();
+	if (index.x >= target_width || index.y >= target_height)
+	{
+		return;
+	}
+
+	const int x0 = 2 * index.x;
+	const int y0 = 2 * index.y;
+	const int x1 = min(x0 + 1, source_width - 1);
+	const int y1 = min(y0 + 1, source_height - 1);
+	target[index.y * target_width + index.x] = 0.25f * (source[y0 * source_width + x0] + source[y0 * source_width + x1]
+		+ source[y1 * source_width + x0] + source[y1 * source_width + x1]);
+}
+
+__device__ float sampleBilinear(const float* image, int width, int height, float x, float y)
+{
+	x = fminf(fmaxf(x, 0.0f), width - 1.0f);
+	y = fminf(fmaxf(y, 0.0f), height - 1.0f);
+	const int x0 = static_cast<int>(x);
+	const int y0 = static_cast<int>(y);
+	const int x1 = min(x0 + 1, width - 1);
+	const int y1 = min(y0 + 1, height - 1);
+	const float fx = x - x0;
+	const float fy = y - y0;
+	const float top = (1.0f - fx) * image[y0 * width + x0] + fx * image[y0 * width + x1];
+	const float bottom = (1.0f - fx) * image[y1 * width + x0] + fx * image[y1 * width + x1];
+	return (1.0f - fy) * top + fy * bottom;
+}
+
+//Sums "values" over the block, every thread gets the sums. All threads of the block have to call it.
+template<int N>
+__device__ void blockSum(float (&values)[N])
+{
+	__shared__ float partial[kFlowThreads / 32][N];
+
+	const int lane = threadIdx.x % 32;
+	const int warp = threadIdx.x / 32;
+	for (int n = 0; n < N; ++n)
+	{
+		for (int offset = 16; offset > 0; offset >>= 1)
+		{
+			values[n] += __shfl_down_sync(0xffffffff, values[n], offset);
+		}
+	}
+
+	__syncthreads(); //the last call may still read "partial"
+	if (lane == 0)
+	{
+		for (int n = 0; n < N; ++n)
+		{
+			partial[warp][n] = values[n];
+		}
+	}
+	__syncthreads();
+
+	for (int n = 0; n < N; ++n)
+	{
+		values[n] = 0.0f;
+		for (int w = 0; w < kFlowThreads / 32; ++w)
+		{
+			values[n] += partial[w][n];
+		}
+	}
+}
+
+//Bouguet's pyramidal Lucas-Kanade, coarse to fine. The structure tensor of the previous frame's window is fixed per level,
+//the residual is iterated with the bilinear samples of the current frame.
+__global__ void lucasKanadeKernel(FlowLevels previous, FlowLevels current, glm::vec2* points, float* errors, int n_points)
+{
+	const int point = blockIdx.x;
+	if (point >= n_points)
+	{
+		return;
+	}
+
+	const bool in_window = threadIdx.x < kWindowSize * kWindowSize;
+	const float offset_x = static_cast<float>(threadIdx.x % kWindowSize - kWindowRadius);
+	const float offset_y = static_cast<float>(threadIdx.x / kWindowSize - kWindowRadius);
+	const glm::vec2 start = points[point];
+
+	glm::vec2 guess(0.0f);
+	float error = -1.0f;
+	for (int l = previous.count - 1; l >= 0; --l)
+	{
+		const float* image = previous.images[l];
+		const float* next_image = current.images[l];
+		const int width = previous.widths[l];
+		const int height = previous.heights[l];
+
+		//Pixel centers of the halved levels, like halveImageKernel.
+		const float scale = 1.0f / (1 << l);
+		const float x = (start.x + 0.5f) * scale - 0.5f + offset_x;
+		const float y = (start.y + 0.5f) * scale - 0.5f + offset_y;
+
+		float intensity = 0.0f;
+		float ix = 0.0f;
+		float iy = 0.0f;
+		if (in_window)
+		{
+			intensity = sampleBilinear(image, width, height, x, y);
+			ix = 0.5f * (sampleBilinear(image, width, height, x + 1.0f, y) - sampleBilinear(image, width, height, x - 1.0f, y));
+			iy = 0.5f * (sampleBilinear(image, width, height, x, y + 1.0f) - sampleBilinear(image, width, height, x, y - 1.0f));
+		}
+
+		float tensor[3] = { ix * ix, ix * iy, iy * iy };
+		blockSum(tensor);
+		const float determinant = tensor[0] * tensor[2] - tensor[1] * tensor[1];
+		if (determinant < kMinDeterminant * kWindowSize * kWindowSize * kWindowSize * kWindowSize)
+		{
+			error = -1.0f;
+			break;
+		}
+
+		glm::vec2 step(0.0f);
+		for (int i = 0; i < kFlowIterations; ++i)
+		{
+			float difference = 0.0f;
+			if (in_window)
+			{
+				difference = intensity - sampleBilinear(next_image, width, height, x + guess.x + step.x, y + guess.y + step.y);
+			}
+
+			float mismatch[2] = { difference * ix, difference * iy };
+			blockSum(mismatch);
+			const glm::vec2 delta((tensor[2] * mismatch[0] - tensor[1] * mismatch[1]) / determinant,
+				(tensor[0] * mismatch[1] - tensor[1] * mismatch[0]) / determinant);
+			step += delta;
+			if (glm::length(delta) < kMinFlowStep)
+			{
+				break;
+			}
+		}
+
+		guess += step;
+		if (l > 0)
+		{
+			guess *= 2.0f;
+			continue;
+		}
+
+		float residual[1] = { in_window ? fabsf(intensity - sampleBilinear(next_image, width, height, x + guess.x, y + guess.y)) : 0.0f };
+		blockSum(residual);
+		const glm::vec2 result = start + guess;
+		const bool inside = result.x >= 0.0f && result.y >= 0.0f && result.x <= width - 1.0f && result.y <= height - 1.0f;
+		error = inside ? residual[0] / (kWindowSize * kWindowSize) : -1.0f;
+	}
+
+	if (threadIdx.x == 0)
+	{
+		points[point] = error >= 0.0f ? start + guess : start;
+		errors[point] = error;
+	}
+}
+
+LandmarkFlow::LandmarkFlow(int number_of_levels)
+	: m_number_of_levels(std::min(std::max(number_of_levels, 1), kMaxFlowLevels))
+{
+	CHECK_CUDA_ERROR(cudaStreamCreate(&m_stream));
+}
+
+LandmarkFlow::~LandmarkFlow()
+{
+	cudaStreamDestroy(m_stream);
+}
+
+static FlowLevels getFlowLevels(const util::DeviceArray<float>& levels, const std::vector<int>& offsets, int width, int height)
+{
+	FlowLevels result;
+	result.count = offsets.size();
+	for (int l = 0; l < result.count; ++l)
+	{
+		result.images[l] = levels.getPtr() + offsets[l];
+		result.widths[l] = width;
+		result.heights[l] = height;
+		width = (width + 1) / 2;
+		height = (height + 1) / 2;
+	}
+	return result;
+}
+
+void LandmarkFlow::setFrame(const cv::Mat& frame)
+{
+	if (frame.type() != CV_8UC3)
+	{
+		throw std::runtime_error("Error: The landmark flow expects a BGR frame!");
+	}
+
+	if (frame.cols != m_width || frame.rows != m_height)
+	{
+		m_width = frame.cols;
+		m_height = frame.rows;
+		m_has_frame = false;
+		m_has_previous = false;
+
+		m_level_offsets.clear();
+		int size = 0;
+		int width = m_width;
+		int height = m_height;
+		for (int l = 0; l < m_number_of_levels; ++l)
+		{
+			m_level_offsets.push_back(size);
+			size += width * height;
+			width = (width + 1) / 2;
+			height = (height + 1) / 2;
+		}
+		m_gray_frame = util::DeviceArray<uchar>(m_width * m_height);
+		m_levels[0] = util::DeviceArray<float>(size);
+		m_levels[1] = util::DeviceArray<float>(size);
+	}
+	else
+	{
+		std::swap(m_levels[0], m_levels[1]);
+		m_has_previous = m_has_frame;
+	}
+	m_has_frame = true;
+
+	cv::Mat gray;
+	cv::cvtColor(frame, gray, cv::COLOR_BGR2GRAY);
+	CHECK_CUDA_ERROR(cudaMemcpyAsync(m_gray_frame.getPtr(), gray.ptr(), m_width * m_height, cudaMemcpyHostToDevice, m_stream));
+
+	const auto levels = getFlowLevels(m_levels[0], m_level_offsets, m_width, m_height);
+	dim3 threads(16, 16);
+	dim3 blocks((m_width + threads.x - 1) / threads.x, (m_height + threads.y - 1) / threads.y);
+	grayToFloatKernel << <blocks, threads, 0, m_stream >> > (m_gray_frame.getPtr(), m_width, m_height, m_levels[0].getPtr());
+	for (int l = 1; l < levels.count; ++l)
+	{
+		blocks = dim3((levels.widths[l] + threads.x - 1) / threads.x, (levels.heights[l] + threads.y - 1) / threads.y);
+		halveImageKernel << <blocks, threads, 0, m_stream >> > (levels.images[l - 1], levels.widths[l - 1], levels.heights[l - 1],
+			const_cast<float*>(levels.images[l]), levels.widths[l], levels.heights[l]);
+	}
+	//"gray" is released when we return.
+	CHECK_CUDA_ERROR(cudaStreamSynchronize(m_stream));
+}
+
+void LandmarkFlow::track(std::vector<glm::vec2>& points, std::vector<float>& errors)
+{
+	const int n_points = points.size();
+	errors.assign(n_points, -1.0f);
+	if (!m_has_previous || n_points == 0)
+	{
+		return;
+	}
+
+	util::ensureSize(m_points, n_points);
+	util::ensureSize(m_errors, n_points);
+	CHECK_CUDA_ERROR(cudaMemcpyAsync(m_points.getPtr(), points.data(), n_points * sizeof(glm::vec2), cudaMemcpyHostToDevice, m_stream));
+
+	const auto previous = getFlowLevels(m_levels[1], m_level_offsets, m_width, m_height);
+	const auto current = getFlowLevels(m_levels[0], m_level_offsets, m_width, m_height);
+	lucasKanadeKernel << <n_points, kFlowThreads, 0, m_stream >> > (previous, current, m_points.getPtr(), m_errors.getPtr(), n_points);
+
+	CHECK_CUDA_ERROR(cudaMemcpyAsync(points.data(), m_points.getPtr(), n_points * sizeof(glm::vec2), cudaMemcpyDeviceToHost, m_stream));
+	CHECK_CUDA_ERROR(cudaMemcpyAsync(errors.data(), m_errors.getPtr(), n_points * sizeof(float), cudaMemcpyDeviceToHost, m_stream));
+	CHECK_CUDA_ERROR(cudaStreamSynchronize(m_stream));
+}
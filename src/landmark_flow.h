@@ -0,0 +1,45 @@
+#pragma once
+
+#include "device_array.h"
+
+#include <vector>
+#include <cuda_runtime.h>
+#include <glm/glm.hpp>
+#include <opencv2/core/core.hpp>
+
+//Pyramidal Lucas-Kanade of a few points between two consecutive frames, on the device.
+//The tracker moves the landmarks of the last shape predictor fit with it, so dlib only runs every few frames.
+//It keeps its own gray pyramid of the tracker's frame, the frame pyramid of the solver isn't uploaded yet when the tracker runs.
+class LandmarkFlow
+{
+public:
+	LandmarkFlow(int number_of_levels = 3);
+	LandmarkFlow(const LandmarkFlow&) = delete;
+	LandmarkFlow& operator=(const LandmarkFlow&) = delete;
+	~LandmarkFlow();
+
+	//"frame" is BGR, the last frame becomes the previous one. A frame of another size starts over.
+	void setFrame(const cv::Mat& frame);
+	bool hasPreviousFrame() const { return m_has_previous; }
+	//Moves "points" (frame pixels) from the previous into the current frame. "errors" is the mean absolute
+	//intensity difference over the window after the last iteration, in 0-255, negative for lost points
+	//(outside of the frame or without enough texture).
+	void track(std::vector<glm::vec2>& points, std::vector<float>& errors);
+	//The next frame has no previous one.
+	void reset() { m_has_frame = false; m_has_previous = false; }
+
+private:
+	int m_number_of_levels;
+	int m_width{ 0 };
+	int m_height{ 0 };
+	bool m_has_frame{ false };
+	bool m_has_previous{ false };
+	cudaStream_t m_stream{ nullptr };
+
+	util::DeviceArray<uchar> m_gray_frame;
+	//All levels of a frame in one array, level l starts at m_level_offsets[l]. [0] is the current frame.
+	util::DeviceArray<float> m_levels[2];
+	std::vector<int> m_level_offsets;
+	util::DeviceArray<glm::vec2> m_points;
+	util::DeviceArray<float> m_errors;
+};
@@ -0,0 +1,68 @@
+#include "landmark_latency.h"
+
+#include <algorithm>
+#include <cmath>
+
+void LatencyCompensator::addDetection(const int frame_index, const std::vector<glm::vec2>& landmarks)
+{
+	if (landmarks.empty() || landmarks.size() != m_landmarks.size())
+	{
+		reset();
+		if (!landmarks.empty())
+		{
+			m_frame = frame_index;
+			m_landmarks = landmarks;
+			m_velocities.assign(landmarks.size(), glm::vec2(0.0f));
+			m_errors.assign(landmarks.size(), 0.0f);
+		}
+		return;
+	}
+	if (frame_index <= m_frame)
+	{
+		return;
+	}
+
+	//The solve of this frame, if there was one, extrapolated the detection of an earlier frame, compare it to what was detected.
+	for (size_t i = 0; i < landmarks.size(); ++i)
+	{
+		m_errors[i] = m_predicted_frame == frame_index ? glm::distance(m_predicted[i], landmarks[i]) : 0.0f;
+		m_velocities[i] = (landmarks[i] - m_landmarks[i]) / static_cast<float>(frame_index - m_frame);
+	}
+	m_frame = frame_index;
+	m_landmarks = landmarks;
+}
+
+void LatencyCompensator::predict(const LatencyCompensationParameters& params, const int frame_index, std::vector<glm::vec2>& landmarks,
+	std::vector<float>& weights)
+{
+	//The solve may also lag behind the detector by a frame or two, then the detection is moved back.
+	const int age = frame_index - m_frame;
+	if (m_frame < 0 || std::abs(age) > params.max_age)
+	{
+		landmarks.clear();
+		weights.clear();
+		return;
+	}
+
+	const float age_weight = std::pow(params.weight_decay, static_cast<float>(std::abs(age)));
+	landmarks.resize(m_landmarks.size());
+	weights.resize(m_landmarks.size());
+	for (size_t i = 0; i < m_landmarks.size(); ++i)
+	{
+		landmarks[i] = m_landmarks[i] + static_cast<float>(age) * m_velocities[i];
+		const float error = age != 0 ? m_errors[i] / std::max(params.error_scale, 1.0e-6f) : 0.0f;
+		weights[i] = age_weight / (1.0f + error * error);
+	}
+	m_predicted_frame = frame_index;
+	m_predicted = landmarks;
+}
+
+void LatencyCompensator::reset()
+{
+	m_frame = -1;
+	m_landmarks.clear();
+	m_velocities.clear();
+	m_errors.clear();
+	m_predicted_frame = -1;
+	m_predicted.clear();
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <vector>
+
+struct LatencyCompensationParameters
+{
+	float weight_decay = 0.7f; //weight of a landmark per frame of its age, so a detection of the frame before weighs 0.7
+	int max_age = 4; //frames, older detections count as lost, the face is untracked then
+	//Weight of a landmark also falls with the error of its last extrapolation, 1 / (1 + (e / error_scale)^2) of the distance e
+	//(NDC) between where it was extrapolated to and where the detection of that frame put it.
+	float error_scale = 0.01f;
+};
+
+//Landmarks of a detector which runs behind the solve, e.g. at half rate beside it: the solve of frame N only has the newest
+//detection of a frame M <= N. The detection is moved to frame N along the landmark velocity of the last two detections, and
+//weighted by its age and by how well the last extrapolation matched. A detection which arrives late replaces the extrapolation
+//in the next frame, so the error doesn't accumulate.
+class LatencyCompensator
+{
+public:
+	//The detection of frame "frame_index", in any order of arrival. Older ones than the newest are ignored. An empty one, a lost
+	//face, or a different number of landmarks starts over.
+	void addDetection(int frame_index, const std::vector<glm::vec2>& landmarks);
+	//The landmarks at frame "frame_index" and their weights. Empty if there is no detection, or it is more than max_age frames
+	//away from it.
+	void predict(const LatencyCompensationParameters& params, int frame_index, std::vector<glm::vec2>& landmarks,
+		std::vector<float>& weights);
+	void reset();
+
+	//Frame of the newest detection, -1 before the first one.
+	int getDetectionFrame() const { return m_frame; }
+
+private:
+	int m_frame{ -1 };
+	std::vector<glm::vec2> m_landmarks;
+	std::vector<glm::vec2> m_velocities; //per frame
+	std::vector<float> m_errors; //of the extrapolation to m_frame, 0 if there was none
+	int m_predicted_frame{ -1 }; //of the last predict, with the positions in m_predicted
+	std::vector<glm::vec2> m_predicted;
+};
@@ -0,0 +1,190 @@
+#include "landmark_solver.h"
+#include "gauss_newton_solver.h"
+#include "prior_sparse_features.h"
+#include "profiler.h"
+#include "util.h"
+
+#include <algorithm>
+#include <cmath>
+
+bool solveLDLT(Eigen::LDLT<Eigen::MatrixXf, Eigen::Lower>& ldlt, const Eigen::MatrixXf& jtj, const Eigen::VectorXf& rhs,
+	Eigen::VectorXf& delta)
+{
+	ldlt.compute(jtj);
+	if (ldlt.info() == Eigen::Success && ldlt.isPositive())
+	{
+		delta = ldlt.solve(rhs);
+		if (delta.allFinite())
+		{
+			return true;
+		}
+	}
+	delta.setZero(rhs.size());
+	return false;
+}
+
+void LandmarkSolver::loadModel(const FaceModel& model, const int nShapeCoeffs, const int nExpressionCoeffs)
+{
+	if (m_source_basis == model.landmark_shape_basis_gpu.getPtr() && m_shape_basis.cols() == nShapeCoeffs &&
+		m_expression_basis.cols() == nExpressionCoeffs)
+	{
+		return;
+	}
+
+	const auto& prior_ids = PriorSparseFeatures::get().getPriorIds();
+	const int nRows = 3 * prior_ids.size();
+
+	std::vector<float> shape_basis(nRows * nShapeCoeffs);
+	std::vector<float> expression_basis(nRows * nExpressionCoeffs);
+	util::copy(shape_basis, model.landmark_shape_basis_gpu, shape_basis.size());
+	util::copy(expression_basis, model.landmark_expression_basis_gpu, expression_basis.size());
+	m_shape_basis = Eigen::Map<decltype(m_shape_basis)>(shape_basis.data(), nRows, nShapeCoeffs);
+	m_expression_basis = Eigen::Map<decltype(m_expression_basis)>(expression_basis.data(), nRows, nExpressionCoeffs);
+
+	//The first half of the average face are the positions, the colors follow.
+	std::vector<glm::vec3> positions(model.number_of_vertices);
+	util::copy(positions, model.average_face_gpu, model.number_of_vertices);
+	m_mean.resize(nRows);
+	for (int i = 0; i < prior_ids.size(); ++i)
+	{
+		const auto& position = positions[prior_ids[i]];
+		m_mean.segment<3>(3 * i) << position.x, position.y, position.z;
+	}
+
+	m_source_basis = model.landmark_shape_basis_gpu.getPtr();
+}
+
+Eigen::VectorXf LandmarkSolver::computePositions(const Face& face, const int nExpressionCoeffs) const
+{
+	//Inactive shape coefficients are zero.
+	const auto& shape = face.getShapeCoefficients();
+	const Eigen::Map<const Eigen::VectorXf> shape_coefficients(shape.data(), shape.size());
+	const Eigen::Map<const Eigen::VectorXf> expression_coefficients(face.getExpressionCoefficients().data(), nExpressionCoeffs);
+	return m_mean + m_shape_basis * shape_coefficients + m_expression_basis.leftCols(nExpressionCoeffs) * expression_coefficients;
+}
+
+float LandmarkSolver::computeError(const SolverParameters& params, const std::vector<glm::vec2>& sparse_features, const Face& face,
+	const glm::mat4& projection)
+{
+	loadModel(*face.getModel(), face.getShapeCoefficients().size(), face.getExpressionCoefficients().size());
+
+	const int nFeatures = std::min(sparse_features.size(), PriorSparseFeatures::get().getPriorIds().size());
+	const int nExpressionCoeffs = glm::clamp(params.num_expression_coefficients, 0, static_cast<int>(face.getExpressionCoefficients().size()));
+	const Eigen::VectorXf positions = computePositions(face, nExpressionCoeffs);
+	const glm::mat4 transform = projection * face.computeModelMatrix();
+
+	float sum = 0.0f;
+	for (int i = 0; i < nFeatures; ++i)
+	{
+		const auto proj_coord = transform * glm::vec4(positions(3 * i), positions(3 * i + 1), positions(3 * i + 2), 1.0f);
+		const auto residual = glm::vec2(proj_coord.x, proj_coord.y) / proj_coord.w - sparse_features[i];
+		sum += glm::dot(residual, residual);
+	}
+	return nFeatures > 0 ? std::sqrt(sum / nFeatures) : 0.0f;
+}
+
+void LandmarkSolver::solve(const SolverParameters& params, const std::vector<glm::vec2>& sparse_features, Face& face, glm::mat4& projection,
+	const float aspect_ratio, const std::vector<float>* weights)
+{
+	util::ScopedTimer timer("Landmark solve");
+
+	auto& expression = face.getExpressionCoefficients();
+	loadModel(*face.getModel(), face.getShapeCoefficients().size(), expression.size());
+
+	const int nFeatures = std::min(sparse_features.size(), PriorSparseFeatures::get().getPriorIds().size());
+	const int nExpressionCoeffs = glm::clamp(params.num_expression_coefficients, 0, static_cast<int>(expression.size()));
+	const int nUnknowns = 7 + nExpressionCoeffs;
+	const float wSparseBase = std::sqrt(std::pow(10.0f, params.sparse_weight_exponent) / nFeatures);
+	const float wReg = std::sqrt(std::pow(10.0f, params.regularisation_weight_exponent));
+
+	//The sizes only change with the coefficient counts, so the buffers are allocated once.
+	m_rows.resize(2, nUnknowns);
+	m_jtj.resize(nUnknowns, nUnknowns);
+	m_rhs.resize(nUnknowns);
+	for (int iteration = 0; iteration < params.num_landmark_iterations; ++iteration)
+	{
+		const Eigen::VectorXf positions = computePositions(face, nExpressionCoeffs);
+
+		const auto face_pose = face.computeModelMatrix();
+		Eigen::Matrix<float, 3, 3> jacobian_local;
+		jacobian_local <<
+			face_pose[0][0], face_pose[1][0], face_pose[2][0],
+			face_pose[0][1], face_pose[1][1], face_pose[2][1],
+			face_pose[0][2], face_pose[1][2], face_pose[2][2];
+
+		glm::mat3 drx, dry, drz;
+		face.computeRotationDerivatives(drx, dry, drz);
+
+		//The normal equations are accumulated landmark by landmark, as rank-2 updates of the lower triangle, instead of
+		//forming the (2 * nFeatures + nExpressionCoeffs) x nUnknowns Jacobian first.
+		m_jtj.setZero();
+		m_rhs.setZero();
+		for (int i = 0; i < nFeatures; ++i)
+		{
+			const float wSparse = weights && i < weights->size() ? wSparseBase * (*weights)[i] : wSparseBase;
+			const glm::vec3 local_coord(positions(3 * i), positions(3 * i + 1), positions(3 * i + 2));
+			const auto world_coord = face_pose * glm::vec4(local_coord, 1.0f);
+			const auto proj_coord = projection * world_coord;
+			const auto uv = glm::vec2(proj_coord.x, proj_coord.y) / proj_coord.w;
+
+			const auto residual = uv - sparse_features[i];
+			const Eigen::Vector2f weighted_residual(residual.x * wSparse, residual.y * wSparse);
+
+			//Homogenization and projection
+			const float one_over_wp = 1.0f / proj_coord.w;
+			Eigen::Matrix<float, 2, 3> jacobian_proj;
+			jacobian_proj <<
+				one_over_wp, 0.0f, -proj_coord.x * one_over_wp * one_over_wp,
+				0.0f, one_over_wp, -proj_coord.y * one_over_wp * one_over_wp;
+			const Eigen::Matrix<float, 2, 3> jacobian_proj_world =
+				jacobian_proj * Eigen::Vector3f(projection[0][0], projection[1][1], -1.0f).asDiagonal() * wSparse;
+
+			//Intrinsics
+			m_rows.col(0) = jacobian_proj.col(0) * world_coord.x * wSparse;
+
+			//Rotation and translation
+			const auto dx = drx * local_coord;
+			const auto dy = dry * local_coord;
+			const auto dz = drz * local_coord;
+			Eigen::Matrix<float, 3, 6> jacobian_pose;
+			jacobian_pose <<
+				dx[0], dy[0], dz[0], 1.0f, 0.0f, 0.0f,
+				dx[1], dy[1], dz[1], 0.0f, 1.0f, 0.0f,
+				dx[2], dy[2], dz[2], 0.0f, 0.0f, 1.0f;
+			m_rows.block<2, 6>(0, 1) = jacobian_proj_world * jacobian_pose;
+
+			//Expressions, the contiguous landmark rows of the basis
+			const Eigen::Matrix<float, 2, 3> jacobian_expression = jacobian_proj_world * jacobian_local;
+			m_rows.rightCols(nExpressionCoeffs).noalias() = jacobian_expression * m_expression_basis.block(3 * i, 0, 3, nExpressionCoeffs);
+
+			m_jtj.selfadjointView<Eigen::Lower>().rankUpdate(m_rows.transpose());
+			m_rhs.noalias() -= m_rows.transpose() * weighted_residual;
+		}
+
+		//Expression prior: rows wReg * e_k
+		const float wReg2 = wReg * wReg;
+		for (int k = 0; k < nExpressionCoeffs; ++k)
+		{
+			m_jtj(7 + k, 7 + k) += wReg2;
+			m_rhs(7 + k) -= wReg2 * expression[k];
+		}
+
+		//7 + nExpressionCoeffs unknowns, so the normal equations are solved directly.
+		solveLDLT(m_ldlt, m_jtj, m_rhs, m_delta);
+		const Eigen::VectorXf& delta = m_delta;
+
+		projection[0][0] += delta(0);
+		projection[1][1] = projection[0][0] * aspect_ratio;
+		face.getRotationCoefficients() += glm::vec3(delta(1), delta(2), delta(3));
+		face.getTranslationCoefficients() += glm::vec3(delta(4), delta(5), delta(6));
+		for (int k = 0; k < nExpressionCoeffs; ++k)
+		{
+			expression[k] = glm::clamp(expression[k] + delta(7 + k), -0.5f, 0.5f);
+		}
+
+		if (params.convergence_threshold > 0.0f && delta.norm() < params.convergence_threshold)
+		{
+			break;
+		}
+	}
+}
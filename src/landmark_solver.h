@@ -0,0 +1,49 @@
+#pragma once
+
+#include "face.h"
+
+#include <Eigen/Dense>
+#include <glm/glm.hpp>
+#include <vector>
+
+struct SolverParameters;
+
+//delta = inv(JTJ) rhs with an LDLT of the lower triangle of "jtj", the factorization of LandmarkSolver and of the HostLdlt
+//backend of GaussNewtonSolver. Returns false and a zero delta if JTJ isn't positive definite in float.
+bool solveLDLT(Eigen::LDLT<Eigen::MatrixXf, Eigen::Lower>& ldlt, const Eigen::MatrixXf& jtj, const Eigen::VectorXf& rhs,
+	Eigen::VectorXf& delta);
+
+//Gauss-Newton on the sparse term alone, on the host with Eigen: focal length, pose and expressions against the landmarks.
+//There is no render, no interop and no dense term, so a frame costs a few small dense solves with 7 + nExpressionCoeffs
+//unknowns. The products are Eigen's, vectorized with the SIMD the host code is compiled for (see FACE_TRACKING_HOST_SIMD). Shape, albedo and lighting stay as the last full solve left them. Residuals, weights and updates are the ones of
+//the landmark rows of GaussNewtonSolver (see computeJacobianRows and updateParameters).
+class LandmarkSolver
+{
+public:
+	//"weights" scale the rows of each landmark, see GaussNewtonSolver::uploadLandmarkWeights. nullptr: 1.
+	void solve(const SolverParameters& params, const std::vector<glm::vec2>& sparse_features, Face& face, glm::mat4& projection,
+		float aspect_ratio, const std::vector<float>* weights = nullptr);
+
+	//RMS distance of the projected landmark vertices to the landmarks, in NDC, without the weights of the solve.
+	float computeError(const SolverParameters& params, const std::vector<glm::vec2>& sparse_features, const Face& face,
+		const glm::mat4& projection);
+
+private:
+	//Downloads the landmark bases and the mean positions of the landmark vertices, once per model and basis precision.
+	void loadModel(const FaceModel& model, int nShapeCoeffs, int nExpressionCoeffs);
+	//Landmark vertices of "face" in model space, x y z per landmark.
+	Eigen::VectorXf computePositions(const Face& face, int nExpressionCoeffs) const;
+
+private:
+	const float* m_source_basis{ nullptr }; //device landmark basis the host copies were taken from
+	Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> m_shape_basis; //3 rows per landmark
+	Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> m_expression_basis;
+	Eigen::VectorXf m_mean; //average face at the landmark vertices, x y z per landmark
+
+	//Normal equations of an iteration, the lower triangle of m_jtj is valid
+	Eigen::Matrix<float, 2, Eigen::Dynamic> m_rows; //Jacobian rows of one landmark
+	Eigen::MatrixXf m_jtj;
+	Eigen::VectorXf m_rhs;
+	Eigen::LDLT<Eigen::MatrixXf, Eigen::Lower> m_ldlt;
+	Eigen::VectorXf m_delta;
+};
@@ -0,0 +1,150 @@
+#include "launch_tuner.h"
+#include "util.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cfloat>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+namespace util
+{
+	std::string LaunchTuner::s_cache_directory = ".";
+
+	LaunchTuner& LaunchTuner::get()
+	{
+		static LaunchTuner tuner;
+		return tuner;
+	}
+
+	void LaunchTuner::setCacheDirectory(const std::string& directory)
+	{
+		std::lock_guard<std::mutex> lock(get().m_mutex);
+		s_cache_directory = directory;
+		get().m_devices.clear();
+	}
+
+	LaunchTuner::DeviceConfig& LaunchTuner::getDeviceConfig()
+	{
+		int device = 0;
+		CHECK_CUDA_ERROR(cudaGetDevice(&device));
+		auto result = m_devices.emplace(device, DeviceConfig());
+		auto& config = result.first->second;
+		if (!result.second || s_cache_directory.empty())
+		{
+			return config;
+		}
+
+		cudaDeviceProp properties;
+		CHECK_CUDA_ERROR(cudaGetDeviceProperties(&properties, device));
+		std::string model = properties.name;
+		std::replace_if(model.begin(), model.end(), [](char c) { return !std::isalnum(static_cast<unsigned char>(c)); }, '_');
+		config.cache_file = s_cache_directory + "/launch_config_" + model + "_sm" + std::to_string(properties.major) + std::to_string(properties.minor) + ".txt";
+
+		std::ifstream file(config.cache_file);
+		std::string kernel;
+		int block_size;
+		while (file >> kernel >> block_size)
+		{
+			config.block_sizes[kernel] = block_size;
+		}
+		return config;
+	}
+
+	void LaunchTuner::launch(const std::string& kernel, const std::vector<int>& candidates, cudaStream_t stream, const std::function<void(int)>& launch)
+	{
+		if (candidates.empty())
+		{
+			throw std::runtime_error("Error: The kernel " + kernel + " has no launch configuration!");
+		}
+
+		int block_size = candidates[0];
+		bool tuned = false;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			const auto& block_sizes = getDeviceConfig().block_sizes;
+			auto found = block_sizes.find(kernel);
+			if (found != block_sizes.end())
+			{
+				block_size = found->second;
+				tuned = true;
+			}
+		}
+
+		cudaStreamCaptureStatus capture_status;
+		CHECK_CUDA_ERROR(cudaStreamIsCapturing(stream, &capture_status));
+		if (tuned || !m_enabled || candidates.size() == 1 || capture_status != cudaStreamCaptureStatusNone)
+		{
+			launch(block_size);
+			return;
+		}
+
+		block_size = sweep(kernel, candidates, stream, launch);
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto& config = getDeviceConfig();
+		config.block_sizes[kernel] = block_size;
+		if (!config.cache_file.empty())
+		{
+			std::ofstream file(config.cache_file);
+			if (!file.is_open())
+			{
+				std::cout << "Warning: Could not write the launch configurations to " << config.cache_file << "!" << std::endl;
+				return;
+			}
+			for (const auto& entry : config.block_sizes)
+			{
+				file << entry.first << " " << entry.second << std::endl;
+			}
+		}
+	}
+
+	int LaunchTuner::sweep(const std::string& kernel, const std::vector<int>& candidates, cudaStream_t stream, const std::function<void(int)>& launch)
+	{
+		cudaEvent_t start, end;
+		CHECK_CUDA_ERROR(cudaEventCreate(&start));
+		CHECK_CUDA_ERROR(cudaEventCreate(&end));
+
+		int best = candidates[0];
+		int last = 0; //the configuration of the output
+		float best_ms = FLT_MAX;
+		std::ostringstream report;
+		for (int block_size : candidates)
+		{
+			launch(block_size); //warmup
+			CHECK_CUDA_ERROR(cudaEventRecord(start, stream));
+			for (int i = 0; i < kRepetitions; ++i)
+			{
+				launch(block_size);
+			}
+			CHECK_CUDA_ERROR(cudaEventRecord(end, stream));
+			CHECK_CUDA_ERROR(cudaEventSynchronize(end));
+			//A configuration the kernel can't launch with (too many registers or too much shared memory) is skipped.
+			if (cudaGetLastError() != cudaSuccess)
+			{
+				report << " " << block_size << ": -";
+				continue;
+			}
+
+			last = block_size;
+			float ms = 0.0f;
+			CHECK_CUDA_ERROR(cudaEventElapsedTime(&ms, start, end));
+			report << " " << block_size << ": " << ms / kRepetitions << " ms";
+			if (ms < best_ms)
+			{
+				best_ms = ms;
+				best = block_size;
+			}
+		}
+		CHECK_CUDA_ERROR(cudaEventDestroy(start));
+		CHECK_CUDA_ERROR(cudaEventDestroy(end));
+
+		if (best != last)
+		{
+			launch(best);
+		}
+		std::cout << "Tuned " << kernel << ":" << report.str() << " -> " << best << std::endl;
+		return best;
+	}
+}
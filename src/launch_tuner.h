@@ -0,0 +1,55 @@
+#pragma once
+
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cuda_runtime.h>
+
+namespace util
+{
+	//Block sizes of the hot kernels per GPU model, swept on first use and persisted, so mixed hardware doesn't run with the
+	//configuration of one card. The sizes of a model are stored in <cache directory>/launch_config_<model>_sm<version>.txt,
+	//one "<kernel> <block size>" per line.
+	class LaunchTuner
+	{
+	public:
+		static constexpr int kRepetitions = 5; //timed launches per candidate, after one warmup launch
+
+		static LaunchTuner& get();
+
+		//Empty doesn't read or write cache files. "." by default.
+		static void setCacheDirectory(const std::string& directory);
+		//Off: untuned kernels use their first candidate and nothing is swept.
+		void setEnabled(bool enabled) { m_enabled = enabled; }
+		bool isEnabled() const { return m_enabled; }
+
+		//Launches "kernel" with launch(block size) on "stream", with the block size tuned for the current device. If there's none
+		//yet, every one of "candidates" is timed on this call's input and the fastest one is kept. So "launch" has to be idempotent,
+		//e.g. writing its output from inputs it doesn't modify: it runs several times, the last run is one with the winner.
+		//While "stream" is captured into a CUDA graph nothing is swept, an untuned kernel uses candidates[0] then.
+		void launch(const std::string& kernel, const std::vector<int>& candidates, cudaStream_t stream, const std::function<void(int)>& launch);
+
+	private:
+		struct DeviceConfig
+		{
+			std::string cache_file; //empty: not persisted
+			std::map<std::string, int> block_sizes;
+		};
+
+		DeviceConfig& getDeviceConfig(); //of the current device, m_mutex held
+		int sweep(const std::string& kernel, const std::vector<int>& candidates, cudaStream_t stream, const std::function<void(int)>& launch);
+
+	private:
+		bool m_enabled{ true };
+		std::mutex m_mutex; //guards m_devices, sweeps run outside of it
+		std::map<int, DeviceConfig> m_devices;
+		static std::string s_cache_directory;
+
+	private:
+		LaunchTuner() = default;
+		LaunchTuner(const LaunchTuner&) = delete;
+		LaunchTuner(LaunchTuner&&) = delete;
+	};
+}
@@ -0,0 +1,148 @@
+#include "linear_solver.h"
+#include "gauss_newton_solver.h"
+#include "landmark_solver.h"
+#include "profiler.h"
+#include "util.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+const char* getStrategyName(SolverStrategy strategy)
+{
+	switch (strategy)
+	{
+	case SolverStrategy::JtjFromJacobian: return "JTJ from the Jacobian";
+	case SolverStrategy::DenseJacobian: return "dense Jacobian";
+	case SolverStrategy::NormalEquations: return "normal equations";
+	case SolverStrategy::HostLdlt: return "host LDLT";
+	case SolverStrategy::MatrixFree: return "matrix-free PCG";
+	}
+	return "unknown";
+}
+
+SolverStrategy getStrategy(const SolverParameters& params)
+{
+	if (params.use_matrix_free_pcg)
+	{
+		return SolverStrategy::MatrixFree;
+	}
+	if (params.use_host_ldlt)
+	{
+		return SolverStrategy::HostLdlt;
+	}
+	if (params.use_normal_equations)
+	{
+		return SolverStrategy::NormalEquations;
+	}
+	return params.use_jtj_from_jacobian ? SolverStrategy::JtjFromJacobian : SolverStrategy::DenseJacobian;
+}
+
+void setStrategy(SolverParameters& params, SolverStrategy strategy)
+{
+	params.use_matrix_free_pcg = strategy == SolverStrategy::MatrixFree;
+	params.use_normal_equations = strategy == SolverStrategy::NormalEquations;
+	params.use_host_ldlt = strategy == SolverStrategy::HostLdlt;
+	params.use_jtj_from_jacobian = strategy == SolverStrategy::JtjFromJacobian;
+}
+
+void DenseJacobianSolver::solve(const JacobianInput& input, SolverWorkspace& workspace)
+{
+	if (m_solver.m_params.storesReducedJacobian())
+	{
+		workspace.jacobian_16.memset(0, m_solver.m_stream);
+	}
+	else
+	{
+		workspace.jacobian.memset(0, m_solver.m_stream);
+	}
+	m_solver.computeJacobian(input, workspace.getJacobian(), workspace.residuals.getPtr());
+	m_solver.solveUpdatePCG(m_solver.m_cublas, input, workspace, 1.0f, -1.0f);
+}
+
+bool JtjFromJacobianSolver::usesPcg() const
+{
+	return !m_solver.m_params.use_cholesky;
+}
+
+void JtjFromJacobianSolver::solve(const JacobianInput& input, SolverWorkspace& workspace)
+{
+	if (m_solver.m_params.storesReducedJacobian())
+	{
+		workspace.jacobian_16.memset(0, m_solver.m_stream);
+	}
+	else
+	{
+		workspace.jacobian.memset(0, m_solver.m_stream);
+	}
+	m_solver.computeJacobian(input, workspace.getJacobian(), workspace.residuals.getPtr());
+	m_solver.solveUpdateJTJ(input, workspace, 1.0f, -1.0f);
+}
+
+int NormalEquationSolver::getJacobianRows(const int nResiduals) const
+{
+	return std::min(nResiduals, 3 * GaussNewtonSolver::kNormalEquationChunkThreads);
+}
+
+bool NormalEquationSolver::usesPcg() const
+{
+	return !m_solver.m_params.use_cholesky;
+}
+
+void NormalEquationSolver::solve(const JacobianInput& input, SolverWorkspace& workspace)
+{
+	m_solver.solveUpdateNormalEquations(input, workspace, 1.0f, -1.0f);
+}
+
+int HostLdltSolver::getJacobianRows(const int nResiduals) const
+{
+	return std::min(nResiduals, 3 * GaussNewtonSolver::kNormalEquationChunkThreads);
+}
+
+void HostLdltSolver::solve(const JacobianInput& input, SolverWorkspace& workspace)
+{
+	const int nUnknowns = input.nUnknowns;
+	m_solver.computeNormalEquations(input, workspace, 1.0f, -1.0f);
+	//JTJ stays undamped on the device, but isn't kept for the next iterations.
+	workspace.jtj_age = -1;
+
+	m_jtj.resize(nUnknowns, nUnknowns);
+	m_rhs.resize(nUnknowns);
+	{
+		util::ScopedTimer timer("JTJ download", true, m_solver.m_stream);
+		CHECK_CUDA_ERROR(cudaMemcpyAsync(m_jtj.data(), workspace.jtj.getPtr(), nUnknowns * nUnknowns * sizeof(float), cudaMemcpyDeviceToHost,
+			m_solver.m_stream));
+		CHECK_CUDA_ERROR(cudaMemcpyAsync(m_rhs.data(), workspace.r.getPtr(), nUnknowns * sizeof(float), cudaMemcpyDeviceToHost, m_solver.m_stream));
+		CHECK_CUDA_ERROR(cudaStreamSynchronize(m_solver.m_stream));
+	}
+
+	{
+		util::ScopedTimer timer("Host LDLT");
+		//The damping of dampJTJ
+		for (int i = 0; i < nUnknowns; ++i)
+		{
+			float& diagonal = m_jtj(i, i);
+			diagonal += m_solver.m_damping * std::max(diagonal, 1.0e-4f) + kJTJDiagonalEpsilon;
+		}
+		solveLDLT(m_ldlt, m_jtj, m_rhs, m_delta);
+	}
+	//m_delta is pageable, so the copy has taken it once it returns.
+	CHECK_CUDA_ERROR(cudaMemcpyAsync(workspace.result.getPtr(), m_delta.data(), nUnknowns * sizeof(float), cudaMemcpyHostToDevice, m_solver.m_stream));
+}
+
+void MatrixFreeSolver::solve(const JacobianInput& input, SolverWorkspace& workspace)
+{
+	m_solver.solveUpdatePCGMatrixFree(m_solver.m_cublas, input, workspace, 1.0f, -1.0f);
+}
+
+std::unique_ptr<LinearSolver> createLinearSolver(const SolverStrategy strategy, GaussNewtonSolver& solver)
+{
+	switch (strategy)
+	{
+	case SolverStrategy::JtjFromJacobian: return std::make_unique<JtjFromJacobianSolver>(solver);
+	case SolverStrategy::DenseJacobian: return std::make_unique<DenseJacobianSolver>(solver);
+	case SolverStrategy::NormalEquations: return std::make_unique<NormalEquationSolver>(solver);
+	case SolverStrategy::HostLdlt: return std::make_unique<HostLdltSolver>(solver);
+	case SolverStrategy::MatrixFree: return std::make_unique<MatrixFreeSolver>(solver);
+	}
+	throw std::runtime_error("Error: Unknown solver strategy!");
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <Eigen/Dense>
+#include <memory>
+
+class GaussNewtonSolver;
+struct JacobianInput;
+struct SolverParameters;
+struct SolverWorkspace;
+
+//Backends of the linear solve, from the fastest to the one with the smallest footprint.
+enum class SolverStrategy
+{
+	JtjFromJacobian,	//stored J, JTJ formed once per GN iteration, see SolverParameters::use_jtj_from_jacobian
+	DenseJacobian,		//stored J, two gemvs over all residuals per PCG iteration
+	NormalEquations,	//JTJ and J^T f accumulated chunk by chunk, see SolverParameters::use_normal_equations
+	HostLdlt,			//accumulated like NormalEquations, factorized on the host, see SolverParameters::use_host_ldlt
+	MatrixFree			//J recomputed in every PCG iteration, see SolverParameters::use_matrix_free_pcg
+};
+constexpr int kNumSolverStrategies = 5;
+
+const char* getStrategyName(SolverStrategy strategy);
+//The strategy of the flags of "params", see LinearSolver.
+SolverStrategy getStrategy(const SolverParameters& params);
+//Sets the flags of the strategy and clears those of the others, the rest of "params" stays.
+void setStrategy(SolverParameters& params, SolverStrategy strategy);
+
+//Computes the step of a GN iteration, workspace.result = -inv(JTJ + damping) J^T f with the regularizer, from the render
+//targets of "input". There is one backend per SolverStrategy. GaussNewtonSolver picks the one of its parameters in every GN
+//iteration, so a strategy set by MemoryPlanner (or the menu) takes effect with the next iteration. A backend runs on the
+//stream and the handles of its solver, the state of a level is in the workspace. A backend only keeps scratch buffers. A further
+//backend implements this interface, gets a SolverStrategy and is created by createLinearSolver.
+class LinearSolver
+{
+public:
+	explicit LinearSolver(GaussNewtonSolver& solver)
+		: m_solver(solver)
+	{
+	}
+	virtual ~LinearSolver() = default;
+
+	virtual SolverStrategy getStrategy() const = 0;
+	//Rows of J the workspace keeps at once for "nResiduals" residuals, see SolverWorkspace::reserve.
+	virtual int getJacobianRows(int nResiduals) const = 0;
+	//The step comes from PCG (of m_num_pcg_iterations iterations), not from a factorization.
+	virtual bool usesPcg() const = 0;
+	//Evaluates J (or its matrix-free products) into a workspace reserved for getJacobianRows and solves for the step. The
+	//residuals of "input" are added to workspace.residuals, which have to be zero. Render targets have to stay mapped until
+	//it returns.
+	virtual void solve(const JacobianInput& input, SolverWorkspace& workspace) = 0;
+
+protected:
+	GaussNewtonSolver& m_solver;
+};
+
+//PCG on the stored Jacobian, see GaussNewtonSolver::solveUpdatePCG.
+class DenseJacobianSolver : public LinearSolver
+{
+public:
+	using LinearSolver::LinearSolver;
+	SolverStrategy getStrategy() const override { return SolverStrategy::DenseJacobian; }
+	int getJacobianRows(int nResiduals) const override { return nResiduals; }
+	bool usesPcg() const override { return true; }
+	void solve(const JacobianInput& input, SolverWorkspace& workspace) override;
+};
+
+//JTJ formed from the stored Jacobian, then Cholesky or PCG on it (SolverParameters::use_cholesky).
+class JtjFromJacobianSolver : public LinearSolver
+{
+public:
+	using LinearSolver::LinearSolver;
+	SolverStrategy getStrategy() const override { return SolverStrategy::JtjFromJacobian; }
+	int getJacobianRows(int nResiduals) const override { return nResiduals; }
+	bool usesPcg() const override;
+	void solve(const JacobianInput& input, SolverWorkspace& workspace) override;
+};
+
+//JTJ accumulated chunk by chunk, then Cholesky or PCG on it. Keeps JTJ over LevelSchedule::jtj_reuse_iterations.
+class NormalEquationSolver : public LinearSolver
+{
+public:
+	using LinearSolver::LinearSolver;
+	SolverStrategy getStrategy() const override { return SolverStrategy::NormalEquations; }
+	int getJacobianRows(int nResiduals) const override;
+	bool usesPcg() const override;
+	void solve(const JacobianInput& input, SolverWorkspace& workspace) override;
+};
+
+//JTJ accumulated chunk by chunk like NormalEquationSolver, then downloaded, damped and solved with the LDLT of
+//LandmarkSolver (see solveLDLT), vectorized with FACE_TRACKING_HOST_SIMD. The download synchronizes the stream once per GN
+//iteration. A JTJ which isn't positive definite gets a zero step, like the Cholesky path.
+class HostLdltSolver : public LinearSolver
+{
+public:
+	using LinearSolver::LinearSolver;
+	SolverStrategy getStrategy() const override { return SolverStrategy::HostLdlt; }
+	int getJacobianRows(int nResiduals) const override;
+	bool usesPcg() const override { return false; }
+	void solve(const JacobianInput& input, SolverWorkspace& workspace) override;
+
+private:
+	//Host copies of the normal equations, the lower triangle of m_jtj is valid
+	Eigen::MatrixXf m_jtj;
+	Eigen::VectorXf m_rhs;
+	Eigen::VectorXf m_delta;
+	Eigen::LDLT<Eigen::MatrixXf, Eigen::Lower> m_ldlt;
+};
+
+//PCG with J recomputed in every iteration, see GaussNewtonSolver::solveUpdatePCGMatrixFree.
+class MatrixFreeSolver : public LinearSolver
+{
+public:
+	using LinearSolver::LinearSolver;
+	SolverStrategy getStrategy() const override { return SolverStrategy::MatrixFree; }
+	int getJacobianRows(int nResiduals) const override { return 0; }
+	bool usesPcg() const override { return true; }
+	void solve(const JacobianInput& input, SolverWorkspace& workspace) override;
+};
+
+//The backend of "strategy", running on "solver".
+std::unique_ptr<LinearSolver> createLinearSolver(SolverStrategy strategy, GaussNewtonSolver& solver);
@@ -1,9 +1,713 @@
 #include "application.h"
+#include "launch_tuner.h"
+#include "thread_placement.h"
+#include <algorithm>
 
-int main()
+#include <cctype>
+#include <cstdlib>
+#include <stdexcept>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <vector>
+
+static void printUsage()
+{
+	std::cout << "Options:" << std::endl
+		<< "  --pipelined               capture, landmark detection, solve and encode on separate threads" << std::endl
+		<< "  --headless                no window, menu or display, process the input as fast as possible" << std::endl
+		<< "  --input <path>            input video" << std::endl
+		<< "  --output <path>           overlay video" << std::endl
+		<< "  --codec <c>               mjpeg (default), h264 or hevc (NVENC, raw elementary stream)" << std::endl
+		<< "  --capture-policy <p>      lossless (default) or latest, which drops frames the solver can't keep up with" << std::endl
+		<< "  --gpu-decode              decode --input with NVDEC into device memory" << std::endl
+		<< "  --ipc-input <name>        device frames of a capture process through the CUDA IPC ring of that name, replaces --input" << std::endl
+		<< "  --no-video                don't render and write the overlay video" << std::endl
+		<< "  --frames <n>              stop after n frames" << std::endl
+		<< "  --server <a,b,...>        serve several inputs headless, see ApplicationSettings::server_inputs" << std::endl
+		<< "  --server-offline <a,...>  also serve these inputs, which yield to the live ones, see SessionScheduler" << std::endl
+		<< "  --live-budget <ms>        latency of the live sessions, offline ones are throttled close to it (33)" << std::endl
+		<< "  --metrics-port <port>     Prometheus endpoint of the server mode" << std::endl
+		<< "  --memory-limit <MB>       plan the solver memory for a card with that much memory instead of the free memory" << std::endl
+		<< "  --no-memory-plan          keep the configured solver strategy even if it doesn't fit into the device memory" << std::endl
+		<< "  --check-allocations <n>   warn about every device allocation after the first n frames" << std::endl
+		<< "  --batch <a,b,...>         offline processing on all GPUs, one merged parameter stream per input" << std::endl
+		<< "  --clip-length <n>         cut the --batch videos into clips of n frames, spread across the GPUs" << std::endl
+		<< "  --devices <a,b,...>       GPUs of --batch and --sweep, all by default" << std::endl
+		<< "  --frame-batch <n>         solve n consecutive --batch frames together once the identity is locked" << std::endl
+		<< "  --batch-landmarks <a,b,...>  landmark caches of the --batch inputs, in the same order" << std::endl
+		<< "  --shard <i>/<n>           process the i-th of n interleaved shards of the --batch clips, e.g. one per node" << std::endl
+		<< "  --resume                  skip the --batch clips which have a checkpoint of an earlier run" << std::endl
+		<< "  --benchmark <path>        solve --frames frames (300 by default) of --input headless, write a JSON report to path" << std::endl
+		<< "  --kernel-benchmark <path> time the solver kernels on synthetic input, write a JSON report to path" << std::endl
+		<< "  --compare <path>          solve --frames frames of --input with the reference and the configured solver, write a JSON report" << std::endl
+		<< "  --sweep <path>            solve --frames frames of --input with every configuration of --sweep-grid, write a JSON report" << std::endl
+		<< "  --sweep-grid <path>       swept solver parameters, one \"<name> = <a>, <b>, ...\" per line, see ParameterSweep" << std::endl
+		<< "  --sweep-workers <n>       configurations solved at the same time per GPU of --devices (1)" << std::endl
+		<< "  --matrix-free             matrix-free PCG, see SolverParameters::use_matrix_free_pcg" << std::endl
+		<< "  --persistent-threads      persistent blocks fed by a work queue, see SolverParameters::use_persistent_threads" << std::endl
+		<< "  --normal-equations        solve the assembled normal equations, see SolverParameters::use_normal_equations" << std::endl
+		<< "  --host-ldlt               solve the normal equations on the host, see SolverParameters::use_host_ldlt" << std::endl
+		<< "  --jtj-from-jacobian       form JTJ from the stored Jacobian, see SolverParameters::use_jtj_from_jacobian" << std::endl
+		<< "  --tensor-core-jtj         form JTJ on the tensor cores, see SolverParameters::use_tensor_core_jtj" << std::endl
+		<< "  --jacobian-precision <p>  fp32, fp16 or bf16 entries of the stored Jacobian, see SolverParameters::jacobian_precision" << std::endl
+		<< "  --fp16-bases              half precision bases of the morphable model" << std::endl
+		<< "  --sparse-expressions [t] drop the expression rows of vertices below t (0.01) of the largest entry, see Face::setSparseExpressionBasis" << std::endl
+		<< "  --basis-columns <s,a,e>   load at most s shape, a albedo and e expression basis columns, -1 all, 0 none, see BasisLimits" << std::endl
+		<< "  --tiled-basis [n]         keep the bases in host memory with a device cache of n (32) tiles, see Face::setTiledBasis" << std::endl
+		<< "  --reuse-solver-render     show the last render of the solver instead of rendering the fitted face again" << std::endl
+		<< "  --roi <n>                 render the solver's targets for a window of at most n x n pixels around the face" << std::endl
+		<< "  --packed-visibility       render triangle ids and barycentrics into one 8 byte target for the solver" << std::endl
+		<< "  --target-atlas            render all pyramid levels into one atlas of targets, mapped as one set of textures" << std::endl
+		<< "  --geometry-shader         render the face with the geometry shader, even if fragment barycentrics are supported" << std::endl
+		<< "  --display-rate <hz>       present the display and the menu at most that often, 0 every frame (default 30)" << std::endl
+		<< "  --swap-interval <n>       vsync interval of the window, 0 never waits for the display (default 1)" << std::endl
+		<< "  --tuning-cache <dir>      directory of the tuned kernel launch configurations per GPU model (default .)" << std::endl
+		<< "  --no-autotune             don't sweep the launch configurations of untuned kernels" << std::endl
+		<< "  --frame-budget <ms>       adapt the solver effort and the detector to hold that frame time, see BudgetController" << std::endl
+		<< "  --trace <path>            write a Chrome trace (chrome://tracing, ui.perfetto.dev) of a window of frames" << std::endl
+		<< "  --trace-frames <f> <n>    the window of --trace: n frames from frame f on (default 100 30)" << std::endl
+		<< "  --max-faces <n>           track up to n faces, solved as a batch (default 1)" << std::endl
+		<< "  --params <path>           write the fitted parameters of every frame to a parameter stream" << std::endl
+		<< "  --params-encoding <e>     float (default), q16 or delta16" << std::endl
+		<< "  --shared-memory <name>    publish the fitted parameters of every frame to other processes, see SharedMemorySink" << std::endl
+		<< "  --shared-memory-mesh      also publish the positions of the fitted face" << std::endl
+		<< "  --mesh-stream <path>      write the quantized mesh of every frame for remote viewers, see MeshStreamEncoder" << std::endl
+		<< "  --mesh-stream-parameters  write the shape and expression coefficients to the mesh stream instead of the mesh" << std::endl
+		<< "  --record <path>           record the frames, landmarks and solver controls for --benchmark, see InputRecorder" << std::endl
+		<< "  --record-png              PNG encode the recorded frames" << std::endl
+		<< "  --convergence-log <path>  log the energies, steps and PCG residuals of every GN iteration, see ConvergenceLogHeader" << std::endl
+		<< "  --snapshot <path>         write the tracking state every 30 tracked frames and at the end, see writeTrackingSnapshot" << std::endl
+		<< "  --snapshot-interval <n>   tracked frames between two snapshots (30)" << std::endl
+		<< "  --restore <path>          start from the tracking snapshot at path, if it exists, instead of the mean face" << std::endl
+		<< "  --identity-store <dir>    identity profiles of returning subjects, see IdentityProfileStore" << std::endl
+		<< "  --subject <id>            load the identity of the subject from the store and skip the calibration, or save it" << std::endl
+		<< "  --gn-iterations <a,b,...> GN iterations per pyramid level, finest first. The last one repeats for further levels" << std::endl
+		<< "  --pcg-iterations <n>      PCG iterations of every pyramid level" << std::endl
+		<< "  --pixel-samples <n>       random subset of n pixels at the finest level" << std::endl
+		<< "  --cuda-rasterizer         render the face with CUDA inside the solver" << std::endl
+		<< "  --cull-triangles          cull triangles before the CUDA rasterizer, see SolverParameters::use_triangle_culling" << std::endl
+		<< "  --render-reuse [t]        reuse the last render while the geometry changed by at most t (0), see SolverParameters::use_render_reuse" << std::endl
+		<< "  --mesh-lod                coarser meshes at coarser pyramid levels, see LevelSchedule::level_of_detail" << std::endl
+		<< "  --joint-calibration [k]   lock the identity solved jointly over k (6) keyframes of the calibration phase, see IdentityCalibrator" << std::endl
+		<< "  --landmark-filter         One-Euro filter of the landmarks, its confidences weight the sparse term" << std::endl
+		<< "  --motion-gate [n]         don't solve static frames, or with n GN iterations at the finest level, see SolverParameters::use_motion_gate" << std::endl
+		<< "  --tracker-threads <n>     fit the landmarks of several faces on n threads, 0 uses all hardware threads" << std::endl
+		<< "  --pin <stage>=<cpus>      run the threads of main, capture, detect, encode, io or service on cpus like 4-7,12" << std::endl
+		<< "  --numa-local              place the other stages and their host memory on the NUMA node of the GPU (Linux)" << std::endl
+		<< "  --precompute-landmarks <path>  detect the landmarks of the input on all threads into a landmark cache and exit" << std::endl
+		<< "  --landmarks <path>        read the landmarks from a landmark cache instead of detecting them" << std::endl
+		<< "  --landmark-flow [k]       move the landmarks with GPU optical flow, the shape predictor runs every k-th frame (default 5)" << std::endl
+		<< "  --async-landmarks [n]     --pipelined: detect the landmarks of every n-th frame (2) beside the solve, see LatencyCompensator" << std::endl
+		<< "  --gpu-shape-predictor     fit the landmarks of all faces of a frame in one launch, see ShapePredictorGpu" << std::endl
+		<< "  --landmark-only [n]       solve pose and expressions against the landmarks only, a full solve every n-th frame" << std::endl
+		<< "  --recovery [e]            re-acquire lost faces, and faces over e (0.15) from the landmarks, from several hypotheses, see SolverParameters::use_recovery" << std::endl
+		<< "  --verbosity <n>           see SolverParameters::verbosity" << std::endl;
+}
+
+//The numbers of the options, checked in full and against [min_value, max_value] instead of atoi's silent 0.
+static long long parseInteger(const std::string& text, const std::string& option, long long min_value, long long max_value)
+{
+	size_t end = 0;
+	long long number = 0;
+	try
+	{
+		number = std::stoll(text, &end);
+	}
+	catch (const std::invalid_argument&)
+	{
+		end = 0;
+	}
+	catch (const std::out_of_range&)
+	{
+		end = text.size();
+		number = text[0] == '-' ? std::numeric_limits<long long>::min() : std::numeric_limits<long long>::max();
+	}
+	if (end == 0 || end != text.size())
+	{
+		throw std::runtime_error("Error: " + option + " expects a number, got \"" + text + "\"!");
+	}
+	if (number < min_value || number > max_value)
+	{
+		const std::string range = max_value == std::numeric_limits<long long>::max() || max_value == std::numeric_limits<int>::max()
+			? ">= " + std::to_string(min_value) : "in [" + std::to_string(min_value) + ", " + std::to_string(max_value) + "]";
+		throw std::runtime_error("Error: " + option + " expects a number " + range + ", got " + text + "!");
+	}
+	return number;
+}
+
+static int parseInt(const std::string& text, const std::string& option, int min_value, int max_value = std::numeric_limits<int>::max())
+{
+	return static_cast<int>(parseInteger(text, option, min_value, max_value));
+}
+
+static float parseFloat(const std::string& text, const std::string& option, float min_value, float max_value = std::numeric_limits<float>::max())
+{
+	size_t end = 0;
+	float number = 0.0f;
+	try
+	{
+		number = std::stof(text, &end);
+	}
+	catch (const std::logic_error&)
+	{
+		end = 0;
+	}
+	if (end == 0 || end != text.size())
+	{
+		throw std::runtime_error("Error: " + option + " expects a number, got \"" + text + "\"!");
+	}
+	if (!(number >= min_value && number <= max_value)) //also NaN
+	{
+		std::ostringstream range;
+		range << (max_value == std::numeric_limits<float>::max() ? ">= " : "in [") << min_value;
+		if (max_value != std::numeric_limits<float>::max())
+		{
+			range << ", " << max_value << "]";
+		}
+		throw std::runtime_error("Error: " + option + " expects a number " + range.str() + ", got " + text + "!");
+	}
+	return number;
+}
+
+int main(int argc, char** argv)
 {
-	Application app;
-	app.run();
+	ApplicationSettings settings;
+	std::vector<std::function<void(SolverParameters&)>> solver_options; //applied once the solver exists
+	bool pipelined = false;
+	bool fp16_bases = false;
+	int flow_fit_interval = 0; //> 0: TrackerParameters::use_flow
+	bool gpu_shape_predictor = false;
+	int tracker_threads = -1; //< 0: 1, or all hardware threads for --precompute-landmarks
+	float sparse_expression_threshold = 0.0f;
+	int tiled_basis_cache_tiles = 0;
+	float frame_budget = 0.0f; //> 0: BudgetParameters::target_ms
+	bool numa_local = false;
+
+	//The errors of the options print the usage, the ones of the run below don't.
+	try
+	{
+		for (int i = 1; i < argc; ++i)
+		{
+			const std::string option = argv[i];
+			auto is = [&](const char* name) { return option == name; };
+			auto value = [&]() -> const char*
+			{
+				if (i + 1 >= argc)
+				{
+					throw std::runtime_error(std::string("Error: Missing value of ") + argv[i]);
+				}
+				return argv[++i];
+			};
+			auto int_value = [&](int min_value, int max_value = std::numeric_limits<int>::max()) { return parseInt(value(), option, min_value, max_value); };
+			auto float_value = [&](float min_value) { return parseFloat(value(), option, min_value); };
+
+			if (is("--pipelined")) pipelined = true;
+			else if (is("--headless")) settings.headless = true;
+			else if (is("--input")) settings.input_path = value();
+			else if (is("--output")) settings.output_video_path = value();
+			else if (is("--codec"))
+			{
+				const std::string codec = value();
+				if (codec == "mjpeg") settings.video_codec = util::VideoCodec::Mjpeg;
+				else if (codec == "h264") settings.video_codec = util::VideoCodec::H264;
+				else if (codec == "hevc") settings.video_codec = util::VideoCodec::Hevc;
+				else throw std::runtime_error("Error: Unknown video codec " + codec);
+			}
+			else if (is("--capture-policy"))
+			{
+				const std::string policy = value();
+				if (policy == "lossless") settings.capture_policy = util::CapturePolicy::Lossless;
+				else if (policy == "latest") settings.capture_policy = util::CapturePolicy::DropToLatest;
+				else throw std::runtime_error("Error: Unknown capture policy " + policy);
+			}
+			else if (is("--gpu-decode")) settings.gpu_decode = true;
+			else if (is("--ipc-input")) settings.ipc_input = value();
+			else if (is("--no-video")) settings.output_video_path.clear();
+			else if (is("--frames")) settings.max_frames = int_value(0);
+			else if (is("--server") || is("--server-offline"))
+			{
+				const bool offline = is("--server-offline");
+				std::stringstream inputs(value());
+				std::string input;
+				while (std::getline(inputs, input, ','))
+				{
+					settings.server_inputs.push_back(input);
+					settings.server_offline.resize(settings.server_inputs.size() - 1, false);
+					settings.server_offline.push_back(offline);
+				}
+			}
+			else if (is("--live-budget")) settings.scheduler.live_latency_budget_ms = float_value(0.0f);
+			else if (is("--metrics-port")) settings.metrics_port = int_value(0, 65535);
+			else if (is("--memory-limit")) settings.memory_limit_mb = static_cast<size_t>(parseInteger(value(), option, 0, std::numeric_limits<long long>::max()));
+			else if (is("--no-memory-plan")) settings.plan_memory = false;
+			else if (is("--check-allocations")) settings.allocation_check_frame = int_value(-1);
+			else if (is("--batch"))
+			{
+				std::stringstream inputs(value());
+				std::string input;
+				while (std::getline(inputs, input, ','))
+				{
+					settings.batch.inputs.push_back(input);
+				}
+			}
+			else if (is("--clip-length")) settings.batch.clip_length = int_value(0);
+			else if (is("--frame-batch")) settings.batch.frame_batch_size = int_value(1);
+			else if (is("--batch-landmarks"))
+			{
+				//Empty entries keep the detector, e.g. "a.flmk,,c.flmk".
+				std::stringstream caches(value());
+				std::string cache;
+				while (std::getline(caches, cache, ','))
+				{
+					settings.batch.landmark_caches.push_back(cache);
+				}
+				settings.batch.landmark_caches.resize(std::max(settings.batch.landmark_caches.size(), settings.batch.inputs.size()));
+			}
+			else if (is("--shard"))
+			{
+				const std::string shard = value();
+				const size_t slash = shard.find('/');
+				if (slash == std::string::npos)
+				{
+					throw std::runtime_error("Error: --shard expects <index>/<count>, e.g. 0/4!");
+				}
+				settings.batch.num_shards = parseInt(shard.substr(slash + 1), option, 1);
+				settings.batch.shard_index = parseInt(shard.substr(0, slash), option, 0, settings.batch.num_shards - 1);
+			}
+			else if (is("--resume")) settings.batch.resume = true;
+			else if (is("--devices"))
+			{
+				std::stringstream devices(value());
+				std::string device;
+				while (std::getline(devices, device, ','))
+				{
+					settings.batch.devices.push_back(parseInt(device, option, 0));
+				}
+				settings.sweep.devices = settings.batch.devices;
+			}
+			else if (is("--benchmark")) settings.benchmark.output_path = value();
+			else if (is("--kernel-benchmark")) settings.kernel_benchmark.output_path = value();
+			else if (is("--compare")) settings.comparison.output_path = value();
+			else if (is("--sweep")) settings.sweep.output_path = value();
+			else if (is("--sweep-grid")) settings.sweep.grid_path = value();
+			else if (is("--sweep-workers")) settings.sweep.workers_per_device = int_value(1);
+			else if (is("--fp16-bases")) fp16_bases = true;
+			else if (is("--sparse-expressions"))
+			{
+				//The threshold is optional.
+				sparse_expression_threshold = Face::kDefaultSparseExpressionThreshold;
+				if (i + 1 < argc && (std::isdigit(static_cast<unsigned char>(argv[i + 1][0])) || argv[i + 1][0] == '.'))
+				{
+					sparse_expression_threshold = float_value(0.0f);
+				}
+			}
+			else if (is("--basis-columns"))
+			{
+				std::vector<int> limits;
+				std::stringstream stream(value());
+				std::string limit;
+				while (std::getline(stream, limit, ','))
+				{
+					limits.push_back(parseInt(limit, option, -1));
+				}
+				if (limits.size() != 3)
+				{
+					throw std::runtime_error("Error: --basis-columns expects three comma separated numbers!");
+				}
+				settings.basis_limits.max_shape_coefficients = limits[0];
+				settings.basis_limits.max_albedo_coefficients = limits[1];
+				settings.basis_limits.max_expression_coefficients = limits[2];
+			}
+			else if (is("--tiled-basis"))
+			{
+				//The cache size is optional.
+				tiled_basis_cache_tiles = Face::kDefaultTiledBasisCacheTiles;
+				if (i + 1 < argc && std::isdigit(static_cast<unsigned char>(argv[i + 1][0])))
+				{
+					tiled_basis_cache_tiles = int_value(1);
+				}
+			}
+			else if (is("--reuse-solver-render")) settings.reuse_solver_render = true;
+			else if (is("--packed-visibility")) settings.packed_visibility = true;
+			else if (is("--target-atlas")) settings.render_target_atlas = true;
+			else if (is("--roi"))
+			{
+				settings.roi_size = int_value(1);
+				solver_options.push_back([](SolverParameters& params) { params.use_roi_rendering = true; });
+			}
+			else if (is("--geometry-shader")) settings.fragment_barycentrics = false;
+			else if (is("--display-rate")) settings.display_rate = float_value(0.0f);
+			else if (is("--swap-interval")) settings.swap_interval = int_value(-1);
+			else if (is("--tuning-cache")) util::LaunchTuner::setCacheDirectory(value());
+			else if (is("--no-autotune")) util::LaunchTuner::get().setEnabled(false);
+			else if (is("--frame-budget")) frame_budget = float_value(0.0f);
+			else if (is("--trace")) settings.trace_path = value();
+			else if (is("--trace-frames"))
+			{
+				settings.trace_first_frame = int_value(0);
+				settings.trace_num_frames = int_value(1);
+			}
+			else if (is("--max-faces")) settings.max_faces = int_value(1);
+			else if (is("--params")) settings.parameter_stream_path = value();
+			else if (is("--shared-memory")) settings.shared_memory_name = value();
+			else if (is("--shared-memory-mesh")) settings.shared_memory_mesh = true;
+			else if (is("--mesh-stream")) settings.mesh_stream_path = value();
+			else if (is("--mesh-stream-parameters")) settings.mesh_stream_mode = MeshStreamMode::Parameters;
+			else if (is("--record")) settings.input_recording_path = value();
+			else if (is("--record-png")) settings.input_recording_png = true;
+			else if (is("--convergence-log")) settings.convergence_log_path = value();
+			else if (is("--snapshot")) settings.snapshot_path = value();
+			else if (is("--snapshot-interval")) settings.snapshot_interval = int_value(1);
+			else if (is("--restore")) settings.restore_path = value();
+			else if (is("--identity-store")) settings.identity_store_directory = value();
+			else if (is("--subject")) settings.subject_id = value();
+			else if (is("--params-encoding"))
+			{
+				const std::string encoding = value();
+				if (encoding == "float") settings.parameter_encoding = ParameterEncoding::Float32;
+				else if (encoding == "q16") settings.parameter_encoding = ParameterEncoding::Quantized16;
+				else if (encoding == "delta16") settings.parameter_encoding = ParameterEncoding::QuantizedDelta16;
+				else throw std::runtime_error("Error: Unknown parameter encoding " + encoding);
+			}
+			else if (is("--pcg-iterations"))
+			{
+				int n = int_value(1);
+				solver_options.push_back([n](SolverParameters& params)
+				{
+					for (auto& level : params.levels)
+					{
+						level.num_pcg_iterations = n;
+					}
+				});
+			}
+			else if (is("--matrix-free"))
+			{
+				solver_options.push_back([](SolverParameters& params) { params.use_matrix_free_pcg = true; });
+			}
+			else if (is("--persistent-threads"))
+			{
+				solver_options.push_back([](SolverParameters& params) { params.use_persistent_threads = true; });
+			}
+			else if (is("--normal-equations"))
+			{
+				solver_options.push_back([](SolverParameters& params) { params.use_normal_equations = true; });
+			}
+			else if (is("--host-ldlt"))
+			{
+				solver_options.push_back([](SolverParameters& params) { params.use_host_ldlt = true; });
+			}
+			else if (is("--jtj-from-jacobian"))
+			{
+				solver_options.push_back([](SolverParameters& params) { params.use_jtj_from_jacobian = true; });
+			}
+			else if (is("--tensor-core-jtj"))
+			{
+				solver_options.push_back([](SolverParameters& params) { params.use_tensor_core_jtj = true; });
+			}
+			else if (is("--jacobian-precision"))
+			{
+				const std::string name = value();
+				JacobianPrecision precision;
+				if (name == "fp32") precision = JacobianPrecision::Float32;
+				else if (name == "fp16") precision = JacobianPrecision::Float16;
+				else if (name == "bf16") precision = JacobianPrecision::BFloat16;
+				else throw std::runtime_error("Error: Unknown Jacobian precision " + name);
+				solver_options.push_back([precision](SolverParameters& params) { params.jacobian_precision = precision; });
+			}
+			else if (is("--cuda-rasterizer"))
+			{
+				solver_options.push_back([](SolverParameters& params) { params.use_cuda_rasterizer = true; });
+			}
+			else if (is("--cull-triangles"))
+			{
+				solver_options.push_back([](SolverParameters& params) { params.use_triangle_culling = true; });
+			}
+			else if (is("--render-reuse"))
+			{
+				//The threshold is optional.
+				float threshold = 0.0f;
+				if (i + 1 < argc && (std::isdigit(static_cast<unsigned char>(argv[i + 1][0])) || argv[i + 1][0] == '.'))
+				{
+					threshold = float_value(0.0f);
+				}
+				solver_options.push_back([threshold](SolverParameters& params) { params.use_render_reuse = true; params.render_reuse_threshold = threshold; });
+			}
+			else if (is("--mesh-lod"))
+			{
+				solver_options.push_back([](SolverParameters& params)
+				{
+					for (int i = 0; i < params.levels.size(); ++i)
+					{
+						params.levels[i].level_of_detail = i;
+					}
+				});
+			}
+			else if (is("--joint-calibration"))
+			{
+				//The number of keyframes is optional.
+				int num_keyframes = SolverParameters().num_calibration_keyframes;
+				if (i + 1 < argc && std::isdigit(static_cast<unsigned char>(argv[i + 1][0])))
+				{
+					num_keyframes = int_value(1);
+				}
+				solver_options.push_back([num_keyframes](SolverParameters& params)
+				{
+					params.use_identity_locking = true;
+					params.use_joint_calibration = true;
+					params.num_calibration_keyframes = num_keyframes;
+				});
+			}
+			else if (is("--landmark-filter"))
+			{
+				solver_options.push_back([](SolverParameters& params) { params.use_landmark_filter = true; });
+			}
+			else if (is("--tracker-threads")) tracker_threads = int_value(0);
+			else if (is("--pin")) util::ThreadPlacement::get().parse(value());
+			else if (is("--numa-local")) numa_local = true;
+			else if (is("--precompute-landmarks")) settings.landmark_precompute_path = value();
+			else if (is("--landmarks")) settings.landmark_cache_path = value();
+			else if (is("--gpu-shape-predictor")) gpu_shape_predictor = true;
+			else if (is("--landmark-flow"))
+			{
+				//The fit interval is optional.
+				flow_fit_interval = 5;
+				if (i + 1 < argc && std::isdigit(static_cast<unsigned char>(argv[i + 1][0])))
+				{
+					flow_fit_interval = int_value(1);
+				}
+			}
+			else if (is("--async-landmarks"))
+			{
+				//The detection interval is optional.
+				settings.async_landmark_interval = 2;
+				if (i + 1 < argc && std::isdigit(static_cast<unsigned char>(argv[i + 1][0])))
+				{
+					settings.async_landmark_interval = int_value(1);
+				}
+			}
+			else if (is("--motion-gate"))
+			{
+				//The iterations of static frames are optional.
+				int iterations = 0;
+				if (i + 1 < argc && std::isdigit(static_cast<unsigned char>(argv[i + 1][0])))
+				{
+					iterations = int_value(0);
+				}
+				solver_options.push_back([iterations](SolverParameters& params) { params.use_motion_gate = true; params.static_solve_iterations = iterations; });
+			}
+			else if (is("--landmark-only"))
+			{
+				//The keyframe interval is optional.
+				int interval = 0;
+				if (i + 1 < argc && std::isdigit(static_cast<unsigned char>(argv[i + 1][0])))
+				{
+					interval = int_value(0);
+				}
+				solver_options.push_back([interval](SolverParameters& params) { params.use_landmark_only = true; params.landmark_keyframe_interval = interval; });
+			}
+			else if (is("--recovery"))
+			{
+				//The landmark error is optional.
+				float error = SolverParameters().recovery_landmark_error;
+				if (i + 1 < argc && (std::isdigit(static_cast<unsigned char>(argv[i + 1][0])) || argv[i + 1][0] == '.'))
+				{
+					error = float_value(0.0f);
+				}
+				solver_options.push_back([error](SolverParameters& params) { params.use_recovery = true; params.recovery_landmark_error = error; });
+			}
+			else if (is("--verbosity"))
+			{
+				int verbosity = int_value(0);
+				solver_options.push_back([verbosity](SolverParameters& params) { params.verbosity = verbosity; });
+			}
+			else if (is("--pixel-samples"))
+			{
+				int n = int_value(1);
+				solver_options.push_back([n](SolverParameters& params) { params.pixel_sampling_mode = 1; params.num_pixel_samples = n; });
+			}
+			else if (is("--gn-iterations"))
+			{
+				std::vector<int> counts;
+				std::stringstream stream(value());
+				std::string count;
+				while (std::getline(stream, count, ','))
+				{
+					counts.push_back(parseInt(count, option, 0));
+				}
+				if (counts.empty())
+				{
+					throw std::runtime_error("Error: --gn-iterations expects comma separated numbers!");
+				}
+				solver_options.push_back([counts](SolverParameters& params)
+				{
+					params.levels.resize(counts.size(), params.levels.empty() ? LevelSchedule() : params.levels.back());
+					for (int i = 0; i < counts.size(); ++i)
+					{
+						params.levels[i].num_gn_iterations = counts[i];
+					}
+				});
+			}
+			else
+			{
+				std::cout << "Warning: Unknown option " << argv[i] << std::endl;
+				printUsage();
+				return 1;
+			}
+		}
+
+		if (!settings.benchmark.output_path.empty() || !settings.kernel_benchmark.output_path.empty() || !settings.comparison.output_path.empty()
+			|| !settings.sweep.output_path.empty())
+		{
+			settings.headless = true;
+			settings.output_video_path.clear();
+			settings.parameter_stream_path.clear();
+			settings.shared_memory_name.clear();
+			settings.mesh_stream_path.clear();
+			settings.input_recording_path.clear();
+			settings.snapshot_path.clear();
+			settings.restore_path.clear();
+			settings.identity_store_directory.clear();
+			if (settings.max_frames > 0)
+			{
+				settings.benchmark.num_frames = settings.max_frames;
+				settings.comparison.num_frames = settings.max_frames;
+				settings.sweep.num_frames = settings.max_frames;
+			}
+		}
+
+		if (!settings.landmark_precompute_path.empty())
+		{
+			settings.headless = true;
+			settings.output_video_path.clear();
+			settings.parameter_stream_path.clear();
+			settings.shared_memory_name.clear();
+			settings.mesh_stream_path.clear();
+			settings.input_recording_path.clear();
+			settings.landmark_cache_path.clear();
+			settings.snapshot_path.clear();
+			settings.restore_path.clear();
+			settings.identity_store_directory.clear();
+		}
+
+		if (!settings.server_inputs.empty() || !settings.batch.inputs.empty())
+		{
+			settings.headless = true;
+			settings.input_path = !settings.batch.inputs.empty() ? settings.batch.inputs[0] : settings.server_inputs[0]; //sizes the hidden window
+			settings.output_video_path.clear();
+			settings.snapshot_path.clear(); //the sessions have faces of their own
+			settings.restore_path.clear();
+			settings.identity_store_directory.clear();
+		}
+
+		if (!settings.ipc_input.empty())
+		{
+			if (!settings.server_inputs.empty() || !settings.batch.inputs.empty() || !settings.landmark_precompute_path.empty()
+				|| !settings.benchmark.output_path.empty() || !settings.kernel_benchmark.output_path.empty() || !settings.comparison.output_path.empty())
+			{
+				throw std::runtime_error("Error: --ipc-input only feeds the interactive and the headless run!");
+			}
+			if (pipelined)
+			{
+				std::cout << "Warning: The pipelined run reads --input only, --ipc-input runs unpipelined." << std::endl;
+				pipelined = false;
+			}
+		}
+	}
+	catch (const std::runtime_error& error)
+	{
+		std::cout << error.what() << std::endl;
+		printUsage();
+		return 1;
+	}
+
+	//Before the CUDA context and the first thread of a stage are created, see ThreadPlacement.
+	if (numa_local)
+	{
+		util::ThreadPlacement::get().placeOnDeviceNode(0);
+	}
+	util::ThreadPlacement::get().apply(util::ThreadStage::Main);
+
+	//The shape predictor loads while the window, the morphable model and the pyramid are created.
+	if (settings.landmark_cache_path.empty() || !settings.landmark_precompute_path.empty())
+	{
+		Tracker::preloadModels();
+	}
+	Application app(settings);
+	for (auto& option : solver_options)
+	{
+		option(app.getSolverParameters());
+	}
+	auto& tracker_parameters = app.getTrackerParameters();
+	tracker_parameters.num_threads = tracker_threads >= 0 ? tracker_threads : (settings.landmark_precompute_path.empty() ? 1 : 0);
+	tracker_parameters.use_gpu_shape_predictor = gpu_shape_predictor;
+	if (flow_fit_interval > 0)
+	{
+		tracker_parameters.use_flow = true;
+		tracker_parameters.flow_fit_interval = flow_fit_interval;
+	}
+	if (frame_budget > 0.0f)
+	{
+		app.getBudgetParameters().enabled = true;
+		app.getBudgetParameters().target_ms = frame_budget;
+	}
+	if (fp16_bases)
+	{
+		app.getFace().setHalfPrecisionBasis(true);
+	}
+	if (sparse_expression_threshold > 0.0f)
+	{
+		app.getFace().setSparseExpressionBasis(sparse_expression_threshold);
+	}
+	if (tiled_basis_cache_tiles > 0)
+	{
+		app.getFace().setTiledBasis(tiled_basis_cache_tiles);
+	}
+	app.planMemory(pipelined && !settings.headless);
+	app.loadIdentityProfile();
+	app.restoreSnapshot();
+
+	if (!settings.landmark_precompute_path.empty())
+	{
+		app.runLandmarkPrecompute();
+	}
+	else if (!settings.batch.inputs.empty())
+	{
+		app.runBatch();
+	}
+	else if (!settings.benchmark.output_path.empty())
+	{
+		app.runBenchmark();
+	}
+	else if (!settings.kernel_benchmark.output_path.empty())
+	{
+		app.runKernelBenchmark();
+	}
+	else if (!settings.comparison.output_path.empty())
+	{
+		app.runComparison();
+	}
+	else if (!settings.sweep.output_path.empty())
+	{
+		app.runSweep();
+	}
+	else if (!settings.server_inputs.empty())
+	{
+		app.runServer();
+	}
+	else if (settings.headless)
+	{
+		app.runHeadless();
+	}
+	else if (pipelined)
+	{
+		app.runPipelined();
+	}
+	else
+	{
+		app.run();
+	}
 
 	return 0;
 }
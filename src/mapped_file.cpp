@@ -0,0 +1,166 @@
+#include "mapped_file.h"
+#include "util.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <thread>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+namespace util
+{
+#ifdef _WIN32
+	MappedFile::MappedFile(const std::string& filepath)
+	{
+		HANDLE file = CreateFileA(filepath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+		{
+			return;
+		}
+		m_file = file;
+
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+		{
+			return;
+		}
+
+		m_mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (m_mapping == nullptr)
+		{
+			return;
+		}
+
+		m_data = static_cast<const char*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+		m_size = m_data ? static_cast<size_t>(size.QuadPart) : 0;
+	}
+
+	MappedFile::~MappedFile()
+	{
+		if (m_data)
+		{
+			UnmapViewOfFile(m_data);
+		}
+		if (m_mapping)
+		{
+			CloseHandle(m_mapping);
+		}
+		if (m_file)
+		{
+			CloseHandle(m_file);
+		}
+	}
+#else
+	MappedFile::MappedFile(const std::string& filepath)
+	{
+		int file = open(filepath.c_str(), O_RDONLY);
+		if (file < 0)
+		{
+			return;
+		}
+
+		struct stat file_stat;
+		if (fstat(file, &file_stat) == 0 && file_stat.st_size > 0)
+		{
+			void* data = mmap(nullptr, file_stat.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+			if (data != MAP_FAILED)
+			{
+				m_data = static_cast<const char*>(data);
+				m_size = file_stat.st_size;
+			}
+		}
+		close(file); //the mapping stays valid
+	}
+
+	MappedFile::~MappedFile()
+	{
+		if (m_data)
+		{
+			munmap(const_cast<char*>(m_data), m_size);
+		}
+	}
+#endif
+
+	void copyThroughPinnedMemory(void* dst_device, const void* src_host, size_t bytes)
+	{
+		constexpr size_t kChunkSize = 8 * 1024 * 1024;
+		if (bytes == 0)
+		{
+			return;
+		}
+
+		const size_t staging_size = std::min(bytes, kChunkSize);
+		char* staging[2] = { nullptr, nullptr };
+		cudaEvent_t copied[2];
+		cudaStream_t stream;
+		CHECK_CUDA_ERROR(cudaStreamCreate(&stream));
+		for (int i = 0; i < 2; ++i)
+		{
+			CHECK_CUDA_ERROR(cudaMallocHost(&staging[i], staging_size));
+			CHECK_CUDA_ERROR(cudaEventCreateWithFlags(&copied[i], cudaEventDisableTiming));
+		}
+
+		auto dst = static_cast<char*>(dst_device);
+		auto src = static_cast<const char*>(src_host);
+		for (size_t offset = 0, chunk = 0; offset < bytes; offset += kChunkSize, ++chunk)
+		{
+			const int buffer = chunk % 2;
+			const size_t size = std::min(kChunkSize, bytes - offset);
+
+			//The buffer was handed to the DMA two chunks ago.
+			if (chunk >= 2)
+			{
+				CHECK_CUDA_ERROR(cudaEventSynchronize(copied[buffer]));
+			}
+			std::memcpy(staging[buffer], src + offset, size);
+			CHECK_CUDA_ERROR(cudaMemcpyAsync(dst + offset, staging[buffer], size, cudaMemcpyHostToDevice, stream));
+			CHECK_CUDA_ERROR(cudaEventRecord(copied[buffer], stream));
+		}
+		CHECK_CUDA_ERROR(cudaStreamSynchronize(stream));
+
+		for (int i = 0; i < 2; ++i)
+		{
+			CHECK_CUDA_ERROR(cudaFreeHost(staging[i]));
+			CHECK_CUDA_ERROR(cudaEventDestroy(copied[i]));
+		}
+		CHECK_CUDA_ERROR(cudaStreamDestroy(stream));
+	}
+
+	std::string getTemporaryPath(const std::string& filepath)
+	{
+#ifdef _WIN32
+		const unsigned long process = GetCurrentProcessId();
+#else
+		const long process = static_cast<long>(getpid());
+#endif
+		return filepath + "." + std::to_string(process) + "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp";
+	}
+
+	bool replaceFile(const std::string& temporary_path, const std::string& filepath)
+	{
+#ifdef _WIN32
+		//rename fails on Windows if the target exists, removing it first would leave a moment without the file.
+		const bool replaced = MoveFileExW(std::filesystem::path(temporary_path).c_str(), std::filesystem::path(filepath).c_str(),
+			MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+		const bool replaced = std::rename(temporary_path.c_str(), filepath.c_str()) == 0;
+#endif
+		if (!replaced)
+		{
+			std::remove(temporary_path.c_str());
+		}
+		return replaced;
+	}
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+namespace util
+{
+	//Read-only memory mapping of a whole file. isOpen() is false, if the file doesn't exist.
+	class MappedFile
+	{
+	public:
+		explicit MappedFile(const std::string& filepath);
+		~MappedFile();
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		bool isOpen() const { return m_data != nullptr; }
+		const char* getData() const { return m_data; }
+		size_t getSize() const { return m_size; }
+
+	private:
+		const char* m_data{ nullptr };
+		size_t m_size{ 0 };
+#ifdef _WIN32
+		void* m_file{ nullptr };
+		void* m_mapping{ nullptr };
+#endif
+	};
+
+	//Copies pageable (e.g. memory mapped) host memory to the device through two pinned staging buffers,
+	//so reading the source overlaps with the DMA of the previous chunk.
+	void copyThroughPinnedMemory(void* dst_device, const void* src_host, size_t bytes);
+
+	//Path next to "filepath" to write a replacement of it to, unique to this process and thread. Other processes may write
+	//the same file at the same time, e.g. the batch workers of several machines.
+	std::string getTemporaryPath(const std::string& filepath);
+
+	//Renames "temporary_path" to "filepath" in one step, replacing an existing file, so a reader sees either the old or the
+	//new file, never none. False, if it failed, the temporary file is removed then.
+	bool replaceFile(const std::string& temporary_path, const std::string& filepath);
+}
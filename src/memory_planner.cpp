@@ -0,0 +1,135 @@
+#include "memory_planner.h"
+
+#include <algorithm>
+#include <iomanip>
+
+namespace
+{
+	double toMegabytes(size_t bytes)
+	{
+		return bytes / (1024.0 * 1024.0);
+	}
+}
+
+size_t MemoryPlanner::estimateSolverBytes(const SolverParameters& params, SolverStrategy strategy, const MemoryConfig& config)
+{
+	const size_t n_unknowns = 7 + params.num_shape_coefficients + params.num_expression_coefficients + params.num_albedo_coefficients + 9;
+	const bool forms_jtj = strategy == SolverStrategy::JtjFromJacobian || strategy == SolverStrategy::NormalEquations ||
+		strategy == SolverStrategy::HostLdlt;
+	const bool stores_jacobian = strategy == SolverStrategy::JtjFromJacobian || strategy == SolverStrategy::DenseJacobian;
+	const size_t jacobian_entry_bytes = stores_jacobian && params.jacobian_precision != JacobianPrecision::Float32 ? 2 : sizeof(float);
+
+	size_t workspace_bytes = 0;
+	size_t max_pixels = 0;
+	int width = config.width;
+	int height = config.height;
+	for (int i = 0; i < config.number_of_levels; ++i, width /= 2, height /= 2)
+	{
+		//The targets the solver renders into, the ROI ones with use_roi_rendering.
+		const bool roi = params.use_roi_rendering && config.roi_size > 0;
+		const size_t n_pixels = params.getLevel(i).use_dense_term ?
+			static_cast<size_t>(roi ? std::min(width, config.roi_size) : width) * (roi ? std::min(height, config.roi_size) : height) : 0;
+		const size_t n_residuals = 2 * kNumLandmarks + 3 * n_pixels;
+		max_pixels = std::max(max_pixels, n_pixels);
+
+		size_t n_jacobian_rows = n_residuals;
+		if (strategy == SolverStrategy::MatrixFree)
+		{
+			n_jacobian_rows = 0;
+		}
+		else if (strategy == SolverStrategy::NormalEquations || strategy == SolverStrategy::HostLdlt)
+		{
+			n_jacobian_rows = std::min(n_residuals, static_cast<size_t>(3 * GaussNewtonSolver::kNormalEquationChunkThreads));
+		}
+
+		//Jacobian, residuals and Jp, the PCG vectors, JTJ and the damped and factorized copy of it. The host LDLT factorizes
+		//a host copy.
+		workspace_bytes += n_jacobian_rows * n_unknowns * jacobian_entry_bytes;
+		size_t n_floats = 2 * n_residuals + 6 * n_unknowns;
+		if (forms_jtj || params.use_block_preconditioner)
+		{
+			n_floats += (strategy == SolverStrategy::HostLdlt ? 1 : 2) * n_unknowns * n_unknowns;
+		}
+		workspace_bytes += n_floats * sizeof(float);
+	}
+
+	//Dense and sampled pixels are shared by the levels and the faces.
+	return config.num_faces * workspace_bytes + 2 * max_pixels * sizeof(VisiblePixel);
+}
+
+size_t MemoryPlanner::estimatePyramidBytes(const MemoryConfig& config)
+{
+	//Color, depth and the visibility targets: packed (RG32UI) or barycentrics (RGBA32F) and vertex ids (RGB32I, padded).
+	const size_t target_bytes_per_pixel = 4 + 4 + (config.packed_visibility ? 8 : 16 + 16);
+	size_t frame_bytes = 3 * static_cast<size_t>(config.width) * config.height; //raw frame
+	size_t target_bytes = 4 * static_cast<size_t>(config.width) * config.height; //display texture
+	int width = config.width;
+	int height = config.height;
+	for (int i = 0; i < config.number_of_levels; ++i, width /= 2, height /= 2)
+	{
+		const size_t pitch = (width + 15) / 16 * 16;
+		frame_bytes += 3 * static_cast<size_t>(width) * height + 2 * pitch * height * 4 * sizeof(float);
+		target_bytes += target_bytes_per_pixel * width * height;
+		if (config.roi_size > 0)
+		{
+			target_bytes += target_bytes_per_pixel * std::min(width, config.roi_size) * std::min(height, config.roi_size);
+		}
+	}
+	return (config.prefetch ? 2 : 1) * frame_bytes + target_bytes;
+}
+
+MemoryPlan MemoryPlanner::plan(SolverParameters& params, const MemoryConfig& config, size_t available_bytes)
+{
+	MemoryPlan plan;
+	plan.available_bytes = available_bytes;
+	plan.pyramid_bytes = estimatePyramidBytes(config);
+	plan.strategy_bytes.resize(kNumSolverStrategies);
+	for (int i = 0; i < kNumSolverStrategies; ++i)
+	{
+		plan.strategy_bytes[i] = estimateSolverBytes(params, static_cast<SolverStrategy>(i), config);
+	}
+
+	const size_t usable_bytes = static_cast<size_t>(kUsableFraction * available_bytes);
+	auto getTotal = [&](SolverStrategy strategy)
+	{
+		return config.num_sessions * plan.strategy_bytes[static_cast<int>(strategy)] + config.num_pyramids * plan.pyramid_bytes;
+	};
+
+	//The configured strategy first, then the others from the fastest on. The last one is the smallest.
+	plan.configured_strategy = getStrategy(params);
+	plan.strategy = plan.configured_strategy;
+	plan.fits = getTotal(plan.strategy) <= usable_bytes;
+	for (int i = 0; i < kNumSolverStrategies && !plan.fits; ++i)
+	{
+		plan.strategy = static_cast<SolverStrategy>(i);
+		plan.fits = getTotal(plan.strategy) <= usable_bytes;
+	}
+
+	setStrategy(params, plan.strategy);
+	plan.solver_bytes = plan.strategy_bytes[static_cast<int>(plan.strategy)];
+	plan.total_bytes = getTotal(plan.strategy);
+	return plan;
+}
+
+void MemoryPlanner::print(const MemoryPlan& plan, std::ostream& stream)
+{
+	const auto precision = stream.precision();
+	stream << std::fixed << std::setprecision(1) << "Memory plan: " << toMegabytes(plan.available_bytes) << " MB free, solver per session:";
+	for (int i = 0; i < plan.strategy_bytes.size(); ++i)
+	{
+		stream << (i > 0 ? "," : "") << " " << getStrategyName(static_cast<SolverStrategy>(i)) << " " << toMegabytes(plan.strategy_bytes[i]) << " MB";
+	}
+	stream << ", pyramid " << toMegabytes(plan.pyramid_bytes) << " MB" << std::endl;
+	stream << "Memory plan: " << getStrategyName(plan.strategy) << ", " << toMegabytes(plan.total_bytes) << " MB in total" << std::endl;
+	if (plan.strategy != plan.configured_strategy)
+	{
+		stream << "Warning: The configured strategy (" << getStrategyName(plan.configured_strategy) << ") needs "
+			<< toMegabytes(plan.strategy_bytes[static_cast<int>(plan.configured_strategy)]) << " MB per session, switched to "
+			<< getStrategyName(plan.strategy) << "." << std::endl;
+	}
+	stream << std::defaultfloat << std::setprecision(precision);
+	if (!plan.fits)
+	{
+		stream << "Warning: No solver strategy fits into the free memory, reduce the resolution, the pyramid levels or the coefficients!" << std::endl;
+	}
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "gauss_newton_solver.h"
+
+#include <cstddef>
+#include <ostream>
+#include <vector>
+
+//What a planned configuration allocates on the device, on top of the model.
+struct MemoryConfig
+{
+	int width = 0; //of pyramid level 0
+	int height = 0;
+	int number_of_levels = 0;
+	int roi_size = 0; //see Pyramid
+	bool packed_visibility = false;
+	int num_faces = 1; //solved per session, every one has its own workspaces
+	int num_sessions = 1; //solvers
+	int num_pyramids = 1; //not created yet, e.g. 0 for the one of the application
+	bool prefetch = false; //second set of frame buffers per pyramid, see Pyramid::prefetchFrame
+};
+
+struct MemoryPlan
+{
+	SolverStrategy configured_strategy = SolverStrategy::DenseJacobian; //of the parameters before planning
+	SolverStrategy strategy = SolverStrategy::DenseJacobian;
+	bool fits = false;
+	size_t available_bytes = 0;
+	size_t solver_bytes = 0; //per session, of "strategy"
+	size_t pyramid_bytes = 0; //per pyramid
+	size_t total_bytes = 0; //all sessions and pyramids
+	std::vector<size_t> strategy_bytes; //solver footprint per session, indexed by SolverStrategy
+};
+
+//Estimates the device memory of the solver strategies and the pyramids of a configuration and picks one that fits. The
+//estimates cover the large buffers the sizes of which follow from the configuration: the Jacobian and the residual vectors of
+//the workspaces (one per face and pyramid level), JTJ, the visible pixels and the frame, gradient and render target buffers.
+//The dense Jacobian dominates, (2 * landmarks + 3 * pixels) rows of all unknowns per level.
+class MemoryPlanner
+{
+public:
+	//Fraction of the free memory a plan uses, the rest is left to the allocator caches, cuBLAS and the driver.
+	static constexpr float kUsableFraction = 0.9f;
+	static constexpr int kNumLandmarks = 68;
+
+	static size_t estimateSolverBytes(const SolverParameters& params, SolverStrategy strategy, const MemoryConfig& config);
+	static size_t estimatePyramidBytes(const MemoryConfig& config);
+
+	//Keeps the strategy of "params" if the configuration fits into "available_bytes". Otherwise switches "params" to the
+	//fastest strategy that fits, or to the one with the smallest footprint if none does.
+	static MemoryPlan plan(SolverParameters& params, const MemoryConfig& config, size_t available_bytes);
+	static void print(const MemoryPlan& plan, std::ostream& stream);
+};
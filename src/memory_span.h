@@ -0,0 +1,119 @@
+#pragma once
+
+#include "util.h"
+
+#include <assert.h>
+#include <cstddef>
+#include <type_traits>
+#include <vector>
+#include <cuda_runtime.h>
+
+namespace util
+{
+	//Where the memory of a MemorySpan lives. The copies below pick their cudaMemcpyKind from it at compile time, instead of
+	//asking the driver about the pointers on every copy.
+	enum class MemoryKind
+	{
+		Host,	//pageable, an async copy from or to it is staged by the driver and doesn't overlap with the host
+		Pinned,	//page-locked, cudaMallocHost or cudaHostRegister
+		Device,
+	};
+
+	//A pointer and a number of elements of T in memory of "Kind". It doesn't own the memory. A span of T converts to one of
+	//const T, not the other way around. DeviceArray, std::vector and the factories below make them.
+	template<typename T, MemoryKind Kind>
+	class MemorySpan
+	{
+	public:
+		MemorySpan() = default;
+		MemorySpan(T* data, size_t size)
+			: m_data(data)
+			, m_size(size)
+		{
+		}
+
+		template<typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+		MemorySpan(const MemorySpan<U, Kind>& span)
+			: m_data(span.data())
+			, m_size(span.size())
+		{
+		}
+
+		T* data() const { return m_data; }
+		size_t size() const { return m_size; }
+		size_t bytes() const { return m_size * sizeof(T); }
+
+		//"count" elements from "offset" on.
+		MemorySpan subspan(size_t offset, size_t count) const
+		{
+			assert(offset + count <= m_size);
+			return MemorySpan(m_data + offset, count);
+		}
+
+	private:
+		T* m_data{ nullptr };
+		size_t m_size{ 0 };
+	};
+
+	template<typename T>
+	using HostSpan = MemorySpan<T, MemoryKind::Host>;
+	template<typename T>
+	using PinnedSpan = MemorySpan<T, MemoryKind::Pinned>;
+	template<typename T>
+	using DeviceSpan = MemorySpan<T, MemoryKind::Device>;
+
+	template<typename T>
+	HostSpan<T> hostSpan(T* data, size_t size)
+	{
+		return HostSpan<T>(data, size);
+	}
+
+	template<typename T>
+	HostSpan<T> hostSpan(std::vector<T>& vector)
+	{
+		return HostSpan<T>(vector.data(), vector.size());
+	}
+
+	template<typename T>
+	HostSpan<const T> hostSpan(const std::vector<T>& vector)
+	{
+		return HostSpan<const T>(vector.data(), vector.size());
+	}
+
+	template<typename T>
+	PinnedSpan<T> pinnedSpan(T* data, size_t size)
+	{
+		return PinnedSpan<T>(data, size);
+	}
+
+	template<typename T>
+	DeviceSpan<T> deviceSpan(T* data, size_t size)
+	{
+		return DeviceSpan<T>(data, size);
+	}
+
+	constexpr cudaMemcpyKind getCopyKind(MemoryKind dst, MemoryKind src)
+	{
+		return dst == MemoryKind::Device ? (src == MemoryKind::Device ? cudaMemcpyDeviceToDevice : cudaMemcpyHostToDevice) :
+			(src == MemoryKind::Device ? cudaMemcpyDeviceToHost : cudaMemcpyHostToHost);
+	}
+
+	//Copies all of "src" to the start of "dst", which has to be at least as large.
+	template<typename T, MemoryKind DstKind, typename U, MemoryKind SrcKind>
+	void copy(const MemorySpan<T, DstKind>& dst, const MemorySpan<U, SrcKind>& src)
+	{
+		static_assert(std::is_same<typename std::remove_const<U>::type, T>::value, "Copies need the same element type and a mutable destination");
+		assert(dst.size() >= src.size());
+		CHECK_CUDA_ERROR(cudaMemcpy(dst.data(), src.data(), src.bytes(), getCopyKind(DstKind, SrcKind)));
+	}
+
+	//Same in the order of "stream". Pinned and device memory can be reused once the stream got past the copy, pageable host
+	//memory once the call returned for uploads, but only after a synchronization for readbacks.
+	template<typename T, MemoryKind DstKind, typename U, MemoryKind SrcKind>
+	void copyAsync(const MemorySpan<T, DstKind>& dst, const MemorySpan<U, SrcKind>& src, cudaStream_t stream)
+	{
+		static_assert(std::is_same<typename std::remove_const<U>::type, T>::value, "Copies need the same element type and a mutable destination");
+		assert(dst.size() >= src.size());
+		CHECK_CUDA_ERROR(cudaMemcpyAsync(dst.data(), src.data(), src.bytes(), getCopyKind(DstKind, SrcKind), stream));
+	}
+}
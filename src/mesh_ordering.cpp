@@ -0,0 +1,257 @@
+#include "mesh_ordering.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <set>
+#include <unordered_map>
+
+namespace util
+{
+	//Spreads the lower 10 bits of v to every third bit.
+	static uint32_t expandBits(uint32_t v)
+	{
+		v = (v * 0x00010001u) & 0xFF0000FFu;
+		v = (v * 0x00000101u) & 0x0F00F00Fu;
+		v = (v * 0x00000011u) & 0xC30C30C3u;
+		v = (v * 0x00000005u) & 0x49249249u;
+		return v;
+	}
+
+	std::vector<int> computeMortonOrder(const std::vector<glm::vec3>& positions)
+	{
+		glm::vec3 min_corner(0.0f);
+		glm::vec3 max_corner(0.0f);
+		if (!positions.empty())
+		{
+			min_corner = max_corner = positions[0];
+		}
+		for (const auto& position : positions)
+		{
+			min_corner = glm::min(min_corner, position);
+			max_corner = glm::max(max_corner, position);
+		}
+		const glm::vec3 extent = glm::max(max_corner - min_corner, glm::vec3(1e-12f));
+
+		std::vector<uint32_t> codes(positions.size());
+		for (size_t i = 0; i < positions.size(); ++i)
+		{
+			const glm::uvec3 cell(glm::clamp((positions[i] - min_corner) / extent * 1023.0f, 0.0f, 1023.0f));
+			codes[i] = (expandBits(cell.x) << 2) | (expandBits(cell.y) << 1) | expandBits(cell.z);
+		}
+
+		std::vector<int> order(positions.size());
+		for (size_t i = 0; i < order.size(); ++i)
+		{
+			order[i] = static_cast<int>(i);
+		}
+		std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return codes[a] < codes[b]; });
+		return order;
+	}
+
+	std::vector<std::vector<int>> clusterVertices(const std::vector<glm::vec3>& positions, const std::vector<unsigned int>& indices,
+		const std::vector<bool>& pinned, int n_levels)
+	{
+		const int number_of_vertices = static_cast<int>(positions.size());
+		double edge_length = 0.0;
+		for (size_t i = 0; i + 2 < indices.size(); i += 3)
+		{
+			for (int k = 0; k < 3; ++k)
+			{
+				edge_length += glm::length(positions[indices[i + k]] - positions[indices[i + (k + 1) % 3]]);
+			}
+		}
+		edge_length /= std::max<size_t>(indices.size(), 1);
+
+		glm::vec3 min_corner(0.0f);
+		if (!positions.empty())
+		{
+			min_corner = positions[0];
+		}
+		for (const auto& position : positions)
+		{
+			min_corner = glm::min(min_corner, position);
+		}
+
+		std::vector<std::vector<int>> levels;
+		std::vector<int> previous(number_of_vertices);
+		for (int v = 0; v < number_of_vertices; ++v)
+		{
+			previous[v] = v;
+		}
+		for (int level = 1; level <= n_levels; ++level)
+		{
+			const float cell_size = static_cast<float>(std::ldexp(edge_length, level));
+			auto get_cell = [&](int v)
+			{
+				const glm::vec3 cell = glm::floor((positions[v] - min_corner) / cell_size);
+				return (static_cast<uint64_t>(cell.x) << 42) | (static_cast<uint64_t>(cell.y) << 21) | static_cast<uint64_t>(cell.z);
+			};
+
+			//Cell -> the kept vertex of the previous level closest to its center.
+			std::unordered_map<uint64_t, int> cell_vertices;
+			for (int v = 0; v < number_of_vertices; ++v)
+			{
+				if (previous[v] != v)
+				{
+					continue;
+				}
+				const uint64_t cell = get_cell(v);
+				const glm::vec3 center = (glm::floor((positions[v] - min_corner) / cell_size) + 0.5f) * cell_size + min_corner;
+				auto it = cell_vertices.find(cell);
+				if (it == cell_vertices.end())
+				{
+					cell_vertices.emplace(cell, v);
+				}
+				else if (glm::length(positions[v] - center) < glm::length(positions[it->second] - center))
+				{
+					it->second = v;
+				}
+			}
+
+			std::vector<int> representatives(number_of_vertices);
+			for (int v = 0; v < number_of_vertices; ++v)
+			{
+				const int u = previous[v];
+				representatives[v] = pinned[u] ? u : cell_vertices[get_cell(u)];
+			}
+			levels.push_back(representatives);
+			previous = std::move(representatives);
+		}
+		return levels;
+	}
+
+	std::vector<unsigned int> collapseTriangles(const std::vector<unsigned int>& indices, const std::vector<int>& representatives)
+	{
+		std::set<std::array<unsigned int, 3>> seen;
+		std::vector<unsigned int> result;
+		for (size_t i = 0; i + 2 < indices.size(); i += 3)
+		{
+			std::array<unsigned int, 3> triangle{ static_cast<unsigned int>(representatives[indices[i]]),
+				static_cast<unsigned int>(representatives[indices[i + 1]]), static_cast<unsigned int>(representatives[indices[i + 2]]) };
+			if (triangle[0] == triangle[1] || triangle[1] == triangle[2] || triangle[0] == triangle[2])
+			{
+				continue;
+			}
+
+			//The rotation starting at the smallest id identifies the triangle, the winding is kept.
+			std::rotate(triangle.begin(), std::min_element(triangle.begin(), triangle.end()), triangle.end());
+			if (seen.insert(triangle).second)
+			{
+				result.insert(result.end(), triangle.begin(), triangle.end());
+			}
+		}
+		return result;
+	}
+
+	std::vector<unsigned int> tipsify(const std::vector<unsigned int>& indices, int number_of_vertices, int cache_size)
+	{
+		const int number_of_triangles = static_cast<int>(indices.size() / 3);
+		if (number_of_vertices == 0)
+		{
+			return indices;
+		}
+
+		//Vertex -> triangles in CSR layout.
+		std::vector<int> offsets(number_of_vertices + 1, 0);
+		for (auto index : indices)
+		{
+			offsets[index + 1]++;
+		}
+		for (int i = 0; i < number_of_vertices; ++i)
+		{
+			offsets[i + 1] += offsets[i];
+		}
+		std::vector<int> vertex_triangles(offsets.back());
+		std::vector<int> next(offsets.begin(), offsets.end() - 1);
+		for (int t = 0; t < number_of_triangles; ++t)
+		{
+			for (int k = 0; k < 3; ++k)
+			{
+				vertex_triangles[next[indices[3 * t + k]]++] = t;
+			}
+		}
+
+		std::vector<int> live_triangles(number_of_vertices);
+		for (int i = 0; i < number_of_vertices; ++i)
+		{
+			live_triangles[i] = offsets[i + 1] - offsets[i];
+		}
+		std::vector<int> cache_time(number_of_vertices, 0);
+		std::vector<bool> emitted(number_of_triangles, false);
+		std::vector<int> dead_end; //recently used vertices, the next fanning vertex if the candidates run out
+		std::vector<int> candidates;
+		std::vector<unsigned int> result;
+		result.reserve(indices.size());
+
+		int time = cache_size + 1;
+		int cursor = 0; //vertices before it have no live triangles
+		int fanning = 0;
+		while (fanning >= 0)
+		{
+			candidates.clear();
+			for (int j = offsets[fanning]; j < offsets[fanning + 1]; ++j)
+			{
+				const int t = vertex_triangles[j];
+				if (emitted[t])
+				{
+					continue;
+				}
+				for (int k = 0; k < 3; ++k)
+				{
+					const int v = indices[3 * t + k];
+					result.push_back(v);
+					dead_end.push_back(v);
+					candidates.push_back(v);
+					live_triangles[v]--;
+					if (time - cache_time[v] > cache_size)
+					{
+						cache_time[v] = time++;
+					}
+				}
+				emitted[t] = true;
+			}
+
+			//The candidate that is still in the cache after its remaining triangles are emitted, and has been in it the longest.
+			fanning = -1;
+			int best_priority = -1;
+			for (int v : candidates)
+			{
+				if (live_triangles[v] <= 0)
+				{
+					continue;
+				}
+				int priority = 0;
+				if (time - cache_time[v] + 2 * live_triangles[v] <= cache_size)
+				{
+					priority = time - cache_time[v];
+				}
+				if (priority > best_priority)
+				{
+					best_priority = priority;
+					fanning = v;
+				}
+			}
+
+			while (fanning < 0 && !dead_end.empty())
+			{
+				const int v = dead_end.back();
+				dead_end.pop_back();
+				if (live_triangles[v] > 0)
+				{
+					fanning = v;
+				}
+			}
+			while (fanning < 0 && cursor < number_of_vertices)
+			{
+				if (live_triangles[cursor] > 0)
+				{
+					fanning = cursor;
+				}
+				++cursor;
+			}
+		}
+		return result;
+	}
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <vector>
+
+namespace util
+{
+	//Vertex order along a 30 bit Morton curve over the bounding box of "positions": order[i] is the vertex placed at i.
+	//Vertices close in space get close ids, so the basis rows of neighbouring pixels are close in memory.
+	std::vector<int> computeMortonOrder(const std::vector<glm::vec3>& positions);
+
+	//Vertex clustering for n_levels coarser meshes. Level k keeps one vertex per cell of a grid with 2^k times the mean
+	//edge length, chosen among the vertices level k - 1 keeps (the one closest to the cell center), and every pinned vertex.
+	//result[k - 1][v] is the vertex level k replaces v with, kept vertices map to themselves.
+	std::vector<std::vector<int>> clusterVertices(const std::vector<glm::vec3>& positions, const std::vector<unsigned int>& indices,
+		const std::vector<bool>& pinned, int n_levels);
+
+	//Maps the triangles through "representatives" (see clusterVertices), drops the degenerate and duplicate ones.
+	std::vector<unsigned int> collapseTriangles(const std::vector<unsigned int>& indices, const std::vector<int>& representatives);
+
+	//Triangle order of Tipsify (Sander et al. 2007, "Fast Triangle Reordering for Vertex Locality and Reduced Overdraw")
+	//for a post-transform cache of cache_size vertices. Returns the reordered triangle list, the vertex ids are unchanged.
+	std::vector<unsigned int> tipsify(const std::vector<unsigned int>& indices, int number_of_vertices, int cache_size = 16);
+}
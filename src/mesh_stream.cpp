@@ -0,0 +1,129 @@
+#include "mesh_stream.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+bool readMeshPacket(std::istream& stream, std::vector<uint8_t>& packet)
+{
+	MeshPacketHeader header;
+	if (!stream.read(reinterpret_cast<char*>(&header), sizeof(header)))
+	{
+		return false;
+	}
+	if (std::memcmp(header.magic, "FMSH", 4) != 0)
+	{
+		throw std::runtime_error("Error: Lost the framing of the mesh stream!");
+	}
+
+	packet.resize(sizeof(header) + header.payload_size);
+	std::memcpy(packet.data(), &header, sizeof(header));
+	if (!stream.read(reinterpret_cast<char*>(packet.data() + sizeof(header)), header.payload_size))
+	{
+		throw std::runtime_error("Error: The mesh stream ends within a packet!");
+	}
+	return true;
+}
+
+bool MeshStreamDecoder::decode(const uint8_t* packet, size_t size)
+{
+	MeshPacketHeader header;
+	if (size < sizeof(header))
+	{
+		throw std::runtime_error("Error: The mesh packet is shorter than its header!");
+	}
+	std::memcpy(&header, packet, sizeof(header));
+	if (std::memcmp(header.magic, "FMSH", 4) != 0 || header.version != MeshPacketHeader().version)
+	{
+		throw std::runtime_error("Error: Not a mesh packet of version " + std::to_string(MeshPacketHeader().version));
+	}
+	if (size < sizeof(header) + header.payload_size)
+	{
+		throw std::runtime_error("Error: The mesh packet is truncated!");
+	}
+
+	const uint8_t* payload = packet + sizeof(header);
+	const uint8_t* end = payload + header.payload_size;
+	auto read = [&payload, end](void* target, size_t bytes)
+	{
+		if (payload + bytes > end)
+		{
+			throw std::runtime_error("Error: The payload of the mesh packet is too short!");
+		}
+		std::memcpy(target, payload, bytes);
+		payload += bytes;
+	};
+
+	const size_t num_values = 3 * static_cast<size_t>(header.num_vertices);
+	switch (header.type)
+	{
+	case MeshPacketType::Reference:
+	{
+		m_reference.resize(num_values);
+		read(m_reference.data(), num_values * sizeof(float));
+		uint32_t num_indices = 0;
+		read(&num_indices, sizeof(num_indices));
+		if (num_indices > static_cast<size_t>(end - payload) / sizeof(uint32_t))
+		{
+			throw std::runtime_error("Error: The payload of the mesh packet is too short!");
+		}
+		m_indices.resize(num_indices);
+		read(m_indices.data(), num_indices * sizeof(uint32_t));
+		m_original_vertex_ids.resize(header.num_vertices);
+		read(m_original_vertex_ids.data(), header.num_vertices * sizeof(int32_t));
+		if (std::any_of(m_indices.begin(), m_indices.end(), [&header](uint32_t index) { return index >= header.num_vertices; }))
+		{
+			throw std::runtime_error("Error: The mesh packet has indices past its vertices!");
+		}
+		m_positions = m_reference;
+		break;
+	}
+	case MeshPacketType::Delta:
+	{
+		if (m_reference.size() != num_values)
+		{
+			return false;
+		}
+		uint32_t num_changed = 0;
+		read(&num_changed, sizeof(num_changed));
+		std::vector<uint32_t> mask((header.num_vertices + 31) / 32);
+		read(mask.data(), mask.size() * sizeof(uint32_t));
+		std::vector<int16_t> deltas(3 * static_cast<size_t>(num_changed));
+		read(deltas.data(), deltas.size() * sizeof(int16_t));
+
+		m_positions = m_reference;
+		size_t next = 0;
+		for (uint32_t i = 0; i < header.num_vertices; ++i)
+		{
+			if ((mask[i / 32] >> (i % 32)) & 1)
+			{
+				if (next + 3 > deltas.size())
+				{
+					throw std::runtime_error("Error: The mask of the mesh packet has more vertices than deltas!");
+				}
+				for (int k = 0; k < 3; ++k)
+				{
+					m_positions[3 * i + k] += deltas[next++] * header.step;
+				}
+			}
+		}
+		break;
+	}
+	case MeshPacketType::Parameters:
+	{
+		uint32_t counts[2];
+		read(counts, sizeof(counts));
+		m_shape_coefficients.resize(counts[0]);
+		m_expression_coefficients.resize(counts[1]);
+		read(m_shape_coefficients.data(), counts[0] * sizeof(float));
+		read(m_expression_coefficients.data(), counts[1] * sizeof(float));
+		break;
+	}
+	default:
+		throw std::runtime_error("Error: Unknown mesh packet type " + std::to_string(static_cast<int>(header.type)));
+	}
+
+	m_header = header;
+	return true;
+}
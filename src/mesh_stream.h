@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstdint>
+#include <istream>
+#include <vector>
+
+//Packets of a mesh stream, see MeshStreamEncoder. Each one is a MeshPacketHeader followed by payload_size bytes, so a stream
+//of them is self-delimiting over a file, a pipe or a socket. Little endian, and this header has no dependencies besides the
+//standard library, so a viewer only needs mesh_stream.h/.cpp to decode it.
+enum class MeshPacketType : uint16_t
+{
+	//float positions[3 * num_vertices] of the neutral face, the reference of the following deltas. Then the topology of the
+	//mesh: uint32_t num_indices, uint32_t indices[num_indices] (triangles), and int32_t original_vertex_ids[num_vertices],
+	//the vertex of the model files each vertex is (the model is compacted at load time, see Face::compactModel).
+	Reference = 0,
+	//uint32_t num_changed, uint32_t mask[(num_vertices + 31) / 32], int16_t deltas[3 * num_changed]. Bit i of the mask
+	//(word i / 32, bit i % 32) is set for vertices whose quantized delta to the reference isn't zero, their deltas follow
+	//in vertex order. The position is reference + delta * step, the other vertices are at their reference position.
+	Delta = 1,
+	//uint32_t num_shape, uint32_t num_expression, then the shape and expression coefficients as floats. For viewers that
+	//have the morphable model, instead of the mesh.
+	Parameters = 2
+};
+
+#pragma pack(push, 1)
+struct MeshPacketHeader
+{
+	char magic[4]{ 'F', 'M', 'S', 'H' };
+	uint16_t version = 2;
+	MeshPacketType type = MeshPacketType::Reference;
+	uint32_t frame = 0;
+	uint32_t tracked = 0;
+	uint32_t num_vertices = 0;
+	uint32_t payload_size = 0; //bytes after the header
+	float step = 0.0f; //of the deltas
+	float rotation[3]{}; //Euler angles of the pose, see Face::computeModelMatrix
+	float translation[3]{};
+};
+#pragma pack(pop)
+
+//Reads the next packet of "stream" into "packet", header included. False at the end of the stream.
+bool readMeshPacket(std::istream& stream, std::vector<uint8_t>& packet);
+
+//Rebuilds the mesh of every frame from Reference and Delta packets, or the coefficients from Parameters packets.
+class MeshStreamDecoder
+{
+public:
+	//False for a packet it can't decode yet: a delta before the first reference, e.g. when joining a stream. The next
+	//reference follows within the keyframe interval of the encoder. Throws for malformed packets.
+	bool decode(const uint8_t* packet, size_t size);
+
+	const MeshPacketHeader& getHeader() const { return m_header; } //of the last decoded packet
+	const std::vector<float>& getPositions() const { return m_positions; } //3 per vertex, model space
+	//Of the last reference packet.
+	const std::vector<uint32_t>& getIndices() const { return m_indices; }
+	const std::vector<int32_t>& getOriginalVertexIds() const { return m_original_vertex_ids; }
+	const std::vector<float>& getShapeCoefficients() const { return m_shape_coefficients; }
+	const std::vector<float>& getExpressionCoefficients() const { return m_expression_coefficients; }
+
+private:
+	MeshPacketHeader m_header;
+	std::vector<float> m_reference;
+	std::vector<float> m_positions;
+	std::vector<uint32_t> m_indices;
+	std::vector<int32_t> m_original_vertex_ids;
+	std::vector<float> m_shape_coefficients;
+	std::vector<float> m_expression_coefficients;
+};
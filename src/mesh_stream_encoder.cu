@@ -0,0 +1,233 @@
+#include "mesh_stream_encoder.h"
+#include "face.h"
+#include "device_util.h"
+#include "util.h"
+
+#include <algorithm>
+#include <cstring>
+
+constexpr int kMeshStreamThreads = 256; //a multiple of the warp size, the mask has one word per warp
+
+//Quantizes the delta of every vertex to its reference and sets its bit in the mask if it isn't zero. Counts the changed
+//vertices of every block.
+__global__ void quantizeMeshDeltaKernel(int nVertices, const glm::vec3* __restrict__ current, const glm::vec3* __restrict__ reference,
+	float inv_step, int16_t* __restrict__ quantized, uint32_t* __restrict__ mask, int* __restrict__ block_counts)
+{
+	const int i = blockIdx.x * blockDim.x + threadIdx.x;
+	bool changed = false;
+	if (i < nVertices)
+	{
+		const glm::vec3 delta = (current[i] - reference[i]) * inv_step;
+		for (int k = 0; k < 3; ++k)
+		{
+			const int16_t value = static_cast<int16_t>(fmaxf(-32767.0f, fminf(32767.0f, rintf(delta[k]))));
+			quantized[3 * i + k] = value;
+			changed |= value != 0;
+		}
+	}
+
+	const uint32_t ballot = __ballot_sync(0xffffffff, changed);
+	if ((threadIdx.x & 31) == 0 && i < nVertices)
+	{
+		mask[i / 32] = ballot;
+	}
+	const int count = __syncthreads_count(changed);
+	if (threadIdx.x == 0)
+	{
+		block_counts[blockIdx.x] = count;
+	}
+}
+
+//Exclusive scan of the block counts in place, the total goes to counts[nBlocks]. A few hundred blocks, one thread is enough.
+__global__ void scanMeshBlocksKernel(int nBlocks, int* __restrict__ counts)
+{
+	int sum = 0;
+	for (int b = 0; b < nBlocks; ++b)
+	{
+		const int count = counts[b];
+		counts[b] = sum;
+		sum += count;
+	}
+	counts[nBlocks] = sum;
+}
+
+//Writes the deltas of the changed vertices in vertex order, at the offset of the block plus the changed vertices before them.
+__global__ void compactMeshDeltaKernel(int nVertices, const int16_t* __restrict__ quantized, const uint32_t* __restrict__ mask,
+	const int* __restrict__ block_offsets, int16_t* __restrict__ deltas)
+{
+	__shared__ int warp_counts[kMeshStreamThreads / 32];
+
+	const int i = blockIdx.x * blockDim.x + threadIdx.x;
+	const int lane = threadIdx.x & 31;
+	const int warp = threadIdx.x / 32;
+	const int warp_first = i - lane;
+	const uint32_t bits = warp_first < nVertices ? mask[warp_first / 32] : 0;
+	if (lane == 0)
+	{
+		warp_counts[warp] = __popc(bits);
+	}
+	__syncthreads();
+
+	if (!((bits >> lane) & 1))
+	{
+		return;
+	}
+	int offset = block_offsets[blockIdx.x] + __popc(bits & ((1u << lane) - 1));
+	for (int w = 0; w < warp; ++w)
+	{
+		offset += warp_counts[w];
+	}
+	for (int k = 0; k < 3; ++k)
+	{
+		deltas[3 * offset + k] = quantized[3 * i + k];
+	}
+}
+
+MeshStreamEncoder::MeshStreamEncoder(MeshStreamMode mode, float precision, int keyframe_interval)
+	: m_mode(mode)
+	, m_precision(precision)
+	, m_keyframe_interval(std::max(keyframe_interval, 1))
+{
+}
+
+MeshStreamEncoder::~MeshStreamEncoder()
+{
+	if (m_payload_host)
+	{
+		CHECK_CUDA_ERROR(cudaFreeHost(m_payload_host));
+	}
+}
+
+static std::vector<uint8_t>& appendPacket(std::vector<std::vector<uint8_t>>& packets, MeshPacketHeader header, MeshPacketType type, size_t payload_size)
+{
+	header.type = type;
+	header.payload_size = static_cast<uint32_t>(payload_size);
+	packets.emplace_back(sizeof(header) + payload_size);
+	std::memcpy(packets.back().data(), &header, sizeof(header));
+	return packets.back();
+}
+
+const std::vector<std::vector<uint8_t>>& MeshStreamEncoder::encode(Face& face, bool tracked)
+{
+	m_packets.clear();
+
+	MeshPacketHeader header;
+	header.frame = m_next_frame++;
+	header.tracked = tracked ? 1 : 0;
+	std::memcpy(header.rotation, &face.getRotationCoefficients()[0], sizeof(header.rotation));
+	std::memcpy(header.translation, &face.getTranslationCoefficients()[0], sizeof(header.translation));
+
+	if (m_mode == MeshStreamMode::Parameters)
+	{
+		appendParameters(face, header);
+		return m_packets;
+	}
+
+	header.num_vertices = face.getNumberOfVertices();
+	if (face.getNeutralFaceVersion() != m_reference_version || face.getLevelOfDetail() != m_reference_level_of_detail
+		|| header.num_vertices != m_reference_vertices || m_frames_since_reference < 0 || m_frames_since_reference >= m_keyframe_interval)
+	{
+		appendReference(face, header);
+	}
+	appendDelta(face, header);
+	m_frames_since_reference++;
+	return m_packets;
+}
+
+void MeshStreamEncoder::appendReference(Face& face, const MeshPacketHeader& frame_header)
+{
+	const uint32_t n = frame_header.num_vertices;
+	const auto& indices = face.getMesh().indices;
+	const auto& original_vertex_ids = face.getModel()->original_vertex_ids;
+	const uint32_t num_indices = static_cast<uint32_t>(indices.size());
+	auto& packet = appendPacket(m_packets, frame_header, MeshPacketType::Reference,
+		3 * n * sizeof(float) + sizeof(uint32_t) + num_indices * sizeof(uint32_t) + n * sizeof(int32_t));
+	auto* positions = reinterpret_cast<float*>(packet.data() + sizeof(MeshPacketHeader));
+	CHECK_CUDA_ERROR(cudaMemcpyAsync(positions, face.getNeutralFaceGpu(), n * sizeof(glm::vec3), cudaMemcpyDeviceToHost, face.getStream()));
+
+	//The topology, while the copy runs. A level of detail uses the first n vertices of the model.
+	uint8_t* topology = reinterpret_cast<uint8_t*>(positions + 3 * n);
+	std::memcpy(topology, &num_indices, sizeof(num_indices));
+	std::memcpy(topology + sizeof(num_indices), indices.data(), num_indices * sizeof(uint32_t));
+	std::memcpy(topology + sizeof(num_indices) + num_indices * sizeof(uint32_t), original_vertex_ids.data(), n * sizeof(int32_t));
+	CHECK_CUDA_ERROR(cudaStreamSynchronize(face.getStream()));
+
+	//The step follows the size of the face, so the precision doesn't depend on the units of the model.
+	float min_corner[3] = { positions[0], positions[1], positions[2] };
+	float max_corner[3] = { positions[0], positions[1], positions[2] };
+	for (uint32_t i = 0; i < n; ++i)
+	{
+		for (int k = 0; k < 3; ++k)
+		{
+			min_corner[k] = std::min(min_corner[k], positions[3 * i + k]);
+			max_corner[k] = std::max(max_corner[k], positions[3 * i + k]);
+		}
+	}
+	const float extent = std::max({ max_corner[0] - min_corner[0], max_corner[1] - min_corner[1], max_corner[2] - min_corner[2], 1.0e-6f });
+	m_step = m_precision * extent;
+	reinterpret_cast<MeshPacketHeader*>(packet.data())->step = m_step;
+
+	m_reference_version = face.getNeutralFaceVersion();
+	m_reference_level_of_detail = face.getLevelOfDetail();
+	m_reference_vertices = n;
+	m_frames_since_reference = 0;
+}
+
+void MeshStreamEncoder::appendDelta(Face& face, const MeshPacketHeader& frame_header)
+{
+	const int n = static_cast<int>(frame_header.num_vertices);
+	const int num_blocks = (n + kMeshStreamThreads - 1) / kMeshStreamThreads;
+	const int mask_words = (n + 31) / 32;
+	const cudaStream_t stream = face.getStream();
+	{
+		util::ScopedAllocationTag tag("mesh stream");
+		util::ensureSize(m_quantized, 3 * n);
+		util::ensureSize(m_mask, mask_words);
+		util::ensureSize(m_block_offsets, num_blocks + 1);
+		util::ensureSize(m_deltas, 3 * n);
+	}
+	const size_t capacity = sizeof(uint32_t) + mask_words * sizeof(uint32_t) + 3 * n * sizeof(int16_t);
+	if (m_payload_capacity < capacity)
+	{
+		if (m_payload_host)
+		{
+			CHECK_CUDA_ERROR(cudaFreeHost(m_payload_host));
+		}
+		CHECK_CUDA_ERROR(cudaMallocHost(&m_payload_host, capacity));
+		m_payload_capacity = capacity;
+	}
+
+	quantizeMeshDeltaKernel<<<num_blocks, kMeshStreamThreads, 0, stream>>>(n, face.getCurrentFaceGpu(), face.getNeutralFaceGpu(),
+		1.0f / m_step, m_quantized.getPtr(), m_mask.getPtr(), m_block_offsets.getPtr());
+	scanMeshBlocksKernel<<<1, 1, 0, stream>>>(num_blocks, m_block_offsets.getPtr());
+	compactMeshDeltaKernel<<<num_blocks, kMeshStreamThreads, 0, stream>>>(n, m_quantized.getPtr(), m_mask.getPtr(),
+		m_block_offsets.getPtr(), m_deltas.getPtr());
+
+	//The count and the mask first, then only as many deltas as there are.
+	auto* num_changed = reinterpret_cast<uint32_t*>(m_payload_host);
+	auto* mask = num_changed + 1;
+	auto* deltas = reinterpret_cast<int16_t*>(mask + mask_words);
+	CHECK_CUDA_ERROR(cudaMemcpyAsync(num_changed, m_block_offsets.getPtr() + num_blocks, sizeof(uint32_t), cudaMemcpyDeviceToHost, stream));
+	CHECK_CUDA_ERROR(cudaMemcpyAsync(mask, m_mask.getPtr(), mask_words * sizeof(uint32_t), cudaMemcpyDeviceToHost, stream));
+	CHECK_CUDA_ERROR(cudaStreamSynchronize(stream));
+	CHECK_CUDA_ERROR(cudaMemcpyAsync(deltas, m_deltas.getPtr(), 3 * *num_changed * sizeof(int16_t), cudaMemcpyDeviceToHost, stream));
+	CHECK_CUDA_ERROR(cudaStreamSynchronize(stream));
+
+	const size_t payload_size = sizeof(uint32_t) + mask_words * sizeof(uint32_t) + 3 * *num_changed * sizeof(int16_t);
+	MeshPacketHeader header = frame_header;
+	header.step = m_step;
+	auto& packet = appendPacket(m_packets, header, MeshPacketType::Delta, payload_size);
+	std::memcpy(packet.data() + sizeof(MeshPacketHeader), m_payload_host, payload_size);
+}
+
+void MeshStreamEncoder::appendParameters(const Face& face, const MeshPacketHeader& frame_header)
+{
+	const auto& shape = face.getShapeCoefficients();
+	const auto& expression = face.getExpressionCoefficients();
+	const uint32_t counts[2] = { static_cast<uint32_t>(shape.size()), static_cast<uint32_t>(expression.size()) };
+	auto& packet = appendPacket(m_packets, frame_header, MeshPacketType::Parameters, sizeof(counts) + (shape.size() + expression.size()) * sizeof(float));
+	uint8_t* payload = packet.data() + sizeof(MeshPacketHeader);
+	std::memcpy(payload, counts, sizeof(counts));
+	std::memcpy(payload + sizeof(counts), shape.data(), shape.size() * sizeof(float));
+	std::memcpy(payload + sizeof(counts) + shape.size() * sizeof(float), expression.data(), expression.size() * sizeof(float));
+}
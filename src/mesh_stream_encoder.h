@@ -0,0 +1,66 @@
+#pragma once
+
+#include "mesh_stream.h"
+#include "device_array.h"
+
+#include <cstdint>
+#include <vector>
+#include <cuda_runtime.h>
+
+class Face;
+
+enum class MeshStreamMode
+{
+	Mesh, //Reference and Delta packets
+	Parameters //Parameters packets
+};
+
+//Encodes the fitted face of every frame into one packet of a mesh stream (see mesh_stream.h), for remote viewers. The mesh is
+//quantized against the neutral face on the device: the deltas are rounded to a fixed step, vertices which don't move
+//compared to the neutral face (often most of them, expressions are local) cost one bit, the others 6 bytes. Only the packed
+//payload is read back. A reference packet, with the triangles of the level of detail, is sent first, whenever the neutral
+//face (see Face::getNeutralFaceVersion) or the level of detail changes, and every keyframe_interval frames for viewers
+//that join later.
+class MeshStreamEncoder
+{
+public:
+	static constexpr float kDefaultPrecision = 1.0e-4f;
+	static constexpr int kDefaultKeyframeInterval = 300;
+
+	//"precision" is the quantization step relative to the largest extent of the neutral face.
+	explicit MeshStreamEncoder(MeshStreamMode mode = MeshStreamMode::Mesh, float precision = kDefaultPrecision,
+		int keyframe_interval = kDefaultKeyframeInterval);
+	MeshStreamEncoder(const MeshStreamEncoder&) = delete;
+	MeshStreamEncoder& operator=(const MeshStreamEncoder&) = delete;
+	~MeshStreamEncoder();
+
+	//Packets of the frame, in order: a reference packet if one is due, then the frame itself. Valid until the next encode.
+	//Runs on the stream of the face and waits for the readback.
+	const std::vector<std::vector<uint8_t>>& encode(Face& face, bool tracked);
+
+private:
+	MeshStreamMode m_mode;
+	float m_precision;
+	int m_keyframe_interval;
+	uint32_t m_next_frame{ 0 };
+	int m_frames_since_reference{ -1 }; //-1: no reference sent yet
+
+	//Of the last reference packet.
+	uint64_t m_reference_version{ 0 };
+	int m_reference_level_of_detail{ -1 };
+	uint32_t m_reference_vertices{ 0 };
+	float m_step{ 0.0f };
+
+	util::DeviceArray<int16_t> m_quantized; //3 per vertex
+	util::DeviceArray<uint32_t> m_mask;
+	util::DeviceArray<int> m_block_offsets; //one per block, the last entry is the number of changed vertices
+	util::DeviceArray<int16_t> m_deltas; //of the changed vertices, compacted
+	uint8_t* m_payload_host{ nullptr }; //pinned
+	size_t m_payload_capacity{ 0 };
+
+	std::vector<std::vector<uint8_t>> m_packets;
+
+	void appendReference(Face& face, const MeshPacketHeader& frame_header);
+	void appendDelta(Face& face, const MeshPacketHeader& frame_header);
+	void appendParameters(const Face& face, const MeshPacketHeader& frame_header);
+};
@@ -0,0 +1,332 @@
+#include "metrics.h"
+#include "telemetry.h"
+#include "thread_placement.h"
+
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "Ws2_32.lib")
+#else
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+namespace util
+{
+	Histogram::Histogram(std::vector<double> bounds)
+		: m_bounds(std::move(bounds))
+		, m_counts(new std::atomic<uint64_t>[m_bounds.size() + 1])
+	{
+		for (size_t i = 0; i <= m_bounds.size(); ++i)
+		{
+			m_counts[i].store(0, std::memory_order_relaxed);
+		}
+	}
+
+	void Histogram::observe(double value)
+	{
+		const size_t bucket = std::lower_bound(m_bounds.begin(), m_bounds.end(), value) - m_bounds.begin();
+		m_counts[bucket].fetch_add(1, std::memory_order_relaxed);
+		m_count.fetch_add(1, std::memory_order_relaxed);
+
+		double sum = m_sum.load(std::memory_order_relaxed);
+		while (!m_sum.compare_exchange_weak(sum, sum + value, std::memory_order_relaxed))
+		{
+		}
+	}
+
+	Metrics& Metrics::get()
+	{
+		static Metrics metrics;
+		return metrics;
+	}
+
+	const std::vector<double>& Metrics::getLatencyBounds()
+	{
+		static const std::vector<double> bounds = []()
+		{
+			std::vector<double> result;
+			for (double bound = 0.125; bound <= 1000.0; bound *= 2.0)
+			{
+				result.push_back(bound);
+			}
+			return result;
+		}();
+		return bounds;
+	}
+
+	Metrics::Entry& Metrics::getEntry(const std::string& name, const std::string& help, const std::string& labels, Type type)
+	{
+		auto& entry = m_entries[name + "{" + labels + "}"];
+		if (entry.name.empty())
+		{
+			entry.name = name;
+			entry.help = help;
+			entry.labels = labels;
+			entry.type = type;
+		}
+		else if (entry.type != type)
+		{
+			throw std::runtime_error("Error: The metric " + name + " was registered with another type!");
+		}
+		return entry;
+	}
+
+	Counter& Metrics::counter(const std::string& name, const std::string& help, const std::string& labels)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto& entry = getEntry(name, help, labels, Type::Counter);
+		if (!entry.counter)
+		{
+			entry.counter = std::make_unique<Counter>();
+		}
+		return *entry.counter;
+	}
+
+	Gauge& Metrics::gauge(const std::string& name, const std::string& help, const std::string& labels)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto& entry = getEntry(name, help, labels, Type::Gauge);
+		if (!entry.gauge)
+		{
+			entry.gauge = std::make_unique<Gauge>();
+		}
+		return *entry.gauge;
+	}
+
+	Histogram& Metrics::histogram(const std::string& name, const std::string& help, const std::string& labels, const std::vector<double>& bounds)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto& entry = getEntry(name, help, labels, Type::Histogram);
+		if (!entry.histogram)
+		{
+			entry.histogram = std::make_unique<Histogram>(bounds);
+		}
+		return *entry.histogram;
+	}
+
+	//name{labels,extra} or name{labels} or name
+	static std::string getSeries(const std::string& name, const std::string& labels, const std::string& extra = "")
+	{
+		if (labels.empty() && extra.empty())
+		{
+			return name;
+		}
+		return name + "{" + labels + (labels.empty() || extra.empty() ? "" : ",") + extra + "}";
+	}
+
+	void Metrics::writePrometheus(std::ostream& stream) const
+	{
+		static const char* const kTypeNames[] = { "counter", "gauge", "histogram" };
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		const std::string* previous_name = nullptr;
+		for (const auto& item : m_entries)
+		{
+			const auto& entry = item.second;
+			if (!previous_name || *previous_name != entry.name)
+			{
+				stream << "# HELP " << entry.name << " " << entry.help << "\n";
+				stream << "# TYPE " << entry.name << " " << kTypeNames[static_cast<int>(entry.type)] << "\n";
+				previous_name = &entry.name;
+			}
+
+			switch (entry.type)
+			{
+			case Type::Counter:
+				stream << getSeries(entry.name, entry.labels) << " " << entry.counter->get() << "\n";
+				break;
+			case Type::Gauge:
+				stream << getSeries(entry.name, entry.labels) << " " << entry.gauge->get() << "\n";
+				break;
+			case Type::Histogram:
+			{
+				const auto& histogram = *entry.histogram;
+				const auto& bounds = histogram.getBounds();
+				uint64_t cumulative = 0;
+				for (size_t i = 0; i <= bounds.size(); ++i)
+				{
+					cumulative += histogram.getCount(i);
+					std::ostringstream bound;
+					if (i < bounds.size())
+					{
+						bound << bounds[i];
+					}
+					else
+					{
+						bound << "+Inf";
+					}
+					stream << getSeries(entry.name + "_bucket", entry.labels, "le=\"" + bound.str() + "\"") << " " << cumulative << "\n";
+				}
+				//The buckets are read one by one while observations go on, so the count is that of the buckets.
+				stream << getSeries(entry.name + "_sum", entry.labels) << " " << histogram.getSum() << "\n";
+				stream << getSeries(entry.name + "_count", entry.labels) << " " << cumulative << "\n";
+				break;
+			}
+			}
+		}
+	}
+
+#ifdef _WIN32
+	using Socket = SOCKET;
+	static void closeSocket(Socket socket) { closesocket(socket); }
+#else
+	using Socket = int;
+	constexpr Socket INVALID_SOCKET = -1;
+	static void closeSocket(Socket socket) { close(socket); }
+#endif
+
+	MetricsServer::MetricsServer(int port, const TelemetrySampler* telemetry)
+		: m_telemetry(telemetry)
+	{
+#ifdef _WIN32
+		WSADATA wsa_data;
+		if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0)
+		{
+			throw std::runtime_error("Error: Could not initialize Winsock!");
+		}
+#endif
+
+		Socket server = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (server == INVALID_SOCKET)
+		{
+			throw std::runtime_error("Error: Could not create the socket of the metrics endpoint!");
+		}
+
+		int reuse = 1;
+		setsockopt(server, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&reuse), sizeof(reuse));
+
+		sockaddr_in address = {};
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_ANY);
+		address.sin_port = htons(static_cast<unsigned short>(port));
+		if (bind(server, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0 || listen(server, 8) != 0)
+		{
+			closeSocket(server);
+			throw std::runtime_error("Error: Could not listen on port " + std::to_string(port) + " for the metrics endpoint!");
+		}
+
+		m_socket = static_cast<intptr_t>(server);
+		m_thread = std::thread(&MetricsServer::run, this);
+		std::cout << "Metrics on http://localhost:" << port << "/metrics" << std::endl;
+	}
+
+	MetricsServer::~MetricsServer()
+	{
+		m_stop = true;
+		m_thread.join();
+		closeSocket(static_cast<Socket>(m_socket));
+#ifdef _WIN32
+		WSACleanup();
+#endif
+	}
+
+	void MetricsServer::run()
+	{
+		ThreadPlacement::get().apply(ThreadStage::Service);
+		const auto server = static_cast<Socket>(m_socket);
+		while (!m_stop)
+		{
+			//Wakes up now and then to notice a stop.
+			fd_set sockets;
+			FD_ZERO(&sockets);
+			FD_SET(server, &sockets);
+			timeval timeout = { 0, 200000 };
+			if (select(static_cast<int>(server) + 1, &sockets, nullptr, nullptr, &timeout) <= 0)
+			{
+				continue;
+			}
+
+			Socket client = accept(server, nullptr, nullptr);
+			if (client == INVALID_SOCKET)
+			{
+				continue;
+			}
+
+			//One request per connection, a scraper which stalls doesn't hold the endpoint for long.
+#ifdef _WIN32
+			DWORD receive_timeout = 1000;
+#else
+			timeval receive_timeout = { 1, 0 };
+#endif
+			setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>(&receive_timeout), sizeof(receive_timeout));
+
+			std::string request;
+			char buffer[1024];
+			while (request.size() < 8192 && request.find("\r\n\r\n") == std::string::npos)
+			{
+				const int received = recv(client, buffer, sizeof(buffer), 0);
+				if (received <= 0)
+				{
+					break;
+				}
+				request.append(buffer, received);
+			}
+
+			const std::string response = getResponse(request);
+			size_t sent = 0;
+			while (sent < response.size())
+			{
+				const int result = send(client, response.data() + sent, static_cast<int>(response.size() - sent), 0);
+				if (result <= 0)
+				{
+					break;
+				}
+				sent += result;
+			}
+			closeSocket(client);
+		}
+	}
+
+	std::string MetricsServer::getResponse(const std::string& request) const
+	{
+		if (request.compare(0, 13, "GET /metrics ") != 0 && request.compare(0, 6, "GET / ") != 0)
+		{
+			return "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+		}
+
+		std::ostringstream body;
+		Metrics::get().writePrometheus(body);
+		if (m_telemetry)
+		{
+			const auto telemetry = m_telemetry->getLatest();
+			auto gauge = [&body](const char* name, const char* help, double value)
+			{
+				body << "# HELP " << name << " " << help << "\n# TYPE " << name << " gauge\n" << name << " " << value << "\n";
+			};
+			gauge("gpu_memory_free_bytes", "Free device memory.", static_cast<double>(telemetry.free_bytes));
+			gauge("gpu_memory_total_bytes", "Device memory.", static_cast<double>(telemetry.total_bytes));
+			if (telemetry.has_nvml)
+			{
+				gauge("gpu_utilization_percent", "Time with a kernel running over the last sample period.", telemetry.gpu_utilization);
+				gauge("gpu_sm_clock_mhz", "SM clock.", telemetry.sm_clock_mhz);
+				gauge("gpu_temperature_celsius", "GPU temperature.", telemetry.temperature_c);
+				gauge("gpu_power_watts", "Power draw.", telemetry.power_mw / 1000.0);
+			}
+
+			body << "# HELP device_allocator_bytes_in_use Device memory handed out by an allocator.\n# TYPE device_allocator_bytes_in_use gauge\n";
+			for (const auto& allocator : telemetry.allocators)
+			{
+				body << "device_allocator_bytes_in_use{allocator=\"" << allocator.first << "\"} " << allocator.second.bytes_in_use << "\n";
+			}
+			body << "# HELP device_allocator_bytes_reserved Device memory reserved from the driver by an allocator.\n# TYPE device_allocator_bytes_reserved gauge\n";
+			for (const auto& allocator : telemetry.allocators)
+			{
+				body << "device_allocator_bytes_reserved{allocator=\"" << allocator.first << "\"} " << allocator.second.bytes_reserved << "\n";
+			}
+		}
+
+		const std::string content = body.str();
+		return "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " + std::to_string(content.size())
+			+ "\r\nConnection: close\r\n\r\n" + content;
+	}
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace util
+{
+	class TelemetrySampler;
+
+	//Monotonic count, add() is one relaxed atomic increment.
+	class Counter
+	{
+	public:
+		void add(uint64_t n = 1) { m_value.fetch_add(n, std::memory_order_relaxed); }
+		uint64_t get() const { return m_value.load(std::memory_order_relaxed); }
+
+	private:
+		std::atomic<uint64_t> m_value{ 0 };
+	};
+
+	//The last value set.
+	class Gauge
+	{
+	public:
+		void set(double value) { m_value.store(value, std::memory_order_relaxed); }
+		double get() const { return m_value.load(std::memory_order_relaxed); }
+
+	private:
+		std::atomic<double> m_value{ 0.0 };
+	};
+
+	//Counts of observations per bucket, "bounds" are the inclusive upper bounds in ascending order. observe() searches the
+	//bucket and takes three relaxed atomic adds, the cumulative counts are only built when the histogram is exported.
+	class Histogram
+	{
+	public:
+		explicit Histogram(std::vector<double> bounds);
+
+		void observe(double value);
+
+		const std::vector<double>& getBounds() const { return m_bounds; }
+		//Of bucket i, not cumulative. Entry getBounds().size() is the +Inf bucket.
+		uint64_t getCount(size_t i) const { return m_counts[i].load(std::memory_order_relaxed); }
+		uint64_t getCount() const { return m_count.load(std::memory_order_relaxed); }
+		double getSum() const { return m_sum.load(std::memory_order_relaxed); }
+
+	private:
+		std::vector<double> m_bounds;
+		std::unique_ptr<std::atomic<uint64_t>[]> m_counts;
+		std::atomic<uint64_t> m_count{ 0 };
+		std::atomic<double> m_sum{ 0.0 };
+	};
+
+	//Named metrics of the process. Looking one up takes a lock, so callers do it once and keep the reference, which stays
+	//valid for the lifetime of the process. Updating a metric is lock free.
+	class Metrics
+	{
+	public:
+		static Metrics& get();
+
+		//"labels" in the syntax of the exposition format without the braces, e.g. session="0". Metrics of the same name
+		//must have the same type and "help".
+		Counter& counter(const std::string& name, const std::string& help, const std::string& labels = "");
+		Gauge& gauge(const std::string& name, const std::string& help, const std::string& labels = "");
+		Histogram& histogram(const std::string& name, const std::string& help, const std::string& labels = "",
+			const std::vector<double>& bounds = getLatencyBounds());
+
+		//Powers of two from 0.125 ms to 512 ms.
+		static const std::vector<double>& getLatencyBounds();
+
+		//Prometheus text exposition format 0.0.4.
+		void writePrometheus(std::ostream& stream) const;
+
+	private:
+		enum class Type
+		{
+			Counter,
+			Gauge,
+			Histogram,
+		};
+
+		struct Entry
+		{
+			std::string name;
+			std::string help;
+			std::string labels;
+			Type type;
+			std::unique_ptr<Counter> counter;
+			std::unique_ptr<Gauge> gauge;
+			std::unique_ptr<Histogram> histogram;
+		};
+
+		Entry& getEntry(const std::string& name, const std::string& help, const std::string& labels, Type type);
+
+	private:
+		mutable std::mutex m_mutex;
+		std::map<std::string, Entry> m_entries; //by name and labels, so the entries of a name are adjacent
+
+	private:
+		Metrics() = default;
+		Metrics(const Metrics&) = delete;
+		Metrics(Metrics&&) = delete;
+	};
+
+	//Serves Metrics::get() to Prometheus on http://<host>:<port>/metrics from a thread of its own, so the aggregation of the
+	//exposition happens off the hot path. With a TelemetrySampler its latest sample is exported as gauges as well.
+	class MetricsServer
+	{
+	public:
+		explicit MetricsServer(int port, const TelemetrySampler* telemetry = nullptr);
+		MetricsServer(const MetricsServer&) = delete;
+		MetricsServer& operator=(const MetricsServer&) = delete;
+		~MetricsServer();
+
+	private:
+		void run();
+		std::string getResponse(const std::string& request) const;
+
+	private:
+		const TelemetrySampler* m_telemetry;
+		intptr_t m_socket; //SOCKET on Windows, a file descriptor elsewhere
+		std::atomic<bool> m_stop{ false };
+		std::thread m_thread;
+	};
+}
@@ -0,0 +1,73 @@
+#include "nvdec_video_source.h"
+
+#include <stdexcept>
+
+#if defined(__has_include)
+#if __has_include(<opencv2/cudacodec.hpp>)
+#include <opencv2/cudacodec.hpp>
+#include <opencv2/core/cuda.hpp>
+#define HAS_CUDACODEC 1
+#endif
+#endif
+
+namespace util
+{
+#ifdef HAS_CUDACODEC
+	struct NvdecVideoSource::Decoder
+	{
+		cv::Ptr<cv::cudacodec::VideoReader> reader;
+		cv::cuda::GpuMat frame;
+	};
+
+	bool NvdecVideoSource::isAvailable()
+	{
+		return cv::cuda::getCudaEnabledDeviceCount() > 0;
+	}
+
+	NvdecVideoSource::NvdecVideoSource(const std::string& filepath)
+		: m_decoder(std::make_unique<Decoder>())
+	{
+		m_decoder->reader = cv::cudacodec::createVideoReader(filepath);
+		if (!m_decoder->reader)
+		{
+			throw std::runtime_error("Error: NVDEC could not open " + filepath);
+		}
+	}
+
+	NvdecVideoSource::~NvdecVideoSource() = default;
+
+	bool NvdecVideoSource::read(const uchar*& device_frame, size_t& pitch, int& channels)
+	{
+		auto& frame = m_decoder->frame;
+		if (!m_decoder->reader->nextFrame(frame))
+		{
+			return false;
+		}
+		device_frame = frame.data;
+		pitch = frame.step;
+		channels = frame.channels();
+		return true;
+	}
+#else
+	struct NvdecVideoSource::Decoder
+	{
+	};
+
+	bool NvdecVideoSource::isAvailable()
+	{
+		return false;
+	}
+
+	NvdecVideoSource::NvdecVideoSource(const std::string& filepath)
+	{
+		throw std::runtime_error("Error: Built without OpenCV cudacodec, NVDEC is not available!");
+	}
+
+	NvdecVideoSource::~NvdecVideoSource() = default;
+
+	bool NvdecVideoSource::read(const uchar*& device_frame, size_t& pitch, int& channels)
+	{
+		return false;
+	}
+#endif
+}
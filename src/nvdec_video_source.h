@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include "opencv2/core/core.hpp"
+
+namespace util
+{
+	//Decodes a video with NVDEC (cv::cudacodec) into device memory, so the frames don't go through the host. Feed them to
+	//Pyramid::uploadFrame(device_frame, ...). Only available if OpenCV is built with cudacodec, see isAvailable.
+	class NvdecVideoSource
+	{
+	public:
+		static bool isAvailable();
+
+		explicit NvdecVideoSource(const std::string& filepath);
+		~NvdecVideoSource();
+
+		NvdecVideoSource(const NvdecVideoSource&) = delete;
+		NvdecVideoSource& operator=(const NvdecVideoSource&) = delete;
+
+		//Decodes the next frame, BGRA with rows of "pitch" bytes. It stays valid until the next read. False at the end of the video.
+		bool read(const uchar*& device_frame, size_t& pitch, int& channels);
+
+	private:
+		struct Decoder;
+		std::unique_ptr<Decoder> m_decoder;
+	};
+}
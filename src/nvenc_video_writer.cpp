@@ -0,0 +1,416 @@
+#include "nvenc_video_writer.h"
+#include "profiler.h"
+#include "util.h"
+#include "thread_placement.h"
+
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#if defined(__has_include)
+#if __has_include(<nvEncodeAPI.h>)
+#include <nvEncodeAPI.h>
+#include <cuda.h>
+#define HAS_NVENC 1
+#endif
+#endif
+
+#ifdef HAS_NVENC
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+#endif
+
+namespace util
+{
+#ifdef HAS_NVENC
+	static void checkNvenc(NVENCSTATUS status, const char* call)
+	{
+		if (status != NV_ENC_SUCCESS)
+		{
+			throw std::runtime_error(std::string("Error: ") + call + " failed with NVENC status " + std::to_string(status) + "!");
+		}
+	}
+#define CHECK_NVENC(call) checkNvenc((call), #call)
+
+	//The encoder library ships with the driver. It is loaded at runtime, so the application doesn't link against it.
+	static void* loadNvencLibrary()
+	{
+#ifdef _WIN32
+		return LoadLibraryA("nvEncodeAPI64.dll");
+#else
+		return dlopen("libnvidia-encode.so.1", RTLD_LAZY);
+#endif
+	}
+
+	static void unloadNvencLibrary(void* library)
+	{
+#ifdef _WIN32
+		FreeLibrary(static_cast<HMODULE>(library));
+#else
+		dlclose(library);
+#endif
+	}
+
+	static void* getNvencSymbol(void* library, const char* name)
+	{
+#ifdef _WIN32
+		return reinterpret_cast<void*>(GetProcAddress(static_cast<HMODULE>(library), name));
+#else
+		return dlsym(library, name);
+#endif
+	}
+
+	struct NvencVideoWriter::Session
+	{
+		void* library = nullptr;
+		NV_ENCODE_API_FUNCTION_LIST api{ NV_ENCODE_API_FUNCTION_LIST_VER };
+		void* encoder = nullptr;
+		NV_ENC_OUTPUT_PTR bitstream = nullptr;
+		uint64_t num_frames = 0;
+
+		void writeBitstream(FILE* file)
+		{
+			NV_ENC_LOCK_BITSTREAM lock = { NV_ENC_LOCK_BITSTREAM_VER };
+			lock.outputBitstream = bitstream;
+			CHECK_NVENC(api.nvEncLockBitstream(encoder, &lock));
+			fwrite(lock.bitstreamBufferPtr, 1, lock.bitstreamSizeInBytes, file);
+			CHECK_NVENC(api.nvEncUnlockBitstream(encoder, bitstream));
+		}
+	};
+
+	bool NvencVideoWriter::isAvailable()
+	{
+		void* library = loadNvencLibrary();
+		if (library)
+		{
+			unloadNvencLibrary(library);
+		}
+		return library != nullptr;
+	}
+
+	NvencVideoWriter::NvencVideoWriter(const std::string& filepath, VideoCodec codec, double fps, int width, int height, bool lossless, int num_buffers)
+		: m_session(std::make_unique<Session>())
+		, m_width(width)
+		, m_height(height)
+		, m_lossless(lossless)
+		, m_slots(num_buffers)
+		, m_free_slots(num_buffers)
+		, m_filled_slots(num_buffers)
+	{
+		//The destructor doesn't run if this throws, so everything acquired up to there is given back before rethrowing.
+		try
+		{
+			auto& session = *m_session;
+			session.library = loadNvencLibrary();
+			if (!session.library)
+			{
+				throw std::runtime_error("Error: The NVENC library could not be loaded!");
+			}
+
+			using CreateInstance = NVENCSTATUS(NVENCAPI*)(NV_ENCODE_API_FUNCTION_LIST*);
+			auto create_instance = reinterpret_cast<CreateInstance>(getNvencSymbol(session.library, "NvEncodeAPICreateInstance"));
+			if (!create_instance)
+			{
+				throw std::runtime_error("Error: NvEncodeAPICreateInstance is missing in the NVENC library!");
+			}
+			CHECK_NVENC(create_instance(&session.api));
+
+			//NVENC wants the driver context, which is the primary context of the runtime.
+			CHECK_CUDA_ERROR(cudaFree(0));
+			void* ctx_get_current = nullptr;
+			CHECK_CUDA_ERROR(cudaGetDriverEntryPoint("cuCtxGetCurrent", &ctx_get_current, cudaEnableDefault));
+			CUcontext context = nullptr;
+			reinterpret_cast<CUresult(CUDAAPI*)(CUcontext*)>(ctx_get_current)(&context);
+
+			NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS session_params = { NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS_VER };
+			session_params.device = context;
+			session_params.deviceType = NV_ENC_DEVICE_TYPE_CUDA;
+			session_params.apiVersion = NVENCAPI_VERSION;
+			CHECK_NVENC(session.api.nvEncOpenEncodeSessionEx(&session_params, &session.encoder));
+
+			const GUID codec_guid = codec == VideoCodec::Hevc ? NV_ENC_CODEC_HEVC_GUID : NV_ENC_CODEC_H264_GUID;
+			NV_ENC_PRESET_CONFIG preset_config = { NV_ENC_PRESET_CONFIG_VER, { NV_ENC_CONFIG_VER } };
+			CHECK_NVENC(session.api.nvEncGetEncodePresetConfigEx(session.encoder, codec_guid, NV_ENC_PRESET_P4_GUID, NV_ENC_TUNING_INFO_HIGH_QUALITY, &preset_config));
+
+			//No B-frames, so every picture comes out of the encoder right away. A keyframe every two seconds, with the parameter sets
+			//repeated, so the elementary stream can be cut and decoded from any of them.
+			NV_ENC_CONFIG config = preset_config.presetCfg;
+			config.frameIntervalP = 1;
+			config.gopLength = static_cast<uint32_t>(2 * fps);
+			if (codec == VideoCodec::Hevc)
+			{
+				config.encodeCodecConfig.hevcConfig.idrPeriod = config.gopLength;
+				config.encodeCodecConfig.hevcConfig.repeatSPSPPS = 1;
+			}
+			else
+			{
+				config.encodeCodecConfig.h264Config.idrPeriod = config.gopLength;
+				config.encodeCodecConfig.h264Config.repeatSPSPPS = 1;
+			}
+
+			NV_ENC_INITIALIZE_PARAMS init_params = { NV_ENC_INITIALIZE_PARAMS_VER };
+			init_params.encodeGUID = codec_guid;
+			init_params.presetGUID = NV_ENC_PRESET_P4_GUID;
+			init_params.tuningInfo = NV_ENC_TUNING_INFO_HIGH_QUALITY;
+			init_params.encodeWidth = m_width;
+			init_params.encodeHeight = m_height;
+			init_params.darWidth = m_width;
+			init_params.darHeight = m_height;
+			init_params.frameRateNum = static_cast<uint32_t>(fps);
+			init_params.frameRateDen = 1;
+			init_params.enablePTD = 1;
+			init_params.encodeConfig = &config;
+			CHECK_NVENC(session.api.nvEncInitializeEncoder(session.encoder, &init_params));
+
+			NV_ENC_CREATE_BITSTREAM_BUFFER bitstream = { NV_ENC_CREATE_BITSTREAM_BUFFER_VER };
+			CHECK_NVENC(session.api.nvEncCreateBitstreamBuffer(session.encoder, &bitstream));
+			session.bitstream = bitstream.bitstreamBuffer;
+
+			CHECK_CUDA_ERROR(cudaStreamCreate(&m_stream));
+			for (int i = 0; i < num_buffers; ++i)
+			{
+				auto& slot = m_slots[i];
+				CHECK_CUDA_ERROR(cudaMalloc(&slot.pixels, m_width * m_height * 4));
+				CHECK_CUDA_ERROR(cudaEventCreateWithFlags(&slot.copied, cudaEventDisableTiming));
+
+				//GL's RGBA8 is NVENC's ABGR, the names count the channels from the most significant byte.
+				NV_ENC_REGISTER_RESOURCE resource = { NV_ENC_REGISTER_RESOURCE_VER };
+				resource.resourceType = NV_ENC_INPUT_RESOURCE_TYPE_CUDADEVICEPTR;
+				resource.resourceToRegister = slot.pixels;
+				resource.width = m_width;
+				resource.height = m_height;
+				resource.pitch = m_width * 4;
+				resource.bufferFormat = NV_ENC_BUFFER_FORMAT_ABGR;
+				resource.bufferUsage = NV_ENC_INPUT_IMAGE;
+				CHECK_NVENC(session.api.nvEncRegisterResource(session.encoder, &resource));
+				slot.registered = resource.registeredResource;
+
+				int index = i;
+				m_free_slots.tryPush(std::move(index));
+			}
+
+			m_file = fopen(filepath.c_str(), "wb");
+			if (!m_file)
+			{
+				throw std::runtime_error("Error: Could not open " + filepath + " for writing!");
+			}
+
+			m_encoder = std::thread(&NvencVideoWriter::encode, this);
+		}
+		catch (...)
+		{
+			release();
+			throw;
+		}
+	}
+
+	NvencVideoWriter::~NvencVideoWriter()
+	{
+		m_stop = true;
+		m_filled_slots.wake();
+		if (m_encoder.joinable())
+		{
+			m_encoder.join();
+		}
+		release();
+
+		if (m_num_dropped_frames > 0)
+		{
+			std::cout << "Warning: " << m_num_dropped_frames << " video frames were dropped, the encoder couldn't keep up!" << std::endl;
+		}
+	}
+
+	void NvencVideoWriter::release()
+	{
+		auto& session = *m_session;
+		for (auto& slot : m_slots)
+		{
+			if (slot.registered)
+			{
+				session.api.nvEncUnregisterResource(session.encoder, slot.registered);
+				slot.registered = nullptr;
+			}
+			if (slot.pixels)
+			{
+				CHECK_CUDA_ERROR(cudaFree(slot.pixels));
+				slot.pixels = nullptr;
+			}
+			if (slot.copied)
+			{
+				CHECK_CUDA_ERROR(cudaEventDestroy(slot.copied));
+				slot.copied = nullptr;
+			}
+		}
+		if (m_stream)
+		{
+			CHECK_CUDA_ERROR(cudaStreamDestroy(m_stream));
+			m_stream = nullptr;
+		}
+		if (session.bitstream)
+		{
+			session.api.nvEncDestroyBitstreamBuffer(session.encoder, session.bitstream);
+			session.bitstream = nullptr;
+		}
+		if (session.encoder)
+		{
+			session.api.nvEncDestroyEncoder(session.encoder);
+			session.encoder = nullptr;
+		}
+		if (session.library)
+		{
+			unloadNvencLibrary(session.library);
+			session.library = nullptr;
+		}
+		if (m_file)
+		{
+			fclose(m_file);
+			m_file = nullptr;
+		}
+	}
+
+	int NvencVideoWriter::acquireSlot()
+	{
+		int slot;
+		if (m_lossless ? !m_free_slots.pop(slot, m_encoder_failed) : !m_free_slots.tryPop(slot))
+		{
+			m_num_dropped_frames++;
+			return -1;
+		}
+		return slot;
+	}
+
+	bool NvencVideoWriter::enqueue(cudaGraphicsResource_t resource)
+	{
+		int slot = acquireSlot();
+		if (slot < 0)
+		{
+			return false;
+		}
+
+		//Device to device, the frame never goes through the host.
+		CHECK_CUDA_ERROR(cudaGraphicsMapResources(1, &resource, m_stream));
+		cudaArray_t array = nullptr;
+		CHECK_CUDA_ERROR(cudaGraphicsSubResourceGetMappedArray(&array, resource, 0, 0));
+		CHECK_CUDA_ERROR(cudaMemcpy2DFromArrayAsync(m_slots[slot].pixels, m_width * 4, array, 0, 0, m_width * 4, m_height, cudaMemcpyDeviceToDevice, m_stream));
+		CHECK_CUDA_ERROR(cudaEventRecord(m_slots[slot].copied, m_stream));
+		CHECK_CUDA_ERROR(cudaGraphicsUnmapResources(1, &resource, m_stream));
+
+		m_filled_slots.tryPush(std::move(slot));
+		return true;
+	}
+
+	bool NvencVideoWriter::enqueue(const cv::Mat& frame)
+	{
+		int slot = acquireSlot();
+		if (slot < 0)
+		{
+			return false;
+		}
+
+		CHECK_CUDA_ERROR(cudaMemcpy2DAsync(m_slots[slot].pixels, m_width * 4, frame.data, frame.step, m_width * 4, m_height, cudaMemcpyHostToDevice, m_stream));
+		CHECK_CUDA_ERROR(cudaEventRecord(m_slots[slot].copied, m_stream));
+
+		m_filled_slots.tryPush(std::move(slot));
+		return true;
+	}
+
+	void NvencVideoWriter::encode()
+	{
+		ThreadPlacement::get().apply(ThreadStage::Encode);
+		auto& session = *m_session;
+		try
+		{
+			//Sleeps while there is nothing to encode. The queue is drained before stopping.
+			int slot;
+			while (m_filled_slots.pop(slot, m_stop))
+			{
+				CHECK_CUDA_ERROR(cudaEventSynchronize(m_slots[slot].copied));
+				{
+					ScopedTimer timer("Video encode");
+
+					NV_ENC_MAP_INPUT_RESOURCE input = { NV_ENC_MAP_INPUT_RESOURCE_VER };
+					input.registeredResource = m_slots[slot].registered;
+					CHECK_NVENC(session.api.nvEncMapInputResource(session.encoder, &input));
+
+					NV_ENC_PIC_PARAMS picture = { NV_ENC_PIC_PARAMS_VER };
+					picture.inputBuffer = input.mappedResource;
+					picture.bufferFmt = input.mappedBufferFmt;
+					picture.inputWidth = m_width;
+					picture.inputHeight = m_height;
+					picture.outputBitstream = session.bitstream;
+					picture.pictureStruct = NV_ENC_PIC_STRUCT_FRAME;
+					picture.inputTimeStamp = session.num_frames++;
+
+					const NVENCSTATUS status = session.api.nvEncEncodePicture(session.encoder, &picture);
+					if (status != NV_ENC_ERR_NEED_MORE_INPUT)
+					{
+						checkNvenc(status, "nvEncEncodePicture");
+						session.writeBitstream(m_file);
+					}
+					CHECK_NVENC(session.api.nvEncUnmapInputResource(session.encoder, input.mappedResource));
+				}
+				m_free_slots.tryPush(std::move(slot));
+			}
+
+			NV_ENC_PIC_PARAMS end_of_stream = { NV_ENC_PIC_PARAMS_VER };
+			end_of_stream.encodePicFlags = NV_ENC_PIC_FLAG_EOS;
+			CHECK_NVENC(session.api.nvEncEncodePicture(session.encoder, &end_of_stream));
+		}
+		catch (const std::exception& e)
+		{
+			//The frame loop keeps running, it only sees dropped frames from now on.
+			std::cout << e.what() << std::endl;
+			m_encoder_failed = true;
+			m_free_slots.wake();
+		}
+	}
+#else
+	struct NvencVideoWriter::Session
+	{
+	};
+
+	bool NvencVideoWriter::isAvailable()
+	{
+		return false;
+	}
+
+	NvencVideoWriter::NvencVideoWriter(const std::string& filepath, VideoCodec codec, double fps, int width, int height, bool lossless, int num_buffers)
+		: m_width(width)
+		, m_height(height)
+		, m_lossless(lossless)
+		, m_free_slots(num_buffers)
+		, m_filled_slots(num_buffers)
+	{
+		throw std::runtime_error("Error: Built without the NVENC header nvEncodeAPI.h!");
+	}
+
+	NvencVideoWriter::~NvencVideoWriter() = default;
+
+	void NvencVideoWriter::release()
+	{
+	}
+
+	int NvencVideoWriter::acquireSlot()
+	{
+		return -1;
+	}
+
+	bool NvencVideoWriter::enqueue(cudaGraphicsResource_t resource)
+	{
+		return false;
+	}
+
+	bool NvencVideoWriter::enqueue(const cv::Mat& frame)
+	{
+		return false;
+	}
+
+	void NvencVideoWriter::encode()
+	{
+	}
+#endif
+}
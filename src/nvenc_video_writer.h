@@ -0,0 +1,64 @@
+#pragma once
+
+#include "spsc_queue.h"
+#include "video_writer.h"
+
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace util
+{
+	//Encodes the overlay frames with NVENC into a raw H.264/HEVC elementary stream. The RGBA texture is copied device to device
+	//into one of a few registered input buffers (NVENC takes ABGR input directly, no color conversion on the CPU),
+	//an encoder thread submits them and writes the bitstream. Only available if the Video Codec SDK header nvEncodeAPI.h is found.
+	class NvencVideoWriter : public VideoWriter
+	{
+	public:
+		static bool isAvailable();
+
+		NvencVideoWriter(const std::string& filepath, VideoCodec codec, double fps, int width, int height, bool lossless, int num_buffers = 4);
+		//Encodes all queued frames and flushes the encoder before returning.
+		~NvencVideoWriter();
+
+		NvencVideoWriter(const NvencVideoWriter&) = delete;
+		NvencVideoWriter& operator=(const NvencVideoWriter&) = delete;
+
+		bool isOpened() const override { return m_file != nullptr; }
+		bool enqueue(cudaGraphicsResource_t resource) override;
+		bool enqueue(const cv::Mat& frame) override;
+		int getNumberOfDroppedFrames() const override { return m_num_dropped_frames; }
+
+	private:
+		struct Session;
+
+		struct Slot
+		{
+			void* pixels = nullptr; //device, width * 4 bytes per row
+			void* registered = nullptr; //NV_ENC_REGISTERED_PTR
+			cudaEvent_t copied = nullptr;
+		};
+
+		int acquireSlot();
+		void encode();
+		//Gives back whatever the constructor acquired so far, the encoder thread isn't running.
+		void release();
+
+	private:
+		std::unique_ptr<Session> m_session;
+		FILE* m_file{ nullptr };
+		int m_width;
+		int m_height;
+		bool m_lossless;
+		cudaStream_t m_stream{ nullptr };
+		std::vector<Slot> m_slots;
+		SpscQueue<int> m_free_slots;
+		SpscQueue<int> m_filled_slots;
+		std::atomic<bool> m_stop{ false };
+		std::atomic<bool> m_encoder_failed{ false }; //ends the wait of a lossless enqueue, nothing frees slots anymore
+		std::thread m_encoder;
+		int m_num_dropped_frames{ 0 };
+	};
+}
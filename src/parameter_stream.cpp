@@ -0,0 +1,301 @@
+#include "parameter_stream.h"
+#include "face.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+
+//Every record starts with the frame index, the tracked and keyframe flags and two bytes of padding.
+struct RecordPrefix
+{
+	uint32_t frame = 0;
+	uint8_t tracked = 0;
+	uint8_t keyframe = 0;
+	uint16_t padding = 0;
+};
+
+static size_t getNumberOfValues(const ParameterStreamHeader& header)
+{
+	return 3 + 3 + 1 + header.num_expression_coefficients + header.num_sh_coefficients;
+}
+
+//Index into ParameterStreamHeader::steps of value "i" of a record.
+static int getValueGroup(const ParameterStreamHeader& header, size_t i)
+{
+	if (i < 3) return 0;
+	if (i < 6) return 1;
+	if (i < 7) return 2;
+	if (i < 7 + header.num_expression_coefficients) return 3;
+	return 4;
+}
+
+static size_t getRecordSize(const ParameterStreamHeader& header)
+{
+	const size_t value_size = header.encoding == ParameterEncoding::Float32 ? sizeof(float) : sizeof(int16_t);
+	return sizeof(RecordPrefix) + getNumberOfValues(header) * value_size;
+}
+
+ParameterStreamWriter::ParameterStreamWriter(const std::string& filepath, const Face& face, ParameterEncoding encoding)
+	: m_file(filepath, std::ofstream::binary)
+{
+	if (!m_file.is_open())
+	{
+		throw std::runtime_error("Error: Could not open " + filepath + " for writing!");
+	}
+
+	m_header.encoding = encoding;
+	m_header.num_shape_coefficients = face.getShapeCoefficients().size();
+	m_header.num_albedo_coefficients = face.getAlbedoCoefficients().size();
+	m_header.num_expression_coefficients = face.getExpressionCoefficients().size();
+	m_header.num_sh_coefficients = face.getSHCoefficients().size();
+	m_record_size = getRecordSize(m_header);
+
+	const size_t n_values = getNumberOfValues(m_header);
+	m_values.resize(n_values);
+	m_absolute.resize(n_values);
+	m_quantized.resize(n_values);
+	m_previous.resize(n_values, 0);
+
+	writeHeader(face);
+}
+
+ParameterStreamWriter::~ParameterStreamWriter()
+{
+	if (m_file.is_open())
+	{
+		//Without the face, only the frame count can be fixed up.
+		m_file.seekp(offsetof(ParameterStreamHeader, num_frames));
+		m_file.write(reinterpret_cast<const char*>(&m_header.num_frames), sizeof(m_header.num_frames));
+	}
+}
+
+void ParameterStreamWriter::writeHeader(const Face& face)
+{
+	m_file.seekp(0);
+	m_file.write(reinterpret_cast<const char*>(&m_header), sizeof(m_header));
+	m_file.write(reinterpret_cast<const char*>(face.getShapeCoefficients().data()), m_header.num_shape_coefficients * sizeof(float));
+	m_file.write(reinterpret_cast<const char*>(face.getAlbedoCoefficients().data()), m_header.num_albedo_coefficients * sizeof(float));
+}
+
+void ParameterStreamWriter::write(const Face& face, const glm::mat4& projection, bool tracked)
+{
+	auto it = m_values.begin();
+	for (int i = 0; i < 3; ++i)
+	{
+		*it++ = face.getRotationCoefficients()[i];
+	}
+	for (int i = 0; i < 3; ++i)
+	{
+		*it++ = face.getTranslationCoefficients()[i];
+	}
+	*it++ = projection[0][0];
+	it = std::copy(face.getExpressionCoefficients().begin(), face.getExpressionCoefficients().end(), it);
+	std::copy(face.getSHCoefficients().begin(), face.getSHCoefficients().end(), it);
+
+	RecordPrefix prefix;
+	prefix.frame = m_header.num_frames++;
+	prefix.tracked = tracked ? 1 : 0;
+
+	if (m_header.encoding == ParameterEncoding::Float32)
+	{
+		prefix.keyframe = 1;
+		m_file.write(reinterpret_cast<const char*>(&prefix), sizeof(prefix));
+		m_file.write(reinterpret_cast<const char*>(m_values.data()), m_values.size() * sizeof(float));
+		return;
+	}
+
+	constexpr int kMax = std::numeric_limits<int16_t>::max();
+	bool keyframe = m_header.encoding == ParameterEncoding::Quantized16 || prefix.frame == 0 || m_frames_since_keyframe + 1 >= kKeyframeInterval;
+	for (size_t i = 0; i < m_values.size(); ++i)
+	{
+		const float step = m_header.steps[getValueGroup(m_header, i)];
+		const float steps = std::round(m_values[i] / step);
+		if (!(std::abs(steps) <= kMax))
+		{
+			m_clamped_values++;
+		}
+		m_absolute[i] = static_cast<int>(std::max(-static_cast<float>(kMax), std::min(static_cast<float>(kMax), steps)));
+		keyframe |= std::abs(m_absolute[i] - m_previous[i]) > kMax;
+	}
+
+	for (size_t i = 0; i < m_values.size(); ++i)
+	{
+		m_quantized[i] = static_cast<int16_t>(keyframe ? m_absolute[i] : m_absolute[i] - m_previous[i]);
+		m_previous[i] = m_absolute[i];
+	}
+	m_frames_since_keyframe = keyframe ? 0 : m_frames_since_keyframe + 1;
+
+	prefix.keyframe = keyframe ? 1 : 0;
+	m_file.write(reinterpret_cast<const char*>(&prefix), sizeof(prefix));
+	m_file.write(reinterpret_cast<const char*>(m_quantized.data()), m_quantized.size() * sizeof(int16_t));
+}
+
+void ParameterStreamWriter::close(const Face& face)
+{
+	if (!m_file.is_open())
+	{
+		return;
+	}
+
+	writeHeader(face);
+	m_file.close();
+	if (m_clamped_values > 0)
+	{
+		std::cout << "Warning: " << m_clamped_values << " values of the parameter stream were out of the quantized range and clamped" << std::endl;
+	}
+}
+
+void mergeParameterStreams(const std::vector<std::string>& inputs, const std::string& output)
+{
+	if (inputs.empty())
+	{
+		throw std::runtime_error("Error: No parameter streams to merge into " + output + "!");
+	}
+
+	std::ofstream out(output, std::ofstream::binary);
+	if (!out.is_open())
+	{
+		throw std::runtime_error("Error: Could not open " + output + " for writing!");
+	}
+
+	ParameterStreamHeader merged_header;
+	std::vector<char> buffer;
+	for (size_t i = 0; i < inputs.size(); ++i)
+	{
+		std::ifstream in(inputs[i], std::ifstream::binary);
+		ParameterStreamHeader header;
+		in.read(reinterpret_cast<char*>(&header), sizeof(header));
+		if (!in || std::memcmp(header.magic, merged_header.magic, sizeof(header.magic)) != 0 || header.version != merged_header.version)
+		{
+			throw std::runtime_error("Error: " + inputs[i] + " is not a parameter stream!");
+		}
+
+		const size_t identity_size = (header.num_shape_coefficients + header.num_albedo_coefficients) * sizeof(float);
+		buffer.resize(identity_size);
+		in.read(buffer.data(), identity_size);
+		if (i == 0)
+		{
+			merged_header = header;
+			merged_header.num_frames = 0;
+			out.write(reinterpret_cast<const char*>(&merged_header), sizeof(merged_header));
+			out.write(buffer.data(), identity_size);
+		}
+		else if (header.encoding != merged_header.encoding || getNumberOfValues(header) != getNumberOfValues(merged_header)
+			|| header.num_expression_coefficients != merged_header.num_expression_coefficients)
+		{
+			throw std::runtime_error("Error: " + inputs[i] + " doesn't match the layout of " + inputs[0] + "!");
+		}
+
+		const size_t record_size = getRecordSize(header);
+		buffer.resize(record_size);
+		for (uint32_t frame = 0; frame < header.num_frames && in.read(buffer.data(), record_size); ++frame)
+		{
+			RecordPrefix prefix;
+			std::memcpy(&prefix, buffer.data(), sizeof(prefix));
+			prefix.frame = merged_header.num_frames++;
+			std::memcpy(buffer.data(), &prefix, sizeof(prefix));
+			out.write(buffer.data(), record_size);
+		}
+	}
+
+	out.seekp(offsetof(ParameterStreamHeader, num_frames));
+	out.write(reinterpret_cast<const char*>(&merged_header.num_frames), sizeof(merged_header.num_frames));
+}
+
+ParameterStreamReader::ParameterStreamReader(const std::string& filepath)
+	: m_file(filepath, std::ifstream::binary)
+{
+	if (!m_file.is_open())
+	{
+		throw std::runtime_error("Error: Could not open " + filepath + "!");
+	}
+
+	const ParameterStreamHeader expected;
+	m_file.read(reinterpret_cast<char*>(&m_header), sizeof(m_header));
+	if (!m_file || std::memcmp(m_header.magic, expected.magic, sizeof(expected.magic)) != 0 || m_header.version != expected.version)
+	{
+		throw std::runtime_error("Error: " + filepath + " is not a parameter stream!");
+	}
+
+	m_shape_coefficients.resize(m_header.num_shape_coefficients);
+	m_albedo_coefficients.resize(m_header.num_albedo_coefficients);
+	m_file.read(reinterpret_cast<char*>(m_shape_coefficients.data()), m_shape_coefficients.size() * sizeof(float));
+	m_file.read(reinterpret_cast<char*>(m_albedo_coefficients.data()), m_albedo_coefficients.size() * sizeof(float));
+
+	m_record_size = getRecordSize(m_header);
+	m_first_record = m_file.tellg();
+	m_record.resize(m_record_size);
+	m_previous.resize(getNumberOfValues(m_header), 0);
+}
+
+bool ParameterStreamReader::read(FrameParameters& parameters)
+{
+	if (!m_file.read(m_record.data(), m_record_size))
+	{
+		return false;
+	}
+
+	RecordPrefix prefix;
+	std::memcpy(&prefix, m_record.data(), sizeof(prefix));
+
+	const size_t n_values = getNumberOfValues(m_header);
+	auto& values = m_values;
+	values.resize(n_values);
+	const char* payload = m_record.data() + sizeof(prefix);
+	if (m_header.encoding == ParameterEncoding::Float32)
+	{
+		std::memcpy(values.data(), payload, n_values * sizeof(float));
+	}
+	else
+	{
+		for (size_t i = 0; i < n_values; ++i)
+		{
+			int16_t quantized;
+			std::memcpy(&quantized, payload + i * sizeof(int16_t), sizeof(int16_t));
+			m_previous[i] = prefix.keyframe ? quantized : m_previous[i] + quantized;
+			values[i] = m_previous[i] * m_header.steps[getValueGroup(m_header, i)];
+		}
+	}
+
+	parameters.frame = prefix.frame;
+	parameters.tracked = prefix.tracked != 0;
+	parameters.rotation = glm::vec3(values[0], values[1], values[2]);
+	parameters.translation = glm::vec3(values[3], values[4], values[5]);
+	parameters.focal = values[6];
+	parameters.expression.assign(values.begin() + 7, values.begin() + 7 + m_header.num_expression_coefficients);
+	parameters.sh.assign(values.begin() + 7 + m_header.num_expression_coefficients, values.end());
+	return true;
+}
+
+void ParameterStreamReader::seek(uint32_t frame)
+{
+	m_file.clear();
+
+	uint32_t first = frame;
+	if (m_header.encoding == ParameterEncoding::QuantizedDelta16)
+	{
+		//Walk back to the keyframe, then decode forward up to "frame".
+		while (first > 0)
+		{
+			RecordPrefix prefix;
+			m_file.seekg(m_first_record + static_cast<std::streamoff>(first) * m_record_size);
+			m_file.read(reinterpret_cast<char*>(&prefix), sizeof(prefix));
+			if (!m_file || prefix.keyframe)
+			{
+				m_file.clear();
+				break;
+			}
+			first--;
+		}
+	}
+
+	m_file.seekg(m_first_record + static_cast<std::streamoff>(first) * m_record_size);
+	FrameParameters skipped;
+	for (uint32_t i = first; i < frame && read(skipped); ++i)
+	{
+	}
+}
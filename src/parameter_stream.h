@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+
+class Face;
+
+//Fitted parameters of one frame.
+struct FrameParameters
+{
+	uint32_t frame = 0;
+	bool tracked = false; //false, if no face was found and the parameters are those of the last tracked frame
+	glm::vec3 rotation{ 0.0f };
+	glm::vec3 translation{ 0.0f };
+	float focal = 0.0f; //projection[0][0]
+	std::vector<float> expression;
+	std::vector<float> sh;
+};
+
+//Binary parameter stream: a header with the identity (shape and albedo coefficients), followed by one fixed-size record per frame.
+//Float32 stores every value as is. Quantized16 stores them as int16 multiples of a per-group step (see ParameterStreamHeader),
+//QuantizedDelta16 stores the difference to the previous frame instead, with a keyframe every kKeyframeInterval records
+//or whenever a difference doesn't fit. Deltas are taken to the reconstructed values, so the error doesn't accumulate.
+enum class ParameterEncoding : uint32_t
+{
+	Float32 = 0,
+	Quantized16 = 1,
+	QuantizedDelta16 = 2
+};
+
+struct ParameterStreamHeader
+{
+	char magic[4]{ 'F', 'P', 'S', 'T' };
+	uint32_t version = 1;
+	ParameterEncoding encoding = ParameterEncoding::Float32;
+	uint32_t num_shape_coefficients = 0;
+	uint32_t num_albedo_coefficients = 0;
+	uint32_t num_expression_coefficients = 0;
+	uint32_t num_sh_coefficients = 0;
+	uint32_t num_frames = 0; //updated when the writer is closed
+
+	//Quantization steps of rotation (radians), translation, focal, expression and SH values. 32767 steps cover rotations of
+	//+-3.3 rad, translations of +-3.3 (the face starts at z = -0.4), a focal of up to 6.5 (a field of view down to 17 degrees),
+	//expressions of +-33 and SH of +-3.3. Values beyond that are clamped and counted, see ParameterStreamWriter::getClampedValues.
+	float steps[5]{ 1.0e-4f, 1.0e-4f, 2.0e-4f, 1.0e-3f, 1.0e-4f };
+};
+
+class ParameterStreamWriter
+{
+public:
+	static constexpr int kKeyframeInterval = 30;
+
+	ParameterStreamWriter(const std::string& filepath, const Face& face, ParameterEncoding encoding = ParameterEncoding::Float32);
+	ParameterStreamWriter(const ParameterStreamWriter&) = delete;
+	ParameterStreamWriter& operator=(const ParameterStreamWriter&) = delete;
+	~ParameterStreamWriter();
+
+	void write(const Face& face, const glm::mat4& projection, bool tracked);
+
+	//Rewrites the identity (e.g. after the solver locked it) and the frame count in the header.
+	void close(const Face& face);
+
+	size_t getRecordSize() const { return m_record_size; }
+	//Number of values which didn't fit into the quantized range so far, their decoded value is the end of the range.
+	size_t getClampedValues() const { return m_clamped_values; }
+
+private:
+	void writeHeader(const Face& face);
+
+private:
+	std::ofstream m_file;
+	ParameterStreamHeader m_header;
+	size_t m_record_size{ 0 };
+	std::vector<float> m_values;
+	std::vector<int> m_absolute; //values of this record, in steps
+	std::vector<int16_t> m_quantized;
+	std::vector<int> m_previous; //values of the last record, in steps
+	int m_frames_since_keyframe{ 0 };
+	size_t m_clamped_values{ 0 };
+};
+
+//Writes kKeyframeInterval + 1 records of "face" and "projection" with "encoding" to "scratch_path", so both keyframes and
+//deltas are covered, reads them back and removes the file. Returns the largest difference of a decoded value to the
+//written one and throws if a value was clamped or is off by more than half a step. A check of the step table, defined with
+//the solver's checks in gauss_newton_solver_test.cu. At runtime the writer counts the clamped values, see getClampedValues.
+float checkParameterStreamRoundTrip(const Face& face, const glm::mat4& projection, ParameterEncoding encoding, const std::string& scratch_path);
+
+//Concatenates streams of consecutive clips of one video into "output", renumbering the frames. The streams have to agree
+//in encoding and coefficient counts, and each of them has to start with a keyframe (as every writer does). The identity
+//in the header is the one of the first stream.
+void mergeParameterStreams(const std::vector<std::string>& inputs, const std::string& output);
+
+class ParameterStreamReader
+{
+public:
+	explicit ParameterStreamReader(const std::string& filepath);
+
+	const ParameterStreamHeader& getHeader() const { return m_header; }
+	const std::vector<float>& getShapeCoefficients() const { return m_shape_coefficients; }
+	const std::vector<float>& getAlbedoCoefficients() const { return m_albedo_coefficients; }
+
+	//False at the end of the stream.
+	bool read(FrameParameters& parameters);
+	//The next read returns "frame". Delta streams are decoded from the keyframe before it.
+	void seek(uint32_t frame);
+
+private:
+	std::ifstream m_file;
+	ParameterStreamHeader m_header;
+	std::vector<float> m_shape_coefficients;
+	std::vector<float> m_albedo_coefficients;
+	size_t m_record_size{ 0 };
+	std::streamoff m_first_record{ 0 };
+	std::vector<char> m_record;
+	std::vector<float> m_values;
+	std::vector<int> m_previous;
+};
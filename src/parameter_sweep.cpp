@@ -0,0 +1,427 @@
+#include "parameter_sweep.h"
+#include "face.h"
+#include "pyramid.h"
+#include "glsl_program.h"
+#include "profiler.h"
+#include "util.h"
+
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+#include <cuda_gl_interop.h>
+#include <glm/ext/matrix_clip_space.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+namespace
+{
+	std::string trim(const std::string& text)
+	{
+		const auto begin = text.find_first_not_of(" \t\r");
+		if (begin == std::string::npos)
+		{
+			return std::string();
+		}
+		const auto end = text.find_last_not_of(" \t\r");
+		return text.substr(begin, end - begin + 1);
+	}
+
+	float percentile(std::vector<float> values, float fraction)
+	{
+		if (values.empty())
+		{
+			return 0.0f;
+		}
+		const size_t k = std::min(values.size() - 1, static_cast<size_t>(fraction * values.size()));
+		std::nth_element(values.begin(), values.begin() + k, values.end());
+		return values[k];
+	}
+
+	//"a" is at least as fast and as accurate as "b" and better in one of them.
+	bool dominates(const SweepResult& a, const SweepResult& b)
+	{
+		const bool no_worse = a.frame_ms_p50 <= b.frame_ms_p50 && a.landmark_error <= b.landmark_error && a.photometric_error <= b.photometric_error;
+		const bool better = a.frame_ms_p50 < b.frame_ms_p50 || a.landmark_error < b.landmark_error || a.photometric_error < b.photometric_error;
+		return no_worse && better;
+	}
+}
+
+ParameterSweep::ParameterSweep(const SweepSettings& settings, const SolverParameters& solver_parameters)
+	: m_settings(settings)
+	, m_solver_parameters(solver_parameters)
+	, m_grid(parseGrid(settings.grid_path))
+{
+	if (m_settings.devices.empty())
+	{
+		int device_count = 0;
+		CHECK_CUDA_ERROR(cudaGetDeviceCount(&device_count));
+		for (int i = 0; i < device_count; ++i)
+		{
+			m_settings.devices.push_back(i);
+		}
+	}
+	m_settings.workers_per_device = std::max(m_settings.workers_per_device, 1);
+
+	size_t n_configurations = 1;
+	for (const auto& dimension : m_grid)
+	{
+		n_configurations *= dimension.values.size();
+	}
+	m_results.resize(n_configurations);
+
+	//Checks the names before anything is solved.
+	for (const auto& dimension : m_grid)
+	{
+		SolverParameters params(m_solver_parameters);
+		applyValue(params, dimension.name, dimension.values[0]);
+	}
+}
+
+std::vector<SweepDimension> ParameterSweep::parseGrid(const std::string& filepath)
+{
+	std::ifstream file(filepath);
+	if (!file.is_open())
+	{
+		throw std::runtime_error("Error: Could not open the sweep grid " + filepath);
+	}
+
+	std::vector<SweepDimension> grid;
+	std::string line;
+	int line_number = 0;
+	while (std::getline(file, line))
+	{
+		line_number++;
+		line = trim(line.substr(0, line.find('#')));
+		if (line.empty())
+		{
+			continue;
+		}
+
+		const auto equals = line.find('=');
+		SweepDimension dimension;
+		dimension.name = trim(line.substr(0, equals));
+		if (equals == std::string::npos || dimension.name.empty())
+		{
+			throw std::runtime_error("Error: Line " + std::to_string(line_number) + " of " + filepath + " isn't \"<name> = <values>\"!");
+		}
+
+		std::stringstream values(line.substr(equals + 1));
+		std::string value;
+		while (std::getline(values, value, ','))
+		{
+			char* end = nullptr;
+			value = trim(value);
+			const float number = std::strtof(value.c_str(), &end);
+			if (value.empty() || *end != '\0')
+			{
+				throw std::runtime_error("Error: \"" + value + "\" of " + dimension.name + " in " + filepath + " isn't a number!");
+			}
+			dimension.values.push_back(number);
+		}
+		if (dimension.values.empty())
+		{
+			throw std::runtime_error("Error: " + dimension.name + " in " + filepath + " has no values!");
+		}
+		grid.push_back(dimension);
+	}
+	return grid;
+}
+
+void ParameterSweep::applyValue(SolverParameters& params, const std::string& name, const float value)
+{
+	const int count = static_cast<int>(std::lround(value));
+	auto setLevels = [&](const std::string& field, int LevelSchedule::* member)
+	{
+		if (name == field)
+		{
+			for (auto& level : params.levels)
+			{
+				level.*member = count;
+			}
+			return true;
+		}
+		if (name.compare(0, field.size() + 1, field + ".") != 0)
+		{
+			return false;
+		}
+		const int level = std::atoi(name.c_str() + field.size() + 1);
+		if (level < 0 || level >= RecordedSolverControls::kMaxLevels)
+		{
+			throw std::runtime_error("Error: The sweep parameter " + name + " has no valid pyramid level!");
+		}
+		if (level >= static_cast<int>(params.levels.size()))
+		{
+			params.levels.resize(level + 1, params.levels.empty() ? LevelSchedule() : params.levels.back());
+		}
+		params.levels[level].*member = count;
+		return true;
+	};
+
+	if (name == "sparse_weight_exponent") params.sparse_weight_exponent = value;
+	else if (name == "dense_weight_exponent") params.dense_weight_exponent = value;
+	else if (name == "regularisation_weight_exponent") params.regularisation_weight_exponent = value;
+	else if (name == "num_shape_coefficients") params.num_shape_coefficients = count;
+	else if (name == "num_albedo_coefficients") params.num_albedo_coefficients = count;
+	else if (name == "num_expression_coefficients") params.num_expression_coefficients = count;
+	else if (!setLevels("num_gn_iterations", &LevelSchedule::num_gn_iterations) && !setLevels("num_pcg_iterations", &LevelSchedule::num_pcg_iterations))
+	{
+		throw std::runtime_error("Error: Unknown sweep parameter " + name + "!");
+	}
+}
+
+SolverParameters ParameterSweep::getConfiguration(int configuration, std::vector<float>& values) const
+{
+	//The last dimension varies fastest.
+	SolverParameters params(m_solver_parameters);
+	values.resize(m_grid.size());
+	for (int i = static_cast<int>(m_grid.size()) - 1; i >= 0; --i)
+	{
+		const auto& dimension = m_grid[i];
+		values[i] = dimension.values[configuration % dimension.values.size()];
+		configuration /= static_cast<int>(dimension.values.size());
+		applyValue(params, dimension.name, values[i]);
+	}
+	return params;
+}
+
+bool ParameterSweep::popConfiguration(int& configuration)
+{
+	configuration = m_next_configuration.fetch_add(1);
+	return configuration < static_cast<int>(m_results.size());
+}
+
+void ParameterSweep::run(const BenchmarkFixture& fixture)
+{
+	if (fixture.frames.empty())
+	{
+		throw std::runtime_error("Error: The sweep has no frames to solve!");
+	}
+
+	//CUDA events of the profiler belong to one device, the workers would share its pool.
+	util::Profiler::get().setEnabled(false);
+
+	//GLFW creates windows on the main thread only. Each worker makes its context current on its own thread.
+	std::vector<std::pair<int, GLFWwindow*>> workers;
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 5);
+	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+	glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+	for (int device : m_settings.devices)
+	{
+		for (int i = 0; i < m_settings.workers_per_device; ++i)
+		{
+			auto context = glfwCreateWindow(1, 1, "Face2Face sweep", nullptr, nullptr);
+			if (!context)
+			{
+				throw std::runtime_error("GLFW could not create the context of a worker");
+			}
+			workers.emplace_back(device, context);
+		}
+	}
+	auto main_context = glfwGetCurrentContext();
+	glfwMakeContextCurrent(nullptr);
+
+	std::cout << "Sweeping " << m_results.size() << " configurations over " << m_settings.devices.size() << " devices, "
+		<< workers.size() << " workers" << std::endl;
+	auto start = std::chrono::high_resolution_clock::now();
+	std::vector<std::thread> threads;
+	for (const auto& worker : workers)
+	{
+		threads.emplace_back(&ParameterSweep::runWorker, this, worker.first, worker.second, std::cref(fixture));
+	}
+	for (auto& thread : threads)
+	{
+		thread.join();
+	}
+
+	glfwMakeContextCurrent(main_context);
+	for (const auto& worker : workers)
+	{
+		glfwDestroyWindow(worker.second);
+	}
+
+	markParetoFront();
+	writeReport(fixture);
+
+	auto end = std::chrono::high_resolution_clock::now();
+	auto seconds = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() / 1000.0;
+	std::cout << "Swept " << m_results.size() << " configurations in " << seconds << " s, report written to " << m_settings.output_path << std::endl;
+}
+
+void ParameterSweep::runWorker(int device, void* context, const BenchmarkFixture& fixture)
+{
+	CHECK_CUDA_ERROR(cudaSetDevice(device));
+	glfwMakeContextCurrent(static_cast<GLFWwindow*>(context));
+
+	cudaDeviceProp properties;
+	CHECK_CUDA_ERROR(cudaGetDeviceProperties(&properties, device));
+
+	//Interop with a GL context on another GPU goes through copies, see BatchProcessor::runWorker.
+	bool cuda_rasterizer = false;
+	unsigned int gl_device_count = 0;
+	int gl_devices[8];
+	cudaGLGetDevices(&gl_device_count, gl_devices, 8, cudaGLDeviceListAll);
+	if (std::find(gl_devices, gl_devices + gl_device_count, device) == gl_devices + gl_device_count)
+	{
+		cuda_rasterizer = true;
+	}
+
+	{
+		GLSLProgram face_shader;
+		Face::attachShaders(face_shader);
+		face_shader.link();
+
+		//The first face loads the model to this device, the faces of the configurations share it.
+		Face model_face(m_settings.model_directory);
+		const int width = fixture.frames[0].cols;
+		const int height = fixture.frames[0].rows;
+		Pyramid pyramid(m_settings.number_of_pyramid_levels, width, height);
+
+		SolverParameters evaluation_parameters(m_solver_parameters);
+		evaluation_parameters.use_cuda_rasterizer = evaluation_parameters.use_cuda_rasterizer || cuda_rasterizer;
+		GaussNewtonSolver evaluator(evaluation_parameters);
+
+		const int n_frames = static_cast<int>(fixture.frames.size());
+		const int warmup = std::min(std::max(m_settings.warmup_frames, 0), n_frames - 1);
+		int configuration = 0;
+		while (popConfiguration(configuration))
+		{
+			auto& result = m_results[configuration];
+			SolverParameters params = getConfiguration(configuration, result.values);
+			params.use_cuda_rasterizer = params.use_cuda_rasterizer || cuda_rasterizer;
+
+			//A fresh face and solver per configuration, like a clip of the batch.
+			Face face(model_face.getModel());
+			face.getGraphicsSettings().shader = &face_shader;
+			GaussNewtonSolver solver(params);
+			glm::mat4 projection = glm::perspectiveRH_NO(glm::radians(60.0f), pyramid.getAspectRatio(), 0.01f, 10.0f);
+			face_shader.use();
+			face_shader.setMat4("projection", projection);
+
+			result.device_name = properties.name;
+			std::vector<float> frame_ms;
+			for (int i = 0; i < n_frames; ++i)
+			{
+				const auto& landmarks = fixture.landmarks[i];
+				auto frame_start = std::chrono::high_resolution_clock::now();
+				pyramid.uploadFrame(fixture.frames[i], solver.getStream());
+				solver.solve(landmarks, face, projection, pyramid);
+				CHECK_CUDA_ERROR(cudaStreamSynchronize(solver.getStream()));
+				auto frame_end = std::chrono::high_resolution_clock::now();
+				if (i < warmup)
+				{
+					continue;
+				}
+
+				frame_ms.push_back(std::chrono::duration_cast<std::chrono::microseconds>(frame_end - frame_start).count() / 1000.0f);
+				if (!landmarks.empty())
+				{
+					const auto quality = evaluator.evaluateFit(landmarks, face, projection, pyramid);
+					result.landmark_error += quality.landmark_error;
+					result.photometric_error += quality.photometric_error;
+					result.num_tracked_frames++;
+				}
+			}
+			result.num_frames = static_cast<int>(frame_ms.size());
+			result.frame_ms_p50 = percentile(frame_ms, 0.5f);
+			result.frame_ms_p90 = percentile(frame_ms, 0.9f);
+			const float scale = 1.0f / std::max(result.num_tracked_frames, 1);
+			result.landmark_error *= scale;
+			result.photometric_error *= scale;
+
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_num_done++;
+			std::cout << "Configuration " << configuration << " (" << m_num_done << "/" << m_results.size() << ") on " << result.device_name
+				<< ": " << result.frame_ms_p50 << " ms, landmark error " << result.landmark_error << " px, photometric error "
+				<< result.photometric_error << std::endl;
+		}
+	}
+
+	CHECK_CUDA_ERROR(cudaDeviceSynchronize());
+	glfwMakeContextCurrent(nullptr);
+}
+
+void ParameterSweep::markParetoFront()
+{
+	for (auto& result : m_results)
+	{
+		result.pareto = result.num_tracked_frames > 0;
+		for (const auto& other : m_results)
+		{
+			if (result.pareto && other.num_tracked_frames > 0 && dominates(other, result))
+			{
+				result.pareto = false;
+			}
+		}
+	}
+}
+
+void ParameterSweep::writeReport(const BenchmarkFixture& fixture) const
+{
+	std::ofstream file(m_settings.output_path);
+	if (!file.is_open())
+	{
+		throw std::runtime_error("Error: Could not open " + m_settings.output_path + " for writing!");
+	}
+
+	//The front from the fastest to the most accurate configuration.
+	std::vector<int> front;
+	for (int i = 0; i < m_results.size(); ++i)
+	{
+		if (m_results[i].pareto)
+		{
+			front.push_back(i);
+		}
+	}
+	std::sort(front.begin(), front.end(), [&](int a, int b) { return m_results[a].frame_ms_p50 < m_results[b].frame_ms_p50; });
+
+	file << "{" << std::endl
+		<< "  \"frames\": " << fixture.frames.size() << "," << std::endl
+		<< "  \"warmup_frames\": " << std::min(std::max(m_settings.warmup_frames, 0), static_cast<int>(fixture.frames.size()) - 1) << "," << std::endl
+		<< "  \"workers_per_device\": " << m_settings.workers_per_device << "," << std::endl
+		<< "  \"parameters\": [";
+	for (int i = 0; i < m_grid.size(); ++i)
+	{
+		file << (i > 0 ? ", " : "") << "\"" << escapeJson(m_grid[i].name) << "\"";
+	}
+	file << "]," << std::endl << "  \"pareto_front\": [";
+	for (int i = 0; i < front.size(); ++i)
+	{
+		file << (i > 0 ? ", " : "") << front[i];
+	}
+	file << "]," << std::endl << "  \"configurations\": [";
+	for (int i = 0; i < m_results.size(); ++i)
+	{
+		const auto& result = m_results[i];
+		file << (i > 0 ? "," : "") << std::endl
+			<< "    { \"configuration\": " << i << ", \"device\": \"" << escapeJson(result.device_name) << "\", \"values\": {";
+		for (int d = 0; d < m_grid.size(); ++d)
+		{
+			file << (d > 0 ? ", " : " ") << "\"" << escapeJson(m_grid[d].name) << "\": " << result.values[d];
+		}
+		file << " }," << std::endl
+			<< "      \"frames\": " << result.num_frames << ", \"tracked_frames\": " << result.num_tracked_frames
+			<< ", \"frame_ms_p50\": " << result.frame_ms_p50 << ", \"frame_ms_p90\": " << result.frame_ms_p90
+			<< ", \"landmark_error_px\": " << result.landmark_error << ", \"photometric_error\": " << result.photometric_error
+			<< ", \"pareto\": " << (result.pareto ? "true" : "false") << " }";
+	}
+	file << std::endl << "  ]" << std::endl << "}" << std::endl;
+
+	std::cout << "Pareto front, " << front.size() << " of " << m_results.size() << " configurations:" << std::endl;
+	for (int i : front)
+	{
+		const auto& result = m_results[i];
+		std::cout << "  " << i << ":";
+		for (int d = 0; d < m_grid.size(); ++d)
+		{
+			std::cout << " " << m_grid[d].name << "=" << result.values[d];
+		}
+		std::cout << " -> " << result.frame_ms_p50 << " ms, " << result.landmark_error << " px, " << result.photometric_error << std::endl;
+	}
+}
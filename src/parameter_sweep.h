@@ -0,0 +1,89 @@
+#pragma once
+
+#include "benchmark.h"
+#include "gauss_newton_solver.h"
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct SweepSettings
+{
+	std::string output_path; //JSON report, empty: no sweep
+	std::string grid_path; //the configurations, see ParameterSweep::parseGrid
+	std::string model_directory;
+	int number_of_pyramid_levels = 3;
+	int num_frames = 300; //measured per configuration
+	//Solved before the measured frames of every configuration, so its workspaces are allocated and its temporal state settled.
+	int warmup_frames = 10;
+	std::vector<int> devices; //empty: all devices
+	//Configurations solved at the same time on one device, each by a worker with its own GL context, solver and streams.
+	//More of them fill a large GPU, but their frame times include the waits for each other.
+	int workers_per_device = 1;
+};
+
+//One swept parameter and the values it takes, see ParameterSweep::applyValue for the names.
+struct SweepDimension
+{
+	std::string name;
+	std::vector<float> values;
+};
+
+struct SweepResult
+{
+	std::vector<float> values; //one per dimension of the grid
+	std::string device_name;
+	int num_frames = 0;
+	int num_tracked_frames = 0;
+	float frame_ms_p50 = 0.0f; //upload and solve, synchronized
+	float frame_ms_p90 = 0.0f;
+	//Means over the tracked frames, see FitQuality.
+	float landmark_error = 0.0f;
+	float photometric_error = 0.0f;
+	bool pareto = false; //no other configuration is at least as fast and as accurate in both errors, and better in one
+};
+
+//Solves the same frames and landmarks (see loadBenchmarkFixture) with every configuration of a grid over SolverParameters and
+//reports frame time against fit quality. The workers (workers_per_device per device, like the ones of BatchProcessor) take
+//the configurations from a shared queue. A configuration starts with a fresh face and solver from the parameters of the
+//application with its values applied, its fits are evaluated over all pixels by a solver of the unchanged parameters. The
+//solver controls of an input recording aren't applied, they would override the swept parameters.
+class ParameterSweep
+{
+public:
+	//Parses the grid, throws if it doesn't.
+	ParameterSweep(const SweepSettings& settings, const SolverParameters& solver_parameters);
+
+	//Must be called on the main thread, with GLFW initialized. Writes the report once every configuration is solved.
+	void run(const BenchmarkFixture& fixture);
+
+	int getNumberOfConfigurations() const { return static_cast<int>(m_results.size()); }
+	const std::vector<SweepResult>& getResults() const { return m_results; }
+
+	//One dimension per line, "<name> = <value>, <value>, ...", '#' starts a comment. The configurations are the Cartesian
+	//product of all lines.
+	static std::vector<SweepDimension> parseGrid(const std::string& filepath);
+	//Sets the parameter "name": sparse_weight_exponent, dense_weight_exponent, regularisation_weight_exponent,
+	//num_shape_coefficients, num_albedo_coefficients, num_expression_coefficients, num_gn_iterations and num_pcg_iterations.
+	//The last two set every pyramid level, "num_gn_iterations.<level>" one level (extending the schedule like --gn-iterations).
+	//Throws for any other name.
+	static void applyValue(SolverParameters& params, const std::string& name, float value);
+
+private:
+	//The parameters of a configuration and the value of each dimension.
+	SolverParameters getConfiguration(int configuration, std::vector<float>& values) const;
+	bool popConfiguration(int& configuration);
+	void runWorker(int device, void* context, const BenchmarkFixture& fixture);
+	void markParetoFront();
+	void writeReport(const BenchmarkFixture& fixture) const;
+
+private:
+	SweepSettings m_settings;
+	SolverParameters m_solver_parameters;
+	std::vector<SweepDimension> m_grid;
+	std::vector<SweepResult> m_results; //one per configuration, each written by the worker which solved it
+	std::atomic<int> m_next_configuration{ 0 };
+	std::mutex m_mutex; //guards the progress output
+	int m_num_done{ 0 };
+};
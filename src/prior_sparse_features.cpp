@@ -1,5 +1,8 @@
 #include "prior_sparse_features.h"
 
+#include <stdexcept>
+#include <string>
+
 PriorSparseFeatures::PriorSparseFeatures()
 {
 	m_prior_ids = {
@@ -64,6 +67,26 @@ PriorSparseFeatures::PriorSparseFeatures()
 		7858,
 		6955
 	};
+	m_original_prior_ids = m_prior_ids;
+}
+
+void PriorSparseFeatures::setVertexRemap(const std::vector<int>& original_vertex_ids, unsigned int number_of_original_vertices)
+{
+	std::vector<int> new_ids(number_of_original_vertices, -1);
+	for (int i = 0; i < static_cast<int>(original_vertex_ids.size()); ++i)
+	{
+		new_ids[original_vertex_ids[i]] = i;
+	}
+
+	for (size_t i = 0; i < m_original_prior_ids.size(); ++i)
+	{
+		const int original = m_original_prior_ids[i];
+		if (original >= static_cast<int>(new_ids.size()) || new_ids[original] < 0)
+		{
+			throw std::runtime_error("Error: The landmark vertex " + std::to_string(original) + " is not part of the model!");
+		}
+		m_prior_ids[i] = new_ids[original];
+	}
 }
 
 PriorSparseFeatures& PriorSparseFeatures::get()
@@ -9,9 +9,15 @@ public:
 	static PriorSparseFeatures& get();
 
 	const std::vector<int>& getPriorIds() { return m_prior_ids; };
+	//Ids in the model files, before Face::compactModel.
+	const std::vector<int>& getOriginalPriorIds() { return m_original_prior_ids; };
+	//original_vertex_ids[i] is the original id of vertex i of the compacted model. All faces share the model, so the remap
+	//is the same for every call.
+	void setVertexRemap(const std::vector<int>& original_vertex_ids, unsigned int number_of_original_vertices);
 
 private:
 	std::vector<int> m_prior_ids;
+	std::vector<int> m_original_prior_ids;
 
 private:
 	PriorSparseFeatures();
@@ -0,0 +1,444 @@
+#include "profiler.h"
+#include "util.h"
+
+#include <glad/glad.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#if defined(__has_include)
+#if __has_include(<nvtx3/nvToolsExt.h>)
+#include <nvtx3/nvToolsExt.h>
+#define HAS_NVTX 1
+#endif
+#endif
+
+namespace util
+{
+	static float percentile(std::vector<float>& values, float p)
+	{
+		if (values.empty())
+		{
+			return 0.0f;
+		}
+
+		size_t index = std::min(values.size() - 1, static_cast<size_t>(p * values.size()));
+		std::nth_element(values.begin(), values.begin() + index, values.end());
+		return values[index];
+	}
+
+	Profiler& Profiler::get()
+	{
+		static Profiler profiler;
+		return profiler;
+	}
+
+	void Profiler::beginFrame()
+	{
+		m_frame++;
+		if (isTracedFrame() && !m_trace_reference)
+		{
+			if (!m_trace_stream)
+			{
+				CHECK_CUDA_ERROR(cudaStreamCreateWithFlags(&m_trace_stream, cudaStreamNonBlocking));
+			}
+			m_trace_reference = acquireEvent();
+			CHECK_CUDA_ERROR(cudaEventRecord(m_trace_reference, m_trace_stream));
+			m_trace_start = std::chrono::high_resolution_clock::now();
+		}
+	}
+
+	void Profiler::endFrame()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			std::swap(m_pending, m_resolving);
+		}
+
+		std::vector<cudaEvent_t> released_events;
+		m_frame_samples.clear();
+		for (auto& pending : m_resolving)
+		{
+			Sample sample;
+			sample.frame = m_frame;
+			sample.cpu_ms = pending.cpu_ms;
+
+			//GL timings only exist in traces.
+			if (pending.gl_start)
+			{
+				if (isTracedFrame())
+				{
+					addTraceEvents(pending, sample);
+				}
+				m_free_gl_queries.push_back(pending.gl_start);
+				m_free_gl_queries.push_back(pending.gl_end);
+				continue;
+			}
+
+			if (pending.start && pending.end)
+			{
+				CHECK_CUDA_ERROR(cudaEventSynchronize(pending.end));
+				CHECK_CUDA_ERROR(cudaEventElapsedTime(&sample.gpu_ms, pending.start, pending.end));
+				released_events.push_back(pending.start);
+				released_events.push_back(pending.end);
+			}
+
+			if (isTracedFrame())
+			{
+				addTraceEvents(pending, sample);
+			}
+
+			auto& history = m_history[pending.name];
+			if (history.samples.empty())
+			{
+				history.order = static_cast<int>(m_history.size());
+				history.samples.reserve(kHistorySize);
+				history.cpu_metric = &Metrics::get().histogram("stage_cpu_ms", "Host time of a profiler stage.", "stage=\"" + pending.name + "\"");
+			}
+
+			history.cpu_metric->observe(sample.cpu_ms);
+			if (sample.gpu_ms >= 0.0f)
+			{
+				if (!history.gpu_metric)
+				{
+					history.gpu_metric = &Metrics::get().histogram("stage_gpu_ms", "Device time of a profiler stage.", "stage=\"" + pending.name + "\"");
+				}
+				history.gpu_metric->observe(sample.gpu_ms);
+			}
+
+			m_frame_samples.emplace_back(pending.name, sample);
+			if (history.samples.size() < kHistorySize)
+			{
+				history.samples.push_back(sample);
+			}
+			else
+			{
+				history.samples[history.next] = sample;
+			}
+			history.next = (history.next + 1) % kHistorySize;
+		}
+		m_resolving.clear();
+
+		if (isTracing() && m_frame >= m_trace_end_frame - 1)
+		{
+			released_events.push_back(m_trace_reference);
+			writeTrace();
+		}
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_free_events.insert(m_free_events.end(), released_events.begin(), released_events.end());
+	}
+
+	void Profiler::startTrace(const std::string& filepath, int first_frame, int num_frames)
+	{
+		if (m_trace_reference)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_free_events.push_back(m_trace_reference);
+		}
+		m_trace_reference = nullptr;
+		m_trace_events.clear();
+		m_trace_tracks.clear();
+		m_trace_track_ids.clear();
+		m_trace_threads.clear();
+		m_has_gl_reference = false;
+
+		m_trace_path = filepath;
+		m_trace_first_frame = std::max(first_frame, m_frame + 1);
+		m_trace_end_frame = m_trace_first_frame + std::max(num_frames, 1);
+	}
+
+	int Profiler::getTrack(const std::string& name)
+	{
+		auto result = m_trace_track_ids.emplace(name, static_cast<int>(m_trace_tracks.size()));
+		if (result.second)
+		{
+			m_trace_tracks.push_back(name);
+		}
+		return result.first->second;
+	}
+
+	void Profiler::addTraceEvents(const PendingSample& pending, const Sample& sample)
+	{
+		if (pending.gl_start)
+		{
+			GLuint64 start_ns = 0;
+			GLuint64 end_ns = 0;
+			glGetQueryObjectui64v(pending.gl_start, GL_QUERY_RESULT, &start_ns);
+			glGetQueryObjectui64v(pending.gl_end, GL_QUERY_RESULT, &end_ns);
+
+			TraceEvent event;
+			event.name = pending.name;
+			event.track = getTrack("GL");
+			event.start_us = m_gl_reference_us + (static_cast<long long>(start_ns) - m_gl_reference_ns) / 1000.0;
+			event.duration_us = (end_ns - start_ns) / 1000.0;
+			m_trace_events.push_back(std::move(event));
+			return;
+		}
+
+		auto thread = m_trace_threads.emplace(pending.thread, static_cast<int>(m_trace_threads.size()) + 1).first;
+		TraceEvent event;
+		event.name = pending.name;
+		event.track = getTrack("Thread " + std::to_string(thread->second));
+		event.start_us = std::chrono::duration<double, std::micro>(pending.host_start - m_trace_start).count();
+		event.duration_us = sample.cpu_ms * 1000.0;
+		m_trace_events.push_back(event);
+
+		if (sample.gpu_ms >= 0.0f)
+		{
+			float offset_ms = 0.0f;
+			CHECK_CUDA_ERROR(cudaEventElapsedTime(&offset_ms, m_trace_reference, pending.start));
+
+			std::ostringstream stream_name;
+			stream_name << "CUDA stream " << pending.stream;
+			event.track = getTrack(stream_name.str());
+			event.start_us = offset_ms * 1000.0;
+			event.duration_us = sample.gpu_ms * 1000.0;
+			m_trace_events.push_back(std::move(event));
+		}
+	}
+
+	static std::string escapeJson(const std::string& text)
+	{
+		std::string result;
+		for (char c : text)
+		{
+			if (c == '"' || c == '\\')
+			{
+				result += '\\';
+			}
+			result += c;
+		}
+		return result;
+	}
+
+	void Profiler::writeTrace()
+	{
+		std::ofstream file(m_trace_path);
+		if (!file.is_open())
+		{
+			std::cout << "Warning: Could not open " << m_trace_path << " for writing!" << std::endl;
+		}
+		else
+		{
+			file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[" << std::endl;
+			for (size_t i = 0; i < m_trace_tracks.size(); ++i)
+			{
+				file << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":" << i
+					<< ",\"args\":{\"name\":\"" << escapeJson(m_trace_tracks[i]) << "\"}}," << std::endl;
+			}
+			for (size_t i = 0; i < m_trace_events.size(); ++i)
+			{
+				const auto& event = m_trace_events[i];
+				file << "{\"name\":\"" << escapeJson(event.name) << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << event.track
+					<< ",\"ts\":" << event.start_us << ",\"dur\":" << event.duration_us << "}"
+					<< (i + 1 < m_trace_events.size() ? "," : "") << std::endl;
+			}
+			file << "]}" << std::endl;
+			std::cout << "Trace of frames " << m_trace_first_frame << " to " << m_trace_end_frame - 1 << " written to " << m_trace_path << std::endl;
+		}
+
+		m_trace_path.clear();
+		m_trace_reference = nullptr; //released by endFrame
+		m_trace_events.clear();
+		m_trace_tracks.clear();
+		m_trace_track_ids.clear();
+		m_trace_threads.clear();
+		m_has_gl_reference = false;
+	}
+
+	std::vector<std::pair<std::string, Profiler::Statistics>> Profiler::getStatistics() const
+	{
+		std::vector<std::pair<int, std::pair<std::string, Statistics>>> ordered;
+
+		std::vector<float> cpu, gpu;
+		for (const auto& entry : m_history)
+		{
+			cpu.clear();
+			gpu.clear();
+			for (const auto& sample : entry.second.samples)
+			{
+				cpu.push_back(sample.cpu_ms);
+				if (sample.gpu_ms >= 0.0f)
+				{
+					gpu.push_back(sample.gpu_ms);
+				}
+			}
+
+			Statistics statistics;
+			statistics.cpu_p50 = percentile(cpu, 0.50f);
+			statistics.cpu_p99 = percentile(cpu, 0.99f);
+			if (!gpu.empty())
+			{
+				statistics.gpu_p50 = percentile(gpu, 0.50f);
+				statistics.gpu_p99 = percentile(gpu, 0.99f);
+			}
+			ordered.push_back({ entry.second.order, { entry.first, statistics } });
+		}
+
+		std::sort(ordered.begin(), ordered.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+		std::vector<std::pair<std::string, Statistics>> result;
+		for (auto& entry : ordered)
+		{
+			result.push_back(std::move(entry.second));
+		}
+		return result;
+	}
+
+	void Profiler::dumpCsv(const std::string& filepath) const
+	{
+		std::ofstream file(filepath);
+		if (!file.is_open())
+		{
+			std::cout << "Warning: Could not open " << filepath << " for writing!" << std::endl;
+			return;
+		}
+
+		file << "frame,stage,cpu_ms,gpu_ms" << std::endl;
+		for (const auto& entry : m_history)
+		{
+			for (const auto& sample : entry.second.samples)
+			{
+				file << sample.frame << "," << entry.first << "," << sample.cpu_ms << ",";
+				if (sample.gpu_ms >= 0.0f)
+				{
+					file << sample.gpu_ms;
+				}
+				file << std::endl;
+			}
+		}
+	}
+
+	cudaEvent_t Profiler::acquireEvent()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_free_events.empty())
+		{
+			cudaEvent_t event;
+			CHECK_CUDA_ERROR(cudaEventCreate(&event));
+			return event;
+		}
+
+		auto event = m_free_events.back();
+		m_free_events.pop_back();
+		return event;
+	}
+
+	unsigned int Profiler::acquireGlQuery()
+	{
+		if (m_free_gl_queries.empty())
+		{
+			GLuint query;
+			glGenQueries(1, &query);
+			return query;
+		}
+
+		auto query = m_free_gl_queries.back();
+		m_free_gl_queries.pop_back();
+		return query;
+	}
+
+	void Profiler::submit(PendingSample&& sample)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_pending.push_back(std::move(sample));
+	}
+
+	ScopedTimer::ScopedTimer(std::string name, bool gpu, cudaStream_t stream)
+		: m_name(std::move(name))
+		, m_stream(stream)
+		, m_enabled(Profiler::get().isEnabled())
+	{
+		if (!m_enabled)
+		{
+			return;
+		}
+
+#ifdef HAS_NVTX
+		nvtxRangePushA(m_name.c_str());
+#endif
+
+		if (gpu)
+		{
+			cudaStreamCaptureStatus capture_status;
+			CHECK_CUDA_ERROR(cudaStreamIsCapturing(m_stream, &capture_status));
+			if (capture_status == cudaStreamCaptureStatusNone)
+			{
+				m_start = Profiler::get().acquireEvent();
+				CHECK_CUDA_ERROR(cudaEventRecord(m_start, m_stream));
+			}
+		}
+
+		m_host_start = std::chrono::high_resolution_clock::now();
+	}
+
+	ScopedTimer::~ScopedTimer()
+	{
+		if (!m_enabled)
+		{
+			return;
+		}
+
+		auto host_end = std::chrono::high_resolution_clock::now();
+
+		Profiler::PendingSample sample;
+		sample.name = std::move(m_name);
+		sample.cpu_ms = std::chrono::duration_cast<std::chrono::microseconds>(host_end - m_host_start).count() / 1000.0f;
+		sample.host_start = m_host_start;
+		sample.thread = std::this_thread::get_id();
+		sample.stream = m_stream;
+
+		if (m_start)
+		{
+			sample.start = m_start;
+			sample.end = Profiler::get().acquireEvent();
+			CHECK_CUDA_ERROR(cudaEventRecord(sample.end, m_stream));
+		}
+
+#ifdef HAS_NVTX
+		nvtxRangePop();
+#endif
+
+		Profiler::get().submit(std::move(sample));
+	}
+
+	ScopedGlTimer::ScopedGlTimer(std::string name)
+		: m_name(std::move(name))
+	{
+		auto& profiler = Profiler::get();
+		if (!profiler.isTracedFrame())
+		{
+			return;
+		}
+
+		if (!profiler.m_has_gl_reference)
+		{
+			GLint64 timestamp = 0;
+			glGetInteger64v(GL_TIMESTAMP, &timestamp);
+			profiler.m_gl_reference_ns = timestamp;
+			profiler.m_gl_reference_us = std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - profiler.m_trace_start).count();
+			profiler.m_has_gl_reference = true;
+		}
+
+		m_start = profiler.acquireGlQuery();
+		glQueryCounter(m_start, GL_TIMESTAMP);
+	}
+
+	ScopedGlTimer::~ScopedGlTimer()
+	{
+		if (!m_start)
+		{
+			return;
+		}
+
+		auto& profiler = Profiler::get();
+		Profiler::PendingSample sample;
+		sample.name = std::move(m_name);
+		sample.gl_start = m_start;
+		sample.gl_end = profiler.acquireGlQuery();
+		glQueryCounter(sample.gl_end, GL_TIMESTAMP);
+		profiler.submit(std::move(sample));
+	}
+}
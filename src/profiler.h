@@ -0,0 +1,201 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <map>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <cuda_runtime.h>
+
+#include "metrics.h"
+
+namespace util
+{
+	//Collects host and GPU timings of named stages. GPU times are measured with CUDA events and resolved in endFrame(),
+	//so taking a timing never syncs in the middle of the frame. Timers may be taken on any thread, frames are ended on one.
+	class Profiler
+	{
+	public:
+		struct Sample
+		{
+			int frame = 0;
+			float cpu_ms = 0.0f;
+			float gpu_ms = -1.0f; //negative, if the stage has no GPU timing
+		};
+
+		struct Statistics
+		{
+			float cpu_p50 = 0.0f;
+			float cpu_p99 = 0.0f;
+			float gpu_p50 = -1.0f;
+			float gpu_p99 = -1.0f;
+		};
+
+		static constexpr int kHistorySize = 300; //frames kept per stage
+
+		static Profiler& get();
+
+		//Atomic, the menu toggles it while the timers of other threads read it.
+		void setEnabled(bool enabled) { m_enabled.store(enabled, std::memory_order_relaxed); }
+		bool isEnabled() const { return m_enabled.load(std::memory_order_relaxed); }
+
+		void beginFrame();
+		//Resolves the GPU timings of this frame and moves all samples into the ring buffers and the latency histograms of Metrics.
+		void endFrame();
+
+		//Drops the samples of all stages, e.g. those of warmup frames. Call it between frames, on the thread which ends them.
+		void clearHistory() { m_history.clear(); }
+
+		//The samples of the last ended frame, in the order their timers ended. Call it on the thread which ends the frames.
+		const std::vector<std::pair<std::string, Sample>>& getFrameSamples() const { return m_frame_samples; }
+		//Rolling p50/p99 of every stage, ordered by first appearance.
+		std::vector<std::pair<std::string, Statistics>> getStatistics() const;
+		void dumpCsv(const std::string& filepath) const;
+
+		//Records frames [first_frame, first_frame + num_frames) as Chrome trace-event JSON (chrome://tracing, ui.perfetto.dev)
+		//and writes it to "filepath" once the last of them ends. Frames count from 1 at the first beginFrame, see getFrame.
+		//Host stages are on a track per thread, GPU timings on a track per stream and ScopedGlTimer on a GL track. Replaces a
+		//trace in progress. Call it on the thread which ends the frames.
+		void startTrace(const std::string& filepath, int first_frame, int num_frames);
+		bool isTracing() const { return !m_trace_path.empty(); }
+		int getFrame() const { return m_frame; }
+
+	private:
+		friend class ScopedTimer;
+		friend class ScopedGlTimer;
+
+		struct PendingSample
+		{
+			std::string name;
+			float cpu_ms = 0.0f;
+			cudaEvent_t start = nullptr;
+			cudaEvent_t end = nullptr;
+			//Only for traces.
+			std::chrono::high_resolution_clock::time_point host_start;
+			std::thread::id thread;
+			cudaStream_t stream = nullptr;
+			unsigned int gl_start = 0; //GL_TIMESTAMP queries of ScopedGlTimer, which has no host timing
+			unsigned int gl_end = 0;
+		};
+
+		struct TraceEvent
+		{
+			std::string name;
+			int track = 0;
+			double start_us = 0.0;
+			double duration_us = 0.0;
+		};
+
+		struct History
+		{
+			int order = 0;
+			int next = 0;
+			std::vector<Sample> samples;
+			Histogram* cpu_metric = nullptr; //stage_cpu_ms of the stage, see Metrics
+			Histogram* gpu_metric = nullptr; //stage_gpu_ms, null until the stage had a GPU timing
+		};
+
+		cudaEvent_t acquireEvent();
+		unsigned int acquireGlQuery();
+		void submit(PendingSample&& sample);
+
+		bool isTracedFrame() const { return isTracing() && m_frame >= m_trace_first_frame && m_frame < m_trace_end_frame; }
+		void addTraceEvents(const PendingSample& pending, const Sample& sample);
+		int getTrack(const std::string& name);
+		void writeTrace();
+
+	private:
+		std::atomic<bool> m_enabled{ true };
+		int m_frame{ 0 };
+		std::mutex m_mutex; //guards m_free_events and m_pending
+		std::vector<cudaEvent_t> m_free_events;
+		std::vector<PendingSample> m_pending;
+		std::vector<PendingSample> m_resolving;
+		std::map<std::string, History> m_history;
+		std::vector<std::pair<std::string, Sample>> m_frame_samples;
+
+		//See startTrace. GPU timestamps are relative to m_trace_reference, an event recorded on an idle stream when the first
+		//frame of the trace begins, GL ones to a GL_TIMESTAMP taken with the first GL timing. Both are aligned to the host
+		//clock at that moment, up to the latency of the event or query.
+		std::string m_trace_path;
+		int m_trace_first_frame{ 0 };
+		int m_trace_end_frame{ 0 };
+		std::vector<TraceEvent> m_trace_events;
+		std::vector<std::string> m_trace_tracks; //names, a track's index is its tid
+		std::map<std::string, int> m_trace_track_ids;
+		std::map<std::thread::id, int> m_trace_threads; //numbers of the host tracks
+		std::chrono::high_resolution_clock::time_point m_trace_start;
+		cudaStream_t m_trace_stream{ nullptr };
+		cudaEvent_t m_trace_reference{ nullptr };
+		bool m_has_gl_reference{ false };
+		long long m_gl_reference_ns{ 0 };
+		double m_gl_reference_us{ 0.0 }; //host time of m_gl_reference_ns since m_trace_start
+		std::vector<unsigned int> m_free_gl_queries;
+
+	private:
+		Profiler() = default;
+		Profiler(const Profiler&) = delete;
+		Profiler(Profiler&&) = delete;
+	};
+
+	//Begins a frame of the Profiler and ends it when it goes out of scope, also on the paths which leave a frame early (continue,
+	//break, exceptions). end() ends it before, e.g. to read getFrameSamples.
+	class ScopedFrame
+	{
+	public:
+		ScopedFrame() { Profiler::get().beginFrame(); }
+		~ScopedFrame() { end(); }
+
+		ScopedFrame(const ScopedFrame&) = delete;
+		ScopedFrame& operator=(const ScopedFrame&) = delete;
+
+		void end()
+		{
+			if (!m_ended)
+			{
+				m_ended = true;
+				Profiler::get().endFrame();
+			}
+		}
+
+	private:
+		bool m_ended{ false };
+	};
+
+	//Times its own lifetime on the host and, if "gpu" is set, on "stream". Also opens an NVTX range of the same name.
+	//GPU timing is skipped while "stream" is captured into a CUDA graph.
+	class ScopedTimer
+	{
+	public:
+		explicit ScopedTimer(std::string name, bool gpu = false, cudaStream_t stream = 0);
+		~ScopedTimer();
+
+		ScopedTimer(const ScopedTimer&) = delete;
+		ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+	private:
+		std::string m_name;
+		cudaStream_t m_stream;
+		cudaEvent_t m_start{ nullptr };
+		std::chrono::high_resolution_clock::time_point m_host_start;
+		bool m_enabled;
+	};
+
+	//Times its own lifetime on the GPU with GL_TIMESTAMP queries, e.g. a render pass. Only while a trace is recorded, resolving
+	//the queries waits for the GL commands of the frame. Must be used on the thread of the GL context, which ends the frames.
+	class ScopedGlTimer
+	{
+	public:
+		explicit ScopedGlTimer(std::string name);
+		~ScopedGlTimer();
+
+		ScopedGlTimer(const ScopedGlTimer&) = delete;
+		ScopedGlTimer& operator=(const ScopedGlTimer&) = delete;
+
+	private:
+		std::string m_name;
+		unsigned int m_start{ 0 };
+	};
+}
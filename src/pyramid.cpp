@@ -1,81 +1,383 @@
 #include "pyramid.h"
 
-Pyramid::Pyramid(int number_of_levels, int top_width, int top_height)
-	: m_face_framebuffer(number_of_levels, 0)
-	, m_rt_rgb(number_of_levels, 0)
-	, m_rt_barycentrics(number_of_levels, 0)
-	, m_rt_vertex_ids(number_of_levels, 0)
-	, m_rt_rgb_cuda_resource(number_of_levels, nullptr)
-	, m_rt_barycentrics_cuda_resource(number_of_levels, nullptr)
-	, m_rt_vertex_ids_cuda_resource(number_of_levels, nullptr)
-	, m_depth_buffer(number_of_levels, 0)
-	, m_widths(number_of_levels)
-	, m_heights(number_of_levels)
-{
-	m_widths[0] = top_width;
-	m_heights[0] = top_height;
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include "opencv2/imgproc/imgproc.hpp"
+
+Pyramid::Pyramid(int number_of_levels, int top_width, int top_height, bool packed_visibility, int roi_size, bool atlas)
+	: m_packed_visibility(packed_visibility)
+	, m_roi_size(roi_size)
+	, m_atlas(atlas)
+{
+	createResources(number_of_levels, top_width, top_height);
+}
+
+Pyramid::~Pyramid()
+{
+	destroyResources();
+}
+
+void Pyramid::resize(int top_width, int top_height)
+{
+	reconfigure(getNumberOfLevels(), top_width, top_height, m_roi_size);
+}
+
+void Pyramid::reconfigure(int number_of_levels, int top_width, int top_height, int roi_size)
+{
+	if (number_of_levels == getNumberOfLevels() && top_width == m_widths[0] && top_height == m_heights[0] && roi_size == m_roi_size)
+	{
+		return;
+	}
+
+	//The buffers may still be read or written by work of any stream, e.g. the solve of the last frame.
+	CHECK_CUDA_ERROR(cudaDeviceSynchronize());
+	destroyResources();
+	m_roi_size = roi_size;
+	createResources(number_of_levels, top_width, top_height);
+}
+
+void Pyramid::createResources(int number_of_levels, int top_width, int top_height)
+{
+	if (number_of_levels < 1 || top_width < 1 || top_height < 1)
+	{
+		throw std::runtime_error("Error: A pyramid needs at least one level of at least one pixel!");
+	}
+
+	m_widths.assign(number_of_levels, top_width);
+	m_heights.assign(number_of_levels, top_height);
 	for (int i = 1; i < number_of_levels; ++i)
 	{
 		m_widths[i] = m_widths[i - 1] / 2;
 		m_heights[i] = m_heights[i - 1] / 2;
 	}
 
+	//Render targets are created by the first setGraphicsSettings of their level, the atlas by the first of any level.
+	const int n_targets = m_atlas ? 1 : number_of_levels;
+	m_targets.assign(n_targets, RenderTargets());
+	m_roi_targets.assign(m_roi_size > 0 ? n_targets : 0, RenderTargets());
+	createFrameBuffers(m_buffers[0]);
+	m_current = 0;
+	m_prefetched = false;
+	m_frame_texture_stale = false;
+
+	const int n_frame_bytes = 3 * top_width * top_height;
+	CHECK_CUDA_ERROR(cudaMallocHost(&m_frame_host, n_frame_bytes));
+	CHECK_CUDA_ERROR(cudaEventCreateWithFlags(&m_frame_copied, cudaEventDisableTiming));
+
+	// background texture, written by CUDA
+	glGenTextures(1, &m_frame_texture);
+	glBindTexture(GL_TEXTURE_2D, m_frame_texture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, top_width, top_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	CHECK_CUDA_ERROR(cudaGraphicsGLRegisterImage(&m_frame_texture_resource, m_frame_texture, GL_TEXTURE_2D, cudaGraphicsRegisterFlagsSurfaceLoadStore));
+}
+
+void Pyramid::destroyResources()
+{
+	if (m_frame_surface)
+	{
+		CHECK_CUDA_ERROR(cudaDestroySurfaceObject(m_frame_surface));
+		m_frame_surface = 0;
+		m_frame_surface_array = nullptr;
+	}
+	CHECK_CUDA_ERROR(cudaGraphicsUnregisterResource(m_frame_texture_resource));
+	m_frame_texture_resource = nullptr;
+	glDeleteTextures(1, &m_frame_texture);
+	m_frame_texture = 0;
+	for (auto& buffers : m_buffers)
+	{
+		destroyFrameBuffers(buffers);
+	}
+	CHECK_CUDA_ERROR(cudaEventDestroy(m_frame_copied));
+	m_frame_copied = nullptr;
+	CHECK_CUDA_ERROR(cudaFreeHost(m_frame_host));
+	m_frame_host = nullptr;
+
+	for (auto& targets : m_targets)
+	{
+		destroyRenderTargets(targets);
+	}
+	for (auto& targets : m_roi_targets)
+	{
+		destroyRenderTargets(targets);
+	}
+}
+
+void Pyramid::createFrameBuffers(FrameBuffers& buffers) const
+{
+	util::ScopedAllocationTag tag("frame");
+	const int number_of_levels = getNumberOfLevels();
+	buffers.raw_frame = util::DeviceArray<uchar>(3 * m_widths[0] * m_heights[0]);
+	buffers.frames.resize(number_of_levels);
+	buffers.gradients.resize(number_of_levels);
 	for (int i = 0; i < number_of_levels; ++i)
 	{
-		glGenFramebuffers(1, &m_face_framebuffer[i]);
-		glBindFramebuffer(GL_FRAMEBUFFER, m_face_framebuffer[i]);
+		buffers.frames[i] = util::DeviceArray<uchar>(3 * m_widths[i] * m_heights[i]);
 
-		// RGB render texture
-		glGenTextures(1, &m_rt_rgb[i]);
-		glBindTexture(GL_TEXTURE_2D, m_rt_rgb[i]);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, m_widths[i], m_heights[i], 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-		glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, m_rt_rgb[i], 0);
-		CHECK_CUDA_ERROR(cudaGraphicsGLRegisterImage(&m_rt_rgb_cuda_resource[i], m_rt_rgb[i], GL_TEXTURE_2D, cudaGraphicsRegisterFlagsNone));
+		auto& gradients = buffers.gradients[i];
+		gradients.pitch = (m_widths[i] + 15) / 16 * 16; //keeps every row aligned to 256 bytes, as pitched textures want
+		gradients.x = util::DeviceArray<float4>(gradients.pitch * m_heights[i]);
+		gradients.y = util::DeviceArray<float4>(gradients.pitch * m_heights[i]);
+
+		cudaResourceDesc res_desc;
+		memset(&res_desc, 0, sizeof(res_desc));
+		res_desc.resType = cudaResourceTypePitch2D;
+		res_desc.res.pitch2D.width = m_widths[i];
+		res_desc.res.pitch2D.height = m_heights[i];
+		res_desc.res.pitch2D.desc = cudaCreateChannelDesc<float4>();
+		res_desc.res.pitch2D.pitchInBytes = gradients.pitch * sizeof(float4);
+
+		cudaTextureDesc tex_desc;
+		memset(&tex_desc, 0, sizeof(tex_desc));
+		tex_desc.addressMode[0] = cudaTextureAddressMode(cudaAddressModeClamp);
+		tex_desc.addressMode[1] = cudaTextureAddressMode(cudaAddressModeClamp);
+		tex_desc.filterMode = cudaTextureFilterMode(cudaFilterModeLinear);
+		tex_desc.readMode = cudaReadModeElementType;
+		tex_desc.normalizedCoords = 0;
+
+		res_desc.res.pitch2D.devPtr = gradients.x.getPtr();
+		CHECK_CUDA_ERROR(cudaCreateTextureObject(&gradients.texture_x, &res_desc, &tex_desc, nullptr));
+		res_desc.res.pitch2D.devPtr = gradients.y.getPtr();
+		CHECK_CUDA_ERROR(cudaCreateTextureObject(&gradients.texture_y, &res_desc, &tex_desc, nullptr));
+	}
+	CHECK_CUDA_ERROR(cudaEventCreateWithFlags(&buffers.released, cudaEventDisableTiming));
+	CHECK_CUDA_ERROR(cudaEventCreateWithFlags(&buffers.built, cudaEventDisableTiming));
+}
+
+void Pyramid::destroyFrameBuffers(FrameBuffers& buffers)
+{
+	if (!buffers.released)
+	{
+		return; //never created
+	}
+	for (auto& gradients : buffers.gradients)
+	{
+		CHECK_CUDA_ERROR(cudaDestroyTextureObject(gradients.texture_x));
+		CHECK_CUDA_ERROR(cudaDestroyTextureObject(gradients.texture_y));
+	}
+	CHECK_CUDA_ERROR(cudaEventDestroy(buffers.released));
+	CHECK_CUDA_ERROR(cudaEventDestroy(buffers.built));
+	buffers = FrameBuffers(); //frees the device arrays
+}
+
+Pyramid::RenderTargets Pyramid::createRenderTargets(int width, int height, bool packed_visibility)
+{
+	RenderTargets targets;
+	targets.width = width;
+	targets.height = height;
 
+	glGenFramebuffers(1, &targets.framebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, targets.framebuffer);
+
+	// RGB render texture
+	glGenTextures(1, &targets.rgb);
+	glBindTexture(GL_TEXTURE_2D, targets.rgb);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, targets.rgb, 0);
+	CHECK_CUDA_ERROR(cudaGraphicsGLRegisterImage(&targets.rgb_cuda_resource, targets.rgb, GL_TEXTURE_2D, cudaGraphicsRegisterFlagsNone));
+
+	if (packed_visibility)
+	{
+		// packed visibility render texture, see face.frag
+		glGenTextures(1, &targets.visibility);
+		glBindTexture(GL_TEXTURE_2D, targets.visibility);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32UI, width, height, 0, GL_RG_INTEGER, GL_UNSIGNED_INT, 0);
+		glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT3, targets.visibility, 0);
+		CHECK_CUDA_ERROR(cudaGraphicsGLRegisterImage(&targets.visibility_cuda_resource, targets.visibility, GL_TEXTURE_2D, cudaGraphicsRegisterFlagsNone));
+	}
+	else
+	{
 		// barycentrics render texture
-		glGenTextures(1, &m_rt_barycentrics[i]);
-		glBindTexture(GL_TEXTURE_2D, m_rt_barycentrics[i]);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, m_widths[i], m_heights[i], 0, GL_RGBA, GL_FLOAT, 0);
+		glGenTextures(1, &targets.barycentrics);
+		glBindTexture(GL_TEXTURE_2D, targets.barycentrics);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width, height, 0, GL_RGBA, GL_FLOAT, 0);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-		glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, m_rt_barycentrics[i], 0);
-		CHECK_CUDA_ERROR(cudaGraphicsGLRegisterImage(&m_rt_barycentrics_cuda_resource[i], m_rt_barycentrics[i], GL_TEXTURE_2D, cudaGraphicsRegisterFlagsNone));
+		glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, targets.barycentrics, 0);
+		CHECK_CUDA_ERROR(cudaGraphicsGLRegisterImage(&targets.barycentrics_cuda_resource, targets.barycentrics, GL_TEXTURE_2D, cudaGraphicsRegisterFlagsNone));
 
 		// vertex ID render texture
-		glGenTextures(1, &m_rt_vertex_ids[i]);
-		glBindTexture(GL_TEXTURE_2D, m_rt_vertex_ids[i]);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32I, m_widths[i], m_heights[i], 0, GL_RGBA_INTEGER, GL_INT, 0);
-		glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, m_rt_vertex_ids[i], 0);
-		CHECK_CUDA_ERROR(cudaGraphicsGLRegisterImage(&m_rt_vertex_ids_cuda_resource[i], m_rt_vertex_ids[i], GL_TEXTURE_2D, cudaGraphicsRegisterFlagsNone));
-
-		GLenum draw_buffers[3] = { GL_COLOR_ATTACHMENT0,GL_COLOR_ATTACHMENT1,GL_COLOR_ATTACHMENT2 };
-		glDrawBuffers(3, draw_buffers); // "3" is the size of draw_buffers
-		glGenRenderbuffers(1, &m_depth_buffer[i]);
-		glBindRenderbuffer(GL_RENDERBUFFER, m_depth_buffer[i]);
-		glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT, m_widths[i], m_heights[i]);
-		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, m_depth_buffer[i]);
-
-		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		glGenTextures(1, &targets.vertex_ids);
+		glBindTexture(GL_TEXTURE_2D, targets.vertex_ids);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32I, width, height, 0, GL_RGBA_INTEGER, GL_INT, 0);
+		glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, targets.vertex_ids, 0);
+		CHECK_CUDA_ERROR(cudaGraphicsGLRegisterImage(&targets.vertex_ids_cuda_resource, targets.vertex_ids, GL_TEXTURE_2D, cudaGraphicsRegisterFlagsNone));
+	}
+
+	// The outputs of face.frag without a target are dropped. Draw buffer 3 exists either way, so Face::draw can clear it.
+	GLenum draw_buffers[4] = { GL_COLOR_ATTACHMENT0, packed_visibility ? GL_NONE : GL_COLOR_ATTACHMENT1,
+		packed_visibility ? GL_NONE : GL_COLOR_ATTACHMENT2, packed_visibility ? GL_COLOR_ATTACHMENT3 : GL_NONE };
+	glDrawBuffers(4, draw_buffers);
+	glGenRenderbuffers(1, &targets.depth_buffer);
+	glBindRenderbuffer(GL_RENDERBUFFER, targets.depth_buffer);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT, width, height);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, targets.depth_buffer);
+
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+	{
+		throw std::runtime_error("Error: Failed to create the framebuffer!");
+	}
+
+	return targets;
+}
+
+void Pyramid::destroyRenderTargets(RenderTargets& targets)
+{
+	if (!targets.framebuffer)
+	{
+		return; //never created
+	}
+	CHECK_CUDA_ERROR(cudaGraphicsUnregisterResource(targets.rgb_cuda_resource));
+	for (auto resource : { targets.barycentrics_cuda_resource, targets.vertex_ids_cuda_resource, targets.visibility_cuda_resource })
+	{
+		if (resource)
 		{
-			throw std::runtime_error("Error: Failed to create the framebuffer!");
+			CHECK_CUDA_ERROR(cudaGraphicsUnregisterResource(resource));
 		}
 	}
+	//Deleting texture 0 is ignored.
+	GLuint textures[4] = { targets.rgb, targets.barycentrics, targets.vertex_ids, targets.visibility };
+	glDeleteTextures(4, textures);
+	glDeleteRenderbuffers(1, &targets.depth_buffer);
+	glDeleteFramebuffers(1, &targets.framebuffer);
+	targets = RenderTargets();
+}
+
+glm::ivec2 Pyramid::getTargetSize(const bool roi, const int pyramid_level) const
+{
+	glm::ivec2 size(m_widths[pyramid_level], m_heights[pyramid_level]);
+	return roi ? glm::min(size, glm::ivec2(m_roi_size)) : size;
+}
+
+glm::ivec2 Pyramid::getAtlasOffset(const bool roi, const int pyramid_level) const
+{
+	if (!m_atlas || pyramid_level == 0)
+	{
+		return glm::ivec2(0);
+	}
+
+	//Level 1 at the bottom of the right column, the next ones on top of it.
+	glm::ivec2 offset(getTargetSize(roi, 0).x, 0);
+	for (int i = 1; i < pyramid_level; ++i)
+	{
+		offset.y += getTargetSize(roi, i).y;
+	}
+	return offset;
+}
+
+const Pyramid::RenderTargets& Pyramid::getRenderTargets(const bool roi, const int pyramid_level) const
+{
+	auto& targets = roi ? m_roi_targets : m_targets;
+	auto& level_targets = targets[m_atlas ? 0 : pyramid_level];
+	if (!level_targets.framebuffer)
+	{
+		glm::ivec2 size = getTargetSize(roi, pyramid_level);
+		if (m_atlas)
+		{
+			//Every level has half the size of the one before, so the right column is about as high as level 0.
+			const int n_levels = getNumberOfLevels();
+			size = getTargetSize(roi, 0);
+			if (n_levels > 1)
+			{
+				const auto top = getAtlasOffset(roi, n_levels - 1) + getTargetSize(roi, n_levels - 1);
+				size = glm::max(size, top);
+			}
+		}
+		level_targets = createRenderTargets(size.x, size.y, m_packed_visibility);
+	}
+	return level_targets;
+}
+
+void Pyramid::setTargets(const bool roi, const int pyramid_level, Face::GraphicsSettings& graphics_settings) const
+{
+	const auto& targets = getRenderTargets(roi, pyramid_level);
+	const auto size = getTargetSize(roi, pyramid_level);
+	const auto offset = getAtlasOffset(roi, pyramid_level);
+	graphics_settings.framebuffer = targets.framebuffer;
+	graphics_settings.rt_rgb = targets.rgb;
+	graphics_settings.rt_rgb_cuda_resource = targets.rgb_cuda_resource;
+	graphics_settings.rt_barycentrics_cuda_resource = targets.barycentrics_cuda_resource;
+	graphics_settings.rt_vertex_ids_cuda_resource = targets.vertex_ids_cuda_resource;
+	graphics_settings.rt_visibility_cuda_resource = targets.visibility_cuda_resource;
+	graphics_settings.texture_width = size.x;
+	graphics_settings.texture_height = size.y;
+	graphics_settings.target_x = offset.x;
+	graphics_settings.target_y = offset.y;
+	graphics_settings.atlas_width = targets.width;
+	graphics_settings.atlas_height = targets.height;
+	graphics_settings.atlas = m_atlas;
 }
 
 void Pyramid::setGraphicsSettings(int pyramid_level, Face::GraphicsSettings& graphics_settings) const
 {
-	if (pyramid_level >= m_face_framebuffer.size())
+	if (pyramid_level >= getNumberOfLevels())
+	{
+		throw std::runtime_error("Error: Invalid pyramid_level index!");
+	}
+
+	setTargets(false, pyramid_level, graphics_settings);
+	graphics_settings.crop = glm::mat4(1.0f);
+	graphics_settings.roi_x = 0;
+	graphics_settings.roi_y = 0;
+	graphics_settings.roi_stride = 1;
+}
+
+void Pyramid::setRoiGraphicsSettings(int pyramid_level, const glm::vec4& face_rect, Face::GraphicsSettings& graphics_settings) const
+{
+	if (m_roi_targets.empty())
+	{
+		setGraphicsSettings(pyramid_level, graphics_settings);
+		return;
+	}
+	if (pyramid_level >= getNumberOfLevels())
 	{
 		throw std::runtime_error("Error: Invalid pyramid_level index!");
 	}
 
-	graphics_settings.framebuffer = m_face_framebuffer[pyramid_level];
-	graphics_settings.rt_rgb = m_rt_rgb[pyramid_level];
-	graphics_settings.rt_rgb_cuda_resource = m_rt_rgb_cuda_resource[pyramid_level];
-	graphics_settings.rt_barycentrics_cuda_resource = m_rt_barycentrics_cuda_resource[pyramid_level];
-	graphics_settings.rt_vertex_ids_cuda_resource = m_rt_vertex_ids_cuda_resource[pyramid_level];
-	graphics_settings.texture_width = m_widths[pyramid_level];
-	graphics_settings.texture_height = m_heights[pyramid_level];
+	setTargets(true, pyramid_level, graphics_settings);
+	const auto targets = getTargetSize(true, pyramid_level);
+
+	//Every target pixel samples the center of a frame pixel, a window larger than the targets skips pixels.
+	const int width = m_widths[pyramid_level];
+	const int height = m_heights[pyramid_level];
+	const float rect_width = face_rect.z * width;
+	const float rect_height = face_rect.w * height;
+	const int stride = std::max(1, static_cast<int>(std::ceil(std::max(rect_width / targets.x, rect_height / targets.y))));
+	const int window_width = targets.x * stride;
+	const int window_height = targets.y * stride;
+
+	//Centered on the face and moved into the frame where it fits, pixels outside of the frame are dropped by the solver.
+	const float center_x = (face_rect.x + 0.5f * face_rect.z) * width;
+	const float center_y = (face_rect.y + 0.5f * face_rect.w) * height;
+	const int roi_x = std::min(std::max(static_cast<int>(std::lround(center_x - 0.5f * window_width)), 0), std::max(width - window_width, 0));
+	const int roi_y = std::min(std::max(static_cast<int>(std::lround(center_y - 0.5f * window_height)), 0), std::max(height - window_height, 0));
+	graphics_settings.roi_x = roi_x;
+	graphics_settings.roi_y = roi_y;
+	graphics_settings.roi_stride = stride;
+
+	//Edges of the window in frame pixels, mapped to -1 and 1. NDC y points up, the rows go down.
+	const float left = roi_x + 0.5f - 0.5f * stride;
+	const float top = roi_y + 0.5f - 0.5f * stride;
+	glm::mat4 crop(1.0f);
+	crop[0][0] = static_cast<float>(width) / window_width;
+	crop[3][0] = (width - 2.0f * left) / window_width - 1.0f;
+	crop[1][1] = static_cast<float>(height) / window_height;
+	crop[3][1] = 1.0f - (height - 2.0f * top) / window_height;
+	graphics_settings.crop = crop;
+}
+
+void Pyramid::downloadFrame(const int pyramid_level, cv::Mat& frame, cudaStream_t stream) const
+{
+	const int width = m_widths[pyramid_level];
+	const int height = m_heights[pyramid_level];
+	cv::Mat rgb(height, width, CV_8UC3);
+	CHECK_CUDA_ERROR(cudaMemcpyAsync(rgb.data, getFrame(pyramid_level), 3 * width * height, cudaMemcpyDeviceToHost, stream));
+	CHECK_CUDA_ERROR(cudaStreamSynchronize(stream));
+	cv::cvtColor(rgb, frame, cv::COLOR_RGB2BGR);
 }
@@ -0,0 +1,368 @@
+#include "pyramid.h"
+#include "device_util.h"
+#include "execution_context.h"
+#include "profiler.h"
+#include "util.h"
+
+#include <cstring>
+#include <stdexcept>
+#include "opencv2/imgproc/imgproc.hpp"
+
+//Downscaling by about 2 or more (odd sizes halve to a little less) is a box filter over the source pixels a target pixel covers, like cv::resize with INTER_AREA,
+//so the coarse levels don't alias: 2x2 blocks for level 1, 4x4 for level 2. Otherwise bilinear with pixel centers at +0.5,
+//like INTER_LINEAR, level 0 is a copy. "to_rgb" swaps BGR to RGB on the way.
+__global__ void resizeFrameKernel(const uchar* __restrict__ source, int source_width, int source_height,
+	uchar* __restrict__ target, int target_width, int target_height, bool to_rgb)
+{
+	const auto index = util::getThreadIndex2D();
+	if (index.x >= target_width || index.y >= target_height)
+	{
+		return;
+	}
+
+	const float scale_x = static_cast<float>(source_width) / target_width;
+	const float scale_y = static_cast<float>(source_height) / target_height;
+	uchar* pixel = target + 3 * (index.y * target_width + index.x);
+	if (scale_x >= 1.5f && scale_y >= 1.5f)
+	{
+		const int x_begin = static_cast<int>(index.x * scale_x);
+		const int y_begin = static_cast<int>(index.y * scale_y);
+		const int x_end = min(max(static_cast<int>(ceilf((index.x + 1) * scale_x)), x_begin + 1), source_width);
+		const int y_end = min(max(static_cast<int>(ceilf((index.y + 1) * scale_y)), y_begin + 1), source_height);
+		int sum[3] = { 0, 0, 0 };
+		for (int y = y_begin; y < y_end; ++y)
+		{
+			for (int x = x_begin; x < x_end; ++x)
+			{
+				const uchar* bgr = source + 3 * (y * source_width + x);
+				sum[0] += bgr[0];
+				sum[1] += bgr[1];
+				sum[2] += bgr[2];
+			}
+		}
+		const float inv_count = 1.0f / ((x_end - x_begin) * (y_end - y_begin));
+		for (int c = 0; c < 3; ++c)
+		{
+			pixel[to_rgb ? 2 - c : c] = static_cast<uchar>(sum[c] * inv_count + 0.5f);
+		}
+		return;
+	}
+
+	const float x = fminf(fmaxf((index.x + 0.5f) * scale_x - 0.5f, 0.0f), source_width - 1.0f);
+	const float y = fminf(fmaxf((index.y + 0.5f) * scale_y - 0.5f, 0.0f), source_height - 1.0f);
+	const int x0 = static_cast<int>(x);
+	const int y0 = static_cast<int>(y);
+	const int x1 = min(x0 + 1, source_width - 1);
+	const int y1 = min(y0 + 1, source_height - 1);
+	const float fx = x - x0;
+	const float fy = y - y0;
+
+	for (int c = 0; c < 3; ++c)
+	{
+		const float top = (1.0f - fx) * source[3 * (y0 * source_width + x0) + c] + fx * source[3 * (y0 * source_width + x1) + c];
+		const float bottom = (1.0f - fx) * source[3 * (y1 * source_width + x0) + c] + fx * source[3 * (y1 * source_width + x1) + c];
+		pixel[to_rgb ? 2 - c : c] = static_cast<uchar>((1.0f - fy) * top + fy * bottom + 0.5f);
+	}
+}
+
+//3x3 Sobel of the RGB frame, divided by 8, so it is the smoothed central difference per pixel. Clamped at the borders.
+__global__ void computeGradientsKernel(const uchar* __restrict__ frame, int width, int height, int pitch,
+	float4* __restrict__ gradients_x, float4* __restrict__ gradients_y)
+{
+	const auto index = util::getThreadIndex2D();
+	if (index.x >= width || index.y >= height)
+	{
+		return;
+	}
+
+	const int x = index.x;
+	const int y = index.y;
+	const int columns[3] = { max(x - 1, 0), x, min(x + 1, width - 1) };
+	const int rows[3] = { max(y - 1, 0), y, min(y + 1, height - 1) };
+	const float weights[3] = { 1.0f, 2.0f, 1.0f };
+
+	float3 dx = make_float3(0.0f, 0.0f, 0.0f);
+	float3 dy = make_float3(0.0f, 0.0f, 0.0f);
+	for (int i = 0; i < 3; ++i)
+	{
+		const uchar* left = frame + 3 * (rows[i] * width + columns[0]);
+		const uchar* right = frame + 3 * (rows[i] * width + columns[2]);
+		dx.x += weights[i] * (right[0] - left[0]);
+		dx.y += weights[i] * (right[1] - left[1]);
+		dx.z += weights[i] * (right[2] - left[2]);
+
+		const uchar* up = frame + 3 * (rows[0] * width + columns[i]);
+		const uchar* down = frame + 3 * (rows[2] * width + columns[i]);
+		dy.x += weights[i] * (down[0] - up[0]);
+		dy.y += weights[i] * (down[1] - up[1]);
+		dy.z += weights[i] * (down[2] - up[2]);
+	}
+
+	constexpr float kScale = 1.0f / (8.0f * 255.0f);
+	gradients_x[y * pitch + x] = make_float4(dx.x * kScale, dx.y * kScale, dx.z * kScale, 0.0f);
+	gradients_y[y * pitch + x] = make_float4(dy.x * kScale, dy.y * kScale, dy.z * kScale, 0.0f);
+}
+
+//BGRA rows of "pitch" bytes to packed BGR.
+__global__ void packFrameKernel(const uchar* __restrict__ source, size_t pitch, int width, int height, uchar* __restrict__ target)
+{
+	const auto index = util::getThreadIndex2D();
+	if (index.x >= width || index.y >= height)
+	{
+		return;
+	}
+
+	const uchar* bgra = source + index.y * pitch + 4 * index.x;
+	uchar* bgr = target + 3 * (index.y * width + index.x);
+	bgr[0] = bgra[0];
+	bgr[1] = bgra[1];
+	bgr[2] = bgra[2];
+}
+
+__global__ void writeFrameTextureKernel(const uchar* __restrict__ source, int width, int height, cudaSurfaceObject_t surface)
+{
+	const auto index = util::getThreadIndex2D();
+	if (index.x >= width || index.y >= height)
+	{
+		return;
+	}
+
+	const uchar* bgr = source + 3 * (index.y * width + index.x);
+	surf2Dwrite(make_uchar4(bgr[2], bgr[1], bgr[0], 255), surface, index.x * sizeof(uchar4), index.y);
+}
+
+cudaStream_t Pyramid::getProcessStream(cudaStream_t stream) const
+{
+	return stream == 0 && m_context ? m_context->getComputeStream() : stream;
+}
+
+const uchar* Pyramid::stageFrame(const cv::Mat& frame, const bool pinned)
+{
+	const int width = m_widths[0];
+	const int height = m_heights[0];
+	if (frame.type() != CV_8UC3)
+	{
+		throw std::runtime_error("Error: The frame has to be 8 bit BGR!");
+	}
+	//E.g. a camera which switched resolution before the session resized the pyramid. Resized on the host, that's rare.
+	const cv::Mat* source = &frame;
+	if (frame.cols != width || frame.rows != height)
+	{
+		util::ScopedTimer timer("Frame resize");
+		const bool shrink = frame.cols > width || frame.rows > height;
+		cv::resize(frame, m_resized_frame, cv::Size(width, height), 0.0, 0.0, shrink ? cv::INTER_AREA : cv::INTER_LINEAR);
+		source = &m_resized_frame;
+	}
+	else if (pinned && frame.isContinuous())
+	{
+		return frame.data;
+	}
+
+	//The copy of the last frame has to be done with the staging buffer.
+	CHECK_CUDA_ERROR(cudaEventSynchronize(m_frame_copied));
+	for (int y = 0; y < height; ++y)
+	{
+		std::memcpy(m_frame_host + 3 * y * width, source->ptr(y), 3 * width);
+	}
+	return m_frame_host;
+}
+
+FrameDownscaler::FrameDownscaler()
+{
+	CHECK_CUDA_ERROR(cudaStreamCreate(&m_stream));
+}
+
+FrameDownscaler::~FrameDownscaler()
+{
+	CHECK_CUDA_ERROR(cudaStreamDestroy(m_stream));
+}
+
+void FrameDownscaler::downscale(const cv::Mat& frame, cv::Mat& half)
+{
+	if (frame.type() != CV_8UC3)
+	{
+		throw std::runtime_error("Error: The frame has to be 8 bit BGR!");
+	}
+	const int width = frame.cols;
+	const int height = frame.rows;
+	const int half_width = (width + 1) / 2;
+	const int half_height = (height + 1) / 2;
+	half.create(half_height, half_width, CV_8UC3);
+	{
+		util::ScopedAllocationTag tag("frame downscaler");
+		util::ensureSize(m_frame, 3 * width * height);
+		util::ensureSize(m_half, 3 * half_width * half_height);
+	}
+
+	CHECK_CUDA_ERROR(cudaMemcpy2DAsync(m_frame.getPtr(), 3 * width, frame.data, frame.step, 3 * width, height, cudaMemcpyHostToDevice, m_stream));
+	dim3 threads(16, 16);
+	dim3 blocks((half_width + threads.x - 1) / threads.x, (half_height + threads.y - 1) / threads.y);
+	resizeFrameKernel <<<blocks, threads, 0, m_stream>>>(m_frame.getPtr(), width, height, m_half.getPtr(), half_width, half_height, false);
+	CHECK_CUDA_ERROR(cudaMemcpy2DAsync(half.data, half.step, m_half.getPtr(), 3 * half_width, 3 * half_width, half_height, cudaMemcpyDeviceToHost, m_stream));
+	CHECK_CUDA_ERROR(cudaStreamSynchronize(m_stream));
+}
+
+void Pyramid::waitForFrameCopy() const
+{
+	CHECK_CUDA_ERROR(cudaEventSynchronize(m_frame_copied));
+}
+
+void Pyramid::uploadFrame(const cv::Mat& frame, cudaStream_t stream, const bool pinned)
+{
+	const cudaStream_t process_stream = getProcessStream(stream);
+	const cudaStream_t copy_stream = stream == 0 && m_context ? m_context->getUploadStream() : stream;
+	util::ScopedTimer timer("Frame upload", true, process_stream);
+
+	const uchar* host_frame = stageFrame(frame, pinned);
+	FrameBuffers& buffers = m_buffers[m_current];
+	if (copy_stream != process_stream)
+	{
+		//The last frame has to be processed before the raw frame is overwritten.
+		CHECK_CUDA_ERROR(cudaStreamWaitEvent(copy_stream, buffers.released, 0));
+	}
+	util::copyAsync(buffers.raw_frame.span(), util::pinnedSpan(host_frame, 3 * m_widths[0] * m_heights[0]), copy_stream);
+	CHECK_CUDA_ERROR(cudaEventRecord(m_frame_copied, copy_stream));
+	if (copy_stream != process_stream)
+	{
+		CHECK_CUDA_ERROR(cudaStreamWaitEvent(process_stream, m_frame_copied, 0));
+	}
+
+	processRawFrame(process_stream);
+}
+
+void Pyramid::prefetchFrame(const cv::Mat& frame, const bool pinned)
+{
+	if (!m_context)
+	{
+		throw std::runtime_error("Error: Prefetching frames needs an execution context!");
+	}
+	const cudaStream_t stream = m_context->getUploadStream();
+	util::ScopedTimer timer("Frame prefetch", true, stream);
+
+	FrameBuffers& buffers = m_buffers[1 - m_current];
+	if (!buffers.released)
+	{
+		createFrameBuffers(buffers);
+	}
+	const uchar* host_frame = stageFrame(frame, pinned);
+	//The frame that used these buffers last has to be solved, see usePrefetchedFrame.
+	CHECK_CUDA_ERROR(cudaStreamWaitEvent(stream, buffers.released, 0));
+	util::copyAsync(buffers.raw_frame.span(), util::pinnedSpan(host_frame, 3 * m_widths[0] * m_heights[0]), stream);
+	CHECK_CUDA_ERROR(cudaEventRecord(m_frame_copied, stream));
+	buildLevels(buffers, stream);
+	CHECK_CUDA_ERROR(cudaEventRecord(buffers.built, stream));
+	m_prefetched = true;
+}
+
+void Pyramid::usePrefetchedFrame()
+{
+	if (!m_prefetched)
+	{
+		throw std::runtime_error("Error: There's no prefetched frame!");
+	}
+	const cudaStream_t stream = m_context->getComputeStream();
+	//Everything issued so far read the current frame, the next prefetchFrame may overwrite it after that.
+	CHECK_CUDA_ERROR(cudaEventRecord(m_buffers[m_current].released, stream));
+	m_current = 1 - m_current;
+	m_prefetched = false;
+	CHECK_CUDA_ERROR(cudaStreamWaitEvent(stream, m_buffers[m_current].built, 0));
+	//The next prefetchFrame writes the other buffers, the raw frame stays for getFrameTexture until the next swap.
+	m_frame_texture_stale = true;
+	m_frame_texture_stream = stream;
+	//For uploadFrame the raw frame is free from here on, prefetchFrame waits for the next swap.
+	CHECK_CUDA_ERROR(cudaEventRecord(m_buffers[m_current].released, stream));
+}
+
+void Pyramid::uploadFrame(const uchar* device_frame, const size_t pitch, const int channels, cudaStream_t stream)
+{
+	stream = getProcessStream(stream);
+	util::ScopedTimer timer("Frame upload", true, stream);
+
+	const int width = m_widths[0];
+	const int height = m_heights[0];
+	dim3 threads(16, 16);
+	dim3 blocks((width + threads.x - 1) / threads.x, (height + threads.y - 1) / threads.y);
+	if (channels == 3)
+	{
+		CHECK_CUDA_ERROR(cudaMemcpy2DAsync(m_buffers[m_current].raw_frame.getPtr(), 3 * width, device_frame, pitch, 3 * width, height, cudaMemcpyDeviceToDevice, stream));
+	}
+	else if (channels == 4)
+	{
+		packFrameKernel <<<blocks, threads, 0, stream>>>(device_frame, pitch, width, height, m_buffers[m_current].raw_frame.getPtr());
+	}
+	else
+	{
+		throw std::runtime_error("Error: Device frames have to be BGR or BGRA!");
+	}
+
+	processRawFrame(stream);
+}
+
+void Pyramid::processRawFrame(cudaStream_t stream)
+{
+	FrameBuffers& buffers = m_buffers[m_current];
+	buildLevels(buffers, stream);
+	m_frame_texture_stale = true;
+	m_frame_texture_stream = stream;
+	CHECK_CUDA_ERROR(cudaEventRecord(buffers.released, stream));
+}
+
+GLuint Pyramid::getFrameTexture()
+{
+	if (m_frame_texture_stale)
+	{
+		FrameBuffers& buffers = m_buffers[m_current];
+		writeFrameTexture(buffers, m_frame_texture_stream);
+		//The next uploadFrame overwrites the raw frame after the write.
+		CHECK_CUDA_ERROR(cudaEventRecord(buffers.released, m_frame_texture_stream));
+		m_frame_texture_stale = false;
+	}
+	return m_frame_texture;
+}
+
+void Pyramid::buildLevels(FrameBuffers& buffers, cudaStream_t stream)
+{
+	const int width = m_widths[0];
+	const int height = m_heights[0];
+	dim3 threads(16, 16);
+	for (int i = 0; i < getNumberOfLevels(); ++i)
+	{
+		dim3 blocks((m_widths[i] + threads.x - 1) / threads.x, (m_heights[i] + threads.y - 1) / threads.y);
+		resizeFrameKernel <<<blocks, threads, 0, stream>>>(buffers.raw_frame.getPtr(), width, height, buffers.frames[i].getPtr(), m_widths[i],
+			m_heights[i], true);
+
+		auto& gradients = buffers.gradients[i];
+		computeGradientsKernel <<<blocks, threads, 0, stream>>>(buffers.frames[i].getPtr(), m_widths[i], m_heights[i], gradients.pitch,
+			gradients.x.getPtr(), gradients.y.getPtr());
+	}
+}
+
+void Pyramid::writeFrameTexture(const FrameBuffers& buffers, cudaStream_t stream)
+{
+	const int width = m_widths[0];
+	const int height = m_heights[0];
+	dim3 threads(16, 16);
+	CHECK_CUDA_ERROR(cudaGraphicsMapResources(1, &m_frame_texture_resource, stream));
+	cudaArray_t array = nullptr;
+	CHECK_CUDA_ERROR(cudaGraphicsSubResourceGetMappedArray(&array, m_frame_texture_resource, 0, 0));
+
+	//The mapped array usually stays the same, so the surface is only recreated when it changes.
+	if (array != m_frame_surface_array)
+	{
+		if (m_frame_surface)
+		{
+			CHECK_CUDA_ERROR(cudaDestroySurfaceObject(m_frame_surface));
+		}
+
+		cudaResourceDesc resource_desc;
+		std::memset(&resource_desc, 0, sizeof(resource_desc));
+		resource_desc.resType = cudaResourceTypeArray;
+		resource_desc.res.array.array = array;
+		CHECK_CUDA_ERROR(cudaCreateSurfaceObject(&m_frame_surface, &resource_desc));
+		m_frame_surface_array = array;
+	}
+
+	dim3 blocks((width + threads.x - 1) / threads.x, (height + threads.y - 1) / threads.y);
+	writeFrameTextureKernel <<<blocks, threads, 0, stream>>>(buffers.raw_frame.getPtr(), width, height, m_frame_surface);
+	CHECK_CUDA_ERROR(cudaGraphicsUnmapResources(1, &m_frame_texture_resource, stream));
+}
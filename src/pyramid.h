@@ -1,36 +1,201 @@
 #pragma once
 
 #include "face.h"
+#include "device_array.h"
 
 #include <cuda_gl_interop.h>
 #include <cuda_runtime.h>
+#include <memory>
 #include <vector>
+#include "opencv2/core/core.hpp"
+
+//Smoothed RGB gradients (Sobel, in color units per pixel, clamped at the borders) of one level of the frame.
+//"x" holds d/dx of R, G and B, "y" d/dy. The textures sample them bilinearly with unnormalized coordinates.
+struct FrameGradients
+{
+	int pitch = 0; //in pixels
+	util::DeviceArray<float4> x;
+	util::DeviceArray<float4> y;
+	cudaTextureObject_t texture_x = 0;
+	cudaTextureObject_t texture_y = 0;
+};
 
 class Pyramid
 {
 public:
-	Pyramid(int number_of_levels, int top_width, int top_height);
+	//"packed_visibility" replaces the barycentrics (RGBA32F) and vertex ids (RGB32I) targets with one RG32UI target: the triangle
+	//id plus 1 (0: background) and two unorm16 barycentrics. The solver reads 8 instead of 32 bytes per pixel and reconstructs
+	//the vertex ids, the light and the color from the mesh. The RGBA8 color target stays for the display, CUDA doesn't map it then.
+	//"roi_size" > 0 adds a second set of render targets per level of at most roi_size x roi_size pixels, for rendering a crop
+	//window around the face only (see setRoiGraphicsSettings). The full size targets stay for the display.
+	//"atlas" packs the targets of all levels into one framebuffer, level 0 in the left column and the coarser levels stacked
+	//up in the right one, and each level renders into its viewport (see Face::GraphicsSettings::target_x). The ROI targets get
+	//an atlas of their own. So there is only one set of registered textures: every level maps the same resources and the
+	//solver creates its texture objects once, instead of once per level.
+	Pyramid(int number_of_levels, int top_width, int top_height, bool packed_visibility = false, int roi_size = 0, bool atlas = false);
 	Pyramid(Pyramid&) = delete;
 	Pyramid(Pyramid&& rhs) = delete;
 	Pyramid& operator=(Pyramid&) = delete;
 	Pyramid& operator=(Pyramid&&) = delete;
 
-	//TODO: Don't be lazy and write the destructor
-	//~Pyramid();
+	~Pyramid();
 
+	//Recreates the buffers and the render targets for another frame size (or level count, or ROI size), e.g. when the input
+	//of a session switches resolution. Waits for the device first, the frame has to be uploaded again afterwards. The faces
+	//pick up the new render targets with the next setGraphicsSettings.
+	void resize(int top_width, int top_height);
+	void reconfigure(int number_of_levels, int top_width, int top_height, int roi_size);
+
+	//The render targets of a level are created by the first call for it, with the GL context current, so levels the solver
+	//never visits (see SolverParameters::warm_start_level) cost no framebuffers.
 	void setGraphicsSettings(int pyramid_level, Face::GraphicsSettings& graphics_settings) const;
+	//Same with the ROI targets of the level and a crop window which covers "face_rect" (x, y, width, height, normalized to the
+	//frame, y down), see Face::GraphicsSettings::crop. A window larger than the targets samples every roi_stride-th pixel of the
+	//level. Falls back to setGraphicsSettings without ROI targets.
+	void setRoiGraphicsSettings(int pyramid_level, const glm::vec4& face_rect, Face::GraphicsSettings& graphics_settings) const;
+	bool hasRoiTargets() const { return m_roi_size > 0; }
+	int getRoiSize() const { return m_roi_size; }
+	bool hasAtlas() const { return m_atlas; }
+
+	int getNumberOfLevels() const { return m_widths.size(); }
+	int getWidth(int pyramid_level) const { return m_widths[pyramid_level]; }
+	int getHeight(int pyramid_level) const { return m_heights[pyramid_level]; }
+	//Of the frame, taken from level 0 since the coarser levels round their size down.
+	float getAspectRatio() const { return static_cast<float>(m_widths[0]) / m_heights[0]; }
 
-	int getNumberOfLevels() const { return m_face_framebuffer.size(); }
+	//Uploads without a stream then copy on the upload stream of "context" and process the frame on its compute stream, ordered
+	//by events. So the copy of the next frame overlaps the solve of this one. Without a context they use the default stream.
+	void setExecutionContext(std::shared_ptr<util::ExecutionContext> context) { m_context = std::move(context); }
+
+	//Uploads the camera frame (CV_8UC3, BGR) once through pinned memory. A frame of another size than level 0 is resized to it on
+	//the host first. The RGB frame of every level
+	//is resized on the device, followed by its gradients, so nothing is resized on the host. The background texture of the
+	//display is written from the device frame once it's needed, see getFrameTexture.
+	//"pinned": the frame is continuous page-locked memory (e.g. of util::HostFramePool) and is copied from directly, without the
+	//staging copy. It must not be written again before waitForFrameCopy.
+	void uploadFrame(const cv::Mat& frame, cudaStream_t stream = 0, bool pinned = false);
+	//Same for a frame which is on the device already, e.g. decoded by NVDEC: 8 bit BGR (3 channels) or BGRA (4) rows of
+	//"pitch" bytes, of the size of level 0. Nothing goes through the host.
+	void uploadFrame(const uchar* device_frame, size_t pitch, int channels, cudaStream_t stream = 0);
+	//Copies the next frame and builds its levels and gradients into a second set of buffers, on the upload stream of the
+	//context, while the solve of the current frame still reads the first. usePrefetchedFrame then makes it the current frame.
+	//Needs setExecutionContext. The second set is allocated on the first call.
+	void prefetchFrame(const cv::Mat& frame, bool pinned = false);
+	//Waits until the host frame of the last uploadFrame or prefetchFrame is copied, so a pinned frame can be reused.
+	void waitForFrameCopy() const;
+	//Swaps in the frame of the last prefetchFrame: later work on the compute stream waits for it to be built, and the display
+	//texture is written from it by the next getFrameTexture. The buffers of the previous frame are reused once the compute
+	//stream is done with them.
+	void usePrefetchedFrame();
+	bool hasPrefetchedFrame() const { return m_prefetched; }
+	//BGR copy (CV_8UC3) of the frame of a level, e.g. of level 1 for the landmark detector. Waits for the copy.
+	void downloadFrame(int pyramid_level, cv::Mat& frame, cudaStream_t stream = 0) const;
+	//RGB, 3 bytes per pixel, rows top to bottom. Valid after uploadFrame, in stream order.
+	const uchar* getFrame(int pyramid_level) const { return m_buffers[m_current].frames[pyramid_level].getPtr(); }
+	//The frame as it was uploaded, BGR with 3 * getWidth(0) bytes per row, e.g. to upload it again later. In stream order as well.
+	const uchar* getRawFrame() const { return m_buffers[m_current].raw_frame.getPtr(); }
+	const FrameGradients& getGradients(int pyramid_level) const { return m_buffers[m_current].gradients[pyramid_level]; }
+	//RGBA8 copy of the last uploaded frame of level 0, for drawing the background. Its storage is allocated once. The first call
+	//after an upload writes it from the device frame, in the order of the stream of the upload, so the display and the video
+	//composite share one write, and frames that nothing draws (display_rate, headless sessions) aren't mapped and converted.
+	GLuint getFrameTexture();
 
 private:
-	std::vector<GLuint> m_face_framebuffer;
-	std::vector<GLuint> m_rt_rgb;
-	std::vector<GLuint> m_rt_barycentrics;
-	std::vector<GLuint> m_rt_vertex_ids;
-	std::vector<cudaGraphicsResource_t> m_rt_rgb_cuda_resource;
-	std::vector<cudaGraphicsResource_t> m_rt_barycentrics_cuda_resource;
-	std::vector<cudaGraphicsResource_t> m_rt_vertex_ids_cuda_resource;
-	std::vector<GLuint> m_depth_buffer;
+	//Framebuffer and render targets of one level, registered with CUDA.
+	struct RenderTargets
+	{
+		GLuint framebuffer{ 0 };
+		GLuint rgb{ 0 };
+		GLuint barycentrics{ 0 };
+		GLuint vertex_ids{ 0 };
+		GLuint visibility{ 0 }; //packed visibility instead of the barycentrics and vertex ids, see the constructor
+		GLuint depth_buffer{ 0 };
+		cudaGraphicsResource_t rgb_cuda_resource{ nullptr };
+		cudaGraphicsResource_t barycentrics_cuda_resource{ nullptr };
+		cudaGraphicsResource_t vertex_ids_cuda_resource{ nullptr };
+		cudaGraphicsResource_t visibility_cuda_resource{ nullptr };
+		int width{ 0 };
+		int height{ 0 };
+	};
+
+	//Device copies of one frame: the raw frame, its levels and their gradients.
+	struct FrameBuffers
+	{
+		util::DeviceArray<uchar> raw_frame; //BGR
+		std::vector<util::DeviceArray<uchar>> frames;
+		std::vector<FrameGradients> gradients;
+		cudaEvent_t released{ nullptr }; //the last work that reads the buffers is done, they can be written again
+		cudaEvent_t built{ nullptr }; //levels and gradients of a prefetched frame are written
+	};
+
+	void createResources(int number_of_levels, int top_width, int top_height);
+	void destroyResources();
+	void createFrameBuffers(FrameBuffers& buffers) const;
+	static void destroyFrameBuffers(FrameBuffers& buffers);
+	static RenderTargets createRenderTargets(int width, int height, bool packed_visibility);
+	static void destroyRenderTargets(RenderTargets& targets);
+	//Size of the targets of a level, the ROI targets are clamped to m_roi_size.
+	glm::ivec2 getTargetSize(bool roi, int pyramid_level) const;
+	//Lower left corner of a level in the atlas, in GL pixels (rows from the bottom). 0 without one.
+	glm::ivec2 getAtlasOffset(bool roi, int pyramid_level) const;
+	//The targets of a level (m_roi_targets if "roi", else m_targets), created if it's the first use: the entry of the level, or
+	//the atlas of all of them.
+	const RenderTargets& getRenderTargets(bool roi, int pyramid_level) const;
+	void setTargets(bool roi, int pyramid_level, Face::GraphicsSettings& graphics_settings) const;
+
+	//Levels and gradients from the raw frame of the current buffers, the display texture is stale from then on.
+	void processRawFrame(cudaStream_t stream);
+	void buildLevels(FrameBuffers& buffers, cudaStream_t stream);
+	void writeFrameTexture(const FrameBuffers& buffers, cudaStream_t stream);
+	//Host copy of "frame" into m_frame_host, once the last copy from it is done. Returns the host memory to copy to the device,
+	//the frame itself if it is pinned.
+	const uchar* stageFrame(const cv::Mat& frame, bool pinned);
+	//The compute stream of the context for stream 0, if there's one.
+	cudaStream_t getProcessStream(cudaStream_t stream) const;
+
+private:
+	bool m_packed_visibility;
+	int m_roi_size;
+	bool m_atlas;
+	//Framebuffer 0: not created yet, see getRenderTargets. One entry per level, or only the atlas.
+	mutable std::vector<RenderTargets> m_targets;
+	mutable std::vector<RenderTargets> m_roi_targets; //empty without roi_size
 	std::vector<int> m_widths;
 	std::vector<int> m_heights;
+
+	uchar* m_frame_host{ nullptr }; //pinned, BGR
+	cv::Mat m_resized_frame; //of a frame which doesn't have the size of level 0, see stageFrame
+	std::shared_ptr<util::ExecutionContext> m_context; //null: the streams of the callers
+	cudaEvent_t m_frame_copied{ nullptr }; //staging buffer is free again
+	FrameBuffers m_buffers[2]; //the second one is allocated by the first prefetchFrame
+	int m_current{ 0 };
+	bool m_prefetched{ false }; //the other buffers hold the frame of the last prefetchFrame
+	GLuint m_frame_texture{ 0 };
+	cudaGraphicsResource_t m_frame_texture_resource{ nullptr };
+	cudaArray_t m_frame_surface_array{ nullptr };
+	cudaSurfaceObject_t m_frame_surface{ 0 };
+	//The texture doesn't hold the current frame yet, getFrameTexture writes it on the stream the frame was processed on.
+	bool m_frame_texture_stale{ false };
+	cudaStream_t m_frame_texture_stream{ nullptr };
+};
+
+//Halves BGR host frames on the device, with the box filter of the pyramid levels, for the landmark detector of a thread which
+//doesn't own the pyramid, e.g. the capture thread of the pipelined mode. Instead of cv::pyrDown on the host. Has a stream and
+//buffers of its own, so it doesn't order against the solve.
+class FrameDownscaler
+{
+public:
+	FrameDownscaler();
+	~FrameDownscaler();
+	FrameDownscaler(const FrameDownscaler&) = delete;
+	FrameDownscaler& operator=(const FrameDownscaler&) = delete;
+
+	//"half" gets (cols + 1) / 2 x (rows + 1) / 2 pixels like cv::pyrDown, in its own buffer if it has that size already
+	//(e.g. a frame of util::HostFramePool). Waits for the result.
+	void downscale(const cv::Mat& frame, cv::Mat& half);
+
+private:
+	cudaStream_t m_stream{ nullptr };
+	util::DeviceArray<uchar> m_frame;
+	util::DeviceArray<uchar> m_half;
 };
@@ -0,0 +1,320 @@
+#include "rasterizer.h"
+#include "device_util.h"
+#include "jacobian_util.h"
+#include "util.h"
+
+#include <cstring>
+
+constexpr unsigned long long kEmptyDepth = ~0ull;
+//Cosine between the normal and the ray from the camera above which a vertex counts as back facing. Not 0, the normals are
+//interpolated, so triangles at the silhouette keep some slack.
+constexpr float kBackFacingCosine = 0.2f;
+
+//face.vert
+__global__ void transformVerticesKernel(int nVertices, const glm::vec3* __restrict__ current_face, Rasterizer::Uniforms uniforms,
+	int width, int height, glm::vec4* __restrict__ window, glm::vec3* __restrict__ normals, glm::vec3* __restrict__ albedos,
+	unsigned char* __restrict__ back_facing)
+{
+	const int i = util::getThreadIndex1D();
+	if (i >= nVertices)
+	{
+		return;
+	}
+
+	const glm::vec4 view = uniforms.model * glm::vec4(current_face[i], 1.0f);
+	const glm::vec4 clip = uniforms.projection * view;
+	const glm::vec3 ndc = glm::vec3(clip) / clip.w;
+	window[i] = glm::vec4((ndc.x * 0.5f + 0.5f) * width, (ndc.y * 0.5f + 0.5f) * height, ndc.z * 0.5f + 0.5f, clip.w);
+	normals[i] = glm::normalize(glm::mat3(uniforms.model) * current_face[2 * nVertices + i]);
+	albedos[i] = current_face[nVertices + i];
+	if (back_facing)
+	{
+		back_facing[i] = glm::dot(normals[i], glm::normalize(glm::vec3(view))) > kBackFacingCosine;
+	}
+}
+
+__device__ inline float edgeFunction(const glm::vec2& a, const glm::vec2& b, const glm::vec2& p)
+{
+	return (b.x - a.x) * (p.y - a.y) - (b.y - a.y) * (p.x - a.x);
+}
+
+//Screen space barycentrics of "p", they are what the noperspective varyings of face.geom interpolate with.
+__device__ inline bool computeBarycentrics(const glm::vec4& v0, const glm::vec4& v1, const glm::vec4& v2, const glm::vec2& p, glm::vec3& barycentrics)
+{
+	const float area = edgeFunction(glm::vec2(v0), glm::vec2(v1), glm::vec2(v2));
+	if (area == 0.0f)
+	{
+		return false;
+	}
+
+	barycentrics.x = edgeFunction(glm::vec2(v1), glm::vec2(v2), p) / area;
+	barycentrics.y = edgeFunction(glm::vec2(v2), glm::vec2(v0), p) / area;
+	barycentrics.z = 1.0f - barycentrics.x - barycentrics.y;
+	return barycentrics.x >= 0.0f && barycentrics.y >= 0.0f && barycentrics.z >= 0.0f;
+}
+
+//One thread per triangle. Keeps the ids of the triangles which may be visible, the ones of a warp in one atomic. The order of
+//the warps is arbitrary, the depth test doesn't depend on it: ties go to the lower triangle id either way.
+__global__ void cullTrianglesKernel(int nFaces, const glm::ivec3* __restrict__ faces, const glm::vec4* __restrict__ window,
+	const unsigned char* __restrict__ back_facing, int width, int height, int* __restrict__ visible_faces, int* __restrict__ num_visible_faces)
+{
+	const int i = util::getThreadIndex1D();
+	if (i >= nFaces)
+	{
+		return;
+	}
+
+	const auto face = faces[i];
+	const glm::vec4 v0 = window[face.x];
+	const glm::vec4 v1 = window[face.y];
+	const glm::vec4 v2 = window[face.z];
+	bool visible = v0.w > 0.0f && v1.w > 0.0f && v2.w > 0.0f && !(back_facing[face.x] && back_facing[face.y] && back_facing[face.z]);
+	if (visible)
+	{
+		//The first and last pixel centers inside the bounding box, none for a triangle between two centers or outside the target.
+		const int x_first = max(0, static_cast<int>(ceilf(fminf(v0.x, fminf(v1.x, v2.x)) - 0.5f)));
+		const int x_last = min(width - 1, static_cast<int>(floorf(fmaxf(v0.x, fmaxf(v1.x, v2.x)) - 0.5f)));
+		const int y_first = max(0, static_cast<int>(ceilf(fminf(v0.y, fminf(v1.y, v2.y)) - 0.5f)));
+		const int y_last = min(height - 1, static_cast<int>(floorf(fmaxf(v0.y, fmaxf(v1.y, v2.y)) - 0.5f)));
+		visible = x_first <= x_last && y_first <= y_last;
+	}
+
+	const unsigned int active = __activemask();
+	const unsigned int ballot = __ballot_sync(active, visible);
+	const int lane = threadIdx.x % 32;
+	const int leader = __ffs(active) - 1;
+	int first = 0;
+	if (lane == leader && ballot != 0)
+	{
+		first = atomicAdd(num_visible_faces, __popc(ballot));
+	}
+	first = __shfl_sync(active, first, leader);
+	if (visible)
+	{
+		visible_faces[first + __popc(ballot & ((1u << lane) - 1))] = i;
+	}
+}
+
+//One thread per triangle, of the culled ones if there is a "visible_faces" list. Both windings are drawn, like the GL pipeline
+//without face culling.
+__global__ void rasterizeTrianglesKernel(int nFaces, const glm::ivec3* __restrict__ faces, const int* __restrict__ visible_faces,
+	const int* __restrict__ num_visible_faces, const glm::vec4* __restrict__ window, const glm::vec3* __restrict__ albedos, int width, int height,
+	unsigned long long* __restrict__ depth)
+{
+	int i = util::getThreadIndex1D();
+	if (i >= (visible_faces ? *num_visible_faces : nFaces))
+	{
+		return;
+	}
+	if (visible_faces)
+	{
+		i = visible_faces[i];
+	}
+
+	const auto face = faces[i];
+	const glm::vec4 v0 = window[face.x];
+	const glm::vec4 v1 = window[face.y];
+	const glm::vec4 v2 = window[face.z];
+
+	//Triangles crossing the near plane aren't clipped, the face never comes close to the camera.
+	if (v0.w <= 0.0f || v1.w <= 0.0f || v2.w <= 0.0f)
+	{
+		return;
+	}
+
+	const int x_min = max(0, static_cast<int>(floorf(fminf(v0.x, fminf(v1.x, v2.x)) - 0.5f)));
+	const int x_max = min(width - 1, static_cast<int>(ceilf(fmaxf(v0.x, fmaxf(v1.x, v2.x)) - 0.5f)));
+	const int y_min = max(0, static_cast<int>(floorf(fminf(v0.y, fminf(v1.y, v2.y)) - 0.5f)));
+	const int y_max = min(height - 1, static_cast<int>(ceilf(fmaxf(v0.y, fmaxf(v1.y, v2.y)) - 0.5f)));
+
+	for (int y = y_min; y <= y_max; ++y)
+	{
+		for (int x = x_min; x <= x_max; ++x)
+		{
+			glm::vec3 barycentrics;
+			if (!computeBarycentrics(v0, v1, v2, glm::vec2(x + 0.5f, y + 0.5f), barycentrics))
+			{
+				continue;
+			}
+
+			const float z = barycentrics.x * v0.z + barycentrics.y * v1.z + barycentrics.z * v2.z;
+			if (z < 0.0f || z > 1.0f)
+			{
+				continue;
+			}
+
+			//Discarded fragments (see face.frag) don't write depth either.
+			const float albedo_y = barycentrics.x * albedos[face.x].y + barycentrics.y * albedos[face.y].y + barycentrics.z * albedos[face.z].y;
+			if (albedo_y > 1.0f)
+			{
+				continue;
+			}
+
+			//Non-negative floats compare like their bits, ties go to the lower triangle id.
+			const unsigned long long key = (static_cast<unsigned long long>(__float_as_uint(z)) << 32) | static_cast<unsigned int>(i);
+			atomicMin(&depth[y * width + x], key);
+		}
+	}
+}
+
+__device__ inline unsigned char toUnorm8(float value)
+{
+	return static_cast<unsigned char>(__float2int_rn(fminf(fmaxf(value, 0.0f), 1.0f) * 255.0f));
+}
+
+//One thread per pixel. Also clears the pixels no triangle covers, like glClear with a clear color of 0.
+__global__ void resolvePixelsKernel(int width, int height, int pitch, const unsigned long long* __restrict__ depth,
+	const glm::ivec3* __restrict__ faces, const glm::vec4* __restrict__ window, const glm::vec3* __restrict__ normals,
+	const glm::vec3* __restrict__ albedos, Rasterizer::Uniforms uniforms,
+	uchar4* __restrict__ rgb, float4* __restrict__ barycentrics_light, int4* __restrict__ vertex_ids)
+{
+	const auto index = util::getThreadIndex2D();
+	if (index.x >= width || index.y >= height)
+	{
+		return;
+	}
+
+	const int pixel = index.y * pitch + index.x;
+	const unsigned long long key = depth[index.y * width + index.x];
+	if (key == kEmptyDepth)
+	{
+		rgb[pixel] = make_uchar4(0, 0, 0, 0);
+		barycentrics_light[pixel] = make_float4(0.0f, 0.0f, 0.0f, 0.0f);
+		vertex_ids[pixel] = make_int4(0, 0, 0, 0);
+		return;
+	}
+
+	const auto face = faces[static_cast<unsigned int>(key & 0xffffffffull)];
+	glm::vec3 barycentrics;
+	computeBarycentrics(window[face.x], window[face.y], window[face.z], glm::vec2(index.x + 0.5f, index.y + 0.5f), barycentrics);
+
+	const glm::vec3 normal = barycentrics.x * normals[face.x] + barycentrics.y * normals[face.y] + barycentrics.z * normals[face.z];
+	const glm::vec3 albedo = barycentrics.x * albedos[face.x] + barycentrics.y * albedos[face.y] + barycentrics.z * albedos[face.z];
+	const float light = jacobian_util::computeSH(uniforms.sh_coefficients, glm::normalize(normal));
+	const glm::vec3 color = light * albedo;
+
+	rgb[pixel] = make_uchar4(toUnorm8(color.x), toUnorm8(color.y), toUnorm8(color.z), 255);
+	barycentrics_light[pixel] = make_float4(barycentrics.x, barycentrics.y, barycentrics.z, light);
+	vertex_ids[pixel] = make_int4(face.x, face.y, face.z, 0);
+}
+
+void RenderTargetTextures::destroy()
+{
+	for (auto texture : { rgb, barycentrics, vertex_ids, visibility })
+	{
+		if (texture)
+		{
+			CHECK_CUDA_ERROR(cudaDestroyTextureObject(texture));
+		}
+	}
+	*this = RenderTargetTextures();
+}
+
+Rasterizer::~Rasterizer()
+{
+	for (auto& target : m_targets)
+	{
+		target.textures.destroy();
+	}
+}
+
+void Rasterizer::reserve(Target& target, int width, int height)
+{
+	if (target.width == width && target.height == height)
+	{
+		return;
+	}
+
+	target.textures.destroy();
+	target.width = width;
+	target.height = height;
+	target.pitch = (width + 63) / 64 * 64; //keeps every row aligned to 256 bytes, as pitched textures want
+	target.rgb = util::DeviceArray<uchar4>(target.pitch * height);
+	target.barycentrics = util::DeviceArray<float4>(target.pitch * height);
+	target.vertex_ids = util::DeviceArray<int4>(target.pitch * height);
+	target.depth = util::DeviceArray<unsigned long long>(width * height);
+
+	//Same sampling as the textures of the GL render targets, see GaussNewtonSolver::mapRenderTargets.
+	cudaResourceDesc res_desc;
+	memset(&res_desc, 0, sizeof(res_desc));
+	res_desc.resType = cudaResourceTypePitch2D;
+	res_desc.res.pitch2D.width = width;
+	res_desc.res.pitch2D.height = height;
+
+	cudaTextureDesc tex_desc;
+	memset(&tex_desc, 0, sizeof(tex_desc));
+	tex_desc.addressMode[0] = cudaTextureAddressMode(cudaAddressModeWrap);
+	tex_desc.addressMode[1] = cudaTextureAddressMode(cudaAddressModeWrap);
+	tex_desc.filterMode = cudaTextureFilterMode(cudaFilterModeLinear);
+	tex_desc.readMode = cudaReadModeNormalizedFloat;
+	tex_desc.normalizedCoords = 0;
+
+	//RGB texture
+	res_desc.res.pitch2D.devPtr = target.rgb.getPtr();
+	res_desc.res.pitch2D.desc = cudaCreateChannelDesc<uchar4>();
+	res_desc.res.pitch2D.pitchInBytes = target.pitch * sizeof(uchar4);
+	CHECK_CUDA_ERROR(cudaCreateTextureObject(&target.textures.rgb, &res_desc, &tex_desc, nullptr));
+
+	//Barycentrics texture
+	tex_desc.filterMode = cudaTextureFilterMode(cudaFilterModePoint);
+	tex_desc.readMode = cudaReadModeElementType;
+	res_desc.res.pitch2D.devPtr = target.barycentrics.getPtr();
+	res_desc.res.pitch2D.desc = cudaCreateChannelDesc<float4>();
+	res_desc.res.pitch2D.pitchInBytes = target.pitch * sizeof(float4);
+	CHECK_CUDA_ERROR(cudaCreateTextureObject(&target.textures.barycentrics, &res_desc, &tex_desc, nullptr));
+
+	//Vertex ids texture
+	res_desc.res.pitch2D.devPtr = target.vertex_ids.getPtr();
+	res_desc.res.pitch2D.desc = cudaCreateChannelDesc<int4>();
+	res_desc.res.pitch2D.pitchInBytes = target.pitch * sizeof(int4);
+	CHECK_CUDA_ERROR(cudaCreateTextureObject(&target.textures.vertex_ids, &res_desc, &tex_desc, nullptr));
+}
+
+void Rasterizer::draw(int target_index, int width, int height, const glm::vec3* current_face, int nVertices, const glm::ivec3* faces, int nFaces,
+	const Uniforms& uniforms, const bool cull, cudaStream_t stream)
+{
+	if (static_cast<int>(m_targets.size()) <= target_index)
+	{
+		m_targets.resize(target_index + 1);
+	}
+	auto& target = m_targets[target_index];
+	reserve(target, width, height);
+
+	util::ensureSize(m_window, nVertices);
+	util::ensureSize(m_normals, nVertices);
+	util::ensureSize(m_albedos, nVertices);
+	auto window = m_window.getPtr();
+	auto normals = m_normals.getPtr();
+	auto albedos = m_albedos.getPtr();
+	unsigned char* back_facing = nullptr;
+	int* visible_faces = nullptr;
+	if (cull)
+	{
+		util::ensureSize(m_back_facing, nVertices);
+		util::ensureSize(m_visible_faces, nFaces);
+		util::ensureSize(m_num_visible_faces, 1);
+		back_facing = m_back_facing.getPtr();
+		visible_faces = m_visible_faces.getPtr();
+	}
+
+	const int block_size = 256;
+	transformVerticesKernel <<<(nVertices + block_size - 1) / block_size, block_size, 0, stream>>>(
+		nVertices, current_face, uniforms, width, height, window, normals, albedos, back_facing);
+
+	if (cull)
+	{
+		//The count stays on the device, the raster threads past it return right away.
+		m_num_visible_faces.memset(0, stream);
+		cullTrianglesKernel <<<(nFaces + block_size - 1) / block_size, block_size, 0, stream>>>(
+			nFaces, faces, window, back_facing, width, height, visible_faces, m_num_visible_faces.getPtr());
+	}
+
+	CHECK_CUDA_ERROR(cudaMemsetAsync(target.depth.getPtr(), 0xff, width * height * sizeof(unsigned long long), stream));
+	rasterizeTrianglesKernel <<<(nFaces + block_size - 1) / block_size, block_size, 0, stream>>>(
+		nFaces, faces, visible_faces, m_num_visible_faces.getPtr(), window, albedos, width, height, target.depth.getPtr());
+
+	dim3 threads(16, 16);
+	dim3 blocks((width + threads.x - 1) / threads.x, (height + threads.y - 1) / threads.y);
+	resolvePixelsKernel <<<blocks, threads, 0, stream>>>(width, height, target.pitch, target.depth.getPtr(),
+		faces, window, normals, albedos, uniforms, target.rgb.getPtr(), target.barycentrics.getPtr(), target.vertex_ids.getPtr());
+}
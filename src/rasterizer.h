@@ -0,0 +1,77 @@
+#pragma once
+
+#include "device_array.h"
+
+#include <vector>
+#include <cuda_runtime.h>
+#include <glm/glm.hpp>
+
+//Texture objects of the render targets of one pyramid level and the arrays they were created for.
+//The CUDA rasterizer binds pitched device memory instead and leaves "arrays" empty.
+struct RenderTargetTextures
+{
+	cudaArray* arrays[3]{ nullptr, nullptr, nullptr }; //rgb, barycentrics, vertex ids, or the packed visibility alone
+	cudaTextureObject_t rgb = 0;
+	cudaTextureObject_t barycentrics = 0;
+	cudaTextureObject_t vertex_ids = 0;
+	cudaTextureObject_t visibility = 0; //see Pyramid
+
+	void destroy();
+};
+
+//Renders the same outputs as face.vert/face.geom/face.frag (rgb, barycentrics plus light, vertex ids) into device memory,
+//on a CUDA stream and without a GL context. The layout matches the GL render targets, row 0 is the bottom row.
+//One triangle per thread resolves the depth test with a 64-bit atomicMin of (depth, triangle id), then one thread per pixel shades.
+//With culling, a pass over the triangles first compacts the ids of those which can be visible, so the raster threads aren't
+//spent on the back of the head or on triangles outside the targets.
+class Rasterizer
+{
+public:
+	struct Uniforms
+	{
+		glm::mat4 model;
+		glm::mat4 projection;
+		float sh_coefficients[9];
+	};
+
+	Rasterizer() = default;
+	Rasterizer(const Rasterizer&) = delete;
+	Rasterizer& operator=(const Rasterizer&) = delete;
+	~Rasterizer();
+
+	//"current_face" is laid out like Face::m_current_face_gpu: positions, colors and normals of all vertices.
+	//Every "target_index" (e.g. pyramid level) keeps its own buffers and texture objects, allocated on first use.
+	//"cull" drops the triangles whose vertex normals all face away from the camera (a camera at the origin, as "uniforms.model"
+	//places the face), which lie behind the camera or cover no pixel center of the target. That's not exact for the first test:
+	//a triangle of the silhouette with three back facing normals may still win a pixel without culling.
+	void draw(int target_index, int width, int height, const glm::vec3* current_face, int nVertices, const glm::ivec3* faces, int nFaces,
+		const Uniforms& uniforms, bool cull, cudaStream_t stream);
+
+	const RenderTargetTextures& getTextures(int target_index) const { return m_targets[target_index].textures; }
+
+private:
+	struct Target
+	{
+		int width = 0;
+		int height = 0;
+		int pitch = 0; //in pixels, the same for all buffers
+		util::DeviceArray<uchar4> rgb;
+		util::DeviceArray<float4> barycentrics;
+		util::DeviceArray<int4> vertex_ids;
+		util::DeviceArray<unsigned long long> depth;
+		RenderTargetTextures textures;
+	};
+
+	void reserve(Target& target, int width, int height);
+
+private:
+	std::vector<Target> m_targets;
+	//Transformed vertices of the last draw
+	util::DeviceArray<glm::vec4> m_window; //x, y in pixels, z in [0, 1], w of the clip position
+	util::DeviceArray<glm::vec3> m_normals;
+	util::DeviceArray<glm::vec3> m_albedos;
+	util::DeviceArray<unsigned char> m_back_facing;
+	//Culling: the ids of the triangles left, in no particular order, and their count
+	util::DeviceArray<int> m_visible_faces;
+	util::DeviceArray<int> m_num_visible_faces;
+};
@@ -11,6 +11,8 @@ in G2P
 layout(location = 0) out vec4 fragment_color;
 layout(location = 1) out vec4 barycentrics;
 layout(location = 2) out ivec4 vertex_indices;
+// Packed visibility buffer, see Pyramid. Only one of locations 1 and 2 or 3 has a draw buffer.
+layout(location = 3) out uvec2 visibility;
 
 uniform float sh_coefficients[9];
 
@@ -30,6 +32,10 @@ void main()
 	fragment_color = vec4(light * frag.albedo, 1.0f);
 	barycentrics = vec4(frag.barycentrics, light);
 	vertex_indices = ivec4(frag.ids, 0);
+
+	// Triangle id + 1 (0 is the background) and the first two barycentrics as unorm16.
+	uvec2 unorm = uvec2(clamp(frag.barycentrics.xy, 0.0f, 1.0f) * 65535.0f + 0.5f);
+	visibility = uvec2(uint(gl_PrimitiveID) + 1u, unorm.x | (unorm.y << 16));
 }
 
 float computeSH(vec3 dir)
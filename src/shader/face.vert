@@ -14,10 +14,11 @@ out V2G
 
 uniform mat4 model;
 uniform mat4 projection;
+uniform mat4 crop; //see Face::GraphicsSettings::crop
 
 void main()
 {
-	vertex.position = projection * model * vec4(position, 1.0f);
+	vertex.position = crop * projection * model * vec4(position, 1.0f);
 	vertex.normal = normalize(mat3(model) * normal);
 	vertex.albedo = color;
 	vertex.id = gl_VertexID; 
@@ -0,0 +1,53 @@
+#version 450 core
+#extension GL_NV_fragment_shader_barycentric : require
+
+// face.frag without face.geom: the barycentrics come from the rasterizer, the vertex ids are read per vertex.
+noperspective in vec3 vertex_normal;
+noperspective in vec3 vertex_albedo;
+pervertexNV in int vertex_id[3];
+
+layout(location = 0) out vec4 fragment_color;
+layout(location = 1) out vec4 barycentrics;
+layout(location = 2) out ivec4 vertex_indices;
+layout(location = 3) out uvec2 visibility;
+
+uniform float sh_coefficients[9];
+
+float computeSH(vec3 dir);
+
+void main()
+{
+	// See face.frag.
+	if (vertex_albedo.y > 1.0f)
+	{
+		discard;
+	}
+
+	float light = computeSH(normalize(vertex_normal));
+	fragment_color = vec4(light * vertex_albedo, 1.0f);
+	barycentrics = vec4(gl_BaryCoordNoPerspNV, light);
+	vertex_indices = ivec4(vertex_id[0], vertex_id[1], vertex_id[2], 0);
+
+	uvec2 unorm = uvec2(clamp(gl_BaryCoordNoPerspNV.xy, 0.0f, 1.0f) * 65535.0f + 0.5f);
+	visibility = uvec2(uint(gl_PrimitiveID) + 1u, unorm.x | (unorm.y << 16));
+}
+
+float computeSH(vec3 dir)
+{
+	//band 0 aka ambient
+	float light = sh_coefficients[0];
+
+	//band 1
+	light += sh_coefficients[1] * dir.y;
+	light += sh_coefficients[2] * dir.z;
+	light += sh_coefficients[3] * dir.x;
+
+	//band 2
+	light += sh_coefficients[4] * dir.x * dir.y; 
+	light += sh_coefficients[5] * dir.y * dir.z; 
+	light += sh_coefficients[6] * (3.0f * dir.z * dir.z - 1.0f);
+	light += sh_coefficients[7] * dir.x * dir.z; 
+	light += sh_coefficients[8] * (dir.x * dir.x - dir.y * dir.y);
+
+	return light;
+}
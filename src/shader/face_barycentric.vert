@@ -0,0 +1,22 @@
+#version 450 core
+
+// face.vert without the V2G block, for face_barycentric.frag. The id is read per vertex, not interpolated.
+layout (location = 0) in vec3 position;
+layout (location = 1) in vec3 color;
+layout (location = 2) in vec3 normal;
+
+noperspective out vec3 vertex_normal;
+noperspective out vec3 vertex_albedo;
+out int vertex_id;
+
+uniform mat4 model;
+uniform mat4 projection;
+uniform mat4 crop; //see Face::GraphicsSettings::crop
+
+void main()
+{
+	gl_Position = crop * projection * model * vec4(position, 1.0f);
+	vertex_normal = normalize(mat3(model) * normal);
+	vertex_albedo = color;
+	vertex_id = gl_VertexID;
+}
@@ -5,10 +5,11 @@ out vec4 color;
 
 uniform sampler2D face;
 uniform sampler2D background; 
+uniform vec4 face_window; //offset and scale of the face in its texture, see Face::GraphicsSettings::target_x
 
 void main()
 {
-	vec4 face_color = texture(face, tex_coord);
+	vec4 face_color = texture(face, face_window.xy + tex_coord * face_window.zw);
 	if(face_color.w > 0.0f)
 	{
 		color = face_color; 
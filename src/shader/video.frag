@@ -5,6 +5,7 @@ layout(location = 0) out vec4 color;
 
 uniform sampler2D face;
 uniform sampler2D background; 
+uniform vec4 face_window; //offset and scale of the face in its texture, see Face::GraphicsSettings::target_x
 
 void main()
 {
@@ -12,7 +13,7 @@ void main()
 	if (tex_coord_tmp.x < 0.5)
 	{
 		tex_coord_tmp.x *= 2.0f;
-		vec4 face_color = texture(face, vec2(tex_coord_tmp.x, 1.0f - tex_coord_tmp.y));
+		vec4 face_color = texture(face, face_window.xy + vec2(tex_coord_tmp.x, 1.0f - tex_coord_tmp.y) * face_window.zw);
 		if(face_color.w > 0.0f)
 		{
 			color = face_color;
@@ -0,0 +1,206 @@
+#include "shape_predictor_gpu.h"
+
+#include <dlib/image_processing.h>
+#include <dlib/opencv.h>
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+ShapePredictorGpu::ShapePredictorGpu(const dlib::shape_predictor& model)
+{
+	//The cascades are private, they are read back from dlib's serialization (version 1).
+	std::stringstream stream;
+	dlib::serialize(model, stream);
+	int version = 0;
+	dlib::matrix<float, 0, 1> initial_shape;
+	std::vector<std::vector<dlib::impl::regression_tree>> forests;
+	std::vector<std::vector<unsigned long>> anchor_idx;
+	std::vector<std::vector<dlib::vector<float, 2>>> deltas;
+	dlib::deserialize(version, stream);
+	if (version != 1)
+	{
+		throw std::runtime_error("Error: Unknown shape predictor version " + std::to_string(version) + "!");
+	}
+	dlib::deserialize(initial_shape, stream);
+	dlib::deserialize(forests, stream);
+	dlib::deserialize(anchor_idx, stream);
+	dlib::deserialize(deltas, stream);
+
+	if (forests.empty() || forests[0].empty() || anchor_idx.size() != forests.size() || deltas.size() != forests.size())
+	{
+		throw std::runtime_error("Error: The shape predictor has no cascades!");
+	}
+	m_number_of_parts = initial_shape.size() / 2;
+	m_number_of_cascades = forests.size();
+	m_number_of_trees = forests[0].size();
+	m_number_of_splits = forests[0][0].splits.size();
+	m_number_of_features = anchor_idx[0].size();
+	if (m_number_of_parts > kMaxShapeParts || m_number_of_trees > kMaxShapeTrees || m_number_of_features > kMaxShapeFeatures)
+	{
+		throw std::runtime_error("Error: The shape predictor is too large for the GPU fit!");
+	}
+
+	const int n_coordinates = 2 * m_number_of_parts;
+	const int n_leaves = m_number_of_splits + 1;
+	std::vector<int> anchors;
+	std::vector<glm::vec2> feature_deltas;
+	std::vector<int2> split_features;
+	std::vector<float> split_thresholds;
+	std::vector<float> leaf_values;
+	leaf_values.reserve(static_cast<size_t>(m_number_of_cascades) * m_number_of_trees * n_leaves * n_coordinates);
+	for (int c = 0; c < m_number_of_cascades; ++c)
+	{
+		if (forests[c].size() != m_number_of_trees || anchor_idx[c].size() != m_number_of_features || deltas[c].size() != m_number_of_features)
+		{
+			throw std::runtime_error("Error: The cascades of the shape predictor differ in size!");
+		}
+		for (int f = 0; f < m_number_of_features; ++f)
+		{
+			anchors.push_back(static_cast<int>(anchor_idx[c][f]));
+			feature_deltas.emplace_back(deltas[c][f].x(), deltas[c][f].y());
+		}
+		for (const auto& tree : forests[c])
+		{
+			if (tree.splits.size() != m_number_of_splits || tree.leaf_values.size() != n_leaves)
+			{
+				throw std::runtime_error("Error: The trees of the shape predictor differ in depth!");
+			}
+			for (const auto& split : tree.splits)
+			{
+				split_features.push_back(make_int2(static_cast<int>(split.idx1), static_cast<int>(split.idx2)));
+				split_thresholds.push_back(split.thresh);
+			}
+			for (const auto& leaf : tree.leaf_values)
+			{
+				leaf_values.insert(leaf_values.end(), leaf.begin(), leaf.end());
+			}
+		}
+	}
+
+	m_initial_shape = util::DeviceArray<float>(std::vector<float>(initial_shape.begin(), initial_shape.end()));
+	m_anchors = util::DeviceArray<int>(anchors);
+	m_deltas = util::DeviceArray<glm::vec2>(feature_deltas);
+	m_split_features = util::DeviceArray<int2>(split_features);
+	m_split_thresholds = util::DeviceArray<float>(split_thresholds);
+	m_leaf_values = util::DeviceArray<float>(leaf_values);
+	CHECK_CUDA_ERROR(cudaStreamCreate(&m_stream));
+}
+
+ShapePredictorGpu::~ShapePredictorGpu()
+{
+	cudaStreamDestroy(m_stream);
+}
+
+static ShapePredictorGpu::FaceBox toFaceBox(const dlib::rectangle& box, int image)
+{
+	ShapePredictorGpu::FaceBox face;
+	face.left = static_cast<float>(box.left());
+	face.top = static_cast<float>(box.top());
+	face.width = static_cast<float>(box.right() - box.left());
+	face.height = static_cast<float>(box.bottom() - box.top());
+	face.image = image;
+	return face;
+}
+
+std::vector<std::vector<glm::vec2>> ShapePredictorGpu::fit(const cv::Mat& frame, const std::vector<dlib::rectangle>& boxes)
+{
+	return fit(std::vector<cv::Mat>{ frame }, std::vector<std::vector<dlib::rectangle>>{ boxes })[0];
+}
+
+std::vector<std::vector<std::vector<glm::vec2>>> ShapePredictorGpu::fit(const std::vector<cv::Mat>& frames, const std::vector<std::vector<dlib::rectangle>>& boxes)
+{
+	//Only the frames with faces are uploaded.
+	size_t size = 0;
+	for (int f = 0; f < frames.size(); ++f)
+	{
+		if (frames[f].type() != CV_8UC3)
+		{
+			throw std::runtime_error("Error: The shape predictor expects BGR frames!");
+		}
+		if (!boxes[f].empty())
+		{
+			size += static_cast<size_t>(frames[f].cols) * frames[f].rows * 3;
+		}
+	}
+	util::ensureSize(m_frames, static_cast<int>(size));
+
+	std::vector<Image> images;
+	std::vector<FaceBox> faces;
+	size_t offset = 0;
+	for (int f = 0; f < frames.size(); ++f)
+	{
+		if (boxes[f].empty())
+		{
+			continue;
+		}
+
+		Image image;
+		image.pixels = m_frames.getPtr() + offset;
+		image.pitch = frames[f].cols * 3;
+		image.width = frames[f].cols;
+		image.height = frames[f].rows;
+		CHECK_CUDA_ERROR(cudaMemcpy2DAsync(m_frames.getPtr() + offset, image.pitch, frames[f].ptr(), frames[f].step, image.pitch, image.height,
+			cudaMemcpyHostToDevice, m_stream));
+		offset += image.pitch * image.height;
+
+		for (const auto& box : boxes[f])
+		{
+			faces.push_back(toFaceBox(box, images.size()));
+		}
+		images.push_back(image);
+	}
+
+	auto face_landmarks = launch(images, faces, m_stream);
+
+	std::vector<std::vector<std::vector<glm::vec2>>> landmarks(frames.size());
+	int face = 0;
+	for (int f = 0; f < frames.size(); ++f)
+	{
+		for (int i = 0; i < boxes[f].size(); ++i)
+		{
+			landmarks[f].push_back(std::move(face_landmarks[face++]));
+		}
+	}
+	return landmarks;
+}
+
+std::vector<std::vector<glm::vec2>> ShapePredictorGpu::fit(const uchar* device_frame, size_t pitch, int width, int height,
+	const std::vector<dlib::rectangle>& boxes, cudaStream_t stream)
+{
+	Image image;
+	image.pixels = device_frame;
+	image.pitch = pitch;
+	image.width = width;
+	image.height = height;
+
+	std::vector<FaceBox> faces;
+	for (const auto& box : boxes)
+	{
+		faces.push_back(toFaceBox(box, 0));
+	}
+	return launch({ image }, faces, stream);
+}
+
+ShapePredictorAccuracy ShapePredictorGpu::validate(const dlib::shape_predictor& model, const cv::Mat& frame, const std::vector<dlib::rectangle>& boxes)
+{
+	ShapePredictorAccuracy accuracy;
+	const auto landmarks = fit(frame, boxes);
+	dlib::cv_image<dlib::bgr_pixel> cimg(frame);
+	double sum = 0.0;
+	int n_parts = 0;
+	for (int i = 0; i < boxes.size(); ++i)
+	{
+		const auto shape = model(cimg, boxes[i]);
+		for (unsigned long k = 0; k < shape.num_parts(); ++k)
+		{
+			const float error = glm::length(landmarks[i][k] - glm::vec2(shape.part(k).x(), shape.part(k).y()));
+			accuracy.max_error = std::max(accuracy.max_error, error);
+			sum += error;
+			n_parts++;
+		}
+		accuracy.faces++;
+	}
+	accuracy.mean_error = n_parts > 0 ? static_cast<float>(sum / n_parts) : 0.0f;
+	return accuracy;
+}
@@ -0,0 +1,195 @@
+#include "shape_predictor_gpu.h"
+#include "device_util.h"
+
+constexpr int kShapeThreads = 256; //one block per face
+
+struct ShapeModel
+{
+	const float* initial_shape;
+	const int* anchors;
+	const glm::vec2* deltas;
+	const int2* split_features;
+	const float* split_thresholds;
+	const float* leaf_values;
+	int parts;
+	int cascades;
+	int trees;
+	int splits;
+	int features;
+};
+
+__device__ inline float warpSum(float value)
+{
+	for (int offset = 16; offset > 0; offset >>= 1)
+	{
+		value += __shfl_down_sync(0xffffffff, value, offset);
+	}
+	return __shfl_sync(0xffffffff, value, 0);
+}
+
+//dlib::shape_predictor::operator() of one face. The shape is normalized to the face box, like in dlib.
+__global__ void shapePredictorKernel(ShapeModel model, const ShapePredictorGpu::Image* __restrict__ images,
+	const ShapePredictorGpu::FaceBox* __restrict__ faces, int n_faces, glm::vec2* __restrict__ landmarks)
+{
+	__shared__ float shape[2 * kMaxShapeParts];
+	__shared__ float features[kMaxShapeFeatures];
+	__shared__ int leaves[kMaxShapeTrees];
+	__shared__ float transform[2]; //a, b of the similarity [a -b; b a] from the initial to the current shape
+
+	const int face_index = blockIdx.x;
+	if (face_index >= n_faces)
+	{
+		return;
+	}
+
+	const auto face = faces[face_index];
+	const auto image = images[face.image];
+	const int n_coordinates = 2 * model.parts;
+	for (int i = threadIdx.x; i < n_coordinates; i += blockDim.x)
+	{
+		shape[i] = model.initial_shape[i];
+	}
+
+	for (int c = 0; c < model.cascades; ++c)
+	{
+		__syncthreads();
+
+		//find_tform_between_shapes(initial_shape, current_shape) in closed form, a rotation and scale only.
+		if (threadIdx.x < 32)
+		{
+			float sums[4] = { 0.0f, 0.0f, 0.0f, 0.0f }; //initial x, y, current x, y
+			for (int p = threadIdx.x; p < model.parts; p += 32)
+			{
+				sums[0] += model.initial_shape[2 * p];
+				sums[1] += model.initial_shape[2 * p + 1];
+				sums[2] += shape[2 * p];
+				sums[3] += shape[2 * p + 1];
+			}
+			for (int n = 0; n < 4; ++n)
+			{
+				sums[n] = warpSum(sums[n]) / model.parts;
+			}
+
+			float moments[3] = { 0.0f, 0.0f, 0.0f }; //|from|^2, from . to, from x to
+			for (int p = threadIdx.x; p < model.parts; p += 32)
+			{
+				const float from_x = model.initial_shape[2 * p] - sums[0];
+				const float from_y = model.initial_shape[2 * p + 1] - sums[1];
+				const float to_x = shape[2 * p] - sums[2];
+				const float to_y = shape[2 * p + 1] - sums[3];
+				moments[0] += from_x * from_x + from_y * from_y;
+				moments[1] += from_x * to_x + from_y * to_y;
+				moments[2] += from_x * to_y - from_y * to_x;
+			}
+			for (int n = 0; n < 3; ++n)
+			{
+				moments[n] = warpSum(moments[n]);
+			}
+
+			if (threadIdx.x == 0)
+			{
+				const bool degenerate = moments[0] <= 0.0f;
+				transform[0] = degenerate ? 1.0f : moments[1] / moments[0];
+				transform[1] = degenerate ? 0.0f : moments[2] / moments[0];
+			}
+		}
+		__syncthreads();
+
+		//extract_feature_pixel_values: pixels outside of the frame are 0.
+		const float a = transform[0];
+		const float b = transform[1];
+		for (int f = threadIdx.x; f < model.features; f += blockDim.x)
+		{
+			const int anchor = model.anchors[c * model.features + f];
+			const glm::vec2 delta = model.deltas[c * model.features + f];
+			const float x = a * delta.x - b * delta.y + shape[2 * anchor];
+			const float y = b * delta.x + a * delta.y + shape[2 * anchor + 1];
+			const int pixel_x = static_cast<int>(floorf(face.left + x * face.width + 0.5f));
+			const int pixel_y = static_cast<int>(floorf(face.top + y * face.height + 0.5f));
+
+			float value = 0.0f;
+			if (pixel_x >= 0 && pixel_y >= 0 && pixel_x < image.width && pixel_y < image.height)
+			{
+				const uchar* pixel = image.pixels + pixel_y * image.pitch + 3 * pixel_x;
+				value = static_cast<float>((static_cast<unsigned int>(pixel[0]) + pixel[1] + pixel[2]) / 3); //dlib's get_pixel_intensity
+			}
+			features[f] = value;
+		}
+		__syncthreads();
+
+		const int tree_offset = c * model.trees;
+		for (int t = threadIdx.x; t < model.trees; t += blockDim.x)
+		{
+			const int2* split_features = model.split_features + (tree_offset + t) * model.splits;
+			const float* thresholds = model.split_thresholds + (tree_offset + t) * model.splits;
+			int node = 0;
+			while (node < model.splits)
+			{
+				const int2 split = split_features[node];
+				node = features[split.x] - features[split.y] > thresholds[node] ? 2 * node + 1 : 2 * node + 2;
+			}
+			leaves[t] = node - model.splits;
+		}
+		__syncthreads();
+
+		//The trees are added in order, like dlib does, so there is no reduction over the trees.
+		const int n_leaves = model.splits + 1;
+		for (int i = threadIdx.x; i < n_coordinates; i += blockDim.x)
+		{
+			float value = shape[i];
+			for (int t = 0; t < model.trees; ++t)
+			{
+				value += model.leaf_values[((tree_offset + t) * n_leaves + leaves[t]) * n_coordinates + i];
+			}
+			shape[i] = value;
+		}
+	}
+	__syncthreads();
+
+	//The parts of a full_object_detection are integer pixels.
+	for (int p = threadIdx.x; p < model.parts; p += blockDim.x)
+	{
+		landmarks[face_index * model.parts + p] = glm::vec2(floorf(face.left + shape[2 * p] * face.width + 0.5f),
+			floorf(face.top + shape[2 * p + 1] * face.height + 0.5f));
+	}
+}
+
+std::vector<std::vector<glm::vec2>> ShapePredictorGpu::launch(const std::vector<Image>& images, const std::vector<FaceBox>& faces, cudaStream_t stream)
+{
+	const int n_faces = faces.size();
+	if (n_faces == 0)
+	{
+		return {};
+	}
+
+	util::ensureSize(m_images, images.size());
+	util::ensureSize(m_faces, n_faces);
+	util::ensureSize(m_landmarks, n_faces * m_number_of_parts);
+	CHECK_CUDA_ERROR(cudaMemcpyAsync(m_images.getPtr(), images.data(), images.size() * sizeof(Image), cudaMemcpyHostToDevice, stream));
+	CHECK_CUDA_ERROR(cudaMemcpyAsync(m_faces.getPtr(), faces.data(), n_faces * sizeof(FaceBox), cudaMemcpyHostToDevice, stream));
+
+	ShapeModel model;
+	model.initial_shape = m_initial_shape.getPtr();
+	model.anchors = m_anchors.getPtr();
+	model.deltas = m_deltas.getPtr();
+	model.split_features = m_split_features.getPtr();
+	model.split_thresholds = m_split_thresholds.getPtr();
+	model.leaf_values = m_leaf_values.getPtr();
+	model.parts = m_number_of_parts;
+	model.cascades = m_number_of_cascades;
+	model.trees = m_number_of_trees;
+	model.splits = m_number_of_splits;
+	model.features = m_number_of_features;
+	shapePredictorKernel << <n_faces, kShapeThreads, 0, stream >> > (model, m_images.getPtr(), m_faces.getPtr(), n_faces, m_landmarks.getPtr());
+
+	std::vector<glm::vec2> landmarks(n_faces * m_number_of_parts);
+	CHECK_CUDA_ERROR(cudaMemcpyAsync(landmarks.data(), m_landmarks.getPtr(), landmarks.size() * sizeof(glm::vec2), cudaMemcpyDeviceToHost, stream));
+	CHECK_CUDA_ERROR(cudaStreamSynchronize(stream));
+
+	std::vector<std::vector<glm::vec2>> face_landmarks(n_faces);
+	for (int i = 0; i < n_faces; ++i)
+	{
+		face_landmarks[i].assign(landmarks.begin() + i * m_number_of_parts, landmarks.begin() + (i + 1) * m_number_of_parts);
+	}
+	return face_landmarks;
+}
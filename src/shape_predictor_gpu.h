@@ -0,0 +1,99 @@
+#pragma once
+
+#include "device_array.h"
+
+#include <vector>
+#include <cuda_runtime.h>
+#include <glm/glm.hpp>
+#include <opencv2/core/core.hpp>
+
+//Keeps dlib out of the CUDA sources.
+namespace dlib
+{
+	class rectangle;
+	class shape_predictor;
+}
+
+//Limits of the shared memory of the kernel, ShapePredictorGpu throws for larger models.
+constexpr int kMaxShapeParts = 128;
+constexpr int kMaxShapeFeatures = 1024; //dlib's default feature pool has 400 pixels
+constexpr int kMaxShapeTrees = 1024; //per cascade, dlib's default is 500
+
+//Distance of the GPU landmarks to the ones of dlib::shape_predictor on the same boxes, in frame pixels.
+struct ShapePredictorAccuracy
+{
+	int faces = 0;
+	float mean_error = 0.0f;
+	float max_error = 0.0f;
+};
+
+//Inference of dlib's ensemble of regression trees (shape_predictor_68_face_landmarks.dat) on the device, one block per face.
+//It evaluates the same cascades as dlib::shape_predictor and returns its landmarks up to float rounding of the similarity
+//transform, so the shape predictor fits of a frame, or of all frames of a batch, are a single launch instead of a CPU fit per face.
+//Like LandmarkFlow it uploads the tracker's frames itself, the frame pyramid of the solver isn't uploaded yet when the tracker runs.
+class ShapePredictorGpu
+{
+public:
+	//Copies the cascades of "model" to the device. Throws, if its trees aren't complete binary trees of one depth,
+	//which dlib's trainer always produces.
+	explicit ShapePredictorGpu(const dlib::shape_predictor& model);
+	ShapePredictorGpu(const ShapePredictorGpu&) = delete;
+	ShapePredictorGpu& operator=(const ShapePredictorGpu&) = delete;
+	~ShapePredictorGpu();
+
+	int getNumberOfParts() const { return m_number_of_parts; }
+
+	//All parts of every box of "boxes" in "frame" (BGR), in frame pixels, like Tracker's fits of dlib::shape_predictor.
+	//Waits for the results.
+	std::vector<std::vector<glm::vec2>> fit(const cv::Mat& frame, const std::vector<dlib::rectangle>& boxes);
+	//The faces of all frames in one launch, "boxes" has an entry per frame. The frames may have different sizes.
+	std::vector<std::vector<std::vector<glm::vec2>>> fit(const std::vector<cv::Mat>& frames, const std::vector<std::vector<dlib::rectangle>>& boxes);
+	//Same for a frame which is on the device already, 3 bytes per pixel (BGR or RGB, the intensity is their mean) rows
+	//of "pitch" bytes, e.g. Pyramid::getFrame(0). Work on "stream" before the call is ordered with the fit.
+	std::vector<std::vector<glm::vec2>> fit(const uchar* device_frame, size_t pitch, int width, int height,
+		const std::vector<dlib::rectangle>& boxes, cudaStream_t stream = 0);
+
+	//Fits "boxes" of "frame" on the device and with "model" on the host, which must be the model of the constructor.
+	ShapePredictorAccuracy validate(const dlib::shape_predictor& model, const cv::Mat& frame, const std::vector<dlib::rectangle>& boxes);
+
+	//The box and image of one face, for the kernel.
+	struct FaceBox
+	{
+		float left = 0.0f;
+		float top = 0.0f;
+		float width = 0.0f; //right - left, dlib's boxes include their right and bottom pixels
+		float height = 0.0f;
+		int image = 0; //index into the images of the launch
+	};
+	struct Image
+	{
+		const uchar* pixels = nullptr;
+		size_t pitch = 0;
+		int width = 0;
+		int height = 0;
+	};
+
+private:
+	std::vector<std::vector<glm::vec2>> launch(const std::vector<Image>& images, const std::vector<FaceBox>& faces, cudaStream_t stream);
+
+private:
+	int m_number_of_parts{ 0 };
+	int m_number_of_cascades{ 0 };
+	int m_number_of_trees{ 0 }; //per cascade
+	int m_number_of_splits{ 0 }; //per tree
+	int m_number_of_features{ 0 }; //feature pixels per cascade
+	cudaStream_t m_stream{ nullptr };
+
+	util::DeviceArray<float> m_initial_shape; //x0, y0, x1, ... normalized to the face box
+	util::DeviceArray<int> m_anchors; //[cascade][feature], the part a feature pixel moves with
+	util::DeviceArray<glm::vec2> m_deltas; //[cascade][feature], its offset from the part in the initial shape
+	util::DeviceArray<int2> m_split_features; //[cascade][tree][split], the two feature pixels
+	util::DeviceArray<float> m_split_thresholds; //[cascade][tree][split]
+	util::DeviceArray<float> m_leaf_values; //[cascade][tree][leaf][2 * part]
+
+	//Inputs of the last launch, reused while large enough.
+	util::DeviceArray<uchar> m_frames; //host frames of fit, back to back
+	util::DeviceArray<Image> m_images;
+	util::DeviceArray<FaceBox> m_faces;
+	util::DeviceArray<glm::vec2> m_landmarks; //[face][part]
+};
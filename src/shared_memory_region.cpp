@@ -0,0 +1,91 @@
+#include "shared_memory_region.h"
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+SharedMemoryRegion::SharedMemoryRegion(const std::string& name, size_t size)
+	: m_name(name)
+	, m_owner(size > 0)
+{
+	if (m_owner)
+	{
+		const auto size64 = static_cast<unsigned long long>(size);
+		m_mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, static_cast<DWORD>(size64 >> 32),
+			static_cast<DWORD>(size64), name.c_str());
+	}
+	else
+	{
+		m_mapping = OpenFileMappingA(FILE_MAP_READ | FILE_MAP_WRITE, FALSE, name.c_str());
+	}
+	if (m_mapping == nullptr)
+	{
+		return;
+	}
+
+	m_data = static_cast<char*>(MapViewOfFile(m_mapping, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, size));
+	if (m_data && !m_owner)
+	{
+		MEMORY_BASIC_INFORMATION info;
+		VirtualQuery(m_data, &info, sizeof(info));
+		size = info.RegionSize;
+	}
+	m_size = m_data ? size : 0;
+}
+
+SharedMemoryRegion::~SharedMemoryRegion()
+{
+	if (m_data)
+	{
+		UnmapViewOfFile(m_data);
+	}
+	if (m_mapping)
+	{
+		CloseHandle(m_mapping);
+	}
+}
+#else
+SharedMemoryRegion::SharedMemoryRegion(const std::string& name, size_t size)
+	: m_name("/" + name)
+	, m_owner(size > 0)
+{
+	int file = m_owner ? shm_open(m_name.c_str(), O_CREAT | O_RDWR, 0600) : shm_open(m_name.c_str(), O_RDWR, 0);
+	if (file < 0)
+	{
+		return;
+	}
+
+	struct stat file_stat;
+	if (m_owner ? ftruncate(file, size) == 0 : (fstat(file, &file_stat) == 0 && (size = file_stat.st_size) > 0))
+	{
+		//Readers map it writable as well, the sequence counters are atomics.
+		void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+		if (data != MAP_FAILED)
+		{
+			m_data = static_cast<char*>(data);
+			m_size = size;
+		}
+	}
+	close(file); //the mapping stays valid
+}
+
+SharedMemoryRegion::~SharedMemoryRegion()
+{
+	if (m_data)
+	{
+		munmap(m_data, m_size);
+	}
+	//Readers which have it mapped keep their mapping, new ones don't find it anymore.
+	if (m_owner)
+	{
+		shm_unlink(m_name.c_str());
+	}
+}
+#endif
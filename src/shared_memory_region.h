@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+//Named shared memory region, created by the writer and opened by the readers. POSIX shm_open, a named file mapping on Windows.
+class SharedMemoryRegion
+{
+public:
+	//"size" 0 opens an existing region of the writer, isOpen() is false if there is none.
+	SharedMemoryRegion(const std::string& name, size_t size);
+	~SharedMemoryRegion();
+
+	SharedMemoryRegion(const SharedMemoryRegion&) = delete;
+	SharedMemoryRegion& operator=(const SharedMemoryRegion&) = delete;
+
+	bool isOpen() const { return m_data != nullptr; }
+	char* getData() const { return m_data; }
+	size_t getSize() const { return m_size; }
+
+private:
+	std::string m_name;
+	bool m_owner;
+	char* m_data{ nullptr };
+	size_t m_size{ 0 };
+#ifdef _WIN32
+	void* m_mapping{ nullptr };
+#endif
+};
@@ -0,0 +1,249 @@
+#include "shared_memory_sink.h"
+#include "face.h"
+#include "util.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <cuda_runtime.h>
+
+static_assert(sizeof(SharedFrameHeader) <= SharedFrameHeader::kSlotOffset, "The slots overlap the header.");
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "The shared sequence counters need lock-free 64 bit atomics.");
+
+static size_t alignToCacheLine(size_t bytes)
+{
+	return (bytes + 63) / 64 * 64;
+}
+
+static SharedFrameSlot* getSlot(const SharedFrameHeader* header, uint64_t index)
+{
+	auto* data = reinterpret_cast<char*>(const_cast<SharedFrameHeader*>(header));
+	return reinterpret_cast<SharedFrameSlot*>(data + SharedFrameHeader::kSlotOffset + (index % header->num_slots) * header->slot_size);
+}
+
+static float* getSlotValues(SharedFrameSlot* slot)
+{
+	return reinterpret_cast<float*>(reinterpret_cast<char*>(slot) + alignToCacheLine(sizeof(SharedFrameSlot)));
+}
+
+static size_t getSlotSize(const Face& face, bool with_mesh)
+{
+	const size_t num_values = face.getShapeCoefficients().size() + face.getAlbedoCoefficients().size()
+		+ face.getExpressionCoefficients().size() + face.getSHCoefficients().size() + (with_mesh ? 3 * face.getModel()->meshes[0].number_of_vertices : 0);
+	return alignToCacheLine(sizeof(SharedFrameSlot)) + alignToCacheLine(num_values * sizeof(float));
+}
+
+//See SharedFrameHeader, the full mesh has the most vertices.
+static size_t getTopologySize(const Face& face, bool with_mesh)
+{
+	if (!with_mesh)
+	{
+		return 0;
+	}
+	size_t bytes = face.getModel()->meshes[0].number_of_vertices * sizeof(int32_t);
+	for (const auto& mesh : face.getModel()->meshes)
+	{
+		bytes += 2 * sizeof(uint32_t) + mesh.indices.size() * sizeof(uint32_t);
+	}
+	return bytes;
+}
+
+SharedMemorySink::SharedMemorySink(const std::string& name, const Face& face, bool with_mesh, int num_slots)
+	: m_region(name, SharedFrameHeader::kSlotOffset + std::max(num_slots, 1) * getSlotSize(face, with_mesh) + getTopologySize(face, with_mesh))
+{
+	if (!m_region.isOpen())
+	{
+		throw std::runtime_error("Error: Could not create the shared memory " + name);
+	}
+
+	m_header = new (m_region.getData()) SharedFrameHeader();
+	m_header->num_slots = std::max(num_slots, 1);
+	m_header->slot_size = static_cast<uint32_t>(getSlotSize(face, with_mesh));
+	m_header->num_shape_coefficients = static_cast<uint32_t>(face.getShapeCoefficients().size());
+	m_header->num_albedo_coefficients = static_cast<uint32_t>(face.getAlbedoCoefficients().size());
+	m_header->num_expression_coefficients = static_cast<uint32_t>(face.getExpressionCoefficients().size());
+	m_header->num_sh_coefficients = static_cast<uint32_t>(face.getSHCoefficients().size());
+	m_header->max_vertices = with_mesh ? face.getModel()->meshes[0].number_of_vertices : 0;
+	for (uint32_t i = 0; i < m_header->num_slots; ++i)
+	{
+		new (getSlot(m_header, i)) SharedFrameSlot();
+	}
+
+	if (with_mesh)
+	{
+		const auto& model = *face.getModel();
+		m_header->num_levels_of_detail = static_cast<uint32_t>(model.meshes.size());
+		m_header->topology_offset = SharedFrameHeader::kSlotOffset + m_header->num_slots * m_header->slot_size;
+		m_header->topology_size = static_cast<uint32_t>(getTopologySize(face, with_mesh));
+		char* topology = static_cast<char*>(m_region.getData()) + m_header->topology_offset;
+		auto write = [&topology](const void* data, size_t bytes)
+		{
+			std::memcpy(topology, data, bytes);
+			topology += bytes;
+		};
+		write(model.original_vertex_ids.data(), m_header->max_vertices * sizeof(int32_t));
+		for (const auto& mesh : model.meshes)
+		{
+			const uint32_t counts[2] = { mesh.number_of_vertices, static_cast<uint32_t>(mesh.indices.size()) };
+			write(counts, sizeof(counts));
+			write(mesh.indices.data(), mesh.indices.size() * sizeof(uint32_t));
+		}
+	}
+
+	//Pinned, the mesh is written by DMA. Pageable memory works as well, through a staging copy of the driver.
+	if (with_mesh)
+	{
+		m_registered = cudaHostRegister(m_region.getData(), m_region.getSize(), cudaHostRegisterDefault) == cudaSuccess;
+		if (!m_registered)
+		{
+			cudaGetLastError();
+			std::cout << "Warning: Could not pin the shared memory " << name << ", the mesh is copied through pageable memory." << std::endl;
+		}
+	}
+}
+
+SharedMemorySink::~SharedMemorySink()
+{
+	if (m_registered)
+	{
+		cudaHostUnregister(m_region.getData());
+	}
+}
+
+void SharedMemorySink::write(Face& face, const glm::mat4& projection, bool tracked)
+{
+	const uint64_t index = m_next_frame++;
+	SharedFrameSlot* slot = getSlot(m_header, index);
+
+	slot->sequence.store(2 * index + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	slot->frame = static_cast<uint32_t>(index);
+	slot->tracked = tracked ? 1 : 0;
+	std::memcpy(slot->rotation, &face.getRotationCoefficients()[0], sizeof(slot->rotation));
+	std::memcpy(slot->translation, &face.getTranslationCoefficients()[0], sizeof(slot->translation));
+	std::memcpy(slot->projection, &projection[0][0], sizeof(slot->projection));
+
+	float* values = getSlotValues(slot);
+	auto append = [&values](const std::vector<float>& coefficients)
+	{
+		std::memcpy(values, coefficients.data(), coefficients.size() * sizeof(float));
+		values += coefficients.size();
+	};
+	append(face.getShapeCoefficients());
+	append(face.getAlbedoCoefficients());
+	append(face.getExpressionCoefficients());
+	append(face.getSHCoefficients());
+
+	slot->num_vertices = std::min(face.getNumberOfVertices(), m_header->max_vertices);
+	slot->level_of_detail = static_cast<uint32_t>(face.getLevelOfDetail());
+	if (slot->num_vertices > 0)
+	{
+		//The positions come first in the current face.
+		CHECK_CUDA_ERROR(cudaMemcpyAsync(values, face.getCurrentFaceGpu(), slot->num_vertices * sizeof(glm::vec3), cudaMemcpyDeviceToHost, face.getStream()));
+		CHECK_CUDA_ERROR(cudaStreamSynchronize(face.getStream()));
+	}
+
+	slot->sequence.store(2 * (index + 1), std::memory_order_release);
+	m_header->published.store(index + 1, std::memory_order_release);
+}
+
+SharedMemoryReader::SharedMemoryReader(const std::string& name)
+	: m_region(name, 0)
+{
+	m_header = reinterpret_cast<const SharedFrameHeader*>(m_region.getData());
+	if (!m_region.isOpen() || m_region.getSize() < SharedFrameHeader::kSlotOffset || std::memcmp(m_header->magic, "FSHM", 4) != 0)
+	{
+		throw std::runtime_error("Error: There is no shared memory output " + name);
+	}
+	if (m_header->version != SharedFrameHeader().version)
+	{
+		throw std::runtime_error("Error: Unsupported version " + std::to_string(m_header->version) + " of the shared memory output " + name);
+	}
+
+	if (m_header->num_levels_of_detail > 0)
+	{
+		if (static_cast<size_t>(m_header->topology_offset) + m_header->topology_size > m_region.getSize())
+		{
+			throw std::runtime_error("Error: The topology of the shared memory output " + name + " is truncated!");
+		}
+		const char* topology = static_cast<const char*>(m_region.getData()) + m_header->topology_offset;
+		const char* end = topology + m_header->topology_size;
+		auto read = [&topology, end](void* target, size_t bytes)
+		{
+			if (topology + bytes > end)
+			{
+				throw std::runtime_error("Error: The topology of the shared memory output is truncated!");
+			}
+			std::memcpy(target, topology, bytes);
+			topology += bytes;
+		};
+		m_original_vertex_ids.resize(m_header->max_vertices);
+		read(m_original_vertex_ids.data(), m_original_vertex_ids.size() * sizeof(int32_t));
+		m_indices.resize(m_header->num_levels_of_detail);
+		for (auto& indices : m_indices)
+		{
+			uint32_t counts[2];
+			read(counts, sizeof(counts));
+			if (counts[1] > static_cast<size_t>(end - topology) / sizeof(uint32_t))
+			{
+				throw std::runtime_error("Error: The topology of the shared memory output is truncated!");
+			}
+			indices.resize(counts[1]);
+			read(indices.data(), indices.size() * sizeof(uint32_t));
+		}
+	}
+}
+
+bool SharedMemoryReader::readLatest(SharedFrame& frame) const
+{
+	//Each retry reads a newer frame, the writer only laps a reader which is stalled for num_slots frames.
+	for (int attempt = 0; attempt < 3; ++attempt)
+	{
+		const uint64_t published = getNumberOfPublishedFrames();
+		if (published == 0)
+		{
+			return false;
+		}
+		if (read(published - 1, frame))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+bool SharedMemoryReader::read(uint64_t index, SharedFrame& frame) const
+{
+	SharedFrameSlot* slot = getSlot(m_header, index);
+	const uint64_t sequence = slot->sequence.load(std::memory_order_acquire);
+	if (sequence != 2 * (index + 1))
+	{
+		return false;
+	}
+
+	frame.frame = slot->frame;
+	frame.tracked = slot->tracked != 0;
+	frame.level_of_detail = static_cast<int>(slot->level_of_detail);
+	std::memcpy(&frame.rotation[0], slot->rotation, sizeof(slot->rotation));
+	std::memcpy(&frame.translation[0], slot->translation, sizeof(slot->translation));
+	std::memcpy(&frame.projection[0][0], slot->projection, sizeof(slot->projection));
+
+	const float* values = getSlotValues(slot);
+	auto extract = [&values](std::vector<float>& coefficients, uint32_t count)
+	{
+		coefficients.assign(values, values + count);
+		values += count;
+	};
+	extract(frame.shape, m_header->num_shape_coefficients);
+	extract(frame.albedo, m_header->num_albedo_coefficients);
+	extract(frame.expression, m_header->num_expression_coefficients);
+	extract(frame.sh, m_header->num_sh_coefficients);
+	const uint32_t num_vertices = std::min(slot->num_vertices, m_header->max_vertices);
+	frame.positions.resize(num_vertices);
+	std::memcpy(frame.positions.data(), values, num_vertices * sizeof(glm::vec3));
+
+	std::atomic_thread_fence(std::memory_order_acquire);
+	return slot->sequence.load(std::memory_order_relaxed) == sequence;
+}
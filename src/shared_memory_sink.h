@@ -0,0 +1,116 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+#include "shared_memory_region.h"
+
+class Face;
+
+//Layout of the shared memory of a SharedMemorySink: the header, followed by num_slots slots of slot_size bytes from byte
+//kSlotOffset on. Slots are 64 byte aligned, so a slot doesn't share a cache line with its neighbours. The writer
+//fills the slots round robin, frame i goes to slot i % num_slots. Every slot is a seqlock, see SharedFrameSlot.
+//With a mesh, the topology follows the slots from byte topology_offset on. It is written once, before the first frame:
+//int32_t original_vertex_ids[max_vertices] (the vertex of the model files each vertex is, see Face::compactModel), then
+//for each of the num_levels_of_detail levels uint32_t num_vertices, uint32_t num_indices and uint32_t indices[num_indices]
+//(triangles). A slot's positions belong to the index buffer of its level_of_detail.
+struct SharedFrameHeader
+{
+	static constexpr uint32_t kSlotOffset = 64;
+
+	char magic[4]{ 'F', 'S', 'H', 'M' };
+	uint32_t version = 2;
+	uint32_t num_slots = 0;
+	uint32_t slot_size = 0; //bytes, including the SharedFrameSlot
+	uint32_t num_shape_coefficients = 0;
+	uint32_t num_albedo_coefficients = 0;
+	uint32_t num_expression_coefficients = 0;
+	uint32_t num_sh_coefficients = 0;
+	uint32_t max_vertices = 0; //0: no mesh
+	uint32_t num_levels_of_detail = 0; //0: no mesh
+	uint32_t topology_offset = 0; //bytes
+	uint32_t topology_size = 0; //bytes
+	std::atomic<uint64_t> published{ 0 }; //frames published so far, the newest one is in slot (published - 1) % num_slots
+};
+
+//Followed by the values of the frame: shape, albedo, expression and SH coefficients, then num_vertices positions (3 floats).
+struct SharedFrameSlot
+{
+	//Odd while the writer fills the slot, 2 * (frame + 1) once frame is complete. A reader copies or reads the slot in place
+	//and checks that the sequence didn't change meanwhile, otherwise the writer lapped it.
+	std::atomic<uint64_t> sequence{ 0 };
+	uint32_t frame = 0;
+	uint32_t tracked = 0;
+	uint32_t num_vertices = 0; //follows the level of detail, at most max_vertices
+	uint32_t level_of_detail = 0; //of the index buffer of the positions
+	float rotation[3]{};
+	float translation[3]{};
+	float projection[16]{}; //column major
+};
+
+//Values of one frame, copied out of the shared memory by SharedMemoryReader.
+struct SharedFrame
+{
+	uint32_t frame = 0;
+	bool tracked = false;
+	glm::vec3 rotation{ 0.0f };
+	glm::vec3 translation{ 0.0f };
+	glm::mat4 projection{ 1.0f };
+	std::vector<float> shape;
+	std::vector<float> albedo;
+	std::vector<float> expression;
+	std::vector<float> sh;
+	std::vector<glm::vec3> positions; //empty without a mesh
+	int level_of_detail = 0; //see SharedMemoryReader::getIndices
+};
+
+//Publishes the fitted parameters, and optionally the positions of the current face, of every frame to other processes through
+//a lock-free ring of num_slots frames in shared memory. There is one writer, any number of readers, and the writer never
+//waits for them: a reader that is more than num_slots frames behind misses frames. The region is pinned with
+//cudaHostRegister where possible, so the mesh is copied straight from the device into it.
+class SharedMemorySink
+{
+public:
+	static constexpr int kDefaultNumSlots = 4;
+
+	SharedMemorySink(const std::string& name, const Face& face, bool with_mesh, int num_slots = kDefaultNumSlots);
+	~SharedMemorySink();
+
+	SharedMemorySink(const SharedMemorySink&) = delete;
+	SharedMemorySink& operator=(const SharedMemorySink&) = delete;
+
+	//Waits for the copy of the mesh, if it is published.
+	void write(Face& face, const glm::mat4& projection, bool tracked);
+
+private:
+	SharedMemoryRegion m_region;
+	SharedFrameHeader* m_header;
+	bool m_registered{ false }; //with cudaHostRegister
+	uint32_t m_next_frame{ 0 };
+};
+
+class SharedMemoryReader
+{
+public:
+	//Throws, if there is no SharedMemorySink of that name.
+	explicit SharedMemoryReader(const std::string& name);
+
+	const SharedFrameHeader& getHeader() const { return *m_header; }
+	//Topology of the mesh, empty without one. The triangles of a frame are getIndices(frame.level_of_detail).
+	const std::vector<uint32_t>& getIndices(int level_of_detail) const { return m_indices.at(level_of_detail); }
+	const std::vector<int32_t>& getOriginalVertexIds() const { return m_original_vertex_ids; }
+	uint64_t getNumberOfPublishedFrames() const { return m_header->published.load(std::memory_order_acquire); }
+
+	//Copies the newest frame. False, if nothing was published yet or the writer kept lapping the reader.
+	bool readLatest(SharedFrame& frame) const;
+	//Frame "index", false if it wasn't published yet or was overwritten already.
+	bool read(uint64_t index, SharedFrame& frame) const;
+
+private:
+	SharedMemoryRegion m_region;
+	const SharedFrameHeader* m_header;
+	std::vector<std::vector<uint32_t>> m_indices; //per level of detail
+	std::vector<int32_t> m_original_vertex_ids;
+};
@@ -0,0 +1,206 @@
+#include "solver_comparison.h"
+#include "util.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+SolverComparison::SolverComparison(const ComparisonSettings& settings, const SolverParameters& candidate_parameters, Face& candidate_face,
+	const std::string& model_directory)
+	: m_settings(settings)
+	, m_candidate_parameters(candidate_parameters)
+	, m_candidate_face(candidate_face)
+	, m_model_directory(model_directory)
+{
+}
+
+SolverParameters SolverComparison::getReferenceParameters(const SolverParameters& candidate_parameters)
+{
+	//Weights, iteration and coefficient counts stay those of the candidate, only the paths which change the numerics are reset.
+	SolverParameters parameters(candidate_parameters);
+	parameters.use_matrix_free_pcg = false;
+	parameters.use_row_major_jacobian = false;
+	parameters.use_fused_pcg = false;
+	parameters.use_cuda_graphs = false;
+	parameters.use_normal_equations = false;
+	parameters.use_host_ldlt = false;
+	parameters.use_block_preconditioner = false;
+	parameters.pixel_sampling_mode = 0;
+	parameters.use_levenberg_marquardt = false;
+	parameters.verbosity = 0;
+	return parameters;
+}
+
+static float rmsDelta(const std::vector<float>& a, const std::vector<float>& b)
+{
+	const size_t n = std::min(a.size(), b.size());
+	float sum = 0.0f;
+	for (size_t i = 0; i < n; ++i)
+	{
+		sum += (a[i] - b[i]) * (a[i] - b[i]);
+	}
+	return n > 0 ? std::sqrt(sum / n) : 0.0f;
+}
+
+static float maxDelta(const glm::vec3& a, const glm::vec3& b)
+{
+	const auto delta = glm::abs(a - b);
+	return std::max(delta.x, std::max(delta.y, delta.z));
+}
+
+FrameComparison SolverComparison::compareFaces(const Face& reference, const glm::mat4& reference_projection, const Face& candidate,
+	const glm::mat4& candidate_projection) const
+{
+	FrameComparison comparison;
+	comparison.max_rotation_delta = maxDelta(reference.getRotationCoefficients(), candidate.getRotationCoefficients());
+	comparison.max_translation_delta = maxDelta(reference.getTranslationCoefficients(), candidate.getTranslationCoefficients());
+	comparison.focal_delta = std::abs(reference_projection[0][0] - candidate_projection[0][0]);
+	comparison.shape_delta = rmsDelta(reference.getShapeCoefficients(), candidate.getShapeCoefficients());
+	comparison.expression_delta = rmsDelta(reference.getExpressionCoefficients(), candidate.getExpressionCoefficients());
+	comparison.albedo_delta = rmsDelta(reference.getAlbedoCoefficients(), candidate.getAlbedoCoefficients());
+	comparison.sh_delta = rmsDelta(reference.getSHCoefficients(), candidate.getSHCoefficients());
+	return comparison;
+}
+
+void SolverComparison::run(const BenchmarkFixture& fixture, Pyramid& pyramid, const glm::mat4& projection)
+{
+	Face reference_face(m_model_directory);
+	reference_face.getGraphicsSettings().shader = m_candidate_face.getGraphicsSettings().shader;
+	GaussNewtonSolver reference(getReferenceParameters(m_candidate_parameters));
+	GaussNewtonSolver candidate(m_candidate_parameters);
+	glm::mat4 reference_projection = projection;
+	glm::mat4 candidate_projection = projection;
+
+	auto timeSolve = [&](GaussNewtonSolver& solver, const std::vector<glm::vec2>& landmarks, Face& face, glm::mat4& face_projection)
+	{
+		auto start = std::chrono::high_resolution_clock::now();
+		solver.solve(landmarks, face, face_projection, pyramid);
+		CHECK_CUDA_ERROR(cudaStreamSynchronize(solver.getStream()));
+		auto end = std::chrono::high_resolution_clock::now();
+		return std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1000.0f;
+	};
+
+	m_frames.clear();
+	m_basis_precision = BasisPrecisionReport();
+	const int n_frames = std::min(static_cast<int>(fixture.frames.size()), m_settings.num_frames);
+	const auto first_tracked = std::find_if(fixture.landmarks.begin(), fixture.landmarks.begin() + n_frames,
+		[](const std::vector<glm::vec2>& landmarks) { return !landmarks.empty(); });
+	if (first_tracked != fixture.landmarks.begin() + n_frames && !m_candidate_face.isHalfPrecisionBasis())
+	{
+		//Leaves the candidate as it was, so the frames below start from the same state.
+		pyramid.uploadFrame(fixture.frames[first_tracked - fixture.landmarks.begin()]);
+		m_basis_precision = candidate.validateHalfPrecisionBasis(*first_tracked, m_candidate_face, candidate_projection, pyramid);
+	}
+	for (int i = 0; i < n_frames; ++i)
+	{
+		const auto& landmarks = fixture.landmarks[i];
+		//On the legacy default stream, which both (blocking) solver streams wait for.
+		pyramid.uploadFrame(fixture.frames[i]);
+
+		const float reference_ms = timeSolve(reference, landmarks, reference_face, reference_projection);
+		const float candidate_ms = timeSolve(candidate, landmarks, m_candidate_face, candidate_projection);
+
+		auto comparison = compareFaces(reference_face, reference_projection, m_candidate_face, candidate_projection);
+		comparison.tracked = !landmarks.empty();
+		comparison.reference_ms = reference_ms;
+		comparison.candidate_ms = candidate_ms;
+		if (comparison.tracked)
+		{
+			comparison.reference = reference.evaluateFit(landmarks, reference_face, reference_projection, pyramid);
+			comparison.candidate = reference.evaluateFit(landmarks, m_candidate_face, candidate_projection, pyramid);
+		}
+		m_frames.push_back(comparison);
+	}
+
+	writeReport();
+}
+
+void SolverComparison::writeReport() const
+{
+	std::ofstream file(m_settings.output_path);
+	if (!file.is_open())
+	{
+		throw std::runtime_error("Error: Could not open " + m_settings.output_path + " for writing!");
+	}
+
+	//Means over the tracked frames, medians of the frame times.
+	FrameComparison mean;
+	std::vector<float> reference_ms, candidate_ms;
+	int n_tracked = 0;
+	for (const auto& frame : m_frames)
+	{
+		reference_ms.push_back(frame.reference_ms);
+		candidate_ms.push_back(frame.candidate_ms);
+		if (!frame.tracked)
+		{
+			continue;
+		}
+		n_tracked++;
+		mean.max_rotation_delta += frame.max_rotation_delta;
+		mean.max_translation_delta += frame.max_translation_delta;
+		mean.focal_delta += frame.focal_delta;
+		mean.shape_delta += frame.shape_delta;
+		mean.expression_delta += frame.expression_delta;
+		mean.albedo_delta += frame.albedo_delta;
+		mean.sh_delta += frame.sh_delta;
+		mean.reference.landmark_error += frame.reference.landmark_error;
+		mean.reference.photometric_error += frame.reference.photometric_error;
+		mean.candidate.landmark_error += frame.candidate.landmark_error;
+		mean.candidate.photometric_error += frame.candidate.photometric_error;
+	}
+	const float scale = 1.0f / std::max(n_tracked, 1);
+	auto median = [](std::vector<float> values)
+	{
+		if (values.empty())
+		{
+			return 0.0f;
+		}
+		std::nth_element(values.begin(), values.begin() + values.size() / 2, values.end());
+		return values[values.size() / 2];
+	};
+
+	auto writeFrame = [&](const FrameComparison& frame, float frame_scale, const char* indent)
+	{
+		file << indent << "\"rotation_delta\": " << frame.max_rotation_delta * frame_scale
+			<< ", \"translation_delta\": " << frame.max_translation_delta * frame_scale
+			<< ", \"focal_delta\": " << frame.focal_delta * frame_scale
+			<< ", \"shape_delta\": " << frame.shape_delta * frame_scale
+			<< ", \"expression_delta\": " << frame.expression_delta * frame_scale
+			<< ", \"albedo_delta\": " << frame.albedo_delta * frame_scale
+			<< ", \"sh_delta\": " << frame.sh_delta * frame_scale << "," << std::endl
+			<< indent << "\"reference_landmark_error_px\": " << frame.reference.landmark_error * frame_scale
+			<< ", \"candidate_landmark_error_px\": " << frame.candidate.landmark_error * frame_scale
+			<< ", \"reference_photometric_error\": " << frame.reference.photometric_error * frame_scale
+			<< ", \"candidate_photometric_error\": " << frame.candidate.photometric_error * frame_scale;
+	};
+
+	file << "{" << std::endl
+		<< "  \"frames\": " << m_frames.size() << "," << std::endl
+		<< "  \"tracked_frames\": " << n_tracked << "," << std::endl
+		<< "  \"reference_ms_p50\": " << median(reference_ms) << "," << std::endl
+		<< "  \"candidate_ms_p50\": " << median(candidate_ms) << "," << std::endl
+		<< "  \"basis_precision\": { \"validated\": " << (m_basis_precision.validated ? "true" : "false")
+		<< ", \"loss_fp32\": " << m_basis_precision.loss_fp32 << ", \"loss_fp16\": " << m_basis_precision.loss_fp16
+		<< ", \"max_position_error\": " << m_basis_precision.max_position_error
+		<< ", \"max_albedo_error\": " << m_basis_precision.max_albedo_error << " }," << std::endl
+		<< "  \"mean\": {" << std::endl;
+	writeFrame(mean, scale, "    ");
+	file << std::endl << "  }," << std::endl << "  \"per_frame\": [";
+	for (int i = 0; i < m_frames.size(); ++i)
+	{
+		const auto& frame = m_frames[i];
+		file << (i > 0 ? "," : "") << std::endl
+			<< "    { \"frame\": " << i << ", \"tracked\": " << (frame.tracked ? "true" : "false")
+			<< ", \"reference_ms\": " << frame.reference_ms << ", \"candidate_ms\": " << frame.candidate_ms << "," << std::endl;
+		writeFrame(frame, 1.0f, "      ");
+		file << " }";
+	}
+	file << std::endl << "  ]" << std::endl << "}" << std::endl;
+
+	std::cout << "Compared " << m_frames.size() << " frames: " << median(reference_ms) << " ms reference, " << median(candidate_ms)
+		<< " ms candidate, landmark error " << mean.reference.landmark_error * scale << " / " << mean.candidate.landmark_error * scale
+		<< " px, photometric error " << mean.reference.photometric_error * scale << " / " << mean.candidate.photometric_error * scale << std::endl;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "benchmark.h"
+#include "gauss_newton_solver.h"
+
+#include <string>
+#include <vector>
+
+struct ComparisonSettings
+{
+	std::string output_path; //JSON report, empty: no comparison
+	int num_frames = 300;
+};
+
+//Differences between a reference and a candidate fit of the same frame. Parameters are compared as the solvers left them.
+struct FrameComparison
+{
+	bool tracked = false;
+	float reference_ms = 0.0f; //solve, synchronized
+	float candidate_ms = 0.0f;
+
+	float max_rotation_delta = 0.0f; //radians
+	float max_translation_delta = 0.0f;
+	float focal_delta = 0.0f; //projection[0][0]
+	//RMS over the coefficients
+	float shape_delta = 0.0f;
+	float expression_delta = 0.0f;
+	float albedo_delta = 0.0f;
+	float sh_delta = 0.0f;
+
+	FitQuality reference;
+	FitQuality candidate;
+};
+
+//Accuracy against speed of a solver configuration. The reference is the plain path: FP32 bases in their original layout, the
+//stored dense Jacobian solved by PCG, all pixels and no damping. The candidate runs the given parameters and Face, e.g. with
+//FP16 bases, subsampling, matrix-free or normal equation solves. Both solve the same frames and landmarks (see
+//loadBenchmarkFixture), each with its own face and temporal state. Both fits are evaluated by the reference solver. With FP32
+//bases the candidate also validates FP16 bases on the first tracked frame (GaussNewtonSolver::validateHalfPrecisionBasis).
+class SolverComparison
+{
+public:
+	//"candidate_face" is the one the candidate solves, the reference loads its own copy of the model from "model_directory".
+	SolverComparison(const ComparisonSettings& settings, const SolverParameters& candidate_parameters, Face& candidate_face,
+		const std::string& model_directory);
+
+	//Needs a current GL context and a pyramid of the size of the frames.
+	void run(const BenchmarkFixture& fixture, Pyramid& pyramid, const glm::mat4& projection);
+
+	const std::vector<FrameComparison>& getFrames() const { return m_frames; }
+	const BasisPrecisionReport& getBasisPrecision() const { return m_basis_precision; }
+
+private:
+	static SolverParameters getReferenceParameters(const SolverParameters& candidate_parameters);
+	FrameComparison compareFaces(const Face& reference, const glm::mat4& reference_projection, const Face& candidate,
+		const glm::mat4& candidate_projection) const;
+	void writeReport() const;
+
+private:
+	ComparisonSettings m_settings;
+	SolverParameters m_candidate_parameters;
+	Face& m_candidate_face;
+	std::string m_model_directory;
+	std::vector<FrameComparison> m_frames;
+	BasisPrecisionReport m_basis_precision;
+};
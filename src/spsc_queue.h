@@ -0,0 +1,130 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+namespace util
+{
+	//Bounded lock-free ring buffer for exactly one producer and one consumer thread. tryPush and tryPop never block, push and pop
+	//sleep on a condition variable while the queue is full or empty. The lock is only taken if the other side is asleep.
+	template<typename T>
+	class SpscQueue
+	{
+	public:
+		explicit SpscQueue(size_t capacity)
+			: m_buffer(capacity + 1) //one slot is always left empty to tell full from empty
+		{}
+
+		SpscQueue(const SpscQueue&) = delete;
+		SpscQueue& operator=(const SpscQueue&) = delete;
+
+		bool tryPush(T&& value)
+		{
+			const size_t tail = m_tail.load(std::memory_order_relaxed);
+			const size_t next = increment(tail);
+			if (next == m_head.load(std::memory_order_acquire))
+			{
+				return false;
+			}
+
+			m_buffer[tail] = std::move(value);
+			m_tail.store(next, std::memory_order_release);
+			notify();
+			return true;
+		}
+
+		bool tryPop(T& value)
+		{
+			const size_t head = m_head.load(std::memory_order_relaxed);
+			if (head == m_tail.load(std::memory_order_acquire))
+			{
+				return false;
+			}
+
+			value = std::move(m_buffer[head]);
+			m_head.store(increment(head), std::memory_order_release);
+			notify();
+			return true;
+		}
+
+		//Waits until there is space or "stop" is set. Returns false, if it was stopped.
+		bool push(T&& value, const std::atomic<bool>& stop)
+		{
+			while (!tryPush(std::move(value)))
+			{
+				if (stop.load(std::memory_order_relaxed))
+				{
+					return false;
+				}
+				wait([this]() { return increment(m_tail.load(std::memory_order_relaxed)) != m_head.load(std::memory_order_acquire); }, stop);
+			}
+			return true;
+		}
+
+		//Waits until there is an element or "stop" is set. Returns false, if it was stopped. Elements pushed before "stop" was
+		//set are still popped.
+		bool pop(T& value, const std::atomic<bool>& stop)
+		{
+			while (!tryPop(value))
+			{
+				if (stop.load(std::memory_order_relaxed))
+				{
+					return false;
+				}
+				wait([this]() { return !empty(); }, stop);
+			}
+			return true;
+		}
+
+		//Wakes a waiting push or pop, so it sees its "stop" flag right away instead of with the next poll.
+		void wake()
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_changed.notify_all();
+		}
+
+		//Exact on the consumer side, a snapshot on the producer side.
+		bool empty() const
+		{
+			return m_head.load(std::memory_order_acquire) == m_tail.load(std::memory_order_acquire);
+		}
+
+	private:
+		//The stop flags are owned by the callers and set without a wake() by some, so a waiter polls them as well.
+		static constexpr std::chrono::milliseconds kStopPollInterval{ 5 };
+
+		size_t increment(size_t index) const
+		{
+			return (index + 1) % m_buffer.size();
+		}
+
+		void notify()
+		{
+			if (m_waiters.load() > 0)
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_changed.notify_all();
+			}
+		}
+
+		template<typename Ready>
+		void wait(Ready ready, const std::atomic<bool>& stop)
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_waiters++;
+			m_changed.wait_for(lock, kStopPollInterval, [&]() { return ready() || stop.load(std::memory_order_relaxed); });
+			m_waiters--;
+		}
+
+	private:
+		std::vector<T> m_buffer;
+		alignas(64) std::atomic<size_t> m_head{ 0 };
+		alignas(64) std::atomic<size_t> m_tail{ 0 };
+		alignas(64) std::atomic<int> m_waiters{ 0 };
+		std::mutex m_mutex;
+		std::condition_variable m_changed;
+	};
+}
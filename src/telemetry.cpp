@@ -0,0 +1,197 @@
+#include "telemetry.h"
+#include "util.h"
+#include "thread_placement.h"
+
+#include <cuda_runtime.h>
+
+#if defined(__has_include)
+#if __has_include(<nvml.h>)
+#include <nvml.h>
+#define HAS_NVML 1
+#endif
+#endif
+
+#ifdef HAS_NVML
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+#endif
+
+namespace util
+{
+#ifdef HAS_NVML
+	//NVML ships with the driver. It is loaded at runtime, so the application doesn't link against it.
+	struct TelemetrySampler::Nvml
+	{
+		void* library = nullptr;
+		nvmlDevice_t device = nullptr;
+
+		decltype(&nvmlShutdown) shutdown = nullptr;
+		decltype(&nvmlDeviceGetMemoryInfo) getMemoryInfo = nullptr;
+		decltype(&nvmlDeviceGetUtilizationRates) getUtilizationRates = nullptr;
+		decltype(&nvmlDeviceGetClockInfo) getClockInfo = nullptr;
+		decltype(&nvmlDeviceGetTemperature) getTemperature = nullptr;
+		decltype(&nvmlDeviceGetPowerUsage) getPowerUsage = nullptr;
+
+		void* getSymbol(const char* name) const
+		{
+#ifdef _WIN32
+			return reinterpret_cast<void*>(GetProcAddress(static_cast<HMODULE>(library), name));
+#else
+			return dlsym(library, name);
+#endif
+		}
+
+		~Nvml()
+		{
+			if (shutdown)
+			{
+				shutdown();
+			}
+			if (library)
+			{
+#ifdef _WIN32
+				FreeLibrary(static_cast<HMODULE>(library));
+#else
+				dlclose(library);
+#endif
+			}
+		}
+
+		//Null, if the library or the device isn't there.
+		static std::unique_ptr<Nvml> load(int cuda_device)
+		{
+			auto nvml = std::make_unique<Nvml>();
+#ifdef _WIN32
+			nvml->library = LoadLibraryA("nvml.dll");
+#else
+			nvml->library = dlopen("libnvidia-ml.so.1", RTLD_LAZY);
+#endif
+			if (!nvml->library)
+			{
+				return nullptr;
+			}
+
+			auto init = reinterpret_cast<decltype(&nvmlInit_v2)>(nvml->getSymbol("nvmlInit_v2"));
+			auto get_handle = reinterpret_cast<decltype(&nvmlDeviceGetHandleByPciBusId_v2)>(nvml->getSymbol("nvmlDeviceGetHandleByPciBusId_v2"));
+			nvml->getMemoryInfo = reinterpret_cast<decltype(&nvmlDeviceGetMemoryInfo)>(nvml->getSymbol("nvmlDeviceGetMemoryInfo"));
+			nvml->getUtilizationRates = reinterpret_cast<decltype(&nvmlDeviceGetUtilizationRates)>(nvml->getSymbol("nvmlDeviceGetUtilizationRates"));
+			nvml->getClockInfo = reinterpret_cast<decltype(&nvmlDeviceGetClockInfo)>(nvml->getSymbol("nvmlDeviceGetClockInfo"));
+			nvml->getTemperature = reinterpret_cast<decltype(&nvmlDeviceGetTemperature)>(nvml->getSymbol("nvmlDeviceGetTemperature"));
+			nvml->getPowerUsage = reinterpret_cast<decltype(&nvmlDeviceGetPowerUsage)>(nvml->getSymbol("nvmlDeviceGetPowerUsage"));
+			if (!init || !get_handle || !nvml->getMemoryInfo || !nvml->getUtilizationRates || !nvml->getClockInfo
+				|| !nvml->getTemperature || !nvml->getPowerUsage || init() != NVML_SUCCESS)
+			{
+				return nullptr;
+			}
+			nvml->shutdown = reinterpret_cast<decltype(&nvmlShutdown)>(nvml->getSymbol("nvmlShutdown"));
+
+			//NVML enumerates the devices differently, the PCI bus id matches them.
+			char pci_bus_id[32] = {};
+			if (cudaDeviceGetPCIBusId(pci_bus_id, sizeof(pci_bus_id), cuda_device) != cudaSuccess
+				|| get_handle(pci_bus_id, &nvml->device) != NVML_SUCCESS)
+			{
+				cudaGetLastError();
+				return nullptr;
+			}
+			return nvml;
+		}
+	};
+#else
+	struct TelemetrySampler::Nvml
+	{
+		static std::unique_ptr<Nvml> load(int) { return nullptr; }
+	};
+#endif
+
+	TelemetrySampler::TelemetrySampler(std::chrono::milliseconds period, int device)
+		: m_period(period)
+		, m_device(device)
+	{
+		if (m_device < 0)
+		{
+			CHECK_CUDA_ERROR(cudaGetDevice(&m_device));
+		}
+		m_nvml = Nvml::load(m_device);
+		m_thread = std::thread(&TelemetrySampler::run, this);
+	}
+
+	TelemetrySampler::~TelemetrySampler()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_stop_requested.notify_all();
+		m_thread.join();
+	}
+
+	GpuTelemetry TelemetrySampler::getLatest() const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_latest;
+	}
+
+	void TelemetrySampler::run()
+	{
+		ThreadPlacement::get().apply(ThreadStage::Service);
+		//Only for cudaMemGetInfo, the sampler doesn't allocate.
+		CHECK_CUDA_ERROR(cudaSetDevice(m_device));
+
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (!m_stop)
+		{
+			lock.unlock();
+			sample();
+			lock.lock();
+			m_stop_requested.wait_for(lock, m_period, [this]() { return m_stop; });
+		}
+	}
+
+	void TelemetrySampler::sample()
+	{
+		GpuTelemetry telemetry;
+		telemetry.valid = true;
+		telemetry.time = std::chrono::steady_clock::now();
+
+#ifdef HAS_NVML
+		if (m_nvml)
+		{
+			nvmlMemory_t memory;
+			nvmlUtilization_t utilization;
+			telemetry.has_nvml = m_nvml->getMemoryInfo(m_nvml->device, &memory) == NVML_SUCCESS;
+			if (telemetry.has_nvml)
+			{
+				telemetry.free_bytes = memory.free;
+				telemetry.total_bytes = memory.total;
+			}
+			if (m_nvml->getUtilizationRates(m_nvml->device, &utilization) == NVML_SUCCESS)
+			{
+				telemetry.gpu_utilization = utilization.gpu;
+				telemetry.memory_utilization = utilization.memory;
+			}
+			m_nvml->getClockInfo(m_nvml->device, NVML_CLOCK_GRAPHICS, &telemetry.graphics_clock_mhz);
+			m_nvml->getClockInfo(m_nvml->device, NVML_CLOCK_SM, &telemetry.sm_clock_mhz);
+			m_nvml->getClockInfo(m_nvml->device, NVML_CLOCK_MEM, &telemetry.memory_clock_mhz);
+			m_nvml->getTemperature(m_nvml->device, NVML_TEMPERATURE_GPU, &telemetry.temperature_c);
+			m_nvml->getPowerUsage(m_nvml->device, &telemetry.power_mw);
+		}
+#endif
+		if (!telemetry.has_nvml)
+		{
+			CHECK_CUDA_ERROR(cudaMemGetInfo(&telemetry.free_bytes, &telemetry.total_bytes));
+		}
+
+		const DeviceAllocator* allocators[] = { &getCudaAllocator(), &getCachingAllocator(), &getFrameArena() };
+		for (auto allocator : allocators)
+		{
+			telemetry.allocators.emplace_back(allocator->getName(), allocator->getStats());
+		}
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_latest = std::move(telemetry);
+	}
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "device_allocator.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace util
+{
+	//One sample of the device and of our allocators.
+	struct GpuTelemetry
+	{
+		bool valid = false; //false until the first sample
+		std::chrono::steady_clock::time_point time;
+		size_t free_bytes = 0;
+		size_t total_bytes = 0;
+
+		//Only sampled with NVML.
+		bool has_nvml = false;
+		unsigned int gpu_utilization = 0; //percent of the last sample period with a kernel running
+		unsigned int memory_utilization = 0; //percent of the last sample period with device memory being read or written
+		unsigned int graphics_clock_mhz = 0;
+		unsigned int sm_clock_mhz = 0;
+		unsigned int memory_clock_mhz = 0;
+		unsigned int temperature_c = 0;
+		unsigned int power_mw = 0;
+
+		//Approximate, the allocators update them without a lock.
+		std::vector<std::pair<const char*, AllocationStats>> allocators;
+	};
+
+	//Samples GpuTelemetry on a thread of its own, so the UI and exporters read cached values instead of calling
+	//cudaMemGetInfo (which synchronizes) on their thread. NVML is loaded at runtime, without it only the memory
+	//and the allocators are sampled.
+	class TelemetrySampler
+	{
+	public:
+		//"device" is a CUDA device, -1 is the current one of the calling thread.
+		explicit TelemetrySampler(std::chrono::milliseconds period = std::chrono::milliseconds(500), int device = -1);
+		TelemetrySampler(const TelemetrySampler&) = delete;
+		TelemetrySampler& operator=(const TelemetrySampler&) = delete;
+		~TelemetrySampler();
+
+		GpuTelemetry getLatest() const;
+
+	private:
+		struct Nvml;
+
+		void run();
+		void sample();
+
+	private:
+		std::chrono::milliseconds m_period;
+		int m_device;
+		std::unique_ptr<Nvml> m_nvml; //null without NVML
+		GpuTelemetry m_latest;
+		mutable std::mutex m_mutex;
+		std::condition_variable m_stop_requested;
+		bool m_stop{ false };
+		std::thread m_thread;
+	};
+}
@@ -0,0 +1,170 @@
+#include "thread_placement.h"
+#include "util.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <cuda_runtime.h>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace util
+{
+	static const char* const kStageNames[] = { "main", "capture", "detect", "encode", "io", "service" };
+	static_assert(sizeof(kStageNames) / sizeof(kStageNames[0]) == static_cast<int>(ThreadStage::Count), "A stage without a name");
+
+	const char* getThreadStageName(ThreadStage stage)
+	{
+		return kStageNames[static_cast<int>(stage)];
+	}
+
+	std::vector<int> parseCpuList(const std::string& list)
+	{
+		std::vector<int> cpus;
+		size_t begin = 0;
+		while (begin < list.size())
+		{
+			size_t end = list.find(',', begin);
+			if (end == std::string::npos)
+			{
+				end = list.size();
+			}
+			const std::string range = list.substr(begin, end - begin);
+			const size_t dash = range.find('-');
+			const std::string first = range.substr(0, dash);
+			const std::string last = dash == std::string::npos ? first : range.substr(dash + 1);
+			auto isNumber = [](const std::string& text)
+			{
+				return !text.empty() && std::all_of(text.begin(), text.end(), [](char c) { return std::isdigit(static_cast<unsigned char>(c)); });
+			};
+			if (!isNumber(first) || !isNumber(last) || std::atoi(last.c_str()) < std::atoi(first.c_str()))
+			{
+				throw std::runtime_error("Error: \"" + list + "\" isn't a list of CPUs like 0-3,8!");
+			}
+			for (int cpu = std::atoi(first.c_str()); cpu <= std::atoi(last.c_str()); ++cpu)
+			{
+				cpus.push_back(cpu);
+			}
+			begin = end + 1;
+		}
+		std::sort(cpus.begin(), cpus.end());
+		cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+		return cpus;
+	}
+
+	ThreadPlacement& ThreadPlacement::get()
+	{
+		static ThreadPlacement placement;
+		return placement;
+	}
+
+	void ThreadPlacement::parse(const std::string& spec)
+	{
+		const size_t equals = spec.find('=');
+		const std::string name = spec.substr(0, equals);
+		for (int s = 0; s < static_cast<int>(ThreadStage::Count); ++s)
+		{
+			if (equals != std::string::npos && name == kStageNames[s])
+			{
+				setCpus(static_cast<ThreadStage>(s), parseCpuList(spec.substr(equals + 1)));
+				return;
+			}
+		}
+		throw std::runtime_error("Error: \"" + spec + "\" isn't a placement like detect=4-7, the stages are main, capture, detect, "
+			"encode, io and service!");
+	}
+
+	void ThreadPlacement::setCpus(ThreadStage stage, std::vector<int> cpus)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_cpus[static_cast<int>(stage)] = std::move(cpus);
+	}
+
+	void ThreadPlacement::placeOnDeviceNode(int cuda_device)
+	{
+#ifdef _WIN32
+		std::cout << "Warning: The NUMA node of the device is only known on Linux, the threads aren't placed on it." << std::endl;
+#else
+		char bus_id[32] = {};
+		CHECK_CUDA_ERROR(cudaDeviceGetPCIBusId(bus_id, sizeof(bus_id), cuda_device));
+		std::string device_path = "/sys/bus/pci/devices/" + std::string(bus_id);
+		std::transform(device_path.begin(), device_path.end(), device_path.begin(), [](char c) { return std::tolower(static_cast<unsigned char>(c)); });
+
+		int node = -1;
+		std::string cpulist;
+		std::ifstream(device_path + "/numa_node") >> node;
+		std::ifstream(device_path + "/local_cpulist") >> cpulist;
+		if (node < 0 || cpulist.empty())
+		{
+			std::cout << "Warning: The NUMA node of CUDA device " << cuda_device << " isn't known, the threads aren't placed on it." << std::endl;
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_node = node;
+		m_node_cpus = parseCpuList(cpulist);
+		std::cout << "Threads are placed on NUMA node " << node << " of CUDA device " << cuda_device << ", CPUs " << cpulist << std::endl;
+#endif
+	}
+
+	void ThreadPlacement::apply(ThreadStage stage) const
+	{
+		std::vector<int> cpus;
+		int node;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			cpus = m_cpus[static_cast<int>(stage)].empty() ? m_node_cpus : m_cpus[static_cast<int>(stage)];
+			node = m_node;
+		}
+
+		if (!cpus.empty())
+		{
+#ifdef _WIN32
+			DWORD_PTR mask = 0;
+			for (int cpu : cpus)
+			{
+				mask |= cpu < 64 ? DWORD_PTR(1) << cpu : 0;
+			}
+			if (mask == 0 || SetThreadAffinityMask(GetCurrentThread(), mask) == 0)
+#else
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			for (int cpu : cpus)
+			{
+				if (cpu < CPU_SETSIZE)
+				{
+					CPU_SET(cpu, &set);
+				}
+			}
+			if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+#endif
+			{
+				std::cout << "Warning: Could not place a " << getThreadStageName(stage) << " thread on its CPUs." << std::endl;
+			}
+		}
+
+#ifndef _WIN32
+		//MPOL_PREFERRED: the node's memory while it has free pages, then any other.
+		const int kPreferred = 1;
+		if (node >= 0 && node < 64)
+		{
+			const unsigned long mask = 1ul << node;
+			if (syscall(SYS_set_mempolicy, kPreferred, &mask, sizeof(mask) * 8 + 1) != 0)
+			{
+				std::cout << "Warning: Could not prefer the memory of NUMA node " << node << " for a " << getThreadStageName(stage) << " thread." << std::endl;
+			}
+		}
+#endif
+	}
+}
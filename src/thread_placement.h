@@ -0,0 +1,56 @@
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace util
+{
+	//Pipeline stages whose threads are placed together, see ThreadPlacement.
+	enum class ThreadStage
+	{
+		Main,		//the solve and GL thread, the threads of the CUDA driver start from it
+		Capture,	//FrameGrabber and the capture thread of the pipelined run
+		Detection,	//landmark detection, the tracker's thread pool and the input threads of the sessions
+		Encode,		//video encoders
+		Io,			//debug images and input recordings
+		Service,	//metrics endpoint and telemetry sampling
+		Count
+	};
+
+	//"main", "capture", "detect", "encode", "io" or "service".
+	const char* getThreadStageName(ThreadStage stage);
+
+	//CPUs and NUMA node of the threads of each stage. Every thread of a stage applies it when it starts, so set it up before the
+	//threads are started, in particular before the CUDA context is created: the threads of the driver take the affinity of
+	//the thread which creates it. Linux also prefers the memory of the node for every allocation of a placed thread, which
+	//includes pinned host buffers. On Windows only the CPUs (of the first 64) are set.
+	class ThreadPlacement
+	{
+	public:
+		static ThreadPlacement& get();
+
+		//"spec" is "<stage>=<cpus>", with cpus like the cpulist of Linux, e.g. "capture=2" or "detect=4-7,12". Throws if it
+		//doesn't parse.
+		void parse(const std::string& spec);
+		void setCpus(ThreadStage stage, std::vector<int> cpus);
+		//Places the stages without CPUs of their own on the CPUs of the NUMA node local to the CUDA device, and makes all of
+		//them prefer its memory. Warns and does nothing if the node isn't known, e.g. on a single socket machine.
+		void placeOnDeviceNode(int cuda_device);
+
+		//Applies the placement of "stage" to the calling thread, nothing if it has none.
+		void apply(ThreadStage stage) const;
+
+	private:
+		ThreadPlacement() = default;
+
+	private:
+		mutable std::mutex m_mutex;
+		std::vector<int> m_cpus[static_cast<int>(ThreadStage::Count)];
+		std::vector<int> m_node_cpus; //of m_node, for the stages without CPUs
+		int m_node{ -1 };
+	};
+
+	//Parses a Linux cpulist, "0-3,8". Throws if it doesn't parse.
+	std::vector<int> parseCpuList(const std::string& list);
+}
@@ -0,0 +1,121 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+
+namespace util
+{
+	ThreadPool::ThreadPool(int number_of_threads, ThreadStage stage)
+	{
+		if (number_of_threads <= 0)
+		{
+			number_of_threads = std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+		}
+
+		for (int i = 1; i < number_of_threads; ++i)
+		{
+			m_workers.emplace_back(&ThreadPool::work, this, i, stage);
+		}
+	}
+
+	ThreadPool::~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_job_ready.notify_all();
+		for (auto& worker : m_workers)
+		{
+			worker.join();
+		}
+	}
+
+	void ThreadPool::runTasks(int thread)
+	{
+		for (int index = m_next_index++; index < m_count; index = m_next_index++)
+		{
+			try
+			{
+				(*m_task)(index, thread);
+			}
+			catch (...)
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				if (!m_exception)
+				{
+					m_exception = std::current_exception();
+				}
+				m_next_index = m_count;
+			}
+		}
+	}
+
+	void ThreadPool::work(int thread, ThreadStage stage)
+	{
+		ThreadPlacement::get().apply(stage);
+		int generation = 0;
+		while (true)
+		{
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_job_ready.wait(lock, [&]() { return m_stop || m_generation != generation; });
+				if (m_stop)
+				{
+					return;
+				}
+				generation = m_generation;
+			}
+
+			runTasks(thread);
+
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_busy_workers--;
+			}
+			m_job_done.notify_one();
+		}
+	}
+
+	void ThreadPool::parallelFor(int count, const std::function<void(int index, int thread)>& task)
+	{
+		if (count <= 0)
+		{
+			return;
+		}
+
+		//Not worth waking the workers.
+		if (count == 1 || m_workers.empty())
+		{
+			for (int i = 0; i < count; ++i)
+			{
+				task(i, 0);
+			}
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_task = &task;
+			m_count = count;
+			m_next_index = 0;
+			m_exception = nullptr;
+			m_busy_workers = static_cast<int>(m_workers.size());
+			m_generation++;
+		}
+		m_job_ready.notify_all();
+
+		runTasks(0);
+
+		std::exception_ptr exception;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_job_done.wait(lock, [&]() { return m_busy_workers == 0; });
+			m_task = nullptr;
+			std::swap(exception, m_exception);
+		}
+		if (exception)
+		{
+			std::rethrow_exception(exception);
+		}
+	}
+}
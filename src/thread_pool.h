@@ -0,0 +1,53 @@
+#pragma once
+
+#include "thread_placement.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace util
+{
+	//Fixed set of worker threads for data parallel CPU work, e.g. the shape predictor fits of several faces or frames.
+	//parallelFor can be called from one thread at a time.
+	class ThreadPool
+	{
+	public:
+		//"number_of_threads" includes the calling thread of parallelFor, <= 0 uses all hardware threads. The workers are placed
+		//like the threads of "stage", see ThreadPlacement.
+		explicit ThreadPool(int number_of_threads = 0, ThreadStage stage = ThreadStage::Main);
+		ThreadPool(const ThreadPool&) = delete;
+		ThreadPool& operator=(const ThreadPool&) = delete;
+		~ThreadPool();
+
+		int getNumberOfThreads() const { return static_cast<int>(m_workers.size()) + 1; }
+
+		//Calls task(index, thread) for every index in [0, count) and returns once all calls returned.
+		//"thread" is in [0, getNumberOfThreads()), 0 is the caller, so it can pick per thread scratch.
+		//The first exception of a task is rethrown on the caller, the remaining indices are skipped.
+		void parallelFor(int count, const std::function<void(int index, int thread)>& task);
+
+	private:
+		void work(int thread, ThreadStage stage);
+		void runTasks(int thread);
+
+	private:
+		std::vector<std::thread> m_workers;
+		std::mutex m_mutex;
+		std::condition_variable m_job_ready;
+		std::condition_variable m_job_done;
+		bool m_stop{ false };
+
+		//The current job, guarded by m_mutex except for the index counter.
+		const std::function<void(int, int)>* m_task{ nullptr };
+		int m_count{ 0 };
+		std::atomic<int> m_next_index{ 0 };
+		int m_generation{ 0 };
+		int m_busy_workers{ 0 };
+		std::exception_ptr m_exception;
+	};
+}
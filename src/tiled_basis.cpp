@@ -0,0 +1,135 @@
+#include "tiled_basis.h"
+#include "util.h"
+
+#include <limits>
+#include <stdexcept>
+#include <string>
+
+TiledBasis::TiledBasis(int n_vertices, const int n_coefficients[3], const Eigen::half* const bases[3], int cache_tiles, int vertices_per_tile)
+	: m_vertices(n_vertices)
+	, m_vertices_per_tile(vertices_per_tile)
+{
+	if (n_vertices < 1 || cache_tiles < 1 || vertices_per_tile < 1)
+	{
+		throw std::runtime_error("Error: A tiled basis needs at least one vertex, one tile per cache and one vertex per tile!");
+	}
+
+	const int n_tiles = (n_vertices + vertices_per_tile - 1) / vertices_per_tile;
+	//More slots than tiles would never be used.
+	m_cache_tiles = std::min(cache_tiles, n_tiles);
+	m_tile_slots.assign(n_tiles, -1);
+	m_slot_tiles.assign(m_cache_tiles, -1);
+	m_slot_uses.assign(m_cache_tiles, 0);
+
+	util::ScopedAllocationTag tag("basis");
+	for (int b = 0; b < 3; ++b)
+	{
+		m_coefficients[b] = n_coefficients[b];
+		const size_t n_rows = static_cast<size_t>(3) * n_vertices;
+		const size_t n_elements = n_rows * n_coefficients[b];
+		void* host = nullptr;
+		CHECK_CUDA_ERROR(cudaMallocHost(&host, std::max<size_t>(n_elements, 1) * sizeof(Eigen::half)));
+		m_host[b] = static_cast<Eigen::half*>(host);
+		for (size_t row = 0; row < n_rows; ++row)
+		{
+			for (int col = 0; col < n_coefficients[b]; ++col)
+			{
+				m_host[b][row * n_coefficients[b] + col] = bases[b][row + col * n_rows];
+			}
+		}
+
+		//The zero vertex after the slots, the bit pattern of 0 is FP16 zero.
+		m_cache[b] = util::DeviceArray<Eigen::half>((getCacheVertices() + 1) * 3 * n_coefficients[b]);
+		m_cache[b].memset(0);
+	}
+
+	const std::vector<int> vertex_map(n_vertices, getCacheVertices());
+	m_vertex_map_gpu = util::DeviceArray<int>(vertex_map);
+}
+
+TiledBasis::~TiledBasis()
+{
+	for (auto* host : m_host)
+	{
+		CHECK_CUDA_ERROR(cudaFreeHost(host));
+	}
+}
+
+const Eigen::half* TiledBasis::getHostVertex(int basis, int vertex) const
+{
+	return m_host[basis] + static_cast<size_t>(3) * vertex * m_coefficients[basis];
+}
+
+void TiledBasis::upload(int tile, int slot, cudaStream_t stream)
+{
+	const int first_vertex = tile * m_vertices_per_tile;
+	const int n_vertices = std::min(m_vertices_per_tile, m_vertices - first_vertex);
+	for (int b = 0; b < 3; ++b)
+	{
+		const size_t vertex_elements = static_cast<size_t>(3) * m_coefficients[b];
+		CHECK_CUDA_ERROR(cudaMemcpyAsync(m_cache[b].getPtr() + slot * m_vertices_per_tile * vertex_elements, getHostVertex(b, first_vertex),
+			n_vertices * vertex_elements * sizeof(Eigen::half), cudaMemcpyHostToDevice, stream));
+	}
+	setTileVertexMap(m_vertex_map_gpu.getPtr(), first_vertex, n_vertices, slot * m_vertices_per_tile, getCacheVertices(), stream);
+	++m_uploaded_tiles;
+}
+
+void TiledBasis::require(const std::vector<unsigned char>& tiles, cudaStream_t stream)
+{
+	//Mark the requested resident tiles first, so none of them is replaced by a missing one.
+	const uint64_t request = ++m_requests;
+	int n_requested = 0;
+	for (int t = 0; t < std::min<int>(tiles.size(), getTileCount()); ++t)
+	{
+		if (tiles[t])
+		{
+			++n_requested;
+			if (m_tile_slots[t] >= 0)
+			{
+				m_slot_uses[m_tile_slots[t]] = request;
+			}
+		}
+	}
+	if (n_requested > m_cache_tiles)
+	{
+		throw std::runtime_error("Error: " + std::to_string(n_requested) + " tiles of the basis are needed at once, but the cache only holds " +
+			std::to_string(m_cache_tiles) + "!");
+	}
+
+	for (int t = 0; t < std::min<int>(tiles.size(), getTileCount()); ++t)
+	{
+		if (!tiles[t] || m_tile_slots[t] >= 0)
+		{
+			continue;
+		}
+
+		//Free slots have never been used, so they come first.
+		int slot = 0;
+		for (int s = 1; s < m_cache_tiles; ++s)
+		{
+			if (m_slot_uses[s] < m_slot_uses[slot])
+			{
+				slot = s;
+			}
+		}
+		const int evicted = m_slot_tiles[slot];
+		if (evicted >= 0)
+		{
+			const int first_vertex = evicted * m_vertices_per_tile;
+			setTileVertexMap(m_vertex_map_gpu.getPtr(), first_vertex, std::min(m_vertices_per_tile, m_vertices - first_vertex), -1,
+				getCacheVertices(), stream);
+			m_tile_slots[evicted] = -1;
+		}
+		upload(t, slot, stream);
+		m_tile_slots[t] = slot;
+		m_slot_tiles[slot] = t;
+		m_slot_uses[slot] = request;
+	}
+}
+
+void TiledBasis::requireRange(int first_tile, int end_tile, cudaStream_t stream)
+{
+	m_range_flags.assign(getTileCount(), 0);
+	std::fill(m_range_flags.begin() + first_tile, m_range_flags.begin() + end_tile, 1);
+	require(m_range_flags, stream);
+}
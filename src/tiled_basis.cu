@@ -0,0 +1,19 @@
+#include "tiled_basis.h"
+#include "device_util.h"
+
+__global__ void setTileVertexMapKernel(int* __restrict__ vertex_map, int first_vertex, int n_vertices, int first_cache_vertex, int zero_vertex)
+{
+	const int i = util::getThreadIndex1D();
+	if (i >= n_vertices)
+	{
+		return;
+	}
+	vertex_map[first_vertex + i] = first_cache_vertex >= 0 ? first_cache_vertex + i : zero_vertex;
+}
+
+void setTileVertexMap(int* vertex_map, int first_vertex, int n_vertices, int first_cache_vertex, int zero_vertex, cudaStream_t stream)
+{
+	const int block_size = 256;
+	const int num_blocks = (n_vertices + block_size - 1) / block_size;
+	setTileVertexMapKernel <<<num_blocks, block_size, 0, stream>>>(vertex_map, first_vertex, n_vertices, first_cache_vertex, zero_vertex);
+}
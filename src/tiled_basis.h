@@ -0,0 +1,92 @@
+#pragma once
+
+#include "device_array.h"
+
+#include <Eigen/Core>
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+#include <cuda_runtime.h>
+
+//The shape, albedo and expression bases of a morphable model which doesn't have to fit into device memory. All of them stay
+//in pinned host memory, in FP16 and vertex-major, split into tiles of consecutive vertices. A device cache holds up to
+//cache_tiles of the tiles of all three bases, the least recently used one is replaced by a missing one. The cache reads like
+//a sparse basis (see FaceModel::expression_vertex_map): getVertexMapGpu maps vertex v of the model to its vertex in the
+//cache, the vertices of tiles which aren't resident share the all-zero vertex after the last slot.
+//Uploads and map updates are issued on the stream of the caller, so a kernel on that stream always sees the tiles it was
+//launched for.
+class TiledBasis
+{
+public:
+	static constexpr int kShape = 0;
+	static constexpr int kAlbedo = 1;
+	static constexpr int kExpression = 2;
+	static constexpr int kDefaultVerticesPerTile = 1024;
+
+	//"bases" are column-major FP16 bases of n_vertices vertices, divided by their scale, in the order of kShape, kAlbedo,
+	//kExpression. They are transposed into pinned memory, the caller may free them afterwards.
+	TiledBasis(int n_vertices, const int n_coefficients[3], const Eigen::half* const bases[3], int cache_tiles,
+		int vertices_per_tile = kDefaultVerticesPerTile);
+	~TiledBasis();
+
+	TiledBasis(const TiledBasis&) = delete;
+	TiledBasis& operator=(const TiledBasis&) = delete;
+
+	//Makes the tiles with a non-zero flag resident. Throws if they are more than the cache holds.
+	void require(const std::vector<unsigned char>& tiles, cudaStream_t stream);
+	//Calls function(first_vertex, end_vertex) for consecutive ranges of resident tiles, which cover the first n_vertices
+	//vertices. Without room for all of them, the tiles stream through the cache one batch of cache_tiles after another.
+	template<typename Function>
+	void forEachResidentRange(int n_vertices, cudaStream_t stream, Function function);
+
+	//Vertex-major cache of a basis, row stride is getCoefficientCount(basis).
+	const Eigen::half* getCache(int basis) const { return m_cache[basis].getPtr(); }
+	const int* getVertexMapGpu() const { return m_vertex_map_gpu.getPtr(); }
+	//Vertices of the slots, the zero vertex comes after them. See FaceModel::number_of_expression_vertices.
+	int getCacheVertices() const { return m_cache_tiles * m_vertices_per_tile; }
+	//The 3 rows of a vertex of the pinned copy, divided by the scale.
+	const Eigen::half* getHostVertex(int basis, int vertex) const;
+
+	int getCoefficientCount(int basis) const { return m_coefficients[basis]; }
+	int getVerticesPerTile() const { return m_vertices_per_tile; }
+	int getTileCount() const { return static_cast<int>(m_tile_slots.size()); }
+	int getCacheTiles() const { return m_cache_tiles; }
+	int getTileOf(int vertex) const { return vertex / m_vertices_per_tile; }
+	//Tiles uploaded since the construction, for the statistics.
+	uint64_t getUploadedTiles() const { return m_uploaded_tiles; }
+
+private:
+	void upload(int tile, int slot, cudaStream_t stream);
+	void requireRange(int first_tile, int end_tile, cudaStream_t stream);
+
+	int m_vertices = 0;
+	int m_vertices_per_tile = 0;
+	int m_cache_tiles = 0;
+	int m_coefficients[3] = {};
+	Eigen::half* m_host[3] = {}; //pinned, vertex-major
+	util::DeviceArray<Eigen::half> m_cache[3];
+	util::DeviceArray<int> m_vertex_map_gpu;
+
+	std::vector<int> m_tile_slots; //slot of each tile, -1 if it isn't resident
+	std::vector<int> m_slot_tiles; //tile of each slot, -1 if it is free
+	std::vector<uint64_t> m_slot_uses; //last require of each slot, for the replacement
+	uint64_t m_requests = 0;
+	uint64_t m_uploaded_tiles = 0;
+	std::vector<unsigned char> m_range_flags;
+};
+
+//Sets the map entries of vertices [first_vertex, first_vertex + n_vertices) to first_cache_vertex on (consecutive), or all
+//to zero_vertex if first_cache_vertex is negative.
+void setTileVertexMap(int* vertex_map, int first_vertex, int n_vertices, int first_cache_vertex, int zero_vertex, cudaStream_t stream);
+
+template<typename Function>
+void TiledBasis::forEachResidentRange(int n_vertices, cudaStream_t stream, Function function)
+{
+	const int n_tiles = (n_vertices + m_vertices_per_tile - 1) / m_vertices_per_tile;
+	for (int first_tile = 0; first_tile < n_tiles; first_tile += m_cache_tiles)
+	{
+		const int end_tile = std::min(first_tile + m_cache_tiles, n_tiles);
+		requireRange(first_tile, end_tile, stream);
+		function(first_tile * m_vertices_per_tile, std::min(end_tile * m_vertices_per_tile, n_vertices));
+	}
+}
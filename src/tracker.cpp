@@ -1,49 +1,590 @@
 #include "tracker.h"
+#include "landmark_flow.h"
+#include "profiler.h"
+#include "shape_predictor_gpu.h"
+#include "thread_pool.h"
+#include <opencv2/imgproc/imgproc.hpp>
+#include <algorithm>
+#include <future>
+#include <iostream>
+#include <mutex>
 #include <utility>
 
+//The shape predictor is read-only once loaded, all trackers (e.g. of the server sessions) share one copy for the whole process.
+//It is deserialized on a thread of its own, which the first call starts.
+static std::shared_future<std::shared_ptr<const dlib::shape_predictor>> loadPoseModel()
+{
+	static std::mutex mutex;
+	static std::shared_future<std::shared_ptr<const dlib::shape_predictor>> shared_model;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!shared_model.valid())
+	{
+		shared_model = std::async(std::launch::async, []()
+		{
+			auto model = std::make_shared<dlib::shape_predictor>();
+			try
+			{
+				dlib::deserialize("shape_predictor_68_face_landmarks.dat") >> *model;
+			}
+			catch (dlib::serialization_error& e)
+			{
+				std::cout << std::endl << e.what() << std::endl;
+			}
+			return std::shared_ptr<const dlib::shape_predictor>(std::move(model));
+		}).share();
+	}
+	return shared_model;
+}
+
+void Tracker::preloadModels()
+{
+	loadPoseModel();
+}
+
 Tracker::Tracker()
+	: m_landmark_detector(createLandmarkDetector(LandmarkBackend::Hog))
+{
+}
+
+const dlib::shape_predictor& Tracker::getPoseModel()
+{
+	if (!m_pose_model)
+	{
+		util::ScopedTimer timer("Shape predictor loading");
+		m_pose_model = loadPoseModel().get();
+	}
+	return *m_pose_model;
+}
+
+Tracker::~Tracker() = default;
+
+ShapePredictorGpu& Tracker::getGpuPoseModel()
+{
+	if (!m_gpu_pose_model)
+	{
+		const auto& pose_model = getPoseModel();
+		util::ScopedTimer timer("Shape predictor upload");
+		m_gpu_pose_model = std::make_unique<ShapePredictorGpu>(pose_model);
+	}
+	return *m_gpu_pose_model;
+}
+
+void Tracker::validateGpuPoseModel(const cv::Mat& frame, const std::vector<dlib::rectangle>& boxes)
+{
+	//dlib rounds the parts to integer pixels, the device fit keeps them in float.
+	constexpr float kMaxError = 1.0f;
+	const auto accuracy = getGpuPoseModel().validate(getPoseModel(), frame, boxes);
+	m_gpu_pose_model_validated = true;
+	std::cout << "GPU shape predictor vs dlib on " << accuracy.faces << " faces: mean error " << accuracy.mean_error
+		<< " px, max error " << accuracy.max_error << " px" << std::endl;
+	if (accuracy.max_error > kMaxError)
+	{
+		std::cout << "Warning: The GPU shape predictor differs from dlib, fitting on the host instead" << std::endl;
+		m_params.use_gpu_shape_predictor = false;
+	}
+}
+
+static std::vector<glm::vec2> getLandmarks(const dlib::full_object_detection& shape)
+{
+	std::vector<glm::vec2> landmarks;
+	for (unsigned long i = 0; i < shape.num_parts(); ++i)
+	{
+		landmarks.emplace_back(shape.part(i).x(), shape.part(i).y());
+	}
+	return landmarks;
+}
+
+std::vector<std::vector<glm::vec2>> Tracker::fitLandmarks(const cv::Mat& frame, const std::vector<dlib::rectangle>& boxes)
+{
+	if (m_params.use_gpu_shape_predictor && !m_gpu_pose_model_validated && !boxes.empty())
+	{
+		validateGpuPoseModel(frame, boxes);
+	}
+	if (m_params.use_gpu_shape_predictor)
+	{
+		return getGpuPoseModel().fit(frame, boxes);
+	}
+
+	//The fits of the faces are independent, the shape predictor is shared read-only.
+	const auto& pose_model = getPoseModel();
+	dlib::cv_image<dlib::bgr_pixel> cimg(frame);
+	std::vector<std::vector<glm::vec2>> landmarks(boxes.size());
+	getThreadPool().parallelFor(boxes.size(), [&](int i, int)
+	{
+		landmarks[i] = getLandmarks(pose_model(cimg, boxes[i]));
+	});
+	return landmarks;
+}
+
+//The first 60 landmarks, the ones of PriorSparseFeatures.
+static std::vector<glm::vec2> toSparseFeatures(const std::vector<glm::vec2>& landmarks, const cv::Size& frame_size)
+{
+	const float two_over_width = 2.0f / static_cast<float>(frame_size.width);
+	const float two_over_height = 2.0f / static_cast<float>(frame_size.height);
+	std::vector<glm::vec2> sparse_features;
+	for (int i = 0; i < 60; ++i)
+	{
+		//Normalize sparse feature positions such that left-bottom corner is (-1, -1) and top-right corner is (+1, +1).
+		//This is the OpenGL convention.
+		sparse_features.emplace_back(landmarks[i].x * two_over_width - 1.0f, 1.0f - landmarks[i].y * two_over_height);
+	}
+	return sparse_features;
+}
+
+static dlib::drectangle getLandmarkBox(const std::vector<glm::vec2>& landmarks)
+{
+	dlib::drectangle box;
+	for (const auto& landmark : landmarks)
+	{
+		box += dlib::dpoint(landmark.x, landmark.y);
+	}
+	return box;
+}
+
+static double computeOverlap(const dlib::drectangle& a, const dlib::drectangle& b)
+{
+	const double intersection = a.intersect(b).area();
+	const double union_area = a.area() + b.area() - intersection;
+	return union_area > 0.0 ? intersection / union_area : 0.0;
+}
+
+dlib::drectangle Tracker::predictLandmarkBox(const Track& track) const
+{
+	return m_params.use_motion ? dlib::translate_rect(track.last_landmark_box, track.last_motion) : track.last_landmark_box;
+}
+
+dlib::drectangle Tracker::predictFaceBox(const Track& track, const cv::Size& frame_size) const
+{
+	auto box = predictLandmarkBox(track);
+	const double padding_x = box.width() * m_params.box_padding;
+	const double padding_y = box.height() * m_params.box_padding;
+	box = dlib::drectangle(box.left() - padding_x, box.top() - padding_y, box.right() + padding_x, box.bottom() + padding_y);
+
+	return box.intersect(dlib::drectangle(0.0, 0.0, frame_size.width - 1.0, frame_size.height - 1.0));
+}
+
+std::vector<dlib::rectangle> Tracker::detectFaces(LandmarkDetector& detector, const cv::Mat& frame, const cv::Rect& search_window) const
+{
+	const double scale = std::min(std::max(static_cast<double>(m_params.detection_scale), 0.05), 1.0);
+
+	cv::Mat detection_image = frame(search_window);
+	if (scale < 1.0)
+	{
+		cv::Mat downscaled;
+		cv::resize(detection_image, downscaled, cv::Size(), scale, scale, cv::INTER_AREA);
+		detection_image = downscaled;
+	}
+
+	std::vector<dlib::rectangle> faces = detector.detect(detection_image);
+
+	//Map the boxes back into the full resolution frame, the shape predictor runs there.
+	for (auto& face : faces)
+	{
+		face = dlib::rectangle(
+			static_cast<long>(face.left() / scale) + search_window.x,
+			static_cast<long>(face.top() / scale) + search_window.y,
+			static_cast<long>(face.right() / scale) + search_window.x,
+			static_cast<long>(face.bottom() / scale) + search_window.y);
+	}
+	return faces;
+}
+
+void Tracker::updateLandmarkBackend()
 {
+	const auto backend = static_cast<LandmarkBackend>(m_params.landmark_backend);
+	if (backend == m_landmark_backend)
+	{
+		return;
+	}
+
 	try
 	{
-		dlib::deserialize("shape_predictor_68_face_landmarks.dat") >> m_pose_model;
+		m_landmark_detector = createLandmarkDetector(backend);
+		m_landmark_backend = backend;
+		m_thread_detectors.clear();
 	}
-	catch (dlib::serialization_error& e)
+	catch (std::exception& e)
 	{
-		std::cout << std::endl << e.what() << std::endl;
+		std::cout << "Warning: Keeping the " << m_landmark_detector->getName() << " detector. " << e.what() << std::endl;
+		m_params.landmark_backend = static_cast<int>(m_landmark_backend);
 	}
 }
 
+void Tracker::updateTrack(Track& track, const dlib::drectangle& landmark_box)
+{
+	track.last_motion = track.active ? dlib::center(landmark_box) - dlib::center(track.last_landmark_box) : dlib::dpoint(0.0, 0.0);
+	track.last_landmark_box = landmark_box;
+	track.active = true;
+}
+
+util::ThreadPool& Tracker::getThreadPool()
+{
+	const int number_of_threads = m_params.num_threads > 0 ? m_params.num_threads : std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+	if (!m_thread_pool || m_thread_pool->getNumberOfThreads() != number_of_threads)
+	{
+		m_thread_pool = std::make_unique<util::ThreadPool>(number_of_threads, util::ThreadStage::Detection);
+	}
+	return *m_thread_pool;
+}
+
+bool Tracker::propagateLandmarks(Track& track)
+{
+	util::ScopedTimer timer("Landmark flow");
+	auto landmarks = track.last_landmarks;
+	std::vector<float> errors;
+	m_flow->track(landmarks, errors);
+
+	//A single lost point is enough, the shape predictor has to fix the shape anyway.
+	float error = 0.0f;
+	for (const float point_error : errors)
+	{
+		if (point_error < 0.0f)
+		{
+			return false;
+		}
+		error += point_error;
+	}
+	if (errors.empty() || error / errors.size() > m_params.max_flow_error)
+	{
+		return false;
+	}
+
+	updateTrack(track, getLandmarkBox(landmarks));
+	track.last_landmarks = std::move(landmarks);
+	return true;
+}
+
+std::vector<dlib::rectangle> Tracker::detectFaces(const cv::Mat& frame, const std::vector<bool>& tracked)
+{
+	util::ScopedTimer timer("Face detection");
+	const cv::Rect full_frame(0, 0, frame.cols, frame.rows);
+
+	//A single lost face is searched around its last position first.
+	if (m_params.use_search_window && m_tracks.size() == 1 && m_tracks[0].active)
+	{
+		const auto& last_box = m_tracks[0].last_landmark_box;
+		const auto center = dlib::center(last_box);
+		const double width = last_box.width() * m_params.search_window_size;
+		const double height = last_box.height() * m_params.search_window_size;
+		cv::Rect search_window(static_cast<int>(center.x() - width * 0.5), static_cast<int>(center.y() - height * 0.5), static_cast<int>(width), static_cast<int>(height));
+		search_window &= full_frame;
+
+		if (!search_window.empty())
+		{
+			auto faces = detectFaces(*m_landmark_detector, frame, search_window);
+			if (!faces.empty())
+			{
+				return faces;
+			}
+		}
+	}
+
+	auto faces = detectFaces(*m_landmark_detector, frame, full_frame);
+
+	//Faces which were tracked in this frame keep their slot, drop their detections.
+	faces.erase(std::remove_if(faces.begin(), faces.end(), [&](const dlib::rectangle& face)
+	{
+		const auto center = dlib::center(dlib::drectangle(face));
+		for (int i = 0; i < m_tracks.size(); ++i)
+		{
+			if (tracked[i] && m_tracks[i].last_landmark_box.contains(center))
+			{
+				return true;
+			}
+		}
+		return false;
+	}), faces.end());
+
+	//Largest faces first, they are the closest people and the most reliable fits.
+	std::sort(faces.begin(), faces.end(), [](const dlib::rectangle& a, const dlib::rectangle& b) { return a.area() > b.area(); });
+	return faces;
+}
+
+void Tracker::reset()
+{
+	m_tracks.clear();
+	m_frames_since_detection = 0;
+	if (m_flow)
+	{
+		m_flow->reset();
+	}
+}
+
+std::vector<std::vector<std::vector<glm::vec2>>> Tracker::detectSparseFeaturesOfFrames(const std::vector<cv::Mat>& frames)
+{
+	updateLandmarkBackend();
+	auto& thread_pool = getThreadPool();
+	const int max_faces = std::max(m_params.max_faces, 1);
+	const int n_frames = frames.size();
+	std::vector<std::vector<dlib::rectangle>> faces(n_frames);
+
+	{
+		util::ScopedTimer timer("Face detection");
+		auto detect = [&](LandmarkDetector& detector, int f)
+		{
+			faces[f] = detectFaces(detector, frames[f], cv::Rect(0, 0, frames[f].cols, frames[f].rows));
+			std::sort(faces[f].begin(), faces[f].end(), [](const dlib::rectangle& a, const dlib::rectangle& b) { return a.area() > b.area(); });
+			faces[f].resize(std::min(static_cast<int>(faces[f].size()), max_faces));
+		};
+
+		if (m_landmark_backend == LandmarkBackend::Hog)
+		{
+			//The HOG detector keeps scratch buffers, every thread gets its own copy.
+			while (static_cast<int>(m_thread_detectors.size()) + 1 < thread_pool.getNumberOfThreads())
+			{
+				m_thread_detectors.push_back(createLandmarkDetector(LandmarkBackend::Hog));
+			}
+			thread_pool.parallelFor(n_frames, [&](int f, int thread)
+			{
+				detect(thread == 0 ? *m_landmark_detector : *m_thread_detectors[thread - 1], f);
+			});
+		}
+		else
+		{
+			//The CNN is on the GPU and too large to copy, it runs on this thread.
+			for (int f = 0; f < n_frames; ++f)
+			{
+				detect(*m_landmark_detector, f);
+			}
+		}
+	}
+
+	std::vector<std::pair<int, int>> fits; //frame, face
+	std::vector<std::vector<std::vector<glm::vec2>>> sparse_features(n_frames);
+	for (int f = 0; f < n_frames; ++f)
+	{
+		sparse_features[f].resize(faces[f].size());
+		for (int i = 0; i < faces[f].size(); ++i)
+		{
+			fits.emplace_back(f, i);
+		}
+	}
+
+	util::ScopedTimer timer("Landmark fitting");
+	if (m_params.use_gpu_shape_predictor && !m_gpu_pose_model_validated)
+	{
+		for (int f = 0; f < n_frames; ++f)
+		{
+			if (!faces[f].empty())
+			{
+				validateGpuPoseModel(frames[f], faces[f]);
+				break;
+			}
+		}
+	}
+	if (m_params.use_gpu_shape_predictor)
+	{
+		const auto landmarks = getGpuPoseModel().fit(frames, faces);
+		for (int f = 0; f < n_frames; ++f)
+		{
+			for (int i = 0; i < faces[f].size(); ++i)
+			{
+				sparse_features[f][i] = toSparseFeatures(landmarks[f][i], frames[f].size());
+			}
+		}
+		return sparse_features;
+	}
+
+	const auto& pose_model = getPoseModel();
+	thread_pool.parallelFor(fits.size(), [&](int i, int)
+	{
+		const int f = fits[i].first;
+		const int face = fits[i].second;
+		dlib::cv_image<dlib::bgr_pixel> cimg(frames[f]);
+		const auto landmarks = getLandmarks(pose_model(cimg, faces[f][face]));
+		sparse_features[f][face] = toSparseFeatures(landmarks, frames[f].size());
+	});
+	return sparse_features;
+}
+
 std::vector<glm::vec2> Tracker::getSparseFeatures(const cv::Mat& frame)
 {
-	std::vector<glm::vec2> sparse_features;
+	return getSparseFeaturesOfFaces(frame)[0];
+}
+
+std::vector<std::vector<glm::vec2>> Tracker::getSparseFeaturesOfFaces(const cv::Mat& frame)
+{
+	updateLandmarkBackend();
+
+	const int max_faces = std::max(m_params.max_faces, 1);
+	if (m_tracks.size() != max_faces)
+	{
+		m_tracks.resize(max_faces);
+	}
+
+	std::vector<std::vector<glm::vec2>> sparse_features(max_faces);
+	std::vector<bool> tracked(max_faces, false);
+	std::vector<dlib::drectangle> seed_boxes(max_faces);
+	std::vector<dlib::drectangle> predicted_boxes(max_faces); //landmark boxes the seeds were padded from
+	std::vector<std::vector<glm::vec2>> fits(max_faces);
 
 	try
 	{
-		dlib::cv_image<dlib::bgr_pixel> cimg(frame);
-		std::vector<dlib::rectangle> faces = m_detector(cimg);
+		//The flow needs every frame, also the ones the shape predictor fits.
+		bool flow_ready = false;
+		if (m_params.use_flow)
+		{
+			if (!m_flow)
+			{
+				m_flow = std::make_unique<LandmarkFlow>();
+			}
+			util::ScopedTimer timer("Flow pyramid");
+			m_flow->setFrame(frame);
+			flow_ready = m_flow->hasPreviousFrame();
+		}
+		else if (m_flow)
+		{
+			m_flow->reset();
+		}
 
-		// Consider only one face for the processing
-		if (faces.empty())
+		bool any_active = false;
+		bool any_lost = false;
+		bool any_empty = false;
+		for (int i = 0; i < max_faces; ++i)
 		{
-			return sparse_features;
+			auto& track = m_tracks[i];
+			if (!track.active)
+			{
+				any_empty = true;
+				continue;
+			}
+			any_active = true;
+
+			if (m_params.use_tracking && track.frames_since_detection < m_params.redetection_interval)
+			{
+				if (flow_ready && track.frames_since_fit < m_params.flow_fit_interval && propagateLandmarks(track))
+				{
+					tracked[i] = true;
+					track.frames_since_detection++;
+					track.frames_since_fit++;
+					continue;
+				}
+
+				seed_boxes[i] = predictFaceBox(track, frame.size());
+				predicted_boxes[i] = predictLandmarkBox(track);
+			}
 		}
 
-		dlib::full_object_detection shape = m_pose_model(cimg, faces[0]);
+		{
+			util::ScopedTimer timer("Landmark tracking");
+			std::vector<int> seeded;
+			std::vector<dlib::rectangle> boxes;
+			for (int i = 0; i < max_faces; ++i)
+			{
+				if (!tracked[i] && !seed_boxes[i].is_empty())
+				{
+					seeded.push_back(i);
+					boxes.push_back(dlib::rectangle(seed_boxes[i]));
+				}
+			}
+			auto seeded_fits = fitLandmarks(frame, boxes);
+			for (int i = 0; i < seeded.size(); ++i)
+			{
+				fits[seeded[i]] = std::move(seeded_fits[i]);
+			}
+		}
+
+		for (int i = 0; i < max_faces; ++i)
+		{
+			auto& track = m_tracks[i];
+			if (!fits[i].empty())
+			{
+				//The shape predictor has no confidence output. If the fitted landmarks drifted away from where they were expected,
+				//the track is lost. Against the unpadded box, the padded seed would cap the IoU of a perfect fit at 1 / (1 + 2p)^2.
+				auto landmark_box = getLandmarkBox(fits[i]);
+				tracked[i] = computeOverlap(landmark_box, predicted_boxes[i]) >= m_params.min_tracking_overlap;
+				if (tracked[i])
+				{
+					updateTrack(track, landmark_box);
+					track.last_landmarks = std::move(fits[i]);
+					track.frames_since_detection++;
+					track.frames_since_fit = 0;
+				}
+			}
+			any_lost |= track.active && !tracked[i];
+		}
+
+		m_frames_since_detection++;
+		if (any_lost || !any_active || (any_empty && m_frames_since_detection >= m_params.redetection_interval))
+		{
+			auto faces = detectFaces(frame, tracked);
+			m_frames_since_detection = 0;
+
+			util::ScopedTimer timer("Landmark fitting");
+			//Every face takes a slot until all are taken, the remaining ones aren't fitted.
+			const int free_slots = static_cast<int>(std::count(tracked.begin(), tracked.end(), false));
+			faces.resize(std::min(static_cast<int>(faces.size()), free_slots));
+			auto face_landmarks = fitLandmarks(frame, faces);
+
+			std::vector<bool> assigned = tracked;
+			for (auto& landmarks : face_landmarks)
+			{
+				auto landmark_box = getLandmarkBox(landmarks);
+
+				//The lost track that overlaps the most, otherwise the first empty slot.
+				int slot = -1;
+				double best_overlap = 0.0;
+				for (int i = 0; i < max_faces; ++i)
+				{
+					if (!assigned[i] && m_tracks[i].active)
+					{
+						const double overlap = computeOverlap(landmark_box, m_tracks[i].last_landmark_box);
+						if (overlap > best_overlap)
+						{
+							best_overlap = overlap;
+							slot = i;
+						}
+					}
+				}
+				for (int i = 0; i < max_faces && slot < 0; ++i)
+				{
+					if (!assigned[i] && !m_tracks[i].active)
+					{
+						slot = i;
+					}
+				}
+				//Lost tracks without overlap still take the remaining faces, e.g. after a fast movement.
+				for (int i = 0; i < max_faces && slot < 0; ++i)
+				{
+					if (!assigned[i])
+					{
+						slot = i;
+					}
+				}
+				if (slot < 0)
+				{
+					break;
+				}
+
+				auto& track = m_tracks[slot];
+				if (best_overlap == 0.0)
+				{
+					track.active = false; //a new face, no motion from the old box
+				}
+				updateTrack(track, landmark_box);
+				track.frames_since_detection = 0;
+				track.frames_since_fit = 0;
+				track.last_landmarks = std::move(landmarks);
+				assigned[slot] = true;
+			}
+
+			for (int i = 0; i < max_faces; ++i)
+			{
+				m_tracks[i].active = assigned[i];
+			}
+			tracked = assigned;
+		}
 
 		//const dlib::rgb_pixel color = dlib::rgb_pixel(0, 255, 0);
 		//std::vector<dlib::image_window::overlay_circle> circles;
 
-		auto frame_size = frame.size();
-		auto two_over_width = 2.0f / static_cast<float>(frame_size.width);
-		auto two_over_height = 2.0f / static_cast<float>(frame_size.height);
-		for (unsigned long i = 0; i < 60; ++i)
+		for (int f = 0; f < max_faces; ++f)
 		{
-			const dlib::point& point = shape.part(i);
-			//circles.emplace_back(point, 2, color);
-
-			//Normalize sparse feature positions such that left-bottom corner is (-1, -1) and top-right corner is (+1, +1).
-			//This is the OpenGL convention.
-			sparse_features.emplace_back(point.x() * two_over_width - 1.0f, 1.0f - point.y() * two_over_height);
+			if (tracked[f])
+			{
+				sparse_features[f] = toSparseFeatures(m_tracks[f].last_landmarks, frame.size());
+			}
 		}
 
 		//m_window.clear_overlay();
@@ -7,16 +7,119 @@
 #include <dlib/image_processing.h>
 #include <dlib/gui_widgets.h>
 #include <glm/glm.hpp>
+#include <memory>
 #include <vector>
 
+#include "landmark_detector.h"
+
+class LandmarkFlow;
+class ShapePredictorGpu;
+namespace util
+{
+	class ThreadPool;
+}
+
+struct TrackerParameters
+{
+	int landmark_backend = static_cast<int>(LandmarkBackend::Hog); //see LandmarkBackend, can be switched at runtime
+
+	//Seed the shape predictor with the landmark box of the previous frame instead of running the HOG detector.
+	bool use_tracking = true;
+	int redetection_interval = 10; //run the full detector at least every K frames
+	float box_padding = 0.1f; //relative to the box size, on each side
+	bool use_motion = true; //shift the seed box by the motion of the last frame
+	float min_tracking_overlap = 0.5f; //IoU between the predicted (unpadded) and the fitted landmark box, below that we re-detect
+
+	//The HOG detector runs on a downscaled image, its cost is proportional to the pixel count.
+	//Note that it doesn't find faces smaller than about 80x80 pixels in the downscaled image.
+	float detection_scale = 0.5f;
+	bool use_search_window = true; //only search around the last known face, falls back to the whole frame
+	float search_window_size = 2.0f; //relative to the last landmark box
+
+	//Between shape predictor fits, move the landmarks of the last frame with pyramidal Lucas-Kanade on the GPU, see LandmarkFlow.
+	//Only tracked faces use it, and it is also bounded by redetection_interval.
+	bool use_flow = false;
+	int flow_fit_interval = 5; //run the shape predictor at least every K frames
+	float max_flow_error = 12.0f; //mean absolute intensity difference of the landmark windows (0-255), above that the shape predictor runs
+
+	//Fit the landmarks with ShapePredictorGpu, one launch for all faces of a frame (or of all frames of
+	//detectSparseFeaturesOfFrames) instead of a dlib fit per face on the thread pool. The first fit is checked against dlib on
+	//the same boxes, further fits run on the host if they differ by more than a pixel.
+	bool use_gpu_shape_predictor = false;
+
+	//The shape predictor fits of the faces of a frame, and detectSparseFeaturesOfFrames, run on a pool of that many threads,
+	//including the caller. <= 0 uses all hardware threads.
+	int num_threads = 1;
+
+	//Number of faces tracked at the same time. With more than one the detector searches the full frame, for empty slots
+	//every redetection_interval frames.
+	int max_faces = 1;
+};
+
 class Tracker
 {
 public:
 	Tracker();
+	~Tracker();
+
+	//Starts loading the shape predictor in the background, e.g. while the window and the morphable model are set up.
+	//Trackers share it, the first fit starts loading it or waits for it.
+	static void preloadModels();
+
+	const LandmarkDetector& getLandmarkDetector() const { return *m_landmark_detector; }
+	//Landmarks of the first face slot, empty if it is not tracked.
 	std::vector<glm::vec2> getSparseFeatures(const cv::Mat& frame);
+	//One entry per face slot (max_faces), empty for slots without a face. A face keeps its slot while it is tracked.
+	std::vector<std::vector<glm::vec2>> getSparseFeaturesOfFaces(const cv::Mat& frame);
+	//Detects and fits the faces of every frame on its own, without the tracks, in parallel on the thread pool. E.g. for offline jobs.
+	//One entry per frame, it has up to max_faces faces, the largest first. The frames may have different sizes.
+	std::vector<std::vector<std::vector<glm::vec2>>> detectSparseFeaturesOfFrames(const std::vector<cv::Mat>& frames);
+	//Forgets all tracks, e.g. before another video. The next frame runs the full detector.
+	void reset();
+
+	TrackerParameters& getParameters() { return m_params; }
+	const TrackerParameters& getParameters() const { return m_params; }
+
+private:
+	struct Track
+	{
+		bool active = false;
+		int frames_since_detection = 0;
+		int frames_since_fit = 0; //of the shape predictor, the frames in between use the flow
+		dlib::drectangle last_landmark_box;
+		dlib::dpoint last_motion;
+		std::vector<glm::vec2> last_landmarks; //all parts, frame pixels
+	};
+
+	//Landmark box of the track in this frame, moved by the motion of the last frame.
+	dlib::drectangle predictLandmarkBox(const Track& track) const;
+	//The predicted landmark box padded by box_padding and clipped to the frame, the seed of the shape predictor.
+	dlib::drectangle predictFaceBox(const Track& track, const cv::Size& frame_size) const;
+	std::vector<dlib::rectangle> detectFaces(LandmarkDetector& detector, const cv::Mat& frame, const cv::Rect& search_window) const;
+	std::vector<dlib::rectangle> detectFaces(const cv::Mat& frame, const std::vector<bool>& tracked);
+	void updateTrack(Track& track, const dlib::drectangle& landmark_box);
+	bool propagateLandmarks(Track& track);
+	util::ThreadPool& getThreadPool();
+	//Waits for the shared shape predictor on the first call. Call it on the tracker's thread, not in the pool's tasks.
+	const dlib::shape_predictor& getPoseModel();
+	//All parts of the faces "boxes" of "frame", with the dlib shape predictor on the thread pool or on the GPU.
+	std::vector<std::vector<glm::vec2>> fitLandmarks(const cv::Mat& frame, const std::vector<dlib::rectangle>& boxes);
+	ShapePredictorGpu& getGpuPoseModel();
+	//Compares the first GPU fit with dlib's on the same boxes, and falls back to the host fit if they differ.
+	void validateGpuPoseModel(const cv::Mat& frame, const std::vector<dlib::rectangle>& boxes);
+	void updateLandmarkBackend();
 
 private:
-	dlib::frontal_face_detector m_detector = dlib::get_frontal_face_detector();
-	dlib::shape_predictor m_pose_model;
+	std::unique_ptr<LandmarkDetector> m_landmark_detector;
+	LandmarkBackend m_landmark_backend{ LandmarkBackend::Hog };
+	std::shared_ptr<const dlib::shape_predictor> m_pose_model; //null until the first fit, see getPoseModel
+	std::unique_ptr<ShapePredictorGpu> m_gpu_pose_model; //created by the first fit with use_gpu_shape_predictor
+	bool m_gpu_pose_model_validated{ false };
+	std::unique_ptr<util::ThreadPool> m_thread_pool; //see TrackerParameters::num_threads
+	std::vector<std::unique_ptr<LandmarkDetector>> m_thread_detectors; //HOG copies of the pool threads but the caller
+	TrackerParameters m_params;
+	std::vector<Track> m_tracks;
+	std::unique_ptr<LandmarkFlow> m_flow; //created with use_flow
+	int m_frames_since_detection{ 0 }; //of the full detector, for the empty slots
 	//dlib::image_window m_window;
 };
@@ -0,0 +1,330 @@
+#include "tracking_session.h"
+#include "glsl_program.h"
+#include "profiler.h"
+#include "device_allocator.h"
+#include "execution_context.h"
+#include "thread_placement.h"
+
+#include <glm/ext/matrix_clip_space.hpp>
+#include <algorithm>
+#include <chrono>
+#include "opencv2/imgproc/imgproc.hpp"
+
+static std::string getSessionLabel(int id)
+{
+	return "session=\"" + std::to_string(id) + "\"";
+}
+
+TrackingSession::TrackingSession(int id, const std::string& input_path, std::shared_ptr<FaceModel> model, const GLSLProgram* face_shader,
+	int number_of_pyramid_levels, const SolverParameters& solver_parameters, const TrackerParameters& tracker_parameters,
+	SessionKind kind)
+	: m_id(id)
+	, m_kind(kind)
+	, m_capture(input_path)
+	, m_face(std::move(model))
+	, m_face_shader(face_shader)
+	, m_pyramid(number_of_pyramid_levels, m_capture.get(cv::CAP_PROP_FRAME_WIDTH), m_capture.get(cv::CAP_PROP_FRAME_HEIGHT))
+	, m_solver(solver_parameters, std::make_shared<util::ExecutionContext>(util::getDefaultAllocator(),
+		kind == SessionKind::Live ? util::StreamPriority::High : util::StreamPriority::Low))
+	, m_frames_metric(util::Metrics::get().counter("session_frames_total", "Frames solved by a session.", getSessionLabel(id)))
+	, m_lost_metric(util::Metrics::get().counter("session_tracking_lost_total", "Frames which lost the face tracked in the previous one.", getSessionLabel(id)))
+	, m_gn_iterations_metric(util::Metrics::get().counter("session_gn_iterations_total", "Gauss-Newton iterations of a session.", getSessionLabel(id)))
+	, m_pcg_iterations_metric(util::Metrics::get().counter("session_pcg_iterations_total", "PCG iterations issued by a session.", getSessionLabel(id)))
+	, m_rejected_steps_metric(util::Metrics::get().counter("session_rejected_steps_total", "Levenberg-Marquardt steps which raised the energy.", getSessionLabel(id)))
+	, m_energy_metric(util::Metrics::get().gauge("session_final_energy", "Energy of the last accepted Levenberg-Marquardt step of the last frame.", getSessionLabel(id)))
+	, m_gpu_time_metric(util::Metrics::get().counter("session_gpu_microseconds_total", "GPU time of the frames of a session, including waits for other sessions.", getSessionLabel(id)))
+	, m_gpu_frame_metric(util::Metrics::get().histogram("session_gpu_frame_milliseconds", "GPU time of one frame of a session, including waits for other sessions.", getSessionLabel(id)))
+	, m_device_bytes_metric(util::Metrics::get().gauge("session_device_bytes", "Device arrays allocated by a session, without the shared model.", getSessionLabel(id)))
+	, m_peak_device_bytes_metric(util::Metrics::get().gauge("session_device_peak_bytes", "Peak of session_device_bytes.", getSessionLabel(id)))
+	, m_queue(2)
+{
+	CHECK_CUDA_ERROR(cudaEventCreate(&m_frame_start));
+	CHECK_CUDA_ERROR(cudaEventCreate(&m_frame_end));
+	if (!m_capture.isOpened())
+	{
+		throw std::runtime_error("Error: Could not open the input " + input_path);
+	}
+
+	m_tracker.getParameters() = tracker_parameters;
+	m_tracker.getParameters().max_faces = 1;
+	m_projection = glm::perspectiveRH_NO(glm::radians(60.0f), m_pyramid.getAspectRatio(), 0.01f, 10.0f);
+	m_face.getGraphicsSettings().shader = m_face_shader;
+	m_face.setExecutionContext(m_solver.getExecutionContext());
+	m_pyramid.setExecutionContext(m_solver.getExecutionContext());
+}
+
+TrackingSession::~TrackingSession()
+{
+	stop();
+	if (m_parameter_writer)
+	{
+		m_parameter_writer->close(m_face);
+	}
+	CHECK_CUDA_ERROR(cudaEventDestroy(m_frame_start));
+	CHECK_CUDA_ERROR(cudaEventDestroy(m_frame_end));
+}
+
+void TrackingSession::start()
+{
+	m_thread = std::thread([this]()
+	{
+		util::ThreadPlacement::get().apply(util::ThreadStage::Detection);
+		while (!m_stop)
+		{
+			Frame frame;
+			cv::Mat frame_half;
+			{
+				util::ScopedTimer timer("Capture");
+				if (!m_capture.read(frame.raw_frame))
+				{
+					break;
+				}
+				frame.capture_time = std::chrono::steady_clock::now();
+			}
+			{
+				util::ScopedTimer timer("pyrDown");
+				cv::pyrDown(frame.raw_frame, frame_half);
+			}
+			frame.sparse_features = m_tracker.getSparseFeatures(frame_half);
+			util::ScopedTimer timer("Session queue push");
+			if (!m_queue.push(std::move(frame), m_stop))
+			{
+				break;
+			}
+		}
+		m_input_ended = true;
+	});
+}
+
+void TrackingSession::stop()
+{
+	m_stop = true;
+	if (m_thread.joinable())
+	{
+		m_thread.join();
+	}
+}
+
+void TrackingSession::openParameterStream(const std::string& filepath, ParameterEncoding encoding)
+{
+	m_parameter_writer = std::make_unique<ParameterStreamWriter>(filepath, m_face, encoding);
+}
+
+void TrackingSession::collectGpuTime()
+{
+	if (!m_frame_pending)
+	{
+		return;
+	}
+	float milliseconds = 0.0f;
+	CHECK_CUDA_ERROR(cudaEventSynchronize(m_frame_end));
+	CHECK_CUDA_ERROR(cudaEventElapsedTime(&milliseconds, m_frame_start, m_frame_end));
+	m_gpu_ms += milliseconds;
+	m_gpu_time_metric.add(static_cast<uint64_t>(milliseconds * 1000.0f));
+	m_gpu_frame_metric.observe(milliseconds);
+	m_frame_pending = false;
+}
+
+size_t TrackingSession::getDeviceBytes() const
+{
+	return util::AllocationTracker::get().getOwnerStats(m_id).bytes_in_use;
+}
+
+size_t TrackingSession::getPeakDeviceBytes() const
+{
+	return util::AllocationTracker::get().getOwnerStats(m_id).peak_bytes_in_use;
+}
+
+void TrackingSession::solve(const Frame& frame)
+{
+	//Workspaces grow on demand, and a new resolution reallocates the pyramid.
+	util::ScopedAllocationOwner owner(m_id);
+	collectGpuTime();
+	const cudaStream_t stream = m_solver.getExecutionContext()->getComputeStream();
+	CHECK_CUDA_ERROR(cudaEventRecord(m_frame_start, stream));
+
+	//The face shader is shared, its projection is the one of the session drawing.
+	m_face_shader->use();
+	m_face_shader->setMat4("projection", m_projection);
+
+	//A stream which switches resolution (e.g. an adaptive network source) gets a pyramid of the new size, the focal length
+	//in x is kept.
+	if (frame.raw_frame.cols != m_pyramid.getWidth(0) || frame.raw_frame.rows != m_pyramid.getHeight(0))
+	{
+		m_pyramid.resize(frame.raw_frame.cols, frame.raw_frame.rows);
+		m_projection[1][1] = m_projection[0][0] * m_pyramid.getAspectRatio();
+		m_face_shader->setMat4("projection", m_projection);
+	}
+	m_pyramid.uploadFrame(frame.raw_frame);
+	{
+		util::ScopedTimer timer("Solve", true);
+		m_solver.solve(frame.sparse_features, m_face, m_projection, m_pyramid);
+	}
+
+	if (m_parameter_writer)
+	{
+		util::ScopedTimer timer("Parameter stream");
+		m_parameter_writer->write(m_face, m_projection, !frame.sparse_features.empty());
+	}
+	CHECK_CUDA_ERROR(cudaEventRecord(m_frame_end, stream));
+	m_frame_pending = true;
+	m_num_solved_frames++;
+
+	const bool tracked = !frame.sparse_features.empty();
+	const auto& statistics = m_solver.getStatistics();
+	m_frames_metric.add();
+	m_lost_metric.add(m_was_tracked && !tracked ? 1 : 0);
+	m_gn_iterations_metric.add(statistics.num_gn_iterations);
+	m_pcg_iterations_metric.add(statistics.num_pcg_iterations);
+	m_rejected_steps_metric.add(statistics.num_rejected_steps);
+	if (statistics.final_energy >= 0.0f)
+	{
+		m_energy_metric.set(statistics.final_energy);
+	}
+	const auto memory = util::AllocationTracker::get().getOwnerStats(m_id);
+	m_device_bytes_metric.set(static_cast<double>(memory.bytes_in_use));
+	m_peak_device_bytes_metric.set(static_cast<double>(memory.peak_bytes_in_use));
+	m_was_tracked = tracked;
+}
+
+bool SessionScheduler::solveNext(SessionKind kind)
+{
+	const int k = static_cast<int>(kind);
+	for (size_t i = 0; i < m_sessions.size(); ++i)
+	{
+		const size_t index = (m_next[k] + i) % m_sessions.size();
+		auto& session = *m_sessions[index];
+		TrackingSession::Frame frame;
+		if (session.getKind() != kind || !session.tryPopFrame(frame))
+		{
+			continue;
+		}
+
+		util::getFrameArena().beginFrame();
+		util::AllocationTracker::get().beginFrame();
+		util::Profiler::get().beginFrame();
+		{
+			util::ScopedTimer frame_timer("Frame");
+			session.solve(frame);
+		}
+		util::Profiler::get().endFrame();
+
+		if (kind == SessionKind::Live)
+		{
+			const float latency = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - frame.capture_time).count();
+			if (m_live_latencies.size() < static_cast<size_t>(std::max(m_settings.latency_window, 1)))
+			{
+				m_live_latencies.push_back(latency);
+			}
+			else
+			{
+				m_live_latencies[m_next_latency] = latency;
+			}
+			m_next_latency = (m_next_latency + 1) % std::max(m_settings.latency_window, 1);
+		}
+		m_next[k] = (index + 1) % m_sessions.size();
+		return true;
+	}
+	return false;
+}
+
+float SessionScheduler::getLiveLatencyP99() const
+{
+	if (m_live_latencies.empty())
+	{
+		return 0.0f;
+	}
+	std::vector<float> latencies = m_live_latencies;
+	const size_t n = (latencies.size() * 99) / 100;
+	std::nth_element(latencies.begin(), latencies.begin() + n, latencies.end());
+	return latencies[n];
+}
+
+void SessionScheduler::run(int max_frames)
+{
+	for (auto& session : m_sessions)
+	{
+		session->start();
+	}
+
+	auto& fps_metric = util::Metrics::get().gauge("server_fps", "Frames per second over all sessions since the start.");
+	auto& latency_metric = util::Metrics::get().gauge("server_live_latency_p99_ms", "p99 latency from the capture to the solve of the last live frames.");
+	auto& throttled_metric = util::Metrics::get().counter("server_offline_throttled_total", "Times the offline sessions were throttled for the live ones.");
+	int number_of_frames = 0;
+	auto start = std::chrono::high_resolution_clock::now();
+	auto last_offline = std::chrono::steady_clock::now();
+	bool throttled = false;
+	while (max_frames <= 0 || number_of_frames < max_frames)
+	{
+		//With hysteresis, so the offline sessions don't toggle every frame around the threshold.
+		const float p99 = getLiveLatencyP99();
+		if (!throttled && p99 > m_settings.throttle_fraction * m_settings.live_latency_budget_ms)
+		{
+			throttled = true;
+			throttled_metric.add();
+		}
+		else if (throttled && p99 < m_settings.resume_fraction * m_settings.live_latency_budget_ms)
+		{
+			throttled = false;
+		}
+
+		//A ready live frame always goes first. Round robin within the sessions of a kind, so a slow input doesn't hold the
+		//others back.
+		bool solved = solveNext(SessionKind::Live);
+		if (solved)
+		{
+			latency_metric.set(getLiveLatencyP99());
+		}
+		else
+		{
+			const auto now = std::chrono::steady_clock::now();
+			const bool offline_due = !throttled || (m_settings.throttled_offline_interval_ms > 0.0f &&
+				std::chrono::duration<float, std::milli>(now - last_offline).count() >= m_settings.throttled_offline_interval_ms);
+			if (offline_due && solveNext(SessionKind::Offline))
+			{
+				last_offline = now;
+				solved = true;
+			}
+		}
+
+		if (!solved)
+		{
+			if (std::all_of(m_sessions.begin(), m_sessions.end(), [](const std::unique_ptr<TrackingSession>& session) { return session->isFinished(); }))
+			{
+				break;
+			}
+			std::this_thread::yield();
+			continue;
+		}
+
+		if (++number_of_frames % 100 == 0)
+		{
+			auto now = std::chrono::high_resolution_clock::now();
+			auto seconds = std::chrono::duration_cast<std::chrono::milliseconds>(now - start).count() / 1000.0;
+			std::cout << number_of_frames << " frames of " << m_sessions.size() << " sessions, " << number_of_frames / seconds << " fps" << std::endl;
+			fps_metric.set(number_of_frames / seconds);
+		}
+	}
+
+	for (auto& session : m_sessions)
+	{
+		session->stop();
+	}
+	CHECK_CUDA_ERROR(cudaDeviceSynchronize());
+
+	auto end = std::chrono::high_resolution_clock::now();
+	auto seconds = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() / 1000.0;
+	double gpu_ms = 0.0;
+	for (auto& session : m_sessions)
+	{
+		session->collectGpuTime();
+		gpu_ms += session->getGpuMilliseconds();
+	}
+	std::cout << "Processed " << number_of_frames << " frames in " << seconds << " s, live p99 latency " << getLiveLatencyP99() << " ms" << std::endl;
+	for (auto& session : m_sessions)
+	{
+		std::cout << "  Session " << session->getId() << (session->getKind() == SessionKind::Live ? " (live)" : " (offline)") << ": "
+			<< session->getNumberOfSolvedFrames() << " frames, " << session->getNumberOfSolvedFrames() / seconds << " fps, "
+			<< session->getGpuMilliseconds() << " GPU ms (" << 100.0 * session->getGpuMilliseconds() / std::max(gpu_ms, 1e-3) << "%)" << std::endl;
+	}
+}
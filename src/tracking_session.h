@@ -0,0 +1,161 @@
+#pragma once
+
+#include "face.h"
+#include "tracker.h"
+#include "gauss_newton_solver.h"
+#include "pyramid.h"
+#include "parameter_stream.h"
+#include "spsc_queue.h"
+#include "metrics.h"
+
+#include <glm/glm.hpp>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "opencv2/highgui/highgui.hpp"
+
+class GLSLProgram;
+
+enum class SessionKind
+{
+	Live,		//a camera or stream, whose frames are solved first and on streams of high priority
+	Offline,	//e.g. a recording, which yields to the live sessions, see SchedulerSettings
+};
+
+//One input stream of the server mode. Owns everything that is per stream: the capture, the tracker, the coefficients and
+//vertex buffer of its Face, the frame pyramid with its render targets and a solver with its own execution context
+//(streams and library handles) and workspaces, shared with the face and the pyramid of the session.
+//The morphable model is shared with the other sessions, so an extra stream costs little more than its render targets.
+class TrackingSession
+{
+public:
+	struct Frame
+	{
+		cv::Mat raw_frame;
+		std::vector<glm::vec2> sparse_features;
+		std::chrono::steady_clock::time_point capture_time; //once it was read, for the latency
+	};
+
+	//Construct it in a util::ScopedAllocationOwner of "id", so the arrays of its members count as the session's, see getDeviceBytes.
+	TrackingSession(int id, const std::string& input_path, std::shared_ptr<FaceModel> model, const GLSLProgram* face_shader,
+		int number_of_pyramid_levels, const SolverParameters& solver_parameters, const TrackerParameters& tracker_parameters,
+		SessionKind kind = SessionKind::Live);
+	TrackingSession(TrackingSession&) = delete;
+	TrackingSession(TrackingSession&& rhs) = delete;
+	TrackingSession& operator=(TrackingSession&) = delete;
+	TrackingSession& operator=(TrackingSession&&) = delete;
+	~TrackingSession();
+
+	//Capture and landmark detection on a thread of the session, frames end up in a small queue.
+	void start();
+	void stop();
+	//False while the CPU side hasn't delivered a frame yet.
+	bool tryPopFrame(Frame& frame) { return m_queue.tryPop(frame); }
+	//The input ended and every frame of it was popped.
+	bool isFinished() const { return m_input_ended && m_queue.empty(); }
+
+	//Uploads the frame on the stream of the solver and solves it. Must be called on the thread which owns the GL context.
+	void solve(const Frame& frame);
+
+	//Writes the fitted parameters of every solved frame to "filepath".
+	void openParameterStream(const std::string& filepath, ParameterEncoding encoding);
+
+	int getId() const { return m_id; }
+	SessionKind getKind() const { return m_kind; }
+	int getNumberOfSolvedFrames() const { return m_num_solved_frames; }
+	//Summed over the solved frames, from the first to the last command of a frame on the compute stream of the session. It
+	//includes the time its work waited for that of other sessions. The frame of the last solve is only in it after
+	//collectGpuTime.
+	double getGpuMilliseconds() const { return m_gpu_ms; }
+	//Adds the GPU time of the last solved frame, waits for it. Also called by solve for the frame before.
+	void collectGpuTime();
+	//Device arrays of the session: the ones allocated while it was constructed and by its solves, see util::AllocationTracker.
+	//The shared morphable model and the GL render targets aren't in it. Together with getGpuMilliseconds this is what a
+	//stream of its resolution and parameters costs.
+	size_t getDeviceBytes() const;
+	size_t getPeakDeviceBytes() const;
+	SolverParameters& getSolverParameters() { return m_solver.getSolverParameters(); }
+	TrackerParameters& getTrackerParameters() { return m_tracker.getParameters(); }
+
+private:
+	int m_id;
+	SessionKind m_kind;
+	cv::VideoCapture m_capture;
+	Tracker m_tracker;
+	Face m_face;
+	glm::mat4 m_projection;
+	const GLSLProgram* m_face_shader;
+	Pyramid m_pyramid;
+	GaussNewtonSolver m_solver;
+	std::unique_ptr<ParameterStreamWriter> m_parameter_writer;
+	int m_num_solved_frames{ 0 };
+	bool m_was_tracked{ false };
+
+	//Labelled with the session id, see Metrics.
+	util::Counter& m_frames_metric;
+	util::Counter& m_lost_metric;
+	util::Counter& m_gn_iterations_metric;
+	util::Counter& m_pcg_iterations_metric;
+	util::Counter& m_rejected_steps_metric;
+	util::Gauge& m_energy_metric;
+	util::Counter& m_gpu_time_metric; //microseconds, see getGpuMilliseconds
+	util::Histogram& m_gpu_frame_metric; //milliseconds per frame
+	util::Gauge& m_device_bytes_metric; //see getDeviceBytes
+	util::Gauge& m_peak_device_bytes_metric;
+
+	cudaEvent_t m_frame_start;
+	cudaEvent_t m_frame_end;
+	bool m_frame_pending{ false };
+	double m_gpu_ms{ 0.0 };
+
+	util::SpscQueue<Frame> m_queue;
+	std::atomic<bool> m_stop{ false };
+	std::atomic<bool> m_input_ended{ false };
+	std::thread m_thread;
+};
+
+struct SchedulerSettings
+{
+	//Of a live frame, from its capture to the end of its solve. Offline sessions are throttled while the p99 latency of the
+	//last latency_window live frames is above throttle_fraction of the budget, until it fell below resume_fraction.
+	float live_latency_budget_ms = 33.0f;
+	float throttle_fraction = 0.8f;
+	float resume_fraction = 0.6f;
+	int latency_window = 120;
+	//While throttled, one offline frame is still solved this often, so the offline sessions aren't starved. <= 0: none.
+	float throttled_offline_interval_ms = 100.0f;
+};
+
+//Interleaves the sessions on the GPU. The CPU side (capture, landmarks) of every session runs on its own thread, the GL thread
+//solves whichever session has a frame ready, round robin. Each solver issues its work on its own stream, so the frame upload
+//and pyramid of one session overlap with the solve of another. Throughput grows with the number of sessions until the GPU
+//(or the GL thread issuing the solves) is saturated.
+//Live sessions come first: a ready live frame is always solved before an offline one, and their streams have the greatest
+//priority, so the GPU runs their kernels ahead of offline work still in flight. Offline sessions are throttled while the
+//live latency approaches its budget.
+class SessionScheduler
+{
+public:
+	explicit SessionScheduler(const SchedulerSettings& settings = SchedulerSettings()) : m_settings(settings) {}
+
+	void addSession(std::unique_ptr<TrackingSession> session) { m_sessions.push_back(std::move(session)); }
+
+	//Until every input ended, or "max_frames" frames (summed over all sessions) were solved, if it is > 0.
+	void run(int max_frames = 0);
+
+private:
+	//Solves the next ready session of "kind" after m_next[kind], round robin. False if none was ready.
+	bool solveNext(SessionKind kind);
+	//p99 of the last live latencies, 0 without any.
+	float getLiveLatencyP99() const;
+
+private:
+	SchedulerSettings m_settings;
+	std::vector<std::unique_ptr<TrackingSession>> m_sessions;
+	size_t m_next[2] = {};
+	std::vector<float> m_live_latencies; //ring of the last latency_window ones
+	size_t m_next_latency{ 0 };
+};
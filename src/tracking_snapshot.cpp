@@ -0,0 +1,225 @@
+#include "tracking_snapshot.h"
+#include "face.h"
+#include "gauss_newton_solver.h"
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+namespace
+{
+	//The landmarks come from the detector, not the model, so their count is bounded by what any landmark model produces.
+	constexpr size_t kMaxLandmarks = 1024;
+
+	template <typename T>
+	void writeValue(std::ofstream& file, const T& value)
+	{
+		file.write(reinterpret_cast<const char*>(&value), sizeof(T));
+	}
+
+	template <typename T>
+	void writeVector(std::ofstream& file, const std::vector<T>& values)
+	{
+		writeValue(file, static_cast<uint32_t>(values.size()));
+		file.write(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+	}
+
+	template <typename T>
+	void readValue(std::ifstream& file, T& value)
+	{
+		if (!file.read(reinterpret_cast<char*>(&value), sizeof(T)))
+		{
+			throw std::runtime_error("Error: The tracking snapshot is truncated!");
+		}
+	}
+
+	//"max_size" bounds the count from the file, so a corrupt snapshot can't request gigabytes before it is found to be truncated.
+	template <typename T>
+	void readVector(std::ifstream& file, std::vector<T>& values, size_t max_size, const char* name)
+	{
+		uint32_t size = 0;
+		readValue(file, size);
+		if (size > max_size)
+		{
+			throw std::runtime_error("Error: The tracking snapshot has " + std::to_string(size) + " " + name + " values, at most "
+				+ std::to_string(max_size) + " are expected!");
+		}
+		values.resize(size);
+		if (!file.read(reinterpret_cast<char*>(values.data()), size * sizeof(T)))
+		{
+			throw std::runtime_error("Error: The tracking snapshot is truncated!");
+		}
+	}
+
+	//The coefficients of the model stay, only their values come from the snapshot. "count" is the number of the model.
+	void readCoefficients(std::ifstream& file, std::vector<float>& coefficients, size_t count, const char* name)
+	{
+		readVector(file, coefficients, count, name);
+		if (coefficients.size() != count)
+		{
+			throw std::runtime_error("Error: The tracking snapshot has " + std::to_string(coefficients.size()) + " " + name + " coefficients, the model "
+				+ std::to_string(count) + "!");
+		}
+	}
+
+	void writeTemporalState(std::ofstream& file, const GaussNewtonSolver::TemporalState& state)
+	{
+		writeValue(file, state.rotation);
+		writeValue(file, state.translation);
+		writeVector(file, state.expression);
+	}
+
+	//The expression is empty before the first frame, so it may have fewer values than the model.
+	void readTemporalState(std::ifstream& file, GaussNewtonSolver::TemporalState& state, size_t num_expression_coefficients)
+	{
+		readValue(file, state.rotation);
+		readValue(file, state.translation);
+		readVector(file, state.expression, num_expression_coefficients, "expression");
+	}
+
+	//One entry of the snapshot, parsed completely before any of it reaches a face or the solver.
+	struct FaceEntry
+	{
+		std::vector<float> shape;
+		std::vector<float> albedo;
+		std::vector<float> expression;
+		std::vector<float> sh;
+		glm::vec3 rotation{ 0.0f };
+		glm::vec3 translation{ 0.0f };
+		glm::mat4 projection{ 1.0f };
+		int32_t active[3]{};
+		uint32_t identity_locked = 0;
+		GaussNewtonSolver::FaceState state;
+	};
+}
+
+void writeTrackingSnapshot(const std::string& filepath, const std::vector<const Face*>& faces, const std::vector<const glm::mat4*>& projections,
+	const GaussNewtonSolver& solver, uint32_t frame)
+{
+	const std::string temporary_path = util::getTemporaryPath(filepath);
+	{
+		std::ofstream file(temporary_path, std::ofstream::binary);
+		if (!file.is_open())
+		{
+			throw std::runtime_error("Error: Could not open " + temporary_path + " for writing!");
+		}
+
+		TrackingSnapshotHeader header;
+		header.num_faces = static_cast<uint32_t>(faces.size());
+		header.frame = frame;
+		writeValue(file, header);
+		for (size_t i = 0; i < faces.size(); ++i)
+		{
+			const Face& face = *faces[i];
+			writeVector(file, face.getShapeCoefficients());
+			writeVector(file, face.getAlbedoCoefficients());
+			writeVector(file, face.getExpressionCoefficients());
+			writeVector(file, face.getSHCoefficients());
+			writeValue(file, face.getRotationCoefficients());
+			writeValue(file, face.getTranslationCoefficients());
+			writeValue(file, *projections[i]);
+			const int32_t active[3] = { face.getNumActiveShapeCoefficients(), face.getNumActiveExpressionCoefficients(),
+				face.getNumActiveAlbedoCoefficients() };
+			writeValue(file, active);
+			writeValue(file, static_cast<uint32_t>(face.isIdentityLocked() ? 1 : 0));
+
+			const auto state = solver.getFaceState(static_cast<int>(i));
+			writeTemporalState(file, state.last_state);
+			writeTemporalState(file, state.velocity);
+			const int32_t counters[3] = { state.num_tracked_frames, state.num_calibration_frames, state.num_frames_since_keyframe };
+			writeValue(file, counters);
+			writeValue(file, state.keyframe_landmark_error);
+			writeValue(file, state.face_rect);
+			writeVector(file, state.landmark_filter.getValues());
+			writeVector(file, state.landmark_filter.getDerivatives());
+		}
+		if (!file)
+		{
+			throw std::runtime_error("Error: Could not write the tracking snapshot " + temporary_path);
+		}
+	}
+
+	if (!util::replaceFile(temporary_path, filepath))
+	{
+		throw std::runtime_error("Error: Could not replace the tracking snapshot " + filepath);
+	}
+}
+
+TrackingSnapshotHeader readTrackingSnapshot(const std::string& filepath, const std::vector<Face*>& faces, const std::vector<glm::mat4*>& projections,
+	GaussNewtonSolver& solver)
+{
+	std::ifstream file(filepath, std::ifstream::binary);
+	if (!file.is_open())
+	{
+		throw std::runtime_error("Error: Could not open the tracking snapshot " + filepath);
+	}
+
+	TrackingSnapshotHeader header;
+	readValue(file, header);
+	if (std::memcmp(header.magic, "FTSN", 4) != 0 || header.version != TrackingSnapshotHeader().version)
+	{
+		throw std::runtime_error("Error: " + filepath + " is not a tracking snapshot of version " + std::to_string(TrackingSnapshotHeader().version));
+	}
+
+	//A truncated or corrupt entry throws before anything was restored, the faces and the solver keep their state.
+	std::vector<FaceEntry> entries(std::min<size_t>(header.num_faces, faces.size()));
+	for (size_t i = 0; i < entries.size(); ++i)
+	{
+		const Face& face = *faces[i];
+		FaceEntry& entry = entries[i];
+		readCoefficients(file, entry.shape, face.getShapeCoefficients().size(), "shape");
+		readCoefficients(file, entry.albedo, face.getAlbedoCoefficients().size(), "albedo");
+		readCoefficients(file, entry.expression, face.getExpressionCoefficients().size(), "expression");
+		readCoefficients(file, entry.sh, face.getSHCoefficients().size(), "SH");
+		readValue(file, entry.rotation);
+		readValue(file, entry.translation);
+		readValue(file, entry.projection);
+		readValue(file, entry.active);
+		readValue(file, entry.identity_locked);
+
+		GaussNewtonSolver::FaceState& state = entry.state;
+		readTemporalState(file, state.last_state, entry.expression.size());
+		readTemporalState(file, state.velocity, entry.expression.size());
+		int32_t counters[3];
+		readValue(file, counters);
+		state.num_tracked_frames = counters[0];
+		state.num_calibration_frames = counters[1];
+		state.num_frames_since_keyframe = counters[2];
+		readValue(file, state.keyframe_landmark_error);
+		readValue(file, state.face_rect);
+		std::vector<glm::vec2> values;
+		std::vector<glm::vec2> derivatives;
+		readVector(file, values, kMaxLandmarks, "landmark");
+		readVector(file, derivatives, kMaxLandmarks, "landmark");
+		state.landmark_filter.restore(values, derivatives);
+	}
+
+	for (size_t i = 0; i < entries.size(); ++i)
+	{
+		Face& face = *faces[i];
+		FaceEntry& entry = entries[i];
+		face.getShapeCoefficients() = std::move(entry.shape);
+		face.getAlbedoCoefficients() = std::move(entry.albedo);
+		face.getExpressionCoefficients() = std::move(entry.expression);
+		face.getSHCoefficients() = std::move(entry.sh);
+		face.getRotationCoefficients() = entry.rotation;
+		face.getTranslationCoefficients() = entry.translation;
+		*projections[i] = entry.projection;
+		solver.setFaceState(entry.state, static_cast<int>(i));
+
+		//The locked identity is baked with the counts it was locked with, the next solve sets its own again.
+		face.setActiveCoefficients(entry.active[0], entry.active[1], entry.active[2]);
+		if (entry.identity_locked != 0)
+		{
+			face.lockIdentity();
+		}
+		else
+		{
+			face.unlockIdentity();
+		}
+		face.invalidateFace();
+	}
+	return header;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+
+class Face;
+class GaussNewtonSolver;
+
+//Tracking state of a run, so a restarted tracker continues where the last one stopped instead of converging again from the
+//mean face. A header, followed by one entry per face: its coefficients and pose, the intrinsics of its projection, whether its
+//identity is locked, and the state the solver keeps between frames (see GaussNewtonSolver::FaceState). Little endian, the
+//vectors are stored as a uint32 count followed by the values.
+struct TrackingSnapshotHeader
+{
+	char magic[4]{ 'F', 'T', 'S', 'N' };
+	uint32_t version = 1;
+	uint32_t num_faces = 0;
+	uint32_t frame = 0; //frames tracked when the snapshot was taken, for the log
+};
+
+//Entry i belongs to faces[i], projections[i] and face i of the solver (see GaussNewtonSolver::solveBatch). The host coefficients
+//of the faces have to be up to date, as they are once solve returned. Written to filepath + ".tmp" first and renamed, so a crash
+//while writing leaves the last snapshot intact.
+void writeTrackingSnapshot(const std::string& filepath, const std::vector<const Face*>& faces, const std::vector<const glm::mat4*>& projections,
+	const GaussNewtonSolver& solver, uint32_t frame = 0);
+
+//Restores the faces, their projections and the solver before the first frame, the next solve continues from the snapshot.
+//Faces beyond the entries of the snapshot keep their state, entries beyond the faces are skipped. Throws, if "filepath" can't
+//be read, isn't a snapshot of this version, is truncated or has counts which don't match the model of a face. All entries are
+//parsed before the first is restored, so the faces and the solver are left as they were when it throws. Returns the header.
+TrackingSnapshotHeader readTrackingSnapshot(const std::string& filepath, const std::vector<Face*>& faces, const std::vector<glm::mat4*>& projections,
+	GaussNewtonSolver& solver);
@@ -0,0 +1,30 @@
+#include "video_writer.h"
+#include "async_video_writer.h"
+#include "nvenc_video_writer.h"
+
+#include <exception>
+#include <iostream>
+
+namespace util
+{
+	std::unique_ptr<VideoWriter> createVideoWriter(const std::string& filepath, VideoCodec codec, double fps, int width, int height, bool lossless)
+	{
+		if (codec != VideoCodec::Mjpeg)
+		{
+			//The library may load on a GPU without an NVENC engine, or the session may fail to open, e.g. with all sessions in use.
+			if (NvencVideoWriter::isAvailable())
+			{
+				try
+				{
+					return std::make_unique<NvencVideoWriter>(filepath, codec, fps, width, height, lossless);
+				}
+				catch (const std::exception& e)
+				{
+					std::cout << e.what() << std::endl;
+				}
+			}
+			std::cout << "Warning: NVENC is not available, writing MJPG instead!" << std::endl;
+		}
+		return std::make_unique<AsyncVideoWriter>(filepath, cv::VideoWriter::fourcc('M', 'J', 'P', 'G'), fps, width, height, lossless);
+	}
+}
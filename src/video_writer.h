@@ -0,0 +1,37 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <cuda_runtime.h>
+#include "opencv2/core/core.hpp"
+
+namespace util
+{
+	enum class VideoCodec
+	{
+		Mjpeg = 0,	//OpenCV VideoWriter on the CPU
+		H264 = 1,	//NVENC, raw Annex B elementary stream
+		Hevc = 2,	//NVENC, raw Annex B elementary stream
+	};
+
+	//Consumes the composited overlay frames. Implementations read back and encode asynchronously. If the encoder is behind,
+	//enqueue drops the frame instead of waiting, unless the writer is lossless, as for offline output.
+	class VideoWriter
+	{
+	public:
+		virtual ~VideoWriter() = default;
+
+		virtual bool isOpened() const = 0;
+
+		//"resource" is a CUDA registered RGBA8 GL texture of the size of the video. The GL commands rendering it
+		//have to be issued already, mapping the resource orders the copy after them. False, if the frame has been dropped.
+		virtual bool enqueue(cudaGraphicsResource_t resource) = 0;
+		//Same for a frame which is on the host already (CV_8UC4).
+		virtual bool enqueue(const cv::Mat& frame) = 0;
+
+		virtual int getNumberOfDroppedFrames() const = 0;
+	};
+
+	//Falls back to Mjpeg with a warning, if NVENC isn't available. A lossless writer waits for the encoder instead of dropping frames.
+	std::unique_ptr<VideoWriter> createVideoWriter(const std::string& filepath, VideoCodec codec, double fps, int width, int height, bool lossless);
+}
@@ -3,6 +3,7 @@
 #include "window.h"
 #include "util.h"
 
+#include <algorithm>
 #include <cassert>
 
 #include <glad/glad.h>
@@ -11,7 +12,7 @@
 #include <imgui_impl_opengl3.h>
 #include <imgui_impl_glfw.h>
 
-Window::Window(int gui_width, int screen_width, int screen_height)
+Window::Window(int gui_width, int screen_width, int screen_height, bool visible)
 	: m_gui_width(gui_width)
 	, m_screen_width(screen_width)
 	, m_screen_height(screen_height)
@@ -27,6 +28,7 @@ Window::Window(int gui_width, int screen_width, int screen_height)
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 5);
 	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 	glfwWindowHint(GLFW_RESIZABLE, GL_FALSE);
+	glfwWindowHint(GLFW_VISIBLE, visible ? GLFW_TRUE : GLFW_FALSE);
 
 	m_window = glfwCreateWindow(m_screen_width + m_gui_width, m_screen_height, "Face2Face", nullptr, nullptr);
 
@@ -35,6 +37,7 @@ Window::Window(int gui_width, int screen_width, int screen_height)
 		throw std::runtime_error("GLFW could not create the window");
 	}
 	glfwMakeContextCurrent(m_window);
+	setSwapInterval(visible ? 1 : 0);
 
 	//Initialize GLAD
 	if (!gladLoadGL())
@@ -71,6 +74,12 @@ void Window::refresh()
 	glClear(GL_COLOR_BUFFER_BIT);
 }
 
+void Window::setSwapInterval(int interval)
+{
+	m_swap_interval = std::max(interval, 0);
+	glfwSwapInterval(m_swap_interval);
+}
+
 bool Window::queryKey(int key, int condition) const
 {
 	return glfwGetKey(m_window, key) == condition;
@@ -13,7 +13,8 @@ class Window
 {
 public:
 	//Non-movable and non-copyable
-	Window(int gui_width, int screen_width, int screen_height);
+	//An invisible window only provides the GL context, e.g. for offscreen batch processing. It doesn't wait for vsync.
+	Window(int gui_width, int screen_width, int screen_height, bool visible = true);
 	Window(const Window&) = delete;
 	Window(Window&&) = delete;
 	Window& operator=(const Window&) = delete;
@@ -21,6 +22,9 @@ public:
 	~Window();
 
 	void refresh();
+	//glfwSwapInterval, 0 never waits for vsync in refresh. Visible windows start with 1.
+	void setSwapInterval(int interval);
+	int getSwapInterval() const { return m_swap_interval; }
 	bool queryKey(int key, int condition) const;
 	void setWindowTitle(const std::string& title) const;
 	void getCursorPosition(double& x, double& y) const;
@@ -36,4 +40,5 @@ private:
 	const int m_screen_width;
 	const int m_screen_height;
 	const int m_gui_width;
+	int m_swap_interval{ 1 };
 };
\ No newline at end of file